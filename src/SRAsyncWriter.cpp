@@ -0,0 +1,386 @@
+#include "SRAsyncWriter.h"
+#include "SRLog.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <malloc.h>
+#else
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+extern "C"
+{
+#include "libavutil/error.h"
+#include "libavutil/mem.h"
+}
+
+static uint8_t *alignedAlloc(size_t size) {
+#ifdef _WIN32
+    return (uint8_t *) _aligned_malloc(size, ASYNC_ALIGNMENT);
+#else
+    void *ptr = nullptr;
+    return posix_memalign(&ptr, ASYNC_ALIGNMENT, size) ? nullptr : (uint8_t *) ptr;
+#endif
+}
+
+static void alignedFree(uint8_t *ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    std::free(ptr);
+#endif
+}
+
+SRAsyncWriter::SRAsyncWriter(): fd(-1), directFd(-1), io(nullptr), ioBuffer(nullptr), current({nullptr, 0, 0}),
+                                extent(0), spillLimit(0), closing(false), error(0), queuedBytes(0),
+                                counters({0, 0, 0, 0, 0, 0, 0, 0}), prefix(0) {}
+
+SRAsyncWriter::~SRAsyncWriter() {
+    close();
+    for (uint8_t *buf : buffers)
+        alignedFree(buf);
+}
+
+/**
+ * open() creates the file, the write buffers and the writer thread; after close(), the next file
+ * @param direct bypass the page cache for the full buffers, Linux only
+ * @param ioSize bytes of the AVIOContext buffer: libavformat calls writePacket() once it is full
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int SRAsyncWriter::open(const char *path, bool direct, int ioSize) {
+#ifdef _WIN32
+    fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0)
+        return AVERROR(errno);
+    prefix = 0;
+    this->path = path;
+    if (manifest)
+        manifest->reset();
+    if (cipher) {
+        //a new nonce for each file: the same key never encrypts two contents with the same keystream
+        std::vector<uint8_t> header(CIPHER_HEADER_SIZE);
+        cipher->restart(header.data());
+#ifdef _WIN32
+        bool written = _write(fd, header.data(), CIPHER_HEADER_SIZE) == CIPHER_HEADER_SIZE;
+#else
+        bool written = pwrite(fd, header.data(), CIPHER_HEADER_SIZE, 0) == CIPHER_HEADER_SIZE;
+#endif
+        if (!written)
+            return AVERROR(errno ? errno : EIO);
+        prefix = CIPHER_HEADER_SIZE;
+        if (manifest)
+            manifest->update(0, header.data(), header.size());
+    }
+#ifdef O_DIRECT
+    if (direct)
+        directFd = ::open(path, O_WRONLY | O_DIRECT);
+#else
+    (void) direct;
+#endif
+
+    //a closed writer opens the next file with its buffers, its statistics go on
+    if (buffers.empty()) {
+        for (int i = 0; i < ASYNC_BUFFER_COUNT; i++) {
+            uint8_t *buf = alignedAlloc(ASYNC_BUFFER_SIZE);
+            if (!buf)
+                return AVERROR(ENOMEM);
+            buffers.push_back(buf);
+            spare.push_back(buf);
+        }
+        opened = std::chrono::steady_clock::now();
+    }
+    current = {nullptr, 0, 0};
+    extent = 0;
+    closing = false;
+    error = 0;
+
+    ioBuffer = (uint8_t *) av_malloc(ioSize);
+    if (!ioBuffer)
+        return AVERROR(ENOMEM);
+    io = avio_alloc_context(ioBuffer, ioSize, 1, this, nullptr, writePacket, seek);
+    if (!io) {
+        av_freep(&ioBuffer);
+        return AVERROR(ENOMEM);
+    }
+    io->seekable = AVIO_SEEKABLE_NORMAL;
+
+    writer = std::thread(&SRAsyncWriter::run, this);
+    return 0;
+}
+
+AVIOContext *SRAsyncWriter::avio() const {
+    return io;
+}
+
+/**
+ * close() flushes what libavformat left in the buffers, waits for the writer thread and closes the file,
+ * then writes its manifest with writeManifest()
+ * @return 0, or the first write error
+ */
+int SRAsyncWriter::close() {
+    if (io) {
+        avio_flush(io);
+        if (current.size > 0)
+            submit();
+        av_freep(&io->buffer);
+        avio_context_free(&io);
+    }
+    if (writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            closing = true;
+        }
+        cv.notify_all();
+        writer.join();
+    }
+    if (current.data) {
+        spare.push_back(current.data);
+        current.data = nullptr;
+    }
+    if (directFd >= 0) {
+        ::close(directFd);
+        directFd = -1;
+    }
+    if (fd >= 0) {
+#ifdef _WIN32
+        _close(fd);
+#else
+        ::close(fd);
+#endif
+        fd = -1;
+        //the stale chunks are read back once the file is complete
+        if (manifest && !error && manifest->finish(path.c_str(), manifestKey) < 0)
+            srLog(SR_LOG_ERROR, "[SRAsyncWriter] no manifest for %s", path.c_str());
+    }
+    return error;
+}
+
+/**
+ * sync() waits until everything written so far is in the file, for the code reading it back while it is open
+ * @return 0, or the first write error
+ */
+int SRAsyncWriter::sync() {
+    if (io)
+        avio_flush(io);
+    if (current.size > 0)
+        submit();
+    std::unique_lock<std::mutex> guard(lock);
+    size_t owned = current.data ? 1 : 0;
+    cv.wait(guard, [&](){return (filled.empty() && spare.size() + owned == buffers.size()) || error;});
+    return error;
+}
+
+SRWriterStats SRAsyncWriter::stats() {
+    std::lock_guard<std::mutex> guard(lock);
+    return counters;
+}
+
+/**
+ * acquire() gives the muxer a free buffer: a new one within the spill limit when all of them are in flight,
+ * otherwise it waits for the writer thread
+ * @return 0, or the write error that stopped the writer
+ */
+int SRAsyncWriter::acquire() {
+    std::unique_lock<std::mutex> guard(lock);
+    if (spare.empty() && !error &&
+        (int64_t) (buffers.size() + 1 - ASYNC_BUFFER_COUNT) * ASYNC_BUFFER_SIZE <= spillLimit) {
+        uint8_t *buf = alignedAlloc(ASYNC_BUFFER_SIZE);
+        if (buf) {
+            buffers.push_back(buf);
+            spare.push_back(buf);
+            counters.spills++;
+        }
+    }
+    if (spare.empty() && !error) {
+        auto start = std::chrono::steady_clock::now();
+        counters.stalls++;
+        cv.wait(guard, [this](){return !spare.empty() || error;});
+        counters.stallTime += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+    if (error)
+        return error;
+    current.data = spare.back();
+    spare.pop_back();
+    current.size = 0;
+    return 0;
+}
+
+/**
+ * submit() hands the current buffer to the writer thread, the next one starts where it ends
+ */
+void SRAsyncWriter::submit() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        filled.push_back(current);
+        int64_t queued = queuedBytes.fetch_add((int64_t) current.size, std::memory_order_relaxed) + (int64_t) current.size;
+        counters.peakBacklog = std::max(counters.peakBacklog, queued);
+    }
+    cv.notify_all();
+    current = {nullptr, 0, current.offset + (int64_t) current.size};
+}
+
+int SRAsyncWriter::writePacket(void *opaque, uint8_t *buf, int size) {
+    SRAsyncWriter *w = (SRAsyncWriter *) opaque;
+    int left = size;
+    while (left > 0) {
+        int ret;
+        if (!w->current.data && (ret = w->acquire()) < 0)
+            return ret;
+        size_t n = std::min((size_t) left, (size_t) ASYNC_BUFFER_SIZE - w->current.size);
+        memcpy(w->current.data + w->current.size, buf, n);
+        w->current.size += n;
+        buf += n;
+        left -= (int) n;
+        w->extent = std::max(w->extent, w->current.offset + (int64_t) w->current.size);
+        if (w->current.size == ASYNC_BUFFER_SIZE)
+            w->submit();
+    }
+    return size;
+}
+
+int64_t SRAsyncWriter::seek(void *opaque, int64_t offset, int whence) {
+    SRAsyncWriter *w = (SRAsyncWriter *) opaque;
+    int64_t position = w->current.offset + (int64_t) w->current.size;
+
+    if (whence == AVSEEK_SIZE)
+        return w->extent;
+    switch (whence & ~AVSEEK_FORCE) {
+        case SEEK_SET: break;
+        case SEEK_CUR: offset += position; break;
+        case SEEK_END: offset += w->extent; break;
+        default: return AVERROR(EINVAL);
+    }
+    if (offset < 0)
+        return AVERROR(EINVAL);
+    //the bytes before the seek are written at their own offset, the buffer restarts at the new one
+    if (w->current.size > 0)
+        w->submit();
+    w->current.offset = offset;
+    return offset;
+}
+
+/**
+ * writeAt() writes count buffers that follow each other in the file, in one pwritev() unless it comes back short,
+ * on the direct descriptor when they are all aligned
+ * @param syscalls incremented for each system call
+ * @return 0, or a negative AVERROR
+ */
+int SRAsyncWriter::writeAt(const SRWriteBuffer *bufs, int count, uint64_t &syscalls) {
+#ifdef _WIN32
+    for (int i = 0; i < count; i++) {
+        size_t done = 0;
+        const SRWriteBuffer &buf = bufs[i];
+        while (done < buf.size) {
+            syscalls++;
+            if (_lseeki64(fd, prefix + buf.offset + done, SEEK_SET) < 0)
+                return AVERROR(errno);
+            int n = _write(fd, buf.data + done, (unsigned int) (buf.size - done));
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return AVERROR(errno);
+            }
+            done += n;
+        }
+    }
+    return 0;
+#else
+    struct iovec iov[ASYNC_MAX_GATHER];
+    bool direct = directFd >= 0 && bufs[0].offset % ASYNC_ALIGNMENT == 0;
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = bufs[i].data;
+        iov[i].iov_len = bufs[i].size;
+        direct = direct && bufs[i].size % ASYNC_ALIGNMENT == 0;
+    }
+    int64_t offset = prefix + bufs[0].offset;
+    int first = 0;
+    while (first < count) {
+        syscalls++;
+        ssize_t n = pwritev(direct ? directFd : fd, iov + first, count - first, offset);
+        if (n < 0 && direct && errno == EINVAL) {
+            //the file system refuses direct I/O: keep going through the page cache
+            direct = false;
+            continue;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        //skip what went out, a short write resumes inside its buffer
+        offset += n;
+        while (first < count && (size_t) n >= iov[first].iov_len)
+            n -= iov[first++].iov_len;
+        if (first < count) {
+            iov[first].iov_base = (uint8_t *) iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+    return 0;
+#endif
+}
+
+/**
+ * run() is the writer thread: it writes the filled buffers in order and gives them back to the muxer,
+ * the ones queued at contiguous offsets together
+ */
+void SRAsyncWriter::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    SRWriteBuffer batch[ASYNC_MAX_GATHER];
+    while (true) {
+        cv.wait(guard, [this](){return !filled.empty() || closing;});
+        if (filled.empty())
+            break;
+        int count = 0;
+        do {
+            batch[count++] = filled.front();
+            filled.pop_front();
+        } while (count < ASYNC_MAX_GATHER && !filled.empty() &&
+                 filled.front().offset == batch[count - 1].offset + (int64_t) batch[count - 1].size);
+
+        guard.unlock();
+        //the manifest hashes the bytes on the disk, encrypted or not
+        for (int i = 0; i < count && !error; i++) {
+            if (cipher)
+                cipher->apply(batch[i].data, batch[i].size, batch[i].offset);
+            if (manifest)
+                manifest->update(prefix + batch[i].offset, batch[i].data, batch[i].size);
+        }
+        uint64_t syscalls = 0;
+        int ret = error ? 0 : writeAt(batch, count, syscalls);
+        guard.lock();
+
+        if (ret < 0 && !error)
+            error = ret;
+        for (int i = 0; i < count; i++) {
+            counters.bytes += batch[i].size;
+            queuedBytes.fetch_sub((int64_t) batch[i].size, std::memory_order_relaxed);
+            spare.push_back(batch[i].data);
+        }
+        //caught up: the spilled buffers go back to the system
+        while (filled.empty() && (int) buffers.size() > ASYNC_BUFFER_COUNT && !spare.empty()) {
+            uint8_t *buf = spare.back();
+            spare.pop_back();
+            buffers.erase(std::find(buffers.begin(), buffers.end(), buf));
+            alignedFree(buf);
+        }
+        counters.writes += count;
+        counters.syscalls += syscalls;
+        counters.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - opened).count();
+        cv.notify_all();
+    }
+}
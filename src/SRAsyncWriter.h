@@ -0,0 +1,161 @@
+//
+// Output file written by its own thread through large aligned buffers, plugged into libavformat as a custom AVIOContext.
+//
+
+#ifndef CPPSCREENRECORDER_SRASYNCWRITER_H
+#define CPPSCREENRECORDER_SRASYNCWRITER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SRCipher.h"
+#include "SRManifest.h"
+
+extern "C"
+{
+#include "libavformat/avio.h"
+}
+
+#define ASYNC_BUFFER_SIZE (4 << 20)   //bytes of each write buffer
+#define ASYNC_BUFFER_COUNT 2    //buffers: one filled by the muxer while the other is written
+#define ASYNC_ALIGNMENT 4096    //alignment of the buffers and of the O_DIRECT writes
+#define ASYNC_IO_SIZE (64 << 10)   //default bytes of the AVIOContext buffer in front of the write buffers
+#define ASYNC_MAX_GATHER 16     //contiguous buffers one pwritev() may write
+
+/**
+ * Statistics of an SRAsyncWriter: writes counts the buffers, syscalls the write system calls they took
+ * (fewer when contiguous buffers are gathered in one pwritev(), more on short writes).
+ * stalls counts the times the muxer found every buffer still being written, stallTime is the total time it waited, in us.
+ */
+typedef struct K{
+    uint64_t bytes;
+    uint64_t writes;
+    uint64_t syscalls;
+    uint64_t stalls;
+    int64_t stallTime;
+    int64_t elapsed;    //us from open() to the last write, syscalls / elapsed is the write rate
+    uint64_t spills;    //buffers allocated past ASYNC_BUFFER_COUNT while the storage was behind
+    int64_t peakBacklog;    //most bytes waiting for the writer thread at once
+}SRWriterStats;
+
+/**
+ * SRAsyncWriter moves the file writes off the MuxerThread.\n
+ * libavformat writes into the AVIOContext returned by avio(), its packets are copied into ASYNC_BUFFER_SIZE buffers
+ * and each full buffer is written at its file offset by the writer thread, so the muxer only waits when the disk
+ * is slower than the encoders for longer than ASYNC_BUFFER_COUNT buffers.
+ * Seeks (the MP4 header updates) just start a new buffer at the new offset.
+ * The buffers waiting in a row at contiguous offsets are written by one pwritev().\n
+ * When the storage slows down (network shares, USB drives) and every buffer is in flight, the muxer gets a new
+ * one, up to setSpillLimit() bytes of them: the packets are staged in memory, not held in the pipeline,
+ * and the extra buffers are freed once the writer has caught up.\n
+ * With direct I/O (Linux only) the full, aligned buffers bypass the page cache; the short writes go through it.\n
+ * With encrypt(), the writer thread encrypts each buffer in place at its offset just before writing it, see SRCipher:
+ * the muxer never waits for the cipher and the file is written once.
+ * With writeManifest(), the same thread hashes each buffer as written, see SRManifest, and close() writes the manifest.
+ */
+class SRAsyncWriter {
+
+private:
+    typedef struct B{
+        uint8_t *data;
+        size_t size;
+        int64_t offset;
+    }SRWriteBuffer;
+
+    int fd;
+    int directFd;
+    AVIOContext *io;
+    uint8_t *ioBuffer;
+
+    std::vector<uint8_t *> buffers;
+    SRWriteBuffer current;      //MuxerThread only
+    int64_t extent;             //MuxerThread only, highest offset written
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<SRWriteBuffer> filled;
+    std::vector<uint8_t *> spare;
+    int64_t spillLimit;
+    bool closing;
+    std::atomic<int> error;
+    std::atomic<int64_t> queuedBytes;   //bytes of filled, read without the lock by backlog()
+    SRWriterStats counters;
+    std::thread writer;
+    std::chrono::steady_clock::time_point opened;
+    std::unique_ptr<SRCipher> cipher;
+    int64_t prefix;     //bytes of the cipher header in front of the content
+    std::unique_ptr<SRManifest> manifest;
+    std::vector<uint8_t> manifestKey;
+    std::string path;
+
+    void run();
+    int acquire();
+    void submit();
+    int writeAt(const SRWriteBuffer *bufs, int count, uint64_t &syscalls);
+
+    static int writePacket(void *opaque, uint8_t *buf, int size);
+    static int64_t seek(void *opaque, int64_t offset, int whence);
+
+public:
+    SRAsyncWriter();
+    ~SRAsyncWriter();
+
+    SRAsyncWriter(const SRAsyncWriter&) = delete;
+    SRAsyncWriter &operator=(const SRAsyncWriter&) = delete;
+
+    int open(const char *path, bool direct, int ioSize = ASYNC_IO_SIZE);
+
+    /**
+     * encrypt() encrypts the files opened from now on with key, the writer must be closed
+     */
+    void encrypt(const uint8_t key[CIPHER_KEY_SIZE]) { cipher.reset(new SRCipher(key)); }
+
+    /**
+     * cipherName() is the kernel encrypting the files, nullptr when they are written in the clear
+     */
+    const char *cipherName() const { return cipher ? cipher->name() : nullptr; }
+
+    /**
+     * writeManifest() hashes the files opened from now on and writes their manifest on close, signed with key
+     * unless it is empty; the writer must be closed
+     */
+    void writeManifest(const std::vector<uint8_t> &key) { manifest.reset(new SRManifest()); manifestKey = key; }
+
+    /**
+     * manifestStats() are those of the manifest of the last file closed
+     */
+    SRManifestStats manifestStats() const { return manifest ? manifest->stats() : SRManifestStats(); }
+    int sync();
+    int close();
+
+    AVIOContext *avio() const;
+    SRWriterStats stats();
+
+    /**
+     * setSpillLimit() bounds the memory of the buffers allocated past ASYNC_BUFFER_COUNT, 0 makes the muxer wait
+     */
+    void setSpillLimit(int64_t bytes) { spillLimit = bytes; }
+
+    /**
+     * backlog() are the bytes written by the muxer the storage has not taken yet, cheap enough for every packet
+     */
+    int64_t backlog() const { return queuedBytes.load(std::memory_order_relaxed); }
+
+    /**
+     * failure() is the write error that stopped the writer (AVERROR(ENOSPC) for a full disk), 0 while it writes
+     */
+    int failure() const { return error.load(std::memory_order_relaxed); }
+
+    static int64_t reservedBytes(int ioSize = ASYNC_IO_SIZE, int64_t spill = 0) {
+        return (int64_t) ASYNC_BUFFER_SIZE * ASYNC_BUFFER_COUNT + ioSize + spill;
+    }
+};
+
+#endif //CPPSCREENRECORDER_SRASYNCWRITER_H
@@ -0,0 +1,149 @@
+//
+// Sample format conversion of the captured audio, in place of the resampler when the rate and the channels match.
+//
+
+#include "SRAudioConvert.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SR_HAVE_SSE2 1
+#endif
+
+extern "C"
+{
+#include "libavutil/common.h"
+}
+
+#define S16_SCALE (1.0f / 32768.0f)
+
+static void s16ToFloat(const int16_t *in, float *out, size_t count) {
+    size_t i = 0;
+#ifdef SR_HAVE_SSE2
+    const __m128 scale = _mm_set1_ps(S16_SCALE);
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+        //sign extended to 32 bits: the 16 bits in the high half, shifted back down
+        __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = in[i] * S16_SCALE;
+}
+
+static inline int16_t floatSample(float v) {
+    return (int16_t) lrintf(av_clipf(v * 32768.0f, -32768.0f, 32767.0f));
+}
+
+static void floatToS16(const float *in, int16_t *out, size_t count) {
+    size_t i = 0;
+#ifdef SR_HAVE_SSE2
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    for (; i + 8 <= count; i += 8) {
+        //rounded to nearest, then packed with signed saturation: +1.0 gives 32767 as the clip of swr does
+        __m128i low = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i), scale));
+        __m128i high = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_packs_epi32(low, high));
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = floatSample(in[i]);
+}
+
+/* interleaved stereo S16 into two float planes, the capture format of the back-ends into the one of AAC */
+static void s16StereoToFloatPlanes(const int16_t *in, float *left, float *right, size_t count) {
+    size_t i = 0;
+#ifdef SR_HAVE_SSE2
+    const __m128 scale = _mm_set1_ps(S16_SCALE);
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + 2 * i));
+        //left is the low half of each 32 bit pair, right the high one
+        __m128i l = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+        __m128i r = _mm_srai_epi32(v, 16);
+        _mm_storeu_ps(left + i, _mm_mul_ps(_mm_cvtepi32_ps(l), scale));
+        _mm_storeu_ps(right + i, _mm_mul_ps(_mm_cvtepi32_ps(r), scale));
+    }
+#endif
+    for (; i < count; i++) {
+        left[i] = in[2 * i] * S16_SCALE;
+        right[i] = in[2 * i + 1] * S16_SCALE;
+    }
+}
+
+static void floatStereoToPlanes(const float *in, float *left, float *right, size_t count) {
+    size_t i = 0;
+#ifdef SR_HAVE_SSE2
+    for (; i + 4 <= count; i += 4) {
+        __m128 a = _mm_loadu_ps(in + 2 * i), b = _mm_loadu_ps(in + 2 * i + 4);
+        _mm_storeu_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(right + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+#endif
+    for (; i < count; i++) {
+        left[i] = in[2 * i];
+        right[i] = in[2 * i + 1];
+    }
+}
+
+bool SRAudioConvert::supported(AVSampleFormat in, AVSampleFormat out) {
+    AVSampleFormat packedIn = av_get_packed_sample_fmt(in), packedOut = av_get_packed_sample_fmt(out);
+    return (packedIn == AV_SAMPLE_FMT_S16 || packedIn == AV_SAMPLE_FMT_FLT) &&
+           (packedOut == AV_SAMPLE_FMT_S16 || packedOut == AV_SAMPLE_FMT_FLT);
+}
+
+void SRAudioConvert::convert(uint8_t *const *out, int outOffset, const uint8_t *const *in, int inOffset, int samples,
+                             int channels, AVSampleFormat inFormat, AVSampleFormat outFormat) {
+    if (samples <= 0)
+        return;
+    const bool planarIn = av_sample_fmt_is_planar(inFormat) && channels > 1;
+    const bool planarOut = av_sample_fmt_is_planar(outFormat) && channels > 1;
+    const bool floatIn = av_get_packed_sample_fmt(inFormat) == AV_SAMPLE_FMT_FLT;
+    const bool floatOut = av_get_packed_sample_fmt(outFormat) == AV_SAMPLE_FMT_FLT;
+    const int bpsIn = av_get_bytes_per_sample(inFormat), bpsOut = av_get_bytes_per_sample(outFormat);
+
+    if (planarIn == planarOut) {
+        //the same layout: one run per plane, or a single run of the interleaved samples
+        const int planes = planarIn ? channels : 1;
+        const size_t count = (size_t) samples * (planarIn ? 1 : channels);
+        const size_t skipIn = (size_t) inOffset * (planarIn ? 1 : channels);
+        const size_t skipOut = (size_t) outOffset * (planarOut ? 1 : channels);
+        for (int c = 0; c < planes; c++) {
+            const uint8_t *src = in[c] + skipIn * bpsIn;
+            uint8_t *dst = out[c] + skipOut * bpsOut;
+            if (floatIn == floatOut)
+                memcpy(dst, src, count * bpsIn);
+            else if (floatOut)
+                s16ToFloat((const int16_t *) src, (float *) dst, count);
+            else
+                floatToS16((const float *) src, (int16_t *) dst, count);
+        }
+        return;
+    }
+    if (!planarIn && channels == 2 && floatOut) {
+        float *left = (float *) out[0] + outOffset, *right = (float *) out[1] + outOffset;
+        if (floatIn)
+            floatStereoToPlanes((const float *) in[0] + 2 * inOffset, left, right, (size_t) samples);
+        else
+            s16StereoToFloatPlanes((const int16_t *) in[0] + 2 * inOffset, left, right, (size_t) samples);
+        return;
+    }
+    //the other layouts and channel counts, one sample at a time
+    for (int c = 0; c < channels; c++) {
+        for (int i = 0; i < samples; i++) {
+            size_t from = planarIn ? (size_t) (inOffset + i) : (size_t) (inOffset + i) * channels + c;
+            size_t to = planarOut ? (size_t) (outOffset + i) : (size_t) (outOffset + i) * channels + c;
+            const uint8_t *src = in[planarIn ? c : 0];
+            uint8_t *dst = out[planarOut ? c : 0];
+            float v = floatIn ? ((const float *) src)[from] : ((const int16_t *) src)[from] * S16_SCALE;
+            if (floatOut)
+                ((float *) dst)[to] = v;
+            else
+                ((int16_t *) dst)[to] = floatIn ? floatSample(v) : ((const int16_t *) src)[from];
+        }
+    }
+}
@@ -0,0 +1,41 @@
+//
+// Sample format conversion of the captured audio, in place of the resampler when the rate and the channels match.
+//
+
+#ifndef CPPSCREENRECORDER_SRAUDIOCONVERT_H
+#define CPPSCREENRECORDER_SRAUDIOCONVERT_H
+
+#include <cstdint>
+
+extern "C"
+{
+#include "libavutil/samplefmt.h"
+}
+
+/**
+ * SRAudioConvert changes the sample format of the audio between S16, S16P, FLT and FLTP (interleaved or planar),
+ * the formats of the capture back-ends and of the AAC and Opus encoders, without any buffer of its own: swr goes
+ * through its resampler buffers even when only the format differs.\n
+ * The S16 to float conversion runs 8 samples per instruction with SSE2, and interleaved stereo is split into its
+ * two planes on the way; a plain copy for the same format in and out. The scale is the one of swr,
+ * 1/32768 to float, a rounded and clipped x32768 back.
+ */
+class SRAudioConvert {
+
+public:
+    /**
+     * supported() tells if convert() handles in to out
+     */
+    static bool supported(AVSampleFormat in, AVSampleFormat out);
+
+    /**
+     * convert() converts samples of every channel
+     * @param out planes of a planar format, out[0] for an interleaved one
+     * @param outOffset first sample of out to write, in samples of one channel
+     * @param inOffset first sample of in to read, in samples of one channel
+     */
+    static void convert(uint8_t *const *out, int outOffset, const uint8_t *const *in, int inOffset, int samples,
+                        int channels, AVSampleFormat inFormat, AVSampleFormat outFormat);
+};
+
+#endif //CPPSCREENRECORDER_SRAUDIOCONVERT_H
@@ -0,0 +1,298 @@
+//
+// Real-time clean-up of the recorded audio: noise suppression, loudness normalization and compression.
+//
+
+#include "SRAudioDsp.h"
+#include "SRAudioConvert.h"
+#include "SRLog.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SR_HAVE_SSE2 1
+#endif
+
+extern "C"
+{
+#include "libavutil/common.h"
+#include "libavutil/frame.h"
+#include "libavutil/mem.h"
+#include "libavutil/time.h"
+}
+
+#define DSP_OVERSUBTRACTION 3.0f    //times the noise estimate taken off each bin, the minimum it tracks lies under the mean
+#define DSP_BLOCK 100   //ms of the loudness blocks, 30 of them make the short-term window
+#define DSP_SHORT_TERM 30
+#define DSP_GAIN_STEP 16    //samples between two evaluations of the compressor curve
+
+/* dst = a * b over count floats */
+static void multiply(float *dst, const float *a, const float *b, int count) {
+    int i = 0;
+#ifdef SR_HAVE_SSE2
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+#endif
+    for (; i < count; i++)
+        dst[i] = a[i] * b[i];
+}
+
+/* dst += a * b * scale over count floats */
+static void multiplyAdd(float *dst, const float *a, const float *b, float scale, int count) {
+    int i = 0;
+#ifdef SR_HAVE_SSE2
+    const __m128 s = _mm_set1_ps(scale);
+    for (; i + 4 <= count; i += 4) {
+        __m128 v = _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)), s);
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), v));
+    }
+#endif
+    for (; i < count; i++)
+        dst[i] += a[i] * b[i] * scale;
+}
+
+/* one sample through a biquad of coefficients k (b0 b1 b2 a1 a2), transposed direct form II */
+static inline double biquad(const double *k, double *z, double x) {
+    double y = k[0] * x + z[0];
+    z[0] = k[1] * x - k[3] * y + z[1];
+    z[1] = k[2] * x - k[4] * y;
+    return y;
+}
+
+SRAudioDsp::SRAudioDsp(): rate(0), channels(0), size(0), hop(0), fill(0), enabled(false), bypass(false), strikes(0),
+                          forward(nullptr), inverse(nullptr), spectrum(nullptr), shelfK(), highpassK(),
+                          blockEnergy(0), blockSamples(0), blockLength(0), blockIndex(0), blockCount(0),
+                          loudnessDb(0), targetDb(0), loudnessGain(1), envelope(0), limiter(0), compGain(1),
+                          attack(0), release(0), limiterRelease(0) {}
+
+SRAudioDsp::~SRAudioDsp() {
+    if (forward)
+        av_rdft_end(forward);
+    if (inverse)
+        av_rdft_end(inverse);
+    av_free(spectrum);
+}
+
+int SRAudioDsp::setup(int sampleRate, int channelCount) {
+    if (sampleRate <= 0 || channelCount <= 0 || channelCount > AV_NUM_DATA_POINTERS)
+        return AVERROR(EINVAL);
+    rate = sampleRate;
+    channels = channelCount;
+    size = 1 << DSP_FFT_BITS;
+    hop = size / 2;
+    forward = av_rdft_init(DSP_FFT_BITS, DFT_R2C);
+    inverse = av_rdft_init(DSP_FFT_BITS, IDFT_C2R);
+    spectrum = (float *) av_malloc(size * sizeof(float));
+    if (!forward || !inverse || !spectrum)
+        return AVERROR(ENOMEM);
+
+    //periodic square root of Hann: analysis and synthesis windows of half overlap add up to one
+    window.resize(size);
+    for (int i = 0; i < size; i++)
+        window[i] = (float) sqrt(0.5 * (1 - cos(2 * M_PI * i / size)));
+    state.resize(channels);
+    for (Channel &ch : state) {
+        ch.history.assign(size, 0);
+        ch.overlap.assign(size, 0);
+        ch.queueIn.assign(hop, 0);
+        ch.queueOut.assign(hop, 0);
+        ch.power.assign(hop + 1, 0);
+        ch.noise.assign(hop + 1, 0);
+        ch.gain.assign(hop + 1, 1);
+        ch.shelf[0] = ch.shelf[1] = ch.highpass[0] = ch.highpass[1] = 0;
+        ch.primed = false;
+    }
+
+    //K-weighting of BS.1770 at any rate: the high shelf of the head, then the high pass of the RLB weighting
+    double K = tan(M_PI * 1681.974450955533 / rate), Q = 0.7071752369554196;
+    double Vh = pow(10.0, 3.999843853973347 / 20), Vb = pow(Vh, 0.4996667741545416);
+    double a0 = 1 + K / Q + K * K;
+    shelfK[0] = (Vh + Vb * K / Q + K * K) / a0;
+    shelfK[1] = 2 * (K * K - Vh) / a0;
+    shelfK[2] = (Vh - Vb * K / Q + K * K) / a0;
+    shelfK[3] = 2 * (K * K - 1) / a0;
+    shelfK[4] = (1 - K / Q + K * K) / a0;
+    K = tan(M_PI * 38.13547087602444 / rate);
+    Q = 0.5003270373238773;
+    a0 = 1 + K / Q + K * K;
+    highpassK[0] = 1;
+    highpassK[1] = -2;
+    highpassK[2] = 1;
+    highpassK[3] = 2 * (K * K - 1) / a0;
+    highpassK[4] = (1 - K / Q + K * K) / a0;
+    blockLength = rate * DSP_BLOCK / 1000;
+    blocks.assign(DSP_SHORT_TERM, 0);
+
+    attack = (float) exp(-1000.0 / (DSP_COMP_ATTACK * rate));
+    release = (float) exp(-1000.0 / (DSP_COMP_RELEASE * rate));
+    //the limiter takes a peak at once and lets go within a few ms
+    limiterRelease = (float) exp(-1000.0 / (5.0 * rate));
+    enabled = true;
+    return 0;
+}
+
+/**
+ * block() runs the window of the last hop: the noise estimate follows the smoothed power of each bin, the gain of a
+ * bin is what is left once the estimate is taken off, smoothed over two windows
+ */
+void SRAudioDsp::block(Channel &ch) {
+    memmove(ch.history.data(), ch.history.data() + hop, hop * sizeof(float));
+    memcpy(ch.history.data() + hop, ch.queueIn.data(), hop * sizeof(float));
+    if (bypass) {
+        //the delay of the windows, without them
+        memcpy(ch.queueOut.data(), ch.history.data(), hop * sizeof(float));
+        return;
+    }
+    multiply(spectrum, ch.history.data(), window.data(), size);
+    av_rdft_calc(forward, spectrum);
+
+    const float rise = (float) pow(10.0, DSP_NOISE_RISE / 10.0 * hop / rate);
+    const float floor = (float) pow(10.0, DSP_NOISE_FLOOR / 20.0);
+    //the power of a full scale sine in its bin is (size / 4)^2 through the window: the estimate rises from there
+    const float least = (float) ((size / 4.0) * (size / 4.0) * pow(10.0, DSP_NOISE_MIN / 10.0));
+    for (int k = 0; k <= hop; k++) {
+        //the packed layout of DFT_R2C: DC and Nyquist first, then re and im of the bins in between
+        float re = k == 0 ? spectrum[0] : k == hop ? spectrum[1] : spectrum[2 * k];
+        float im = k == 0 || k == hop ? 0 : spectrum[2 * k + 1];
+        float p = re * re + im * im;
+        ch.power[k] = ch.primed ? 0.7f * ch.power[k] + 0.3f * p : p;
+        ch.noise[k] = !ch.primed || ch.power[k] < ch.noise[k] ? ch.power[k] : ch.noise[k] * rise;
+        ch.noise[k] = FFMAX(ch.noise[k], least);
+        float g = p > 0 ? 1 - DSP_OVERSUBTRACTION * ch.noise[k] / p : 0;
+        g = sqrtf(FFMAX(g, 0.0f));
+        ch.gain[k] = 0.5f * ch.gain[k] + 0.5f * FFMAX(g, floor);
+    }
+    ch.primed = true;
+    spectrum[0] *= ch.gain[0];
+    spectrum[1] *= ch.gain[hop];
+    for (int k = 1; k < hop; k++) {
+        spectrum[2 * k] *= ch.gain[k];
+        spectrum[2 * k + 1] *= ch.gain[k];
+    }
+    av_rdft_calc(inverse, spectrum);
+
+    //IDFT_C2R leaves the samples times size / 2
+    multiplyAdd(ch.overlap.data(), spectrum, window.data(), 2.0f / size, size);
+    memcpy(ch.queueOut.data(), ch.overlap.data(), hop * sizeof(float));
+    memmove(ch.overlap.data(), ch.overlap.data() + hop, hop * sizeof(float));
+    memset(ch.overlap.data() + hop, 0, hop * sizeof(float));
+}
+
+/**
+ * suppress() streams the samples through the hop queues: each sample comes out size samples later,
+ * the windows run whenever a hop is complete
+ */
+void SRAudioDsp::suppress(float *const *planes, int samples) {
+    int done = 0;
+    while (done < samples) {
+        int n = FFMIN(hop - fill, samples - done);
+        for (int c = 0; c < channels; c++) {
+            Channel &ch = state[c];
+            float *x = planes[c] + done;
+            memcpy(ch.queueIn.data() + fill, x, n * sizeof(float));
+            memcpy(x, ch.queueOut.data() + fill, n * sizeof(float));
+        }
+        fill += n;
+        done += n;
+        if (fill == hop) {
+            for (Channel &ch : state)
+                block(ch);
+            fill = 0;
+        }
+    }
+}
+
+/**
+ * measure() takes the K-weighted mean square of 100 ms blocks, slews the normalization gain to bring the loudness of
+ * the last 3 s to DSP_LOUDNESS_TARGET, and applies it
+ */
+void SRAudioDsp::measure(float *const *planes, int samples) {
+    for (int i = 0; i < samples; i++) {
+        for (int c = 0; c < channels; c++) {
+            double y = biquad(highpassK, state[c].highpass, biquad(shelfK, state[c].shelf, planes[c][i]));
+            blockEnergy += y * y;
+        }
+        if (++blockSamples < blockLength)
+            continue;
+        blocks[blockIndex] = blockEnergy / blockLength;
+        blockIndex = (blockIndex + 1) % DSP_SHORT_TERM;
+        blockCount = FFMIN(blockCount + 1, DSP_SHORT_TERM);
+        blockEnergy = 0;
+        blockSamples = 0;
+        double sum = 0;
+        for (int b = 0; b < blockCount; b++)
+            sum += blocks[b];
+        double lufs = -0.691 + 10 * log10(sum / blockCount + 1e-12);
+        //the loudness before the gain: the loop does not chase its own output
+        if (lufs > DSP_LOUDNESS_GATE)
+            targetDb = av_clipd(DSP_LOUDNESS_TARGET - lufs, -DSP_LOUDNESS_RANGE, DSP_LOUDNESS_RANGE);
+        const double step = DSP_LOUDNESS_SLEW * DSP_BLOCK / 1000.0;
+        loudnessDb += av_clipd(targetDb - loudnessDb, -step, step);
+    }
+    //toward the gain of the last block in about 20 ms: no zipper noise at the block edges
+    const float wanted = (float) pow(10.0, loudnessDb / 20);
+    const float smoothing = 1000.0f / (20.0f * rate);
+    for (int i = 0; i < samples; i++) {
+        loudnessGain += (wanted - loudnessGain) * smoothing;
+        for (int c = 0; c < channels; c++)
+            planes[c][i] *= loudnessGain;
+    }
+}
+
+/**
+ * compress() follows the peak of all channels with the attack and release envelope, takes the gain of the curve
+ * every DSP_GAIN_STEP samples; the limiter catches at once what still goes over DSP_CEILING
+ */
+void SRAudioDsp::compress(float *const *planes, int samples) {
+    const float ceiling = (float) pow(10.0, DSP_CEILING / 20.0);
+    for (int i = 0; i < samples; i++) {
+        float peak = 0;
+        for (int c = 0; c < channels; c++)
+            peak = FFMAX(peak, fabsf(planes[c][i]));
+        envelope = peak > envelope ? attack * envelope + (1 - attack) * peak
+                                   : release * envelope + (1 - release) * peak;
+        if (i % DSP_GAIN_STEP == 0) {
+            float level = 20 * log10f(envelope + 1e-9f);
+            float over = level - DSP_COMP_THRESHOLD;
+            compGain = over > 0 ? powf(10.0f, -over * (1 - 1.0f / DSP_COMP_RATIO) / 20) : 1.0f;
+        }
+        peak *= compGain;
+        limiter = FFMAX(peak, limiter * limiterRelease);
+        float gain = limiter > ceiling ? compGain * ceiling / limiter : compGain;
+        for (int c = 0; c < channels; c++)
+            planes[c][i] *= gain;
+    }
+}
+
+void SRAudioDsp::process(uint8_t *const *data, int samples, AVSampleFormat format) {
+    if (!enabled || samples <= 0)
+        return;
+    int64_t start = av_gettime_relative();
+    float *planes[AV_NUM_DATA_POINTERS];
+    bool native = format == AV_SAMPLE_FMT_FLTP || (channels == 1 && format == AV_SAMPLE_FMT_FLT);
+    if (native) {
+        for (int c = 0; c < channels; c++)
+            planes[c] = (float *) data[c];
+    } else {
+        scratch.resize((size_t) samples * channels);
+        for (int c = 0; c < channels; c++)
+            planes[c] = scratch.data() + (size_t) c * samples;
+        SRAudioConvert::convert((uint8_t *const *) planes, 0, data, 0, samples, channels, format, AV_SAMPLE_FMT_FLTP);
+    }
+    suppress(planes, samples);
+    measure(planes, samples);
+    compress(planes, samples);
+    if (!native)
+        SRAudioConvert::convert(data, 0, (const uint8_t *const *) planes, 0, samples, channels, AV_SAMPLE_FMT_FLTP, format);
+
+    if (bypass)
+        return;
+    int64_t budget = (int64_t) samples * 10000 * DSP_BUDGET / rate;
+    strikes = av_gettime_relative() - start > budget ? strikes + 1 : 0;
+    if (strikes >= DSP_BUDGET_STRIKES) {
+        bypass = true;
+        srLog(SR_LOG_WARNING, "[SRAudioDsp] %d frames in a row over %d%% of their duration, noise suppression bypassed",
+              strikes, DSP_BUDGET);
+    }
+}
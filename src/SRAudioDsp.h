@@ -0,0 +1,120 @@
+//
+// Real-time clean-up of the recorded audio: noise suppression, loudness normalization and compression.
+//
+
+#ifndef CPPSCREENRECORDER_SRAUDIODSP_H
+#define CPPSCREENRECORDER_SRAUDIODSP_H
+
+#include <cstdint>
+#include <vector>
+
+extern "C"
+{
+#include "libavcodec/avfft.h"
+#include "libavutil/samplefmt.h"
+}
+
+#define DSP_FFT_BITS 9      //512 point windows of the noise suppression, half overlapped: 10.7 ms of latency at 48 kHz
+#define DSP_NOISE_FLOOR -12     //dB, deepest cut of the noise suppression: the voice over the noise keeps its breath
+#define DSP_NOISE_RISE 3    //dB per second the noise estimate may rise, it falls at once
+#define DSP_NOISE_MIN -100  //dBFS per bin the noise estimate never falls under: digital silence would hold it at 0
+#define DSP_LOUDNESS_TARGET -16     //LUFS, short-term loudness the normalization steers to
+#define DSP_LOUDNESS_RANGE 12   //dB the normalization may add or remove at most
+#define DSP_LOUDNESS_SLEW 3     //dB per second the normalization gain may move
+#define DSP_LOUDNESS_GATE -50   //LUFS under which the gain is held: the pauses are not pulled up
+#define DSP_COMP_THRESHOLD -20  //dBFS over which the compressor engages
+#define DSP_COMP_RATIO 3
+#define DSP_COMP_ATTACK 5   //ms
+#define DSP_COMP_RELEASE 150    //ms
+#define DSP_CEILING -1      //dBFS, the peak limiter after the compressor
+#define DSP_BUDGET 25   //% of the duration of a frame the stage may take, beyond the noise suppression is bypassed
+#define DSP_BUDGET_STRIKES 8    //frames in a row over DSP_BUDGET before the bypass
+
+/**
+ * SRAudioDsp cleans up the encoder frames of a track in place, in three stages:\n
+ * the noise suppression subtracts the spectrum of the steady noise (fans, hum, hiss) on half overlapped windows of
+ * the real FFT of libavcodec, its estimate follows the quietest level of each bin, falling at once and rising by
+ * DSP_NOISE_RISE dB per second, and never cuts more than DSP_NOISE_FLOOR dB;
+ * the normalization measures the short-term loudness of ITU-R BS.1770 (K-weighted, 3 s) and slews its gain to
+ * DSP_LOUDNESS_TARGET;
+ * the compressor (the static curve of af_compand with an attack and release envelope) and a peak limiter at
+ * DSP_CEILING keep the gain of the normalization from clipping.\n
+ * The stage holds latency() samples back, the start of the audio timeline is placed earlier by as much. A frame
+ * taking more than DSP_BUDGET % of its duration counts as a strike: after DSP_BUDGET_STRIKES in a row the noise
+ * suppression is reduced to a plain delay of the same length, the other two stages cost a few operations per sample.
+ *
+ * @Note one per track, AudioThread only
+ */
+class SRAudioDsp {
+
+private:
+    struct Channel {
+        std::vector<float> history;     //the last window of input
+        std::vector<float> overlap;     //of the inverse transforms
+        std::vector<float> queueIn;     //hop samples on the way in and out
+        std::vector<float> queueOut;
+        std::vector<float> power;   //per bin, smoothed
+        std::vector<float> noise;
+        std::vector<float> gain;
+        double shelf[2], highpass[2];   //K-weighting filter states
+        bool primed;    //the noise estimate started from the first window
+    };
+
+    int rate, channels;
+    int size, hop;  //of the windows
+    int fill;   //samples in the queues of the current hop
+    bool enabled, bypass;
+    int strikes;
+    RDFTContext *forward, *inverse;
+    float *spectrum;    //av_malloc(), aligned for the SIMD transforms
+    std::vector<float> window;
+    std::vector<Channel> state;
+    std::vector<float> scratch;     //float planes of the frames in another format
+    //K-weighting coefficients, b0 b1 b2 a1 a2
+    double shelfK[5], highpassK[5];
+    double blockEnergy;
+    int blockSamples, blockLength;
+    std::vector<double> blocks;     //mean squares of the last 3 s, 100 ms each
+    int blockIndex, blockCount;
+    double loudnessDb, targetDb;    //current and wanted normalization gain
+    float loudnessGain;     //linear, smoothed per sample
+    float envelope, limiter;
+    float compGain;
+    float attack, release, limiterRelease;
+
+    void block(Channel &ch);
+    void suppress(float *const *planes, int samples);
+    void measure(float *const *planes, int samples);
+    void compress(float *const *planes, int samples);
+
+public:
+    SRAudioDsp();
+    ~SRAudioDsp();
+
+    SRAudioDsp(const SRAudioDsp&) = delete;
+    SRAudioDsp &operator=(const SRAudioDsp&) = delete;
+
+    /**
+     * setup() allocates the transforms and the state for the track
+     * @return 0 on success, a negative AVERROR code otherwise: the stage stays off
+     */
+    int setup(int sampleRate, int channelCount);
+
+    bool active() const { return enabled; }
+
+    /**
+     * latency() is the number of samples the stage holds back, 0 when it is off
+     */
+    int latency() const { return enabled ? size : 0; }
+
+    double gainDb() const { return loudnessDb; }
+    bool bypassed() const { return bypass; }
+
+    /**
+     * process() runs the stages over a frame in place
+     * @param data the planes of a planar format, data[0] for an interleaved one; S16, S16P, FLT or FLTP
+     */
+    void process(uint8_t *const *data, int samples, AVSampleFormat format);
+};
+
+#endif //CPPSCREENRECORDER_SRAUDIODSP_H
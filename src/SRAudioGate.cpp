@@ -0,0 +1,145 @@
+//
+// Silence gate of the captured audio: the chunks under a level skip the resampler, the silent frames the encoder.
+//
+
+#include "SRAudioGate.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SR_HAVE_SSE2 1
+#endif
+
+extern "C"
+{
+#include "libavutil/common.h"
+}
+
+/* largest magnitude of count S16 samples, in 1/32768 */
+static int peakS16(const int16_t *s, size_t count) {
+    size_t i = 0;
+    int high = 0, low = 0;
+#ifdef SR_HAVE_SSE2
+    //the max and the min separately: -32768 has no positive counterpart in 16 bits
+    __m128i maxv = _mm_setzero_si128(), minv = _mm_setzero_si128();
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        maxv = _mm_max_epi16(maxv, v);
+        minv = _mm_min_epi16(minv, v);
+    }
+    int16_t lanes[8];
+    _mm_storeu_si128((__m128i *) lanes, maxv);
+    for (int k = 0; k < 8; k++)
+        high = FFMAX(high, lanes[k]);
+    _mm_storeu_si128((__m128i *) lanes, minv);
+    for (int k = 0; k < 8; k++)
+        low = FFMIN(low, lanes[k]);
+#endif
+    for (; i < count; i++) {
+        high = FFMAX(high, s[i]);
+        low = FFMIN(low, s[i]);
+    }
+    return FFMAX(high, -low);
+}
+
+static float peakFloat(const float *s, size_t count) {
+    size_t i = 0;
+    float peak = 0;
+#ifdef SR_HAVE_SSE2
+    const __m128 magnitude = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 maxv = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4)
+        maxv = _mm_max_ps(maxv, _mm_and_ps(_mm_loadu_ps(s + i), magnitude));
+    float lanes[4];
+    _mm_storeu_ps(lanes, maxv);
+    for (int k = 0; k < 4; k++)
+        peak = FFMAX(peak, lanes[k]);
+#endif
+    for (; i < count; i++)
+        peak = FFMAX(peak, fabsf(s[i]));
+    //NaN compares false: a broken chunk is not silence
+    return peak == peak ? peak : 1.0f;
+}
+
+static double peakPlane(const uint8_t *data, size_t count, AVSampleFormat format) {
+    double peak = 0;
+    switch (format) {
+        case AV_SAMPLE_FMT_S16:
+            return peakS16((const int16_t *) data, count) / 32768.0;
+        case AV_SAMPLE_FMT_FLT:
+            return peakFloat((const float *) data, count);
+        case AV_SAMPLE_FMT_U8:
+            for (size_t i = 0; i < count; i++)
+                peak = FFMAX(peak, abs((int) data[i] - 128) / 128.0);
+            return peak;
+        case AV_SAMPLE_FMT_S32:
+            for (size_t i = 0; i < count; i++)
+                peak = FFMAX(peak, fabs((double) ((const int32_t *) data)[i]) / 2147483648.0);
+            return peak;
+        case AV_SAMPLE_FMT_DBL:
+            for (size_t i = 0; i < count; i++)
+                peak = FFMAX(peak, fabs(((const double *) data)[i]));
+            return peak == peak ? peak : 1.0;
+        default:
+            return 1.0;
+    }
+}
+
+SRAudioGate::SRAudioGate(): threshold(0), hold(0), quiet(0), closed(false) {}
+
+void SRAudioGate::setup(int sampleRate, int levelDb, int holdMs) {
+    threshold = pow(10.0, levelDb / 20.0);
+    hold = (int64_t) sampleRate * holdMs / 1000;
+    quiet = 0;
+    closed = false;
+}
+
+bool SRAudioGate::silent(const AVFrame *frame) {
+    double level = peak(frame->extended_data, frame->nb_samples, frame->channels, (AVSampleFormat) frame->format);
+    if (level >= threshold) {
+        quiet = 0;
+        closed = false;
+        return false;
+    }
+    quiet += frame->nb_samples;
+    closed = quiet >= hold;
+    return closed;
+}
+
+double SRAudioGate::peak(const uint8_t *const *data, int samples, int channels, AVSampleFormat format) {
+    if (samples <= 0 || channels <= 0)
+        return 0;
+    AVSampleFormat packed = av_get_packed_sample_fmt(format);
+    if (!av_sample_fmt_is_planar(format))
+        return peakPlane(data[0], (size_t) samples * channels, packed);
+    double peak = 0;
+    for (int c = 0; c < channels; c++)
+        peak = FFMAX(peak, peakPlane(data[c], (size_t) samples, packed));
+    return peak;
+}
+
+bool SRAudioGate::zero(const uint8_t *const *data, int samples, int channels, AVSampleFormat format) {
+    //the silence of unsigned 8 bit is 0x80, not a run of zero bytes
+    if (av_get_packed_sample_fmt(format) == AV_SAMPLE_FMT_U8)
+        return false;
+    int planar = av_sample_fmt_is_planar(format);
+    size_t bytes = (size_t) samples * av_get_bytes_per_sample(format) * (planar ? 1 : channels);
+    for (int c = 0; c < (planar ? channels : 1); c++) {
+        const uint8_t *p = data[c];
+        size_t i = 0;
+#ifdef SR_HAVE_SSE2
+        __m128i any = _mm_setzero_si128();
+        for (; i + 16 <= bytes; i += 16)
+            any = _mm_or_si128(any, _mm_loadu_si128((const __m128i *) (p + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xffff)
+            return false;
+#endif
+        for (; i < bytes; i++)
+            if (p[i])
+                return false;
+    }
+    return true;
+}
@@ -0,0 +1,43 @@
+//
+// Native audio capture back-ends.
+//
+
+#ifndef CPPSCREENRECORDER_SRAUDIOGRABBER_H
+#define CPPSCREENRECORDER_SRAUDIOGRABBER_H
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+}
+
+/**
+ * SRAudioGrabber is a capture back-end that talks to the sound server directly, taking the place
+ * of the libavdevice demuxer: it produces packets of interleaved PCM for the decoder of codecId(),
+ * with pts in microseconds on the wall clock (av_gettime()), the time the first sample was captured.
+ */
+class SRAudioGrabber {
+
+public:
+    virtual ~SRAudioGrabber() = default;
+
+    /**
+     * open() connects to the server and starts recording
+     * @param device source name, back-end specific, "default" for the default source
+     * @param fragmentUs size of the chunks the server delivers, in microseconds
+     * @return 0 on success, a negative AVERROR code otherwise
+     */
+    virtual int open(const char *device, int sampleRate, int channels, int fragmentUs) = 0;
+
+    /**
+     * read() waits for the next chunk of samples and stores it in pkt
+     * @return 0 on success, AVERROR(EAGAIN) if the source stayed silent for a while, a negative AVERROR code otherwise
+     */
+    virtual int read(AVPacket *pkt) = 0;
+
+    virtual enum AVCodecID codecId() const = 0;
+    virtual int sampleRate() const = 0;
+    virtual int channels() const = 0;
+    virtual const char *name() const = 0;
+};
+
+#endif //CPPSCREENRECORDER_SRAUDIOGRABBER_H
@@ -0,0 +1,37 @@
+//
+// Owning pointers of the libav structs, freed with their own deallocator.
+//
+
+#ifndef CPPSCREENRECORDER_SRAVPTR_H
+#define CPPSCREENRECORDER_SRAVPTR_H
+
+#include <memory>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavutil/frame.h"
+#include "libswresample/swresample.h"
+}
+
+struct SRPacketDeleter {
+    void operator()(AVPacket *packet) const { av_packet_free(&packet); }
+};
+
+struct SRFrameDeleter {
+    void operator()(AVFrame *frame) const { av_frame_free(&frame); }
+};
+
+struct SRSwrDeleter {
+    void operator()(SwrContext *ctx) const { swr_free(&ctx); }
+};
+
+/**
+ * SRPacketPtr is an AVPacket of av_packet_alloc(): the struct and its references go with the pointer.\n
+ * The packet of a capture loop is one of these, unreferenced after each use and reused for the next one.
+ */
+typedef std::unique_ptr<AVPacket, SRPacketDeleter> SRPacketPtr;
+typedef std::unique_ptr<AVFrame, SRFrameDeleter> SRFramePtr;
+typedef std::unique_ptr<SwrContext, SRSwrDeleter> SRSwrPtr;
+
+#endif //CPPSCREENRECORDER_SRAVPTR_H
@@ -0,0 +1,109 @@
+#include "SRBlend.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/* x / 255 rounded, exact for the products of two bytes */
+static inline int div255(int x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+/**
+ * blendTail() blends the columns [x, width) of a row, the vector loops stop before them
+ */
+static void blendTail(uint8_t *dst, const uint32_t *src, int x, int width) {
+    for (; x < width; x++) {
+        uint32_t p = src[x];
+        int inv = 255 - (int) (p >> 24);
+        uint8_t *d = dst + 4 * x;
+        d[0] = (uint8_t) ((p & 0xff) + div255(d[0] * inv));
+        d[1] = (uint8_t) (((p >> 8) & 0xff) + div255(d[1] * inv));
+        d[2] = (uint8_t) (((p >> 16) & 0xff) + div255(d[2] * inv));
+        d[3] = (uint8_t) ((p >> 24) + div255(d[3] * inv));
+    }
+}
+
+#ifdef __SSE2__
+static inline __m128i blendHalfSSE2(__m128i d, __m128i inv) {
+    __m128i m = _mm_add_epi16(_mm_mullo_epi16(d, inv), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(m, _mm_srli_epi16(m, 8)), 8);
+}
+#endif
+
+void blendPremultiplied(uint8_t *dst, int dstStride, const uint32_t *src, int srcStride, int width, int height) {
+    for (int j = 0; j < height; j++, dst += dstStride, src += srcStride) {
+        int x = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; x + 4 <= width; x += 4) {
+            __m128i s = _mm_loadu_si128((const __m128i *) (src + x));
+            //fully transparent pixels are most of a pointer: they leave the destination alone
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff)
+                continue;
+            __m128i d = _mm_loadu_si128((const __m128i *) (dst + 4 * x));
+            __m128i a = _mm_srli_epi32(s, 24);
+            a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+            a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+            __m128i inv = _mm_xor_si128(a, _mm_set1_epi8((char) 0xff));
+            __m128i lo = blendHalfSSE2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(inv, zero));
+            __m128i hi = blendHalfSSE2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(inv, zero));
+            _mm_storeu_si128((__m128i *) (dst + 4 * x), _mm_adds_epu8(_mm_packus_epi16(lo, hi), s));
+        }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        for (; x + 8 <= width; x += 8) {
+            uint8x8x4_t s = vld4_u8((const uint8_t *) (src + x));
+            uint8x8x4_t d = vld4_u8(dst + 4 * x);
+            uint8x8_t inv = vmvn_u8(s.val[3]);
+            for (int c = 0; c < 4; c++) {
+                uint16x8_t m = vmull_u8(d.val[c], inv);
+                d.val[c] = vqadd_u8(vraddhn_u16(m, vrshrq_n_u16(m, 8)), s.val[c]);
+            }
+            vst4_u8(dst + 4 * x, d);
+        }
+#endif
+        blendTail(dst, src, x, width);
+    }
+}
+
+void blendPlane(uint8_t *dst, int dstStride, const uint8_t *src, const uint8_t *alpha, int srcStride,
+                int width, int height) {
+    for (int j = 0; j < height; j++, dst += dstStride, src += srcStride, alpha += srcStride) {
+        int x = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; x + 16 <= width; x += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *) (alpha + x));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero)) == 0xffff)
+                continue;
+            __m128i d = _mm_loadu_si128((const __m128i *) (dst + x));
+            __m128i inv = _mm_xor_si128(a, _mm_set1_epi8((char) 0xff));
+            __m128i lo = blendHalfSSE2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(inv, zero));
+            __m128i hi = blendHalfSSE2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(inv, zero));
+            __m128i sv = _mm_loadu_si128((const __m128i *) (src + x));
+            _mm_storeu_si128((__m128i *) (dst + x), _mm_adds_epu8(_mm_packus_epi16(lo, hi), sv));
+        }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        for (; x + 16 <= width; x += 16) {
+            uint8x16_t a = vld1q_u8(alpha + x);
+            uint64x2_t any = vreinterpretq_u64_u8(a);
+            if ((vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) == 0)
+                continue;
+            uint8x16_t d = vld1q_u8(dst + x);
+            uint8x16_t inv = vmvnq_u8(a);
+            uint16x8_t lo = vmull_u8(vget_low_u8(d), vget_low_u8(inv));
+            uint16x8_t hi = vmull_u8(vget_high_u8(d), vget_high_u8(inv));
+            uint8x16_t m = vcombine_u8(vraddhn_u16(lo, vrshrq_n_u16(lo, 8)), vraddhn_u16(hi, vrshrq_n_u16(hi, 8)));
+            vst1q_u8(dst + x, vqaddq_u8(m, vld1q_u8(src + x)));
+        }
+#endif
+        for (; x < width; x++)
+            if (alpha[x])
+                dst[x] = (uint8_t) (src[x] + div255(dst[x] * (255 - alpha[x])));
+    }
+}
@@ -0,0 +1,29 @@
+//
+// Alpha blending of premultiplied overlays, used to composite the mouse pointer and the SROverlay layers.
+//
+
+#ifndef CPPSCREENRECORDER_SRBLEND_H
+#define CPPSCREENRECORDER_SRBLEND_H
+
+#include <cstdint>
+
+/**
+ * blendPremultiplied() composites height rows of width premultiplied ARGB pixels (0xAARRGGBB, as XFixes delivers them)
+ * over 32 bit BGR0/BGRA pixels: dst = src + dst * (255 - alpha) / 255.\n
+ * SSE2 on x86, NEON on ARM, the byte left of the destination pixels is not kept.
+ *
+ * @param dstStride stride of dst in bytes, srcStride of src in pixels
+ */
+void blendPremultiplied(uint8_t *dst, int dstStride, const uint32_t *src, int srcStride, int width, int height);
+
+/**
+ * blendPlane() composites height rows of width premultiplied samples over the samples of one plane,
+ * each with its own alpha: dst = src + dst * (255 - alpha) / 255.\n
+ * SSE2 on x86, NEON on ARM; runs of 16 transparent samples leave the destination untouched.
+ *
+ * @param srcStride stride of src and alpha in bytes
+ */
+void blendPlane(uint8_t *dst, int dstStride, const uint8_t *src, const uint8_t *alpha, int srcStride,
+                int width, int height);
+
+#endif //CPPSCREENRECORDER_SRBLEND_H
@@ -0,0 +1,208 @@
+#include "SRBurstArena.h"
+#include "SRNuma.h"
+
+#include <cstring>
+
+extern "C"
+{
+#include "libavutil/common.h"
+#include "libavutil/error.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
+}
+
+/**
+ * packRow() codes the differences of row to the pixel step bytes on its left as tokens: 0x80 | n - 1 for a run of
+ * n zero differences, n - 1 followed by n literal differences otherwise
+ * @return bytes written to dst, at most bytes + bytes / BURST_RUN + 1
+ */
+static size_t packRow(const uint8_t *row, int bytes, int step, uint8_t *dst) {
+    auto diff = [&](int x) -> uint8_t { return x < step ? row[x] : (uint8_t) (row[x] - row[x - step]); };
+    uint8_t *out = dst;
+    int x = 0;
+    while (x < bytes) {
+        int run = 0;
+        while (x + run < bytes && run < BURST_RUN && !diff(x + run))
+            run++;
+        if (run >= 2) {
+            *out++ = (uint8_t) (0x80 | (run - 1));
+            x += run;
+            continue;
+        }
+        //the literals stop before the next run of two zeros, where a run token is shorter
+        uint8_t *count = out++;
+        int n = 0;
+        while (x < bytes && n < BURST_RUN && !(n && x + 1 < bytes && !diff(x) && !diff(x + 1))) {
+            *out++ = diff(x++);
+            n++;
+        }
+        *count = (uint8_t) (n - 1);
+    }
+    return out - dst;
+}
+
+/**
+ * unpackRow() decodes the tokens of packRow() into row
+ * @return bytes read from src
+ */
+static size_t unpackRow(const uint8_t *src, int bytes, int step, uint8_t *row) {
+    const uint8_t *in = src;
+    int x = 0;
+    while (x < bytes) {
+        uint8_t token = *in++;
+        int n = FFMIN((token & 0x7f) + 1, bytes - x);
+        if (token & 0x80) {
+            for (int end = x + n; x < end; x++)
+                row[x] = x < step ? 0 : row[x - step];
+        } else {
+            for (int end = x + n; x < end; x++, in++)
+                row[x] = x < step ? *in : (uint8_t) (*in + row[x - step]);
+        }
+    }
+    return in - src;
+}
+
+SRBurstArena::SRBurstArena(int64_t bytes, int tiles, bool huge): capacity((size_t) FFMAX(bytes, (int64_t) 0)),
+                                                                 huge(huge), tiles(tiles), arena(nullptr), used(0),
+                                                                 format(AV_PIX_FMT_NONE), width(0), height(0),
+                                                                 planes(0), rawFrame(0), worstFrame(0), headroom(0),
+                                                                 next(0), refused(0) {}
+
+SRBurstArena::~SRBurstArena() {
+    //the workers go before the memory they pack into
+    pool.reset();
+    if (arena)
+        numaFree(arena, capacity, huge);
+}
+
+size_t SRBurstArena::tileBound(int tile) const {
+    size_t bound = 0;
+    for (int p = 0; p < planes; p++)
+        bound += (size_t) (firstRow(p, tile + 1) - firstRow(p, tile)) * (rowBytes[p] + rowBytes[p] / BURST_RUN + 1);
+    return bound;
+}
+
+int SRBurstArena::open(enum AVPixelFormat format, int width, int height, int inFlight) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_PAL)))
+        return AVERROR(ENOSYS);
+    this->format = format;
+    this->width = width;
+    this->height = height;
+    int linesizes[4] = {0};
+    int ret = av_image_fill_linesizes(linesizes, format, width);
+    if (ret < 0)
+        return ret;
+    av_image_fill_max_pixsteps(step, nullptr, desc);
+    planes = av_pix_fmt_count_planes(format);
+    for (int p = 0; p < planes; p++) {
+        rowBytes[p] = linesizes[p];
+        planeHeight[p] = p == 1 || p == 2 ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+        step[p] = FFMAX(step[p], 1);
+        rawFrame += (size_t) rowBytes[p] * planeHeight[p];
+    }
+
+    pool.reset(new SRTaskPool(tiles));
+    tiles = FFMIN(pool->size(), height);
+    scratch.resize(tiles);
+    tileSizes.resize(tiles);
+    tileOffsets.resize(tiles);
+    worstFrame = tiles * sizeof(uint32_t);
+    size_t smallest = worstFrame;
+    for (int t = 0; t < tiles; t++) {
+        scratch[t].resize(tileBound(t));
+        worstFrame += scratch[t].size();
+    }
+    //and the alignment of the next frame
+    worstFrame += sizeof(uint32_t);
+    for (int p = 0; p < planes; p++)
+        smallest += (size_t) planeHeight[p] * ((rowBytes[p] + BURST_RUN - 1) / BURST_RUN);
+    //the frames in flight and the one being pushed when full() turns true
+    headroom = worstFrame * ((size_t) FFMAX(inFlight, 0) + 1);
+    if (capacity < headroom)
+        return AVERROR(ENOSPC);
+
+    if (!(arena = (uint8_t *) numaAlloc(capacity, -1, huge)))
+        return AVERROR(ENOMEM);
+    //every page faulted in now, not on the capture deadline
+    memset(arena, 0, capacity);
+    //the index of the smallest frames the arena can hold
+    records.reserve(capacity / smallest + 1);
+    return framePool.initVideo(format, width, height, 2);
+}
+
+/**
+ * packTile() packs the rows of tile in every plane of frame into dst
+ * @return bytes written
+ */
+size_t SRBurstArena::packTile(const AVFrame *frame, int tile, uint8_t *dst) const {
+    uint8_t *out = dst;
+    for (int p = 0; p < planes; p++)
+        for (int y = firstRow(p, tile); y < firstRow(p, tile + 1); y++)
+            out += packRow(frame->data[p] + (ptrdiff_t) y * frame->linesize[p], rowBytes[p], step[p], out);
+    return out - dst;
+}
+
+void SRBurstArena::unpackTile(const uint8_t *src, int tile, AVFrame *frame) const {
+    for (int p = 0; p < planes; p++)
+        for (int y = firstRow(p, tile); y < firstRow(p, tile + 1); y++)
+            src += unpackRow(src, rowBytes[p], step[p], frame->data[p] + (ptrdiff_t) y * frame->linesize[p]);
+}
+
+int SRBurstArena::push(const AVFrame *frame) {
+    if (!arena || frame->format != format || frame->width != width || frame->height != height)
+        return AVERROR(EINVAL);
+    if (capacity - used < worstFrame) {
+        refused++;
+        return AVERROR(ENOSPC);
+    }
+    pool->parallelFor(tiles, [&](int t) {
+        tileSizes[t] = (uint32_t) packTile(frame, t, scratch[t].data());
+    });
+    //the sizes of the tiles, then the tiles one after the other
+    Record record = {frame->pts, frame->opaque, used};
+    uint8_t *out = arena + used;
+    memcpy(out, tileSizes.data(), tiles * sizeof(uint32_t));
+    out += tiles * sizeof(uint32_t);
+    for (int t = 0; t < tiles; t++) {
+        memcpy(out, scratch[t].data(), tileSizes[t]);
+        out += tileSizes[t];
+    }
+    used = FFALIGN((size_t) (out - arena), sizeof(uint32_t));
+    records.push_back(record);
+    return 0;
+}
+
+AVFrame *SRBurstArena::pop() {
+    if (next >= records.size())
+        return nullptr;
+    const Record &record = records[next++];
+    AVFrame *frame = framePool.get();
+    if (!frame)
+        return nullptr;
+    const uint8_t *in = arena + record.offset;
+    memcpy(tileSizes.data(), in, tiles * sizeof(uint32_t));
+    size_t offset = record.offset + tiles * sizeof(uint32_t);
+    for (int t = 0; t < tiles; t++) {
+        tileOffsets[t] = offset;
+        offset += tileSizes[t];
+    }
+    pool->parallelFor(tiles, [&](int t) {
+        unpackTile(arena + tileOffsets[t], t, frame);
+    });
+    frame->pts = record.pts;
+    frame->opaque = record.opaque;
+    return frame;
+}
+
+SRBurstStats SRBurstArena::stats() const {
+    SRBurstStats s = SRBurstStats();
+    s.capacity = capacity;
+    s.used = used;
+    s.frames = records.size();
+    s.rawBytes = (int64_t) (rawFrame * records.size());
+    s.duration = records.empty() ? 0 : records.back().pts - records.front().pts;
+    s.minFrames = worstFrame ? capacity / worstFrame : 0;
+    s.refused = refused;
+    return s;
+}
@@ -0,0 +1,134 @@
+//
+// Burst capture: the converted frames packed losslessly into a RAM arena reserved up front, encoded once the burst ends.
+//
+
+#ifndef CPPSCREENRECORDER_SRBURSTARENA_H
+#define CPPSCREENRECORDER_SRBURSTARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "SRFramePool.h"
+#include "SRTaskPool.h"
+
+extern "C"
+{
+#include "libavutil/frame.h"
+#include "libavutil/pixfmt.h"
+}
+
+#define BURST_RUN 128   //bytes of a token at most: a literal run costs one byte more, the worst case grows a row by 1/BURST_RUN
+
+/**
+ * Statistics of an SRBurstArena: what it holds, and the frames it can take at least, at the worst ratio.
+ */
+typedef struct BA{
+    int64_t capacity;   //bytes of the arena
+    int64_t used;
+    int64_t rawBytes;   //what the frames held weigh unpacked
+    int64_t duration;   //us from the first frame to the last
+    uint64_t frames;
+    uint64_t minFrames;
+    uint64_t refused;   //frames pushed into a full arena
+}SRBurstStats;
+
+/**
+ * SRBurstArena keeps the converted frames of a burst, in the order they come, in one block of memory reserved and
+ * touched by open(): pushing a frame never allocates nor faults a page in.\n
+ * Each frame is cut into horizontal bands, packed in parallel on the tiles of an SRTaskPool of its own: every row is
+ * replaced by its differences to the pixel on its left, then the zero runs are coded in one byte. Screen content is
+ * mostly flat and packs several times smaller, noise still takes at most 1/BURST_RUN more than the raw frame, so the
+ * arena holds a number of frames known up front.\n
+ * full() turns true while the arena can still take the frames in flight given to open(): the recorder ends the
+ * capture then, nothing captured before is left out. pop() unpacks the frames back, in order, once the burst ended.
+ *
+ * @Note push() and pop() from one thread only (the ProducerThread); 8 bit and 16 bit system memory frames
+ */
+class SRBurstArena {
+
+private:
+    struct Record {
+        int64_t pts;
+        void *opaque;   //the hints of the capture, kept as they are
+        size_t offset;
+    };
+
+    size_t capacity;
+    bool huge;
+    int tiles;
+    uint8_t *arena;
+    size_t used;
+    std::unique_ptr<SRTaskPool> pool;
+    SRFramePool framePool;
+
+    //geometry of the frames
+    int format;
+    int width;
+    int height;
+    int planes;
+    int rowBytes[4];
+    int planeHeight[4];
+    int step[4];
+    size_t rawFrame;
+    size_t worstFrame;
+    size_t headroom;
+
+    std::vector<std::vector<uint8_t>> scratch;  //worst case of each tile
+    std::vector<uint32_t> tileSizes;
+    std::vector<size_t> tileOffsets;
+    std::vector<Record> records;
+    size_t next;
+    uint64_t refused;
+
+    int firstRow(int plane, int tile) const { return (int) ((int64_t) planeHeight[plane] * tile / tiles); }
+    size_t tileBound(int tile) const;
+    size_t packTile(const AVFrame *frame, int tile, uint8_t *dst) const;
+    void unpackTile(const uint8_t *src, int tile, AVFrame *frame) const;
+
+public:
+    /**
+     * @param bytes size of the arena
+     * @param tiles bands of each frame packed in parallel, 0 for one per core
+     * @param huge the arena in huge pages, see numaAlloc()
+     */
+    SRBurstArena(int64_t bytes, int tiles, bool huge);
+    ~SRBurstArena();
+
+    SRBurstArena(const SRBurstArena&) = delete;
+    SRBurstArena &operator=(const SRBurstArena&) = delete;
+
+    /**
+     * open() reserves the arena and touches its pages, for frames of the given geometry
+     * @param inFlight frames that can still reach push() once the capture is asked to end
+     * @return 0 on success, AVERROR(ENOSPC) when the arena cannot take the frames in flight at the worst ratio,
+     * another negative AVERROR otherwise
+     */
+    int open(enum AVPixelFormat format, int width, int height, int inFlight);
+
+    /**
+     * push() packs frame at the end of the arena
+     * @return 0 on success, AVERROR(ENOSPC) once the arena is full, AVERROR(EINVAL) for a frame of another geometry
+     * @Note frame pts in microseconds on the capture clock, pts and opaque come back with the frame
+     */
+    int push(const AVFrame *frame);
+
+    /**
+     * full() tells the capture has to end: only the frames in flight fit in what is left
+     */
+    bool full() const { return capacity - used < headroom; }
+
+    /**
+     * pop() unpacks the oldest frame not read yet
+     * @return a frame of the pool, to give back to release(), nullptr once every frame was read
+     */
+    AVFrame *pop();
+
+    void release(AVFrame *frame) { framePool.release(frame); }
+
+    int tileCount() const { return tiles; }
+
+    SRBurstStats stats() const;
+};
+
+#endif //CPPSCREENRECORDER_SRBURSTARENA_H
@@ -0,0 +1,320 @@
+#include "SRCapabilityCache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+#include "libavutil/avutil.h"
+#include "libavutil/error.h"
+}
+
+#ifdef _WIN32
+#include <windows.h>
+#include <dxgi.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#endif
+#ifdef __APPLE__
+#include <CoreGraphics/CoreGraphics.h>
+#endif
+
+using namespace std;
+
+#define CAPS_HEADER_SIZE 32
+
+/* FNV-1a, 64 bit: the keys and the fingerprint only need to tell states apart */
+static void mix(uint64_t &hash, const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+}
+
+static void mix(uint64_t &hash, const string &text) {
+    mix(hash, text.data(), text.size());
+    mix(hash, "", 1);
+}
+
+static void mix(uint64_t &hash, int64_t value) {
+    mix(hash, &value, sizeof(value));
+}
+
+#ifndef _WIN32
+/* first bytes of a small file of /sys or /proc, empty if it is not there */
+static string readSmallFile(const string &path) {
+    char buffer[512];
+    FILE *file = fopen(path.c_str(), "r");
+    if (!file)
+        return "";
+    size_t size = fread(buffer, 1, sizeof(buffer), file);
+    fclose(file);
+    return string(buffer, size);
+}
+#endif
+
+#ifdef __linux__
+/* the DRM devices with their drivers, the connectors with their state and their modes */
+static void mixDrm(uint64_t &hash) {
+    DIR *dir = opendir("/sys/class/drm");
+    if (!dir)
+        return;
+    vector<string> names;
+    while (struct dirent *entry = readdir(dir))
+        if (!strncmp(entry->d_name, "card", 4))
+            names.push_back(entry->d_name);
+    closedir(dir);
+    //readdir() has no order, the fingerprint must
+    sort(names.begin(), names.end());
+    for (const string &name : names) {
+        string base = "/sys/class/drm/" + name;
+        mix(hash, name);
+        if (name.find('-') == string::npos) {
+            char driver[256];
+            ssize_t size = readlink((base + "/device/driver").c_str(), driver, sizeof(driver) - 1);
+            string module = size > 0 ? string(driver, size) : "";
+            module = module.substr(module.rfind('/') + 1);
+            mix(hash, readSmallFile(base + "/device/vendor"));
+            mix(hash, readSmallFile(base + "/device/device"));
+            mix(hash, module);
+            if (!module.empty())
+                mix(hash, readSmallFile("/sys/module/" + module + "/version"));
+        } else {
+            mix(hash, readSmallFile(base + "/status"));
+            mix(hash, readSmallFile(base + "/modes"));
+        }
+    }
+    mix(hash, readSmallFile("/proc/driver/nvidia/version"));
+}
+#endif
+
+#ifdef _WIN32
+/* the adapters with their driver versions, the outputs with their place on the desktop */
+static void mixDxgi(uint64_t &hash) {
+    IDXGIFactory1 *factory = nullptr;
+    if (FAILED(CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void **) &factory)))
+        return;
+    IDXGIAdapter1 *adapter = nullptr;
+    for (UINT i = 0; factory->EnumAdapters1(i, &adapter) != DXGI_ERROR_NOT_FOUND; i++) {
+        DXGI_ADAPTER_DESC1 desc;
+        LARGE_INTEGER driver;
+        driver.QuadPart = 0;
+        if (SUCCEEDED(adapter->GetDesc1(&desc))) {
+            mix(hash, (int64_t) desc.VendorId);
+            mix(hash, (int64_t) desc.DeviceId);
+            mix(hash, (int64_t) desc.Revision);
+        }
+        if (SUCCEEDED(adapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &driver)))
+            mix(hash, (int64_t) driver.QuadPart);
+        IDXGIOutput *output = nullptr;
+        for (UINT j = 0; adapter->EnumOutputs(j, &output) != DXGI_ERROR_NOT_FOUND; j++) {
+            DXGI_OUTPUT_DESC out;
+            if (SUCCEEDED(output->GetDesc(&out))) {
+                mix(hash, &out.DesktopCoordinates, sizeof(out.DesktopCoordinates));
+                mix(hash, (int64_t) out.Rotation);
+            }
+            output->Release();
+        }
+        adapter->Release();
+    }
+    factory->Release();
+}
+#endif
+
+uint64_t SRCapabilityCache::machineFingerprint() {
+    uint64_t hash = 14695981039346656037ULL;
+    mix(hash, (int64_t) avcodec_version());
+    mix(hash, (int64_t) avformat_version());
+    mix(hash, (int64_t) avutil_version());
+    mix(hash, string(avcodec_configuration()));
+#ifdef _WIN32
+    char host[MAX_COMPUTERNAME_LENGTH + 1];
+    DWORD size = sizeof(host);
+    if (GetComputerNameA(host, &size))
+        mix(hash, string(host, size));
+    mixDxgi(hash);
+    mix(hash, (int64_t) GetSystemMetrics(SM_CMONITORS));
+#else
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    mix(hash, string(host));
+    //the kernel carries the open drivers of Linux, the release the drivers of macOS
+    struct utsname system;
+    if (!uname(&system)) {
+        mix(hash, string(system.release));
+        mix(hash, string(system.version));
+    }
+    const char *display = getenv("DISPLAY"), *wayland = getenv("WAYLAND_DISPLAY");
+    mix(hash, string(display ? display : ""));
+    mix(hash, string(wayland ? wayland : ""));
+#endif
+#ifdef __linux__
+    mixDrm(hash);
+#endif
+#ifdef __APPLE__
+    CGDirectDisplayID displays[16];
+    uint32_t count = 0;
+    if (CGGetActiveDisplayList(16, displays, &count) == kCGErrorSuccess) {
+        for (uint32_t i = 0; i < count; i++) {
+            mix(hash, (int64_t) CGDisplayVendorNumber(displays[i]));
+            mix(hash, (int64_t) CGDisplayModelNumber(displays[i]));
+            mix(hash, (int64_t) CGDisplayPixelsWide(displays[i]));
+            mix(hash, (int64_t) CGDisplayPixelsHigh(displays[i]));
+        }
+    }
+#endif
+    return hash;
+}
+
+SRCapabilityCache::SRCapabilityCache(const char *path): path(path), fingerprint(0), dirty(false), counters() {}
+
+uint64_t SRCapabilityCache::hashKey(const char *key) {
+    uint64_t hash = 14695981039346656037ULL;
+    mix(hash, key, strlen(key));
+    return hash;
+}
+
+int SRCapabilityCache::load() {
+    fingerprint = machineFingerprint();
+    entries.clear();
+    const uint8_t *map = nullptr;
+    int64_t size = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    HANDLE mapping = nullptr;
+    LARGE_INTEGER length;
+    if (file != INVALID_HANDLE_VALUE && GetFileSizeEx(file, &length) && length.QuadPart >= CAPS_HEADER_SIZE &&
+        (mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr))) {
+        map = (const uint8_t *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        size = length.QuadPart;
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && !fstat(fd, &st) && st.st_size >= CAPS_HEADER_SIZE) {
+        void *view = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        map = view == MAP_FAILED ? nullptr : (const uint8_t *) view;
+        size = st.st_size;
+    }
+#endif
+
+    if (map) {
+        uint32_t version, count;
+        uint64_t print;
+        memcpy(&version, map + 8, 4);
+        memcpy(&count, map + 12, 4);
+        memcpy(&print, map + 16, 8);
+        bool valid = !memcmp(map, CAPS_MAGIC, 8) && version == CAPS_VERSION && count <= CAPS_ENTRIES &&
+                     size >= CAPS_HEADER_SIZE + (int64_t) count * (int64_t) sizeof(SRCapsEntry);
+        if (valid && print == fingerprint) {
+            entries.resize(count);
+            memcpy(entries.data(), map + CAPS_HEADER_SIZE, count * sizeof(SRCapsEntry));
+        } else {
+            //another driver, another display, another build: nothing of it holds
+            counters.invalidated = true;
+            dirty = true;
+        }
+    }
+#ifdef _WIN32
+    if (map)
+        UnmapViewOfFile(map);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+#else
+    if (map)
+        munmap((void *) map, (size_t) size);
+    if (fd >= 0)
+        close(fd);
+#endif
+    counters.entries = (int) entries.size();
+    return 0;
+}
+
+bool SRCapabilityCache::lookup(const char *key, SRCapsEntry &entry) {
+    uint64_t hash = hashKey(key);
+    for (const SRCapsEntry &e : entries) {
+        if (e.key != hash)
+            continue;
+        if (e.result < 0 && (int64_t) time(nullptr) - e.time > CAPS_FAILURE_TTL)
+            break;
+        entry = e;
+        counters.hits++;
+        return true;
+    }
+    counters.misses++;
+    return false;
+}
+
+void SRCapabilityCache::store(const char *key, int result, const int32_t *values, int count) {
+    SRCapsEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.key = hashKey(key);
+    entry.time = (int64_t) time(nullptr);
+    entry.result = result;
+    if (values)
+        memcpy(entry.values, values, FFMIN(count, CAPS_VALUES) * sizeof(int32_t));
+    for (SRCapsEntry &e : entries) {
+        if (e.key != entry.key)
+            continue;
+        //a success seen again changes nothing; a failure seen again is believed for another TTL from now
+        if (e.result == entry.result && !memcmp(e.values, entry.values, sizeof(entry.values)) &&
+            (e.result >= 0 || e.time == entry.time))
+            return;
+        e = entry;
+        dirty = true;
+        counters.stores++;
+        return;
+    }
+    if (entries.size() >= CAPS_ENTRIES)
+        entries.erase(min_element(entries.begin(), entries.end(),
+                                  [](const SRCapsEntry &a, const SRCapsEntry &b) { return a.time < b.time; }));
+    entries.push_back(entry);
+    counters.entries = (int) entries.size();
+    counters.stores++;
+    dirty = true;
+}
+
+int SRCapabilityCache::save() {
+    if (!dirty)
+        return 0;
+    uint8_t header[CAPS_HEADER_SIZE] = {0};
+    uint32_t version = CAPS_VERSION, count = (uint32_t) entries.size();
+    memcpy(header, CAPS_MAGIC, 8);
+    memcpy(header + 8, &version, 4);
+    memcpy(header + 12, &count, 4);
+    memcpy(header + 16, &fingerprint, 8);
+
+    string temporary = path + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (!file)
+        return AVERROR(errno);
+    bool written = fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+                   fwrite(entries.data(), sizeof(SRCapsEntry), count, file) == count;
+    written = !fclose(file) && written;
+#ifdef _WIN32
+    written = written && MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    written = written && !rename(temporary.c_str(), path.c_str());
+#endif
+    if (!written) {
+        remove(temporary.c_str());
+        return AVERROR(EIO);
+    }
+    dirty = false;
+    return 0;
+}
@@ -0,0 +1,102 @@
+//
+// Capability cache of the machine: what the device probes and the encoder trials found, for the next launch.
+//
+
+#ifndef CPPSCREENRECORDER_SRCAPABILITYCACHE_H
+#define CPPSCREENRECORDER_SRCAPABILITYCACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define CAPS_MAGIC "SRCAPS\0\0"     //8 bytes at the head of the file
+#define CAPS_VERSION 1      //layout of the file, an older one is started over
+#define CAPS_ENTRIES 256    //entries of a file, the oldest go first
+#define CAPS_VALUES 3       //parameters an entry remembers beside its result
+#define CAPS_FAILURE_TTL 86400  //s a failure is believed, from the last time it was seen
+
+/**
+ * An entry of the cache: the hash of its key, when it was found (s since 1970), the result (0 or a negative AVERROR)
+ * and the parameters that came with it. 32 bytes, the layout of the file.
+ */
+typedef struct CA{
+    uint64_t key;
+    int64_t time;
+    int32_t result;
+    int32_t values[CAPS_VALUES];
+}SRCapsEntry;
+
+/**
+ * Statistics of an SRCapabilityCache: the lookups answered and the ones that were not, the entries stored, and
+ * whether the file was thrown away at load for another machine state (fingerprint) or another layout.
+ */
+typedef struct CC{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stores;
+    int entries;
+    bool invalidated;
+}SRCapsStats;
+
+/**
+ * SRCapabilityCache keeps what a recorder learned about the machine from one launch to the next: the hardware devices
+ * that open, the encoders that fail in a configuration, the capture devices whose stream parameters a probe never
+ * changed. The next launch skips those probes and trial opens: a hardware encoder that is not there costs nothing
+ * instead of a device creation and a failed open each, a capture device opens without avformat_find_stream_info().\n
+ * The file is a fixed layout, memory-mapped at load: a 32 byte header (CAPS_MAGIC, CAPS_VERSION, the entry count
+ * and the fingerprint) and up to CAPS_ENTRIES SRCapsEntry, nothing to parse. The fingerprint hashes what the
+ * answers depend on: the libav* versions and configuration, the host, the GPU drivers (DXGI adapters and their
+ * driver versions on Windows, the DRM devices, their drivers and the NVIDIA version on Linux, the OS build on
+ * macOS) and the displays (outputs, modes and layout). Any change of them throws the whole file away.\n
+ * A success holds until then; a failure for CAPS_FAILURE_TTL s, what fails for a while is tried again.
+ * save() writes a temporary file renamed over the old one: a reader never maps half a file.
+ *
+ * @Note one thread: the recorder uses it while it opens
+ */
+class SRCapabilityCache {
+
+private:
+    std::string path;
+    uint64_t fingerprint;
+    std::vector<SRCapsEntry> entries;
+    bool dirty;
+    SRCapsStats counters;
+
+    static uint64_t hashKey(const char *key);
+
+public:
+    explicit SRCapabilityCache(const char *path);
+
+    /**
+     * load() maps the file and takes its entries when its layout and its fingerprint are the current ones
+     * @return 0: a missing, damaged or stale file only starts an empty cache
+     */
+    int load();
+
+    /**
+     * lookup() finds the entry of key still believed
+     * @return false if there is none, or a failure older than CAPS_FAILURE_TTL
+     */
+    bool lookup(const char *key, SRCapsEntry &entry);
+
+    /**
+     * store() remembers result and count values (CAPS_VALUES at most) for key
+     */
+    void store(const char *key, int result, const int32_t *values = nullptr, int count = 0);
+
+    /**
+     * save() writes the entries when they changed
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int save();
+
+    const std::string &name() const { return path; }
+    SRCapsStats stats() const { return counters; }
+
+    /**
+     * machineFingerprint() hashes the libraries, the host, the GPU drivers and the displays, as the class describes
+     */
+    static uint64_t machineFingerprint();
+};
+
+#endif //CPPSCREENRECORDER_SRCAPABILITYCACHE_H
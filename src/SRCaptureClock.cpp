@@ -0,0 +1,100 @@
+#define _USE_MATH_DEFINES
+#include "SRCaptureClock.h"
+
+#include <cmath>
+
+/* 1 - e^-x, to the precision the loop needs */
+static double qexpneg(double x) {
+    return 1 - 1 / (1 + x * (1 + x / 2 * (1 + x / 3)));
+}
+
+SRTimeFilter::SRTimeFilter(double unit, double period, double bandwidth): cycleTime(0), clockPeriod(unit), count(0) {
+    double o = 2 * M_PI * bandwidth * period * unit;
+    feedback2 = qexpneg(M_SQRT2 * o);
+    feedback3 = qexpneg(o * o) / period;
+}
+
+double SRTimeFilter::update(double systemTime, double period) {
+    count++;
+    if (count == 1) {
+        cycleTime = systemTime;
+    } else {
+        cycleTime += clockPeriod * period;
+        double loopError = systemTime - cycleTime;
+        //the first updates converge faster than the steady state bandwidth
+        cycleTime += (feedback2 > 1.0 / count ? feedback2 : 1.0 / count) * loopError;
+        clockPeriod += feedback3 * loopError;
+    }
+    return cycleTime;
+}
+
+void SRTimeFilter::reset() {
+    count = 0;
+}
+
+/* the nominal periods are replaced by configure(), the bandwidths follow libavdevice (1.5 Hz for audio) */
+SRCaptureClock::SRCaptureClock(): base(INT64_MIN), pausedAt(INT64_MIN), epoch(0), videoFilter(1.0 / 30, 1, 1.0),
+                                  audio(1, {SRTimeFilter(1.0 / 48000, 1024, 1.5), 0, 0}), videoEpoch(0) {}
+
+void SRCaptureClock::start(int64_t wallNow) {
+    int64_t unset = INT64_MIN;
+    if (base.compare_exchange_strong(unset, wallNow))
+        return;
+    int64_t paused = pausedAt.exchange(INT64_MIN);
+    if (paused == INT64_MIN)
+        return;
+    //the pause is shifted out of the origin, the filters must not see it as a late event
+    base.fetch_add(wallNow - paused);
+    epoch.fetch_add(1);
+}
+
+void SRCaptureClock::pause(int64_t wallNow) {
+    int64_t running = INT64_MIN;
+    if (started())
+        pausedAt.compare_exchange_strong(running, wallNow);
+}
+
+bool SRCaptureClock::started() const {
+    return base.load() != INT64_MIN;
+}
+
+int64_t SRCaptureClock::elapsed(int64_t wallNow) const {
+    return wallNow - base.load();
+}
+
+uint32_t SRCaptureClock::resumes() const {
+    return epoch.load();
+}
+
+void SRCaptureClock::configure(int fps, int sampleRate, int chunkSamples, int track) {
+    if (fps > 0) videoFilter = SRTimeFilter(1.0 / fps, 1, 1.0);
+    if (sampleRate <= 0)
+        return;
+    if ((int) audio.size() <= track)
+        audio.resize(track + 1, audio[0]);
+    audio[track] = {SRTimeFilter(1.0 / sampleRate, chunkSamples > 0 ? chunkSamples : 1024, 1.5), 0, epoch.load()};
+}
+
+int64_t SRCaptureClock::videoTime(int64_t deviceWall) {
+    uint32_t e = epoch.load();
+    if (e != videoEpoch) {
+        videoFilter.reset();
+        videoEpoch = e;
+    }
+    double t = videoFilter.update((deviceWall - base.load()) / 1e6, 1);
+    return (int64_t) llround(t * 1e6);
+}
+
+int64_t SRCaptureClock::audioTime(int64_t deviceWall, int nbSamples, int track) {
+    AudioStream &a = audio[track];
+    uint32_t e = epoch.load();
+    if (e != a.epoch) {
+        a.filter.reset();
+        a.epoch = e;
+        a.lastSamples = 0;
+    }
+    //the filter advances by the length of the previous chunk
+    double t = a.filter.update((deviceWall - base.load()) / 1e6, a.lastSamples);
+    a.lastSamples = nbSamples;
+    return (int64_t) llround(t * 1e6);
+}
@@ -0,0 +1,112 @@
+//
+// Shared capture clock: device timestamps of every stream smoothed onto one monotonic base.
+//
+
+#ifndef CPPSCREENRECORDER_SRCAPTURECLOCK_H
+#define CPPSCREENRECORDER_SRCAPTURECLOCK_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+ * SRTimeFilter is a second order delay locked loop (the time filter of libavdevice, see timefilter.c):
+ * it tracks a free running device clock and returns a jitter-free estimate of the time of each event.
+ */
+class SRTimeFilter {
+
+private:
+    double cycleTime;
+    double feedback2;
+    double feedback3;
+    double clockPeriod;
+    int count;
+
+public:
+    /**
+     * @param unit nominal duration of one unit of the update() periods, in seconds
+     * @param period typical number of units between two updates
+     * @param bandwidth loop bandwidth in Hz: lower values trust the nominal period more
+     */
+    SRTimeFilter(double unit, double period, double bandwidth);
+
+    /**
+     * update() feeds the observed time of an event, period units after the previous one
+     * @return the filtered time of the event, in seconds
+     */
+    double update(double systemTime, double period);
+
+    void reset();
+};
+
+/**
+ * SRCaptureClock maps the device timestamps of video and audio, which libavdevice and the native
+ * grabbers report on the wall clock (av_gettime()), onto microseconds since start():
+ * each stream goes through its own SRTimeFilter, so scheduling jitter of the capture threads
+ * does not end up in the timestamps and both streams share the same origin.\n
+ * The time between pause() and the next start() is cut out of the timeline, and the filters
+ * restart on resume, so a paused recording plays and seeks without a gap.
+ */
+class SRCaptureClock {
+
+private:
+    std::atomic<int64_t> base;
+    std::atomic<int64_t> pausedAt;
+    std::atomic<uint32_t> epoch;    //resumes so far, the filters restart when it changes
+    //the filter of an audio track, the chunk it last advanced by and the resumes it has seen
+    struct AudioStream {
+        SRTimeFilter filter;
+        int lastSamples;
+        uint32_t epoch;
+    };
+
+    SRTimeFilter videoFilter;
+    std::vector<AudioStream> audio;
+    uint32_t videoEpoch;
+
+public:
+    SRCaptureClock();
+
+    /**
+     * start() sets the origin of the capture timeline on the first call, later calls resume after pause()
+     */
+    void start(int64_t wallNow);
+
+    /**
+     * pause() freezes the timeline: device time from now to the next start() is not counted
+     */
+    void pause(int64_t wallNow);
+
+    bool started() const;
+
+    /**
+     * elapsed() is the position of wallNow on the capture timeline, in microseconds
+     */
+    int64_t elapsed(int64_t wallNow) const;
+
+    /**
+     * resumes() counts the start() calls that ended a pause
+     */
+    uint32_t resumes() const;
+
+    /**
+     * configure() sets the nominal frame duration, and sample rate and chunk size of the filter of audio track
+     * @Note before the capture threads start, every audio track is configured once
+     */
+    void configure(int fps, int sampleRate, int chunkSamples, int track = 0);
+
+    /**
+     * videoTime() is the smoothed capture time of a video frame, in microseconds
+     * @Note VideoThread only
+     */
+    int64_t videoTime(int64_t deviceWall);
+
+    /**
+     * audioTime() is the smoothed capture time of the first sample of a chunk of nbSamples samples,
+     * in microseconds
+     * @Note AudioThread of the track only
+     */
+    int64_t audioTime(int64_t deviceWall, int nbSamples, int track = 0);
+};
+
+#endif //CPPSCREENRECORDER_SRCAPTURECLOCK_H
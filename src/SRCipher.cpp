@@ -0,0 +1,236 @@
+#include "SRCipher.h"
+
+#include <cstring>
+
+extern "C"
+{
+#include "libavutil/aes.h"
+#include "libavutil/bswap.h"
+#include "libavutil/common.h"
+#include "libavutil/cpu.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/mem.h"
+#include "libavutil/random_seed.h"
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(AV_CPU_FLAG_AESNI)
+#include <immintrin.h>
+#define SR_HAVE_AESNI 1
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#include <arm_neon.h>
+#define SR_HAVE_ARMV8_AES 1
+#endif
+
+#define CIPHER_LANES 8  //blocks in flight: the AES instructions are pipelined, one block alone waits on each round
+#define CIPHER_C_BLOCKS 64  //counter blocks libavutil encrypts in one call
+
+/* the AES S-box, from the inverses of GF(2^8) and the affine map, for the key schedule */
+static const uint8_t *sbox() {
+    static const struct SB {
+        uint8_t s[256];
+        SB() {
+            uint8_t p = 1, q = 1;
+            do {
+                //p runs over the multiplicative group by powers of 3, q over the inverses
+                p = (uint8_t) (p ^ (p << 1) ^ (p & 0x80 ? 0x1b : 0));
+                q ^= (uint8_t) (q << 1);
+                q ^= (uint8_t) (q << 2);
+                q ^= (uint8_t) (q << 4);
+                if (q & 0x80)
+                    q ^= 0x09;
+                uint8_t x = q;
+                for (int r = 1; r < 5; r++)
+                    x ^= (uint8_t) ((q << r) | (q >> (8 - r)));
+                s[p] = x ^ 0x63;
+            } while (p != 1);
+            s[0] = 0x63;
+        }
+    } table;
+    return table.s;
+}
+
+/* FIPS-197 key expansion: 11 round keys of 16 bytes, in the byte order both instruction sets load */
+static void expandKey(const uint8_t *key, uint8_t *roundKeys) {
+    static const uint8_t rcon[10] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36};
+    const uint8_t *s = sbox();
+    memcpy(roundKeys, key, CIPHER_KEY_SIZE);
+    for (int i = 4; i < 44; i++) {
+        uint8_t t[4];
+        memcpy(t, roundKeys + 4 * (i - 1), 4);
+        if (i % 4 == 0) {
+            uint8_t first = t[0];
+            t[0] = (uint8_t) (s[t[1]] ^ rcon[i / 4 - 1]);
+            t[1] = s[t[2]];
+            t[2] = s[t[3]];
+            t[3] = s[first];
+        }
+        for (int b = 0; b < 4; b++)
+            roundKeys[4 * i + b] = roundKeys[4 * (i - 4) + b] ^ t[b];
+    }
+}
+
+static void ctrC(const uint8_t *roundKeys, const uint8_t *nonce, struct AVAES *aes, uint8_t *data, size_t blocks,
+                 uint64_t first) {
+    (void) roundKeys;
+    uint8_t counters[CIPHER_C_BLOCKS * 16], stream[CIPHER_C_BLOCKS * 16];
+    while (blocks > 0) {
+        int n = (int) FFMIN(blocks, (size_t) CIPHER_C_BLOCKS);
+        for (int i = 0; i < n; i++) {
+            memcpy(counters + 16 * i, nonce, CIPHER_NONCE_SIZE);
+            AV_WB64(counters + 16 * i + 8, first + i);
+        }
+        av_aes_crypt(aes, stream, counters, n, nullptr, 0);
+        for (int i = 0; i < 16 * n; i++)
+            data[i] ^= stream[i];
+        data += 16 * n;
+        first += n;
+        blocks -= n;
+    }
+}
+
+#ifdef SR_HAVE_AESNI
+__attribute__((target("aes")))
+static void ctrAESNI(const uint8_t *roundKeys, const uint8_t *nonce, struct AVAES *aes, uint8_t *data, size_t blocks,
+                     uint64_t first) {
+    (void) aes;
+    __m128i rk[11];
+    for (int r = 0; r < 11; r++)
+        rk[r] = _mm_load_si128((const __m128i *) (roundKeys + 16 * r));
+    //the counter block is nonce || first big-endian: x86 stores the low quadword first
+    int64_t high = (int64_t) AV_RN64(nonce);
+    //a constant count keeps the lanes in registers, the tail goes one block at a time
+    for (; blocks >= CIPHER_LANES; blocks -= CIPHER_LANES, first += CIPHER_LANES, data += 16 * CIPHER_LANES) {
+        __m128i b[CIPHER_LANES];
+        for (int i = 0; i < CIPHER_LANES; i++)
+            b[i] = _mm_xor_si128(_mm_set_epi64x((int64_t) av_bswap64(first + i), high), rk[0]);
+        for (int r = 1; r < 10; r++)
+            for (int i = 0; i < CIPHER_LANES; i++)
+                b[i] = _mm_aesenc_si128(b[i], rk[r]);
+        for (int i = 0; i < CIPHER_LANES; i++) {
+            __m128i *p = (__m128i *) (data + 16 * i);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), _mm_aesenclast_si128(b[i], rk[10])));
+        }
+    }
+    for (; blocks > 0; blocks--, first++, data += 16) {
+        __m128i b = _mm_xor_si128(_mm_set_epi64x((int64_t) av_bswap64(first), high), rk[0]);
+        for (int r = 1; r < 10; r++)
+            b = _mm_aesenc_si128(b, rk[r]);
+        _mm_storeu_si128((__m128i *) data, _mm_xor_si128(_mm_loadu_si128((const __m128i *) data), _mm_aesenclast_si128(b, rk[10])));
+    }
+}
+#endif
+
+#ifdef SR_HAVE_ARMV8_AES
+static void ctrARMv8(const uint8_t *roundKeys, const uint8_t *nonce, struct AVAES *aes, uint8_t *data, size_t blocks,
+                     uint64_t first) {
+    (void) aes;
+    uint8x16_t rk[11];
+    for (int r = 0; r < 11; r++)
+        rk[r] = vld1q_u8(roundKeys + 16 * r);
+    uint8_t counter[16];
+    memcpy(counter, nonce, CIPHER_NONCE_SIZE);
+    //AESE adds the round key before the substitution: the last key is a plain xor
+    for (; blocks >= CIPHER_LANES; blocks -= CIPHER_LANES, first += CIPHER_LANES, data += 16 * CIPHER_LANES) {
+        uint8x16_t b[CIPHER_LANES];
+        for (int i = 0; i < CIPHER_LANES; i++) {
+            AV_WB64(counter + 8, first + i);
+            b[i] = vld1q_u8(counter);
+        }
+        for (int r = 0; r < 9; r++)
+            for (int i = 0; i < CIPHER_LANES; i++)
+                b[i] = vaesmcq_u8(vaeseq_u8(b[i], rk[r]));
+        for (int i = 0; i < CIPHER_LANES; i++)
+            vst1q_u8(data + 16 * i, veorq_u8(vld1q_u8(data + 16 * i), veorq_u8(vaeseq_u8(b[i], rk[9]), rk[10])));
+    }
+    for (; blocks > 0; blocks--, first++, data += 16) {
+        AV_WB64(counter + 8, first);
+        uint8x16_t b = vld1q_u8(counter);
+        for (int r = 0; r < 9; r++)
+            b = vaesmcq_u8(vaeseq_u8(b, rk[r]));
+        vst1q_u8(data, veorq_u8(vld1q_u8(data), veorq_u8(vaeseq_u8(b, rk[9]), rk[10])));
+    }
+}
+#endif
+
+SRCipher::SRCipher(const uint8_t key[CIPHER_KEY_SIZE]): nonce(), aes(av_aes_alloc()), kernel(ctrC), kernelName("C") {
+    expandKey(key, roundKeys);
+    if (aes)
+        av_aes_init(aes, key, 128, 0);
+#ifdef SR_HAVE_AESNI
+    if (av_get_cpu_flags() & AV_CPU_FLAG_AESNI)
+        kernel = ctrAESNI, kernelName = "AES-NI";
+#endif
+#ifdef SR_HAVE_ARMV8_AES
+    kernel = ctrARMv8, kernelName = "ARMv8";
+#endif
+    if (kernel == ctrC)
+        return;
+    //FIPS-197 C.1: the counter nonce || first is its plaintext block
+    static const uint8_t testKey[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                        0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+    static const uint8_t testNonce[8] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77};
+    static const uint8_t expected[16] = {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+                                         0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a};
+    alignas(16) uint8_t testKeys[176];
+    uint8_t block[16] = {0};
+    expandKey(testKey, testKeys);
+    kernel(testKeys, testNonce, nullptr, block, 1, 0x8899aabbccddeeffULL);
+    if (memcmp(block, expected, sizeof(block)))
+        kernel = ctrC, kernelName = "C";
+}
+
+SRCipher::~SRCipher() {
+    av_freep(&aes);
+}
+
+void SRCipher::restart(uint8_t *header) {
+    AV_WB32(nonce, av_get_random_seed());
+    AV_WB32(nonce + 4, av_get_random_seed());
+    memset(header, 0, CIPHER_HEADER_SIZE);
+    memcpy(header, CIPHER_MAGIC, 8);
+    memcpy(header + 8, nonce, CIPHER_NONCE_SIZE);
+    //the key check is the key encrypting the zero block: the counter of block 0 is nonce || 0, never zero in full
+    uint8_t check[16] = {0};
+    uint8_t zero[CIPHER_NONCE_SIZE] = {0};
+    kernel(roundKeys, zero, aes, check, 1, 0);
+    memcpy(header + 16, check, 4);
+}
+
+void SRCipher::apply(uint8_t *data, size_t size, int64_t offset) const {
+    //a head or a tail off the block grid goes through a block of its own
+    while (size > 0) {
+        uint64_t block = (uint64_t) offset / 16;
+        size_t skip = (size_t) (offset % 16);
+        if (skip || size < 16) {
+            uint8_t partial[16] = {0};
+            size_t n = FFMIN(size, 16 - skip);
+            memcpy(partial + skip, data, n);
+            kernel(roundKeys, nonce, aes, partial, 1, block);
+            memcpy(data, partial + skip, n);
+            data += n;
+            offset += n;
+            size -= n;
+            continue;
+        }
+        size_t blocks = size / 16;
+        kernel(roundKeys, nonce, aes, data, blocks, block);
+        data += 16 * blocks;
+        offset += 16 * blocks;
+        size -= 16 * blocks;
+    }
+}
+
+bool SRCipher::parseKey(const char *hex, uint8_t key[CIPHER_KEY_SIZE]) {
+    if (!hex || strlen(hex) != 2 * CIPHER_KEY_SIZE)
+        return false;
+    for (int i = 0; i < 2 * CIPHER_KEY_SIZE; i++) {
+        char c = hex[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (v < 0)
+            return false;
+        key[i / 2] = (uint8_t) (i % 2 ? (key[i / 2] << 4) | v : v);
+    }
+    return true;
+}
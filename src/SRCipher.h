@@ -0,0 +1,70 @@
+//
+// AES-128-CTR encryption of the recording at rest, with the AES instructions of the CPU when it has them.
+//
+
+#ifndef CPPSCREENRECORDER_SRCIPHER_H
+#define CPPSCREENRECORDER_SRCIPHER_H
+
+#include <cstddef>
+#include <cstdint>
+
+struct AVAES;
+
+#define CIPHER_KEY_SIZE 16  //bytes of an AES-128 key
+#define CIPHER_NONCE_SIZE 8     //bytes of the IV chosen for each file, the other 8 count the blocks
+#define CIPHER_HEADER_SIZE 4096     //bytes in front of an encrypted file, ASYNC_ALIGNMENT keeps direct I/O aligned
+#define CIPHER_MAGIC "SRCRYPT1"
+
+/**
+ * SRCipher encrypts a file in AES-128-CTR. The keystream of each byte depends only on its offset: the file can be
+ * written in any order, its header patched by a seek back, and decrypted from anywhere. Each file gets a random
+ * nonce; block n of the file has the counter nonce || n, big-endian, which is the counter of
+ * openssl enc -aes-128-ctr with -iv nonce0000000000000000.\n
+ * The encrypted file starts with CIPHER_HEADER_SIZE bytes, of which the first 28 are used: CIPHER_MAGIC, the nonce,
+ * the key check (the first 4 bytes of the key encrypting a zero block) and 0 for the format flags; the rest
+ * is zero. The content follows, encrypted, at its own offsets plus CIPHER_HEADER_SIZE, so
+ * tail -c +4097 file | openssl enc -d -aes-128-ctr -K key -iv nonce0000000000000000 decrypts it.\n
+ * The rounds run with AES-NI on x86 (picked at runtime) and the ARMv8 crypto extension on ARM (when built for it),
+ * 8 blocks at a time, or through libavutil otherwise; a known answer test falls back to libavutil if they disagree.
+ * The CTR mode has no integrity check of its own: the containers detect damaged packets, not forged ones.
+ */
+class SRCipher {
+
+private:
+    alignas(16) uint8_t roundKeys[176];
+    uint8_t nonce[CIPHER_NONCE_SIZE];
+    struct AVAES *aes;
+    void (*kernel)(const uint8_t *roundKeys, const uint8_t *nonce, struct AVAES *aes, uint8_t *data, size_t blocks,
+                   uint64_t first);
+    const char *kernelName;
+
+public:
+    explicit SRCipher(const uint8_t key[CIPHER_KEY_SIZE]);
+    ~SRCipher();
+
+    SRCipher(const SRCipher&) = delete;
+    SRCipher &operator=(const SRCipher&) = delete;
+
+    /**
+     * restart() draws the nonce of the next file and writes its header into header, CIPHER_HEADER_SIZE bytes
+     */
+    void restart(uint8_t *header);
+
+    /**
+     * apply() encrypts, or decrypts, the size bytes of data found at offset of the content
+     */
+    void apply(uint8_t *data, size_t size, int64_t offset) const;
+
+    /**
+     * name() is the kernel running the rounds: "AES-NI", "ARMv8" or "C"
+     */
+    const char *name() const { return kernelName; }
+
+    /**
+     * parseKey() reads the 32 hex digits of a key
+     * @return false if hex is not one
+     */
+    static bool parseKey(const char *hex, uint8_t key[CIPHER_KEY_SIZE]);
+};
+
+#endif //CPPSCREENRECORDER_SRCIPHER_H
@@ -0,0 +1,496 @@
+#include "SRClip.h"
+#include "SRKeyIndex.h"
+#include "SRLog.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+extern "C"
+{
+#include "libavutil/file.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/opt.h"
+}
+
+using namespace std;
+
+static int64_t ptsOf(const AVPacket *pkt) {
+    return pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+}
+
+static bool nalCodec(enum AVCodecID id) {
+    return id == AV_CODEC_ID_H264 || id == AV_CODEC_ID_HEVC;
+}
+
+/**
+ * appendNal() writes a NAL unit with a start code, or with its size on lengthSize bytes
+ */
+static void appendNal(std::vector<uint8_t> &out, const uint8_t *nal, size_t size, int lengthSize) {
+    if (lengthSize) {
+        for (int i = lengthSize - 1; i >= 0; i--)
+            out.push_back((uint8_t) (size >> (8 * i)));
+    } else {
+        static const uint8_t startCode[4] = {0, 0, 0, 1};
+        out.insert(out.end(), startCode, startCode + 4);
+    }
+    out.insert(out.end(), nal, nal + size);
+}
+
+/**
+ * reframe() splits the start code delimited NAL units of data and writes them with their size on lengthSize bytes
+ */
+static void reframe(const uint8_t *data, size_t size, int lengthSize, std::vector<uint8_t> &out) {
+    size_t i = 0, nal = SIZE_MAX;
+    while (i + 3 <= size) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            if (nal != SIZE_MAX) {
+                //the zero of a 4 byte start code belongs to the next one
+                size_t last = i;
+                while (last > nal && data[last - 1] == 0)
+                    last--;
+                appendNal(out, data + nal, last - nal, lengthSize);
+            }
+            i += 3;
+            nal = i;
+        } else
+            i++;
+    }
+    if (nal != SIZE_MAX && nal < size)
+        appendNal(out, data + nal, size - nal, lengthSize);
+}
+
+/**
+ * readParameterSets() takes the parameter sets out of the avcC or hvcC extradata of par, in the framing of its
+ * packets; Annex B extradata is already in it
+ * @return the bytes of the NAL sizes of the packets, 0 for start codes, -1 when the extradata cannot be read
+ */
+static int readParameterSets(const AVCodecParameters *par, std::vector<uint8_t> &sets) {
+    const uint8_t *p = par->extradata, *end = p + par->extradata_size;
+    sets.clear();
+    if (par->extradata_size < 4)
+        return -1;
+    if (p[0] != 1) {
+        sets.assign(p, end);
+        return 0;
+    }
+    int lengthSize;
+    if (par->codec_id == AV_CODEC_ID_H264) {
+        if (par->extradata_size < 7)
+            return -1;
+        lengthSize = (p[4] & 3) + 1;
+        //the SPS then the PPS, each list with its count
+        p += 5;
+        for (int list = 0; list < 2 && p < end; list++) {
+            int count = list ? *p++ : *p++ & 0x1f;
+            for (int i = 0; i < count; i++) {
+                if (end - p < 2 || end - p - 2 < AV_RB16(p))
+                    return -1;
+                appendNal(sets, p + 2, AV_RB16(p), lengthSize);
+                p += 2 + AV_RB16(p);
+            }
+        }
+    } else {
+        if (par->extradata_size < 23)
+            return -1;
+        lengthSize = (p[21] & 3) + 1;
+        //arrays of VPS, SPS, PPS and SEI
+        int arrays = p[22];
+        p += 23;
+        for (int a = 0; a < arrays; a++) {
+            if (end - p < 3)
+                return -1;
+            int count = AV_RB16(p + 1);
+            p += 3;
+            for (int i = 0; i < count; i++) {
+                if (end - p < 2 || end - p - 2 < AV_RB16(p))
+                    return -1;
+                appendNal(sets, p + 2, AV_RB16(p), lengthSize);
+                p += 2 + AV_RB16(p);
+            }
+        }
+    }
+    return lengthSize;
+}
+
+SRClip::SRClip(int crf): crf(crf), in(nullptr), out(nullptr), decoder(nullptr), encoder(nullptr), encoderFailed(false),
+                         encoded(nullptr), frame(nullptr), videoIndex(-1), startTs(0), endTs(0), delay(0),
+                         lengthSize(0), injectNext(false), counters() {}
+
+SRClip::~SRClip() {
+    closeAll();
+}
+
+void SRClip::closeAll() {
+    avcodec_free_context(&encoder);
+    avcodec_free_context(&decoder);
+    av_packet_free(&encoded);
+    av_frame_free(&frame);
+    if (out) {
+        if (!(out->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&out->pb);
+        avformat_free_context(out);
+        out = nullptr;
+    }
+    avformat_close_input(&in);
+}
+
+/**
+ * openInput() opens the recording and its decoder, and seeks to the keyframe at or before start: to its byte
+ * in the keyframe index when the demuxer seeks by bytes, through the demuxer otherwise
+ */
+int SRClip::openInput(const char *input, const char *index, int64_t start) {
+    int ret = avformat_open_input(&in, input, nullptr, nullptr);
+    if (ret < 0 || (ret = avformat_find_stream_info(in, nullptr)) < 0) {
+        cout << "\n[SRClip] cannot read " << input;
+        return ret;
+    }
+    videoIndex = av_find_best_stream(in, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (videoIndex < 0) {
+        cout << "\n[SRClip] no video in " << input;
+        return videoIndex;
+    }
+    AVStream *st = in->streams[videoIndex];
+    const AVCodec *codec = avcodec_find_decoder(st->codecpar->codec_id);
+    decoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+    ret = decoder ? avcodec_parameters_to_context(decoder, st->codecpar) : AVERROR_DECODER_NOT_FOUND;
+    if (ret >= 0)
+        ret = avcodec_open2(decoder, codec, nullptr);
+    if (ret < 0) {
+        cout << "\n[SRClip] cannot decode the video of " << input;
+        return ret;
+    }
+    if (nalCodec(st->codecpar->codec_id))
+        lengthSize = FFMAX(readParameterSets(st->codecpar, parameterSets), 0);
+
+    int64_t first = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    startTs = first + av_rescale_q(start, AV_TIME_BASE_Q, st->time_base);
+    std::string indexPath = index ? index : std::string(input) + ".idx";
+    uint8_t *map = nullptr;
+    size_t size = 0;
+    bool seeked = false;
+    if (av_file_map(indexPath.c_str(), &map, &size, 0, nullptr) >= 0) {
+        //the index counts from its first keyframe, the first packet of the recording
+        const SRKeyIndexHeader *header = (const SRKeyIndexHeader *) map;
+        const SRKeyIndexEntry *head = SRKeyIndex::find(map, size, INT64_MIN), *entry = nullptr;
+        if (head && !(header->flags & KEYINDEX_SEGMENTED))
+            entry = SRKeyIndex::find(map, size, head->pts + start);
+        if (entry && entry->offset >= 0)
+            seeked = av_seek_frame(in, -1, entry->offset, AVSEEK_FLAG_BYTE) >= 0;
+        av_file_unmap(map, size);
+    }
+    if (!seeked && (ret = avformat_seek_file(in, videoIndex, INT64_MIN, startTs, startTs, 0)) < 0) {
+        cout << "\n[SRClip] cannot seek " << input;
+        return ret;
+    }
+    return 0;
+}
+
+int SRClip::openOutput(const char *output) {
+    int ret = avformat_alloc_output_context2(&out, nullptr, nullptr, output);
+    if (ret < 0)
+        return ret;
+    streamMap.assign(in->nb_streams, -1);
+    for (unsigned int i = 0; i < in->nb_streams; i++) {
+        AVStream *from = in->streams[i];
+        if ((int) i != videoIndex && from->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+            continue;
+        AVStream *st = avformat_new_stream(out, nullptr);
+        if (!st || (ret = avcodec_parameters_copy(st->codecpar, from->codecpar)) < 0)
+            return st ? ret : AVERROR(ENOMEM);
+        st->codecpar->codec_tag = 0;
+        st->time_base = from->time_base;
+        streamMap[i] = st->index;
+    }
+    if (!(out->oformat->flags & AVFMT_NOFILE) && (ret = avio_open2(&out->pb, output, AVIO_FLAG_WRITE, nullptr, nullptr)) < 0)
+        return ret;
+    return avformat_write_header(out, nullptr);
+}
+
+/**
+ * writeVideo() moves a copied or encoded video packet to the output, on the clip timeline
+ */
+int SRClip::writeVideo(AVPacket *pkt) {
+    AVStream *st = in->streams[videoIndex];
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts -= startTs;
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts -= startTs;
+    pkt->stream_index = streamMap[videoIndex];
+    av_packet_rescale_ts(pkt, st->time_base, out->streams[pkt->stream_index]->time_base);
+    return av_interleaved_write_frame(out, pkt);
+}
+
+/**
+ * openEncoder() opens the encoder of the recording's codec for frames like first, with its profile and no B-frame:
+ * an encoded frame is never reordered, its dts is its pts less the delay of the copied GOPs
+ */
+int SRClip::openEncoder(const AVFrame *first) {
+    AVStream *st = in->streams[videoIndex];
+    enum AVCodecID id = st->codecpar->codec_id;
+    const AVCodec *codec = id == AV_CODEC_ID_H264 ? avcodec_find_encoder_by_name("libx264") :
+                           id == AV_CODEC_ID_HEVC ? avcodec_find_encoder_by_name("libx265") : avcodec_find_encoder(id);
+    encoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+    if (!encoder) {
+        encoderFailed = true;
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    encoder->width = first->width;
+    encoder->height = first->height;
+    encoder->pix_fmt = (enum AVPixelFormat) first->format;
+    encoder->sample_aspect_ratio = first->sample_aspect_ratio;
+    encoder->color_range = first->color_range;
+    encoder->colorspace = first->colorspace;
+    encoder->color_primaries = first->color_primaries;
+    encoder->color_trc = first->color_trc;
+    encoder->time_base = st->time_base;
+    encoder->framerate = av_guess_frame_rate(in, st, nullptr);
+    encoder->max_b_frames = 0;
+    //no global header: the parameter sets of the encoded GOPs go in band, the extradata stays the recording's
+    if (id == AV_CODEC_ID_H264 || id == AV_CODEC_ID_HEVC) {
+        encoder->profile = st->codecpar->profile;
+        encoder->level = st->codecpar->level;
+        av_opt_set(encoder->priv_data, "preset", CLIP_PRESET, 0);
+        av_opt_set_int(encoder->priv_data, "crf", crf, 0);
+    } else {
+        encoder->flags |= AV_CODEC_FLAG_QSCALE;
+        encoder->global_quality = FF_QP2LAMBDA * CLIP_QSCALE;
+    }
+    int ret = avcodec_open2(encoder, codec, nullptr);
+    if (ret < 0) {
+        encoderFailed = true;
+        avcodec_free_context(&encoder);
+    }
+    return ret;
+}
+
+/**
+ * writeEncoded() gives frame to the encoder, nullptr drains it, and writes the packets it has ready
+ */
+int SRClip::writeEncoded(AVFrame *frame) {
+    int ret = avcodec_send_frame(encoder, frame);
+    std::vector<uint8_t> data;
+    while (ret >= 0 && (ret = avcodec_receive_packet(encoder, encoded)) >= 0) {
+        if (lengthSize) {
+            //the encoders write start codes, the container of the recording has sizes
+            data.clear();
+            reframe(encoded->data, encoded->size, lengthSize, data);
+            AVPacket *framed = av_packet_alloc();
+            if (!framed || (ret = av_new_packet(framed, (int) data.size())) < 0) {
+                av_packet_free(&framed);
+                return ret < 0 ? ret : AVERROR(ENOMEM);
+            }
+            memcpy(framed->data, data.data(), data.size());
+            av_packet_copy_props(framed, encoded);
+            av_packet_unref(encoded);
+            av_packet_move_ref(encoded, framed);
+            av_packet_free(&framed);
+        }
+        encoded->dts = encoded->pts - delay;
+        ret = writeVideo(encoded);
+        av_packet_unref(encoded);
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+void SRClip::closeEncoder() {
+    if (!encoder)
+        return;
+    writeEncoded(nullptr);
+    avcodec_free_context(&encoder);
+    //the copied GOPs refer to the parameter sets of the recording, the decoders saw the encoder's last
+    injectNext = true;
+}
+
+int SRClip::copyGop(std::vector<AVPacket*> &gop) {
+    closeEncoder();
+    int ret = 0;
+    for (AVPacket *pkt : gop) {
+        if (injectNext && (pkt->flags & AV_PKT_FLAG_KEY) && !parameterSets.empty()) {
+            AVPacket *sets = av_packet_alloc();
+            if (!sets || (ret = av_new_packet(sets, (int) parameterSets.size() + pkt->size)) < 0) {
+                av_packet_free(&sets);
+                return ret < 0 ? ret : AVERROR(ENOMEM);
+            }
+            memcpy(sets->data, parameterSets.data(), parameterSets.size());
+            memcpy(sets->data + parameterSets.size(), pkt->data, pkt->size);
+            av_packet_copy_props(sets, pkt);
+            av_packet_unref(pkt);
+            av_packet_move_ref(pkt, sets);
+            av_packet_free(&sets);
+        }
+        injectNext = false;
+        if ((ret = writeVideo(pkt)) < 0)
+            return ret;
+        counters.copiedPackets++;
+    }
+    counters.copiedGops++;
+    return 0;
+}
+
+/**
+ * encodeGop() decodes a GOP the range cuts and encodes its frames inside the range; consecutive partial GOPs share
+ * the encoder, which starts with a keyframe
+ */
+int SRClip::encodeGop(std::vector<AVPacket*> &gop) {
+    avcodec_flush_buffers(decoder);
+    int ret = 0;
+    bool encodedAny = false;
+    for (size_t i = 0; i <= gop.size() && ret >= 0; i++) {
+        ret = avcodec_send_packet(decoder, i < gop.size() ? gop[i] : nullptr);
+        while (ret >= 0 && (ret = avcodec_receive_frame(decoder, frame)) >= 0) {
+            int64_t pts = frame->best_effort_timestamp;
+            if (pts >= startTs && pts < endTs) {
+                if (!encoder && (ret = openEncoder(frame)) < 0)
+                    break;
+                frame->pts = pts;
+                frame->pict_type = AV_PICTURE_TYPE_NONE;
+                ret = writeEncoded(frame);
+                counters.encodedFrames++;
+                encodedAny = true;
+            }
+            av_frame_unref(frame);
+        }
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            ret = 0;
+    }
+    if (encodedAny)
+        counters.encodedGops++;
+    return ret;
+}
+
+/**
+ * processGop() copies a GOP that the range holds whole and encodes again the frames of one it cuts
+ * @param gopEnd pts of the next keyframe, INT64_MAX at the end of the recording
+ */
+int SRClip::processGop(std::vector<AVPacket*> &gop, int64_t gopEnd) {
+    int64_t gopStart = ptsOf(gop.front());
+    int ret;
+    if (gopStart >= endTs || gopEnd <= startTs)
+        ret = 0;
+    else if (gopStart >= startTs && gopEnd <= endTs)
+        ret = copyGop(gop);
+    else {
+        ret = encoderFailed ? 0 : encodeGop(gop);
+        if (encoderFailed) {
+            //nothing of the GOP went out, the encoder fails on its first frame
+            if (!counters.widenedGops)
+                cout << "\n[SRClip] cannot encode " << avcodec_get_name(in->streams[videoIndex]->codecpar->codec_id)
+                     << ": the clip is widened to the keyframes around the range";
+            counters.widenedGops++;
+            ret = copyGop(gop);
+        }
+    }
+    for (AVPacket *pkt : gop)
+        av_packet_free(&pkt);
+    gop.clear();
+    return ret;
+}
+
+int SRClip::run(const char *input, int64_t start, int64_t end, const char *output, const char *index) {
+    if (start < 0 || end <= start) {
+        cout << "\n[SRClip] empty range";
+        return AVERROR(EINVAL);
+    }
+    closeAll();
+    counters = SRClipStats();
+    encoderFailed = injectNext = false;
+    parameterSets.clear();
+    lengthSize = 0;
+    delay = AV_NOPTS_VALUE;
+    encoded = av_packet_alloc();
+    frame = av_frame_alloc();
+    AVPacket *pkt = av_packet_alloc();
+    int ret = encoded && frame && pkt ? openInput(input, index, start) : AVERROR(ENOMEM);
+    if (ret >= 0) {
+        AVStream *st = in->streams[videoIndex];
+        endTs = end == INT64_MAX ? INT64_MAX : startTs + av_rescale_q(end - start, AV_TIME_BASE_Q, st->time_base);
+        if ((ret = openOutput(output)) < 0)
+            cout << "\n[SRClip] cannot create " << output;
+    }
+
+    //the video is held a GOP at a time: it is copied once the next keyframe shows where it ends
+    std::vector<AVPacket*> gop;
+    std::vector<bool> past(in ? in->nb_streams : 0, false);
+    bool videoDone = false;
+    while (ret >= 0) {
+        bool done = videoDone;
+        for (size_t i = 0; i < past.size() && done; i++)
+            done = streamMap[i] < 0 || (int) i == videoIndex || past[i];
+        if (done)
+            break;
+        if (av_read_frame(in, pkt) < 0) {
+            if (!gop.empty())
+                ret = processGop(gop, INT64_MAX);
+            break;
+        }
+        int i = pkt->stream_index;
+        if (i >= (int) streamMap.size() || streamMap[i] < 0 || past[i]) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        AVStream *st = in->streams[i];
+        int64_t pts = ptsOf(pkt);
+        if (i != videoIndex) {
+            //the audio packets inside the range, on the same timeline as the video
+            int64_t from = av_rescale_q(startTs, in->streams[videoIndex]->time_base, st->time_base);
+            int64_t to = endTs == INT64_MAX ? INT64_MAX : av_rescale_q(endTs, in->streams[videoIndex]->time_base, st->time_base);
+            if (pts != AV_NOPTS_VALUE && pts >= to) {
+                past[i] = true;
+            } else if (pts != AV_NOPTS_VALUE && pts >= from) {
+                pkt->pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts - from : AV_NOPTS_VALUE;
+                pkt->dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts - from : AV_NOPTS_VALUE;
+                pkt->stream_index = streamMap[i];
+                av_packet_rescale_ts(pkt, st->time_base, out->streams[pkt->stream_index]->time_base);
+                ret = av_interleaved_write_frame(out, pkt);
+            }
+            av_packet_unref(pkt);
+            continue;
+        }
+        bool key = pkt->flags & AV_PKT_FLAG_KEY;
+        if (key) {
+            if (delay == AV_NOPTS_VALUE)
+                delay = pkt->pts != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE ? FFMAX(pkt->pts - pkt->dts, 0) : 0;
+            if (!gop.empty() && (ret = processGop(gop, pts)) < 0)
+                break;
+            if (pts >= endTs) {
+                videoDone = true;
+                av_packet_unref(pkt);
+                continue;
+            }
+        } else if (gop.empty()) {
+            //a byte seek lands before the keyframe, the packets up to it decode nothing
+            av_packet_unref(pkt);
+            continue;
+        }
+        AVPacket *held = av_packet_clone(pkt);
+        av_packet_unref(pkt);
+        if (!held) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        gop.push_back(held);
+    }
+    for (AVPacket *held : gop)
+        av_packet_free(&held);
+    if (ret >= 0 && encoder) {
+        writeEncoded(nullptr);
+        avcodec_free_context(&encoder);
+    }
+    if (ret >= 0)
+        ret = av_write_trailer(out);
+    av_packet_free(&pkt);
+    closeAll();
+    flushLog();
+
+    if (ret < 0) {
+        cout << "\n[SRClip] exporting " << output << " failed";
+        remove(output);
+        return ret;
+    }
+    cout << "\n[SRClip] " << output << ": " << counters.copiedGops << " GOPs copied, " << counters.encodedFrames
+         << " frames encoded in " << counters.encodedGops << " GOPs";
+    if (counters.widenedGops)
+        cout << ", " << counters.widenedGops << " partial GOPs copied whole";
+    return 0;
+}
@@ -0,0 +1,99 @@
+//
+// Clip export without re-encoding: the GOPs inside the range are copied, only the partial ones at its ends are encoded.
+//
+
+#ifndef CPPSCREENRECORDER_SRCLIP_H
+#define CPPSCREENRECORDER_SRCLIP_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+#define CLIP_CRF 18     //x264 and x265 constant quality of the encoded ends, close to the recording around them
+#define CLIP_PRESET "veryfast"  //someone waits for the clip, and the ends are a GOP each at most
+#define CLIP_QSCALE 2   //fixed quantizer of the ends in the other codecs
+
+/**
+ * Statistics of an SRClip::run(): GOPs and packets copied, GOPs and frames encoded at the ends of the range.
+ * widenedGops are the partial GOPs copied whole, the codec of the recording having no encoder here: the clip then
+ * starts at the keyframe before the start and ends at the one after the end.
+ */
+typedef struct CS{
+    uint64_t copiedGops;
+    uint64_t copiedPackets;
+    uint64_t encodedGops;
+    uint64_t encodedFrames;
+    uint64_t widenedGops;
+}SRClipStats;
+
+/**
+ * SRClip cuts the range [start, end) of a recording into a file of its own, stream copying the video GOPs fully
+ * inside it and the audio packets; only the frames of the GOPs cut by start or end are decoded and encoded again,
+ * with the codec, profile and size of the recording and without B-frames. A 30 s clip of a 4 hour recording costs
+ * the seek and two GOPs of encoding, whatever the length of the recording.\n
+ * The keyframe before start comes from the SRKeyIndex of the recording, mapped read-only: its byte offset is seeked
+ * to directly, in O(log n), where the demuxer allows it; the demuxer's own index is used otherwise. The video is read
+ * one GOP ahead, so a GOP is only copied once the next keyframe shows that it ends inside the range.\n
+ * The encoded frames are H.264 or HEVC GOPs with their own parameter sets in band, in the framing of the recording;
+ * the first copied keyframe after them gets the parameter sets of the recording back in band too. The encoded
+ * packets keep the dts offset of the B-frame delay of the recording, so the dts stay increasing across every cut.
+ *
+ * @Note closed GOPs only: the open GOPs and intra-refresh of SR_PROFILE_LIVE need more of the range encoded
+ */
+class SRClip {
+
+private:
+    int crf;
+    AVFormatContext *in;
+    AVFormatContext *out;
+    AVCodecContext *decoder;
+    AVCodecContext *encoder;
+    bool encoderFailed;
+    AVPacket *encoded;
+    AVFrame *frame;
+    int videoIndex;
+    std::vector<int> streamMap;     //output stream of each input stream, -1 when it is not copied
+    int64_t startTs, endTs;     //range in the video time base
+    int64_t delay;  //pts - dts of the keyframes of the recording
+    std::vector<uint8_t> parameterSets;     //of the recording, in the framing of its packets
+    int lengthSize;     //bytes of the NAL sizes of the packets, 0 for start codes or another codec
+    bool injectNext;    //the next copied keyframe follows encoded frames
+    SRClipStats counters;
+
+    int openInput(const char *input, const char *index, int64_t start);
+    int openOutput(const char *output);
+    int processGop(std::vector<AVPacket*> &gop, int64_t gopEnd);
+    int copyGop(std::vector<AVPacket*> &gop);
+    int encodeGop(std::vector<AVPacket*> &gop);
+    int openEncoder(const AVFrame *first);
+    int writeEncoded(AVFrame *frame);
+    void closeEncoder();
+    int writeVideo(AVPacket *pkt);
+    void closeAll();
+
+public:
+    explicit SRClip(int crf = CLIP_CRF);
+    ~SRClip();
+
+    SRClip(const SRClip&) = delete;
+    SRClip &operator=(const SRClip&) = delete;
+
+    /**
+     * run() exports [start, end) of input into output, output is removed when the export fails
+     * @param start us from the beginning of the recording
+     * @param end us, INT64_MAX to the end of the recording
+     * @param index keyframe index of input, nullptr for input + ".idx"; without one the demuxer seeks
+     * @return 0 on success, a negative AVERROR code otherwise
+     */
+    int run(const char *input, int64_t start, int64_t end, const char *output, const char *index = nullptr);
+
+    SRClipStats stats() const { return counters; }
+};
+
+#endif //CPPSCREENRECORDER_SRCLIP_H
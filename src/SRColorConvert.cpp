@@ -0,0 +1,1042 @@
+#include "SRColorConvert.h"
+
+extern "C"
+{
+#include "libavutil/common.h"
+#include "libavutil/cpu.h"
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SR_HAVE_AVX2 1
+#ifdef AV_CPU_FLAG_AVX512
+#define SR_HAVE_AVX512 1    //AV_CPU_FLAG_AVX512 is F, CD, BW, DQ and VL
+#endif
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/*
+ * The coefficients of a matrix in fixed point, built at compile time from its Kr and Kb: swscale computes its tables
+ * in every sws_getContext(), the kernels read these as immediates. The G coefficient of the chroma is what is left
+ * of the rounded R and B ones, the rows sum to 0 and a gray pixel stays exactly on the neutral chroma.
+ */
+struct SRMatrix {
+    int yr, yg, yb;
+    int ur, ug, ub;
+    int vr, vg, vb;
+    int yOffset;    //16 or 64 for limited range, 0 for full range
+};
+
+static constexpr int roundFixed(double x) {
+    return x >= 0 ? (int) (x + 0.5) : -(int) (-x + 0.5);
+}
+
+/**
+ * makeMatrix() builds the matrix of Kr, Kb for RGB and YUV of the given bits, coefficients of the given precision
+ */
+static constexpr SRMatrix makeMatrix(double kr, double kb, int bits, int precision, bool fullRange) {
+    double maxValue = (1 << bits) - 1;
+    double luma = (1 << precision) * (fullRange ? 1.0 : (219 << (bits - 8)) / maxValue);
+    double chroma = (1 << precision) * (fullRange ? 1.0 : (224 << (bits - 8)) / maxValue);
+    int ur = roundFixed(-kr / (2 * (1 - kb)) * chroma), ub = roundFixed(chroma / 2);
+    int vr = roundFixed(chroma / 2), vb = roundFixed(-kb / (2 * (1 - kr)) * chroma);
+    return {roundFixed(kr * luma), roundFixed((1 - kr - kb) * luma), roundFixed(kb * luma),
+            ur, -ur - ub, ub,
+            vr, -vr - vb, vb,
+            fullRange ? 0 : 16 << (bits - 8)};
+}
+
+/* the 8 bit matrices of the kernels, template argument M */
+enum {
+    SR_MATRIX_BT601,
+    SR_MATRIX_BT709,
+    SR_MATRIX_BT601_FULL,
+    SR_MATRIX_BT709_FULL
+};
+
+static constexpr SRMatrix matrices8[] = {
+        makeMatrix(0.299, 0.114, 8, 8, false),
+        makeMatrix(0.2126, 0.0722, 8, 8, false),
+        makeMatrix(0.299, 0.114, 8, 8, true),
+        makeMatrix(0.2126, 0.0722, 8, 8, true),
+};
+
+//the BT.601 limited range matrix is the one of the swscale default
+static_assert(matrices8[SR_MATRIX_BT601].yr == 66 && matrices8[SR_MATRIX_BT601].yg == 129 && matrices8[SR_MATRIX_BT601].yb == 25 &&
+              matrices8[SR_MATRIX_BT601].ug == -74 && matrices8[SR_MATRIX_BT601].vg == -94, "BT.601 coefficients");
+
+template <int M>
+static inline uint8_t toY(int r, int g, int b) {
+    const SRMatrix &m = matrices8[M];
+    return (uint8_t) av_clip_uint8(((m.yr * r + m.yg * g + m.yb * b + 128) >> 8) + m.yOffset);
+}
+
+template <int M>
+static inline uint8_t toU(int r, int g, int b) {
+    const SRMatrix &m = matrices8[M];
+    return (uint8_t) av_clip_uint8(((m.ur * r + m.ug * g + m.ub * b + 128) >> 8) + 128);
+}
+
+template <int M>
+static inline uint8_t toV(int r, int g, int b) {
+    const SRMatrix &m = matrices8[M];
+    return (uint8_t) av_clip_uint8(((m.vr * r + m.vg * g + m.vb * b + 128) >> 8) + 128);
+}
+
+/**
+ * convertTail() converts the columns [x, width) of a pair of rows, the vector loops stop before them
+ */
+template <int M, bool RGB, bool NV12>
+static void convertTail(const uint8_t *row0, const uint8_t *row1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                        int x, int width, bool second) {
+    const int ri = RGB ? 0 : 2, bi = RGB ? 2 : 0;
+    for (; x < width; x += 2) {
+        int x1 = x + 1 < width ? x + 1 : x;
+        const uint8_t *p[4] = {row0 + 4 * x, row0 + 4 * x1, row1 + 4 * x, row1 + 4 * x1};
+        y0[x] = toY<M>(p[0][ri], p[0][1], p[0][bi]);
+        if (x1 != x) y0[x1] = toY<M>(p[1][ri], p[1][1], p[1][bi]);
+        if (second) {
+            y1[x] = toY<M>(p[2][ri], p[2][1], p[2][bi]);
+            if (x1 != x) y1[x1] = toY<M>(p[3][ri], p[3][1], p[3][bi]);
+        }
+        int r = (p[0][ri] + p[1][ri] + p[2][ri] + p[3][ri] + 2) >> 2;
+        int g = (p[0][1] + p[1][1] + p[2][1] + p[3][1] + 2) >> 2;
+        int b = (p[0][bi] + p[1][bi] + p[2][bi] + p[3][bi] + 2) >> 2;
+        if (NV12) {
+            u[x] = toU<M>(r, g, b);
+            u[x + 1] = toV<M>(r, g, b);
+        } else {
+            u[x / 2] = toU<M>(r, g, b);
+            v[x / 2] = toV<M>(r, g, b);
+        }
+    }
+}
+
+/**
+ * convertTail444() converts the columns [x, width) of a row to full resolution Y, U and V
+ */
+template <int M, bool RGB>
+static void convertTail444(const uint8_t *row, uint8_t *y, uint8_t *u, uint8_t *v, int x, int width) {
+    const int ri = RGB ? 0 : 2, bi = RGB ? 2 : 0;
+    for (const uint8_t *p = row + 4 * x; x < width; x++, p += 4) {
+        y[x] = toY<M>(p[ri], p[1], p[bi]);
+        u[x] = toU<M>(p[ri], p[1], p[bi]);
+        v[x] = toV<M>(p[ri], p[1], p[bi]);
+    }
+}
+
+#ifdef AV_PIX_FMT_X2RGB10
+/*
+ * X2RGB10 holds R, G and B in the bits 20, 10 and 0 of a little endian word, the coefficients are 14 bit
+ * fixed point of 10 bit limited range: Y 64-940, chroma 64-960 around 512.
+ */
+static constexpr SRMatrix bt709Matrix10 = makeMatrix(0.2126, 0.0722, 10, 14, false);
+static constexpr SRMatrix bt2020Matrix10 = makeMatrix(0.2627, 0.0593, 10, 14, false);
+
+template <bool BT2020>
+static inline const SRMatrix &matrix10() {
+    return BT2020 ? bt2020Matrix10 : bt709Matrix10;
+}
+
+/**
+ * convertTail10() converts the columns [x, width) of a pair of X2RGB10 rows, P010 keeps the 10 bits in the high ones
+ */
+template <bool P010, bool BT2020>
+static void convertTail10(const uint32_t *row0, const uint32_t *row1, uint16_t *y0, uint16_t *y1, uint16_t *u, uint16_t *v,
+                          int x, int width, bool second) {
+    const SRMatrix &m = matrix10<BT2020>();
+    const int shift = P010 ? 6 : 0;
+    for (; x < width; x += 2) {
+        int x1 = x + 1 < width ? x + 1 : x;
+        const uint32_t p[4] = {row0[x], row0[x1], row1[x], row1[x1]};
+        int r = 0, g = 0, b = 0;
+        for (int k = 0; k < 4; k++) {
+            int pr = (p[k] >> 20) & 0x3ff, pg = (p[k] >> 10) & 0x3ff, pb = p[k] & 0x3ff;
+            uint16_t luma = (uint16_t) ((((m.yr * pr + m.yg * pg + m.yb * pb + 8192) >> 14) + 64) << shift);
+            if (k == 0) y0[x] = luma;
+            else if (k == 1 && x1 != x) y0[x1] = luma;
+            else if (k == 2 && second) y1[x] = luma;
+            else if (k == 3 && second && x1 != x) y1[x1] = luma;
+            r += pr;
+            g += pg;
+            b += pb;
+        }
+        r = (r + 2) >> 2;
+        g = (g + 2) >> 2;
+        b = (b + 2) >> 2;
+        uint16_t cu = (uint16_t) ((((m.ur * r + m.ug * g + m.ub * b + 8192) >> 14) + 512) << shift);
+        uint16_t cv = (uint16_t) ((((m.vr * r + m.vg * g + m.vb * b + 8192) >> 14) + 512) << shift);
+        if (P010) {
+            u[x] = cu;
+            u[x + 1] = cv;
+        } else {
+            u[x / 2] = cu;
+            v[x / 2] = cv;
+        }
+    }
+}
+#endif
+
+#ifdef __SSE2__
+/*
+ * A 32 bit pixel masked with 0x00ff00ff holds B and R (R and B for RGB order) in its 16 bit halves,
+ * shifted right by 8 it holds G and A: pmaddwd then computes a whole dot product per pixel.
+ */
+#define SR_PAIR(lo, hi) ((int) (((uint32_t) (uint16_t) (hi) << 16) | (uint16_t) (lo)))
+
+/* the B and R pair of a row of the matrix, in the order of the pixels */
+#define SR_PAIR_BR(RGB, cr, cb) ((RGB) ? SR_PAIR(cr, cb) : SR_PAIR(cb, cr))
+
+template <int M, bool RGB>
+static inline __m128i lumaSSE2(__m128i px) {
+    const SRMatrix &m = matrices8[M];
+    const __m128i cBR = _mm_set1_epi32(SR_PAIR_BR(RGB, m.yr, m.yb));
+    const __m128i cGA = _mm_set1_epi32(SR_PAIR(m.yg, 0));
+    __m128i br = _mm_and_si128(px, _mm_set1_epi32(0x00ff00ff));
+    __m128i ga = _mm_srli_epi16(px, 8);
+    __m128i y = _mm_add_epi32(_mm_madd_epi16(br, cBR), _mm_madd_epi16(ga, cGA));
+    y = _mm_srai_epi32(_mm_add_epi32(y, _mm_set1_epi32(128)), 8);
+    return _mm_add_epi32(y, _mm_set1_epi32(m.yOffset));
+}
+
+/**
+ * chromaSSE2() averages the 2x2 blocks of 4 pixels of two rows: U and V of the two blocks end up in the low 64 bits
+ */
+template <int M, bool RGB>
+static inline void chromaSSE2(__m128i p, __m128i q, __m128i &u, __m128i &v) {
+    const SRMatrix &m = matrices8[M];
+    const __m128i mask = _mm_set1_epi32(0x00ff00ff);
+    const __m128i cUBR = _mm_set1_epi32(SR_PAIR_BR(RGB, m.ur, m.ub));
+    const __m128i cVBR = _mm_set1_epi32(SR_PAIR_BR(RGB, m.vr, m.vb));
+    const __m128i cUGA = _mm_set1_epi32(SR_PAIR(m.ug, 0));
+    const __m128i cVGA = _mm_set1_epi32(SR_PAIR(m.vg, 0));
+    const __m128i two = _mm_set1_epi16(2);
+    const __m128i round = _mm_set1_epi32(128);
+
+    __m128i br = _mm_add_epi16(_mm_and_si128(p, mask), _mm_and_si128(q, mask));
+    __m128i ga = _mm_add_epi16(_mm_srli_epi16(p, 8), _mm_srli_epi16(q, 8));
+    //add the odd pixel of each pair to the even one
+    br = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(br, _mm_srli_epi64(br, 32)), two), 2);
+    ga = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(ga, _mm_srli_epi64(ga, 32)), two), 2);
+
+    u = _mm_add_epi32(_mm_madd_epi16(br, cUBR), _mm_madd_epi16(ga, cUGA));
+    v = _mm_add_epi32(_mm_madd_epi16(br, cVBR), _mm_madd_epi16(ga, cVGA));
+    u = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(u, round), 8), round);
+    v = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(v, round), 8), round);
+    u = _mm_shuffle_epi32(u, _MM_SHUFFLE(3, 1, 2, 0));
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+/**
+ * storeChroma16() stores the chroma of 16 pixels from the four chromaSSE2() results
+ */
+template <bool NV12>
+static inline void storeChroma16(const __m128i u4[4], const __m128i v4[4], uint8_t *u, uint8_t *v, int x) {
+    __m128i uw = _mm_packs_epi32(_mm_unpacklo_epi64(u4[0], u4[1]), _mm_unpacklo_epi64(u4[2], u4[3]));
+    __m128i vw = _mm_packs_epi32(_mm_unpacklo_epi64(v4[0], v4[1]), _mm_unpacklo_epi64(v4[2], v4[3]));
+    __m128i ub = _mm_packus_epi16(uw, uw);
+    __m128i vb = _mm_packus_epi16(vw, vw);
+    if (NV12) {
+        _mm_storeu_si128((__m128i *) (u + x), _mm_unpacklo_epi8(ub, vb));
+    } else {
+        _mm_storel_epi64((__m128i *) (u + x / 2), ub);
+        _mm_storel_epi64((__m128i *) (v + x / 2), vb);
+    }
+}
+
+template <int M, bool RGB, bool NV12>
+static void convertSSE2(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4], int width, int height) {
+    for (int j = 0; j < height; j += 2) {
+        bool second = j + 1 < height;
+        const uint8_t *row0 = src + (size_t) j * srcStride;
+        const uint8_t *row1 = second ? row0 + srcStride : row0;
+        uint8_t *y0 = dst[0] + (size_t) j * dstStride[0];
+        uint8_t *y1 = y0 + dstStride[0];
+        uint8_t *u = dst[1] + (size_t) (j / 2) * dstStride[1];
+        uint8_t *v = NV12 ? nullptr : dst[2] + (size_t) (j / 2) * dstStride[2];
+        int x = 0;
+        for (; x + 16 <= width; x += 16) {
+            __m128i p[4], q[4], uq[4], vq[4];
+            for (int k = 0; k < 4; k++) {
+                p[k] = _mm_loadu_si128((const __m128i *) (row0 + 4 * x) + k);
+                q[k] = _mm_loadu_si128((const __m128i *) (row1 + 4 * x) + k);
+                chromaSSE2<M, RGB>(p[k], q[k], uq[k], vq[k]);
+            }
+            __m128i ya = _mm_packs_epi32(lumaSSE2<M, RGB>(p[0]), lumaSSE2<M, RGB>(p[1]));
+            __m128i yb = _mm_packs_epi32(lumaSSE2<M, RGB>(p[2]), lumaSSE2<M, RGB>(p[3]));
+            _mm_storeu_si128((__m128i *) (y0 + x), _mm_packus_epi16(ya, yb));
+            if (second) {
+                ya = _mm_packs_epi32(lumaSSE2<M, RGB>(q[0]), lumaSSE2<M, RGB>(q[1]));
+                yb = _mm_packs_epi32(lumaSSE2<M, RGB>(q[2]), lumaSSE2<M, RGB>(q[3]));
+                _mm_storeu_si128((__m128i *) (y1 + x), _mm_packus_epi16(ya, yb));
+            }
+            storeChroma16<NV12>(uq, vq, u, v, x);
+        }
+        convertTail<M, RGB, NV12>(row0, row1, y0, y1, u, v, x, width, second);
+    }
+}
+
+/**
+ * planeRowSSE2() computes one plane of 16 pixels, lumaSSE2() with the coefficients of any plane:
+ * 4:4:4 chroma is the same dot product per pixel as luma
+ */
+static inline void planeRowSSE2(const uint8_t *row, uint8_t *out, __m128i cBR, __m128i cGA, __m128i offset) {
+    const __m128i mask = _mm_set1_epi32(0x00ff00ff);
+    const __m128i round = _mm_set1_epi32(128);
+    __m128i c[4];
+    for (int k = 0; k < 4; k++) {
+        __m128i px = _mm_loadu_si128((const __m128i *) row + k);
+        __m128i dot = _mm_add_epi32(_mm_madd_epi16(_mm_and_si128(px, mask), cBR), _mm_madd_epi16(_mm_srli_epi16(px, 8), cGA));
+        c[k] = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(dot, round), 8), offset);
+    }
+    _mm_storeu_si128((__m128i *) out, _mm_packus_epi16(_mm_packs_epi32(c[0], c[1]), _mm_packs_epi32(c[2], c[3])));
+}
+
+template <int M, bool RGB>
+static void convert444SSE2(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4], int width, int height) {
+    const SRMatrix &m = matrices8[M];
+    const __m128i cYBR = _mm_set1_epi32(SR_PAIR_BR(RGB, m.yr, m.yb)), cYGA = _mm_set1_epi32(SR_PAIR(m.yg, 0));
+    const __m128i cUBR = _mm_set1_epi32(SR_PAIR_BR(RGB, m.ur, m.ub)), cUGA = _mm_set1_epi32(SR_PAIR(m.ug, 0));
+    const __m128i cVBR = _mm_set1_epi32(SR_PAIR_BR(RGB, m.vr, m.vb)), cVGA = _mm_set1_epi32(SR_PAIR(m.vg, 0));
+    const __m128i luma = _mm_set1_epi32(m.yOffset), chroma = _mm_set1_epi32(128);
+    for (int j = 0; j < height; j++) {
+        const uint8_t *row = src + (size_t) j * srcStride;
+        uint8_t *y = dst[0] + (size_t) j * dstStride[0];
+        uint8_t *u = dst[1] + (size_t) j * dstStride[1];
+        uint8_t *v = dst[2] + (size_t) j * dstStride[2];
+        int x = 0;
+        for (; x + 16 <= width; x += 16) {
+            planeRowSSE2(row + 4 * x, y + x, cYBR, cYGA, luma);
+            planeRowSSE2(row + 4 * x, u + x, cUBR, cUGA, chroma);
+            planeRowSSE2(row + 4 * x, v + x, cVBR, cVGA, chroma);
+        }
+        convertTail444<M, RGB>(row, y, u, v, x, width);
+    }
+}
+
+#ifdef AV_PIX_FMT_X2RGB10
+/**
+ * luma10SSE2() computes the 10 bit luma of 4 X2RGB10 pixels: R and G share a pmaddwd, B is paired with 0
+ */
+template <bool BT2020>
+static inline __m128i luma10SSE2(__m128i px) {
+    const SRMatrix &m = matrix10<BT2020>();
+    const __m128i ten = _mm_set1_epi32(0x3ff);
+    __m128i b = _mm_and_si128(px, ten);
+    __m128i rg = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(px, 20), ten),
+                              _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(px, 10), ten), 16));
+    __m128i y = _mm_add_epi32(_mm_madd_epi16(rg, _mm_set1_epi32(SR_PAIR(m.yr, m.yg))),
+                              _mm_madd_epi16(b, _mm_set1_epi32(SR_PAIR(m.yb, 0))));
+    y = _mm_srai_epi32(_mm_add_epi32(y, _mm_set1_epi32(8192)), 14);
+    return _mm_add_epi32(y, _mm_set1_epi32(64));
+}
+
+/**
+ * chroma10SSE2() averages the 2x2 blocks of 4 X2RGB10 pixels of two rows, as chromaSSE2() does
+ */
+template <bool BT2020>
+static inline void chroma10SSE2(__m128i p, __m128i q, __m128i &u, __m128i &v) {
+    const SRMatrix &m = matrix10<BT2020>();
+    const __m128i ten = _mm_set1_epi32(0x3ff);
+    const __m128i two = _mm_set1_epi32(2);
+    const __m128i round = _mm_set1_epi32(8192);
+    const __m128i center = _mm_set1_epi32(512);
+
+    __m128i b = _mm_add_epi32(_mm_and_si128(p, ten), _mm_and_si128(q, ten));
+    __m128i g = _mm_add_epi32(_mm_and_si128(_mm_srli_epi32(p, 10), ten), _mm_and_si128(_mm_srli_epi32(q, 10), ten));
+    __m128i r = _mm_add_epi32(_mm_and_si128(_mm_srli_epi32(p, 20), ten), _mm_and_si128(_mm_srli_epi32(q, 20), ten));
+    //add the odd pixel of each pair to the even one, the odd lanes are left over
+    b = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(b, _mm_srli_epi64(b, 32)), two), 2);
+    g = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(g, _mm_srli_epi64(g, 32)), two), 2);
+    r = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(r, _mm_srli_epi64(r, 32)), two), 2);
+    __m128i rg = _mm_or_si128(r, _mm_slli_epi32(g, 16));
+
+    u = _mm_add_epi32(_mm_madd_epi16(rg, _mm_set1_epi32(SR_PAIR(m.ur, m.ug))),
+                      _mm_madd_epi16(b, _mm_set1_epi32(SR_PAIR(m.ub, 0))));
+    v = _mm_add_epi32(_mm_madd_epi16(rg, _mm_set1_epi32(SR_PAIR(m.vr, m.vg))),
+                      _mm_madd_epi16(b, _mm_set1_epi32(SR_PAIR(m.vb, 0))));
+    u = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(u, round), 14), center);
+    v = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(v, round), 14), center);
+    u = _mm_shuffle_epi32(u, _MM_SHUFFLE(3, 1, 2, 0));
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+template <bool P010>
+static inline void storeLuma10(uint16_t *y, __m128i a, __m128i b) {
+    __m128i w = _mm_packs_epi32(a, b);
+    _mm_storeu_si128((__m128i *) y, P010 ? _mm_slli_epi16(w, 6) : w);
+}
+
+template <bool P010, bool BT2020>
+static void convert10SSE2(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4], int width, int height) {
+    for (int j = 0; j < height; j += 2) {
+        bool second = j + 1 < height;
+        const uint8_t *row0 = src + (size_t) j * srcStride;
+        const uint8_t *row1 = second ? row0 + srcStride : row0;
+        uint16_t *y0 = (uint16_t *) (dst[0] + (size_t) j * dstStride[0]);
+        uint16_t *y1 = (uint16_t *) ((uint8_t *) y0 + dstStride[0]);
+        uint16_t *u = (uint16_t *) (dst[1] + (size_t) (j / 2) * dstStride[1]);
+        uint16_t *v = P010 ? nullptr : (uint16_t *) (dst[2] + (size_t) (j / 2) * dstStride[2]);
+        int x = 0;
+        for (; x + 8 <= width; x += 8) {
+            __m128i p0 = _mm_loadu_si128((const __m128i *) (row0 + 4 * x));
+            __m128i p1 = _mm_loadu_si128((const __m128i *) (row0 + 4 * x) + 1);
+            __m128i q0 = _mm_loadu_si128((const __m128i *) (row1 + 4 * x));
+            __m128i q1 = _mm_loadu_si128((const __m128i *) (row1 + 4 * x) + 1);
+            __m128i u0, v0, u1, v1;
+            chroma10SSE2<BT2020>(p0, q0, u0, v0);
+            chroma10SSE2<BT2020>(p1, q1, u1, v1);
+            storeLuma10<P010>(y0 + x, luma10SSE2<BT2020>(p0), luma10SSE2<BT2020>(p1));
+            if (second)
+                storeLuma10<P010>(y1 + x, luma10SSE2<BT2020>(q0), luma10SSE2<BT2020>(q1));
+            __m128i uw = _mm_packs_epi32(_mm_unpacklo_epi64(u0, u1), _mm_setzero_si128());
+            __m128i vw = _mm_packs_epi32(_mm_unpacklo_epi64(v0, v1), _mm_setzero_si128());
+            if (P010) {
+                _mm_storeu_si128((__m128i *) (u + x), _mm_slli_epi16(_mm_unpacklo_epi16(uw, vw), 6));
+            } else {
+                _mm_storel_epi64((__m128i *) (u + x / 2), uw);
+                _mm_storel_epi64((__m128i *) (v + x / 2), vw);
+            }
+        }
+        convertTail10<P010, BT2020>((const uint32_t *) row0, (const uint32_t *) row1, y0, y1, u, v, x, width, second);
+    }
+}
+#endif
+
+#ifdef SR_HAVE_AVX2
+template <int M, bool RGB>
+__attribute__((target("avx2")))
+static inline __m256i lumaAVX2(__m256i px) {
+    const SRMatrix &m = matrices8[M];
+    const __m256i cBR = _mm256_set1_epi32(SR_PAIR_BR(RGB, m.yr, m.yb));
+    const __m256i cGA = _mm256_set1_epi32(SR_PAIR(m.yg, 0));
+    __m256i br = _mm256_and_si256(px, _mm256_set1_epi32(0x00ff00ff));
+    __m256i ga = _mm256_srli_epi16(px, 8);
+    __m256i y = _mm256_add_epi32(_mm256_madd_epi16(br, cBR), _mm256_madd_epi16(ga, cGA));
+    y = _mm256_srai_epi32(_mm256_add_epi32(y, _mm256_set1_epi32(128)), 8);
+    return _mm256_add_epi32(y, _mm256_set1_epi32(m.yOffset));
+}
+
+/**
+ * lumaRowAVX2() converts 32 pixels: the packs work per 128 bit lane, the final permute restores the pixel order
+ */
+template <int M, bool RGB>
+__attribute__((target("avx2")))
+static inline void lumaRowAVX2(const uint8_t *row, uint8_t *y) {
+    __m256i p0 = _mm256_loadu_si256((const __m256i *) row);
+    __m256i p1 = _mm256_loadu_si256((const __m256i *) row + 1);
+    __m256i p2 = _mm256_loadu_si256((const __m256i *) row + 2);
+    __m256i p3 = _mm256_loadu_si256((const __m256i *) row + 3);
+    __m256i a = _mm256_packs_epi32(lumaAVX2<M, RGB>(p0), lumaAVX2<M, RGB>(p1));
+    __m256i b = _mm256_packs_epi32(lumaAVX2<M, RGB>(p2), lumaAVX2<M, RGB>(p3));
+    __m256i out = _mm256_packus_epi16(a, b);
+    out = _mm256_permutevar8x32_epi32(out, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+    _mm256_storeu_si256((__m256i *) y, out);
+}
+
+template <int M, bool RGB, bool NV12>
+__attribute__((target("avx2")))
+static void convertAVX2(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4], int width, int height) {
+    for (int j = 0; j < height; j += 2) {
+        bool second = j + 1 < height;
+        const uint8_t *row0 = src + (size_t) j * srcStride;
+        const uint8_t *row1 = second ? row0 + srcStride : row0;
+        uint8_t *y0 = dst[0] + (size_t) j * dstStride[0];
+        uint8_t *y1 = y0 + dstStride[0];
+        uint8_t *u = dst[1] + (size_t) (j / 2) * dstStride[1];
+        uint8_t *v = NV12 ? nullptr : dst[2] + (size_t) (j / 2) * dstStride[2];
+        int x = 0;
+        for (; x + 32 <= width; x += 32) {
+            lumaRowAVX2<M, RGB>(row0 + 4 * x, y0 + x);
+            if (second) lumaRowAVX2<M, RGB>(row1 + 4 * x, y1 + x);
+            //chroma is a quarter of the work, the 128 bit kernel keeps it simple
+            for (int h = 0; h < 32; h += 16) {
+                __m128i uq[4], vq[4];
+                for (int k = 0; k < 4; k++)
+                    chromaSSE2<M, RGB>(_mm_loadu_si128((const __m128i *) (row0 + 4 * (x + h)) + k),
+                                    _mm_loadu_si128((const __m128i *) (row1 + 4 * (x + h)) + k), uq[k], vq[k]);
+                storeChroma16<NV12>(uq, vq, u, v, x + h);
+            }
+        }
+        convertTail<M, RGB, NV12>(row0, row1, y0, y1, u, v, x, width, second);
+    }
+}
+
+/**
+ * planeRowAVX2() is planeRowSSE2() for 32 pixels, with the permute of lumaRowAVX2()
+ */
+__attribute__((target("avx2")))
+static inline void planeRowAVX2(const uint8_t *row, uint8_t *out, __m256i cBR, __m256i cGA, __m256i offset) {
+    const __m256i mask = _mm256_set1_epi32(0x00ff00ff);
+    const __m256i round = _mm256_set1_epi32(128);
+    __m256i c[4];
+    for (int k = 0; k < 4; k++) {
+        __m256i px = _mm256_loadu_si256((const __m256i *) row + k);
+        __m256i dot = _mm256_add_epi32(_mm256_madd_epi16(_mm256_and_si256(px, mask), cBR),
+                                       _mm256_madd_epi16(_mm256_srli_epi16(px, 8), cGA));
+        c[k] = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(dot, round), 8), offset);
+    }
+    __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(c[0], c[1]), _mm256_packs_epi32(c[2], c[3]));
+    packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+    _mm256_storeu_si256((__m256i *) out, packed);
+}
+
+template <int M, bool RGB>
+__attribute__((target("avx2")))
+static void convert444AVX2(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4], int width, int height) {
+    const SRMatrix &m = matrices8[M];
+    const __m256i cYBR = _mm256_set1_epi32(SR_PAIR_BR(RGB, m.yr, m.yb)), cYGA = _mm256_set1_epi32(SR_PAIR(m.yg, 0));
+    const __m256i cUBR = _mm256_set1_epi32(SR_PAIR_BR(RGB, m.ur, m.ub)), cUGA = _mm256_set1_epi32(SR_PAIR(m.ug, 0));
+    const __m256i cVBR = _mm256_set1_epi32(SR_PAIR_BR(RGB, m.vr, m.vb)), cVGA = _mm256_set1_epi32(SR_PAIR(m.vg, 0));
+    const __m256i luma = _mm256_set1_epi32(m.yOffset), chroma = _mm256_set1_epi32(128);
+    for (int j = 0; j < height; j++) {
+        const uint8_t *row = src + (size_t) j * srcStride;
+        uint8_t *y = dst[0] + (size_t) j * dstStride[0];
+        uint8_t *u = dst[1] + (size_t) j * dstStride[1];
+        uint8_t *v = dst[2] + (size_t) j * dstStride[2];
+        int x = 0;
+        for (; x + 32 <= width; x += 32) {
+            planeRowAVX2(row + 4 * x, y + x, cYBR, cYGA, luma);
+            planeRowAVX2(row + 4 * x, u + x, cUBR, cUGA, chroma);
+            planeRowAVX2(row + 4 * x, v + x, cVBR, cVGA, chroma);
+        }
+        convertTail444<M, RGB>(row, y, u, v, x, width);
+    }
+}
+#endif
+
+#ifdef SR_HAVE_AVX512
+/*
+ * The AVX-512 kernels are the AVX2 ones on 64 pixels: the packs still work per 128 bit lane,
+ * the permute puts the 16 dwords of the packed result back in pixel order.
+ */
+#define SR_AVX512_ORDER _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15)
+
+__attribute__((target("avx512f,avx512bw")))
+static inline void planeRowAVX512(const uint8_t *row, uint8_t *out, __m512i cBR, __m512i cGA, __m512i offset) {
+    const __m512i mask = _mm512_set1_epi32(0x00ff00ff);
+    const __m512i round = _mm512_set1_epi32(128);
+    __m512i c[4];
+    for (int k = 0; k < 4; k++) {
+        __m512i px = _mm512_loadu_si512((const __m512i *) row + k);
+        __m512i dot = _mm512_add_epi32(_mm512_madd_epi16(_mm512_and_si512(px, mask), cBR),
+                                       _mm512_madd_epi16(_mm512_srli_epi16(px, 8), cGA));
+        c[k] = _mm512_add_epi32(_mm512_srai_epi32(_mm512_add_epi32(dot, round), 8), offset);
+    }
+    __m512i packed = _mm512_packus_epi16(_mm512_packs_epi32(c[0], c[1]), _mm512_packs_epi32(c[2], c[3]));
+    _mm512_storeu_si512((__m512i *) out, _mm512_permutexvar_epi32(SR_AVX512_ORDER, packed));
+}
+
+template <int M, bool RGB, bool NV12>
+__attribute__((target("avx512f,avx512bw")))
+static void convertAVX512(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4], int width, int height) {
+    const SRMatrix &m = matrices8[M];
+    const __m512i cBR = _mm512_set1_epi32(SR_PAIR_BR(RGB, m.yr, m.yb)), cGA = _mm512_set1_epi32(SR_PAIR(m.yg, 0));
+    const __m512i luma = _mm512_set1_epi32(m.yOffset);
+    for (int j = 0; j < height; j += 2) {
+        bool second = j + 1 < height;
+        const uint8_t *row0 = src + (size_t) j * srcStride;
+        const uint8_t *row1 = second ? row0 + srcStride : row0;
+        uint8_t *y0 = dst[0] + (size_t) j * dstStride[0];
+        uint8_t *y1 = y0 + dstStride[0];
+        uint8_t *u = dst[1] + (size_t) (j / 2) * dstStride[1];
+        uint8_t *v = NV12 ? nullptr : dst[2] + (size_t) (j / 2) * dstStride[2];
+        int x = 0;
+        for (; x + 64 <= width; x += 64) {
+            planeRowAVX512(row0 + 4 * x, y0 + x, cBR, cGA, luma);
+            if (second) planeRowAVX512(row1 + 4 * x, y1 + x, cBR, cGA, luma);
+            //as in convertAVX2(), chroma stays on the 128 bit kernel
+            for (int h = 0; h < 64; h += 16) {
+                __m128i uq[4], vq[4];
+                for (int k = 0; k < 4; k++)
+                    chromaSSE2<M, RGB>(_mm_loadu_si128((const __m128i *) (row0 + 4 * (x + h)) + k),
+                                       _mm_loadu_si128((const __m128i *) (row1 + 4 * (x + h)) + k), uq[k], vq[k]);
+                storeChroma16<NV12>(uq, vq, u, v, x + h);
+            }
+        }
+        convertTail<M, RGB, NV12>(row0, row1, y0, y1, u, v, x, width, second);
+    }
+}
+
+template <int M, bool RGB>
+__attribute__((target("avx512f,avx512bw")))
+static void convert444AVX512(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4], int width, int height) {
+    const SRMatrix &m = matrices8[M];
+    const __m512i cYBR = _mm512_set1_epi32(SR_PAIR_BR(RGB, m.yr, m.yb)), cYGA = _mm512_set1_epi32(SR_PAIR(m.yg, 0));
+    const __m512i cUBR = _mm512_set1_epi32(SR_PAIR_BR(RGB, m.ur, m.ub)), cUGA = _mm512_set1_epi32(SR_PAIR(m.ug, 0));
+    const __m512i cVBR = _mm512_set1_epi32(SR_PAIR_BR(RGB, m.vr, m.vb)), cVGA = _mm512_set1_epi32(SR_PAIR(m.vg, 0));
+    const __m512i luma = _mm512_set1_epi32(m.yOffset), chroma = _mm512_set1_epi32(128);
+    for (int j = 0; j < height; j++) {
+        const uint8_t *row = src + (size_t) j * srcStride;
+        uint8_t *y = dst[0] + (size_t) j * dstStride[0];
+        uint8_t *u = dst[1] + (size_t) j * dstStride[1];
+        uint8_t *v = dst[2] + (size_t) j * dstStride[2];
+        int x = 0;
+        for (; x + 64 <= width; x += 64) {
+            planeRowAVX512(row + 4 * x, y + x, cYBR, cYGA, luma);
+            planeRowAVX512(row + 4 * x, u + x, cUBR, cUGA, chroma);
+            planeRowAVX512(row + 4 * x, v + x, cVBR, cVGA, chroma);
+        }
+        convertTail444<M, RGB>(row, y, u, v, x, width);
+    }
+}
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+template <int M>
+static inline uint8x8_t lumaNEON(uint8x8_t r, uint8x8_t g, uint8x8_t b) {
+    const SRMatrix &m = matrices8[M];
+    uint16x8_t y = vmull_u8(r, vdup_n_u8(m.yr));
+    y = vmlal_u8(y, g, vdup_n_u8(m.yg));
+    y = vmlal_u8(y, b, vdup_n_u8(m.yb));
+    return vadd_u8(vrshrn_n_u16(y, 8), vdup_n_u8(m.yOffset));
+}
+
+/* the rounding shift does not overflow, the full range dot products reach 255 * 128 */
+static inline uint8x8_t chromaNEON(int16x8_t r, int16x8_t g, int16x8_t b, int16_t cr, int16_t cg, int16_t cb) {
+    int16x8_t c = vmulq_n_s16(r, cr);
+    c = vmlaq_n_s16(c, g, cg);
+    c = vmlaq_n_s16(c, b, cb);
+    c = vrshrq_n_s16(c, 8);
+    return vqmovun_s16(vaddq_s16(c, vdupq_n_s16(128)));
+}
+
+template <int M, bool RGB, bool NV12>
+static void convertNEON(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4], int width, int height) {
+    const SRMatrix &m = matrices8[M];
+    for (int j = 0; j < height; j += 2) {
+        bool second = j + 1 < height;
+        const uint8_t *row0 = src + (size_t) j * srcStride;
+        const uint8_t *row1 = second ? row0 + srcStride : row0;
+        uint8_t *y0 = dst[0] + (size_t) j * dstStride[0];
+        uint8_t *y1 = y0 + dstStride[0];
+        uint8_t *u = dst[1] + (size_t) (j / 2) * dstStride[1];
+        uint8_t *v = NV12 ? nullptr : dst[2] + (size_t) (j / 2) * dstStride[2];
+        int x = 0;
+        for (; x + 16 <= width; x += 16) {
+            uint8x16x4_t p = vld4q_u8(row0 + 4 * x);
+            uint8x16x4_t q = vld4q_u8(row1 + 4 * x);
+            uint8x16_t pr = p.val[RGB ? 0 : 2], pg = p.val[1], pb = p.val[RGB ? 2 : 0];
+            uint8x16_t qr = q.val[RGB ? 0 : 2], qg = q.val[1], qb = q.val[RGB ? 2 : 0];
+
+            vst1q_u8(y0 + x, vcombine_u8(lumaNEON<M>(vget_low_u8(pr), vget_low_u8(pg), vget_low_u8(pb)),
+                                         lumaNEON<M>(vget_high_u8(pr), vget_high_u8(pg), vget_high_u8(pb))));
+            if (second)
+                vst1q_u8(y1 + x, vcombine_u8(lumaNEON<M>(vget_low_u8(qr), vget_low_u8(qg), vget_low_u8(qb)),
+                                             lumaNEON<M>(vget_high_u8(qr), vget_high_u8(qg), vget_high_u8(qb))));
+
+            //pairwise sums of both rows, rounded to the average of each 2x2 block
+            int16x8_t r = vreinterpretq_s16_u16(vrshrq_n_u16(vaddq_u16(vpaddlq_u8(pr), vpaddlq_u8(qr)), 2));
+            int16x8_t g = vreinterpretq_s16_u16(vrshrq_n_u16(vaddq_u16(vpaddlq_u8(pg), vpaddlq_u8(qg)), 2));
+            int16x8_t b = vreinterpretq_s16_u16(vrshrq_n_u16(vaddq_u16(vpaddlq_u8(pb), vpaddlq_u8(qb)), 2));
+            uint8x8_t cu = chromaNEON(r, g, b, m.ur, m.ug, m.ub);
+            uint8x8_t cv = chromaNEON(r, g, b, m.vr, m.vg, m.vb);
+            if (NV12) {
+                uint8x8x2_t uv = {{cu, cv}};
+                vst2_u8(u + x, uv);
+            } else {
+                vst1_u8(u + x / 2, cu);
+                vst1_u8(v + x / 2, cv);
+            }
+        }
+        convertTail<M, RGB, NV12>(row0, row1, y0, y1, u, v, x, width, second);
+    }
+}
+
+template <int M, bool RGB>
+static void convert444NEON(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4], int width, int height) {
+    const SRMatrix &m = matrices8[M];
+    for (int j = 0; j < height; j++) {
+        const uint8_t *row = src + (size_t) j * srcStride;
+        uint8_t *y = dst[0] + (size_t) j * dstStride[0];
+        uint8_t *u = dst[1] + (size_t) j * dstStride[1];
+        uint8_t *v = dst[2] + (size_t) j * dstStride[2];
+        int x = 0;
+        for (; x + 16 <= width; x += 16) {
+            uint8x16x4_t p = vld4q_u8(row + 4 * x);
+            uint8x16_t pr = p.val[RGB ? 0 : 2], pg = p.val[1], pb = p.val[RGB ? 2 : 0];
+            vst1q_u8(y + x, vcombine_u8(lumaNEON<M>(vget_low_u8(pr), vget_low_u8(pg), vget_low_u8(pb)),
+                                        lumaNEON<M>(vget_high_u8(pr), vget_high_u8(pg), vget_high_u8(pb))));
+            int16x8_t rl = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(pr))), rh = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(pr)));
+            int16x8_t gl = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(pg))), gh = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(pg)));
+            int16x8_t bl = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(pb))), bh = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(pb)));
+            vst1q_u8(u + x, vcombine_u8(chromaNEON(rl, gl, bl, m.ur, m.ug, m.ub), chromaNEON(rh, gh, bh, m.ur, m.ug, m.ub)));
+            vst1q_u8(v + x, vcombine_u8(chromaNEON(rl, gl, bl, m.vr, m.vg, m.vb), chromaNEON(rh, gh, bh, m.vr, m.vg, m.vb)));
+        }
+        convertTail444<M, RGB>(row, y, u, v, x, width);
+    }
+}
+
+#ifdef AV_PIX_FMT_X2RGB10
+/* splits 4 X2RGB10 pixels in their 10 bit components */
+static inline void unpack10NEON(uint32x4_t px, uint16x4_t &r, uint16x4_t &g, uint16x4_t &b) {
+    const uint32x4_t ten = vdupq_n_u32(0x3ff);
+    b = vmovn_u32(vandq_u32(px, ten));
+    g = vmovn_u32(vandq_u32(vshrq_n_u32(px, 10), ten));
+    r = vmovn_u32(vandq_u32(vshrq_n_u32(px, 20), ten));
+}
+
+/* the luma coefficients are positive: unsigned widening products, the rounding narrow is the + 8192 >> 14 of C */
+template <bool P010, bool BT2020>
+static inline uint16x4_t luma10NEON(uint16x4_t r, uint16x4_t g, uint16x4_t b) {
+    const SRMatrix &m = matrix10<BT2020>();
+    uint32x4_t y = vmull_n_u16(r, (uint16_t) m.yr);
+    y = vmlal_n_u16(y, g, (uint16_t) m.yg);
+    y = vmlal_n_u16(y, b, (uint16_t) m.yb);
+    uint16x4_t out = vadd_u16(vrshrn_n_u32(y, 14), vdup_n_u16(64));
+    return P010 ? vshl_n_u16(out, 6) : out;
+}
+
+template <bool P010>
+static inline uint16x4_t chroma10NEON(int32x4_t r, int32x4_t g, int32x4_t b, int cr, int cg, int cb) {
+    int32x4_t c = vmulq_n_s32(r, cr);
+    c = vmlaq_n_s32(c, g, cg);
+    c = vmlaq_n_s32(c, b, cb);
+    uint16x4_t out = vmovn_u32(vreinterpretq_u32_s32(vaddq_s32(vrshrq_n_s32(c, 14), vdupq_n_s32(512))));
+    return P010 ? vshl_n_u16(out, 6) : out;
+}
+
+/* the rounded average of the 2x2 blocks of 8 columns of two rows */
+static inline int32x4_t average10NEON(uint16x4_t a0, uint16x4_t a1, uint16x4_t b0, uint16x4_t b1) {
+    uint32x4_t sum = vpaddlq_u16(vaddq_u16(vcombine_u16(a0, a1), vcombine_u16(b0, b1)));
+    return vreinterpretq_s32_u32(vrshrq_n_u32(sum, 2));
+}
+
+template <bool P010, bool BT2020>
+static void convert10NEON(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4], int width, int height) {
+    const SRMatrix &m = matrix10<BT2020>();
+    for (int j = 0; j < height; j += 2) {
+        bool second = j + 1 < height;
+        const uint32_t *row0 = (const uint32_t *) (src + (size_t) j * srcStride);
+        const uint32_t *row1 = second ? (const uint32_t *) ((const uint8_t *) row0 + srcStride) : row0;
+        uint16_t *y0 = (uint16_t *) (dst[0] + (size_t) j * dstStride[0]);
+        uint16_t *y1 = (uint16_t *) ((uint8_t *) y0 + dstStride[0]);
+        uint16_t *u = (uint16_t *) (dst[1] + (size_t) (j / 2) * dstStride[1]);
+        uint16_t *v = P010 ? nullptr : (uint16_t *) (dst[2] + (size_t) (j / 2) * dstStride[2]);
+        int x = 0;
+        for (; x + 8 <= width; x += 8) {
+            uint16x4_t pr0, pg0, pb0, pr1, pg1, pb1, qr0, qg0, qb0, qr1, qg1, qb1;
+            unpack10NEON(vld1q_u32(row0 + x), pr0, pg0, pb0);
+            unpack10NEON(vld1q_u32(row0 + x + 4), pr1, pg1, pb1);
+            unpack10NEON(vld1q_u32(row1 + x), qr0, qg0, qb0);
+            unpack10NEON(vld1q_u32(row1 + x + 4), qr1, qg1, qb1);
+            vst1q_u16(y0 + x, vcombine_u16(luma10NEON<P010, BT2020>(pr0, pg0, pb0), luma10NEON<P010, BT2020>(pr1, pg1, pb1)));
+            if (second)
+                vst1q_u16(y1 + x, vcombine_u16(luma10NEON<P010, BT2020>(qr0, qg0, qb0), luma10NEON<P010, BT2020>(qr1, qg1, qb1)));
+
+            int32x4_t r = average10NEON(pr0, pr1, qr0, qr1);
+            int32x4_t g = average10NEON(pg0, pg1, qg0, qg1);
+            int32x4_t b = average10NEON(pb0, pb1, qb0, qb1);
+            uint16x4_t cu = chroma10NEON<P010>(r, g, b, m.ur, m.ug, m.ub);
+            uint16x4_t cv = chroma10NEON<P010>(r, g, b, m.vr, m.vg, m.vb);
+            if (P010) {
+                uint16x4x2_t uv = {{cu, cv}};
+                vst2_u16(u + x, uv);
+            } else {
+                vst1_u16(u + x / 2, cu);
+                vst1_u16(v + x / 2, cv);
+            }
+        }
+        convertTail10<P010, BT2020>(row0, row1, y0, y1, u, v, x, width, second);
+    }
+}
+#endif
+#endif
+
+template <int M, bool RGB, bool NV12>
+static void convertC(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4], int width, int height) {
+    for (int j = 0; j < height; j += 2) {
+        bool second = j + 1 < height;
+        const uint8_t *row0 = src + (size_t) j * srcStride;
+        uint8_t *y0 = dst[0] + (size_t) j * dstStride[0];
+        convertTail<M, RGB, NV12>(row0, second ? row0 + srcStride : row0, y0, y0 + dstStride[0],
+                               dst[1] + (size_t) (j / 2) * dstStride[1],
+                               NV12 ? nullptr : dst[2] + (size_t) (j / 2) * dstStride[2], 0, width, second);
+    }
+}
+
+template <int M, bool RGB, bool NV12>
+static SRColorConvertFn selectConverter() {
+#ifdef __SSE2__
+#ifdef SR_HAVE_AVX2
+#ifdef SR_HAVE_AVX512
+    if (av_get_cpu_flags() & AV_CPU_FLAG_AVX512)
+        return convertAVX512<M, RGB, NV12>;
+#endif
+    if (av_get_cpu_flags() & AV_CPU_FLAG_AVX2)
+        return convertAVX2<M, RGB, NV12>;
+#endif
+    return convertSSE2<M, RGB, NV12>;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    if (av_get_cpu_flags() & AV_CPU_FLAG_NEON)
+        return convertNEON<M, RGB, NV12>;
+    return convertC<M, RGB, NV12>;
+#else
+    return convertC<M, RGB, NV12>;
+#endif
+}
+
+template <int M, bool RGB>
+static void convert444C(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4], int width, int height) {
+    for (int j = 0; j < height; j++)
+        convertTail444<M, RGB>(src + (size_t) j * srcStride, dst[0] + (size_t) j * dstStride[0],
+                            dst[1] + (size_t) j * dstStride[1], dst[2] + (size_t) j * dstStride[2], 0, width);
+}
+
+template <int M, bool RGB>
+static SRColorConvertFn selectConverter444() {
+#ifdef __SSE2__
+#ifdef SR_HAVE_AVX2
+#ifdef SR_HAVE_AVX512
+    if (av_get_cpu_flags() & AV_CPU_FLAG_AVX512)
+        return convert444AVX512<M, RGB>;
+#endif
+    if (av_get_cpu_flags() & AV_CPU_FLAG_AVX2)
+        return convert444AVX2<M, RGB>;
+#endif
+    return convert444SSE2<M, RGB>;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    if (av_get_cpu_flags() & AV_CPU_FLAG_NEON)
+        return convert444NEON<M, RGB>;
+    return convert444C<M, RGB>;
+#else
+    return convert444C<M, RGB>;
+#endif
+}
+
+/**
+ * selectMatrixConverter() is getColorConverter() for the 8 bit kernels of the matrix M
+ */
+template <int M>
+static SRColorConvertFn selectMatrixConverter(bool rgb, enum AVPixelFormat dst) {
+    if (dst == AV_PIX_FMT_NV12)
+        return rgb ? selectConverter<M, true, true>() : selectConverter<M, false, true>();
+    if (dst == AV_PIX_FMT_YUV420P)
+        return rgb ? selectConverter<M, true, false>() : selectConverter<M, false, false>();
+    if (dst == AV_PIX_FMT_YUV444P)
+        return rgb ? selectConverter444<M, true>() : selectConverter444<M, false>();
+    return nullptr;
+}
+
+#ifdef AV_PIX_FMT_X2RGB10
+template <bool P010, bool BT2020>
+static void convert10C(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4], int width, int height) {
+    for (int j = 0; j < height; j += 2) {
+        bool second = j + 1 < height;
+        const uint32_t *row0 = (const uint32_t *) (src + (size_t) j * srcStride);
+        uint16_t *y0 = (uint16_t *) (dst[0] + (size_t) j * dstStride[0]);
+        convertTail10<P010, BT2020>(row0, second ? (const uint32_t *) ((const uint8_t *) row0 + srcStride) : row0,
+                                    y0, (uint16_t *) ((uint8_t *) y0 + dstStride[0]),
+                                    (uint16_t *) (dst[1] + (size_t) (j / 2) * dstStride[1]),
+                                    P010 ? nullptr : (uint16_t *) (dst[2] + (size_t) (j / 2) * dstStride[2]), 0, width, second);
+    }
+}
+
+template <bool P010, bool BT2020>
+static SRColorConvertFn selectConverter10() {
+#ifdef __SSE2__
+    return convert10SSE2<P010, BT2020>;
+#else
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    if (av_get_cpu_flags() & AV_CPU_FLAG_NEON)
+        return convert10NEON<P010, BT2020>;
+#endif
+    return convert10C<P010, BT2020>;
+#endif
+}
+
+/**
+ * getDeepColorConverter() is getColorConverter() for the 10 bit formats
+ */
+static SRColorConvertFn getDeepColorConverter(enum AVPixelFormat src, enum AVPixelFormat dst, enum AVColorSpace matrix,
+                                              enum AVColorRange range) {
+    if (src != AV_PIX_FMT_X2RGB10LE || (matrix != AVCOL_SPC_BT709 && matrix != AVCOL_SPC_BT2020_NCL) || range == AVCOL_RANGE_JPEG)
+        return nullptr;
+    bool bt2020 = matrix == AVCOL_SPC_BT2020_NCL;
+    if (dst == AV_PIX_FMT_P010LE)
+        return bt2020 ? selectConverter10<true, true>() : selectConverter10<true, false>();
+    if (dst == AV_PIX_FMT_YUV420P10LE)
+        return bt2020 ? selectConverter10<false, true>() : selectConverter10<false, false>();
+    return nullptr;
+}
+#endif
+
+const char *getColorConverterName(enum AVPixelFormat src, enum AVPixelFormat dst, enum AVColorSpace matrix,
+                                  enum AVColorRange range) {
+    if (!getColorConverter(src, dst, matrix, range))
+        return nullptr;
+#ifdef AV_PIX_FMT_X2RGB10
+    if (getDeepColorConverter(src, dst, matrix, range)) {
+#ifdef __SSE2__
+        return "SSE2";
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        return av_get_cpu_flags() & AV_CPU_FLAG_NEON ? "NEON" : "C";
+#else
+        return "C";
+#endif
+    }
+#endif
+#ifdef __SSE2__
+#ifdef SR_HAVE_AVX2
+#ifdef SR_HAVE_AVX512
+    if (av_get_cpu_flags() & AV_CPU_FLAG_AVX512)
+        return "AVX512";
+#endif
+    if (av_get_cpu_flags() & AV_CPU_FLAG_AVX2)
+        return "AVX2";
+#endif
+    return "SSE2";
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    return av_get_cpu_flags() & AV_CPU_FLAG_NEON ? "NEON" : "C";
+#else
+    return "C";
+#endif
+}
+
+SRColorConvertFn getColorConverter(enum AVPixelFormat src, enum AVPixelFormat dst, enum AVColorSpace matrix,
+                                   enum AVColorRange range) {
+#ifdef AV_PIX_FMT_X2RGB10
+    if (src == AV_PIX_FMT_X2RGB10LE)
+        return getDeepColorConverter(src, dst, matrix, range);
+#endif
+    bool rgb;
+    if (src == AV_PIX_FMT_BGR0 || src == AV_PIX_FMT_BGRA) rgb = false;
+    else if (src == AV_PIX_FMT_RGB0 || src == AV_PIX_FMT_RGBA) rgb = true;
+    else return nullptr;
+
+    bool full = range == AVCOL_RANGE_JPEG;
+    if (matrix == AVCOL_SPC_UNSPECIFIED || matrix == AVCOL_SPC_BT470BG || matrix == AVCOL_SPC_SMPTE170M)
+        return full ? selectMatrixConverter<SR_MATRIX_BT601_FULL>(rgb, dst) : selectMatrixConverter<SR_MATRIX_BT601>(rgb, dst);
+    if (matrix == AVCOL_SPC_BT709)
+        return full ? selectMatrixConverter<SR_MATRIX_BT709_FULL>(rgb, dst) : selectMatrixConverter<SR_MATRIX_BT709>(rgb, dst);
+    return nullptr;
+}
+
+enum SRDownscale getDownscale(int srcW, int srcH, int dstW, int dstH) {
+    if (dstW <= 0 || dstH <= 0)
+        return SR_DOWNSCALE_NONE;
+    if (srcW == 2 * dstW && srcH == 2 * dstH)
+        return SR_DOWNSCALE_HALF;
+    if (srcW * 3 == dstW * 4 && srcH * 3 == dstH * 4)
+        return SR_DOWNSCALE_THREE_QUARTERS;
+    return SR_DOWNSCALE_NONE;
+}
+
+/* a row of the output of convertDownscaled() from the two source rows it covers, weight1 of 4 for row1 */
+typedef void (*SRDownscaleRowFn)(const uint8_t *row0, const uint8_t *row1, int weight1, uint8_t *out, int x, int width);
+
+/**
+ * halveRowC() averages the 2x2 blocks of the columns [x, width) of the output, the vector loops stop before them
+ */
+static void halveRowC(const uint8_t *row0, const uint8_t *row1, int, uint8_t *out, int x, int width) {
+    for (; x < width; x++)
+        for (int c = 0; c < 4; c++)
+            out[4 * x + c] = (uint8_t) ((row0[8 * x + c] + row0[8 * x + 4 + c] + row1[8 * x + c] + row1[8 * x + 4 + c] + 2) >> 2);
+}
+
+/**
+ * shrinkRowC() is the 4:3 area filter: each group of 4 source pixels gives 3, weighted 3:1, 2:2 and 1:3,
+ * and the rows are weighted the same way by weight1
+ */
+static void shrinkRowC(const uint8_t *row0, const uint8_t *row1, int weight1, uint8_t *out, int x, int width) {
+    const int weight0 = 4 - weight1;
+    for (; x < width; x += 3) {
+        const uint8_t *a = row0 + 4 * (x / 3 * 4), *b = row1 + 4 * (x / 3 * 4);
+        for (int c = 0; c < 4; c++) {
+            int a0 = a[c], a1 = a[4 + c], a2 = a[8 + c], a3 = a[12 + c];
+            int b0 = b[c], b1 = b[4 + c], b2 = b[8 + c], b3 = b[12 + c];
+            out[4 * x + c] = (uint8_t) ((weight0 * (3 * a0 + a1) + weight1 * (3 * b0 + b1) + 8) >> 4);
+            out[4 * x + 4 + c] = (uint8_t) ((weight0 * (2 * a1 + 2 * a2) + weight1 * (2 * b1 + 2 * b2) + 8) >> 4);
+            out[4 * x + 8 + c] = (uint8_t) ((weight0 * (a2 + 3 * a3) + weight1 * (b2 + 3 * b3) + 8) >> 4);
+        }
+    }
+}
+
+#ifdef __SSE2__
+/**
+ * halveRowSSE2() averages 4 output pixels per iteration: shufps splits the even and the odd source pixels,
+ * then the four vectors of the 2x2 blocks are added at 16 bits, exactly like halveRowC()
+ */
+static void halveRowSSE2(const uint8_t *row0, const uint8_t *row1, int, uint8_t *out, int x, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    for (; x + 4 <= width; x += 4) {
+        __m128 a0 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) (row0 + 8 * x)));
+        __m128 a1 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) (row0 + 8 * x) + 1));
+        __m128 b0 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) (row1 + 8 * x)));
+        __m128 b1 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) (row1 + 8 * x) + 1));
+        __m128i p[4] = {_mm_castps_si128(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(2, 0, 2, 0))),
+                        _mm_castps_si128(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(3, 1, 3, 1))),
+                        _mm_castps_si128(_mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2, 0, 2, 0))),
+                        _mm_castps_si128(_mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3, 1, 3, 1)))};
+        __m128i lo = two, hi = two;
+        for (int k = 0; k < 4; k++) {
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(p[k], zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(p[k], zero));
+        }
+        _mm_storeu_si128((__m128i *) (out + 4 * x), _mm_packus_epi16(_mm_srli_epi16(lo, 2), _mm_srli_epi16(hi, 2)));
+    }
+    halveRowC(row0, row1, 0, out, x, width);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+/**
+ * halveRowNEON() is halveRowSSE2(): vld2q splits the even and the odd pixels, vrshrn rounds the sum of the block
+ */
+static void halveRowNEON(const uint8_t *row0, const uint8_t *row1, int, uint8_t *out, int x, int width) {
+    for (; x + 4 <= width; x += 4) {
+        uint32x4x2_t a = vld2q_u32((const uint32_t *) (row0 + 8 * x));
+        uint32x4x2_t b = vld2q_u32((const uint32_t *) (row1 + 8 * x));
+        uint8x16_t a0 = vreinterpretq_u8_u32(a.val[0]), a1 = vreinterpretq_u8_u32(a.val[1]);
+        uint8x16_t b0 = vreinterpretq_u8_u32(b.val[0]), b1 = vreinterpretq_u8_u32(b.val[1]);
+        uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(a0), vget_low_u8(a1)), vaddl_u8(vget_low_u8(b0), vget_low_u8(b1)));
+        uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(a0), vget_high_u8(a1)), vaddl_u8(vget_high_u8(b0), vget_high_u8(b1)));
+        vst1q_u8(out + 4 * x, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+    }
+    halveRowC(row0, row1, 0, out, x, width);
+}
+#endif
+
+static SRDownscaleRowFn selectHalveRow() {
+#ifdef __SSE2__
+    return halveRowSSE2;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    return av_get_cpu_flags() & AV_CPU_FLAG_NEON ? halveRowNEON : halveRowC;
+#else
+    return halveRowC;
+#endif
+}
+
+void convertDownscaled(enum SRDownscale ratio, SRColorConvertFn convert, int chromaShift, const uint8_t *src, int srcStride,
+                       uint8_t *const dst[4], const int dstStride[4], int width, int height, uint8_t *scratch) {
+    SRDownscaleRowFn downscaleRow = ratio == SR_DOWNSCALE_HALF ? selectHalveRow() : shrinkRowC;
+    for (int j = 0; j < height; j += 2) {
+        int rows = FFMIN(2, height - j);
+        for (int k = 0; k < rows; k++) {
+            int row = j + k, first, weight1;
+            if (ratio == SR_DOWNSCALE_HALF) {
+                first = 2 * row;
+                weight1 = 2;
+            } else {
+                //output rows 0, 1, 2 of a group of 4 source rows: rows 0-1 at 3:1, 1-2 at 2:2, 2-3 at 1:3
+                first = row / 3 * 4 + row % 3;
+                weight1 = row % 3 + 1;
+            }
+            const uint8_t *row0 = src + (size_t) first * srcStride;
+            downscaleRow(row0, row0 + srcStride, weight1, scratch + (size_t) 4 * width * k, 0, width);
+        }
+        uint8_t *planes[4] = {nullptr, nullptr, nullptr, nullptr};
+        for (int i = 0; i < 3; i++)
+            if (dst[i])
+                planes[i] = dst[i] + (size_t) (i ? j >> chromaShift : j) * dstStride[i];
+        convert(scratch, 4 * width, planes, dstStride, width, rows);
+    }
+}
@@ -0,0 +1,75 @@
+//
+// Unscaled packed RGB to YUV conversion, used when the capture and output resolutions match.
+//
+
+#ifndef CPPSCREENRECORDER_SRCOLORCONVERT_H
+#define CPPSCREENRECORDER_SRCOLORCONVERT_H
+
+#include <cstdint>
+
+extern "C"
+{
+#include "libavutil/pixfmt.h"
+}
+
+/**
+ * Converts height rows of width 32 bit packed pixels into the Y, U and V planes of dst
+ * (Y and interleaved UV for NV12 and P010). 4:2:0 chroma is the average of each 2x2 block,
+ * odd sizes repeat the last column and row; 4:4:4 converts each pixel on its own.
+ */
+typedef void (*SRColorConvertFn)(const uint8_t *src, int srcStride, uint8_t *const dst[4], const int dstStride[4],
+                                 int width, int height);
+
+/**
+ * getColorConverter() returns the fastest kernel of this CPU for BGR0/BGRA/RGB0/RGBA to YUV420P/NV12/YUV444P,
+ * BT.601 or BT.709 in limited or full range, and for the 10 bit X2RGB10 of deep color desktops
+ * to YUV420P10/P010, BT.709 or BT.2020 limited range.\n
+ * SSE2 is the x86 baseline and AVX2 or AVX-512 (BW) is picked at runtime; on ARM, NEON when the cpu flags have it,
+ * C otherwise. The 10 bit kernels are SSE2, NEON or C.
+ * The coefficients are compile time constants of each kernel, there are no tables to build.
+ *
+ * @param matrix AVCOL_SPC_UNSPECIFIED for BT.601 like the swscale default, AVCOL_SPC_BT709, or AVCOL_SPC_BT2020_NCL
+ * for the 10 bit kernels
+ * @param range AVCOL_RANGE_JPEG for full range, limited range otherwise
+ * @return nullptr if the pair of formats has no fast path for that matrix
+ */
+SRColorConvertFn getColorConverter(enum AVPixelFormat src, enum AVPixelFormat dst,
+                                   enum AVColorSpace matrix = AVCOL_SPC_UNSPECIFIED,
+                                   enum AVColorRange range = AVCOL_RANGE_UNSPECIFIED);
+
+/**
+ * getColorConverterName() names the kernel getColorConverter() picks with the current cpu flags
+ * @return nullptr if the pair of formats has no fast path
+ */
+const char *getColorConverterName(enum AVPixelFormat src, enum AVPixelFormat dst,
+                                  enum AVColorSpace matrix = AVCOL_SPC_UNSPECIFIED,
+                                  enum AVColorRange range = AVCOL_RANGE_UNSPECIFIED);
+
+/* the exact downscaling ratios convertDownscaled() fuses with the conversion */
+enum SRDownscale {
+    SR_DOWNSCALE_NONE,
+    SR_DOWNSCALE_HALF,          //2:1, e.g. 4K to 1080p
+    SR_DOWNSCALE_THREE_QUARTERS //4:3, e.g. 1440p to 1080p
+};
+
+/**
+ * getDownscale() tells whether srcW x srcH to dstW x dstH is one of the ratios of convertDownscaled(),
+ * the same on both axes and without remainder
+ */
+enum SRDownscale getDownscale(int srcW, int srcH, int dstW, int dstH);
+
+/**
+ * convertDownscaled() downscales and converts an 8 bit packed RGB band in one pass over the source: each pair of
+ * output rows is averaged (a box filter for 2:1, the area weights 3:1, 2:2, 1:3 for 4:3) into scratch,
+ * where it stays in L1 for convert to make it YUV.\n
+ * width and height are the output size, src points at the source row of the first output row:
+ * for 4:3 it must be the first of a group of 4 source rows, i.e. the output row a multiple of 3.
+ *
+ * @param convert getColorConverter() of the source and destination formats
+ * @param chromaShift log2_chroma_h of the destination format
+ * @param scratch 8 * width bytes
+ */
+void convertDownscaled(enum SRDownscale ratio, SRColorConvertFn convert, int chromaShift, const uint8_t *src, int srcStride,
+                       uint8_t *const dst[4], const int dstStride[4], int width, int height, uint8_t *scratch);
+
+#endif //CPPSCREENRECORDER_SRCOLORCONVERT_H
@@ -0,0 +1,442 @@
+#include "SRCompact.h"
+#include "SRLog.h"
+#include "SRThreads.h"
+
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+extern "C"
+{
+#include "libavutil/opt.h"
+#include "libswscale/swscale.h"
+}
+
+using namespace std;
+
+SRCompact::SRCompact(int crf, int jobs, enum AVCodecID codec, bool fast, int64_t bitrate): crf(crf), jobs(jobs),
+        videoCodec(codec), fast(fast), bitrate(bitrate) {}
+
+/**
+ * openChunkEncoder() opens libx264 or the MPEG-4 encoder for the frames of decoder, with the settings every chunk shares
+ * @param pass 0 for a single pass, 1 or 2 of a two-pass export
+ * @param bitrate of the second pass
+ * @param stats the stats file of x264, or the first pass of the MPEG-4 rate control for the second one
+ */
+static AVCodecContext *openChunkEncoder(const AVCodecContext *decoder, AVRational timeBase, AVRational frameRate,
+                                        enum AVCodecID id, int crf, bool fast, int threads, int pass, int64_t bitrate,
+                                        const std::string &stats) {
+    const AVCodec *codec = id == AV_CODEC_ID_H264 ? avcodec_find_encoder_by_name("libx264") : avcodec_find_encoder(id);
+    AVCodecContext *enc = codec ? avcodec_alloc_context3(codec) : nullptr;
+    if (!enc)
+        return nullptr;
+    enc->width = decoder->width;
+    enc->height = decoder->height;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->sample_aspect_ratio = decoder->sample_aspect_ratio;
+    enc->time_base = timeBase;
+    enc->framerate = frameRate;
+    enc->thread_count = threads;
+    //Matroska chunks: the parameter sets go in the extradata, the same for every chunk
+    enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    //the first pass at the quality of a single one: its bytes are the complexity the budget is shared out with
+    if (pass == 1)
+        enc->flags |= AV_CODEC_FLAG_PASS1;
+    else if (pass == 2) {
+        enc->flags |= AV_CODEC_FLAG_PASS2;
+        enc->bit_rate = bitrate;
+    }
+    if (id == AV_CODEC_ID_H264) {
+        //the same preset in both passes: x264 refuses a second pass with other frame type decisions
+        av_opt_set(enc->priv_data, "preset", fast ? COMPACT_FAST_PRESET : COMPACT_PRESET, 0);
+        if (pass != 2)
+            av_opt_set_int(enc->priv_data, "crf", crf, 0);
+        if (pass == 1)
+            av_opt_set(enc->priv_data, "x264-params", COMPACT_FIRST_PASS, 0);
+        if (pass)
+            av_opt_set(enc->priv_data, "stats", stats.c_str(), 0);
+    } else {
+        //a chunk must not reference the frames of the one before: every GOP is closed
+        enc->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+        if (pass != 2) {
+            enc->flags |= AV_CODEC_FLAG_QSCALE;
+            enc->global_quality = FF_QP2LAMBDA * COMPACT_QSCALE;
+        } else {
+            //read by ff_rate_control_init() in avcodec_open2(), left to the caller to free
+            enc->stats_in = (char *) stats.c_str();
+        }
+    }
+    int ret = avcodec_open2(enc, codec, nullptr);
+    enc->stats_in = nullptr;
+    if (ret < 0)
+        avcodec_free_context(&enc);
+    return enc;
+}
+
+/**
+ * writeEncoded() gives frame to the encoder, nullptr drains it, and writes the packets it has ready to the chunk
+ * @param out nullptr in a first pass: the packets are only counted in bytes, the ratecontrol.c stats kept in stats
+ */
+static int writeEncoded(AVCodecContext *enc, AVFrame *frame, AVFormatContext *out, AVPacket *pkt, int64_t &bytes,
+                        std::string &stats) {
+    int ret = avcodec_send_frame(enc, frame);
+    while (ret >= 0 && (ret = avcodec_receive_packet(enc, pkt)) >= 0) {
+        bytes += pkt->size;
+        if (!out) {
+            //the MPEG-4 encoder overwrites its line with each picture, x264 writes its file itself
+            if (enc->stats_out)
+                stats += enc->stats_out;
+            av_packet_unref(pkt);
+            continue;
+        }
+        pkt->stream_index = 0;
+        av_packet_rescale_ts(pkt, enc->time_base, out->streams[0]->time_base);
+        ret = av_write_frame(out, pkt);
+        av_packet_unref(pkt);
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/**
+ * encodeChunk() is the execution flow of a chunk thread: it seeks to the keyframe opening the chunk,
+ * decodes up to the keyframe opening the next one and encodes the frames into chunk.file; the first pass of a
+ * two-pass export writes the stats of the chunk only
+ */
+void SRCompact::encodeChunk(const char *input, int videoIndex, Chunk &chunk, int pass) {
+    AVFormatContext *in = nullptr, *out = nullptr;
+    AVCodecContext *decoder = nullptr, *encoder = nullptr;
+    struct SwsContext *sws = nullptr;
+    AVPacket *pkt = av_packet_alloc(), *encoded = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc(), *converted = av_frame_alloc();
+    AVStream *source = nullptr;
+    const AVCodec *codec = nullptr;
+
+    int ret = pkt && encoded && frame && converted ? 0 : AVERROR(ENOMEM);
+    if (ret >= 0)
+        ret = avformat_open_input(&in, input, nullptr, nullptr);
+    if (ret >= 0)
+        ret = avformat_find_stream_info(in, nullptr);
+    if (ret >= 0) {
+        source = in->streams[videoIndex];
+        codec = avcodec_find_decoder(source->codecpar->codec_id);
+        decoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+        ret = decoder ? avcodec_parameters_to_context(decoder, source->codecpar) : AVERROR_DECODER_NOT_FOUND;
+    }
+    if (ret >= 0) {
+        //the parallelism is between the chunks: the codecs only get the cores no chunk has
+        decoder->thread_count = chunk.threads;
+        ret = avcodec_open2(decoder, codec, nullptr);
+    }
+    if (ret >= 0 && chunk.start != AV_NOPTS_VALUE)
+        ret = avformat_seek_file(in, videoIndex, INT64_MIN, chunk.start, chunk.start, 0);
+    if (ret >= 0) {
+        encoder = openChunkEncoder(decoder, source->time_base, av_guess_frame_rate(in, source, nullptr), videoCodec, crf, fast,
+                                   chunk.threads, pass, chunk.bitrate, chunk.stats);
+        ret = !encoder ? AVERROR_ENCODER_NOT_FOUND :
+              pass == 1 ? 0 : avformat_alloc_output_context2(&out, nullptr, "matroska", chunk.file.c_str());
+    }
+    if (ret >= 0 && pass == 2 && videoCodec != AV_CODEC_ID_H264)
+        std::string().swap(chunk.stats);
+    if (ret >= 0 && out) {
+        AVStream *st = avformat_new_stream(out, nullptr);
+        ret = st ? avcodec_parameters_from_context(st->codecpar, encoder) : AVERROR(ENOMEM);
+        if (st)
+            st->time_base = encoder->time_base;
+    }
+    if (ret >= 0 && out)
+        ret = avio_open2(&out->pb, chunk.file.c_str(), AVIO_FLAG_WRITE, nullptr, nullptr);
+    if (ret >= 0 && out)
+        ret = avformat_write_header(out, nullptr);
+    if (ret >= 0) {
+        sws = sws_getContext(decoder->width, decoder->height, decoder->pix_fmt, encoder->width, encoder->height,
+                             encoder->pix_fmt, SWS_BICUBIC, nullptr, nullptr, nullptr);
+        converted->format = encoder->pix_fmt;
+        converted->width = encoder->width;
+        converted->height = encoder->height;
+        ret = sws ? av_frame_get_buffer(converted, 0) : AVERROR(EINVAL);
+    }
+
+    //the chunk owns the packets from its first keyframe to the first keyframe of the next chunk, excluded
+    bool started = chunk.start == AV_NOPTS_VALUE, draining = false;
+    while (ret >= 0 && !draining) {
+        if (av_read_frame(in, pkt) < 0) {
+            draining = true;
+            ret = avcodec_send_packet(decoder, nullptr);
+        } else if (pkt->stream_index != videoIndex) {
+            av_packet_unref(pkt);
+            continue;
+        } else {
+            bool key = pkt->flags & AV_PKT_FLAG_KEY;
+            int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+            if (key && chunk.end != AV_NOPTS_VALUE && pts >= chunk.end) {
+                draining = true;
+                ret = avcodec_send_packet(decoder, nullptr);
+            } else {
+                started = started || (key && pts >= chunk.start);
+                ret = started ? avcodec_send_packet(decoder, pkt) : 0;
+            }
+            av_packet_unref(pkt);
+        }
+        while (ret >= 0 && (ret = avcodec_receive_frame(decoder, frame)) >= 0) {
+            if ((ret = av_frame_make_writable(converted)) < 0)
+                break;
+            sws_scale(sws, frame->data, frame->linesize, 0, frame->height, converted->data, converted->linesize);
+            converted->pts = frame->best_effort_timestamp;
+            av_frame_unref(frame);
+            ret = writeEncoded(encoder, converted, out, encoded, chunk.bytes, chunk.stats);
+            chunk.frames++;
+        }
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            ret = 0;
+    }
+    if (ret >= 0)
+        ret = writeEncoded(encoder, nullptr, out, encoded, chunk.bytes, chunk.stats);
+    if (ret >= 0 && out)
+        ret = av_write_trailer(out);
+    chunk.ret = ret;
+
+    sws_freeContext(sws);
+    av_frame_free(&converted);
+    av_frame_free(&frame);
+    av_packet_free(&encoded);
+    av_packet_free(&pkt);
+    avcodec_free_context(&encoder);
+    avcodec_free_context(&decoder);
+    if (out) {
+        avio_closep(&out->pb);
+        avformat_free_context(out);
+    }
+    avformat_close_input(&in);
+}
+
+/* time a packet is interleaved by: its dts, its pts when the demuxer left the dts out */
+static int64_t orderTs(const AVPacket *pkt) {
+    return pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+}
+
+/**
+ * join() writes the video packets of the chunks in order, interleaved by dts with the other streams of input
+ * @Note the B-frame delay of a chunk starts its dts before the end of the previous one: they are moved up by a tick,
+ * and a pts the move passed with them. A packet without any timestamp goes out as soon as it is read.
+ */
+int SRCompact::join(const char *input, int videoIndex, const std::vector<Chunk> &chunks, const char *output) {
+    AVFormatContext *in = nullptr, *chunkIn = nullptr, *out = nullptr;
+    AVPacket *video = av_packet_alloc(), *other = av_packet_alloc();
+    int ret = video && other ? avformat_open_input(&in, input, nullptr, nullptr) : AVERROR(ENOMEM);
+    if (ret >= 0)
+        ret = avformat_find_stream_info(in, nullptr);
+    if (ret >= 0)
+        ret = avformat_open_input(&chunkIn, chunks[0].file.c_str(), nullptr, nullptr);
+    if (ret >= 0)
+        ret = avformat_find_stream_info(chunkIn, nullptr);
+    if (ret >= 0)
+        ret = avformat_alloc_output_context2(&out, nullptr, nullptr, output);
+    for (unsigned int i = 0; ret >= 0 && i < in->nb_streams; i++) {
+        AVStream *st = avformat_new_stream(out, nullptr);
+        AVStream *from = (int) i == videoIndex ? chunkIn->streams[0] : in->streams[i];
+        ret = st ? avcodec_parameters_copy(st->codecpar, from->codecpar) : AVERROR(ENOMEM);
+        if (st) {
+            st->codecpar->codec_tag = 0;
+            st->time_base = from->time_base;
+        }
+    }
+    if (ret >= 0 && !(out->oformat->flags & AVFMT_NOFILE))
+        ret = avio_open2(&out->pb, output, AVIO_FLAG_WRITE, nullptr, nullptr);
+    if (ret >= 0)
+        ret = avformat_write_header(out, nullptr);
+
+    size_t next = 1;
+    bool haveVideo = false, haveOther = false, videoDone = false, otherDone = in->nb_streams < 2;
+    int64_t lastDts = AV_NOPTS_VALUE;
+    while (ret >= 0) {
+        while (!haveVideo && !videoDone) {
+            if (av_read_frame(chunkIn, video) >= 0) {
+                haveVideo = true;
+                break;
+            }
+            //next chunk, the streams are the same
+            avformat_close_input(&chunkIn);
+            if (next == chunks.size()) {
+                videoDone = true;
+            } else if ((ret = avformat_open_input(&chunkIn, chunks[next++].file.c_str(), nullptr, nullptr)) < 0) {
+                videoDone = true;
+            }
+        }
+        while (ret >= 0 && !haveOther && !otherDone) {
+            if (av_read_frame(in, other) < 0)
+                otherDone = true;
+            else if (other->stream_index == videoIndex)
+                av_packet_unref(other);
+            else
+                haveOther = true;
+        }
+        if (ret < 0 || (!haveVideo && !haveOther))
+            break;
+
+        int64_t videoTs = haveVideo ? orderTs(video) : AV_NOPTS_VALUE;
+        int64_t otherTs = haveOther ? orderTs(other) : AV_NOPTS_VALUE;
+        bool videoFirst = haveVideo && (!haveOther || videoTs == AV_NOPTS_VALUE ||
+                (otherTs != AV_NOPTS_VALUE && av_compare_ts(videoTs, chunkIn->streams[0]->time_base,
+                                                            otherTs, in->streams[other->stream_index]->time_base) <= 0));
+        AVPacket *pkt = videoFirst ? video : other;
+        if (videoFirst) {
+            av_packet_rescale_ts(pkt, chunkIn->streams[0]->time_base, out->streams[videoIndex]->time_base);
+            pkt->stream_index = videoIndex;
+            if (pkt->dts != AV_NOPTS_VALUE && lastDts != AV_NOPTS_VALUE && pkt->dts <= lastDts)
+                pkt->dts = lastDts + 1;
+            //the muxers refuse a frame presented before it is decoded
+            if (pkt->pts != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE && pkt->pts < pkt->dts)
+                pkt->pts = pkt->dts;
+            if (pkt->dts != AV_NOPTS_VALUE)
+                lastDts = pkt->dts;
+            haveVideo = false;
+        } else {
+            av_packet_rescale_ts(pkt, in->streams[pkt->stream_index]->time_base, out->streams[pkt->stream_index]->time_base);
+            haveOther = false;
+        }
+        ret = av_interleaved_write_frame(out, pkt);
+    }
+    if (ret >= 0)
+        ret = av_write_trailer(out);
+
+    av_packet_free(&video);
+    av_packet_free(&other);
+    avformat_close_input(&chunkIn);
+    avformat_close_input(&in);
+    if (out) {
+        if (!(out->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&out->pb);
+        avformat_free_context(out);
+    }
+    return ret;
+}
+
+/**
+ * encodeChunks() runs a pass over the chunks on workers jobs, each job takes the next chunk when it is done with one,
+ * in the order they are joined
+ */
+void SRCompact::encodeChunks(const char *input, int videoIndex, std::vector<Chunk> &chunks, int workers, int pass) {
+    std::atomic<int> nextChunk(0);
+    const int count = (int) chunks.size();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < workers; i++)
+        threads.emplace_back([&](){
+            if (!fast)
+                idleThread();
+            for (int c; (c = nextChunk.fetch_add(1)) < count;)
+                encodeChunk(input, videoIndex, chunks[c], pass);
+        });
+    for (auto &t : threads)
+        t.join();
+}
+
+/**
+ * shareBitrate() merges the first pass of the chunks: the budget of the whole file at bitrate goes to the chunks
+ * in proportion of their bytes at the constant quality, each second pass gets the average bitrate of its share
+ */
+void SRCompact::shareBitrate(std::vector<Chunk> &chunks) const {
+    int64_t bytes = 0, frames = 0;
+    for (const Chunk &chunk : chunks) {
+        bytes += chunk.bytes;
+        frames += chunk.frames;
+    }
+    for (Chunk &chunk : chunks) {
+        //bytes per frame of the chunk over the ones of the file, the frame rate is the same
+        chunk.bitrate = bytes > 0 && chunk.frames > 0 ?
+                        FFMAX(av_rescale(bitrate, chunk.bytes * frames, chunk.frames * bytes), 1) : bitrate;
+        chunk.frames = 0;
+        chunk.bytes = 0;
+    }
+}
+
+int SRCompact::run(const char *input, const char *output) {
+    AVFormatContext *in = nullptr;
+    int ret = avformat_open_input(&in, input, nullptr, nullptr);
+    if (ret < 0 || (ret = avformat_find_stream_info(in, nullptr)) < 0) {
+        cout << "\n[SRCompact] cannot read " << input;
+        avformat_close_input(&in);
+        return ret;
+    }
+    int videoIndex = av_find_best_stream(in, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (videoIndex < 0) {
+        cout << "\n[SRCompact] no video in " << input;
+        avformat_close_input(&in);
+        return videoIndex;
+    }
+
+    //one chunk per job, none shorter than COMPACT_MIN_CHUNK; the fast export cuts COMPACT_FAST_CHUNK ones
+    AVStream *st = in->streams[videoIndex];
+    int64_t duration = in->duration > 0 ? in->duration : 0;
+    int workers = jobs > 0 ? jobs : cpuCount();
+    int count = fast ? (int) FFMAX(duration / ((int64_t) COMPACT_FAST_CHUNK * AV_TIME_BASE), 1) :
+                (int) FFMAX(FFMIN((int64_t) workers, duration / ((int64_t) COMPACT_MIN_CHUNK * AV_TIME_BASE)), 1);
+    workers = FFMIN(workers, count);
+    int64_t start = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    std::vector<Chunk> chunks(count);
+    for (int i = 0; i < count; i++) {
+        chunks[i].start = i ? start + av_rescale_q(duration * i / count, AV_TIME_BASE_Q, st->time_base) : AV_NOPTS_VALUE;
+        chunks[i].end = i + 1 < count ? start + av_rescale_q(duration * (i + 1) / count, AV_TIME_BASE_Q, st->time_base)
+                                      : AV_NOPTS_VALUE;
+        chunks[i].file = std::string(output) + ".chunk" + std::to_string(i) + ".mkv";
+        chunks[i].threads = FFMAX(cpuCount() / workers, 1);
+        chunks[i].frames = 0;
+        chunks[i].ret = 0;
+        chunks[i].stats = videoCodec == AV_CODEC_ID_H264 ? chunks[i].file + ".stats" : std::string();
+        chunks[i].bytes = 0;
+        chunks[i].bitrate = bitrate;
+    }
+    avformat_close_input(&in);
+
+    cout << "\n[SRCompact] " << input << ": " << count << " chunks on " << workers << " jobs";
+    if (bitrate > 0) {
+        encodeChunks(input, videoIndex, chunks, workers, 1);
+        for (const Chunk &chunk : chunks)
+            if (chunk.ret < 0 && ret >= 0) {
+                srLog(SR_LOG_ERROR, "[SRCompact] first pass of %s failed", chunk.file.c_str());
+                ret = chunk.ret;
+            }
+        if (ret >= 0) {
+            shareBitrate(chunks);
+            encodeChunks(input, videoIndex, chunks, workers, 2);
+        }
+    } else {
+        encodeChunks(input, videoIndex, chunks, workers, 0);
+    }
+
+    int64_t frames = 0;
+    for (const Chunk &chunk : chunks) {
+        frames += chunk.frames;
+        if (chunk.ret < 0 && ret >= 0) {
+            srLog(SR_LOG_ERROR, "[SRCompact] cannot encode %s", chunk.file.c_str());
+            ret = chunk.ret;
+        }
+    }
+    if (ret >= 0 && (ret = join(input, videoIndex, chunks, output)) < 0)
+        srLog(SR_LOG_ERROR, "[SRCompact] cannot join the chunks into %s", output);
+    for (const Chunk &chunk : chunks) {
+        remove(chunk.file.c_str());
+        if (bitrate > 0 && videoCodec == AV_CODEC_ID_H264) {
+            remove(chunk.stats.c_str());
+            remove((chunk.stats + ".mbtree").c_str());
+        }
+    }
+    flushLog();
+
+    if (ret < 0) {
+        cout << "\n[SRCompact] compacting " << input << " failed";
+        remove(output);
+        return ret;
+    }
+    cout << "\n[SRCompact] " << input << " compacted into " << output << ", " << frames << " frames";
+    return 0;
+}
+
+int SRCompact::runBatch(const std::vector<std::pair<std::string, std::string>> &recordings) {
+    int failed = 0;
+    for (const auto &recording : recordings)
+        if (run(recording.first.c_str(), recording.second.c_str()) < 0)
+            failed++;
+    return failed;
+}
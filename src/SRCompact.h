@@ -0,0 +1,93 @@
+//
+// Offline transcode of the intermediate recordings to H.264 or MPEG-4, split in chunks encoded in parallel.
+//
+
+#ifndef CPPSCREENRECORDER_SRCOMPACT_H
+#define CPPSCREENRECORDER_SRCOMPACT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+#define COMPACT_CRF 20  //x264 constant quality of the compacted recording, text stays sharp
+#define COMPACT_PRESET "slow"   //nobody waits for the job: spend the idle cores on compression
+#define COMPACT_MIN_CHUNK 10    //s, shorter chunks cost more in keyframes than they gain in parallelism
+#define COMPACT_FAST_PRESET "veryfast"  //x264 preset of an export at full speed
+#define COMPACT_FAST_CHUNK 2    //s of each chunk of an export at full speed: a few closed GOPs per encoder instance
+#define COMPACT_QSCALE 3    //fixed quantizer of the MPEG-4 chunks, the crf is libx264 only
+//x264 analysis of a first pass, as x264_param_apply_fastfirstpass(): the frame types and the complexity, not the picture
+#define COMPACT_FIRST_PASS "ref=1:8x8dct=0:partitions=none:me=dia:subme=2:trellis=0:fast-pskip=1"
+
+/**
+ * SRCompact transcodes recordings of SR_PROFILE_INTERMEDIATE (lossless video in Matroska) to H.264,
+ * copying the other streams, into any container av_guess_format() knows from the output name.\n
+ * The video is split at keyframes into one chunk per core, each chunk decoded and encoded by its own thread
+ * into a temporary file; the chunks are then joined without re-encoding, with the audio of the recording,
+ * as the concat demuxer would. The chunk encoders share their settings, so the parameter sets
+ * of the first chunk describe all of them. The threads run in the idle class of the scheduler (idleThread()),
+ * so a batch can be started after a recording without slowing the next one down.\n
+ * The fast export is for when someone waits for the file: the chunks are COMPACT_FAST_CHUNK long, each one a few
+ * closed GOPs, and the jobs take the next one as they finish at normal priority, with the fast preset and one
+ * codec thread per chunk: every core encodes from start to end, none waits for a long last chunk.\n
+ * The two-pass export encodes to an average bitrate: a first pass over the same chunks, in parallel, at the constant
+ * quality with the fast analysis of COMPACT_FIRST_PASS, only writes the stats of the rate control (the stats file of
+ * x264, the stats_out of libavcodec/ratecontrol.c for MPEG-4) and counts the bytes. The bytes per frame of the chunks
+ * at the same quality are their complexity: the budget of the whole file is shared out with them, and the second
+ * pass of each chunk, in parallel again, spreads its share over its frames with its own stats.
+ */
+class SRCompact {
+
+private:
+    struct Chunk {
+        int64_t start;  //first keyframe at or after it, stream time base, AV_NOPTS_VALUE from the beginning
+        int64_t end;    //first keyframe at or after it is left to the next chunk, AV_NOPTS_VALUE to the end
+        std::string file;
+        int threads;    //codec threads, the cores left when there are fewer chunks than cores
+        int64_t frames;
+        int ret;
+        std::string stats;  //x264 stats file, or the text of the MPEG-4 first pass
+        int64_t bytes;  //of the first pass
+        int64_t bitrate;    //of the second pass, the share of the chunk
+    };
+
+    int crf;
+    int jobs;
+    enum AVCodecID videoCodec;
+    bool fast;
+    int64_t bitrate;
+
+    void encodeChunk(const char *input, int videoIndex, Chunk &chunk, int pass);
+    void encodeChunks(const char *input, int videoIndex, std::vector<Chunk> &chunks, int workers, int pass);
+    void shareBitrate(std::vector<Chunk> &chunks) const;
+    int join(const char *input, int videoIndex, const std::vector<Chunk> &chunks, const char *output);
+
+public:
+    /**
+     * @param jobs chunks encoded at the same time, 0 for one per core
+     * @param codec AV_CODEC_ID_H264 (libx264) or AV_CODEC_ID_MPEG4
+     * @param fast export at full speed instead of in the background
+     * @param bitrate bit/s of a two-pass export, 0 for the constant quality of crf
+     */
+    explicit SRCompact(int crf = COMPACT_CRF, int jobs = 0, enum AVCodecID codec = AV_CODEC_ID_H264, bool fast = false,
+                       int64_t bitrate = 0);
+
+    /**
+     * run() transcodes input into output, output is removed when the job fails
+     * @return 0 on success, a negative AVERROR code otherwise
+     */
+    int run(const char *input, const char *output);
+
+    /**
+     * runBatch() compacts every pair of inputs and outputs in turn, each one on all the jobs
+     * @return the number of recordings that failed
+     */
+    int runBatch(const std::vector<std::pair<std::string, std::string>> &recordings);
+};
+
+#endif //CPPSCREENRECORDER_SRCOMPACT_H
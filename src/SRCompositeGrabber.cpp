@@ -0,0 +1,157 @@
+#include "SRCompositeGrabber.h"
+#include "SRLog.h"
+
+#include <cstring>
+
+extern "C"
+{
+#include "libavutil/error.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/time.h"
+}
+
+SRCompositeGrabber::SRCompositeGrabber(): canvasWidth(0), canvasHeight(0), bytesPerPixel(4), generation(0), pending(0),
+                                          stopping(false), canvas(nullptr) {}
+
+SRCompositeGrabber::~SRCompositeGrabber() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    start.notify_all();
+    for (auto &region : regions) {
+        if (region->worker.joinable())
+            region->worker.join();
+        av_frame_free(&region->frame);
+    }
+}
+
+void SRCompositeGrabber::add(SRVideoGrabber *grabber, int x, int y, int width, int height) {
+    std::unique_ptr<Region> region(new Region());
+    region->grabber.reset(grabber);
+    region->x = x;
+    region->y = y;
+    region->width = width;
+    region->height = height;
+    region->column = canvasWidth;
+    region->frame = nullptr;
+    region->result = 0;
+    canvasWidth += width;
+    if (height > canvasHeight)
+        canvasHeight = height;
+    regions.push_back(std::move(region));
+}
+
+int SRCompositeGrabber::open(const char *device, int x, int y, int width, int height) {
+    (void) x; (void) y; (void) width; (void) height;
+    if (regions.empty())
+        return AVERROR(EINVAL);
+
+    for (auto &region : regions) {
+        int ret = region->grabber->open(device, region->x, region->y, region->width, region->height);
+        if (ret < 0)
+            return ret;
+        if (region->grabber->pixelFormat() != pixelFormat()) {
+            srLog(SR_LOG_ERROR, "[SRCompositeGrabber] %s does not produce %s", region->grabber->name(),
+                  av_get_pix_fmt_name(pixelFormat()));
+            return AVERROR(EINVAL);
+        }
+        region->frame = av_frame_alloc();
+        if (!region->frame)
+            return AVERROR(ENOMEM);
+    }
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pixelFormat());
+    if (!desc || desc->nb_components == 0 || (desc->flags & AV_PIX_FMT_FLAG_PLANAR))
+        return AVERROR(EINVAL);
+    bytesPerPixel = desc->comp[0].step;
+
+    for (size_t i = 1; i < regions.size(); i++)
+        regions[i]->worker = std::thread(&SRCompositeGrabber::run, this, regions[i].get());
+    return 0;
+}
+
+/**
+ * grabRegion() grabs one region and copies it into its column of the canvas,
+ * the rows below a region shorter than the canvas are cleared
+ */
+int SRCompositeGrabber::grabRegion(Region &region) {
+    int ret = region.grabber->grab(region.frame);
+    if (ret < 0)
+        return ret;
+    if (!region.frame->buf[0])
+        return AVERROR(EIO);
+
+    uint8_t *dst = canvas->data[0] + (size_t) region.column * bytesPerPixel;
+    av_image_copy_plane(dst, canvas->linesize[0], region.frame->data[0], region.frame->linesize[0],
+                        region.width * bytesPerPixel, region.height);
+    for (int row = region.height; row < canvasHeight; row++)
+        memset(dst + (size_t) row * canvas->linesize[0], 0, (size_t) region.width * bytesPerPixel);
+    return ret;
+}
+
+/**
+ * run() is the grab thread of a region: one grabRegion() for each generation
+ */
+void SRCompositeGrabber::run(Region *region) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            start.wait(guard, [&](){return stopping || generation != seen;});
+            if (stopping)
+                return;
+            seen = generation;
+        }
+        int ret = grabRegion(*region);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            region->result = ret;
+            if (--pending == 0)
+                done.notify_one();
+        }
+    }
+}
+
+int SRCompositeGrabber::grab(AVFrame *frame) {
+    //frames coming from a pool already have their buffer
+    if (!frame->buf[0]) {
+        frame->format = pixelFormat();
+        frame->width = canvasWidth;
+        frame->height = canvasHeight;
+        int ret = av_frame_get_buffer(frame, 32);
+        if (ret < 0) return ret;
+    }
+    int64_t pts = av_gettime();
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        canvas = frame;
+        pending = (int) regions.size() - 1;
+        generation++;
+    }
+    start.notify_all();
+    int ret = grabRegion(*regions[0]);
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&](){return pending == 0;});
+    }
+
+    bool changed = ret == 0;
+    for (size_t i = 1; i < regions.size() && ret >= 0; i++) {
+        int result = regions[i]->result;
+        if (result < 0)
+            ret = result;
+        changed = changed || result == 0;
+    }
+    if (ret < 0)
+        return ret;
+    if (!changed)
+        return SR_GRAB_UNCHANGED;
+    frame->pts = pts;
+    return 0;
+}
+
+enum AVPixelFormat SRCompositeGrabber::pixelFormat() const {
+    return regions.empty() ? AV_PIX_FMT_NONE : regions[0]->grabber->pixelFormat();
+}
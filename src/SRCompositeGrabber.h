@@ -0,0 +1,81 @@
+//
+// Multi-monitor grabber: one grab thread per display region, composited into one canvas.
+//
+
+#ifndef CPPSCREENRECORDER_SRCOMPOSITEGRABBER_H
+#define CPPSCREENRECORDER_SRCOMPOSITEGRABBER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "SRVideoGrabber.h"
+
+/**
+ * SRCompositeGrabber records several regions, typically one per monitor, as a single frame: the regions are laid
+ * out left to right in the order they were added, top aligned, on a canvas as wide as all of them and as tall
+ * as the tallest one.\n
+ * Each region has its own back-end: a grab() wakes one thread per region (the calling thread takes the first one),
+ * each grabs its region and copies it into its column of the canvas, so the capture cost is spread over the cores
+ * instead of one large grab.\n
+ * A region that reports SR_GRAB_UNCHANGED is copied from its previous grab; grab() returns SR_GRAB_UNCHANGED
+ * when no region changed, the canvas is written anyway.
+ *
+ * @Note every back-end must produce the same packed pixel format
+ */
+class SRCompositeGrabber : public SRVideoGrabber {
+
+private:
+    struct Region {
+        std::unique_ptr<SRVideoGrabber> grabber;
+        int x, y, width, height;
+        int column;     //left edge in the canvas
+        AVFrame *frame;     //previous grab of the region
+        int result;     //of the last grab, under lock
+        std::thread worker;
+    };
+
+    std::vector<std::unique_ptr<Region>> regions;
+    int canvasWidth, canvasHeight;
+    int bytesPerPixel;
+
+    std::mutex lock;
+    std::condition_variable start;
+    std::condition_variable done;
+    uint64_t generation;    //under lock, one per grab()
+    int pending;    //under lock, regions still grabbing
+    bool stopping;  //under lock
+    AVFrame *canvas;    //frame of the running grab(), set before generation changes
+
+    void run(Region *region);
+    int grabRegion(Region &region);
+
+public:
+    SRCompositeGrabber();
+    ~SRCompositeGrabber() override;
+
+    SRCompositeGrabber(const SRCompositeGrabber&) = delete;
+    SRCompositeGrabber &operator=(const SRCompositeGrabber&) = delete;
+
+    /**
+     * add() appends a region captured by grabber, before open(): the composite takes its ownership
+     */
+    void add(SRVideoGrabber *grabber, int x, int y, int width, int height);
+
+    int width() const { return canvasWidth; }
+    int height() const { return canvasHeight; }
+
+    /**
+     * open() opens every region on device and starts the grab threads, the region arguments are ignored:
+     * the canvas is width() x height()
+     */
+    int open(const char *device, int x, int y, int width, int height) override;
+    int grab(AVFrame *frame) override;
+
+    enum AVPixelFormat pixelFormat() const override;
+    const char *name() const override { return "composite"; }
+};
+
+#endif //CPPSCREENRECORDER_SRCOMPOSITEGRABBER_H
@@ -0,0 +1,71 @@
+//
+// Content-adaptive VBV cap of the constant quality encodes: the motion and the detail of the screen set the peak rate.
+//
+
+#include "SRContentRate.h"
+
+#include <cstdlib>
+
+extern "C"
+{
+#include "libavutil/common.h"
+#include "libavutil/frame.h"
+#include "libavutil/pixdesc.h"
+}
+
+SRContentRate::SRContentRate(int64_t base, int fps): base(base), cap(0), fps(FFMAX(fps, 1)), periodStart(AV_NOPTS_VALUE),
+                                                     changedSum(0), detail(CONTENT_DETAIL_REF), detailed(false),
+                                                     boundary(false), held(0), lowest(0), highest(0), changes(0) {}
+
+double SRContentRate::detailOf(const uint8_t *luma, int stride, int width, int height) {
+    int64_t sum = 0, count = 0;
+    for (int y = 0; y + 1 < height; y += CONTENT_RATE_STEP) {
+        const uint8_t *row = luma + (size_t) y * stride, *below = row + stride;
+        for (int x = 0; x + 1 < width; x += CONTENT_RATE_STEP) {
+            sum += abs(row[x] - row[x + 1]) + abs(row[x] - below[x]);
+            count += 2;
+        }
+    }
+    return count ? (double) sum / count : 0;
+}
+
+int64_t SRContentRate::update(const AVFrame *frame, int changed, int64_t capture) {
+    if (periodStart == AV_NOPTS_VALUE)
+        periodStart = capture;
+    changedSum += changed < 0 ? 1000 : changed;
+    if (!detailed) {
+        //mid-grey detail for the frames without 8 bit luma in system memory
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat) frame->format);
+        if (desc && !(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)) &&
+            desc->comp[0].depth == 8 && desc->comp[0].step == 1 && frame->data[0])
+            detail = detailOf(frame->data[0], frame->linesize[0], frame->width, frame->height);
+        detailed = true;
+    }
+    int64_t elapsed = capture - periodStart;
+    if (elapsed < (int64_t) CONTENT_RATE_PERIOD * 1000)
+        return 0;
+
+    //the frames the period should have had: the static ones skipped before the encoder changed nothing
+    double intervals = FFMAX(elapsed * fps / 1000000.0, 1.0);
+    double motion = FFMIN(changedSum / 1000 / intervals / CONTENT_MOTION_REF, 2.0);
+    double detailLevel = FFMIN(detail / CONTENT_DETAIL_REF, 2.0);
+    double factor = CONTENT_RATE_MIN / 100.0 + (1 - CONTENT_RATE_MIN / 100.0) * motion * (0.5 + 0.5 * detailLevel);
+    factor = av_clipd(factor, CONTENT_RATE_MIN / 100.0, CONTENT_RATE_MAX / 100.0);
+    int64_t target = (int64_t) (base * factor);
+    bool keyed = boundary || ++held >= CONTENT_RATE_HOLD;
+    periodStart = capture;
+    changedSum = 0;
+    detailed = false;
+    boundary = false;
+
+    bool rise = target > cap * (100 + CONTENT_RATE_HYSTERESIS) / 100;
+    bool fall = keyed && target < cap * (100 - CONTENT_RATE_HYSTERESIS) / 100;
+    if (cap && !rise && !fall)
+        return 0;
+    cap = target;
+    held = 0;
+    lowest = lowest ? FFMIN(lowest, cap) : cap;
+    highest = FFMAX(highest, cap);
+    changes++;
+    return cap;
+}
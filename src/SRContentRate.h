@@ -0,0 +1,82 @@
+//
+// Content-adaptive VBV cap of the constant quality encodes: the motion and the detail of the screen set the peak rate.
+//
+
+#ifndef CPPSCREENRECORDER_SRCONTENTRATE_H
+#define CPPSCREENRECORDER_SRCONTENTRATE_H
+
+#include <cstdint>
+
+struct AVFrame;
+
+#define CONTENT_CRF 23      //quality of settings._contentrate when settings._crf is not set
+#define CONTENT_RATE_PERIOD 1000    //ms between two estimates of the content
+#define CONTENT_RATE_STEP 8     //px between two luma samples of the detail estimate, on both axes
+#define CONTENT_MOTION_REF 0.25     //share of the screen changing per frame the base rate is sized for: a playing video
+#define CONTENT_DETAIL_REF 12.0     //mean luma gradient of a page of text
+#define CONTENT_RATE_MIN 25     //% of the base rate the cap goes down to on a still screen
+#define CONTENT_RATE_MAX 200    //% of the base rate the cap goes up to
+#define CONTENT_RATE_HYSTERESIS 15  //% the estimate must move by before the encoder is reconfigured
+#define CONTENT_RATE_HOLD 10    //estimates a lower cap waits for a keyframe at most
+
+/**
+ * SRContentRate sizes the VBV of a constant quality encode (CRF, CQ) to what is on the screen, instead of the one
+ * rate of the resolution: the constant quality spends what each frame needs, the cap only matters on the peaks,
+ * and a still terminal has none a video has.\n
+ * The estimate costs nearly nothing: the motion is the share of the tiles the tile hasher of the VideoThread found
+ * changed, per frame interval over CONTENT_RATE_PERIOD (the skipped static frames count as unchanged), and the
+ * detail the mean luma gradient of a CONTENT_RATE_STEP grid of one frame per period. Their product moves the cap
+ * between CONTENT_RATE_MIN and CONTENT_RATE_MAX % of the base rate. A higher cap applies at once, a lower one waits
+ * for the next keyframe out of the encoder (or CONTENT_RATE_HOLD periods), so a GOP is never squeezed halfway.
+ *
+ * @Note ProducerThread only
+ */
+class SRContentRate {
+
+private:
+    int64_t base, cap;
+    int fps;
+    int64_t periodStart;
+    double changedSum;      //per mille of the frames of the period
+    double detail;
+    bool detailed;      //detail measured in the period
+    bool boundary;      //a keyframe came out of the encoder in the period
+    int held;
+    int64_t lowest, highest;
+    uint64_t changes;
+
+public:
+    /**
+     * @param base bit/s the encoder was opened with, the cap of a content like CONTENT_MOTION_REF and CONTENT_DETAIL_REF
+     */
+    SRContentRate(int64_t base, int fps);
+
+    /**
+     * update() takes a frame the encoder gets next
+     * @param changed per mille of its tiles that changed, -1 unknown
+     * @param capture us on the capture clock
+     * @return the cap the encoder gets from this frame on, 0 to keep the current one
+     */
+    int64_t update(const AVFrame *frame, int changed, int64_t capture);
+
+    /**
+     * keyframe() tells a keyframe came out of the encoder: a lower cap may start there
+     */
+    void keyframe() { boundary = true; }
+
+    /**
+     * setBase() follows a new bitrate of setBitrate(), the next update() sets the cap again
+     */
+    void setBase(int64_t bitrate) { base = bitrate; cap = 0; }
+
+    int64_t lowestCap() const { return lowest; }
+    int64_t highestCap() const { return highest; }
+    uint64_t changeCount() const { return changes; }
+
+    /**
+     * detailOf() is the mean absolute luma gradient on a CONTENT_RATE_STEP grid of an 8 bit plane
+     */
+    static double detailOf(const uint8_t *luma, int stride, int width, int height);
+};
+
+#endif //CPPSCREENRECORDER_SRCONTENTRATE_H
@@ -0,0 +1,109 @@
+//
+// Optional C++20 coroutines over SRTaskPool: device reads, encoder calls and writes as awaitables of pool tasks.
+//
+
+#include "SRCoroutine.h"
+
+#ifdef SR_HAVE_COROUTINES
+
+void SRCoTask::spawn(SRTaskPool &pool, std::function<void(int)> done, SRTaskPriority priority) {
+    if (!handle)
+        return;
+    std::coroutine_handle<promise_type> h = handle;
+    handle = nullptr;
+    h.promise().detached = true;
+    h.promise().done = std::move(done);
+    pool.submit([h](){ h.resume(); }, priority);
+}
+
+SRCoTimer::SRCoTimer(): stopping(false) {
+    thread = std::thread(&SRCoTimer::run, this);
+}
+
+SRCoTimer::~SRCoTimer() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+}
+
+void SRCoTimer::add(std::chrono::steady_clock::time_point due, std::coroutine_handle<> h, SRTaskPool &pool,
+                    SRTaskPriority priority) {
+    bool first;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        first = entries.empty() || due < entries.top().due;
+        entries.push(Entry{due, h, &pool, priority});
+    }
+    //a later deadline than the one the thread sleeps to changes nothing
+    if (first)
+        wake.notify_one();
+}
+
+void SRCoTimer::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        if (entries.empty() && stopping)
+            return;
+        if (entries.empty()) {
+            wake.wait(guard);
+            continue;
+        }
+        if (!stopping && std::chrono::steady_clock::now() < entries.top().due) {
+            wake.wait_until(guard, entries.top().due);
+            continue;
+        }
+        Entry entry = entries.top();
+        entries.pop();
+        //submit() may wake a worker: not under the lock of the callers of add()
+        guard.unlock();
+        std::coroutine_handle<> h = entry.handle;
+        entry.pool->submit([h](){ h.resume(); }, entry.priority);
+        guard.lock();
+    }
+}
+
+SRCoTask readPacket(SRTaskPool &pool, SRCoTimer &timer, AVFormatContext *in, AVPacket *pkt) {
+    in->flags |= AVFMT_FLAG_NONBLOCK;
+    int64_t wait = CO_POLL_MIN;
+    while (true) {
+        int ret = av_read_frame(in, pkt);
+        if (ret != AVERROR(EAGAIN))
+            co_return ret;
+        co_await timer.sleep(pool, wait);
+        wait = FFMIN(wait * 2, CO_POLL_MAX);
+    }
+}
+
+SRCoTask encodeFrame(SRTaskPool &pool, AVCodecContext *enc, const AVFrame *frame, std::vector<AVPacket *> &packets) {
+    co_await resumeOn(pool);
+    int ret = avcodec_send_frame(enc, frame);
+    if (ret < 0 && ret != AVERROR(EAGAIN))
+        co_return ret;
+    while (true) {
+        AVPacket *pkt = av_packet_alloc();
+        if (!pkt)
+            co_return AVERROR(ENOMEM);
+        int received = avcodec_receive_packet(enc, pkt);
+        if (received < 0) {
+            av_packet_free(&pkt);
+            if (received == AVERROR(EAGAIN))
+                break;
+            co_return received;
+        }
+        packets.push_back(pkt);
+    }
+    //a full encoder took nothing: the frame goes now that its packets are out
+    if (ret == AVERROR(EAGAIN) && (ret = avcodec_send_frame(enc, frame)) < 0)
+        co_return ret;
+    co_return 0;
+}
+
+SRCoTask writePacket(SRTaskPool &pool, AVFormatContext *out, AVPacket *pkt) {
+    co_await resumeOn(pool, SR_TASK_BACKGROUND);
+    co_return av_interleaved_write_frame(out, pkt);
+}
+
+#endif
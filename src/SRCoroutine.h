@@ -0,0 +1,200 @@
+//
+// Optional C++20 coroutines over SRTaskPool: device reads, encoder calls and writes as awaitables of pool tasks.
+//
+
+#ifndef CPPSCREENRECORDER_SRCOROUTINE_H
+#define CPPSCREENRECORDER_SRCOROUTINE_H
+
+//the rest of the tree is C++14: the API only exists in a build with SR_COROUTINES, see CMakeLists.txt.
+//The threads of ScreenRecorder do not run on it, the coroutines mode of the benchmark does
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define SR_HAVE_COROUTINES 1
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include "SRTaskPool.h"
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+#define CO_POLL_MIN 500     //us a read waits after the device had nothing ready, doubling up to CO_POLL_MAX
+#define CO_POLL_MAX 8000    //us, a frame at 120 fps
+
+/**
+ * SRCoTask is a coroutine of a pipeline stage, returning 0 or a negative AVERROR code like the calls it wraps.\n
+ * It starts suspended: co_await runs it and resumes the caller when it returns, on the worker that ran its last
+ * step, with no thread switch in between; spawn() starts it detached on a pool.
+ * The steps of one coroutine never run at the same time: a chain of them is one session stage, in order, as
+ * SRSerialTask would run it, and a step that waits gives its worker to the other sessions.
+ */
+class SRCoTask {
+
+public:
+    struct promise_type {
+        int result = 0;
+        bool detached = false;
+        std::coroutine_handle<> continuation;
+        std::function<void(int)> done;
+
+        SRCoTask get_return_object() { return SRCoTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct Final {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                promise_type &p = h.promise();
+                if (p.continuation)
+                    return p.continuation;
+                if (p.done)
+                    p.done(p.result);
+                //nobody holds a spawned task: it frees itself
+                if (p.detached)
+                    h.destroy();
+                return std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+
+        Final final_suspend() noexcept { return {}; }
+        void return_value(int value) { result = value; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    SRCoTask(SRCoTask &&other) noexcept: handle(other.handle) { other.handle = nullptr; }
+    SRCoTask(const SRCoTask&) = delete;
+    SRCoTask &operator=(const SRCoTask&) = delete;
+    ~SRCoTask() { if (handle) handle.destroy(); }
+
+    bool await_ready() const noexcept { return !handle || handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+    int await_resume() const noexcept { return handle ? handle.promise().result : AVERROR(EINVAL); }
+
+    /**
+     * spawn() starts the coroutine on a worker of pool, on its own: it frees itself when it returns
+     * @param done called with the result, on the worker of the last step
+     */
+    void spawn(SRTaskPool &pool, std::function<void(int)> done = nullptr, SRTaskPriority priority = SR_TASK_REALTIME);
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit SRCoTask(std::coroutine_handle<promise_type> h): handle(h) {}
+};
+
+/**
+ * resumeOn() moves the coroutine to the end of a lane of pool: co_await resumeOn(pool, SR_TASK_BACKGROUND)
+ * before work that may be late, co_await resumeOn(pool, SR_TASK_REALTIME, true) to let the other tasks of the
+ * worker run first
+ */
+struct SRCoResume {
+    SRTaskPool &pool;
+    SRTaskPriority priority;
+    bool yield;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) const {
+        pool.submit([h](){ h.resume(); }, priority, yield);
+    }
+    void await_resume() const noexcept {}
+};
+
+inline SRCoResume resumeOn(SRTaskPool &pool, SRTaskPriority priority = SR_TASK_REALTIME, bool yield = false) {
+    return SRCoResume{pool, priority, yield};
+}
+
+/**
+ * SRCoTimer resumes the coroutines waiting on it, at their deadline, on the lanes of their pools: a wait takes
+ * no worker. One thread for all the sessions, it only queues.
+ */
+class SRCoTimer {
+
+private:
+    struct Entry {
+        std::chrono::steady_clock::time_point due;
+        std::coroutine_handle<> handle;
+        SRTaskPool *pool;
+        SRTaskPriority priority;
+
+        bool operator>(const Entry &other) const { return due > other.due; }
+    };
+
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> entries;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping;
+    std::thread thread;
+
+    void run();
+
+public:
+    SRCoTimer();
+
+    /**
+     * ~SRCoTimer() resumes the coroutines still waiting at once, then stops: their waits end early
+     */
+    ~SRCoTimer();
+
+    SRCoTimer(const SRCoTimer&) = delete;
+    SRCoTimer &operator=(const SRCoTimer&) = delete;
+
+    void add(std::chrono::steady_clock::time_point due, std::coroutine_handle<> h, SRTaskPool &pool,
+             SRTaskPriority priority);
+
+    struct Sleep {
+        SRCoTimer &timer;
+        SRTaskPool &pool;
+        int64_t us;
+        SRTaskPriority priority;
+
+        bool await_ready() const noexcept { return us <= 0; }
+        void await_suspend(std::coroutine_handle<> h) const {
+            timer.add(std::chrono::steady_clock::now() + std::chrono::microseconds(us), h, pool, priority);
+        }
+        void await_resume() const noexcept {}
+    };
+
+    /**
+     * sleep() suspends the coroutine for us microseconds, it goes on in a lane of pool
+     */
+    Sleep sleep(SRTaskPool &pool, int64_t us, SRTaskPriority priority = SR_TASK_REALTIME) {
+        return Sleep{*this, pool, us, priority};
+    }
+};
+
+/**
+ * readPacket() reads the next packet of a demuxer without blocking a worker: the demuxer is switched to
+ * AVFMT_FLAG_NONBLOCK and, while the device has nothing ready, the coroutine waits on timer from CO_POLL_MIN
+ * to CO_POLL_MAX us between reads. A demuxer without non-blocking reads blocks the worker, like av_read_frame().
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+SRCoTask readPacket(SRTaskPool &pool, SRCoTimer &timer, AVFormatContext *in, AVPacket *pkt);
+
+/**
+ * encodeFrame() sends frame to enc on the real-time lane, nullptr drains it, and receives the packets it has ready
+ * @param packets the packets are appended, allocated with av_packet_alloc() and owned by the caller
+ * @return 0 on success, AVERROR_EOF once drained, a negative AVERROR code otherwise
+ */
+SRCoTask encodeFrame(SRTaskPool &pool, AVCodecContext *enc, const AVFrame *frame, std::vector<AVPacket *> &packets);
+
+/**
+ * writePacket() writes pkt to out on the background lane: a slow disk delays the writes of the session,
+ * never a conversion on the deadline of another one; the coroutine goes on in the background lane
+ * @return the result of av_interleaved_write_frame(), which takes the reference of pkt
+ */
+SRCoTask writePacket(SRTaskPool &pool, AVFormatContext *out, AVPacket *pkt);
+
+#endif
+#endif //CPPSCREENRECORDER_SRCOROUTINE_H
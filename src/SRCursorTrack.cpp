@@ -0,0 +1,396 @@
+#include "SRCursorTrack.h"
+#include "SRLog.h"
+
+#include <cstring>
+
+extern "C"
+{
+#include "libavutil/avutil.h"
+#include "libavutil/common.h"
+#include "libavutil/error.h"
+#include "libavutil/time.h"
+}
+
+#ifdef __unix__
+#include <X11/Xlib.h>
+#include <X11/extensions/Xfixes.h>
+#include <poll.h>
+#endif
+
+#define CURSOR_EVENT_MAX 21     //bytes a move or a shape switch takes at most: its kind and two 10-byte varints
+#define CURSOR_DEFINE_MAX 36    //bytes of a shape definition before its pixels: its kind and 5 varints
+#define CURSOR_POLL_TIMEOUT 100 //ms the reader waits for the display at most before it checks close()
+
+static void putVarint(std::vector<uint8_t> &out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((uint8_t) (v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t) v);
+}
+
+static void putSigned(std::vector<uint8_t> &out, int64_t v) {
+    putVarint(out, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+static bool getVarint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool getSigned(const uint8_t *&p, const uint8_t *end, int64_t &v) {
+    uint64_t u;
+    if (!getVarint(p, end, u))
+        return false;
+    v = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+    return true;
+}
+
+/* the block header size of the track in data, 0 if it is not one */
+static uint32_t blockSizeOf(const uint8_t *data, size_t size) {
+    SRCursorTrackHeader header;
+    if (size < sizeof(header))
+        return 0;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, CURSORTRACK_MAGIC, 4) || header.blockSize < sizeof(SRCursorBlock))
+        return 0;
+    return header.blockSize;
+}
+
+SRCursorTrack::SRCursorTrack(): file(nullptr), stopping(false), interval(0), block(), lastPts(0), blockWall(0),
+                                lastX(0), lastY(0), lastShape(0), shapePending(false), written(0), blocks(0),
+                                shapeCount(0), bytes(0) {
+}
+
+SRCursorTrack::~SRCursorTrack() {
+    close();
+}
+
+int SRCursorTrack::open(const char *path, const char *device, int x, int y, int width, int height, int64_t interval,
+                        std::function<int64_t(int64_t)> stamp) {
+#ifdef __unix__
+    std::string name(device ? device : "");
+    Display *display = XOpenDisplay(name.substr(0, name.find('+')).c_str());
+    if (!display) {
+        srLog(SR_LOG_ERROR, "[SRCursorTrack] cannot open display %s", name.c_str());
+        return AVERROR(EIO);
+    }
+    int fixesEvent, error;
+    if (!XFixesQueryExtension(display, &fixesEvent, &error)) {
+        srLog(SR_LOG_ERROR, "[SRCursorTrack] the display has no XFixes");
+        XCloseDisplay(display);
+        return AVERROR(ENOSYS);
+    }
+    file = fopen(path, "wb");
+    if (!file) {
+        int ret = AVERROR(errno);
+        srLog(SR_LOG_ERROR, "[SRCursorTrack] cannot create %s", path);
+        XCloseDisplay(display);
+        return ret;
+    }
+    SRCursorTrackHeader header = SRCursorTrackHeader();
+    memcpy(header.magic, CURSORTRACK_MAGIC, 4);
+    header.version = CURSORTRACK_VERSION;
+    header.blockSize = sizeof(SRCursorBlock);
+    header.x = x;
+    header.y = y;
+    header.width = width;
+    header.height = height;
+    if (fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file)) {
+        srLog(SR_LOG_ERROR, "[SRCursorTrack] cannot write %s", path);
+        fclose(file);
+        file = nullptr;
+        XCloseDisplay(display);
+        return AVERROR(EIO);
+    }
+    this->path = path;
+    this->stamp = stamp;
+    this->interval = FFMAX(interval, (int64_t) 1000);
+    events.reserve(CURSOR_BLOCK_BYTES);
+    defined.clear();
+    lastShape = 0;
+    shapePending = false;
+    written = blocks = shapeCount = 0;
+    bytes = sizeof(header);
+    stopping.store(false);
+    reader = std::thread(&SRCursorTrack::run, this, display, fixesEvent);
+    return 0;
+#else
+    (void) path, (void) device, (void) x, (void) y, (void) width, (void) height, (void) interval, (void) stamp;
+    return AVERROR(ENOSYS);
+#endif
+}
+
+void SRCursorTrack::close() {
+    if (!file)
+        return;
+    stopping.store(true);
+    if (reader.joinable())
+        reader.join();
+    flush();
+    fclose(file);
+    file = nullptr;
+}
+
+#ifdef __unix__
+/**
+ * run() is the reader thread: it owns display and blocks in poll() on its connection between two samples.\n
+ * XFixes tells when the shape changes, the image is only fetched then; the position is asked for once per
+ * interval, a pointer at rest writes nothing.
+ */
+void SRCursorTrack::run(Display *display, int fixesEvent) {
+    Window root = DefaultRootWindow(display);
+    XFixesSelectCursorInput(display, root, XFixesDisplayCursorNotifyMask);
+    XFlush(display);
+
+    Window rootReturn, child;
+    int rootX = 0, rootY = 0, winX, winY;
+    unsigned int buttons;
+    if (XQueryPointer(display, root, &rootReturn, &child, &rootX, &rootY, &winX, &winY, &buttons))
+        lastX = rootX, lastY = rootY;
+    auto cursor = [&](int64_t wall) {
+        XFixesCursorImage *image = XFixesGetCursorImage(display);
+        if (!image)
+            return;
+        SRCursorShape current = SRCursorShape();
+        //0 is the id of no shape, serials start at 1
+        current.id = (uint32_t) image->cursor_serial;
+        current.width = image->width;
+        current.height = image->height;
+        current.hotX = image->xhot;
+        current.hotY = image->yhot;
+        //the pixels are longs, 64 bit on LP64 systems; a shape already written needs none
+        if (!defined.count(current.id) && current.width <= CURSOR_SHAPE_MAX && current.height <= CURSOR_SHAPE_MAX) {
+            current.pixels.resize((size_t) image->width * image->height);
+            for (size_t i = 0; i < current.pixels.size(); i++)
+                current.pixels[i] = (uint32_t) image->pixels[i];
+        }
+        XFree(image);
+        if (current.id && (defined.count(current.id) || !current.pixels.empty()))
+            shape(wall, current);
+    };
+    cursor(av_gettime());
+
+    struct pollfd fd;
+    fd.fd = ConnectionNumber(display);
+    fd.events = POLLIN;
+    int64_t nextSample = av_gettime();
+    while (!stopping.load()) {
+        bool changed = false;
+        while (XPending(display)) {
+            XEvent event;
+            XNextEvent(display, &event);
+            if (event.type == fixesEvent + XFixesCursorNotify)
+                changed = true;
+        }
+        int64_t now = av_gettime();
+        if (changed)
+            cursor(now);
+        if (now >= nextSample) {
+            if (shapePending)
+                cursor(now);
+            if (XQueryPointer(display, root, &rootReturn, &child, &rootX, &rootY, &winX, &winY, &buttons) &&
+                (rootX != lastX || rootY != lastY))
+                move(now, rootX, rootY);
+            nextSample = FFMAX(nextSample + interval, now);
+        }
+        if (!events.empty() && now - blockWall >= (int64_t) CURSOR_BLOCK_DURATION * 1000)
+            flush();
+        poll(&fd, 1, (int) FFMIN(CURSOR_POLL_TIMEOUT, FFMAX(1, (nextSample - now) / 1000)));
+    }
+    XCloseDisplay(display);
+}
+#endif
+
+/**
+ * begin() stamps an event of needed bytes at most and opens the block it goes in
+ * @return false while paused: the event is not written, the block is closed
+ */
+bool SRCursorTrack::begin(int64_t wall, int64_t &pts, size_t needed) {
+    pts = stamp ? stamp(wall) : wall;
+    if (pts == AV_NOPTS_VALUE) {
+        flush();
+        return false;
+    }
+    if (!events.empty() && (events.size() + needed > CURSOR_BLOCK_BYTES ||
+                            wall - blockWall >= (int64_t) CURSOR_BLOCK_DURATION * 1000))
+        flush();
+    if (events.empty()) {
+        block.pts = pts;
+        block.x = lastX;
+        block.y = lastY;
+        block.shape = lastShape;
+        block.count = 0;
+        lastPts = pts;
+        blockWall = wall;
+    }
+    //the clock only moves forward inside a block: a step back is written as a 0 us gap
+    pts = FFMAX(pts, lastPts);
+    return true;
+}
+
+void SRCursorTrack::move(int64_t wall, int32_t x, int32_t y) {
+    int64_t pts;
+    if (!begin(wall, pts, CURSOR_EVENT_MAX)) {
+        //paused: the next block starts from where the pointer went meanwhile
+        lastX = x, lastY = y;
+        return;
+    }
+    events.push_back((uint8_t) SR_CURSOR_MOVE);
+    putVarint(events, (uint64_t) (pts - lastPts));
+    putSigned(events, x - lastX);
+    putSigned(events, y - lastY);
+    lastX = x;
+    lastY = y;
+    lastPts = pts;
+    block.count++;
+    written++;
+}
+
+void SRCursorTrack::shape(int64_t wall, const SRCursorShape &shape) {
+    if (shape.id == lastShape) {
+        shapePending = false;
+        return;
+    }
+    bool known = defined.count(shape.id) > 0;
+    int64_t pts;
+    if (!begin(wall, pts, known ? CURSOR_EVENT_MAX : CURSOR_DEFINE_MAX + shape.pixels.size() * 4)) {
+        //a shape is only known once written: the one shown while paused is defined after the pause
+        if (known)
+            lastShape = shape.id;
+        shapePending = !known;
+        return;
+    }
+    shapePending = false;
+    events.push_back((uint8_t) (known ? SR_CURSOR_SHAPE : SR_CURSOR_SHAPE_DEFINE));
+    putVarint(events, (uint64_t) (pts - lastPts));
+    putVarint(events, shape.id);
+    if (!known) {
+        putVarint(events, (uint32_t) shape.width);
+        putVarint(events, (uint32_t) shape.height);
+        putVarint(events, (uint32_t) shape.hotX);
+        putVarint(events, (uint32_t) shape.hotY);
+        size_t at = events.size();
+        events.resize(at + shape.pixels.size() * 4);
+        memcpy(events.data() + at, shape.pixels.data(), shape.pixels.size() * 4);
+        defined.insert(shape.id);
+        shapeCount++;
+    }
+    lastShape = shape.id;
+    lastPts = pts;
+    block.count++;
+    written++;
+}
+
+/**
+ * flush() appends the open block, flushed to the kernel: a crash loses CURSOR_BLOCK_DURATION ms of the track at most
+ */
+void SRCursorTrack::flush() {
+    if (events.empty() || !file)
+        return;
+    block.size = (uint32_t) events.size();
+    if (fwrite(&block, sizeof(block), 1, file) != 1 || fwrite(events.data(), events.size(), 1, file) != 1 ||
+        fflush(file))
+        srLog(SR_LOG_WARNING, "[SRCursorTrack] cannot write %s", path.c_str());
+    bytes += sizeof(block) + events.size();
+    blocks++;
+    events.clear();
+}
+
+size_t SRCursorTrack::find(const void *data, size_t size, int64_t pts) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    uint32_t blockSize = blockSizeOf(bytes, size);
+    if (!blockSize)
+        return 0;
+    size_t found = 0;
+    for (size_t offset = sizeof(SRCursorTrackHeader); offset + blockSize <= size;) {
+        SRCursorBlock block;
+        memcpy(&block, bytes + offset, sizeof(block));
+        if (offset + blockSize + block.size > size)
+            break;
+        if (block.pts > pts && found)
+            break;
+        found = offset;
+        if (block.pts > pts)
+            break;
+        offset += blockSize + block.size;
+    }
+    return found;
+}
+
+size_t SRCursorTrack::decode(const void *data, size_t size, size_t offset, std::vector<SRCursorEvent> &events,
+                             std::map<uint32_t, SRCursorShape> *shapes) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    uint32_t blockSize = blockSizeOf(bytes, size);
+    if (!blockSize || offset < sizeof(SRCursorTrackHeader) || offset + blockSize > size)
+        return 0;
+    SRCursorBlock block;
+    memcpy(&block, bytes + offset, sizeof(block));
+    if (offset + blockSize + block.size > size)
+        return 0;
+    const uint8_t *p = bytes + offset + blockSize, *end = p + block.size;
+    SRCursorEvent event = SRCursorEvent();
+    event.pts = block.pts;
+    event.x = block.x;
+    event.y = block.y;
+    event.shape = block.shape;
+    for (uint32_t i = 0; i < block.count && p < end; i++) {
+        event.kind = *p++;
+        uint64_t dt, id, w, h, hx, hy;
+        int64_t dx, dy;
+        if (!getVarint(p, end, dt))
+            return 0;
+        event.pts += (int64_t) dt;
+        switch (event.kind) {
+            case SR_CURSOR_MOVE:
+                if (!getSigned(p, end, dx) || !getSigned(p, end, dy))
+                    return 0;
+                event.x += (int32_t) dx;
+                event.y += (int32_t) dy;
+                break;
+            case SR_CURSOR_SHAPE:
+                if (!getVarint(p, end, id))
+                    return 0;
+                event.shape = (uint32_t) id;
+                break;
+            case SR_CURSOR_SHAPE_DEFINE:
+                if (!getVarint(p, end, id) || !getVarint(p, end, w) || !getVarint(p, end, h) ||
+                    !getVarint(p, end, hx) || !getVarint(p, end, hy) || w > CURSOR_SHAPE_MAX || h > CURSOR_SHAPE_MAX ||
+                    (size_t) (end - p) < w * h * 4)
+                    return 0;
+                event.shape = (uint32_t) id;
+                if (shapes) {
+                    SRCursorShape &shape = (*shapes)[event.shape];
+                    shape.id = event.shape;
+                    shape.width = (int32_t) w;
+                    shape.height = (int32_t) h;
+                    shape.hotX = (int32_t) hx;
+                    shape.hotY = (int32_t) hy;
+                    shape.pixels.resize(w * h);
+                    memcpy(shape.pixels.data(), p, w * h * 4);
+                }
+                p += w * h * 4;
+                break;
+            default:
+                //a kind of a later version: its payload cannot be skipped, the rest of the block is lost
+                return offset + blockSize + block.size;
+        }
+        events.push_back(event);
+    }
+    size_t next = offset + blockSize + block.size;
+    return next < size ? next : 0;
+}
+
+void SRCursorTrack::shapes(const void *data, size_t size, size_t offset, std::map<uint32_t, SRCursorShape> &shapes) {
+    std::vector<SRCursorEvent> events;
+    for (size_t block = sizeof(SRCursorTrackHeader); block && block < offset;) {
+        events.clear();
+        block = decode(data, size, block, events, &shapes);
+    }
+}
@@ -0,0 +1,170 @@
+//
+// Mouse pointer written next to the recording instead of into its frames: shapes on change, positions as deltas.
+//
+
+#ifndef CPPSCREENRECORDER_SRCURSORTRACK_H
+#define CPPSCREENRECORDER_SRCURSORTRACK_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct _XDisplay;
+
+#define CURSORTRACK_MAGIC "SRCU"
+#define CURSORTRACK_VERSION 1
+#define CURSOR_SUFFIX ".cursor"
+#define CURSOR_BLOCK_BYTES 4096     //bytes of moves a block holds at most, a shape can make it longer
+#define CURSOR_BLOCK_DURATION 1000  //ms a block spans at most: a crash loses what the last one had
+#define CURSOR_SHAPE_MAX 256        //pixels of the side of a shape at most, larger ones are not written
+
+typedef enum CP{
+    SR_CURSOR_MOVE = 1,     //x and y are the new position of the hotspot
+    SR_CURSOR_SHAPE,        //shape is the id of a shape defined before
+    SR_CURSOR_SHAPE_DEFINE  //shape is the id of the shape that follows, shown from now on
+}SRCursorKind;
+
+/**
+ * Header of a cursor track, followed by the blocks up to the end of the file.
+ * Every field is in the byte order of the recording host.
+ */
+typedef struct CT{
+    char magic[4];  //CURSORTRACK_MAGIC
+    uint32_t version;
+    uint32_t blockSize;     //sizeof(SRCursorBlock), newer versions may only append fields
+    uint32_t flags;
+    int32_t x, y, width, height;    //recorded region, in the screen coordinates of the positions
+}SRCursorTrackHeader;
+
+/**
+ * Header of a block: the events of up to CURSOR_BLOCK_DURATION ms follow, size bytes of them. Each event is its
+ * kind byte, the us since the previous event (since pts for the first one) as a LEB128 varint, and its payload:
+ * the zigzag varints dx, dy of a move, the varint id of a shape; a shape definition carries its id, width,
+ * height, hotspot x and y as varints, then width * height premultiplied ARGB pixels of 4 bytes.
+ */
+typedef struct CK{
+    int64_t pts;    //us on the capture clock, as the stream timestamps
+    int32_t x, y;   //hotspot position the moves of the block start from
+    uint32_t shape; //id of the shape shown at pts, 0 before the first one
+    uint32_t count;
+    uint32_t size;
+}SRCursorBlock;
+
+/**
+ * A pointer image, the player draws it with its hotspot at the position of the moves.
+ */
+typedef struct CU{
+    uint32_t id;
+    int32_t width, height;
+    int32_t hotX, hotY;
+    std::vector<uint32_t> pixels;   //premultiplied ARGB, row by row
+}SRCursorShape;
+
+/**
+ * One decoded event.
+ */
+typedef struct CV{
+    int64_t pts;
+    int32_t kind;   //SRCursorKind
+    int32_t x, y;   //hotspot position after the event
+    uint32_t shape; //id of the shape shown after the event
+}SRCursorEvent;
+
+/**
+ * SRCursorTrack records the mouse pointer of the X display on a lightweight thread of its own and appends it to a
+ * sidecar file block by block, while the grabber leaves it out of the frames: a static screen under a moving
+ * pointer then captures no change at all, and the encoder writes skip frames where it had to code the pointer
+ * twice a frame. The player composites the shape of the track at its position.\n
+ * The position is sampled at the frame interval and written only when it moved, in 3 to 5 bytes; a shape is
+ * written in full the first time XFixes shows it, by its id after that.\n
+ * SRCursorTrack::find() walks the block headers of a mapped file to the block of a time, decode() expands it;
+ * shapes() gathers the shapes defined up to a block, for a player that seeks into the track.
+ *
+ * @Note Linux (X11) only, open() fails in other builds
+ */
+class SRCursorTrack {
+
+private:
+    std::string path;
+    FILE *file;
+    std::thread reader;
+    std::atomic<bool> stopping;
+    std::function<int64_t(int64_t)> stamp;
+    int64_t interval;
+
+    //reader thread only
+    SRCursorBlock block;
+    std::vector<uint8_t> events;
+    std::set<uint32_t> defined;
+    int64_t lastPts;
+    int64_t blockWall;
+    int32_t lastX, lastY;
+    uint32_t lastShape;
+    bool shapePending;  //the shape shown while paused is written once the capture goes on
+    uint64_t written;
+    uint64_t blocks;
+    uint64_t shapeCount;
+    int64_t bytes;
+
+    void run(struct _XDisplay *display, int fixesEvent);
+    bool begin(int64_t wall, int64_t &pts, size_t needed);
+    void move(int64_t wall, int32_t x, int32_t y);
+    void shape(int64_t wall, const SRCursorShape &shape);
+    void flush();
+
+public:
+    SRCursorTrack();
+    ~SRCursorTrack();
+
+    SRCursorTrack(const SRCursorTrack&) = delete;
+    SRCursorTrack &operator=(const SRCursorTrack&) = delete;
+
+    /**
+     * open() creates the track, writes its header and starts the thread following the pointer of device
+     * @param interval us between two samples of the position, the frame interval of the capture
+     * @param stamp maps the wall clock of a sample (av_gettime()) to its pts, AV_NOPTS_VALUE drops it (while paused)
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int open(const char *path, const char *device, int x, int y, int width, int height, int64_t interval,
+             std::function<int64_t(int64_t)> stamp);
+
+    /**
+     * close() stops the thread and writes the last block
+     */
+    void close();
+
+    const std::string &name() const { return path; }
+    uint64_t size() const { return written; }
+    uint64_t blockCount() const { return blocks; }
+    uint64_t shapesWritten() const { return shapeCount; }
+    int64_t fileBytes() const { return bytes; }
+
+    /**
+     * find() walks the blocks of a mapped or loaded track
+     * @param data the whole track file, header included
+     * @return the offset in data of the last block starting at or before pts, the first one when pts precedes
+     * them all, 0 when data is not a track or holds no complete block
+     */
+    static size_t find(const void *data, size_t size, int64_t pts);
+
+    /**
+     * decode() expands the block at offset of data into events, the shapes it defines go to shapes when given
+     * @return the offset of the next block, 0 at the end of the track or on a torn block
+     */
+    static size_t decode(const void *data, size_t size, size_t offset, std::vector<SRCursorEvent> &events,
+                         std::map<uint32_t, SRCursorShape> *shapes = nullptr);
+
+    /**
+     * shapes() gathers the shapes the blocks before offset define, the ones a seek to that block may show
+     */
+    static void shapes(const void *data, size_t size, size_t offset, std::map<uint32_t, SRCursorShape> &shapes);
+};
+
+#endif //CPPSCREENRECORDER_SRCURSORTRACK_H
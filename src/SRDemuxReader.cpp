@@ -0,0 +1,100 @@
+#include "SRDemuxReader.h"
+#include "SRFrameClock.h"
+
+extern "C"
+{
+#include "libavutil/time.h"
+}
+
+SRDemuxReader::SRDemuxReader(size_t queueSize): queue(queueSize, SR_WAIT_PARK), spare(queueSize + 1), ctx(nullptr),
+                                               streamIndex(-1), heartbeat(nullptr), policy(SR_REALTIME_OFF),
+                                               priority(REALTIME_PRIORITY), idleUs(0), error(0), stopping(false),
+                                               readPackets(0), droppedPackets(0) {}
+
+SRDemuxReader::~SRDemuxReader() {
+    stop();
+}
+
+void SRDemuxReader::start(AVFormatContext *ctx, int streamIndex, std::atomic<int64_t> *heartbeat,
+                          std::function<bool()> running, SRRealtimePolicy policy, int priority, int64_t idleUs) {
+    this->ctx = ctx;
+    this->streamIndex = streamIndex;
+    this->heartbeat = heartbeat;
+    this->running = std::move(running);
+    this->policy = policy;
+    this->priority = priority;
+    this->idleUs = idleUs;
+    error.store(0, std::memory_order_relaxed);
+    stopping.store(false, std::memory_order_relaxed);
+    reader = std::thread([this](){run();});
+}
+
+void SRDemuxReader::run() {
+    //the reader is what keeps the device drained: it gets the scheduling of the capture threads
+    realtimeThread(policy, priority);
+    int ret = 0;
+    AVPacket *pkt = nullptr;
+    while (!stopping.load(std::memory_order_relaxed) && running()) {
+        //a packet not queued is read into again
+        if (!pkt && !spare.tryPop(pkt) && !(pkt = av_packet_alloc())) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        int64_t readStart = SRFrameClock::now();
+        ret = av_read_frame(ctx, pkt);
+        int64_t arrival = SRFrameClock::now();
+        if (ret == AVERROR(EAGAIN)) {
+            if (idleUs > 0)
+                av_usleep((unsigned int) idleUs);
+            continue;
+        }
+        if (ret < 0)
+            break;
+        if (heartbeat)
+            heartbeat->store(av_gettime(), std::memory_order_relaxed);
+        if (pkt->stream_index != streamIndex) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        readPackets++;
+        if (!queue.tryPush({pkt, readStart, arrival})) {
+            droppedPackets++;
+            av_packet_unref(pkt);
+            continue;
+        }
+        pkt = nullptr;
+    }
+    av_packet_free(&pkt);
+    //a reader stopped on purpose, or by the end of the capture, reports the end of the stream
+    error.store(ret < 0 ? ret : AVERROR_EOF, std::memory_order_release);
+}
+
+int SRDemuxReader::read(AVPacket *pkt, int64_t timeoutUs, int64_t *readStart, int64_t *arrival) {
+    SRDemuxPacket item;
+    if (!queue.tryPop(item)) {
+        if (error.load(std::memory_order_acquire) < 0 && !queue.tryPop(item))
+            return error.load(std::memory_order_relaxed);
+        if (!queue.waitReadable(timeoutUs) || !queue.tryPop(item))
+            return AVERROR(EAGAIN);
+    }
+    av_packet_move_ref(pkt, item.packet);
+    if (!spare.tryPush(item.packet))
+        av_packet_free(&item.packet);
+    if (readStart)
+        *readStart = item.readStart;
+    if (arrival)
+        *arrival = item.arrival;
+    return 0;
+}
+
+void SRDemuxReader::stop() {
+    stopping.store(true, std::memory_order_relaxed);
+    if (reader.joinable())
+        reader.join();
+    SRDemuxPacket item;
+    while (queue.tryPop(item))
+        av_packet_free(&item.packet);
+    AVPacket *pkt;
+    while (spare.tryPop(pkt))
+        av_packet_free(&pkt);
+}
@@ -0,0 +1,105 @@
+//
+// Reader thread of a capture demuxer, handing its packets to the capture thread through a bounded queue.
+//
+
+#ifndef CPPSCREENRECORDER_SRDEMUXREADER_H
+#define CPPSCREENRECORDER_SRDEMUXREADER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include "SRRingBuffer.h"
+#include "SRThreads.h"
+
+extern "C"
+{
+#include "libavformat/avformat.h"
+}
+
+#define THREAD_QUEUE_SIZE 8     //packets a demuxer reader queues for its capture thread, the thread_queue_size of ffmpeg
+
+/**
+ * A packet read by SRDemuxReader, with the times of the read on the SRFrameClock
+ */
+typedef struct DP{
+    AVPacket *packet;
+    int64_t readStart;
+    int64_t arrival;
+}SRDemuxPacket;
+
+/**
+ * SRDemuxReader runs av_read_frame() on a capture demuxer in a thread of its own, so the device is drained
+ * at its own pace whatever the decoding, resampling and encoding of the capture thread cost: x11grab does not
+ * skip ahead and a pulse buffer does not overrun while the audio encoder runs long.\n
+ * The packets of one stream are handed over by an SRRingBuffer of the given size. A full queue never blocks
+ * the read: the packet just read is dropped and counted, the capture thread sees a gap where it fell behind.
+ * A read error other than EAGAIN ends the thread: the error is returned by read() once the queued packets are
+ * taken, and the capture thread restarts the reader with start() after reopening the device.\n
+ * The packets go round: read() gives the emptied one back through a second ring, the reader allocates a new one
+ * only while none came back.
+ */
+class SRDemuxReader {
+
+private:
+    SRRingBuffer<SRDemuxPacket> queue;
+    SRRingBuffer<AVPacket*> spare;  //packets read() emptied, back to the reader
+    std::thread reader;
+    AVFormatContext *ctx;
+    int streamIndex;
+    std::atomic<int64_t> *heartbeat;
+    std::function<bool()> running;
+    SRRealtimePolicy policy;
+    int priority;
+    int64_t idleUs;
+    std::atomic<int> error;     //of the read that ended the thread, 0 while it runs
+    std::atomic<bool> stopping;
+
+    std::atomic<uint64_t> readPackets;
+    std::atomic<uint64_t> droppedPackets;
+
+    void run();
+
+public:
+    explicit SRDemuxReader(size_t queueSize = THREAD_QUEUE_SIZE);
+    ~SRDemuxReader();
+
+    SRDemuxReader(const SRDemuxReader&) = delete;
+    SRDemuxReader &operator=(const SRDemuxReader&) = delete;
+
+    /**
+     * start() starts reading ctx, the previous thread must have been stopped
+     * @param streamIndex the only stream queued, the packets of the others are freed
+     * @param heartbeat set to av_gettime() after each successful read, may be null
+     * @param running called before each read: blocks while the capture is paused, false ends the thread
+     * @param idleUs sleep after an EAGAIN of a non-blocking demuxer
+     */
+    void start(AVFormatContext *ctx, int streamIndex, std::atomic<int64_t> *heartbeat, std::function<bool()> running,
+               SRRealtimePolicy policy, int priority, int64_t idleUs);
+
+    /**
+     * read() takes the oldest queued packet
+     * @param timeoutUs longest wait for a packet
+     * @param readStart, arrival SRFrameClock times the packet was read between, may be null
+     * @return 0, AVERROR(EAGAIN) if none came within timeoutUs, or the error that ended the reader
+     */
+    int read(AVPacket *pkt, int64_t timeoutUs, int64_t *readStart = nullptr, int64_t *arrival = nullptr);
+
+    /**
+     * stop() waits for the thread to end and frees the queued packets: the context can then be closed.\n
+     * A read blocked on a device returns through the interrupt callback of the context.
+     */
+    void stop();
+
+    uint64_t packetsRead() const { return readPackets; }
+    uint64_t packetsDropped() const { return droppedPackets; }
+
+    /**
+     * highWaterMark() is, as in SRRingBuffer, the highest number of packets the capture thread was behind
+     * @Note once the reader has stopped
+     */
+    size_t highWaterMark() const { return queue.highWaterMark(); }
+    size_t maxSize() const { return queue.maxSize(); }
+};
+
+#endif //CPPSCREENRECORDER_SRDEMUXREADER_H
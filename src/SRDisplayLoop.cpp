@@ -0,0 +1,97 @@
+//
+// One event loop for the display connections of many recordings: the X events of every display read by one thread.
+//
+
+#include "SRDisplayLoop.h"
+#include "SRLog.h"
+
+#ifdef __unix__
+
+#include <cerrno>
+#include <cstdint>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+SRDisplayLoop::SRDisplayLoop(): epollFd(-1), wakeFd(-1), stopping(false), failed(false) {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (epollFd < 0 || wakeFd < 0) {
+        srLog(SR_LOG_ERROR, "[SRDisplayLoop] cannot create the epoll set (%d)", errno);
+        return;
+    }
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+    thread = std::thread(&SRDisplayLoop::run, this);
+}
+
+SRDisplayLoop::~SRDisplayLoop() {
+    if (thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0)
+            srLog(SR_LOG_WARNING, "[SRDisplayLoop] cannot wake the loop (%d)", errno);
+        thread.join();
+    }
+    if (wakeFd >= 0)
+        close(wakeFd);
+    if (epollFd >= 0)
+        close(epollFd);
+}
+
+bool SRDisplayLoop::add(int fd, std::function<void()> ready) {
+    if (!thread.joinable() || fd < 0)
+        return false;
+    std::lock_guard<std::mutex> guard(lock);
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        srLog(SR_LOG_WARNING, "[SRDisplayLoop] cannot wait on the connection %d (%d)", fd, errno);
+        return false;
+    }
+    handlers[fd] = std::move(ready);
+    return true;
+}
+
+void SRDisplayLoop::remove(int fd) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (handlers.erase(fd))
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+size_t SRDisplayLoop::size() {
+    std::lock_guard<std::mutex> guard(lock);
+    return handlers.size();
+}
+
+/**
+ * run() is the thread of the loop: each readable connection gets its handler run, under the lock remove() takes
+ */
+void SRDisplayLoop::run() {
+    struct epoll_event events[DISPLAY_LOOP_EVENTS];
+    while (true) {
+        int count = epoll_wait(epollFd, events, DISPLAY_LOOP_EVENTS, -1);
+        if (count < 0 && errno != EINTR) {
+            srLog(SR_LOG_ERROR, "[SRDisplayLoop] the epoll wait failed (%d), the recordings read their displays themselves", errno);
+            failed = true;
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        if (stopping)
+            return;
+        for (int i = 0; i < count; i++) {
+            //a connection removed by an earlier handler of the same wait is not there any more
+            auto handler = handlers.find(events[i].data.fd);
+            if (handler != handlers.end())
+                handler->second();
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,72 @@
+//
+// One event loop for the display connections of many recordings: the X events of every display read by one thread.
+//
+
+#ifndef CPPSCREENRECORDER_SRDISPLAYLOOP_H
+#define CPPSCREENRECORDER_SRDISPLAYLOOP_H
+
+#ifdef __unix__
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#define DISPLAY_LOOP_EVENTS 64  //epoll events taken per wait
+
+/**
+ * SRDisplayLoop waits on the connections of many displays with a single epoll set and runs the handler of each
+ * one that has something to read: the SRX11Grabber of every session of an SRSessionHost reads its XDamage,
+ * XFixes and window events there as the server sends them, and its grab() then only looks at the events already
+ * read. A display nothing was drawn on costs its recording a look at a flag per frame, no system call, and the
+ * damage of all the displays is read by one thread instead of one per display at every frame.
+ *
+ * @Note the handlers run on the thread of the loop, one at a time: they must not block. If the epoll wait fails
+ * the loop stops and running() turns false, its users read their connections themselves from then on
+ */
+class SRDisplayLoop {
+
+private:
+    int epollFd, wakeFd;
+    std::mutex lock;    //held while a handler runs, remove() waits for it
+    std::map<int, std::function<void()>> handlers;
+    std::thread thread;
+    bool stopping;
+    std::atomic<bool> failed;
+
+    void run();
+
+public:
+    SRDisplayLoop();
+
+    /**
+     * ~SRDisplayLoop() stops the thread, the connections still added are left open
+     */
+    ~SRDisplayLoop();
+
+    SRDisplayLoop(const SRDisplayLoop&) = delete;
+    SRDisplayLoop &operator=(const SRDisplayLoop&) = delete;
+
+    /**
+     * add() runs ready on the loop whenever fd has something to read
+     * @return false if the loop could not be started or fd cannot be waited on
+     */
+    bool add(int fd, std::function<void()> ready);
+
+    /**
+     * remove() stops waiting on fd: once it returns the handler of fd does not run any more
+     */
+    void remove(int fd);
+
+    size_t size();
+
+    /**
+     * running() is false once the loop has stopped on an error: the handlers do not run any more
+     */
+    bool running() const { return thread.joinable() && !failed; }
+};
+
+#endif
+
+#endif //CPPSCREENRECORDER_SRDISPLAYLOOP_H
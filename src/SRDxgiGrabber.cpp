@@ -0,0 +1,452 @@
+#include "SRDxgiGrabber.h"
+#include "SRLog.h"
+
+#ifdef _WIN32
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <d3d10.h>
+
+extern "C"
+{
+#include "libavutil/hwcontext.h"
+#include "libavutil/hwcontext_d3d11va.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/time.h"
+}
+
+#define DXGI_OPEN_WAIT 1000     //ms open() waits for the first image of the desktop
+
+using namespace std;
+
+SRDxgiGrabber::SRDxgiGrabber(int outWidth, int outHeight, bool systemMemory): output(nullptr), device(nullptr),
+                                                                              context(nullptr), duplication(nullptr),
+                                                                              region(nullptr), videoDevice(nullptr),
+                                                                              videoContext(nullptr), enumerator(nullptr),
+                                                                              processor(nullptr), inputView(nullptr),
+                                                                              scaled(nullptr), scaledView(nullptr),
+                                                                              staging(nullptr), deviceRef(nullptr),
+                                                                              framesRef(nullptr), x(0), y(0), width(0),
+                                                                              height(0), outWidth(outWidth),
+                                                                              outHeight(outHeight),
+                                                                              systemMemory(systemMemory), fullCopy(true) {}
+
+SRDxgiGrabber::~SRDxgiGrabber() {
+    for (OutputView &cached : outputViews) {
+        cached.view->Release();
+        cached.texture->Release();
+    }
+    if (staging) staging->Release();
+    if (scaledView) scaledView->Release();
+    if (scaled) scaled->Release();
+    if (inputView) inputView->Release();
+    if (processor) processor->Release();
+    if (enumerator) enumerator->Release();
+    if (videoContext) videoContext->Release();
+    if (videoDevice) videoDevice->Release();
+    if (region) region->Release();
+    if (duplication) duplication->Release();
+    //the frames still held by the encoder keep the device alive through deviceRef
+    av_buffer_unref(&framesRef);
+    av_buffer_unref(&deviceRef);
+    if (context) context->Release();
+    if (device) device->Release();
+    if (output) output->Release();
+}
+
+/**
+ * initReadBack() creates the BGRA texture of the output size the video processor scales into with systemMemory,
+ * and the staging texture it is copied to for the CPU
+ */
+int SRDxgiGrabber::initReadBack() {
+    UINT support = 0;
+    if (FAILED(enumerator->CheckVideoProcessorFormat(DXGI_FORMAT_B8G8R8A8_UNORM, &support)) ||
+        !(support & D3D11_VIDEO_PROCESSOR_FORMAT_SUPPORT_OUTPUT)) {
+        cout << "\n[SRDxgiGrabber] the video processor cannot scale to BGRA";
+        return AVERROR(ENOSYS);
+    }
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width = (UINT) outWidth;
+    desc.Height = (UINT) outHeight;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+    if (FAILED(device->CreateTexture2D(&desc, nullptr, &scaled))) {
+        cout << "\n[SRDxgiGrabber] cannot allocate the scaled region";
+        return AVERROR(ENOMEM);
+    }
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.BindFlags = 0;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    if (FAILED(device->CreateTexture2D(&desc, nullptr, &staging))) {
+        cout << "\n[SRDxgiGrabber] cannot allocate the staging copy of the scaled region";
+        return AVERROR(ENOMEM);
+    }
+    D3D11_VIDEO_PROCESSOR_OUTPUT_VIEW_DESC viewDesc = {};
+    viewDesc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2D;
+    if (FAILED(videoDevice->CreateVideoProcessorOutputView(scaled, enumerator, &viewDesc, &scaledView))) {
+        cout << "\n[SRDxgiGrabber] cannot use the scaled region as video processor output";
+        return AVERROR(ENOSYS);
+    }
+    return 0;
+}
+
+/**
+ * duplicate() (re)creates the duplication of the output, after open() and whenever DXGI reports the access lost
+ */
+int SRDxgiGrabber::duplicate() {
+    HRESULT hr = output->DuplicateOutput(device, &duplication);
+    if (FAILED(hr)) {
+        duplication = nullptr;
+        return hr == E_ACCESSDENIED ? AVERROR(EAGAIN) : AVERROR(EIO);
+    }
+    fullCopy = true;
+    return 0;
+}
+
+int SRDxgiGrabber::initProcessor() {
+    if (FAILED(device->QueryInterface(__uuidof(ID3D11VideoDevice), (void **) &videoDevice)) ||
+        FAILED(context->QueryInterface(__uuidof(ID3D11VideoContext), (void **) &videoContext))) {
+        cout << "\n[SRDxgiGrabber] the device has no video processor";
+        return AVERROR(ENOSYS);
+    }
+
+    D3D11_VIDEO_PROCESSOR_CONTENT_DESC content = {};
+    content.InputFrameFormat = D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE;
+    content.InputFrameRate = {1, 1};
+    content.InputWidth = (UINT) width;
+    content.InputHeight = (UINT) height;
+    content.OutputFrameRate = {1, 1};
+    content.OutputWidth = (UINT) outWidth;
+    content.OutputHeight = (UINT) outHeight;
+    content.Usage = D3D11_VIDEO_USAGE_OPTIMAL_SPEED;
+    if (FAILED(videoDevice->CreateVideoProcessorEnumerator(&content, &enumerator)) ||
+        FAILED(videoDevice->CreateVideoProcessor(enumerator, 0, &processor))) {
+        cout << "\n[SRDxgiGrabber] cannot create the video processor";
+        return AVERROR(ENOSYS);
+    }
+
+    D3D11_VIDEO_PROCESSOR_INPUT_VIEW_DESC input = {};
+    input.ViewDimension = D3D11_VPIV_DIMENSION_TEXTURE2D;
+    if (FAILED(videoDevice->CreateVideoProcessorInputView(region, enumerator, &input, &inputView))) {
+        cout << "\n[SRDxgiGrabber] cannot use the desktop copy as video processor input";
+        return AVERROR(ENOSYS);
+    }
+
+    //full range RGB in, BT.709 limited range YUV out, as the software scaler does; the read back stays full range RGB
+    D3D11_VIDEO_PROCESSOR_COLOR_SPACE rgb = {};
+    rgb.RGB_Range = 0;
+    D3D11_VIDEO_PROCESSOR_COLOR_SPACE yuv = {};
+    yuv.YCbCr_Matrix = 1;
+    yuv.Nominal_Range = D3D11_VIDEO_PROCESSOR_NOMINAL_RANGE_16_235;
+    videoContext->VideoProcessorSetStreamColorSpace(processor, 0, &rgb);
+    videoContext->VideoProcessorSetOutputColorSpace(processor, systemMemory ? &rgb : &yuv);
+    videoContext->VideoProcessorSetStreamFrameFormat(processor, 0, D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE);
+    videoContext->VideoProcessorSetStreamAutoProcessingMode(processor, 0, FALSE);
+    return 0;
+}
+
+int SRDxgiGrabber::open(const char *name, int x, int y, int width, int height) {
+    //a number picks the monitor, anything else the one containing the capture offset
+    char *end = nullptr;
+    long index = name && *name ? strtol(name, &end, 10) : -1;
+    if (!end || *end)
+        index = -1;
+
+    IDXGIFactory1 *factory = nullptr;
+    if (FAILED(CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void **) &factory))) {
+        cout << "\n[SRDxgiGrabber] cannot create the DXGI factory";
+        return AVERROR(EIO);
+    }
+    IDXGIAdapter1 *adapter = nullptr;
+    IDXGIOutput *candidate = nullptr;
+    DXGI_OUTPUT_DESC desc;
+    long seen = 0;
+    for (UINT a = 0; !candidate && factory->EnumAdapters1(a, &adapter) != DXGI_ERROR_NOT_FOUND; a++) {
+        for (UINT o = 0; adapter->EnumOutputs(o, &candidate) != DXGI_ERROR_NOT_FOUND; o++) {
+            candidate->GetDesc(&desc);
+            const RECT &bounds = desc.DesktopCoordinates;
+            if (index >= 0 ? seen++ == index
+                           : x >= bounds.left && x < bounds.right && y >= bounds.top && y < bounds.bottom)
+                break;
+            candidate->Release();
+            candidate = nullptr;
+        }
+        if (!candidate) {
+            adapter->Release();
+            adapter = nullptr;
+        }
+    }
+    factory->Release();
+    if (!candidate) {
+        cout << "\n[SRDxgiGrabber] no monitor " << (name ? name : "") << " at " << x << "," << y;
+        return AVERROR(ENODEV);
+    }
+
+    HRESULT hr = candidate->QueryInterface(__uuidof(IDXGIOutput1), (void **) &output);
+    candidate->Release();
+    if (SUCCEEDED(hr))
+        hr = D3D11CreateDevice(adapter, D3D_DRIVER_TYPE_UNKNOWN, nullptr,
+                               D3D11_CREATE_DEVICE_VIDEO_SUPPORT | D3D11_CREATE_DEVICE_BGRA_SUPPORT,
+                               nullptr, 0, D3D11_SDK_VERSION, &device, nullptr, &context);
+    adapter->Release();
+    if (FAILED(hr)) {
+        cout << "\n[SRDxgiGrabber] cannot create a D3D11 device on the adapter of the monitor";
+        return AVERROR(EIO);
+    }
+    //the encoder uses the device from its own thread
+    ID3D10Multithread *multithread = nullptr;
+    if (SUCCEEDED(context->QueryInterface(__uuidof(ID3D10Multithread), (void **) &multithread))) {
+        multithread->SetMultithreadProtected(TRUE);
+        multithread->Release();
+    }
+
+    //without an index the region is in desktop coordinates, the duplication in the ones of the monitor
+    this->x = index >= 0 ? x : x - desc.DesktopCoordinates.left;
+    this->y = index >= 0 ? y : y - desc.DesktopCoordinates.top;
+    this->width = width;
+    this->height = height;
+    if (this->x < 0 || this->y < 0 || this->x + width > desc.DesktopCoordinates.right - desc.DesktopCoordinates.left ||
+        this->y + height > desc.DesktopCoordinates.bottom - desc.DesktopCoordinates.top) {
+        cout << "\n[SRDxgiGrabber] the capture region does not fit in the monitor";
+        return AVERROR(EINVAL);
+    }
+    if (duplicate() < 0) {
+        cout << "\n[SRDxgiGrabber] cannot duplicate the monitor";
+        return AVERROR(EIO);
+    }
+
+    D3D11_TEXTURE2D_DESC copy = {};
+    copy.Width = (UINT) width;
+    copy.Height = (UINT) height;
+    copy.MipLevels = 1;
+    copy.ArraySize = 1;
+    copy.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    copy.SampleDesc.Count = 1;
+    copy.Usage = D3D11_USAGE_DEFAULT;
+    copy.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+    if (FAILED(device->CreateTexture2D(&copy, nullptr, &region))) {
+        cout << "\n[SRDxgiGrabber] cannot allocate the copy of the region";
+        return AVERROR(ENOMEM);
+    }
+    int ret = initProcessor();
+    if (ret < 0 || (systemMemory && (ret = initReadBack()) < 0))
+        return ret;
+
+    //the encoder frames: NV12 textures the video processor renders into; the read back only uses the device lock
+    deviceRef = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_D3D11VA);
+    if (!deviceRef)
+        return AVERROR(ENOMEM);
+    AVD3D11VADeviceContext *hwDevice = (AVD3D11VADeviceContext *) ((AVHWDeviceContext *) deviceRef->data)->hwctx;
+    hwDevice->device = device;
+    device->AddRef();
+    if ((ret = av_hwdevice_ctx_init(deviceRef)) < 0)
+        return ret;
+    if (!systemMemory) {
+        framesRef = av_hwframe_ctx_alloc(deviceRef);
+        if (!framesRef)
+            return AVERROR(ENOMEM);
+        AVHWFramesContext *frames = (AVHWFramesContext *) framesRef->data;
+        frames->format = AV_PIX_FMT_D3D11;
+        frames->sw_format = AV_PIX_FMT_NV12;
+        frames->width = outWidth;
+        frames->height = outHeight;
+        ((AVD3D11VAFramesContext *) frames->hwctx)->BindFlags = D3D11_BIND_RENDER_TARGET;
+        if ((ret = av_hwframe_ctx_init(framesRef)) < 0) {
+            cout << "\n[SRDxgiGrabber] cannot allocate the NV12 surfaces";
+            return ret;
+        }
+    }
+
+    //the first image after the duplication is the whole desktop
+    DXGI_OUTDUPL_FRAME_INFO info;
+    IDXGIResource *resource = nullptr;
+    if (SUCCEEDED(duplication->AcquireNextFrame(DXGI_OPEN_WAIT, &info, &resource))) {
+        ID3D11Texture2D *desktop = nullptr;
+        if (SUCCEEDED(resource->QueryInterface(__uuidof(ID3D11Texture2D), (void **) &desktop))) {
+            RECT all = {this->x, this->y, this->x + width, this->y + height};
+            copyRect(desktop, all);
+            fullCopy = false;
+            desktop->Release();
+        }
+        resource->Release();
+        duplication->ReleaseFrame();
+    }
+
+    cout << "\n[SRDxgiGrabber] " << width << "x" << height << " to " << outWidth << "x" << outHeight
+         << (systemMemory ? " BGR0, read back" : " NV12");
+    return 0;
+}
+
+/**
+ * copyRect() copies the part of a desktop rectangle inside the region into the copy of the region
+ * @return false if the rectangle is outside the region
+ */
+bool SRDxgiGrabber::copyRect(ID3D11Texture2D *desktop, const RECT &rect) {
+    LONG left = max(rect.left, (LONG) x), top = max(rect.top, (LONG) y);
+    LONG right = min(rect.right, (LONG) (x + width)), bottom = min(rect.bottom, (LONG) (y + height));
+    if (left >= right || top >= bottom)
+        return false;
+    D3D11_BOX box = {(UINT) left, (UINT) top, 0, (UINT) right, (UINT) bottom, 1};
+    context->CopySubresourceRegion(region, 0, (UINT) (left - x), (UINT) (top - y), 0, desktop, 0, &box);
+    return true;
+}
+
+/**
+ * outputView() is the video processor view of the texture of a frame.
+ * The pool of the frames context keeps its textures until it is freed: views are created once per texture.
+ */
+ID3D11VideoProcessorOutputView *SRDxgiGrabber::outputView(AVFrame *frame) {
+    ID3D11Texture2D *texture = (ID3D11Texture2D *) frame->data[0];
+    intptr_t index = (intptr_t) frame->data[1];
+    for (const OutputView &cached : outputViews)
+        if (cached.texture == texture && cached.index == index)
+            return cached.view;
+
+    D3D11_TEXTURE2D_DESC desc;
+    texture->GetDesc(&desc);
+    D3D11_VIDEO_PROCESSOR_OUTPUT_VIEW_DESC viewDesc = {};
+    if (desc.ArraySize > 1) {
+        viewDesc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2DARRAY;
+        viewDesc.Texture2DArray.FirstArraySlice = (UINT) index;
+        viewDesc.Texture2DArray.ArraySize = 1;
+    } else {
+        viewDesc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2D;
+    }
+    ID3D11VideoProcessorOutputView *view = nullptr;
+    if (FAILED(videoDevice->CreateVideoProcessorOutputView(texture, enumerator, &viewDesc, &view)))
+        return nullptr;
+    texture->AddRef();
+    outputViews.push_back({texture, index, view});
+    return view;
+}
+
+/**
+ * readBack() scales the copy of the region into the texture of the output size and copies it into frame,
+ * waiting for the GPU: only the scaled pixels cross the bus
+ */
+int SRDxgiGrabber::readBack(AVFrame *frame) {
+    D3D11_VIDEO_PROCESSOR_STREAM stream = {};
+    stream.Enable = TRUE;
+    stream.pInputSurface = inputView;
+    HRESULT hr = videoContext->VideoProcessorBlt(processor, scaledView, 0, 1, &stream);
+    if (FAILED(hr)) {
+        srLog(SR_LOG_ERROR, "[SRDxgiGrabber] scaling failed (0x%lx)", (unsigned long) hr);
+        return AVERROR(EIO);
+    }
+    context->CopyResource(staging, scaled);
+
+    //frames coming from a pool already have their buffer
+    if (!frame->buf[0]) {
+        frame->format = AV_PIX_FMT_BGR0;
+        frame->width = outWidth;
+        frame->height = outHeight;
+        int ret = av_frame_get_buffer(frame, 32);
+        if (ret < 0) return ret;
+    }
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    if (FAILED(hr = context->Map(staging, 0, D3D11_MAP_READ, 0, &mapped))) {
+        srLog(SR_LOG_ERROR, "[SRDxgiGrabber] read back failed (0x%lx)", (unsigned long) hr);
+        return AVERROR(EIO);
+    }
+    av_image_copy_plane(frame->data[0], frame->linesize[0], (const uint8_t *) mapped.pData, (int) mapped.RowPitch,
+                        outWidth * 4, outHeight);
+    context->Unmap(staging, 0);
+    frame->pts = av_gettime();
+    return 0;
+}
+
+int SRDxgiGrabber::grab(AVFrame *frame) {
+    AVD3D11VADeviceContext *hwDevice = (AVD3D11VADeviceContext *) ((AVHWDeviceContext *) deviceRef->data)->hwctx;
+    bool changed = false;
+    int ret = 0;
+
+    //the pipeline paces the grabs: nothing new since the previous one is not waited for
+    hwDevice->lock(hwDevice->lock_ctx);
+    if (!duplication && duplicate() < 0) {
+        //the secure desktop or a mode switch: retried at the next grab
+        hwDevice->unlock(hwDevice->lock_ctx);
+        return SR_GRAB_UNCHANGED;
+    }
+    DXGI_OUTDUPL_FRAME_INFO info;
+    IDXGIResource *resource = nullptr;
+    HRESULT hr = duplication->AcquireNextFrame(0, &info, &resource);
+    if (hr == DXGI_ERROR_ACCESS_LOST) {
+        duplication->Release();
+        duplication = nullptr;
+        hwDevice->unlock(hwDevice->lock_ctx);
+        return SR_GRAB_UNCHANGED;
+    }
+    if (FAILED(hr) && hr != DXGI_ERROR_WAIT_TIMEOUT) {
+        hwDevice->unlock(hwDevice->lock_ctx);
+        srLog(SR_LOG_ERROR, "[SRDxgiGrabber] duplication failed (0x%lx)", (unsigned long) hr);
+        return AVERROR(EIO);
+    }
+
+    //a frame without LastPresentTime only moved the pointer
+    ID3D11Texture2D *desktop = nullptr;
+    if (SUCCEEDED(hr) && info.LastPresentTime.QuadPart &&
+        SUCCEEDED(resource->QueryInterface(__uuidof(ID3D11Texture2D), (void **) &desktop))) {
+        UINT moveBytes = 0, dirtyBytes = 0;
+        if (!fullCopy && info.TotalMetadataBufferSize) {
+            if (metadata.size() < info.TotalMetadataBufferSize)
+                metadata.resize(info.TotalMetadataBufferSize);
+            //moved rectangles already hold their pixels in the new image: they are copied as dirty ones
+            if (FAILED(duplication->GetFrameMoveRects((UINT) metadata.size(), (DXGI_OUTDUPL_MOVE_RECT *) metadata.data(),
+                                                      &moveBytes)))
+                fullCopy = true;
+            if (!fullCopy && FAILED(duplication->GetFrameDirtyRects((UINT) metadata.size() - moveBytes,
+                                                                    (RECT *) (metadata.data() + moveBytes), &dirtyBytes)))
+                fullCopy = true;
+        }
+        size_t moves = moveBytes / sizeof(DXGI_OUTDUPL_MOVE_RECT), dirty = dirtyBytes / sizeof(RECT);
+        if (fullCopy || moves + dirty > DXGI_MAX_DIRTY_RECTS) {
+            RECT all = {x, y, x + width, y + height};
+            changed = copyRect(desktop, all);
+            fullCopy = false;
+        } else {
+            const DXGI_OUTDUPL_MOVE_RECT *moved = (const DXGI_OUTDUPL_MOVE_RECT *) metadata.data();
+            const RECT *rects = (const RECT *) (metadata.data() + moveBytes);
+            for (size_t i = 0; i < moves; i++)
+                changed |= copyRect(desktop, moved[i].DestinationRect);
+            for (size_t i = 0; i < dirty; i++)
+                changed |= copyRect(desktop, rects[i]);
+        }
+        desktop->Release();
+    }
+    if (resource) {
+        resource->Release();
+        duplication->ReleaseFrame();
+    }
+    if (!changed) {
+        hwDevice->unlock(hwDevice->lock_ctx);
+        return SR_GRAB_UNCHANGED;
+    }
+    if (systemMemory) {
+        ret = readBack(frame);
+        hwDevice->unlock(hwDevice->lock_ctx);
+        return ret;
+    }
+
+    if (!frame->buf[0] && (ret = av_hwframe_get_buffer(framesRef, frame, 0)) < 0) {
+        hwDevice->unlock(hwDevice->lock_ctx);
+        return ret;
+    }
+    ID3D11VideoProcessorOutputView *view = outputView(frame);
+    D3D11_VIDEO_PROCESSOR_STREAM stream = {};
+    stream.Enable = TRUE;
+    stream.pInputSurface = inputView;
+    hr = view ? videoContext->VideoProcessorBlt(processor, view, 0, 1, &stream) : E_FAIL;
+    hwDevice->unlock(hwDevice->lock_ctx);
+    if (FAILED(hr)) {
+        srLog(SR_LOG_ERROR, "[SRDxgiGrabber] conversion to NV12 failed (0x%lx)", (unsigned long) hr);
+        return AVERROR(EIO);
+    }
+    return 0;
+}
+
+#endif
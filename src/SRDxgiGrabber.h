@@ -0,0 +1,100 @@
+//
+// DXGI Desktop Duplication grabber, frames stay D3D11 textures or are read back scaled.
+//
+
+#ifndef CPPSCREENRECORDER_SRDXGIGRABBER_H
+#define CPPSCREENRECORDER_SRDXGIGRABBER_H
+
+#ifdef _WIN32
+
+#include <vector>
+#include <d3d11.h>
+#include <dxgi1_2.h>
+#include "SRVideoGrabber.h"
+
+/* above this many dirty or moved rectangles a single copy of the region is cheaper */
+#define DXGI_MAX_DIRTY_RECTS 64
+
+/**
+ * SRDxgiGrabber duplicates a monitor with the Desktop Duplication API: the desktop image is a D3D11 texture
+ * and only the rectangles DXGI reports as dirty or moved are copied into a persistent copy of the region.\n
+ * When none of them intersects the region grab() returns SR_GRAB_UNCHANGED.\n
+ * The video processor of the device converts the copy to NV12 at the output size straight into surfaces
+ * of hwFramesContext() (AV_PIX_FMT_D3D11), which go to the encoder as they are: nothing is read back
+ * to system memory.\n
+ * With systemMemory the video processor scales the copy to a BGRA texture of the output size instead, which is read
+ * back into BGR0 frames: a 5K monitor recorded at 1440p reads a quarter of its pixels over the bus, and the
+ * convert stage only changes the pixel format.\n
+ * The device is the index of the monitor, the capture offset then being inside it, or any other name
+ * for the monitor containing the capture offset (desktop coordinates, as gdigrab).
+ *
+ * @Note the mouse pointer is not composited into the frames
+ */
+class SRDxgiGrabber : public SRVideoGrabber {
+
+private:
+    struct OutputView {
+        ID3D11Texture2D *texture;
+        intptr_t index;
+        ID3D11VideoProcessorOutputView *view;
+    };
+
+    IDXGIOutput1 *output;
+    ID3D11Device *device;
+    ID3D11DeviceContext *context;
+    IDXGIOutputDuplication *duplication;
+    ID3D11Texture2D *region;
+    ID3D11VideoDevice *videoDevice;
+    ID3D11VideoContext *videoContext;
+    ID3D11VideoProcessorEnumerator *enumerator;
+    ID3D11VideoProcessor *processor;
+    ID3D11VideoProcessorInputView *inputView;
+    ID3D11Texture2D *scaled;            //systemMemory: the output of the video processor
+    ID3D11VideoProcessorOutputView *scaledView;
+    ID3D11Texture2D *staging;           //and its CPU readable copy
+    AVBufferRef *deviceRef;
+    AVBufferRef *framesRef;
+
+    int x, y, width, height;
+    int outWidth, outHeight;
+    bool systemMemory;
+    bool fullCopy;
+    std::vector<BYTE> metadata;
+    std::vector<OutputView> outputViews;
+
+    int duplicate();
+    int initProcessor();
+    int initReadBack();
+    int readBack(AVFrame *frame);
+    bool copyRect(ID3D11Texture2D *desktop, const RECT &rect);
+    ID3D11VideoProcessorOutputView *outputView(AVFrame *frame);
+
+public:
+    /**
+     * @param outWidth size of the converted frames, the encoder geometry
+     * @param systemMemory scaled BGR0 frames read back to system memory instead of NV12 surfaces
+     */
+    SRDxgiGrabber(int outWidth, int outHeight, bool systemMemory = false);
+    ~SRDxgiGrabber() override;
+
+    SRDxgiGrabber(const SRDxgiGrabber&) = delete;
+    SRDxgiGrabber &operator=(const SRDxgiGrabber&) = delete;
+
+    int open(const char *device, int x, int y, int width, int height) override;
+    int grab(AVFrame *frame) override;
+
+    enum AVPixelFormat pixelFormat() const override { return systemMemory ? AV_PIX_FMT_BGR0 : AV_PIX_FMT_D3D11; }
+    const char *name() const override { return systemMemory ? "dxgi-readback" : "dxgi"; }
+    AVBufferRef *hwFramesContext() const override { return framesRef; }
+    bool scaledSize(int &width, int &height) const override {
+        if (!systemMemory)
+            return false;
+        width = outWidth;
+        height = outHeight;
+        return true;
+    }
+};
+
+#endif
+
+#endif //CPPSCREENRECORDER_SRDXGIGRABBER_H
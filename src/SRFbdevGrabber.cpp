@@ -0,0 +1,207 @@
+//
+// Linux framebuffer grabber: the fbdev device mapped and read directly, for the targets without a display server.
+//
+
+#include "SRFbdevGrabber.h"
+
+#ifdef __unix__
+
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SR_HAVE_SSE41 1
+#endif
+
+extern "C"
+{
+#include "libavutil/common.h"
+#include "libavutil/cpu.h"
+#include "libavutil/error.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/time.h"
+}
+
+#ifdef SR_HAVE_SSE41
+/* the 16 byte aligned middle of a run with MOVNTDQA: a line of write-combined memory per load, not a word */
+__attribute__((target("sse4.1")))
+static void streamCopySse41(uint8_t *dst, const uint8_t *src, size_t bytes) {
+    size_t head = (16 - ((uintptr_t) src & 15)) & 15;
+    if (head > bytes)
+        head = bytes;
+    memcpy(dst, src, head);
+    size_t i = head;
+    for (; i + 64 <= bytes; i += 64) {
+        __m128i a = _mm_stream_load_si128((__m128i *) (src + i));
+        __m128i b = _mm_stream_load_si128((__m128i *) (src + i + 16));
+        __m128i c = _mm_stream_load_si128((__m128i *) (src + i + 32));
+        __m128i d = _mm_stream_load_si128((__m128i *) (src + i + 48));
+        _mm_storeu_si128((__m128i *) (dst + i), a);
+        _mm_storeu_si128((__m128i *) (dst + i + 16), b);
+        _mm_storeu_si128((__m128i *) (dst + i + 32), c);
+        _mm_storeu_si128((__m128i *) (dst + i + 48), d);
+    }
+    for (; i + 16 <= bytes; i += 16)
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_stream_load_si128((__m128i *) (src + i)));
+    memcpy(dst + i, src + i, bytes - i);
+}
+#endif
+
+static void streamCopy(uint8_t *dst, const uint8_t *src, size_t bytes) {
+#ifdef SR_HAVE_SSE41
+    static const bool sse41 = (av_get_cpu_flags() & AV_CPU_FLAG_SSE4) != 0;
+    if (sse41) {
+        streamCopySse41(dst, src, bytes);
+        return;
+    }
+#endif
+    memcpy(dst, src, bytes);
+}
+
+static enum AVPixelFormat framebufferFormat(const struct fb_var_screeninfo &var) {
+    switch (var.bits_per_pixel) {
+        case 32:
+            if (var.red.offset == 16 && var.blue.offset == 0)
+                return AV_PIX_FMT_BGR0;
+            if (var.red.offset == 0 && var.blue.offset == 16)
+                return AV_PIX_FMT_RGB0;
+            break;
+        case 24:
+            if (var.red.offset == 16 && var.blue.offset == 0)
+                return AV_PIX_FMT_BGR24;
+            if (var.red.offset == 0 && var.blue.offset == 16)
+                return AV_PIX_FMT_RGB24;
+            break;
+        case 16:
+            if (var.red.offset == 11 && var.green.length == 6)
+                return AV_PIX_FMT_RGB565LE;
+            if (var.blue.offset == 11 && var.green.length == 6)
+                return AV_PIX_FMT_BGR565LE;
+            break;
+        default:
+            break;
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+SRFbdevGrabber::SRFbdevGrabber(bool changes): fd(-1), map(nullptr), mapSize(0), lineLength(0), bytesPerPixel(0),
+                                              x(0), y(0), width(0), height(0), format(AV_PIX_FMT_NONE),
+                                              detectChanges(changes), primed(false) {}
+
+SRFbdevGrabber::~SRFbdevGrabber() {
+    if (map)
+        munmap(map, mapSize);
+    if (fd >= 0)
+        close(fd);
+}
+
+bool SRFbdevGrabber::screenSize(const char *device, int &width, int &height) {
+    int dev = ::open(device, O_RDONLY | O_CLOEXEC);
+    if (dev < 0)
+        return false;
+    struct fb_var_screeninfo var;
+    bool ok = ioctl(dev, FBIOGET_VSCREENINFO, &var) == 0;
+    close(dev);
+    if (ok) {
+        width = (int) var.xres;
+        height = (int) var.yres;
+    }
+    return ok;
+}
+
+int SRFbdevGrabber::open(const char *device, int x, int y, int width, int height) {
+    fd = ::open(device, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return AVERROR(errno);
+    struct fb_var_screeninfo var;
+    struct fb_fix_screeninfo fix;
+    if (ioctl(fd, FBIOGET_VSCREENINFO, &var) < 0 || ioctl(fd, FBIOGET_FSCREENINFO, &fix) < 0)
+        return AVERROR(errno);
+    format = framebufferFormat(var);
+    if (format == AV_PIX_FMT_NONE)
+        return AVERROR(ENOSYS);
+    if (width <= 0 || height <= 0) {
+        width = (int) var.xres - x;
+        height = (int) var.yres - y;
+    }
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 || x + width > (int) var.xres || y + height > (int) var.yres)
+        return AVERROR(EINVAL);
+    this->x = x;
+    this->y = y;
+    this->width = width;
+    this->height = height;
+    lineLength = (int) fix.line_length;
+    bytesPerPixel = (int) var.bits_per_pixel / 8;
+
+    mapSize = fix.smem_len;
+    void *mapped = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED)
+        return AVERROR(errno);
+    map = (uint8_t *) mapped;
+    if (detectChanges) {
+        shadow.resize((size_t) width * bytesPerPixel * height);
+        bounce.resize(FBDEV_PAGE);
+    }
+    return 0;
+}
+
+/**
+ * origin() is the top left pixel of the region in the visible part of the framebuffer, which the console may pan
+ */
+const uint8_t *SRFbdevGrabber::origin() {
+    struct fb_var_screeninfo var;
+    size_t offset = (size_t) y * lineLength + (size_t) x * bytesPerPixel;
+    if (ioctl(fd, FBIOGET_VSCREENINFO, &var) == 0) {
+        size_t panned = offset + (size_t) var.yoffset * lineLength + (size_t) var.xoffset * bytesPerPixel;
+        if (panned + (size_t) (height - 1) * lineLength + (size_t) width * bytesPerPixel <= mapSize)
+            offset = panned;
+    }
+    return map + offset;
+}
+
+int SRFbdevGrabber::grab(AVFrame *frame) {
+    const uint8_t *src = origin();
+    const size_t rowBytes = (size_t) width * bytesPerPixel;
+
+    if (detectChanges) {
+        bool changed = !primed;
+        for (int row = 0; row < height; row++) {
+            const uint8_t *line = src + (size_t) row * lineLength;
+            uint8_t *copy = shadow.data() + row * rowBytes;
+            for (size_t run = 0; run < rowBytes; run += FBDEV_PAGE) {
+                size_t bytes = FFMIN((size_t) FBDEV_PAGE, rowBytes - run);
+                streamCopy(bounce.data(), line + run, bytes);
+                if (memcmp(bounce.data(), copy + run, bytes)) {
+                    memcpy(copy + run, bounce.data(), bytes);
+                    changed = true;
+                }
+            }
+        }
+        primed = true;
+        if (!changed)
+            return SR_GRAB_UNCHANGED;
+    }
+
+    //frames coming from a pool already have their buffer
+    if (!frame->buf[0]) {
+        frame->format = format;
+        frame->width = width;
+        frame->height = height;
+        int ret = av_frame_get_buffer(frame, 32);
+        if (ret < 0) return ret;
+    }
+    if (detectChanges)
+        av_image_copy_plane(frame->data[0], frame->linesize[0], shadow.data(), (int) rowBytes, (int) rowBytes, height);
+    else
+        for (int row = 0; row < height; row++)
+            streamCopy(frame->data[0] + (size_t) row * frame->linesize[0], src + (size_t) row * lineLength, rowBytes);
+    frame->pts = av_gettime();
+    return 0;
+}
+
+#endif
@@ -0,0 +1,72 @@
+//
+// Linux framebuffer grabber: the fbdev device mapped and read directly, for the targets without a display server.
+//
+
+#ifndef CPPSCREENRECORDER_SRFBDEVGRABBER_H
+#define CPPSCREENRECORDER_SRFBDEVGRABBER_H
+
+#ifdef __unix__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "SRVideoGrabber.h"
+
+#define FBDEV_PAGE 4096     //bytes of the runs compared by the change detection
+
+/**
+ * SRFbdevGrabber records a Linux framebuffer (/dev/fbN, the fbdev emulation of the DRM drivers included) without
+ * the fbdev demuxer: the device memory is mapped once and each grab() reads the region straight out of it, following
+ * the panning of the console, with the streaming loads of SSE4.1 where the CPU has them: the framebuffer is mostly
+ * write-combined memory, which ordinary loads read one uncached word at a time.\n
+ * With the change detection on, each FBDEV_PAGE run of a row is compared to the one of the previous grab in a
+ * cached copy of the region, and a grab finding no run changed returns SR_GRAB_UNCHANGED: a still panel costs
+ * the read alone, neither a conversion nor an encode.
+ *
+ * @Note the pixel format is the one of the framebuffer: BGR0, RGB0, BGR24, RGB24, RGB565 or BGR565
+ */
+class SRFbdevGrabber : public SRVideoGrabber {
+
+private:
+    int fd;
+    uint8_t *map;
+    size_t mapSize;
+    int lineLength, bytesPerPixel;
+    int x, y, width, height;
+    enum AVPixelFormat format;
+    bool detectChanges, primed;
+    std::vector<uint8_t> shadow;    //the region at the previous grab, rows packed
+    std::vector<uint8_t> bounce;    //a run read from the device, compared with the shadow
+
+    const uint8_t *origin();
+
+public:
+    /**
+     * @param changes compare the grabs page by page, an unchanged region gives SR_GRAB_UNCHANGED
+     */
+    explicit SRFbdevGrabber(bool changes);
+    ~SRFbdevGrabber() override;
+
+    SRFbdevGrabber(const SRFbdevGrabber&) = delete;
+    SRFbdevGrabber &operator=(const SRFbdevGrabber&) = delete;
+
+    /**
+     * open() maps the framebuffer device, a width or height of 0 takes the visible screen past x, y
+     */
+    int open(const char *device, int x, int y, int width, int height) override;
+    int grab(AVFrame *frame) override;
+
+    enum AVPixelFormat pixelFormat() const override { return format; }
+    const char *name() const override { return "fbdev"; }
+    int64_t reservedBytes() const override { return (int64_t) shadow.capacity(); }
+
+    /**
+     * screenSize() reads the visible resolution of a framebuffer device
+     * @return false when the device cannot be opened or is no framebuffer
+     */
+    static bool screenSize(const char *device, int &width, int &height);
+};
+
+#endif
+
+#endif //CPPSCREENRECORDER_SRFBDEVGRABBER_H
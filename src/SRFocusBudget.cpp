@@ -0,0 +1,218 @@
+#include "SRFocusBudget.h"
+#include "ScreenRecorder.h"
+#include "SRLog.h"
+#include "SRXErrorTrap.h"
+
+#include <cstdlib>
+#include <string>
+
+extern "C"
+{
+#include "libavutil/common.h"
+#include "libavutil/error.h"
+#include "libavutil/time.h"
+}
+
+#ifdef __unix__
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <poll.h>
+#endif
+
+SRFocusBudget::SRFocusBudget(int totalKbps, int totalFps): totalKbps(FFMAX(totalKbps, 1)), totalFps(FFMAX(totalFps, 1)),
+                                                           focused(-1), stopping(false), counters() {}
+
+SRFocusBudget::~SRFocusBudget() {
+    stop();
+}
+
+void SRFocusBudget::addSource(ScreenRecorder &recorder) {
+    //an X11 id or a CGWindowID; a window title (gdigrab) is only focused by focus() of its id, never given here
+    const char *window = recorder.settings.window;
+    char *end = nullptr;
+    uint64_t id = window && *window ? strtoull(window, &end, 0) : 0;
+    if (end && *end)
+        id = 0;
+    std::lock_guard<std::mutex> guard(lock);
+    sources.push_back({&recorder, id, FFMAX(recorder.settings._fps, 1)});
+    rebalance();
+}
+
+void SRFocusBudget::removeSource(ScreenRecorder &recorder) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (sources[i].recorder != &recorder)
+            continue;
+        sources.erase(sources.begin() + (long) i);
+        if (focused == (int) i)
+            focused = -1;
+        else if (focused > (int) i)
+            focused--;
+        rebalance();
+        return;
+    }
+}
+
+/**
+ * rebalance() sets the budgets of every source for the focus, as the class describes
+ * @Note under lock
+ */
+void SRFocusBudget::rebalance() {
+    int n = (int) sources.size();
+    if (!n)
+        return;
+    int focusKbps = 0, focusFps = 0;
+    int restKbps = totalKbps, restFps = totalFps, others = n;
+    if (focused >= 0) {
+        //a lone source takes everything, its frame rate still capped by the one it was opened with
+        focusKbps = n > 1 ? FFMAX((int) (totalKbps * FOCUS_SHARE), 1) : totalKbps;
+        focusFps = FFMIN(sources[focused].maxFps, n > 1 ? FFMAX((int) (totalFps * FOCUS_SHARE), 1) : totalFps);
+        restKbps -= focusKbps;
+        restFps -= focusFps;
+        others--;
+    }
+    for (int i = 0; i < n; i++) {
+        int kbps = i == focused ? focusKbps : FFMAX(restKbps / FFMAX(others, 1), 1);
+        int fps = i == focused ? focusFps : av_clip(restFps / FFMAX(others, 1), 1, sources[i].maxFps);
+        //a recorder without video refuses them, it has nothing to share
+        sources[i].recorder->setBitrate(kbps);
+        sources[i].recorder->setFrameRate(fps);
+    }
+    counters.focusedKbps = focused >= 0 ? focusKbps : 0;
+    counters.focusedFps = focused >= 0 ? focusFps : 0;
+}
+
+/**
+ * moveFocus() gives the budgets to the source of the first of windows, the active window and its ancestors,
+ * that a source records
+ */
+void SRFocusBudget::moveFocus(const std::vector<uint64_t> &windows) {
+    std::lock_guard<std::mutex> guard(lock);
+    int found = -1;
+    for (size_t w = 0; w < windows.size() && found < 0; w++)
+        for (size_t i = 0; i < sources.size() && found < 0; i++)
+            if (windows[w] && sources[i].window == windows[w])
+                found = (int) i;
+    if (found == focused)
+        return;
+    focused = found;
+    counters.rebalances++;
+    rebalance();
+    srLog(SR_LOG_INFO, "[SRFocusBudget] focus on %s: %d kbit/s, %d fps of %d kbit/s, %d fps",
+          found >= 0 ? sources[found].recorder->settings.window : "no recorded window",
+          counters.focusedKbps, counters.focusedFps, totalKbps, totalFps);
+}
+
+void SRFocusBudget::focus(uint64_t window) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        counters.focusChanges++;
+    }
+    moveFocus(std::vector<uint64_t>(1, window));
+}
+
+#ifdef __unix__
+/**
+ * activeChain() is the active window of the display and its ancestors up to the root, the frame of the window manager
+ * among them: the one a source records may be any of them
+ */
+static std::vector<uint64_t> activeChain(Display *display, Atom active) {
+    std::vector<uint64_t> chain;
+    Window root = DefaultRootWindow(display);
+    Atom type;
+    int format;
+    unsigned long count, after;
+    unsigned char *data = nullptr;
+    if (XGetWindowProperty(display, root, active, 0, 1, False, XA_WINDOW, &type, &format, &count, &after,
+                           &data) != Success || !data)
+        return chain;
+    Window window = count == 1 && format == 32 ? (Window) *(unsigned long *) data : None;
+    XFree(data);
+
+    //a window that went away must not take the recorder with it
+    SRXErrorTrap trap(display);
+    while (window != None && window != root) {
+        chain.push_back((uint64_t) window);
+        Window parent = None, rootReturn;
+        Window *children = nullptr;
+        unsigned int childCount;
+        if (!XQueryTree(display, window, &rootReturn, &parent, &children, &childCount))
+            break;
+        if (children)
+            XFree(children);
+        window = parent;
+    }
+    trap.release();
+    return chain;
+}
+#endif
+
+int SRFocusBudget::start(const char *device) {
+#ifdef __unix__
+    if (watcher.joinable())
+        return 0;
+    std::string name(device ? device : "");
+    Display *display = XOpenDisplay(name.substr(0, name.find('+')).c_str());
+    if (!display) {
+        srLog(SR_LOG_ERROR, "[SRFocusBudget] cannot open display %s", name.c_str());
+        return AVERROR(EIO);
+    }
+    Atom active = XInternAtom(display, "_NET_ACTIVE_WINDOW", False);
+    XSelectInput(display, DefaultRootWindow(display), PropertyChangeMask);
+    //the focus at the start counts at once, the budgets do not wait for the first change
+    moveFocus(activeChain(display, active));
+    stopping = false;
+    watcher = std::thread(&SRFocusBudget::run, this, display, (unsigned long) active);
+    return 0;
+#else
+    (void) device;
+    return AVERROR(ENOSYS);
+#endif
+}
+
+/**
+ * run() is the watcher thread: it owns display and blocks in poll() on its connection; the last focus change is
+ * applied once it is FOCUS_SETTLE ms old
+ */
+void SRFocusBudget::run(struct _XDisplay *display, unsigned long activeAtom) {
+#ifdef __unix__
+    struct pollfd fd = {ConnectionNumber(display), POLLIN, 0};
+    int64_t changed = 0;
+    bool pending = false;
+    while (!stopping.load(std::memory_order_relaxed)) {
+        while (XPending(display)) {
+            XEvent event;
+            XNextEvent(display, &event);
+            if (event.type != PropertyNotify || event.xproperty.atom != (Atom) activeAtom)
+                continue;
+            changed = av_gettime_relative();
+            pending = true;
+            std::lock_guard<std::mutex> guard(lock);
+            counters.focusChanges++;
+        }
+        int64_t now = av_gettime_relative();
+        if (pending && now - changed >= FOCUS_SETTLE * 1000) {
+            pending = false;
+            moveFocus(activeChain(display, (Atom) activeAtom));
+        }
+        int timeout = pending ? (int) FFMAX(1, FFMIN(FOCUS_POLL_TIMEOUT, (changed + FOCUS_SETTLE * 1000 - now) / 1000))
+                              : FOCUS_POLL_TIMEOUT;
+        poll(&fd, 1, timeout);
+    }
+    XCloseDisplay(display);
+#else
+    (void) display;
+    (void) activeAtom;
+#endif
+}
+
+void SRFocusBudget::stop() {
+    stopping = true;
+    if (watcher.joinable())
+        watcher.join();
+}
+
+SRFocusStats SRFocusBudget::stats() {
+    std::lock_guard<std::mutex> guard(lock);
+    return counters;
+}
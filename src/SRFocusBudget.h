@@ -0,0 +1,106 @@
+//
+// Bitrate and frame rate of several recordings shared out by the focus of their windows, within caps.
+//
+
+#ifndef CPPSCREENRECORDER_SRFOCUSBUDGET_H
+#define CPPSCREENRECORDER_SRFOCUSBUDGET_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ScreenRecorder;
+struct _XDisplay;
+
+#define FOCUS_SHARE 0.6     //of each cap the source of the focused window gets, the others split the rest
+#define FOCUS_SETTLE 300    //ms the focus stays on a window before the budgets move: alt-tabbing through leaves them
+#define FOCUS_POLL_TIMEOUT 100  //ms the watcher waits for the display before it checks stop() and a settled focus
+
+/**
+ * Statistics of an SRFocusBudget: the focus changes seen, the ones that moved the budgets (a settled focus on another
+ * source than the last one), and the budgets of the focused source at the last move, 0 when it was none.
+ */
+typedef struct FB{
+    uint64_t focusChanges;
+    uint64_t rebalances;
+    int focusedKbps;
+    int focusedFps;
+}SRFocusStats;
+
+/**
+ * SRFocusBudget shares a bitrate cap and a frame rate cap between recordings of several windows or regions of one
+ * display (the sessions of an SRSessionHost, or recorders of their own): the recording of the focused window gets
+ * FOCUS_SHARE of both, up to the frame rate it was opened with, and the others split what is left evenly, one frame
+ * a second at least. Without a focused source the caps are split evenly. The frame rate is what the capture, the
+ * conversion and the encoder cost per second: the frame rate cap is the CPU cap, the bitrate cap the bandwidth one.\n
+ * The budgets go through ScreenRecorder::setBitrate() and setFrameRate(), the hot reconfiguration of a running
+ * recording: the bitrate from the next GOP, the frame rate from the next frame.\n
+ * On an X display a watcher thread follows _NET_ACTIVE_WINDOW on the root window: the window a source records
+ * (settings.window) is focused when the active window is it or inside it, a window manager frame included.
+ * On the other systems, or with any other notion of focus, focus() sets it.
+ *
+ * @Note the recorders must outlive the budget, or be removed from it first
+ */
+class SRFocusBudget {
+
+private:
+    struct Source {
+        ScreenRecorder *recorder;
+        uint64_t window;    //recorded window, 0 for a region that is never focused
+        int maxFps;
+    };
+
+    int totalKbps, totalFps;
+    std::mutex lock;
+    std::vector<Source> sources;
+    int focused;        //index of the source of the focused window, -1 for none
+    std::thread watcher;
+    std::atomic<bool> stopping;
+    SRFocusStats counters;
+
+    void moveFocus(const std::vector<uint64_t> &windows);
+    void rebalance();
+    void run(struct _XDisplay *display, unsigned long activeAtom);
+
+public:
+    /**
+     * @param totalKbps kbit/s of all the sources together
+     * @param totalFps frames per second of all the sources together
+     */
+    SRFocusBudget(int totalKbps, int totalFps);
+    ~SRFocusBudget();
+
+    SRFocusBudget(const SRFocusBudget&) = delete;
+    SRFocusBudget &operator=(const SRFocusBudget&) = delete;
+
+    /**
+     * addSource() shares the caps with a recording, opened (its settings._fps known) and running or about to:
+     * the budgets of every source are set again
+     */
+    void addSource(ScreenRecorder &recorder);
+
+    /**
+     * removeSource() gives the share of a recording back to the others, before it ends
+     */
+    void removeSource(ScreenRecorder &recorder);
+
+    /**
+     * start() follows the focus of display with the watcher thread
+     * @return 0 on success, AVERROR(ENOSYS) without X11, a negative AVERROR if the display cannot be opened
+     */
+    int start(const char *display);
+
+    void stop();
+
+    /**
+     * focus() moves the budgets to the source recording window (0 for none) at once, what the watcher does after
+     * FOCUS_SETTLE ms
+     */
+    void focus(uint64_t window);
+
+    SRFocusStats stats();
+};
+
+#endif //CPPSCREENRECORDER_SRFOCUSBUDGET_H
@@ -0,0 +1,81 @@
+#include "SRFrameClock.h"
+
+#include <chrono>
+#include <thread>
+#include <time.h>
+
+#if defined(__unix__) && !defined(__APPLE__)
+#define SR_ABSTIME_SLEEP 1
+#endif
+
+SRFrameClock::SRFrameClock(): interval(0), next(0), lastArrival(0), ticks(0), missed(0), jitterSum(0), jitterMax(0) {}
+
+int64_t SRFrameClock::now() {
+#ifdef SR_ABSTIME_SLEEP
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void SRFrameClock::start(int64_t intervalUs) {
+    interval = intervalUs > 0 ? intervalUs : 1;
+    next = now() + interval;
+    lastArrival = 0;
+}
+
+void SRFrameClock::record(int64_t late) {
+    if (late < 0) late = -late;
+    ticks.fetch_add(1, std::memory_order_relaxed);
+    jitterSum.fetch_add(late, std::memory_order_relaxed);
+    if (late > jitterMax.load(std::memory_order_relaxed))
+        jitterMax.store(late, std::memory_order_relaxed);
+}
+
+int64_t SRFrameClock::wait() {
+    int64_t deadline = next;
+#ifdef SR_ABSTIME_SLEEP
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    //EINTR: sleep again towards the same absolute deadline
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) != 0);
+#else
+    int64_t wait = deadline - now();
+    if (wait > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(wait));
+#endif
+    int64_t woke = now();
+    record(woke - deadline);
+
+    next = deadline + interval;
+    if (woke - next >= 0) {
+        //late by a whole interval or more: drop the missed ticks and realign on the grid
+        int64_t skipped = (woke - next) / interval + 1;
+        missed.fetch_add(skipped, std::memory_order_relaxed);
+        next += skipped * interval;
+    }
+    return deadline;
+}
+
+void SRFrameClock::observe(int64_t arrival) {
+    if (lastArrival) {
+        int64_t delta = arrival - lastArrival;
+        record(delta - interval);
+        if (delta >= 2 * interval)
+            missed.fetch_add(delta / interval - 1, std::memory_order_relaxed);
+    }
+    lastArrival = arrival;
+}
+
+SRClockStats SRFrameClock::stats() const {
+    SRClockStats s;
+    s.ticks = ticks.load(std::memory_order_relaxed);
+    s.missed = missed.load(std::memory_order_relaxed);
+    s.meanJitter = s.ticks ? jitterSum.load(std::memory_order_relaxed) / (int64_t) s.ticks : 0;
+    s.maxJitter = jitterMax.load(std::memory_order_relaxed);
+    return s;
+}
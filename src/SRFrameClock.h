@@ -0,0 +1,71 @@
+//
+// Absolute-deadline frame clock driving the video capture.
+//
+
+#ifndef CPPSCREENRECORDER_SRFRAMECLOCK_H
+#define CPPSCREENRECORDER_SRFRAMECLOCK_H
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Pacing statistics of an SRFrameClock, jitter is the lateness of the wake-ups in microseconds
+ */
+typedef struct J{
+    uint64_t ticks;
+    uint64_t missed;    //deadlines skipped because the loop was late by more than a whole interval
+    int64_t meanJitter;
+    int64_t maxJitter;
+}SRClockStats;
+
+/**
+ * SRFrameClock wakes the capture loop at exact multiples of the frame interval.\n
+ * Deadlines are absolute on the monotonic clock (clock_nanosleep with TIMER_ABSTIME where available),
+ * so the time spent grabbing does not accumulate as drift. A loop running late by more than an interval
+ * skips the missed deadlines instead of bursting to catch up.\n
+ * observe() records the jitter of sources paced by someone else, e.g. the libavdevice demuxers.
+ *
+ * @Note wait() and observe() are meant for a single thread, stats() can be read from any thread
+ */
+class SRFrameClock {
+
+private:
+    int64_t interval;
+    int64_t next;
+    int64_t lastArrival;
+
+    std::atomic<uint64_t> ticks;
+    std::atomic<uint64_t> missed;
+    std::atomic<int64_t> jitterSum;
+    std::atomic<int64_t> jitterMax;
+
+    void record(int64_t late);
+
+public:
+    SRFrameClock();
+
+    /**
+     * now() is the monotonic time in microseconds, the base of av_gettime_relative()
+     */
+    static int64_t now();
+
+    /**
+     * start() sets the interval and schedules the first deadline one interval from now
+     */
+    void start(int64_t intervalUs);
+
+    /**
+     * wait() sleeps until the next deadline
+     * @return the deadline, monotonic microseconds: the ideal timestamp of the frame grabbed now
+     */
+    int64_t wait();
+
+    /**
+     * observe() records a frame delivered by an externally paced source at the given monotonic time
+     */
+    void observe(int64_t arrival);
+
+    SRClockStats stats() const;
+};
+
+#endif //CPPSCREENRECORDER_SRFRAMECLOCK_H
@@ -0,0 +1,195 @@
+#include "SRFrameHash.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#define HASH_LANES 8    //64 bit lanes of a hash, one per 8 bytes of each 64 byte block
+
+/*
+ * A hash is 8 independent lanes, h = h * 33 ^ v on each 64 bit word of a 64 byte block: cheap, position dependent
+ * enough to catch any pixel change in practice, and with 8 chains in flight the loop runs at the speed of the loads.
+ * The C, SSE2 and NEON loops compute the same lanes.
+ */
+static inline uint64_t mix(uint64_t h, uint64_t v) {
+    return ((h << 5) + h) ^ v;
+}
+
+static inline void initLanes(uint64_t lanes[HASH_LANES]) {
+    for (int k = 0; k < HASH_LANES; k++)
+        lanes[k] = 0x9e3779b97f4a7c15ULL * (uint64_t) (k + 1);
+}
+
+static inline uint64_t foldLanes(const uint64_t lanes[HASH_LANES]) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int k = 0; k < HASH_LANES; k++)
+        h = (h ^ lanes[k]) * 0x100000001b3ULL;
+    return h;
+}
+
+/**
+ * hashLines() adds height lines of bytes to the lanes: the 64 byte blocks in registers across the lines,
+ * then the 8 byte words, then the bytes
+ */
+static void hashLines(const uint8_t *data, int linesize, int bytes, int height, uint64_t lanes[HASH_LANES]) {
+    int blocks = bytes & ~63;
+#ifdef __SSE2__
+#define SR_MIX_SSE2(h, p) h = _mm_xor_si128(_mm_add_epi64(_mm_slli_epi64(h, 5), h), _mm_loadu_si128((const __m128i *) (p)))
+    if (blocks) {
+        //four named chains: an array of them ends up on the stack
+        __m128i a0 = _mm_loadu_si128((const __m128i *) lanes), a1 = _mm_loadu_si128((const __m128i *) lanes + 1);
+        __m128i a2 = _mm_loadu_si128((const __m128i *) lanes + 2), a3 = _mm_loadu_si128((const __m128i *) lanes + 3);
+        for (int y = 0; y < height; y++) {
+            const uint8_t *line = data + (size_t) y * linesize;
+            for (int x = 0; x < blocks; x += 64) {
+                SR_MIX_SSE2(a0, line + x);
+                SR_MIX_SSE2(a1, line + x + 16);
+                SR_MIX_SSE2(a2, line + x + 32);
+                SR_MIX_SSE2(a3, line + x + 48);
+            }
+        }
+        _mm_storeu_si128((__m128i *) lanes, a0);
+        _mm_storeu_si128((__m128i *) lanes + 1, a1);
+        _mm_storeu_si128((__m128i *) lanes + 2, a2);
+        _mm_storeu_si128((__m128i *) lanes + 3, a3);
+    }
+#undef SR_MIX_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SR_MIX_NEON(h, p) h = veorq_u64(vaddq_u64(vshlq_n_u64(h, 5), h), vreinterpretq_u64_u8(vld1q_u8(p)))
+    if (blocks) {
+        uint64x2_t a0 = vld1q_u64(lanes), a1 = vld1q_u64(lanes + 2), a2 = vld1q_u64(lanes + 4), a3 = vld1q_u64(lanes + 6);
+        for (int y = 0; y < height; y++) {
+            const uint8_t *line = data + (size_t) y * linesize;
+            for (int x = 0; x < blocks; x += 64) {
+                SR_MIX_NEON(a0, line + x);
+                SR_MIX_NEON(a1, line + x + 16);
+                SR_MIX_NEON(a2, line + x + 32);
+                SR_MIX_NEON(a3, line + x + 48);
+            }
+        }
+        vst1q_u64(lanes, a0);
+        vst1q_u64(lanes + 2, a1);
+        vst1q_u64(lanes + 4, a2);
+        vst1q_u64(lanes + 6, a3);
+    }
+#undef SR_MIX_NEON
+#else
+    for (int y = 0; y < height; y++) {
+        const uint8_t *line = data + (size_t) y * linesize;
+        for (int x = 0; x < blocks; x += 64)
+            for (int k = 0; k < HASH_LANES; k++) {
+                uint64_t v;
+                memcpy(&v, line + x + 8 * k, 8);
+                lanes[k] = mix(lanes[k], v);
+            }
+    }
+#endif
+    if (blocks == bytes)
+        return;
+    //the same lanes as if the tail were hashed after the blocks of each line
+    for (int y = 0; y < height; y++) {
+        const uint8_t *line = data + (size_t) y * linesize;
+        int x = blocks;
+        for (int k = 0; x + 8 <= bytes; x += 8, k++) {
+            uint64_t v;
+            memcpy(&v, line + x, 8);
+            lanes[k] = mix(lanes[k], v);
+        }
+        for (; x < bytes; x++)
+            lanes[0] = mix(lanes[0], line[x]);
+    }
+}
+
+uint64_t hashTile(const uint8_t *data, int linesize, int bytewidth, int height) {
+    uint64_t lanes[HASH_LANES];
+    initLanes(lanes);
+    hashLines(data, linesize, bytewidth, height, lanes);
+    return foldLanes(lanes);
+}
+
+SRTileHasher::SRTileHasher(): cols(0), rows(0), primed(false) {}
+
+void SRTileHasher::reset() {
+    primed = false;
+}
+
+int SRTileHasher::update(const uint8_t *data, int linesize, int width, int height, int bpp) {
+    int newCols = (width + SR_TILE_SIZE - 1) / SR_TILE_SIZE;
+    int newRows = (height + SR_TILE_SIZE - 1) / SR_TILE_SIZE;
+
+    if (newCols != cols || newRows != rows) {
+        cols = newCols;
+        rows = newRows;
+        hashes.assign((size_t) cols * rows, 0);
+        primed = false;
+    }
+
+    changed.clear();
+    for (int r = 0; r < rows; r++) {
+        int y = r * SR_TILE_SIZE;
+        int th = height - y < SR_TILE_SIZE ? height - y : SR_TILE_SIZE;
+        for (int c = 0; c < cols; c++) {
+            int x = c * SR_TILE_SIZE;
+            int tw = width - x < SR_TILE_SIZE ? width - x : SR_TILE_SIZE;
+            uint64_t h = hashTile(data + (size_t) y * linesize + (size_t) x * bpp, linesize, tw * bpp, th);
+            uint64_t &old = hashes[(size_t) r * cols + c];
+            if (!primed || h != old)
+                changed.push_back(r * cols + c);
+            old = h;
+        }
+    }
+    primed = true;
+    return (int) changed.size();
+}
+
+SRScrollDetector::SRScrollDetector(): votes(2 * SR_SCROLL_MAX + 1) {}
+
+void SRScrollDetector::reset() {
+    previous.clear();
+}
+
+int SRScrollDetector::update(const uint8_t *data, int linesize, int width, int height, int bpp) {
+    //the central half: scroll bars, side panels and the pointer edges stay out of it
+    int left = width / 4, bytes = (width / 2) * bpp;
+    current.resize(height);
+    for (int y = 0; y < height; y++)
+        current[y] = hashTile(data + (size_t) y * linesize + (size_t) left * bpp, linesize, bytes, 1);
+    if ((int) previous.size() != height) {
+        previous.swap(current);
+        return 0;
+    }
+
+    sorted.resize(height);
+    for (int y = 0; y < height; y++)
+        sorted[y] = std::make_pair(previous[y], y);
+    std::sort(sorted.begin(), sorted.end());
+    std::fill(votes.begin(), votes.end(), 0);
+    int changed = 0;
+    for (int y = 0; y < height; y++) {
+        if (current[y] == previous[y])
+            continue;
+        changed++;
+        auto it = std::lower_bound(sorted.begin(), sorted.end(), std::make_pair(current[y], -1));
+        if (it == sorted.end() || it->first != current[y] || (it + 1 != sorted.end() && (it + 1)->first == current[y]))
+            continue;
+        int moved = it->second - y;
+        if (moved >= -SR_SCROLL_MAX && moved <= SR_SCROLL_MAX)
+            votes[moved + SR_SCROLL_MAX]++;
+    }
+    previous.swap(current);
+
+    int best = SR_SCROLL_MAX;
+    for (int i = 0; i < (int) votes.size(); i++)
+        if (votes[i] > votes[best])
+            best = i;
+    //most of the changed rows moved together: a scroll, not new content
+    if (best == SR_SCROLL_MAX || votes[best] < SR_SCROLL_MIN_ROWS || votes[best] * 2 < changed)
+        return 0;
+    return best - SR_SCROLL_MAX;
+}
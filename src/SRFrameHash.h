@@ -0,0 +1,82 @@
+//
+// Tile hashing of captured frames, used to detect screen changes.
+//
+
+#ifndef CPPSCREENRECORDER_SRFRAMEHASH_H
+#define CPPSCREENRECORDER_SRFRAMEHASH_H
+
+#include <cstdint>
+#include <vector>
+
+#define SR_TILE_SIZE 64
+#define SR_SCROLL_MAX 256   //rows a frame may scroll by and still be detected
+#define SR_SCROLL_MIN_ROWS 16   //rows that must agree on the scroll, fewer is a change of the content
+
+/**
+ * SRTileHasher splits packed frames in SR_TILE_SIZE x SR_TILE_SIZE tiles and keeps one 64 bit hash per tile.\n
+ * update() hashes a new frame and reports how many tiles differ from the previous one,
+ * so a static screen is detected with a single read of the frame and no copy of it.\n
+ * changedTiles() lists the tiles of the last update(): what changed is walked in O(changed), not over the whole grid.
+ */
+class SRTileHasher {
+
+private:
+    int cols;
+    int rows;
+    std::vector<uint64_t> hashes;
+    std::vector<int> changed;   //tiles of the last update() that differ, row major
+    bool primed;
+
+public:
+    SRTileHasher();
+
+    /**
+     * update() hashes the frame and stores the new tile hashes
+     * @param bpp bytes per pixel of the packed format
+     * @return the number of changed tiles, every tile counts as changed on the first frame or after a size change
+     */
+    int update(const uint8_t *data, int linesize, int width, int height, int bpp);
+
+    /**
+     * changedTiles() are the indices, row * columns() + column, of the tiles the last update() found changed
+     */
+    const std::vector<int> &changedTiles() const { return changed; }
+
+    int columns() const { return cols; }
+
+    void reset();
+};
+
+/**
+ * SRScrollDetector finds the vertical scroll between two frames from one hash per row of their central half:
+ * the rows that changed are looked up among the rows of the previous frame and vote for the distance
+ * they moved by. A row repeated in the previous frame (background, blank lines) cannot tell where it comes from
+ * and is left out.
+ */
+class SRScrollDetector {
+
+private:
+    std::vector<uint64_t> previous;
+    std::vector<uint64_t> current;
+    std::vector<std::pair<uint64_t, int>> sorted;   //unique rows of previous, by hash
+    std::vector<int> votes;
+
+public:
+    SRScrollDetector();
+
+    /**
+     * update() hashes the rows of the frame and compares them with the ones of the previous frame
+     * @param bpp bytes per pixel of the packed format
+     * @return the rows the content moved by, positive when it moved up (scrolling down a page), 0 for no scroll
+     */
+    int update(const uint8_t *data, int linesize, int width, int height, int bpp);
+
+    void reset();
+};
+
+/**
+ * hashTile() hashes a rectangle of bytes in 8 independent lanes per 64 bytes, SSE2 or NEON when available
+ */
+uint64_t hashTile(const uint8_t *data, int linesize, int bytewidth, int height);
+
+#endif //CPPSCREENRECORDER_SRFRAMEHASH_H
@@ -0,0 +1,172 @@
+#include "SRFramePool.h"
+#include "SRNuma.h"
+
+#include <cstdint>
+
+extern "C"
+{
+#include "libavutil/imgutils.h"
+#include "libavutil/samplefmt.h"
+}
+
+SRFramePool::SRFramePool(): pool(nullptr), bufferSize(0), node(-1), huge(false), type(AVMEDIA_TYPE_UNKNOWN), format(-1), width(0), height(0),
+                            nbSamples(0), channels(0), channelLayout(0), sampleRate(0) {}
+
+SRFramePool::~SRFramePool() {
+    for (AVFrame *frame : frames)
+        av_frame_free(&frame);
+    //buffers still referenced elsewhere keep the pool alive until they are released
+    av_buffer_pool_uninit(&pool);
+}
+
+int SRFramePool::initVideo(enum AVPixelFormat format, int width, int height, int count) {
+    type = AVMEDIA_TYPE_VIDEO;
+    this->format = format;
+    this->width = width;
+    this->height = height;
+    bufferSize = av_image_get_buffer_size(format, width, height, 32);
+    if (bufferSize < 0) return bufferSize;
+    return prealloc(count);
+}
+
+int SRFramePool::initAudio(enum AVSampleFormat format, int channels, uint64_t channelLayout, int sampleRate,
+                           int nbSamples, int count) {
+    type = AVMEDIA_TYPE_AUDIO;
+    this->format = format;
+    this->channels = channels;
+    this->channelLayout = channelLayout;
+    this->sampleRate = sampleRate;
+    this->nbSamples = nbSamples;
+    bufferSize = av_samples_get_buffer_size(nullptr, channels, nbSamples, format, 0);
+    if (bufferSize < 0) return bufferSize;
+    if (av_sample_fmt_is_planar(format) && channels > AV_NUM_DATA_POINTERS) return AVERROR(ENOSYS);
+    return prealloc(count);
+}
+
+//the opaque of both packs a value and the huge page flag in its low bit
+static void nodeFree(void *opaque, uint8_t *data) {
+    numaFree(data, (size_t) ((intptr_t) opaque >> 1), (intptr_t) opaque & 1);
+}
+
+/**
+ * nodeAlloc() is the allocator of the pools bound to a node or on huge pages, opaque is the node
+ */
+AVBufferRef *SRFramePool::nodeAlloc(void *opaque, int size) {
+    int node = (int) ((intptr_t) opaque >> 1);
+    bool huge = (intptr_t) opaque & 1;
+    uint8_t *data = (uint8_t *) numaAlloc((size_t) size, node, huge);
+    if (!data)
+        return nullptr;
+    AVBufferRef *buf = av_buffer_create(data, size, nodeFree, (void *) (((intptr_t) size << 1) | huge), 0);
+    if (!buf)
+        numaFree(data, (size_t) size, huge);
+    return buf;
+}
+
+/**
+ * prealloc() fills the buffer pool and the frame list, so that the steady state starts warm
+ */
+int SRFramePool::prealloc(int count) {
+    std::vector<AVFrame*> warm;
+
+    av_buffer_pool_uninit(&pool);
+    bool hugePages = huge && bufferSize >= HUGE_PAGE_SIZE;
+    if (node >= 0 || hugePages)
+        pool = av_buffer_pool_init2(bufferSize + AV_INPUT_BUFFER_PADDING_SIZE,
+                                    (void *) ((intptr_t) node * 2 | hugePages), nodeAlloc, nullptr);
+    else
+        pool = av_buffer_pool_init(bufferSize + AV_INPUT_BUFFER_PADDING_SIZE, av_buffer_alloc);
+    if (!pool) return AVERROR(ENOMEM);
+
+    frames.reserve(frames.size() + count);
+    for (int i = 0; i < count; i++) {
+        AVFrame *frame = get();
+        if (!frame) break;
+        warm.push_back(frame);
+    }
+    for (AVFrame *frame : warm)
+        release(frame);
+    return (int) warm.size() == count ? 0 : AVERROR(ENOMEM);
+}
+
+AVFrame *SRFramePool::getEmpty() {
+    {
+        std::lock_guard<SRMutex> guard(lock);
+        if (!frames.empty()) {
+            AVFrame *frame = frames.back();
+            frames.pop_back();
+            return frame;
+        }
+    }
+    return av_frame_alloc();
+}
+
+AVFrame *SRFramePool::get() {
+    if (!pool) return nullptr;
+
+    AVFrame *frame = getEmpty();
+    if (!frame) return nullptr;
+
+    frame->buf[0] = av_buffer_pool_get(pool);
+    if (!frame->buf[0]) {
+        release(frame);
+        return nullptr;
+    }
+
+    frame->format = format;
+    if (type == AVMEDIA_TYPE_VIDEO) {
+        frame->width = width;
+        frame->height = height;
+        av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, (enum AVPixelFormat) format,
+                             width, height, 32);
+    } else {
+        frame->nb_samples = nbSamples;
+        frame->channels = channels;
+        frame->channel_layout = channelLayout;
+        frame->sample_rate = sampleRate;
+        av_samples_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, channels, nbSamples,
+                               (enum AVSampleFormat) format, 0);
+    }
+    frame->extended_data = frame->data;
+    return frame;
+}
+
+void SRFramePool::release(AVFrame *frame) {
+    if (!frame) return;
+    av_frame_unref(frame);
+    std::lock_guard<SRMutex> guard(lock);
+    frames.push_back(frame);
+}
+
+SRPacketPool::~SRPacketPool() {
+    for (AVPacket *packet : packets)
+        av_packet_free(&packet);
+}
+
+void SRPacketPool::reserve(int count) {
+    std::vector<AVPacket*> warm;
+    packets.reserve(packets.size() + count);
+    for (int i = 0; i < count; i++)
+        warm.push_back(get());
+    for (AVPacket *packet : warm)
+        release(packet);
+}
+
+AVPacket *SRPacketPool::get() {
+    {
+        std::lock_guard<SRMutex> guard(lock);
+        if (!packets.empty()) {
+            AVPacket *packet = packets.back();
+            packets.pop_back();
+            return packet;
+        }
+    }
+    return av_packet_alloc();
+}
+
+void SRPacketPool::release(AVPacket *packet) {
+    if (!packet) return;
+    av_packet_unref(packet);
+    std::lock_guard<SRMutex> guard(lock);
+    packets.push_back(packet);
+}
@@ -0,0 +1,120 @@
+//
+// Recycling pools for the frames and packets of the capture loops.
+//
+
+#ifndef CPPSCREENRECORDER_SRFRAMEPOOL_H
+#define CPPSCREENRECORDER_SRFRAMEPOOL_H
+
+#include <mutex>
+#include <vector>
+#include "SRProfiler.h"
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavutil/buffer.h"
+#include "libavutil/frame.h"
+}
+
+/**
+ * SRFramePool hands out AVFrames of one fixed video or audio geometry.\n
+ * Data buffers come from an AVBufferPool and go back to it when the last reference is dropped,
+ * the AVFrame structs are recycled by release(): once the pool is warm no heap allocation happens.
+ * get() and release() can be called from any thread.\n
+ * A pool bound to a NUMA node with setNode() allocates its buffers from the memory of that node,
+ * with setHugePages() in huge pages: a 4K frame is a few TLB entries instead of thousands.
+ */
+class SRFramePool {
+
+private:
+    SRMutex lock;
+    std::vector<AVFrame*> frames;
+    AVBufferPool *pool;
+    int bufferSize;
+    int node;
+    bool huge;
+
+    //geometry of the frames returned by get()
+    enum AVMediaType type;
+    int format;
+    int width;
+    int height;
+    int nbSamples;
+    int channels;
+    uint64_t channelLayout;
+    int sampleRate;
+
+    int prealloc(int count);
+    static AVBufferRef *nodeAlloc(void *opaque, int size);
+
+public:
+    SRFramePool();
+    ~SRFramePool();
+
+    SRFramePool(const SRFramePool&) = delete;
+    SRFramePool &operator=(const SRFramePool&) = delete;
+
+    /**
+     * setNode() places the buffers of the next init on NUMA node, -1 (the default) leaves them to the first touch
+     */
+    void setNode(int node) { this->node = node; }
+
+    /**
+     * setHugePages() backs the buffers of the next init with huge pages when they are at least HUGE_PAGE_SIZE,
+     * see numaAlloc(); smaller buffers would waste most of their page
+     */
+    void setHugePages(bool huge) { this->huge = huge; }
+
+    /**
+     * initVideo() sizes the pool for video frames
+     * @param count number of frames allocated up front
+     * @return 0 on success, a negative AVERROR code otherwise
+     */
+    int initVideo(enum AVPixelFormat format, int width, int height, int count);
+
+    /**
+     * initAudio() sizes the pool for audio frames of nbSamples samples
+     * @param count number of frames allocated up front
+     * @return 0 on success, a negative AVERROR code otherwise
+     */
+    int initAudio(enum AVSampleFormat format, int channels, uint64_t channelLayout, int sampleRate, int nbSamples, int count);
+
+    /**
+     * get() returns a frame with writable buffers of the pool geometry
+     * @return nullptr on allocation failure or if the pool was never initialized
+     */
+    AVFrame *get();
+
+    /**
+     * getEmpty() returns a frame without buffers, e.g. for decoder output
+     */
+    AVFrame *getEmpty();
+
+    /**
+     * release() drops the references of the frame and keeps the struct for the next get()
+     */
+    void release(AVFrame *frame);
+};
+
+/**
+ * SRPacketPool recycles AVPacket structs between the encoders and the muxer.
+ */
+class SRPacketPool {
+
+private:
+    SRMutex lock;
+    std::vector<AVPacket*> packets;
+
+public:
+    SRPacketPool() = default;
+    ~SRPacketPool();
+
+    SRPacketPool(const SRPacketPool&) = delete;
+    SRPacketPool &operator=(const SRPacketPool&) = delete;
+
+    void reserve(int count);
+    AVPacket *get();
+    void release(AVPacket *packet);
+};
+
+#endif //CPPSCREENRECORDER_SRFRAMEPOOL_H
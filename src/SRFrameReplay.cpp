@@ -0,0 +1,301 @@
+#include "SRFrameReplay.h"
+#include "SRLog.h"
+
+#include <cstdio>
+
+extern "C"
+{
+#include "libavutil/imgutils.h"
+#include "libavutil/opt.h"
+}
+
+SRFrameReplay::SRFrameReplay(int duration, int64_t maxBytes, bool pack): maxDuration((int64_t) duration * 1000000),
+                                                                           maxBytes(maxBytes), pack(pack), source(nullptr),
+                                                                           packer(nullptr), packedParameters(nullptr),
+                                                                           packed(nullptr), bytes(0), evicted(0),
+                                                                           saving(false), saved(0) {}
+
+SRFrameReplay::~SRFrameReplay() {
+    finish();
+    for (Entry &entry : entries)
+        release(entry);
+    avcodec_free_context(&packer);
+    avcodec_parameters_free(&packedParameters);
+    av_packet_free(&packed);
+}
+
+int SRFrameReplay::open(const AVCodecContext *source) {
+    if (source->hw_frames_ctx)
+        return AVERROR(ENOSYS);
+    this->source = source;
+    int ret = pool.initVideo(source->pix_fmt, source->width, source->height, 1);
+    if (ret < 0 || !pack)
+        return ret;
+
+    //a format the packer cannot take is kept unpacked
+    const AVCodec *codec = avcodec_find_encoder_by_name(FRAME_REPLAY_CODEC);
+    bool supported = false;
+    for (const enum AVPixelFormat *f = codec ? codec->pix_fmts : nullptr; f && *f != AV_PIX_FMT_NONE; f++)
+        supported = supported || *f == source->pix_fmt;
+    if (!supported) {
+        srLog(SR_LOG_WARNING, "[SRFrameReplay] %s cannot pack the frames, kept as they are", FRAME_REPLAY_CODEC);
+        pack = false;
+        return 0;
+    }
+    if (!(packer = avcodec_alloc_context3(codec)) || !(packed = av_packet_alloc()) ||
+        !(packedParameters = avcodec_parameters_alloc()))
+        return AVERROR(ENOMEM);
+    packer->width = source->width;
+    packer->height = source->height;
+    packer->pix_fmt = source->pix_fmt;
+    packer->time_base = {1, 1000000};
+    //on the ProducerThread, in place of the encoder: one core, no frame delay
+    packer->thread_count = 1;
+    if ((ret = avcodec_open2(packer, codec, nullptr)) < 0)
+        return ret;
+    return avcodec_parameters_from_context(packedParameters, packer);
+}
+
+void SRFrameReplay::push(const AVFrame *frame) {
+    if (!source || frame->hw_frames_ctx)
+        return;
+    if (pack) {
+        if (avcodec_send_frame(packer, frame) < 0)
+            return;
+        while (avcodec_receive_packet(packer, packed) >= 0) {
+            Entry entry = {nullptr, av_packet_alloc(), packed->pts, packed->size};
+            if (!entry.packet) {
+                av_packet_unref(packed);
+                return;
+            }
+            av_packet_move_ref(entry.packet, packed);
+            store(entry);
+        }
+        return;
+    }
+    Entry entry = {pool.get(), nullptr, frame->pts,
+                   av_image_get_buffer_size((enum AVPixelFormat) frame->format, frame->width, frame->height, 1)};
+    if (!entry.frame || av_frame_copy(entry.frame, frame) < 0) {
+        pool.release(entry.frame);
+        return;
+    }
+    av_frame_copy_props(entry.frame, frame);
+    store(entry);
+}
+
+void SRFrameReplay::store(Entry entry) {
+    std::lock_guard<std::mutex> guard(lock);
+    entries.push_back(entry);
+    bytes += entry.bytes;
+    //the buffers of an evicted frame return to the pool, unless a replay being written still references them
+    while (entries.size() > 1 && (entries.back().pts - entries.front().pts > maxDuration || bytes > maxBytes)) {
+        bytes -= entries.front().bytes;
+        release(entries.front());
+        entries.pop_front();
+        evicted++;
+    }
+}
+
+void SRFrameReplay::release(Entry &entry) {
+    pool.release(entry.frame);
+    av_packet_free(&entry.packet);
+    entry.frame = nullptr;
+}
+
+int SRFrameReplay::save(const char *path) {
+    if (saving.exchange(true))
+        return AVERROR(EBUSY);
+    if (saver.joinable())
+        saver.join();
+
+    std::vector<Entry> frames;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (entries.empty()) {
+            saving = false;
+            return AVERROR(EAGAIN);
+        }
+        //references: the saver reads the buffers while push() evicts and recycles the structs
+        frames.reserve(entries.size());
+        for (const Entry &entry : entries) {
+            Entry ref = {entry.frame ? av_frame_clone(entry.frame) : nullptr,
+                         entry.packet ? av_packet_clone(entry.packet) : nullptr, entry.pts, entry.bytes};
+            if (ref.frame || ref.packet)
+                frames.push_back(ref);
+        }
+    }
+    //no reference taken: out of memory
+    if (frames.empty()) {
+        saving = false;
+        return AVERROR(ENOMEM);
+    }
+    saver = std::thread(&SRFrameReplay::write, this, std::string(path), std::move(frames));
+    return 0;
+}
+
+/**
+ * openEncoder() opens an encoder like the one of the recording, options included, with every core
+ * and the global header flag of out
+ */
+AVCodecContext *SRFrameReplay::openEncoder(const AVFormatContext *out) const {
+    AVCodecContext *enc = avcodec_alloc_context3(source->codec);
+    if (!enc)
+        return nullptr;
+    enc->width = source->width;
+    enc->height = source->height;
+    enc->pix_fmt = source->pix_fmt;
+    enc->sample_aspect_ratio = source->sample_aspect_ratio;
+    enc->time_base = source->time_base;
+    enc->framerate = source->framerate;
+    enc->bit_rate = source->bit_rate;
+    enc->rc_max_rate = source->rc_max_rate;
+    enc->rc_min_rate = source->rc_min_rate;
+    enc->rc_buffer_size = source->rc_buffer_size;
+    enc->gop_size = source->gop_size;
+    enc->max_b_frames = source->max_b_frames;
+    enc->qmin = source->qmin;
+    enc->qmax = source->qmax;
+    enc->global_quality = source->global_quality;
+    enc->profile = source->profile;
+    enc->level = source->level;
+    enc->color_range = source->color_range;
+    enc->colorspace = source->colorspace;
+    enc->color_primaries = source->color_primaries;
+    enc->color_trc = source->color_trc;
+    enc->flags = source->flags & ~AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (out->oformat->flags & AVFMT_GLOBALHEADER)
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    //preset, crf, tune: the private options of the recording encoder
+    if (source->priv_data && enc->priv_data)
+        av_opt_copy(enc->priv_data, source->priv_data);
+    //nothing else waits for this encode: it takes every core
+    enc->thread_count = 0;
+    enc->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (avcodec_open2(enc, source->codec, nullptr) < 0)
+        avcodec_free_context(&enc);
+    return enc;
+}
+
+/**
+ * encode() sends frame, nullptr to drain, to enc and writes the packets it has ready
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int SRFrameReplay::encode(AVCodecContext *enc, AVFormatContext *out, AVFrame *frame, AVPacket *pkt) const {
+    int ret = avcodec_send_frame(enc, frame);
+    while (ret >= 0) {
+        ret = avcodec_receive_packet(enc, pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return 0;
+        if (ret < 0)
+            break;
+        pkt->stream_index = 0;
+        av_packet_rescale_ts(pkt, enc->time_base, out->streams[0]->time_base);
+        ret = av_interleaved_write_frame(out, pkt);
+    }
+    return ret;
+}
+
+/**
+ * write() is the thread of save(): it unpacks the frames if need be, encodes them into path with the first one at 0,
+ * and releases them
+ */
+void SRFrameReplay::write(std::string path, std::vector<Entry> frames) {
+    AVFormatContext *out = nullptr;
+    AVCodecContext *enc = nullptr, *unpacker = nullptr;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *unpacked = av_frame_alloc();
+    int ret = frames.empty() ? AVERROR(EAGAIN) : !pkt || !unpacked ? AVERROR(ENOMEM) :
+              avformat_alloc_output_context2(&out, nullptr, nullptr, path.c_str());
+    if (ret >= 0 && !(enc = openEncoder(out)))
+        ret = AVERROR_ENCODER_NOT_FOUND;
+    AVStream *st = ret >= 0 ? avformat_new_stream(out, nullptr) : nullptr;
+    if (ret >= 0 && !st)
+        ret = AVERROR(ENOMEM);
+    if (ret >= 0 && (ret = avcodec_parameters_from_context(st->codecpar, enc)) >= 0)
+        st->time_base = enc->time_base;
+    if (ret >= 0 && !(out->oformat->flags & AVFMT_NOFILE))
+        ret = avio_open(&out->pb, path.c_str(), AVIO_FLAG_WRITE);
+    if (ret >= 0)
+        ret = avformat_write_header(out, nullptr);
+    if (ret >= 0 && packedParameters && frames[0].packet) {
+        const AVCodec *codec = avcodec_find_decoder(packedParameters->codec_id);
+        if (!codec || !(unpacker = avcodec_alloc_context3(codec)))
+            ret = AVERROR_DECODER_NOT_FOUND;
+        if (ret >= 0 && (ret = avcodec_parameters_to_context(unpacker, packedParameters)) >= 0) {
+            unpacker->pkt_timebase = {1, 1000000};
+            unpacker->thread_count = 0;
+            ret = avcodec_open2(unpacker, codec, nullptr);
+        }
+    }
+
+    int64_t origin = frames.empty() ? 0 : frames[0].pts, last = AV_NOPTS_VALUE;
+    auto encodeAt = [&](AVFrame *frame, int64_t us) {
+        int64_t pts = av_rescale_q(us - origin, AV_TIME_BASE_Q, enc->time_base);
+        if (last != AV_NOPTS_VALUE && pts <= last)
+            pts = last + 1;
+        frame->pts = last = pts;
+        frame->pict_type = AV_PICTURE_TYPE_NONE;
+        return encode(enc, out, frame, pkt);
+    };
+    for (size_t i = 0; ret >= 0 && i <= frames.size(); i++) {
+        if (i < frames.size() && frames[i].frame) {
+            ret = encodeAt(frames[i].frame, frames[i].pts);
+            continue;
+        }
+        if (!unpacker)
+            continue;
+        //the packets keep their capture time through the decoder, nullptr drains it
+        ret = avcodec_send_packet(unpacker, i < frames.size() ? frames[i].packet : nullptr);
+        while (ret >= 0 && (ret = avcodec_receive_frame(unpacker, unpacked)) >= 0) {
+            ret = encodeAt(unpacked, unpacked->pts);
+            av_frame_unref(unpacked);
+        }
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            ret = 0;
+    }
+    if (ret >= 0)
+        ret = encode(enc, out, nullptr, pkt);
+    if (ret >= 0)
+        ret = av_write_trailer(out);
+
+    if (out) {
+        if (!(out->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&out->pb);
+        avformat_free_context(out);
+    }
+    avcodec_free_context(&enc);
+    avcodec_free_context(&unpacker);
+    av_packet_free(&pkt);
+    av_frame_free(&unpacked);
+    int64_t duration = frames.back().pts - frames.front().pts;
+    for (Entry &entry : frames) {
+        av_frame_free(&entry.frame);
+        av_packet_free(&entry.packet);
+    }
+    if (ret < 0) {
+        srLog(SR_LOG_ERROR, "[SRFrameReplay] cannot write the replay %s %d", path.c_str(), ret);
+        remove(path.c_str());
+    } else {
+        saved++;
+        srLog(SR_LOG_INFO, "[SRFrameReplay] replay of %.1f s, %zu frames, encoded to %s", duration / 1000000.0,
+              frames.size(), path.c_str());
+    }
+    saving = false;
+}
+
+void SRFrameReplay::finish() {
+    if (saver.joinable())
+        saver.join();
+}
+
+SRFrameReplayStats SRFrameReplay::stats() const {
+    std::lock_guard<std::mutex> guard(lock);
+    SRFrameReplayStats s;
+    s.duration = entries.empty() ? 0 : entries.back().pts - entries.front().pts;
+    s.bytes = bytes;
+    s.frames = entries.size();
+    s.evictedFrames = evicted;
+    s.saved = saved;
+    s.packed = pack;
+    return s;
+}
@@ -0,0 +1,121 @@
+//
+// Deferred-encoding replay: the last seconds of converted frames kept in memory, encoded only when saved.
+//
+
+#ifndef CPPSCREENRECORDER_SRFRAMEREPLAY_H
+#define CPPSCREENRECORDER_SRFRAMEREPLAY_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SRFramePool.h"
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+#define FRAME_REPLAY_CODEC "ffvhuff"    //lossless intra codec of the packed frames of settings._replaypack
+
+/**
+ * Statistics of an SRFrameReplay: what it holds now, the frames evicted so far and the replays written.
+ */
+typedef struct FR{
+    int64_t duration;   //us
+    int64_t bytes;
+    uint64_t frames;
+    uint64_t evictedFrames;
+    uint64_t saved;
+    bool packed;
+}SRFrameReplayStats;
+
+/**
+ * SRFrameReplay keeps the converted frames of the recording instead of encoding them: the capture and the
+ * conversion run, the encoder does not, until save() encodes the frames it holds into a file.\n
+ * The frames are copied into pooled buffers, recycled once evicted: the oldest ones go when the buffer spans more
+ * than the duration or holds more than maxBytes. Packed, each frame is compressed with the fast lossless
+ * FRAME_REPLAY_CODEC first, a few times smaller for screen content, and decoded back by save().\n
+ * save() references the frames it holds and encodes them from its own thread, with the encoder and the options
+ * of the recording on every core: push() goes on meanwhile, nothing is paused.
+ *
+ * @Note push() is ProducerThread only, save() and stats() may be called from any thread; system memory frames only
+ */
+class SRFrameReplay {
+
+private:
+    struct Entry {
+        AVFrame *frame;     //copy, unpacked
+        AVPacket *packet;   //packed frame
+        int64_t pts;        //us on the capture clock
+        int64_t bytes;
+    };
+
+    int64_t maxDuration;    //us
+    int64_t maxBytes;
+    bool pack;
+    const AVCodecContext *source;   //encoder of the recording, opened and never fed
+    SRFramePool pool;
+    AVCodecContext *packer;
+    AVCodecParameters *packedParameters;
+    AVPacket *packed;
+
+    mutable std::mutex lock;
+    std::deque<Entry> entries;
+    int64_t bytes;
+    uint64_t evicted;
+
+    std::thread saver;
+    std::atomic<bool> saving;
+    std::atomic<uint64_t> saved;
+
+    void store(Entry entry);
+    void release(Entry &entry);
+    void write(std::string path, std::vector<Entry> frames);
+    AVCodecContext *openEncoder(const AVFormatContext *out) const;
+    int encode(AVCodecContext *enc, AVFormatContext *out, AVFrame *frame, AVPacket *pkt) const;
+
+public:
+    /**
+     * @param duration s kept, at least
+     * @param maxBytes bytes of frames kept, at most, the oldest ones are dropped to stay below
+     * @param pack compress the frames with FRAME_REPLAY_CODEC
+     */
+    SRFrameReplay(int duration, int64_t maxBytes, bool pack);
+    ~SRFrameReplay();
+
+    SRFrameReplay(const SRFrameReplay&) = delete;
+    SRFrameReplay &operator=(const SRFrameReplay&) = delete;
+
+    /**
+     * open() takes the geometry of the frames and the encoder of the replays from the encoder of the recording
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int open(const AVCodecContext *source);
+
+    /**
+     * push() copies, or packs, frame
+     * @Note frame pts in microseconds on the capture clock
+     */
+    void push(const AVFrame *frame);
+
+    /**
+     * save() starts encoding the buffered frames into path, in the container of its extension, and returns
+     * @return 0 when the replay is being written, AVERROR(EBUSY) while the previous one is, AVERROR(EAGAIN) when
+     * the buffer holds no frame yet
+     */
+    int save(const char *path);
+
+    /**
+     * finish() waits for the replay being written, if any
+     */
+    void finish();
+
+    SRFrameReplayStats stats() const;
+};
+
+#endif //CPPSCREENRECORDER_SRFRAMEREPLAY_H
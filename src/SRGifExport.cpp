@@ -0,0 +1,509 @@
+#include "SRGifExport.h"
+#include "SRLog.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern "C"
+{
+#include "libavutil/imgutils.h"
+#include "libavutil/time.h"
+#include "libswscale/swscale.h"
+}
+
+using namespace std;
+
+#define GIF_CODES (1 << (3 * GIF_CODE_BITS))
+#define GIF_LEVEL(c) (((c) << (8 - GIF_CODE_BITS)) | (1 << (7 - GIF_CODE_BITS)))    //8 bit center of a component code
+
+static const uint8_t bayer[8][8] = {
+        { 0, 32,  8, 40,  2, 34, 10, 42},
+        {48, 16, 56, 24, 50, 18, 58, 26},
+        {12, 44,  4, 36, 14, 46,  6, 38},
+        {60, 28, 52, 20, 62, 30, 54, 22},
+        { 3, 35, 11, 43,  1, 33,  9, 41},
+        {51, 19, 59, 27, 49, 17, 57, 25},
+        {15, 47,  7, 39, 13, 45,  5, 37},
+        {63, 31, 55, 23, 61, 29, 53, 21}};
+
+/**
+ * ditherRow() adds the Bayer threshold of row y to each component of a BGR0 row and keeps GIF_CODE_BITS bits of
+ * each: the thresholds spread over one step of the codes, so the truncation rounds as often up as the pixel is close
+ * to the next code. The codes are r << 10 | g << 5 | b.
+ */
+static void ditherRow(const uint8_t *src, int width, int y, uint16_t *codes) {
+    const int shift = 8 - GIF_CODE_BITS;
+    const uint8_t *thresholds = bayer[y & 7];
+    int x = 0;
+#ifdef __SSE2__
+    //8 pixels a step: the thresholds of x % 8 in 0..3, then in 4..7
+    uint8_t lanes[32];
+    for (int i = 0; i < 8; i++)
+        memset(lanes + 4 * i, thresholds[i] >> (6 - shift), 4);
+    const __m128i bias0 = _mm_loadu_si128((const __m128i *) lanes), bias1 = _mm_loadu_si128((const __m128i *) (lanes + 16));
+    const __m128i bits = _mm_set1_epi8((char) ((1 << GIF_CODE_BITS) - 1));
+    const __m128i blue = _mm_set1_epi32(0x1f), green = _mm_set1_epi32(0x3e0), red = _mm_set1_epi32(0x7c00);
+    for (; x + 8 <= width; x += 8) {
+        __m128i p0 = _mm_adds_epu8(_mm_loadu_si128((const __m128i *) (src + 4 * x)), bias0);
+        __m128i p1 = _mm_adds_epu8(_mm_loadu_si128((const __m128i *) (src + 4 * x + 16)), bias1);
+        //b, g, r in bits 0, 8 and 16 of each pixel, then gathered in 15 bits
+        p0 = _mm_and_si128(_mm_srli_epi16(p0, shift), bits);
+        p1 = _mm_and_si128(_mm_srli_epi16(p1, shift), bits);
+        __m128i c0 = _mm_or_si128(_mm_or_si128(_mm_and_si128(p0, blue), _mm_and_si128(_mm_srli_epi32(p0, 3), green)),
+                                  _mm_and_si128(_mm_srli_epi32(p0, 6), red));
+        __m128i c1 = _mm_or_si128(_mm_or_si128(_mm_and_si128(p1, blue), _mm_and_si128(_mm_srli_epi32(p1, 3), green)),
+                                  _mm_and_si128(_mm_srli_epi32(p1, 6), red));
+        //the codes are below 1 << 15: the signed saturation leaves them as they are
+        _mm_storeu_si128((__m128i *) (codes + x), _mm_packs_epi32(c0, c1));
+    }
+#endif
+    for (; x < width; x++) {
+        int bias = thresholds[x & 7] >> (6 - shift);
+        const uint8_t *p = src + 4 * x;
+        int b = FFMIN(p[0] + bias, 255) >> shift, g = FFMIN(p[1] + bias, 255) >> shift, r = FFMIN(p[2] + bias, 255) >> shift;
+        codes[x] = (uint16_t) (r << (2 * GIF_CODE_BITS) | g << GIF_CODE_BITS | b);
+    }
+}
+
+SRGifExport::SRGifExport(int fps, int width): fps(fps > 0 ? fps : GIF_FPS), maxWidth(width > 0 ? width : GIF_WIDTH),
+                                              in(nullptr), decoder(nullptr), videoIndex(-1), width(0), height(0),
+                                              palette(), colors(0), counters() {}
+
+SRGifExport::~SRGifExport() {
+    closeAll();
+}
+
+void SRGifExport::closeAll() {
+    for (SwsContext *&scaler : scalers)
+        sws_freeContext(scaler);
+    scalers.clear();
+    avcodec_free_context(&decoder);
+    avformat_close_input(&in);
+}
+
+/**
+ * openInput() opens the recording and its decoder, threaded, and seeks to the keyframe at or before start
+ */
+int SRGifExport::openInput(const char *input, int64_t start, int64_t &startTs) {
+    int ret = avformat_open_input(&in, input, nullptr, nullptr);
+    if (ret < 0 || (ret = avformat_find_stream_info(in, nullptr)) < 0) {
+        cout << "\n[SRGifExport] cannot read " << input;
+        return ret;
+    }
+    videoIndex = av_find_best_stream(in, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (videoIndex < 0) {
+        cout << "\n[SRGifExport] no video in " << input;
+        return videoIndex;
+    }
+    AVStream *st = in->streams[videoIndex];
+    const AVCodec *codec = avcodec_find_decoder(st->codecpar->codec_id);
+    decoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+    ret = decoder ? avcodec_parameters_to_context(decoder, st->codecpar) : AVERROR_DECODER_NOT_FOUND;
+    if (ret >= 0) {
+        decoder->thread_count = 0;
+        ret = avcodec_open2(decoder, codec, nullptr);
+    }
+    if (ret < 0) {
+        cout << "\n[SRGifExport] cannot decode the video of " << input;
+        return ret;
+    }
+    for (int i = 0; i < (int) in->nb_streams; i++)
+        if (i != videoIndex)
+            in->streams[i]->discard = AVDISCARD_ALL;
+    int64_t first = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    startTs = first + av_rescale_q(start, AV_TIME_BASE_Q, st->time_base);
+    if ((ret = avformat_seek_file(in, videoIndex, INT64_MIN, startTs, startTs, 0)) < 0) {
+        cout << "\n[SRGifExport] cannot seek " << input;
+        return ret;
+    }
+
+    //even sizes, the width of the export at most
+    width = FFMIN(decoder->width, maxWidth) & ~1;
+    height = (int) av_rescale(decoder->height, width, FFMAX(decoder->width, 1)) & ~1;
+    if (width <= 0 || height <= 0)
+        return AVERROR_INVALIDDATA;
+    int slots = pool->size();
+    scalers.assign(slots, nullptr);
+    scaled.assign(slots, std::vector<uint8_t>((size_t) width * height * 4));
+    histograms.assign(slots, std::vector<uint32_t>(GIF_CODES, 0));
+    return 0;
+}
+
+/**
+ * convert() scales and dithers the frames of batch on the pool, one a worker, and keeps those that differ from the
+ * frame before them; the frames of batch are freed
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int SRGifExport::convert(std::vector<AVFrame*> &batch, std::vector<int64_t> &times) {
+    int count = (int) batch.size();
+    std::vector<Picture> converted(count);
+    std::vector<int> results(count, 0);
+    pool->parallelFor(count, [&](int k) {
+        const AVFrame *frame = batch[k];
+        scalers[k] = sws_getCachedContext(scalers[k], frame->width, frame->height, (enum AVPixelFormat) frame->format,
+                                          width, height, AV_PIX_FMT_BGR0, SWS_BILINEAR, nullptr, nullptr, nullptr);
+        if (!scalers[k]) {
+            results[k] = AVERROR(EINVAL);
+            return;
+        }
+        uint8_t *dst[4] = {scaled[k].data()};
+        int linesize[4] = {width * 4};
+        sws_scale(scalers[k], frame->data, frame->linesize, 0, frame->height, dst, linesize);
+        converted[k].time = times[k];
+        converted[k].codes.resize((size_t) width * height);
+        uint16_t *codes = converted[k].codes.data();
+        uint32_t *histogram = histograms[k].data();
+        for (int y = 0; y < height; y++) {
+            ditherRow(scaled[k].data() + (size_t) y * width * 4, width, y, codes + (size_t) y * width);
+            for (int x = 0; x < width; x++)
+                histogram[codes[(size_t) y * width + x]]++;
+        }
+    });
+    for (AVFrame *&frame : batch)
+        av_frame_free(&frame);
+    batch.clear();
+    times.clear();
+
+    for (int k = 0; k < count; k++) {
+        if (results[k] < 0)
+            return results[k];
+        if (!pictures.empty() && pictures.back().codes == converted[k].codes)
+            continue;
+        if ((int64_t) (pictures.size() + 1) * width * height * 2 > GIF_MEMORY) {
+            cout << "\n[SRGifExport] more than " << (GIF_MEMORY >> 20) << " MiB of frames, export a shorter range, "
+                 << "a lower rate or a smaller width";
+            return AVERROR(ENOMEM);
+        }
+        pictures.push_back(std::move(converted[k]));
+    }
+    return 0;
+}
+
+/**
+ * buildPalette() splits the codes of the merged histograms by median cut, GIF_COLORS boxes at most, each box
+ * giving its mean color, then maps every code to its nearest color in lookup
+ */
+void SRGifExport::buildPalette() {
+    const int side = 1 << GIF_CODE_BITS;
+    std::vector<uint32_t> histogram(GIF_CODES, 0);
+    for (const std::vector<uint32_t> &h : histograms)
+        for (int c = 0; c < GIF_CODES; c++)
+            histogram[c] += h[c];
+    auto at = [&](const int *p) { return histogram[p[0] << (2 * GIF_CODE_BITS) | p[1] << GIF_CODE_BITS | p[2]]; };
+
+    struct Box {
+        int lo[3], hi[3];   //r, g, b codes, inclusive
+        uint64_t count;
+    };
+    //shrink() fits a box to the codes it holds
+    auto shrink = [&](Box &box) {
+        int lo[3] = {side, side, side}, hi[3] = {-1, -1, -1}, p[3];
+        box.count = 0;
+        for (p[0] = box.lo[0]; p[0] <= box.hi[0]; p[0]++)
+            for (p[1] = box.lo[1]; p[1] <= box.hi[1]; p[1]++)
+                for (p[2] = box.lo[2]; p[2] <= box.hi[2]; p[2]++) {
+                    uint32_t n = at(p);
+                    if (!n)
+                        continue;
+                    box.count += n;
+                    for (int a = 0; a < 3; a++) {
+                        lo[a] = FFMIN(lo[a], p[a]);
+                        hi[a] = FFMAX(hi[a], p[a]);
+                    }
+                }
+        if (box.count)
+            for (int a = 0; a < 3; a++)
+                box.lo[a] = lo[a], box.hi[a] = hi[a];
+    };
+    std::vector<Box> boxes(1, {{0, 0, 0}, {side - 1, side - 1, side - 1}, 0});
+    shrink(boxes[0]);
+    if (!boxes[0].count)
+        boxes.clear();
+    while ((int) boxes.size() < GIF_COLORS) {
+        //the box with the most pixels over the longest side goes first
+        int best = -1, axis = 0;
+        uint64_t score = 0;
+        for (int i = 0; i < (int) boxes.size(); i++)
+            for (int a = 0; a < 3; a++) {
+                uint64_t s = boxes[i].count * (uint64_t) (boxes[i].hi[a] - boxes[i].lo[a]);
+                if (s > score)
+                    score = s, best = i, axis = a;
+            }
+        if (best < 0)
+            break;
+        Box &box = boxes[best];
+        //the weighted median along the axis
+        std::vector<uint64_t> plane(side, 0);
+        int p[3];
+        for (p[0] = box.lo[0]; p[0] <= box.hi[0]; p[0]++)
+            for (p[1] = box.lo[1]; p[1] <= box.hi[1]; p[1]++)
+                for (p[2] = box.lo[2]; p[2] <= box.hi[2]; p[2]++)
+                    plane[p[axis]] += at(p);
+        uint64_t below = 0;
+        int cut = box.lo[axis];
+        while (cut < box.hi[axis] - 1 && (below + plane[cut]) * 2 < box.count)
+            below += plane[cut++];
+        Box upper = box;
+        box.hi[axis] = cut;
+        upper.lo[axis] = cut + 1;
+        shrink(box);
+        shrink(upper);
+        boxes.push_back(upper);
+    }
+
+    colors = 0;
+    for (const Box &box : boxes) {
+        uint64_t sum[3] = {0, 0, 0};
+        int p[3];
+        for (p[0] = box.lo[0]; p[0] <= box.hi[0]; p[0]++)
+            for (p[1] = box.lo[1]; p[1] <= box.hi[1]; p[1]++)
+                for (p[2] = box.lo[2]; p[2] <= box.hi[2]; p[2]++)
+                    for (int a = 0; a < 3; a++)
+                        sum[a] += (uint64_t) at(p) * GIF_LEVEL(p[a]);
+        uint32_t rgb = 0;
+        for (int a = 0; a < 3; a++)
+            rgb = rgb << 8 | (uint32_t) ((sum[a] + box.count / 2) / FFMAX(box.count, (uint64_t) 1));
+        palette[colors++] = 0xff000000 | rgb;
+    }
+    for (int i = colors; i < 256; i++)
+        palette[i] = 0;
+    //the entry the encoder finds transparent, for the unchanged pixels of a rectangle
+    palette[GIF_COLORS] = 0;
+    counters.colors = colors;
+
+    lookup.assign(GIF_CODES, 0);
+    const int chunk = 1024;
+    pool->parallelFor(GIF_CODES / chunk, [&](int block) {
+        for (int c = block * chunk; c < (block + 1) * chunk; c++) {
+            int r = GIF_LEVEL(c >> (2 * GIF_CODE_BITS)), g = GIF_LEVEL((c >> GIF_CODE_BITS) & (side - 1));
+            int b = GIF_LEVEL(c & (side - 1));
+            int nearest = 0, distance = INT32_MAX;
+            for (int i = 0; i < colors; i++) {
+                int dr = r - (int) (palette[i] >> 16 & 0xff), dg = g - (int) (palette[i] >> 8 & 0xff);
+                int db = b - (int) (palette[i] & 0xff);
+                int d = dr * dr + dg * dg + db * db;
+                if (d < distance)
+                    distance = d, nearest = i;
+            }
+            lookup[c] = (uint8_t) nearest;
+        }
+    });
+}
+
+/**
+ * encode() writes the kept frames with the palette, each one shown until the next and the last one until duration
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int SRGifExport::encode(const char *output, int64_t duration) {
+    AVFormatContext *out = nullptr;
+    AVCodecContext *encoder = nullptr;
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *pkt = av_packet_alloc();
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_GIF);
+    int ret = frame && pkt ? 0 : AVERROR(ENOMEM);
+    if (ret >= 0 && !codec)
+        ret = AVERROR_ENCODER_NOT_FOUND;
+    if (ret >= 0 && (ret = avformat_alloc_output_context2(&out, nullptr, "gif", output)) >= 0) {
+        encoder = avcodec_alloc_context3(codec);
+        AVStream *st = avformat_new_stream(out, nullptr);
+        if (!encoder || !st)
+            ret = AVERROR(ENOMEM);
+    }
+    if (ret >= 0) {
+        encoder->width = width;
+        encoder->height = height;
+        encoder->pix_fmt = AV_PIX_FMT_PAL8;
+        //the delays of a GIF are in centiseconds
+        encoder->time_base = {1, 100};
+        if (out->oformat->flags & AVFMT_GLOBALHEADER)
+            encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        AVDictionary *options = nullptr;
+        av_dict_set(&options, "gifflags", "+offsetting+transdiff", 0);
+        ret = avcodec_open2(encoder, codec, &options);
+        av_dict_free(&options);
+    }
+    if (ret >= 0 && (ret = avcodec_parameters_from_context(out->streams[0]->codecpar, encoder)) >= 0) {
+        out->streams[0]->time_base = encoder->time_base;
+        if (!(out->oformat->flags & AVFMT_NOFILE))
+            ret = avio_open2(&out->pb, output, AVIO_FLAG_WRITE, nullptr, nullptr);
+    }
+    if (ret >= 0) {
+        //the loop option of the muxer is 0: the animation repeats forever
+        ret = avformat_write_header(out, nullptr);
+    }
+    if (ret >= 0) {
+        frame->format = AV_PIX_FMT_PAL8;
+        frame->width = width;
+        frame->height = height;
+        ret = av_frame_get_buffer(frame, 32);
+    }
+
+    int64_t last = -1;
+    std::vector<int64_t> shown(pictures.size());
+    for (size_t i = 0; i < pictures.size(); i++)
+        shown[i] = last = FFMAX((pictures[i].time + 5000) / 10000, last + 1);
+    int64_t end = FFMAX((duration + 5000) / 10000, last + 1);
+    auto drain = [&]() {
+        int r;
+        while ((r = avcodec_receive_packet(encoder, pkt)) >= 0) {
+            //the packets come in the order of the frames, a frame each
+            size_t i = FFMIN((size_t) counters.keptFrames, pictures.size() - 1);
+            pkt->duration = (i + 1 < shown.size() ? shown[i + 1] : end) - shown[i];
+            pkt->stream_index = 0;
+            av_packet_rescale_ts(pkt, encoder->time_base, out->streams[0]->time_base);
+            counters.keptFrames++;
+            if ((r = av_interleaved_write_frame(out, pkt)) < 0)
+                return r;
+        }
+        return r == AVERROR(EAGAIN) || r == AVERROR_EOF ? 0 : r;
+    };
+    for (size_t i = 0; i < pictures.size() && ret >= 0; i++) {
+        if ((ret = av_frame_make_writable(frame)) < 0)
+            break;
+        memcpy(frame->data[1], palette, sizeof(palette));
+        const uint16_t *codes = pictures[i].codes.data();
+        const int bands = pool->size();
+        pool->parallelFor(bands, [&](int band) {
+            for (int y = height * band / bands; y < height * (band + 1) / bands; y++) {
+                uint8_t *row = frame->data[0] + (size_t) y * frame->linesize[0];
+                const uint16_t *src = codes + (size_t) y * width;
+                for (int x = 0; x < width; x++)
+                    row[x] = lookup[src[x]];
+            }
+        });
+        //what the frame held is in the encoder now, the memory goes back as the export goes
+        std::vector<uint16_t>().swap(pictures[i].codes);
+        frame->pts = shown[i];
+        if ((ret = avcodec_send_frame(encoder, frame)) >= 0)
+            ret = drain();
+    }
+    if (ret >= 0 && (ret = avcodec_send_frame(encoder, nullptr)) >= 0)
+        ret = drain();
+    if (ret >= 0)
+        ret = av_write_trailer(out);
+    if (out && out->pb)
+        counters.bytes = avio_size(out->pb);
+    if (out && !(out->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&out->pb);
+    avformat_free_context(out);
+    avcodec_free_context(&encoder);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    return ret;
+}
+
+int SRGifExport::run(const char *input, int64_t start, int64_t end, const char *output) {
+    if (start < 0 || end <= start) {
+        cout << "\n[SRGifExport] empty range";
+        return AVERROR(EINVAL);
+    }
+    closeAll();
+    counters = SRGifStats();
+    pictures.clear();
+    if (!pool)
+        pool.reset(new SRTaskPool());
+    int64_t begin = av_gettime(), startTs = 0;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int ret = pkt && frame ? openInput(input, start, startTs) : AVERROR(ENOMEM);
+
+    //the frames are taken a batch at a time, one for each worker
+    std::vector<AVFrame*> batch;
+    std::vector<int64_t> times;
+    int64_t slot = -1, duration = end == INT64_MAX ? 0 : end - start, lastTime = 0;
+    bool draining = false, past = false;
+    while (ret >= 0 && !past) {
+        if (!draining) {
+            ret = av_read_frame(in, pkt);
+            if (ret == AVERROR_EOF || (ret < 0 && avio_feof(in->pb))) {
+                draining = true;
+                ret = avcodec_send_packet(decoder, nullptr);
+            } else if (ret >= 0) {
+                ret = pkt->stream_index == videoIndex ? avcodec_send_packet(decoder, pkt) : 0;
+                av_packet_unref(pkt);
+            }
+            if (ret == AVERROR_INVALIDDATA)
+                ret = 0;
+            if (ret < 0)
+                break;
+        }
+        while (ret >= 0 && (ret = avcodec_receive_frame(decoder, frame)) >= 0) {
+            AVStream *st = in->streams[videoIndex];
+            int64_t pts = frame->best_effort_timestamp;
+            int64_t time = pts == AV_NOPTS_VALUE ? lastTime : av_rescale_q(pts - startTs, st->time_base, AV_TIME_BASE_Q);
+            counters.decodedFrames++;
+            if (end != INT64_MAX && time >= end - start) {
+                past = true;
+                av_frame_unref(frame);
+                break;
+            }
+            //the frames before the start decode the GOP it is in, one frame a slot of the export rate
+            int64_t n = time * fps / 1000000;
+            if (time < 0 || n <= slot) {
+                av_frame_unref(frame);
+                continue;
+            }
+            slot = n;
+            lastTime = time;
+            counters.sampledFrames++;
+            AVFrame *held = av_frame_clone(frame);
+            av_frame_unref(frame);
+            if (!held) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            batch.push_back(held);
+            times.push_back(time);
+            if ((int) batch.size() == pool->size())
+                ret = convert(batch, times);
+        }
+        if (ret == AVERROR(EAGAIN))
+            ret = 0;
+        else if (ret == AVERROR_EOF)
+            break;
+    }
+    if (ret == AVERROR_EOF)
+        ret = 0;
+    if (ret >= 0 && !batch.empty())
+        ret = convert(batch, times);
+    for (AVFrame *&held : batch)
+        av_frame_free(&held);
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    if (ret >= 0 && pictures.empty()) {
+        cout << "\n[SRGifExport] no frame in the range";
+        ret = AVERROR(EINVAL);
+    }
+    if (!duration)
+        duration = lastTime + 1000000 / fps;
+    int64_t decoded = av_gettime();
+    counters.decodeTime = decoded - begin;
+
+    if (ret >= 0) {
+        buildPalette();
+        counters.paletteTime = av_gettime() - decoded;
+        int64_t paletted = av_gettime();
+        ret = encode(output, duration);
+        counters.encodeTime = av_gettime() - paletted;
+    }
+    closeAll();
+    pictures.clear();
+    flushLog();
+
+    if (ret < 0) {
+        cout << "\n[SRGifExport] exporting " << output << " failed";
+        remove(output);
+        return ret;
+    }
+    cout << "\n[SRGifExport] " << output << ": " << counters.keptFrames << " of " << counters.sampledFrames
+         << " frames changed, " << counters.colors << " colors, " << counters.bytes / 1024 << " KiB in "
+         << (av_gettime() - begin) / 1000 << " ms (decode " << counters.decodeTime / 1000 << ", palette "
+         << counters.paletteTime / 1000 << ", encode " << counters.encodeTime / 1000 << ")";
+    return 0;
+}
@@ -0,0 +1,109 @@
+//
+// Animated GIF export of a range of a recording: one global palette, ordered dithering, only the changed rectangles.
+//
+
+#ifndef CPPSCREENRECORDER_SRGIFEXPORT_H
+#define CPPSCREENRECORDER_SRGIFEXPORT_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "SRTaskPool.h"
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+struct SwsContext;
+
+#define GIF_FPS 15      //frames a second of the export, a bug report needs no more
+#define GIF_WIDTH 960   //px of the widest export, larger recordings are scaled down
+#define GIF_MEMORY (1LL << 30)  //bytes of the frames held between the decode and the encode
+#define GIF_COLORS 255  //colors of the palette, the last entry is the transparency of the unchanged pixels
+#define GIF_CODE_BITS 5 //bits of each component the frames are dithered to before the palette lookup
+
+/**
+ * Statistics of an SRGifExport::run(): the frames decoded in the range, the ones sampled at the export rate and the
+ * ones kept, a sampled frame identical to the previous one only lengthening it; the colors of the palette and the
+ * time each pass took.
+ */
+typedef struct GF{
+    uint64_t decodedFrames;
+    uint64_t sampledFrames;
+    uint64_t keptFrames;
+    int colors;
+    int64_t bytes;
+    int64_t decodeTime;     //us to decode, scale and dither
+    int64_t paletteTime;
+    int64_t encodeTime;
+}SRGifStats;
+
+/**
+ * SRGifExport turns [start, end) of a recording into an animated GIF for a bug report, in a fraction of what the
+ * palettegen and paletteuse filters and the ELBG quantizer of libavcodec need:\n
+ * - the decoded frames are sampled at the export rate, scaled and ordered dithered (8x8 Bayer, SSE2 where
+ * available) to GIF_CODE_BITS bits a component on the workers of an SRTaskPool, a frame each; a frame identical to
+ * the previous one is dropped, the previous one shows longer\n
+ * - one global palette comes from the histogram of every kept frame, by median cut over the 15 bit codes, and a
+ * table maps each code to its nearest entry: a pixel costs one lookup\n
+ * - the GIF encoder of libavcodec writes each frame cropped to what changed since the previous one, with the
+ * unchanged pixels inside the rectangle transparent\n
+ * A screen recording changes little from frame to frame: a 30 s export holds a few changed rectangles a second.
+ *
+ * @Note the frames are held between the passes, 2 bytes per pixel, GIF_MEMORY at most
+ */
+class SRGifExport {
+
+private:
+    struct Picture {
+        int64_t time;   //us from start
+        std::vector<uint16_t> codes;
+    };
+
+    int fps;
+    int maxWidth;
+    std::unique_ptr<SRTaskPool> pool;
+    AVFormatContext *in;
+    AVCodecContext *decoder;
+    int videoIndex;
+    int width, height;
+    std::vector<SwsContext*> scalers;  //one per frame of a batch
+    std::vector<std::vector<uint8_t>> scaled;
+    std::vector<std::vector<uint32_t>> histograms;
+    std::vector<Picture> pictures;
+    uint32_t palette[256];
+    int colors;
+    std::vector<uint8_t> lookup;
+    SRGifStats counters;
+
+    int openInput(const char *input, int64_t start, int64_t &startTs);
+    int convert(std::vector<AVFrame*> &batch, std::vector<int64_t> &times);
+    void buildPalette();
+    int encode(const char *output, int64_t duration);
+    void closeAll();
+
+public:
+    /**
+     * @param fps frames a second of the export, GIF_FPS for 0
+     * @param width px of the widest export, GIF_WIDTH for 0
+     */
+    explicit SRGifExport(int fps = GIF_FPS, int width = GIF_WIDTH);
+    ~SRGifExport();
+
+    SRGifExport(const SRGifExport&) = delete;
+    SRGifExport &operator=(const SRGifExport&) = delete;
+
+    /**
+     * run() exports [start, end) of the video of input into the GIF output, output is removed when the export fails
+     * @param start us from the beginning of the recording
+     * @param end us, INT64_MAX to the end of the recording
+     * @return 0 on success, a negative AVERROR code otherwise
+     */
+    int run(const char *input, int64_t start, int64_t end, const char *output);
+
+    SRGifStats stats() const { return counters; }
+};
+
+#endif //CPPSCREENRECORDER_SRGIFEXPORT_H
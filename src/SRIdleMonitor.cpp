@@ -0,0 +1,115 @@
+//
+// Time since the last keyboard or pointer input of the desktop, the capture rate of settings._idlerate follows it.
+//
+
+#include "SRIdleMonitor.h"
+#include "SRLog.h"
+
+#include <string>
+
+#if defined(__unix__)
+#include <X11/Xlib.h>
+#include <X11/extensions/scrnsaver.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <CoreGraphics/CoreGraphics.h>
+#endif
+
+extern "C"
+{
+#include "libavutil/error.h"
+}
+
+#if defined(__unix__)
+struct SRIdleMonitor::Source {
+    Display *display;
+    XScreenSaverInfo *info;
+};
+#else
+struct SRIdleMonitor::Source {};
+#endif
+
+SRIdleMonitor::SRIdleMonitor(): source(nullptr), idle(0), lastQuery(INT64_MIN), lastFrame(INT64_MIN), step(0),
+                                skipped(0) {}
+
+SRIdleMonitor::~SRIdleMonitor() {
+    if (!source)
+        return;
+#if defined(__unix__)
+    XFree(source->info);
+    XCloseDisplay(source->display);
+#endif
+    delete source;
+}
+
+int SRIdleMonitor::open(const char *display) {
+#if defined(__unix__)
+    std::string name(display ? display : "");
+    Display *connection = XOpenDisplay(name.substr(0, name.find('+')).c_str());
+    if (!connection) {
+        srLog(SR_LOG_ERROR, "[SRIdleMonitor] cannot open display %s", name.c_str());
+        return AVERROR(EIO);
+    }
+    int event, error;
+    XScreenSaverInfo *info = nullptr;
+    if (!XScreenSaverQueryExtension(connection, &event, &error) || !(info = XScreenSaverAllocInfo())) {
+        srLog(SR_LOG_ERROR, "[SRIdleMonitor] the display has no MIT-SCREEN-SAVER extension");
+        XCloseDisplay(connection);
+        return AVERROR(ENOSYS);
+    }
+    source = new Source{connection, info};
+    return 0;
+#elif defined(_WIN32) || defined(__APPLE__)
+    (void) display;
+    source = new Source();
+    return 0;
+#else
+    (void) display;
+    return AVERROR(ENOSYS);
+#endif
+}
+
+void SRIdleMonitor::query(int64_t now) {
+    lastQuery = now;
+#if defined(__unix__)
+    //a round trip to the server, the reason of IDLE_POLL
+    if (!XScreenSaverQueryInfo(source->display, DefaultRootWindow(source->display), source->info)) {
+        idle = 0;
+        return;
+    }
+    idle = (int64_t) source->info->idle;
+#elif defined(_WIN32)
+    LASTINPUTINFO info = {sizeof(info), 0};
+    //tick counts of 32 bits: the difference holds across their wrap
+    idle = GetLastInputInfo(&info) ? (int64_t) (DWORD) (GetTickCount() - info.dwTime) : 0;
+#elif defined(__APPLE__)
+    idle = (int64_t) (CGEventSourceSecondsSinceLastEventType(kCGEventSourceStateCombinedSessionState,
+                                                             kCGAnyInputEventType) * 1000);
+#endif
+}
+
+bool SRIdleMonitor::due(int64_t now, int64_t interval) {
+    if (!source)
+        return true;
+    if (lastQuery == INT64_MIN || now - lastQuery >= (int64_t) IDLE_POLL * 1000)
+        query(now);
+    int target = idle >= (int64_t) IDLE_DELAY_LOWEST * 1000 ? 2 : idle >= (int64_t) IDLE_DELAY_LOW * 1000 ? 1 : 0;
+    if (target != step) {
+        if (target)
+            srLog(SR_LOG_INFO, "[SRIdleMonitor] no input for %d s, capturing at %d fps", (int) (idle / 1000),
+                  target == 2 ? IDLE_FPS_LOWEST : IDLE_FPS_LOW);
+        else
+            srLog(SR_LOG_INFO, "[SRIdleMonitor] input, back to the full rate, %llu frames left out so far",
+                  (unsigned long long) skipped);
+        step = target;
+    }
+    int64_t period = step == 2 ? 1000000 / IDLE_FPS_LOWEST : step == 1 ? 1000000 / IDLE_FPS_LOW : 0;
+    //half a tick early rather than a whole one late: the ticks rarely fall on the idle period
+    if (period <= interval || lastFrame == INT64_MIN || now - lastFrame >= period - interval / 2) {
+        lastFrame = now;
+        return true;
+    }
+    skipped++;
+    return false;
+}
@@ -0,0 +1,70 @@
+//
+// Time since the last keyboard or pointer input of the desktop, the capture rate of settings._idlerate follows it.
+//
+
+#ifndef CPPSCREENRECORDER_SRIDLEMONITOR_H
+#define CPPSCREENRECORDER_SRIDLEMONITOR_H
+
+#include <cstdint>
+
+#define IDLE_POLL 50    //ms between two queries of the idle time, the longest a frame waits after an input
+#define IDLE_DELAY_LOW 10   //s without input before the capture drops to IDLE_FPS_LOW
+#define IDLE_FPS_LOW 5
+#define IDLE_DELAY_LOWEST 60    //s without input before it drops to IDLE_FPS_LOWEST
+#define IDLE_FPS_LOWEST 1
+
+/**
+ * SRIdleMonitor lowers the capture rate while nobody touches the desktop: a screen nobody types on or points at
+ * seldom changes in a way worth 30 frames a second. The rate steps down to IDLE_FPS_LOW after IDLE_DELAY_LOW s
+ * without input and to IDLE_FPS_LOWEST after IDLE_DELAY_LOWEST s, and is back to the full one at the first input.\n
+ * The idle time is the one of the desktop session: XScreenSaverQueryInfo() on an X display, GetLastInputInfo() on
+ * windows, the combined session event source on macOS. It is queried every IDLE_POLL ms at most.\n
+ * due() sits behind the capture clock rather than replacing it: the clock keeps its interval and its deadlines, the
+ * ticks between two idle frames are only left out. An input is seen on the next query and its tick is grabbed, so
+ * the full rate comes back within IDLE_POLL ms, on the phase of the frames before.
+ *
+ * @Note due() is meant for the VideoThread only
+ */
+class SRIdleMonitor {
+
+public:
+    struct Source;  //of the platform
+
+private:
+    Source *source;
+    int64_t idle;   //ms without input at the last query
+    int64_t lastQuery;  //us, SRFrameClock::now()
+    int64_t lastFrame;  //us of the last tick due
+    int step;   //0 full rate, 1 IDLE_FPS_LOW, 2 IDLE_FPS_LOWEST
+    uint64_t skipped;
+
+    void query(int64_t now);
+
+public:
+    SRIdleMonitor();
+    ~SRIdleMonitor();
+
+    SRIdleMonitor(const SRIdleMonitor&) = delete;
+    SRIdleMonitor &operator=(const SRIdleMonitor&) = delete;
+
+    /**
+     * @param display X display the idle time is read from ("host:0.0+x,y" is taken), the other platforms take
+     * the desktop session of the process
+     * @return 0 on success, a negative AVERROR if the platform or the display gives no idle time
+     */
+    int open(const char *display);
+
+    /**
+     * due() tells if the tick of the capture clock at now is grabbed
+     * @param now us, SRFrameClock::now() or a deadline of the clock
+     * @param interval us between two ticks, the full rate
+     * @return false for a tick left out while idle
+     */
+    bool due(int64_t now, int64_t interval);
+
+    int idleStep() const { return step; }
+    int64_t idleTime() const { return idle; }
+    uint64_t skippedFrames() const { return skipped; }
+};
+
+#endif //CPPSCREENRECORDER_SRIDLEMONITOR_H
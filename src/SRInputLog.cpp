@@ -0,0 +1,367 @@
+#include "SRInputLog.h"
+#include "SRLog.h"
+
+#include <cstring>
+
+extern "C"
+{
+#include "libavutil/avutil.h"
+#include "libavutil/common.h"
+#include "libavutil/error.h"
+#include "libavutil/time.h"
+}
+
+#ifdef __unix__
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include <poll.h>
+#endif
+
+#define INPUT_EVENT_MAX 31  //bytes an event takes at most: its kind and three 10-byte varints
+#define INPUT_POLL_TIMEOUT 100  //ms the reader waits for the display before it checks close() and the open block
+
+static void putVarint(std::vector<uint8_t> &out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((uint8_t) (v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t) v);
+}
+
+static void putSigned(std::vector<uint8_t> &out, int64_t v) {
+    putVarint(out, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+static bool getVarint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool getSigned(const uint8_t *&p, const uint8_t *end, int64_t &v) {
+    uint64_t u;
+    if (!getVarint(p, end, u))
+        return false;
+    v = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+    return true;
+}
+
+/* the block header size of the log in data, 0 if it is not one */
+static uint32_t blockSizeOf(const uint8_t *data, size_t size) {
+    SRInputLogHeader header;
+    if (size < sizeof(header))
+        return 0;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, INPUTLOG_MAGIC, 4) || header.blockSize < sizeof(SRInputBlock))
+        return 0;
+    return header.blockSize;
+}
+
+SRInputLog::SRInputLog(): file(nullptr), stopping(false), keycodes(false), block(), lastPts(0), blockWall(0), lastX(0),
+                          lastY(0), written(0), blocks(0), bytes(0) {
+}
+
+SRInputLog::~SRInputLog() {
+    close();
+}
+
+int SRInputLog::open(const char *path, const char *device, int x, int y, int width, int height,
+                     std::function<int64_t(int64_t)> stamp, bool keycodes) {
+#ifdef __unix__
+    std::string name(device ? device : "");
+    Display *display = XOpenDisplay(name.substr(0, name.find('+')).c_str());
+    if (!display) {
+        srLog(SR_LOG_ERROR, "[SRInputLog] cannot open display %s", name.c_str());
+        return AVERROR(EIO);
+    }
+    //raw events reach the root window whatever grabs the pointer since XInput 2.1
+    int opcode, event, error, major = 2, minor = 2;
+    if (!XQueryExtension(display, "XInputExtension", &opcode, &event, &error) ||
+        XIQueryVersion(display, &major, &minor) != Success || major * 10 + minor < 21) {
+        srLog(SR_LOG_ERROR, "[SRInputLog] the display has no XInput 2.1");
+        XCloseDisplay(display);
+        return AVERROR(ENOSYS);
+    }
+    file = fopen(path, "wb");
+    if (!file) {
+        int ret = AVERROR(errno);
+        srLog(SR_LOG_ERROR, "[SRInputLog] cannot create %s", path);
+        XCloseDisplay(display);
+        return ret;
+    }
+    SRInputLogHeader header = SRInputLogHeader();
+    memcpy(header.magic, INPUTLOG_MAGIC, 4);
+    header.version = INPUTLOG_VERSION;
+    header.blockSize = sizeof(SRInputBlock);
+    header.flags = keycodes ? INPUTLOG_KEYCODES : 0;
+    header.x = x;
+    header.y = y;
+    header.width = width;
+    header.height = height;
+    if (fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file)) {
+        srLog(SR_LOG_ERROR, "[SRInputLog] cannot write %s", path);
+        fclose(file);
+        file = nullptr;
+        XCloseDisplay(display);
+        return AVERROR(EIO);
+    }
+    this->path = path;
+    this->stamp = stamp;
+    this->keycodes = keycodes;
+    events.reserve(INPUT_BLOCK_BYTES);
+    written = blocks = 0;
+    bytes = sizeof(header);
+    stopping.store(false);
+    reader = std::thread(&SRInputLog::run, this, display, opcode);
+    return 0;
+#else
+    (void) path, (void) device, (void) x, (void) y, (void) width, (void) height, (void) stamp, (void) keycodes;
+    return AVERROR(ENOSYS);
+#endif
+}
+
+void SRInputLog::close() {
+    if (!file)
+        return;
+    stopping.store(true);
+    if (reader.joinable())
+        reader.join();
+    flush();
+    fclose(file);
+    file = nullptr;
+}
+
+#ifdef __unix__
+/**
+ * run() is the reader thread: it owns display and blocks in poll() on its connection.\n
+ * A raw motion only marks the pointer as moved, the position is asked for once the interval since the previous
+ * one has passed: a 1000 Hz mouse costs a round trip each INPUT_MOTION_INTERVAL ms, not one per report.
+ */
+void SRInputLog::run(Display *display, int opcode) {
+    Window root = DefaultRootWindow(display);
+    unsigned char bits[XIMaskLen(XI_LASTEVENT)] = {0};
+    XISetMask(bits, XI_RawKeyPress);
+    XISetMask(bits, XI_RawKeyRelease);
+    XISetMask(bits, XI_RawButtonPress);
+    XISetMask(bits, XI_RawButtonRelease);
+    XISetMask(bits, XI_RawMotion);
+    XIEventMask mask;
+    mask.deviceid = XIAllMasterDevices;
+    mask.mask_len = sizeof(bits);
+    mask.mask = bits;
+    XISelectEvents(display, root, &mask, 1);
+    XFlush(display);
+
+    //the position the first block starts from
+    Window rootReturn, child;
+    int rootX = 0, rootY = 0, winX, winY;
+    unsigned int buttons;
+    if (XQueryPointer(display, root, &rootReturn, &child, &rootX, &rootY, &winX, &winY, &buttons))
+        lastX = rootX, lastY = rootY;
+    //the moves the pointer made since the last motion written, before an event that depends on its position
+    auto pointer = [&](int64_t wall) {
+        if (XQueryPointer(display, root, &rootReturn, &child, &rootX, &rootY, &winX, &winY, &buttons) &&
+            (rootX != lastX || rootY != lastY))
+            add(SR_INPUT_MOTION, wall, rootX, rootY, 0);
+    };
+
+    struct pollfd fd;
+    fd.fd = ConnectionNumber(display);
+    fd.events = POLLIN;
+    bool moved = false;
+    int64_t lastMotion = 0;
+    while (!stopping.load()) {
+        while (XPending(display)) {
+            XEvent event;
+            XNextEvent(display, &event);
+            XGenericEventCookie *cookie = &event.xcookie;
+            if (cookie->type != GenericEvent || cookie->extension != opcode || !XGetEventData(display, cookie))
+                continue;
+            const XIRawEvent *raw = (const XIRawEvent *) cookie->data;
+            int64_t wall = av_gettime();
+            int detail = raw->detail;
+            switch (cookie->evtype) {
+                case XI_RawMotion:
+                    moved = true;
+                    break;
+                case XI_RawButtonPress:
+                case XI_RawButtonRelease:
+                    pointer(wall);
+                    if (detail >= 4 && detail <= 7) {
+                        //the wheel clicks of X: 4 up, 5 down, 6 left, 7 right, their release says nothing more
+                        if (cookie->evtype == XI_RawButtonPress)
+                            add(SR_INPUT_SCROLL, wall, lastX, lastY, detail <= 5 ? (detail == 4 ? -1 : 1) : (detail == 6 ? -2 : 2));
+                    } else
+                        add(cookie->evtype == XI_RawButtonPress ? SR_INPUT_BUTTON_DOWN : SR_INPUT_BUTTON_UP, wall, lastX,
+                            lastY, detail);
+                    break;
+                case XI_RawKeyPress:
+                case XI_RawKeyRelease:
+                    add(cookie->evtype == XI_RawKeyPress ? SR_INPUT_KEY_DOWN : SR_INPUT_KEY_UP, wall, lastX, lastY,
+                        keycodes ? detail : 0);
+                    break;
+                default:
+                    break;
+            }
+            XFreeEventData(display, cookie);
+        }
+        int64_t now = av_gettime();
+        if (moved && now - lastMotion >= INPUT_MOTION_INTERVAL * 1000) {
+            pointer(now);
+            moved = false;
+            lastMotion = now;
+        }
+        if (!events.empty() && now - blockWall >= (int64_t) INPUT_BLOCK_DURATION * 1000)
+            flush();
+        int timeout = INPUT_POLL_TIMEOUT;
+        if (moved)
+            timeout = (int) FFMAX(1, (lastMotion + INPUT_MOTION_INTERVAL * 1000 - now) / 1000);
+        poll(&fd, 1, timeout);
+    }
+    XCloseDisplay(display);
+}
+#endif
+
+void SRInputLog::add(int kind, int64_t wall, int32_t x, int32_t y, int32_t code) {
+    int64_t pts = stamp ? stamp(wall) : wall;
+    if (pts == AV_NOPTS_VALUE) {
+        //paused: the block ends, the next one starts from where the pointer went meanwhile
+        flush();
+        if (kind == SR_INPUT_MOTION)
+            lastX = x, lastY = y;
+        return;
+    }
+    if (!events.empty() && (events.size() + INPUT_EVENT_MAX > INPUT_BLOCK_BYTES ||
+                            wall - blockWall >= INPUT_BLOCK_DURATION * 1000))
+        flush();
+    if (events.empty()) {
+        block.pts = pts;
+        block.x = lastX;
+        block.y = lastY;
+        block.count = 0;
+        lastPts = pts;
+        blockWall = wall;
+    }
+    //the clock only moves forward inside a block: a step back is written as a 0 us gap
+    pts = FFMAX(pts, lastPts);
+    events.push_back((uint8_t) kind);
+    putVarint(events, (uint64_t) (pts - lastPts));
+    switch (kind) {
+        case SR_INPUT_MOTION:
+            putSigned(events, x - lastX);
+            putSigned(events, y - lastY);
+            lastX = x;
+            lastY = y;
+            break;
+        case SR_INPUT_BUTTON_DOWN:
+        case SR_INPUT_BUTTON_UP:
+            events.push_back((uint8_t) code);
+            break;
+        case SR_INPUT_SCROLL:
+            putSigned(events, code);
+            break;
+        default:
+            putVarint(events, (uint32_t) code);
+            break;
+    }
+    lastPts = pts;
+    block.count++;
+    written++;
+}
+
+/**
+ * flush() appends the open block, flushed to the kernel: a crash loses INPUT_BLOCK_DURATION ms of events at most
+ */
+void SRInputLog::flush() {
+    if (events.empty() || !file)
+        return;
+    block.size = (uint32_t) events.size();
+    if (fwrite(&block, sizeof(block), 1, file) != 1 || fwrite(events.data(), events.size(), 1, file) != 1 ||
+        fflush(file))
+        srLog(SR_LOG_WARNING, "[SRInputLog] cannot write %s", path.c_str());
+    bytes += sizeof(block) + events.size();
+    blocks++;
+    events.clear();
+}
+
+size_t SRInputLog::find(const void *data, size_t size, int64_t pts) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    uint32_t blockSize = blockSizeOf(bytes, size);
+    if (!blockSize)
+        return 0;
+    size_t found = 0;
+    for (size_t offset = sizeof(SRInputLogHeader); offset + blockSize <= size;) {
+        SRInputBlock block;
+        memcpy(&block, bytes + offset, sizeof(block));
+        if (offset + blockSize + block.size > size)
+            break;
+        if (block.pts > pts && found)
+            break;
+        found = offset;
+        if (block.pts > pts)
+            break;
+        offset += blockSize + block.size;
+    }
+    return found;
+}
+
+size_t SRInputLog::decode(const void *data, size_t size, size_t offset, std::vector<SRInputEvent> &events) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    uint32_t blockSize = blockSizeOf(bytes, size);
+    if (!blockSize || offset < sizeof(SRInputLogHeader) || offset + blockSize > size)
+        return 0;
+    SRInputBlock block;
+    memcpy(&block, bytes + offset, sizeof(block));
+    if (offset + blockSize + block.size > size)
+        return 0;
+    const uint8_t *p = bytes + offset + blockSize, *end = p + block.size;
+    SRInputEvent event = SRInputEvent();
+    event.pts = block.pts;
+    event.x = block.x;
+    event.y = block.y;
+    for (uint32_t i = 0; i < block.count && p < end; i++) {
+        event.kind = *p++;
+        event.code = 0;
+        uint64_t dt, u;
+        int64_t dx, dy;
+        if (!getVarint(p, end, dt))
+            return 0;
+        event.pts += (int64_t) dt;
+        switch (event.kind) {
+            case SR_INPUT_MOTION:
+                if (!getSigned(p, end, dx) || !getSigned(p, end, dy))
+                    return 0;
+                event.x += (int32_t) dx;
+                event.y += (int32_t) dy;
+                break;
+            case SR_INPUT_BUTTON_DOWN:
+            case SR_INPUT_BUTTON_UP:
+                if (p >= end)
+                    return 0;
+                event.code = *p++;
+                break;
+            case SR_INPUT_SCROLL:
+                if (!getSigned(p, end, dx))
+                    return 0;
+                event.code = (int32_t) dx;
+                break;
+            case SR_INPUT_KEY_DOWN:
+            case SR_INPUT_KEY_UP:
+                if (!getVarint(p, end, u))
+                    return 0;
+                event.code = (int32_t) u;
+                break;
+            default:
+                //a kind of a later version: its payload cannot be skipped, the rest of the block is lost
+                return offset + blockSize + block.size;
+        }
+        events.push_back(event);
+    }
+    size_t next = offset + blockSize + block.size;
+    return next < size ? next : 0;
+}
@@ -0,0 +1,146 @@
+//
+// Input events written next to the recording: keys, buttons, scrolls and pointer moves, delta-encoded by blocks.
+//
+
+#ifndef CPPSCREENRECORDER_SRINPUTLOG_H
+#define CPPSCREENRECORDER_SRINPUTLOG_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct _XDisplay;
+
+#define INPUTLOG_MAGIC "SRIN"
+#define INPUTLOG_VERSION 1
+#define INPUTLOG_KEYCODES 1     //header flag: the key events carry their keycode, 0 otherwise
+#define INPUT_BLOCK_BYTES 4096  //bytes of events a block holds at most
+#define INPUT_BLOCK_DURATION 1000   //ms a block spans at most: a crash loses what the last one had
+#define INPUT_MOTION_INTERVAL 10    //ms between two pointer positions recorded while it moves
+
+typedef enum IK{
+    SR_INPUT_MOTION = 1,    //x and y are the new position
+    SR_INPUT_BUTTON_DOWN,   //code is the button, 1 left, 2 middle, 3 right
+    SR_INPUT_BUTTON_UP,
+    SR_INPUT_SCROLL,        //code is 1 for a vertical scroll down, -1 up, 2 right, -2 left
+    SR_INPUT_KEY_DOWN,      //code is the X keycode, 0 without INPUTLOG_KEYCODES
+    SR_INPUT_KEY_UP
+}SRInputKind;
+
+/**
+ * Header of an input log, followed by the blocks up to the end of the file.
+ * Every field is in the byte order of the recording host.
+ */
+typedef struct IL{
+    char magic[4];  //INPUTLOG_MAGIC
+    uint32_t version;
+    uint32_t blockSize;     //sizeof(SRInputBlock), newer versions may only append fields
+    uint32_t flags;
+    int32_t x, y, width, height;    //recorded region, in the screen coordinates of the events
+}SRInputLogHeader;
+
+/**
+ * Header of a block: the events of up to INPUT_BLOCK_DURATION ms follow, size bytes of them. Each event is its
+ * kind byte, the us since the previous event (since pts for the first one) as a LEB128 varint, and its payload:
+ * the zigzag varints dx, dy of a motion, the button byte, the zigzag varint code of a scroll, the varint keycode
+ * of a key.
+ */
+typedef struct IB{
+    int64_t pts;    //us on the capture clock, as the stream timestamps
+    int32_t x, y;   //pointer position the motions of the block start from
+    uint32_t count;
+    uint32_t size;
+}SRInputBlock;
+
+/**
+ * One decoded event.
+ */
+typedef struct IE{
+    int64_t pts;
+    int32_t kind;   //SRInputKind
+    int32_t x, y;   //pointer position after the event
+    int32_t code;
+}SRInputEvent;
+
+/**
+ * SRInputLog records the input of the X display on a lightweight thread of its own, through the raw events of
+ * XInput2 (they come whatever window has the focus or a grab), and appends them to a sidecar file block by
+ * block: searching a recording for clicks and typing reads this file instead of the video. A pointer
+ * that moves is sampled every INPUT_MOTION_INTERVAL ms at most, and a motion takes 4 or 5 bytes.\n
+ * The keycodes are only written when asked for: the rest records that keys were pressed, not which ones,
+ * so that a typed password does not end up next to the recording.\n
+ * SRInputLog::find() walks the block headers of a mapped file to the block of a time, decode() expands it.
+ *
+ * @Note Linux (X11) only, open() fails in other builds
+ */
+class SRInputLog {
+
+private:
+    std::string path;
+    FILE *file;
+    std::thread reader;
+    std::atomic<bool> stopping;
+    std::function<int64_t(int64_t)> stamp;
+    bool keycodes;
+
+    //reader thread only
+    SRInputBlock block;
+    std::vector<uint8_t> events;
+    int64_t lastPts;
+    int64_t blockWall;
+    int32_t lastX, lastY;
+    uint64_t written;
+    uint64_t blocks;
+    int64_t bytes;
+
+    void run(struct _XDisplay *display, int opcode);
+    void add(int kind, int64_t wall, int32_t x, int32_t y, int32_t code);
+    void flush();
+
+public:
+    SRInputLog();
+    ~SRInputLog();
+
+    SRInputLog(const SRInputLog&) = delete;
+    SRInputLog &operator=(const SRInputLog&) = delete;
+
+    /**
+     * open() creates the log, writes its header and starts the thread reading the events of device
+     * @param stamp maps the wall clock of an event (av_gettime()) to its pts, AV_NOPTS_VALUE drops it (while paused)
+     * @param keycodes write the keycodes of the key events
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int open(const char *path, const char *device, int x, int y, int width, int height,
+             std::function<int64_t(int64_t)> stamp, bool keycodes);
+
+    /**
+     * close() stops the thread and writes the last block
+     */
+    void close();
+
+    const std::string &name() const { return path; }
+    uint64_t size() const { return written; }
+    uint64_t blockCount() const { return blocks; }
+    int64_t fileBytes() const { return bytes; }
+
+    /**
+     * find() walks the blocks of a mapped or loaded log
+     * @param data the whole log file, header included
+     * @return the offset in data of the last block starting at or before pts, the first one when pts precedes
+     * them all, 0 when data is not a log or holds no complete block
+     */
+    static size_t find(const void *data, size_t size, int64_t pts);
+
+    /**
+     * decode() expands the block at offset of data into events
+     * @return the offset of the next block, 0 at the end of the log or on a torn block
+     */
+    static size_t decode(const void *data, size_t size, size_t offset, std::vector<SRInputEvent> &events);
+};
+
+#endif //CPPSCREENRECORDER_SRINPUTLOG_H
@@ -0,0 +1,97 @@
+#include "SRKeyIndex.h"
+#include "SRLog.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+extern "C"
+{
+#include "libavutil/error.h"
+}
+
+using namespace std;
+
+SRKeyIndex::SRKeyIndex(): file(nullptr), entries(0) {}
+
+SRKeyIndex::~SRKeyIndex() {
+    close();
+}
+
+int SRKeyIndex::open(const char *path, uint32_t flags) {
+    this->path = path;
+    file = fopen(path, "w+b");
+    if (!file) {
+        cout << "\n[SRKeyIndex] cannot create " << path;
+        return AVERROR(errno);
+    }
+    SRKeyIndexHeader header;
+    memcpy(header.magic, KEYINDEX_MAGIC, sizeof(header.magic));
+    header.version = KEYINDEX_VERSION;
+    header.entrySize = sizeof(SRKeyIndexEntry);
+    header.flags = flags;
+    if (fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file)) {
+        cout << "\n[SRKeyIndex] cannot write " << path;
+        close();
+        return AVERROR(EIO);
+    }
+    return 0;
+}
+
+void SRKeyIndex::add(int64_t pts, int64_t offset, uint32_t segment) {
+    if (!file)
+        return;
+    SRKeyIndexEntry entry = {pts, offset, segment, 0};
+    //one entry per keyframe: flushing each one costs a write every few seconds
+    if (fwrite(&entry, sizeof(entry), 1, file) != 1 || fflush(file)) {
+        srLog(SR_LOG_ERROR, "[SRKeyIndex] cannot write %s, the index stops here", path.c_str());
+        close();
+        return;
+    }
+    entries++;
+}
+
+void SRKeyIndex::shift(int64_t delta) {
+    if (!file || !delta)
+        return;
+    SRKeyIndexEntry entry;
+    for (uint64_t i = 0; i < entries; i++) {
+        long position = (long) (sizeof(SRKeyIndexHeader) + i * sizeof(entry));
+        if (fseek(file, position, SEEK_SET) || fread(&entry, sizeof(entry), 1, file) != 1)
+            break;
+        if (entry.offset < 0)
+            continue;
+        entry.offset += delta;
+        if (fseek(file, position, SEEK_SET) || fwrite(&entry, sizeof(entry), 1, file) != 1)
+            break;
+    }
+    fflush(file);
+}
+
+void SRKeyIndex::close() {
+    if (!file)
+        return;
+    fclose(file);
+    file = nullptr;
+}
+
+const SRKeyIndexEntry *SRKeyIndex::find(const void *data, size_t size, int64_t pts) {
+    const SRKeyIndexHeader *header = (const SRKeyIndexHeader *) data;
+    if (!data || size < sizeof(*header) || memcmp(header->magic, KEYINDEX_MAGIC, sizeof(header->magic)) ||
+        header->entrySize < sizeof(SRKeyIndexEntry))
+        return nullptr;
+    size_t count = (size - sizeof(*header)) / header->entrySize;
+    if (!count)
+        return nullptr;
+    //entries of a newer version are longer: step over them by entrySize
+    const uint8_t *base = (const uint8_t *) data + sizeof(*header);
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (((const SRKeyIndexEntry *) (base + middle * header->entrySize))->pts <= pts)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return (const SRKeyIndexEntry *) (base + (low ? low - 1 : 0) * header->entrySize);
+}
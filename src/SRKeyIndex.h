@@ -0,0 +1,92 @@
+//
+// Keyframe index written next to the recording: fixed size entries readers map and binary search to seek.
+//
+
+#ifndef CPPSCREENRECORDER_SRKEYINDEX_H
+#define CPPSCREENRECORDER_SRKEYINDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#define KEYINDEX_MAGIC "SRKI"
+#define KEYINDEX_VERSION 1
+#define KEYINDEX_SEGMENTED 1    //header flag: the entries locate a segment file, not a byte of settings.filename
+
+/**
+ * Header of a keyframe index file, followed by the entries up to the end of the file.
+ * Every field is in the byte order of the recording host.
+ */
+typedef struct I{
+    char magic[4];  //KEYINDEX_MAGIC
+    uint32_t version;
+    uint32_t entrySize;     //sizeof(SRKeyIndexEntry), newer versions may only append fields
+    uint32_t flags;
+}SRKeyIndexHeader;
+
+/**
+ * One keyframe of the video stream, in pts order.\n
+ * offset is where a reader starts demuxing to reach the keyframe: the keyframe itself in a plain MP4,
+ * the fragment it starts in a fragmented MP4, at most one cluster before it in Matroska; -1 when it is unknown
+ * (segmenting and live outputs, the segment starts with the keyframe of its first entry).
+ */
+typedef struct KE{
+    int64_t pts;    //us on the capture clock, as the stream timestamps
+    int64_t offset;
+    uint32_t segment;   //file number of SR_OUTPUT_SEGMENTED, HLS and DASH, 0 otherwise
+    uint32_t reserved;
+}SRKeyIndexEntry;
+
+/**
+ * SRKeyIndex appends one entry per keyframe while the recording is written: a reader can map the file
+ * at any time, even while it grows or after a crash, and find the keyframe before a time in O(log n)
+ * instead of scanning the recording.\n
+ * Each entry reaches the file when it is added, a torn last entry is ignored by find().
+ *
+ * @Note MuxerThread only, apart from open() and close()
+ */
+class SRKeyIndex {
+
+private:
+    std::string path;
+    FILE *file;
+    uint64_t entries;
+
+public:
+    SRKeyIndex();
+    ~SRKeyIndex();
+
+    SRKeyIndex(const SRKeyIndex&) = delete;
+    SRKeyIndex &operator=(const SRKeyIndex&) = delete;
+
+    /**
+     * open() creates the index and writes its header
+     * @param flags KEYINDEX_SEGMENTED or 0
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int open(const char *path, uint32_t flags);
+
+    void add(int64_t pts, int64_t offset, uint32_t segment);
+
+    /**
+     * shift() moves every known offset by delta bytes, once the trailer of an MP4 faststart recording
+     * has put its index in front of the samples
+     */
+    void shift(int64_t delta);
+
+    void close();
+
+    const std::string &name() const { return path; }
+    uint64_t size() const { return entries; }
+
+    /**
+     * find() binary searches a mapped or loaded index
+     * @param data the whole index file, header included
+     * @return the last keyframe at or before pts, the first one when pts precedes them all,
+     * nullptr when data is not an index or holds no entry
+     */
+    static const SRKeyIndexEntry *find(const void *data, size_t size, int64_t pts);
+};
+
+#endif //CPPSCREENRECORDER_SRKEYINDEX_H
@@ -0,0 +1,202 @@
+//
+// Leveled asynchronous logger: the pipeline threads never wait for the console.
+//
+
+#include "SRLog.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+extern "C"
+{
+#include "libavutil/log.h"
+}
+
+namespace {
+
+typedef struct U{
+    SRLogLevel level;
+    char text[LOG_RECORD_SIZE];
+}SRLogRecord;
+
+/**
+ * SRLogger is a bounded multi-producer ring (sequence numbered cells, as in D. Vyukov's MPMC queue)
+ * drained by a single log thread.
+ */
+class SRLogger {
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        SRLogRecord record;
+    };
+
+    Cell cells[LOG_RING_SIZE];
+    std::atomic<size_t> enqueuePos;
+    size_t dequeuePos;      //log thread only
+    std::atomic<size_t> written;
+
+    std::atomic<int> level;
+    std::atomic<int64_t> windowStart;
+    std::atomic<int> windowCount;
+    std::atomic<uint64_t> suppressed;
+
+    std::atomic<bool> stopping;
+    std::thread writer;
+
+    static int64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /**
+     * admit() is the rate limit: a one second window of LOG_RATE lines, errors always pass
+     */
+    bool admit(SRLogLevel lineLevel) {
+        if (lineLevel <= SR_LOG_ERROR)
+            return true;
+        int64_t now = nowMs(), start = windowStart.load(std::memory_order_relaxed);
+        if (now - start >= 1000 && windowStart.compare_exchange_strong(start, now, std::memory_order_relaxed))
+            windowCount.store(0, std::memory_order_relaxed);
+        return windowCount.fetch_add(1, std::memory_order_relaxed) < LOG_RATE;
+    }
+
+    bool drain() {
+        static const char *prefixes[] = {"[error] ", "[warning] ", "", "[debug] "};
+        bool any = false;
+        while (true) {
+            Cell &cell = cells[dequeuePos & (LOG_RING_SIZE - 1)];
+            if (cell.seq.load(std::memory_order_acquire) != dequeuePos + 1)
+                break;
+            fputs("\n", stdout);
+            fputs(prefixes[cell.record.level], stdout);
+            fputs(cell.record.text, stdout);
+            cell.seq.store(dequeuePos + LOG_RING_SIZE, std::memory_order_release);
+            dequeuePos++;
+            any = true;
+        }
+        uint64_t lost = suppressed.exchange(0, std::memory_order_relaxed);
+        if (lost)
+            fprintf(stdout, "\n[SRLog] %llu lines dropped", (unsigned long long) lost);
+        if (any || lost)
+            fflush(stdout);
+        written.store(dequeuePos, std::memory_order_release);
+        return any;
+    }
+
+    void run() {
+        while (!stopping.load(std::memory_order_acquire)) {
+            if (!drain())
+                std::this_thread::sleep_for(std::chrono::milliseconds(LOG_POLL));
+        }
+        drain();
+    }
+
+public:
+    SRLogger(): enqueuePos(0), dequeuePos(0), written(0), level(SR_LOG_INFO), windowStart(0), windowCount(0),
+                suppressed(0), stopping(false) {
+        static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0, "LOG_RING_SIZE must be a power of two");
+        for (size_t i = 0; i < LOG_RING_SIZE; i++)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        writer = std::thread(&SRLogger::run, this);
+    }
+
+    ~SRLogger() {
+        stopping.store(true, std::memory_order_release);
+        writer.join();
+    }
+
+    bool enabled(SRLogLevel lineLevel) const {
+        return lineLevel <= level.load(std::memory_order_relaxed);
+    }
+
+    void setLevel(SRLogLevel newLevel) {
+        level.store(newLevel, std::memory_order_relaxed);
+    }
+
+    void write(SRLogLevel lineLevel, const char *format, va_list args) {
+        if (!admit(lineLevel)) {
+            suppressed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells[pos & (LOG_RING_SIZE - 1)];
+            intptr_t diff = (intptr_t) cell->seq.load(std::memory_order_acquire) - (intptr_t) pos;
+            if (diff == 0 && enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+            if (diff < 0) {
+                //ring full: the console is behind, the line is lost rather than the frame
+                suppressed.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            if (diff > 0)
+                pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+        cell->record.level = lineLevel;
+        vsnprintf(cell->record.text, LOG_RECORD_SIZE, format, args);
+        cell->seq.store(pos + 1, std::memory_order_release);
+    }
+
+    void flush() {
+        size_t target = enqueuePos.load(std::memory_order_acquire);
+        while (written.load(std::memory_order_acquire) < target && !stopping.load(std::memory_order_acquire))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+};
+
+SRLogger &logger() {
+    static SRLogger instance;
+    return instance;
+}
+
+SRLogLevel fromLibav(int level) {
+    if (level <= AV_LOG_ERROR) return SR_LOG_ERROR;
+    if (level <= AV_LOG_WARNING) return SR_LOG_WARNING;
+    if (level <= AV_LOG_INFO) return SR_LOG_INFO;
+    return SR_LOG_DEBUG;
+}
+
+void libavCallback(void *avcl, int level, const char *format, va_list args) {
+    //libav keeps its own threshold, av_log_set_level() still applies
+    if (level > av_log_get_level() || !logger().enabled(fromLibav(level)))
+        return;
+    static thread_local int printPrefix = 1;
+    char line[LOG_RECORD_SIZE];
+    av_log_format_line(avcl, level, format, args, line, sizeof(line), &printPrefix);
+    size_t length = strlen(line);
+    while (length && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+        line[--length] = 0;
+    if (length)
+        srLog(fromLibav(level), "%s", line);
+}
+
+}
+
+void srLog(SRLogLevel level, const char *format, ...) {
+    SRLogger &log = logger();
+    if (!log.enabled(level))
+        return;
+    va_list args;
+    va_start(args, format);
+    log.write(level, format, args);
+    va_end(args);
+}
+
+void setLogLevel(SRLogLevel level) {
+    logger().setLevel(level);
+}
+
+void attachLibavLog() {
+    av_log_set_callback(libavCallback);
+}
+
+void flushLog() {
+    logger().flush();
+}
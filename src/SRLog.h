@@ -0,0 +1,50 @@
+//
+// Leveled asynchronous logger: the pipeline threads never wait for the console.
+//
+
+#ifndef CPPSCREENRECORDER_SRLOG_H
+#define CPPSCREENRECORDER_SRLOG_H
+
+#define LOG_RING_SIZE 1024  //records waiting for the log thread, a power of two
+#define LOG_RECORD_SIZE 240  //characters of a record, longer lines are truncated
+#define LOG_RATE 200    //records per second below SR_LOG_ERROR, the others are counted and dropped
+#define LOG_POLL 20     //ms between two flushes of the log thread
+
+typedef enum V{
+    SR_LOG_QUIET = -1,
+    SR_LOG_ERROR,
+    SR_LOG_WARNING,
+    SR_LOG_INFO,
+    SR_LOG_DEBUG
+}SRLogLevel;
+
+/**
+ * srLog() formats a line, printf style, into a preallocated record of the log ring and returns:
+ * no lock, no allocation and no I/O on the calling thread. The log thread, started by the first call,
+ * writes the records to the standard output every LOG_POLL ms.\n
+ * Past LOG_RATE lines per second, or with the ring full, the lines are dropped and their count is logged instead.
+ * Errors are exempt from the rate limit.
+ */
+void srLog(SRLogLevel level, const char *format, ...)
+#if defined(__GNUC__)
+__attribute__((format(printf, 2, 3)))
+#endif
+;
+
+/**
+ * setLogLevel() drops the lines more verbose than level, SR_LOG_QUIET drops all of them
+ */
+void setLogLevel(SRLogLevel level);
+
+/**
+ * attachLibavLog() routes the av_log() output of the devices, codecs and muxers through srLog()
+ */
+void attachLibavLog();
+
+/**
+ * flushLog() waits until the lines logged so far are written
+ * @Note the log thread also drains the ring at exit(), flushLog() is for the places that need the output now
+ */
+void flushLog();
+
+#endif //CPPSCREENRECORDER_SRLOG_H
@@ -0,0 +1,203 @@
+#include "SRManifest.h"
+#include "SRLog.h"
+
+#include <cstring>
+#include <fstream>
+
+extern "C"
+{
+#include "libavformat/avio.h"
+#include "libavutil/common.h"
+#include "libavutil/error.h"
+#include "libavutil/hmac.h"
+#include "libavutil/mem.h"
+#include "libavutil/sha.h"
+}
+
+static std::string hex(const uint8_t *data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string s;
+    s.reserve(size * 2);
+    for (size_t i = 0; i < size; i++) {
+        s += digits[data[i] >> 4];
+        s += digits[data[i] & 15];
+    }
+    return s;
+}
+
+/* the name of the file as a JSON string, without its directory */
+static std::string jsonName(const char *path) {
+    std::string name(path), s = "\"";
+    size_t slash = name.find_last_of("/\\");
+    if (slash != std::string::npos)
+        name = name.substr(slash + 1);
+    for (char c : name) {
+        if (c == '"' || c == '\\')
+            s += '\\';
+        if ((unsigned char) c >= 0x20)
+            s += c;
+    }
+    return s + "\"";
+}
+
+SRManifest::SRManifest(): sha(av_sha_alloc()), position(0), inOrder(true), counters() {
+    reset();
+}
+
+SRManifest::~SRManifest() {
+    av_freep(&sha);
+}
+
+void SRManifest::reset() {
+    digests.clear();
+    position = 0;
+    inOrder = true;
+    counters = SRManifestStats();
+    if (sha)
+        av_sha_init(sha, 256);
+}
+
+/**
+ * markStale() drops the digests of the chunks the bytes from, to overlap: finish() reads them back
+ */
+void SRManifest::markStale(int64_t from, int64_t to) {
+    if (to <= from)
+        return;
+    int64_t first = from / MANIFEST_CHUNK_SIZE, last = (to - 1) / MANIFEST_CHUNK_SIZE;
+    if ((int64_t) digests.size() <= last)
+        digests.resize(last + 1);
+    for (int64_t k = first; k <= last; k++)
+        digests[k].clear();
+    if (last >= position / MANIFEST_CHUNK_SIZE)
+        inOrder = false;
+}
+
+/**
+ * closeChunk() keeps the digest of the chunk ending at position, or leaves it stale, and starts the next one
+ */
+void SRManifest::closeChunk() {
+    int64_t k = (position - 1) / MANIFEST_CHUNK_SIZE;
+    if ((int64_t) digests.size() <= k)
+        digests.resize(k + 1);
+    uint8_t digest[32];
+    av_sha_final(sha, digest);
+    if (inOrder)
+        digests[k].assign((const char *) digest, sizeof(digest));
+    av_sha_init(sha, 256);
+    inOrder = true;
+}
+
+void SRManifest::update(int64_t offset, const uint8_t *data, size_t size) {
+    if (!sha || !size)
+        return;
+    int64_t end = offset + (int64_t) size;
+    if (offset < position) {
+        //a patch of what is hashed already
+        markStale(offset, FFMIN(end, position));
+        if (end <= position)
+            return;
+        data += position - offset;
+        size = (size_t) (end - position);
+        offset = position;
+    }
+    if (offset > position) {
+        //a seek forward: the gap and the chunk it ends in are read back
+        markStale(position, offset % MANIFEST_CHUNK_SIZE ? offset + 1 : offset);
+        av_sha_init(sha, 256);
+        position = offset;
+        inOrder = offset % MANIFEST_CHUNK_SIZE == 0;
+    }
+    while (size > 0) {
+        size_t n = (size_t) FFMIN((int64_t) size, MANIFEST_CHUNK_SIZE - position % MANIFEST_CHUNK_SIZE);
+        if (inOrder)
+            av_sha_update(sha, data, (unsigned int) n);
+        data += n;
+        size -= n;
+        position += n;
+        if (position % MANIFEST_CHUNK_SIZE == 0)
+            closeChunk();
+    }
+}
+
+int SRManifest::finish(const char *path, const std::vector<uint8_t> &key) {
+    if (!sha)
+        return AVERROR(ENOMEM);
+    if (position % MANIFEST_CHUNK_SIZE)
+        closeChunk();
+    digests.resize((size_t) ((position + MANIFEST_CHUNK_SIZE - 1) / MANIFEST_CHUNK_SIZE));
+
+    AVIOContext *io = nullptr;
+    std::vector<uint8_t> chunk;
+    int ret = 0;
+    for (size_t k = 0; k < digests.size() && ret >= 0; k++) {
+        if (!digests[k].empty())
+            continue;
+        if (!io && (ret = avio_open(&io, path, AVIO_FLAG_READ)) < 0)
+            break;
+        int64_t start = (int64_t) k * MANIFEST_CHUNK_SIZE;
+        int n = (int) FFMIN((int64_t) MANIFEST_CHUNK_SIZE, position - start);
+        chunk.resize(n);
+        if (avio_seek(io, start, SEEK_SET) != start || avio_read(io, chunk.data(), n) != n) {
+            ret = AVERROR(EIO);
+            break;
+        }
+        uint8_t digest[32];
+        av_sha_init(sha, 256);
+        av_sha_update(sha, chunk.data(), (unsigned int) n);
+        av_sha_final(sha, digest);
+        digests[k].assign((const char *) digest, sizeof(digest));
+        counters.readBack++;
+    }
+    avio_closep(&io);
+    if (ret < 0) {
+        srLog(SR_LOG_ERROR, "[SRManifest] cannot read %s back", path);
+        return ret;
+    }
+    counters.chunks = digests.size();
+
+    uint8_t root[32];
+    av_sha_init(sha, 256);
+    for (const std::string &d : digests)
+        av_sha_update(sha, (const uint8_t *) d.data(), (unsigned int) d.size());
+    av_sha_final(sha, root);
+    std::string name = jsonName(path), rootHex = hex(root, sizeof(root)), signature;
+    if (!key.empty()) {
+        std::string message = name.substr(1, name.size() - 2) + "\n" + std::to_string(position) + "\n" + rootHex + "\n";
+        uint8_t mac[32];
+        AVHMAC *hmac = av_hmac_alloc(AV_HMAC_SHA256);
+        if (!hmac)
+            return AVERROR(ENOMEM);
+        int size = av_hmac_calc(hmac, (const uint8_t *) message.data(), (unsigned int) message.size(), key.data(),
+                                (unsigned int) key.size(), mac, sizeof(mac));
+        av_hmac_free(hmac);
+        signature = hex(mac, size > 0 ? size : 0);
+    }
+
+    std::ofstream out(std::string(path) + MANIFEST_SUFFIX, std::ios::trunc);
+    out << "{\"file\":" << name << ",\"size\":" << position << ",\"chunkSize\":" << MANIFEST_CHUNK_SIZE
+        << ",\"algorithm\":\"SHA-256\",\"chunks\":[";
+    for (size_t k = 0; k < digests.size(); k++)
+        out << (k ? ",\"" : "\"") << hex((const uint8_t *) digests[k].data(), digests[k].size()) << "\"";
+    out << "],\"root\":\"" << rootHex << "\",\"hmac\":\"" << signature << "\"}\n";
+    out.close();
+    return out.fail() ? AVERROR(EIO) : 0;
+}
+
+bool SRManifest::parseKey(const char *digits, std::vector<uint8_t> &key) {
+    key.clear();
+    size_t length = digits ? strlen(digits) : 0;
+    if (!length || length % 2)
+        return false;
+    for (size_t i = 0; i < length; i += 2) {
+        int v = 0;
+        for (size_t j = i; j < i + 2; j++) {
+            char c = digits[j];
+            int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (d < 0)
+                return false;
+            v = v << 4 | d;
+        }
+        key.push_back((uint8_t) v);
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+//
+// Tamper-evident recordings: SHA-256 of each chunk of the file as the writer writes it, in a signed manifest.
+//
+
+#ifndef CPPSCREENRECORDER_SRMANIFEST_H
+#define CPPSCREENRECORDER_SRMANIFEST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct AVSHA;
+
+#define MANIFEST_CHUNK_SIZE (4 << 20)   //bytes of file each digest covers
+#define MANIFEST_SUFFIX ".manifest.json"
+
+/**
+ * Statistics of an SRManifest: chunks in the manifest, chunks read back from the file to hash them.
+ */
+typedef struct MF{
+    uint64_t chunks;
+    uint64_t readBack;
+}SRManifestStats;
+
+/**
+ * SRManifest hashes a file in MANIFEST_CHUNK_SIZE chunks from the bytes on their way to the disk: the writer
+ * thread hands each buffer to update() at its file offset as it writes it, so a growing recording is hashed
+ * without a second read.\n
+ * A chunk is hashed in passing while the file is written in order. A write landing in the bytes already hashed
+ * (the MP4 or Matroska header patched by a seek back) or past a gap marks its chunks stale, and finish()
+ * reads only those back. On a plain recording that is the first chunk.\n
+ * finish() writes the manifest next to the file, as path + MANIFEST_SUFFIX:
+ * {"file", "size", "chunkSize", "algorithm": "SHA-256", "chunks": [hex digest of each chunk], "root", "hmac"}.
+ * root is the SHA-256 of the concatenated chunk digests. hmac is the HMAC-SHA256, under the key, of
+ * file "\n" size "\n" root "\n"; it is left empty without a key. A chunk that no longer matches its digest shows
+ * where the file was changed. Only a holder of the key can produce a root that matches hmac.
+ *
+ * @Note update() is the writer thread only, finish() once the file is closed
+ */
+class SRManifest {
+
+private:
+    std::vector<std::string> digests;   //binary, empty while the chunk is stale
+    struct AVSHA *sha;
+    int64_t position;   //end of the bytes hashed in order
+    bool inOrder;   //the chunk of position has been hashed from its start
+    SRManifestStats counters;
+
+    void markStale(int64_t from, int64_t to);
+    void closeChunk();
+
+public:
+    SRManifest();
+    ~SRManifest();
+
+    SRManifest(const SRManifest&) = delete;
+    SRManifest &operator=(const SRManifest&) = delete;
+
+    /**
+     * reset() starts the next file
+     */
+    void reset();
+
+    /**
+     * update() takes the size bytes of data written at offset of the file
+     */
+    void update(int64_t offset, const uint8_t *data, size_t size);
+
+    /**
+     * finish() hashes the stale chunks from the file at path and writes its manifest
+     * @param key HMAC-SHA256 key of the signature, empty leaves the manifest unsigned
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int finish(const char *path, const std::vector<uint8_t> &key);
+
+    SRManifestStats stats() const { return counters; }
+
+    /**
+     * parseKey() reads a key of an even number of hex digits
+     * @return false if digits is not one
+     */
+    static bool parseKey(const char *digits, std::vector<uint8_t> &key);
+};
+
+#endif //CPPSCREENRECORDER_SRMANIFEST_H
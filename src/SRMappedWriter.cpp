@@ -0,0 +1,200 @@
+#include "SRMappedWriter.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+extern "C"
+{
+#include "libavutil/error.h"
+#include "libavutil/mem.h"
+}
+
+SRMappedWriter::SRMappedWriter(): fd(-1), io(nullptr), window(nullptr), windowStart(0), position(0), extent(0),
+                                  allocated(0), error(0), counters({0, 0, 0, 0}) {}
+
+SRMappedWriter::~SRMappedWriter() {
+    close();
+}
+
+int SRMappedWriter::open(const char *path) {
+#ifdef _WIN32
+    (void) path;
+    return AVERROR(ENOSYS);
+#else
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return AVERROR(errno);
+    //after close(), the next file: the statistics go on
+    windowStart = position = extent = allocated = 0;
+    error = 0;
+    int ret = mapWindow(0);
+    if (ret < 0)
+        return ret;
+
+    uint8_t *buffer = (uint8_t *) av_malloc(MAPPED_IO_SIZE);
+    if (!buffer)
+        return AVERROR(ENOMEM);
+    io = avio_alloc_context(buffer, MAPPED_IO_SIZE, 1, this, nullptr, writePacket, seek);
+    if (!io) {
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+    io->seekable = AVIO_SEEKABLE_NORMAL;
+    //the packets go straight to writePacket(), which copies them into the mapping
+    io->direct = 1;
+    return 0;
+#endif
+}
+
+int SRMappedWriter::close() {
+#ifndef _WIN32
+    if (io) {
+        avio_flush(io);
+        av_freep(&io->buffer);
+        avio_context_free(&io);
+    }
+    unmapWindow();
+    if (fd >= 0) {
+        //the preallocated tail of the last chunk goes
+        if (ftruncate(fd, (off_t) extent) < 0 && !error)
+            error = AVERROR(errno);
+        ::close(fd);
+        fd = -1;
+    }
+#endif
+    return error;
+}
+
+/**
+ * mapWindow() preallocates the chunk holding offset and maps it
+ * @return 0, or a negative AVERROR: AVERROR(ENOSPC) when the disk cannot take one more chunk
+ */
+int SRMappedWriter::mapWindow(int64_t offset) {
+#ifdef _WIN32
+    (void) offset;
+    return AVERROR(ENOSYS);
+#else
+    int64_t start = offset / MAPPED_CHUNK_SIZE * MAPPED_CHUNK_SIZE;
+    if (start + MAPPED_CHUNK_SIZE > allocated) {
+#ifdef __linux__
+        //blocks reserved now: a store into the mapping never finds the disk full
+        int ret = posix_fallocate(fd, (off_t) allocated, (off_t) (start + MAPPED_CHUNK_SIZE - allocated));
+        if (ret != 0)
+            return AVERROR(ret);
+#else
+        if (ftruncate(fd, (off_t) (start + MAPPED_CHUNK_SIZE)) < 0)
+            return AVERROR(errno);
+#endif
+        allocated = start + MAPPED_CHUNK_SIZE;
+    }
+    void *map = mmap(nullptr, MAPPED_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t) start);
+    if (map == MAP_FAILED)
+        return AVERROR(errno);
+    window = (uint8_t *) map;
+    windowStart = start;
+    counters.windows++;
+    return 0;
+#endif
+}
+
+/**
+ * unmapWindow() starts the write back of the current chunk without waiting for it, and unmaps it
+ */
+void SRMappedWriter::unmapWindow() {
+#ifndef _WIN32
+    if (!window)
+        return;
+    size_t used = (size_t) std::min<int64_t>(std::max<int64_t>(extent - windowStart, 0), MAPPED_CHUNK_SIZE);
+#ifdef __linux__
+    if (used)
+        sync_file_range(fd, (off_t) windowStart, (off_t) used, SYNC_FILE_RANGE_WRITE);
+#else
+    if (used)
+        msync(window, used, MS_ASYNC);
+#endif
+    munmap(window, MAPPED_CHUNK_SIZE);
+    window = nullptr;
+    counters.flushes++;
+#endif
+}
+
+/**
+ * writeDirect() writes behind the current chunk with pwrite()
+ */
+int SRMappedWriter::writeDirect(const uint8_t *buf, int size) {
+#ifdef _WIN32
+    (void) buf;
+    return size;
+#else
+    int done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(fd, buf + done, size - done, (off_t) (position + done));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        done += (int) n;
+    }
+    counters.directWrites++;
+    return done;
+#endif
+}
+
+int SRMappedWriter::writePacket(void *opaque, uint8_t *buf, int size) {
+    SRMappedWriter *w = (SRMappedWriter *) opaque;
+    if (w->error)
+        return w->error;
+    int left = size;
+    while (left > 0) {
+        int64_t inWindow = w->position - w->windowStart;
+        if (w->window && inWindow >= 0 && inWindow < MAPPED_CHUNK_SIZE) {
+            size_t n = std::min((size_t) left, (size_t) (MAPPED_CHUNK_SIZE - inWindow));
+            memcpy(w->window + inWindow, buf, n);
+            buf += n;
+            left -= (int) n;
+            w->position += (int64_t) n;
+        } else if (w->position >= w->windowStart + MAPPED_CHUNK_SIZE) {
+            //the recording went past the chunk: the next one is mapped, the old one flushed
+            w->unmapWindow();
+            int ret = w->mapWindow(w->position);
+            if (ret < 0)
+                return w->error = ret;
+        } else {
+            //behind the chunk, and not past the file: the header updates of the muxer
+            int64_t end = std::min(w->position + left, w->windowStart);
+            int ret = w->writeDirect(buf, (int) (end - w->position));
+            if (ret < 0)
+                return w->error = ret;
+            buf += ret;
+            left -= ret;
+            w->position += ret;
+        }
+        w->extent = std::max(w->extent, w->position);
+    }
+    w->counters.bytes += size;
+    return size;
+}
+
+int64_t SRMappedWriter::seek(void *opaque, int64_t offset, int whence) {
+    SRMappedWriter *w = (SRMappedWriter *) opaque;
+    if (whence == AVSEEK_SIZE)
+        return w->extent;
+    switch (whence & ~AVSEEK_FORCE) {
+        case SEEK_SET: break;
+        case SEEK_CUR: offset += w->position; break;
+        case SEEK_END: offset += w->extent; break;
+        default: return AVERROR(EINVAL);
+    }
+    if (offset < 0)
+        return AVERROR(EINVAL);
+    w->position = offset;
+    return offset;
+}
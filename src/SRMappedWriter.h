@@ -0,0 +1,84 @@
+//
+// Output file written through a memory mapping that grows in large preallocated chunks, plugged into libavformat
+// as a custom AVIOContext.
+//
+
+#ifndef CPPSCREENRECORDER_SRMAPPEDWRITER_H
+#define CPPSCREENRECORDER_SRMAPPEDWRITER_H
+
+#include <cstdint>
+
+extern "C"
+{
+#include "libavformat/avio.h"
+}
+
+#define MAPPED_CHUNK_SIZE (64 << 20)    //bytes preallocated and mapped at a time
+#define MAPPED_IO_SIZE (64 << 10)       //bytes of the AVIOContext buffer, large packets bypass it
+
+/**
+ * Statistics of an SRMappedWriter: windows counts the chunks mapped, flushes the chunks handed to the disk,
+ * directWrites the writes behind the current chunk (the MP4 header updates) done with pwrite().
+ */
+typedef struct MS{
+    uint64_t bytes;
+    uint64_t windows;
+    uint64_t flushes;
+    uint64_t directWrites;
+}SRMappedStats;
+
+/**
+ * SRMappedWriter is the writer of sequential recordings on local fast storage (NVMe), POSIX only.\n
+ * The file grows by MAPPED_CHUNK_SIZE chunks, preallocated with fallocate() so a full disk fails the growth
+ * instead of a store into the mapping (SIGBUS). The chunk being written is mapped: the AVIOContext is direct,
+ * so each packet is copied once from the muxer into the mapping, and there is no write system call per packet.
+ * A chunk left behind is flushed asynchronously (sync_file_range() on Linux, msync(MS_ASYNC) elsewhere) and unmapped.
+ * Writes behind the current chunk go through pwrite(), which shares the page cache with the mappings.\n
+ * close() truncates the file to the bytes written.
+ *
+ * @Note the file is longer than its content until close(): it cannot be read back while it is open (faststart)
+ */
+class SRMappedWriter {
+
+private:
+    int fd;
+    AVIOContext *io;
+    uint8_t *window;        //mapping of the current chunk
+    int64_t windowStart;
+    int64_t position;
+    int64_t extent;         //highest offset written
+    int64_t allocated;      //bytes preallocated
+    int error;
+    SRMappedStats counters;
+
+    int mapWindow(int64_t offset);
+    void unmapWindow();
+    int writeDirect(const uint8_t *buf, int size);
+
+    static int writePacket(void *opaque, uint8_t *buf, int size);
+    static int64_t seek(void *opaque, int64_t offset, int whence);
+
+public:
+    SRMappedWriter();
+    ~SRMappedWriter();
+
+    SRMappedWriter(const SRMappedWriter&) = delete;
+    SRMappedWriter &operator=(const SRMappedWriter&) = delete;
+
+    /**
+     * open() creates the file and maps its first chunk; after close(), the next file
+     * @return 0 on success, AVERROR(ENOSYS) where there are no mappings, a negative AVERROR otherwise
+     */
+    int open(const char *path);
+
+    /**
+     * close() unmaps the last chunk, truncates the file to its content and closes it
+     * @return 0, or the first error
+     */
+    int close();
+
+    AVIOContext *avio() const { return io; }
+    SRMappedStats stats() const { return counters; }
+};
+
+#endif //CPPSCREENRECORDER_SRMAPPEDWRITER_H
@@ -0,0 +1,68 @@
+#include "SRMetrics.h"
+
+#include <cstdio>
+#include <cstring>
+
+SRStatsd::SRStatsd(): io(nullptr), sendErrors(0) {}
+
+SRStatsd::~SRStatsd() {
+    close();
+}
+
+int SRStatsd::open(const char *url, const char *prefix) {
+    this->prefix = prefix && prefix[0] ? std::string(prefix) + "." : "";
+    datagram.reserve(STATSD_PACKET);
+    return avio_open2(&io, url, AVIO_FLAG_WRITE, nullptr, nullptr);
+}
+
+void SRStatsd::append(const char *name, const char *value, const char *type) {
+    size_t size = prefix.size() + strlen(name) + strlen(value) + strlen(type) + 3;
+    if (!datagram.empty() && datagram.size() + size > STATSD_PACKET)
+        flush();
+    datagram += prefix;
+    datagram += name;
+    datagram += ':';
+    datagram += value;
+    datagram += '|';
+    datagram += type;
+    datagram += '\n';
+}
+
+void SRStatsd::gauge(const char *name, double value) {
+    char text[32];
+    //a signed gauge is read as a change of the previous value: a negative one is set from 0
+    if (value < 0)
+        append(name, "0", "g");
+    snprintf(text, sizeof(text), "%.3f", value);
+    append(name, text, "g");
+}
+
+void SRStatsd::count(const char *name, int64_t delta) {
+    if (delta <= 0)
+        return;
+    char text[24];
+    snprintf(text, sizeof(text), "%lld", (long long) delta);
+    append(name, text, "c");
+}
+
+void SRStatsd::flush() {
+    if (!io || datagram.empty())
+        return;
+    //the udp protocol sends what avio_flush() hands it in one datagram, the buffer is larger than STATSD_PACKET
+    avio_write(io, (const unsigned char *) datagram.data(), (int) datagram.size());
+    avio_flush(io);
+    if (io->error < 0) {
+        sendErrors++;
+        io->error = 0;
+    }
+    datagram.clear();
+}
+
+void SRStatsd::close() {
+    flush();
+    avio_closep(&io);
+}
+
+uint64_t SRStatsd::errors() const {
+    return sendErrors;
+}
@@ -0,0 +1,60 @@
+//
+// StatsD client of the recorder metrics, over the UDP protocol of libavformat.
+//
+
+#ifndef CPPSCREENRECORDER_SRMETRICS_H
+#define CPPSCREENRECORDER_SRMETRICS_H
+
+#include <cstdint>
+#include <string>
+
+extern "C"
+{
+#include "libavformat/avio.h"
+}
+
+#define STATSD_PACKET 1432  //bytes of a datagram, within a 1500 bytes MTU behind the IPv6 and UDP headers
+
+/**
+ * SRStatsd sends metrics to a StatsD server (statsd, Telegraf, the Datadog agent) as "prefix.name:value|type" lines.\n
+ * The lines are batched into datagrams of at most STATSD_PACKET bytes, each one sent by flush() or when the next
+ * line would not fit: a metric is never split between two datagrams. UDP does not block on a missing server,
+ * a send error is counted and the next batch goes out anyway.
+ */
+class SRStatsd {
+
+private:
+    AVIOContext *io;
+    std::string prefix;
+    std::string datagram;
+    uint64_t sendErrors;
+
+    void append(const char *name, const char *value, const char *type);
+
+public:
+    SRStatsd();
+    ~SRStatsd();
+
+    SRStatsd(const SRStatsd&) = delete;
+    SRStatsd &operator=(const SRStatsd&) = delete;
+
+    /**
+     * @param url "udp://host:port", the StatsD port is 8125
+     * @param prefix of every name, with its trailing '.': the recorder of a fleet is told apart by it
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int open(const char *url, const char *prefix);
+
+    void gauge(const char *name, double value);
+    void count(const char *name, int64_t delta);
+
+    /**
+     * flush() sends the lines not sent yet
+     */
+    void flush();
+    void close();
+
+    uint64_t errors() const;
+};
+
+#endif //CPPSCREENRECORDER_SRMETRICS_H
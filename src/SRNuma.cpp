@@ -0,0 +1,185 @@
+//
+// NUMA topology, node-local and huge page memory for the frame buffers of the pipelines.
+//
+
+#include "SRNuma.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+#ifdef __linux__
+/**
+ * readList() reads a sysfs list such as "0-3,8-11"
+ */
+static std::vector<int> readList(const std::string &path) {
+    std::vector<int> list;
+    std::ifstream file(path);
+    std::string text;
+    if (!std::getline(file, text))
+        return list;
+    const char *spec = text.c_str();
+    while (*spec) {
+        char *end;
+        long first = strtol(spec, &end, 10), last = first;
+        if (end == spec)
+            break;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (long i = first; i <= last; i++)
+            list.push_back((int) i);
+        if (*end != ',')
+            break;
+        spec = end + 1;
+    }
+    return list;
+}
+#endif
+
+int numaNodeCount() {
+#ifdef __linux__
+    static const int count = (int) readList("/sys/devices/system/node/online").size();
+    return count > 0 ? count : 1;
+#elif defined(_WIN32)
+    ULONG highest = 0;
+    return GetNumaHighestNodeNumber(&highest) ? (int) highest + 1 : 1;
+#else
+    return 1;
+#endif
+}
+
+std::vector<int> numaNodeCores(int node) {
+#ifdef __linux__
+    return readList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+#elif defined(_WIN32)
+    //the core indexes of pinThread() are those of the first processor group
+    std::vector<int> cores;
+    GROUP_AFFINITY affinity = {};
+    if (node >= 0 && GetNumaNodeProcessorMaskEx((USHORT) node, &affinity) && affinity.Group == 0)
+        for (int i = 0; i < (int) sizeof(KAFFINITY) * 8; i++)
+            if (affinity.Mask & ((KAFFINITY) 1 << i))
+                cores.push_back(i);
+    return cores;
+#else
+    std::vector<int> cores;
+    (void) node;
+    return cores;
+#endif
+}
+
+int numaCurrentNode() {
+#ifdef __linux__
+    unsigned int cpu = 0, node = 0;
+    return syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 ? (int) node : -1;
+#elif defined(_WIN32)
+    PROCESSOR_NUMBER processor;
+    USHORT node = 0;
+    GetCurrentProcessorNumberEx(&processor);
+    return GetNumaProcessorNodeEx(&processor, &node) ? (int) node : -1;
+#else
+    return -1;
+#endif
+}
+
+int numaNodeOf(const void *address) {
+#ifdef __linux__
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, nullptr, 0, address, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+        return -1;
+    return node;
+#elif defined(_WIN32)
+    PSAPI_WORKING_SET_EX_INFORMATION info = {};
+    info.VirtualAddress = (PVOID) address;
+    if (!QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info)) || !info.VirtualAttributes.Valid)
+        return -1;
+    return (int) info.VirtualAttributes.Node;
+#else
+    (void) address;
+    return -1;
+#endif
+}
+
+#ifdef __linux__
+static size_t hugeSize(size_t size) {
+    return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+/**
+ * hugeMap() maps size bytes (a multiple of HUGE_PAGE_SIZE) of huge pages, reserved ones or else transparent ones
+ */
+static void *hugeMap(size_t size) {
+    void *address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (address != MAP_FAILED)
+        return address;
+    //transparent huge pages need an aligned range: map one page more and trim the ends
+    uint8_t *base = (uint8_t *) mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return nullptr;
+    uint8_t *aligned = (uint8_t *) (((uintptr_t) base + HUGE_PAGE_SIZE - 1) & ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+    if (aligned > base)
+        munmap(base, aligned - base);
+    if (base + HUGE_PAGE_SIZE > aligned)
+        munmap(aligned + size, base + HUGE_PAGE_SIZE - aligned);
+    madvise(aligned, size, MADV_HUGEPAGE);
+    return aligned;
+}
+#endif
+
+void *numaAlloc(size_t size, int node, bool huge) {
+#ifdef __linux__
+    void *address = huge ? hugeMap(size = hugeSize(size)) :
+                    mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!address || address == MAP_FAILED)
+        return nullptr;
+    //the policy is applied as the pages are touched: whichever thread writes first, they land on node
+    unsigned long mask = 1UL << node;
+    if (node >= 0 && node < (int) sizeof(mask) * 8)
+        syscall(SYS_mbind, address, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+    return address;
+#elif defined(_WIN32)
+    DWORD preferred = node >= 0 ? (DWORD) node : NUMA_NO_PREFERRED_NODE;
+    SIZE_T large = GetLargePageMinimum();
+    if (huge && large) {
+        void *address = VirtualAllocExNuma(GetCurrentProcess(), nullptr, (size + large - 1) / large * large,
+                                           MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, preferred);
+        if (address)
+            return address;
+    }
+    return VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, preferred);
+#else
+    (void) node;
+    (void) huge;
+    return malloc(size);
+#endif
+}
+
+void numaFree(void *address, size_t size, bool huge) {
+    if (!address)
+        return;
+#ifdef __linux__
+    munmap(address, huge ? hugeSize(size) : size);
+#elif defined(_WIN32)
+    (void) size;
+    (void) huge;
+    VirtualFree(address, 0, MEM_RELEASE);
+#else
+    (void) size;
+    (void) huge;
+    free(address);
+#endif
+}
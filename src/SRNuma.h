@@ -0,0 +1,49 @@
+//
+// NUMA topology, node-local and huge page memory for the frame buffers of the pipelines.
+//
+
+#ifndef CPPSCREENRECORDER_SRNUMA_H
+#define CPPSCREENRECORDER_SRNUMA_H
+
+#include <cstddef>
+#include <vector>
+
+#define HUGE_PAGE_SIZE (2 << 20)    //x86-64 and arm64 huge page, the buffers of numaAlloc() with huge pages are rounded up to it
+
+/**
+ * numaNodeCount() returns the number of NUMA nodes, 1 on single-socket hosts and where the platform has no NUMA API
+ */
+int numaNodeCount();
+
+/**
+ * numaNodeCores() returns the logical cores of node, empty for an unknown node
+ */
+std::vector<int> numaNodeCores(int node);
+
+/**
+ * numaCurrentNode() returns the node of the core the calling thread runs on, -1 when unknown
+ */
+int numaCurrentNode();
+
+/**
+ * numaNodeOf() returns the node of the page holding address, -1 when unknown or not yet touched
+ */
+int numaNodeOf(const void *address);
+
+/**
+ * numaAlloc() allocates size bytes of page-aligned memory preferably on node: the pages come from node
+ * as long as it has free memory, from the nearest node otherwise.\n
+ * With huge, the memory comes in HUGE_PAGE_SIZE pages, one TLB entry each instead of 512: from the reserved
+ * huge pages (vm.nr_hugepages on Linux, large pages with SeLockMemoryPrivilege on Windows) when there are any,
+ * else on Linux as transparent huge pages, else in normal pages.
+ * @param node -1 for no preference
+ * @return nullptr on failure
+ */
+void *numaAlloc(size_t size, int node, bool huge = false);
+
+/**
+ * numaFree() releases the memory of numaAlloc(), size and huge as allocated
+ */
+void numaFree(void *address, size_t size, bool huge = false);
+
+#endif //CPPSCREENRECORDER_SRNUMA_H
@@ -0,0 +1,186 @@
+#include "SROverlay.h"
+#include "SRBlend.h"
+
+#include <algorithm>
+
+extern "C"
+{
+#include "libavutil/pixfmt.h"
+}
+
+/* x / 255 rounded, exact for the products of two bytes */
+static inline int div255(int x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static inline uint8_t clip8(int x) {
+    return (uint8_t) (x < 0 ? 0 : x > 255 ? 255 : x);
+}
+
+/* BT.601 limited range of premultiplied components: the offsets are premultiplied too */
+static inline uint8_t premultipliedY(int r, int g, int b, int a) {
+    return clip8(((66 * r + 129 * g + 25 * b + 128) >> 8) + div255(16 * a));
+}
+
+static inline uint8_t premultipliedU(int r, int g, int b, int a) {
+    return clip8(((-38 * r - 74 * g + 112 * b + 128) >> 8) + div255(128 * a));
+}
+
+static inline uint8_t premultipliedV(int r, int g, int b, int a) {
+    return clip8(((112 * r - 94 * g - 18 * b + 128) >> 8) + div255(128 * a));
+}
+
+SROverlay::SROverlay(): layers(std::make_shared<const Layers>()), changes(0) {}
+
+void SROverlay::publish(const std::shared_ptr<const Layers> &next) {
+    std::atomic_store(&layers, next);
+    changes.fetch_add(1, std::memory_order_release);
+}
+
+void SROverlay::setLayer(int id, const uint32_t *argb, int width, int height, int x, int y) {
+    //the transparent border is never blended: crop it, to even bounds for the chroma
+    int left = width, top = height, right = 0, bottom = 0;
+    for (int j = 0; j < height; j++)
+        for (int i = 0; i < width; i++)
+            if (argb[(size_t) j * width + i] >> 24) {
+                left = std::min(left, i);
+                right = std::max(right, i + 1);
+                top = std::min(top, j);
+                bottom = std::max(bottom, j + 1);
+            }
+    std::shared_ptr<Layer> layer = std::make_shared<Layer>();
+    layer->id = id;
+    layer->cropX = right > left ? left & ~1 : 0;
+    layer->cropY = bottom > top ? top & ~1 : 0;
+    layer->width = right > left ? (right - layer->cropX + 1) & ~1 : 0;
+    layer->height = bottom > top ? (bottom - layer->cropY + 1) & ~1 : 0;
+    layer->x = (x & ~1) + layer->cropX;
+    layer->y = (y & ~1) + layer->cropY;
+
+    const int w = layer->width, h = layer->height, cw = w / 2;
+    std::shared_ptr<Planes> planes = std::make_shared<Planes>();
+    planes->luma.resize((size_t) w * h);
+    planes->lumaAlpha.resize((size_t) w * h);
+    planes->u.resize((size_t) cw * h / 2);
+    planes->v.resize((size_t) cw * h / 2);
+    planes->chromaAlpha.resize((size_t) cw * h / 2);
+    planes->uv.resize((size_t) w * h / 2);
+    planes->uvAlpha.resize((size_t) w * h / 2);
+    //the padding of an odd image is transparent
+    auto pixel = [&](int i, int j) -> uint32_t {
+        i += layer->cropX;
+        j += layer->cropY;
+        return i < width && j < height ? argb[(size_t) j * width + i] : 0;
+    };
+    for (int j = 0; j < h; j += 2) {
+        for (int i = 0; i < w; i += 2) {
+            int r = 0, g = 0, b = 0, a = 0;
+            for (int k = 0; k < 4; k++) {
+                uint32_t p = pixel(i + (k & 1), j + (k >> 1));
+                int pr = (p >> 16) & 0xff, pg = (p >> 8) & 0xff, pb = p & 0xff, pa = p >> 24;
+                size_t at = (size_t) (j + (k >> 1)) * w + i + (k & 1);
+                planes->luma[at] = premultipliedY(pr, pg, pb, pa);
+                planes->lumaAlpha[at] = (uint8_t) pa;
+                r += pr;
+                g += pg;
+                b += pb;
+                a += pa;
+            }
+            r = (r + 2) >> 2;
+            g = (g + 2) >> 2;
+            b = (b + 2) >> 2;
+            a = (a + 2) >> 2;
+            size_t c = (size_t) j / 2 * cw + i / 2;
+            planes->u[c] = premultipliedU(r, g, b, a);
+            planes->v[c] = premultipliedV(r, g, b, a);
+            planes->chromaAlpha[c] = (uint8_t) a;
+            size_t uv = (size_t) j / 2 * w + i;
+            planes->uv[uv] = planes->u[c];
+            planes->uv[uv + 1] = planes->v[c];
+            planes->uvAlpha[uv] = planes->uvAlpha[uv + 1] = (uint8_t) a;
+        }
+    }
+    layer->planes = planes;
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<Layers> next = std::make_shared<Layers>(*std::atomic_load(&layers));
+    auto it = std::lower_bound(next->begin(), next->end(), id,
+                               [](const std::shared_ptr<const Layer> &l, int id){return l->id < id;});
+    if (it != next->end() && (*it)->id == id)
+        *it = layer;
+    else
+        next->insert(it, layer);
+    publish(next);
+}
+
+void SROverlay::moveLayer(int id, int x, int y) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<Layers> next = std::make_shared<Layers>(*std::atomic_load(&layers));
+    for (auto &l : *next) {
+        if (l->id != id)
+            continue;
+        //the planes are shared with the previous snapshot, only the position changes
+        std::shared_ptr<Layer> moved = std::make_shared<Layer>(*l);
+        moved->x = (x & ~1) + moved->cropX;
+        moved->y = (y & ~1) + moved->cropY;
+        l = moved;
+        publish(next);
+        return;
+    }
+}
+
+void SROverlay::removeLayer(int id) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<Layers> next = std::make_shared<Layers>(*std::atomic_load(&layers));
+    auto it = std::remove_if(next->begin(), next->end(),
+                             [id](const std::shared_ptr<const Layer> &l){return l->id == id;});
+    if (it == next->end())
+        return;
+    next->erase(it, next->end());
+    publish(next);
+}
+
+void SROverlay::clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    publish(std::make_shared<const Layers>());
+}
+
+bool SROverlay::empty() const {
+    return std::atomic_load(&layers)->empty();
+}
+
+bool SROverlay::composite(AVFrame *frame) const {
+    std::shared_ptr<const Layers> current = std::atomic_load(&layers);
+    if (current->empty())
+        return true;
+    bool nv12 = frame->format == AV_PIX_FMT_NV12;
+    if (frame->hw_frames_ctx ||
+        (!nv12 && frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P))
+        return false;
+
+    for (const auto &l : *current) {
+        //even bounds: a chroma sample is either covered or not
+        int x0 = std::max(l->x, 0), y0 = std::max(l->y, 0);
+        int x1 = std::min(l->x + l->width, frame->width & ~1), y1 = std::min(l->y + l->height, frame->height & ~1);
+        if (x1 <= x0 || y1 <= y0)
+            continue;
+        int sx = x0 - l->x, sy = y0 - l->y, w = x1 - x0, h = y1 - y0;
+        size_t at = (size_t) sy * l->width + sx;
+        blendPlane(frame->data[0] + (size_t) y0 * frame->linesize[0] + x0, frame->linesize[0],
+                   &l->planes->luma[at], &l->planes->lumaAlpha[at], l->width, w, h);
+        if (nv12) {
+            size_t uv = (size_t) sy / 2 * l->width + sx;
+            blendPlane(frame->data[1] + (size_t) y0 / 2 * frame->linesize[1] + x0, frame->linesize[1],
+                       &l->planes->uv[uv], &l->planes->uvAlpha[uv], l->width, w, h / 2);
+        } else {
+            int cw = l->width / 2;
+            size_t c = (size_t) sy / 2 * cw + sx / 2;
+            blendPlane(frame->data[1] + (size_t) y0 / 2 * frame->linesize[1] + x0 / 2, frame->linesize[1],
+                       &l->planes->u[c], &l->planes->chromaAlpha[c], cw, w / 2, h / 2);
+            blendPlane(frame->data[2] + (size_t) y0 / 2 * frame->linesize[2] + x0 / 2, frame->linesize[2],
+                       &l->planes->v[c], &l->planes->chromaAlpha[c], cw, w / 2, h / 2);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,87 @@
+//
+// Overlay layers (click highlights, keystrokes, watermark) composited on the converted YUV frames.
+//
+
+#ifndef CPPSCREENRECORDER_SROVERLAY_H
+#define CPPSCREENRECORDER_SROVERLAY_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+extern "C"
+{
+#include "libavutil/frame.h"
+}
+
+/**
+ * SROverlay holds the layers burnt into the recording, each one a premultiplied ARGB image at a position
+ * of the output frame.\n
+ * setLayer() converts the image once to premultiplied Y, U and V planes with their alpha, BT.601 limited range
+ * like the converted frames, and crops away its transparent border: composite() then only blends the rectangles
+ * of the layers into the planes of each frame, so a static overlay costs the blend of its visible pixels and
+ * nothing else. The layers are published as an immutable snapshot, composite() never waits for setLayer().
+ *
+ * @Note YUV420P and NV12 frames, other formats and device frames are left as they are
+ */
+class SROverlay {
+
+private:
+    struct Planes {
+        std::vector<uint8_t> luma, lumaAlpha;       //width x height
+        std::vector<uint8_t> u, v, chromaAlpha;     //width / 2 x height / 2
+        std::vector<uint8_t> uv, uvAlpha;           //interleaved for NV12, width x height / 2
+    };
+    struct Layer {
+        int id;
+        int x, y;           //even, in output pixels, of the cropped image
+        int cropX, cropY;   //offset of the cropped image in the one of setLayer()
+        int width, height;  //even, of the cropped image
+        std::shared_ptr<const Planes> planes;   //kept by moveLayer()
+    };
+    typedef std::vector<std::shared_ptr<const Layer>> Layers;
+
+    std::mutex lock;    //writers only
+    std::shared_ptr<const Layers> layers;
+    std::atomic<uint32_t> changes;
+
+    void publish(const std::shared_ptr<const Layers> &next);
+
+public:
+    SROverlay();
+
+    SROverlay(const SROverlay&) = delete;
+    SROverlay &operator=(const SROverlay&) = delete;
+
+    /**
+     * setLayer() adds the layer id, or replaces its image, drawn in the order of the ids
+     * @param argb width x height premultiplied 0xAARRGGBB pixels, copied
+     * @param x position of the top left corner in the output frame, rounded down to even
+     */
+    void setLayer(int id, const uint32_t *argb, int width, int height, int x, int y);
+
+    /**
+     * moveLayer() moves the layer id without converting its image again
+     */
+    void moveLayer(int id, int x, int y);
+
+    void removeLayer(int id);
+    void clear();
+
+    /**
+     * changeCount() counts the changes of the layers: a frame identical to the previous one differs after a change
+     */
+    uint32_t changeCount() const { return changes.load(std::memory_order_acquire); }
+
+    bool empty() const;
+
+    /**
+     * composite() blends the layers into the planes of frame, clipped to it
+     * @return false if frame has a format the layers cannot be blended into
+     */
+    bool composite(AVFrame *frame) const;
+};
+
+#endif //CPPSCREENRECORDER_SROVERLAY_H
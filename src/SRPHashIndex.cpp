@@ -0,0 +1,270 @@
+#include "SRPHashIndex.h"
+#include "SRLog.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+extern "C"
+{
+#include "libavutil/avutil.h"
+#include "libavutil/common.h"
+#include "libavutil/cpu.h"
+#include "libavutil/error.h"
+#include "libavutil/frame.h"
+#include "libavutil/pixdesc.h"
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SR_HAVE_AVX2 1
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SR_HAVE_POPCNT 1
+#endif
+
+using namespace std;
+
+typedef void (*SRSearchFn)(const uint8_t *base, size_t count, size_t entrySize, uint64_t hash, int maxDistance,
+                           std::vector<SRPHashMatch> &matches);
+
+static void searchC(const uint8_t *base, size_t count, size_t entrySize, uint64_t hash, int maxDistance,
+                    std::vector<SRPHashMatch> &matches) {
+    for (size_t i = 0; i < count; i++) {
+        const SRPHashEntry *entry = (const SRPHashEntry *) (base + i * entrySize);
+        int d = SRPHashIndex::distance(entry->hash, hash);
+        if (d <= maxDistance)
+            matches.push_back({entry->pts, d});
+    }
+}
+
+#ifdef SR_HAVE_POPCNT
+__attribute__((target("popcnt")))
+static void searchPOPCNT(const uint8_t *base, size_t count, size_t entrySize, uint64_t hash, int maxDistance,
+                         std::vector<SRPHashMatch> &matches) {
+    for (size_t i = 0; i < count; i++) {
+        const SRPHashEntry *entry = (const SRPHashEntry *) (base + i * entrySize);
+        int d = (int) _mm_popcnt_u64(entry->hash ^ hash);
+        if (d <= maxDistance)
+            matches.push_back({entry->pts, d});
+    }
+}
+#endif
+
+#ifdef SR_HAVE_AVX2
+/**
+ * searchAVX2() compares 4 entries of 16 bytes per iteration: the unpack takes their hashes out of the pts, in the
+ * order 0, 2, 1, 3 of its 128 bit lanes, a nibble table counts the bits of each byte and the sum of absolute
+ * differences adds them up per hash
+ */
+__attribute__((target("avx2")))
+static void searchAVX2(const uint8_t *base, size_t count, size_t entrySize, uint64_t hash, int maxDistance,
+                       std::vector<SRPHashMatch> &matches) {
+    static const int order[4] = {0, 2, 1, 3};
+    const __m256i query = _mm256_set1_epi64x((int64_t) hash);
+    const __m256i limit = _mm256_set1_epi64x(maxDistance);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i bits = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const uint8_t *p = base + i * sizeof(SRPHashEntry);
+        __m256i a = _mm256_loadu_si256((const __m256i *) p);
+        __m256i b = _mm256_loadu_si256((const __m256i *) (p + 32));
+        __m256i x = _mm256_xor_si256(_mm256_unpackhi_epi64(a, b), query);
+        __m256i n = _mm256_add_epi8(_mm256_shuffle_epi8(bits, _mm256_and_si256(x, nibble)),
+                                    _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble)));
+        __m256i d = _mm256_sad_epu8(n, _mm256_setzero_si256());
+        int far = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(d, limit)));
+        if (far == 15)
+            continue;
+        alignas(32) int64_t distances[4];
+        _mm256_store_si256((__m256i *) distances, d);
+        //back in pts order
+        for (int k : {0, 2, 1, 3})
+            if (!(far & (1 << k)))
+                matches.push_back({((const SRPHashEntry *) (p + order[k] * sizeof(SRPHashEntry)))->pts,
+                                   (int) distances[k]});
+    }
+    searchC(base + i * entrySize, count - i, entrySize, hash, maxDistance, matches);
+}
+#endif
+
+static SRSearchFn selectSearch(size_t entrySize) {
+#ifdef SR_HAVE_AVX2
+    //the unpack needs the entries of this version, packed
+    if (entrySize == sizeof(SRPHashEntry) && (av_get_cpu_flags() & AV_CPU_FLAG_AVX2))
+        return searchAVX2;
+#endif
+#ifdef SR_HAVE_POPCNT
+    //every CPU with SSE4.2 has POPCNT
+    if (av_get_cpu_flags() & AV_CPU_FLAG_SSE42)
+        return searchPOPCNT;
+#endif
+    (void) entrySize;
+    return searchC;
+}
+
+SRPHashIndex::SRPHashIndex(): file(nullptr), entries(0), hashed(0), nextPts(AV_NOPTS_VALUE), lastHash(0) {}
+
+SRPHashIndex::~SRPHashIndex() {
+    close();
+}
+
+int SRPHashIndex::open(const char *path) {
+    this->path = path;
+    file = fopen(path, "wb");
+    if (!file) {
+        cout << "\n[SRPHashIndex] cannot create " << path;
+        return AVERROR(errno);
+    }
+    SRPHashHeader header;
+    memcpy(header.magic, PHASH_MAGIC, sizeof(header.magic));
+    header.version = PHASH_VERSION;
+    header.entrySize = sizeof(SRPHashEntry);
+    header.flags = 0;
+    if (fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file)) {
+        cout << "\n[SRPHashIndex] cannot write " << path;
+        close();
+        return AVERROR(EIO);
+    }
+    return 0;
+}
+
+void SRPHashIndex::send(const AVFrame *frame, bool keyframe) {
+    if (!file || (!keyframe && nextPts != AV_NOPTS_VALUE && frame->pts < nextPts))
+        return;
+    nextPts = frame->pts + (int64_t) PHASH_INTERVAL * 1000;
+    uint64_t h;
+    if (!hashFrame(frame, h))
+        return;
+    hashed++;
+    if (!entries || distance(h, lastHash) >= PHASH_MIN_DISTANCE)
+        add(frame->pts, h);
+}
+
+void SRPHashIndex::add(int64_t pts, uint64_t hash) {
+    SRPHashEntry entry = {pts, hash};
+    //one entry per change of the screen, a write every few seconds at most
+    if (fwrite(&entry, sizeof(entry), 1, file) != 1 || fflush(file)) {
+        srLog(SR_LOG_ERROR, "[SRPHashIndex] cannot write %s, the index stops here", path.c_str());
+        close();
+        return;
+    }
+    lastHash = hash;
+    entries++;
+}
+
+void SRPHashIndex::close() {
+    if (!file)
+        return;
+    fclose(file);
+    file = nullptr;
+}
+
+uint64_t SRPHashIndex::hash(const uint8_t *data, int linesize, int width, int height, int step) {
+    //cos((2n + 1) k pi / 2N) of the 8 lowest frequencies
+    static const struct CT {
+        float c[8][PHASH_SIZE];
+        CT() {
+            for (int k = 0; k < 8; k++)
+                for (int n = 0; n < PHASH_SIZE; n++)
+                    c[k][n] = (float) cos((2 * n + 1) * k * M_PI / (2 * PHASH_SIZE));
+        }
+    } table;
+    if (width <= 0 || height <= 0)
+        return 0;
+
+    //the cells are averaged from PHASH_SAMPLES x PHASH_SAMPLES samples spread over them, not every pixel
+    int columns[PHASH_SIZE][PHASH_SAMPLES];
+    int taken[PHASH_SIZE];
+    for (int j = 0; j < PHASH_SIZE; j++) {
+        int left = FFMIN(j * width / PHASH_SIZE, width - 1), right = FFMAX(left + 1, (j + 1) * width / PHASH_SIZE);
+        taken[j] = FFMIN(PHASH_SAMPLES, right - left);
+        for (int s = 0; s < taken[j]; s++)
+            columns[j][s] = (left + (2 * s + 1) * (right - left) / (2 * taken[j])) * step;
+    }
+    float luma[PHASH_SIZE][PHASH_SIZE];
+    for (int i = 0; i < PHASH_SIZE; i++) {
+        int top = FFMIN(i * height / PHASH_SIZE, height - 1), bottom = FFMAX(top + 1, (i + 1) * height / PHASH_SIZE);
+        int rows = FFMIN(PHASH_SAMPLES, bottom - top);
+        uint32_t sums[PHASH_SIZE] = {0};
+        for (int r = 0; r < rows; r++) {
+            const uint8_t *row = data + (ptrdiff_t) (top + (2 * r + 1) * (bottom - top) / (2 * rows)) * linesize;
+            for (int j = 0; j < PHASH_SIZE; j++)
+                for (int s = 0; s < taken[j]; s++)
+                    sums[j] += row[columns[j][s]];
+        }
+        for (int j = 0; j < PHASH_SIZE; j++)
+            luma[i][j] = (float) sums[j] / (rows * taken[j]);
+    }
+
+    //separable DCT-II, only the coefficients the hash keeps
+    float partial[PHASH_SIZE][8], coefficients[64];
+    for (int i = 0; i < PHASH_SIZE; i++)
+        for (int l = 0; l < 8; l++) {
+            float sum = 0;
+            for (int n = 0; n < PHASH_SIZE; n++)
+                sum += luma[i][n] * table.c[l][n];
+            partial[i][l] = sum;
+        }
+    for (int k = 0; k < 8; k++)
+        for (int l = 0; l < 8; l++) {
+            float sum = 0;
+            for (int n = 0; n < PHASH_SIZE; n++)
+                sum += partial[n][l] * table.c[k][n];
+            coefficients[k * 8 + l] = sum;
+        }
+
+    //the DC term is the mean brightness, far above the others: the median leaves it out
+    float sorted[63];
+    std::copy(coefficients + 1, coefficients + 64, sorted);
+    std::nth_element(sorted, sorted + 31, sorted + 63);
+    float median = sorted[31];
+    uint64_t h = 0;
+    for (int b = 0; b < 64; b++)
+        if (coefficients[b] > median)
+            h |= (uint64_t) 1 << b;
+    return h;
+}
+
+bool SRPHashIndex::hashFrame(const AVFrame *frame, uint64_t &hash) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat) frame->format);
+    if (frame->hw_frames_ctx || !desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)) ||
+        (desc->flags & AV_PIX_FMT_FLAG_BE))
+        return false;
+    //the luma, or the green that carries most of it
+    const AVComponentDescriptor &c = desc->comp[(desc->flags & AV_PIX_FMT_FLAG_RGB) && desc->nb_components >= 3 ? 1 : 0];
+    int offset = c.offset;
+    if (c.depth > 8) {
+        //the high byte of a sample aligned on the most significant bits (P010)
+        if (c.shift + c.depth != 16)
+            return false;
+        offset++;
+    } else if (c.depth != 8 || c.shift)
+        return false;
+    if (!frame->data[c.plane])
+        return false;
+    hash = SRPHashIndex::hash(frame->data[c.plane] + offset, frame->linesize[c.plane], frame->width, frame->height,
+                              c.step);
+    return true;
+}
+
+int SRPHashIndex::distance(uint64_t a, uint64_t b) {
+    return __builtin_popcountll(a ^ b);
+}
+
+size_t SRPHashIndex::search(const void *data, size_t size, uint64_t hash, int maxDistance,
+                            std::vector<SRPHashMatch> &matches) {
+    const SRPHashHeader *header = (const SRPHashHeader *) data;
+    if (!data || size < sizeof(*header) || memcmp(header->magic, PHASH_MAGIC, sizeof(header->magic)) ||
+        header->entrySize < sizeof(SRPHashEntry))
+        return 0;
+    size_t count = (size - sizeof(*header)) / header->entrySize;
+    static const SRSearchFn packed = selectSearch(sizeof(SRPHashEntry));
+    SRSearchFn kernel = header->entrySize == sizeof(SRPHashEntry) ? packed : selectSearch(header->entrySize);
+    kernel((const uint8_t *) data + sizeof(*header), count, header->entrySize, hash, maxDistance, matches);
+    return count;
+}
@@ -0,0 +1,126 @@
+//
+// Perceptual hash index written next to the recording: one 64 bit DCT hash per change of the screen, searched by
+// Hamming distance.
+//
+
+#ifndef CPPSCREENRECORDER_SRPHASHINDEX_H
+#define CPPSCREENRECORDER_SRPHASHINDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct AVFrame;
+
+#define PHASH_MAGIC "SRPH"
+#define PHASH_VERSION 1
+#define PHASH_INTERVAL 1000     //ms between two frames hashed, a forced keyframe is hashed whenever it comes
+#define PHASH_MIN_DISTANCE 6    //bits a hash must differ by from the previous entry to make one of its own
+#define PHASH_SIZE 32   //px of the luma square the DCT runs on
+#define PHASH_SAMPLES 8     //samples per cell side the luma square averages, a 1080p frame reads 1/50 of its pixels
+
+/**
+ * Header of a perceptual hash index, followed by the entries up to the end of the file.
+ * Every field is in the byte order of the recording host.
+ */
+typedef struct PX{
+    char magic[4];  //PHASH_MAGIC
+    uint32_t version;
+    uint32_t entrySize;     //sizeof(SRPHashEntry), newer versions may only append fields
+    uint32_t flags;
+}SRPHashHeader;
+
+/**
+ * One hashed frame, in pts order: the screen looked like hash from pts to the pts of the next entry.
+ */
+typedef struct PE{
+    int64_t pts;    //us on the capture clock, as the stream timestamps: SRKeyIndex::find() gives the keyframe to seek to
+    uint64_t hash;
+}SRPHashEntry;
+
+/**
+ * One entry of search().
+ */
+typedef struct PM{
+    int64_t pts;
+    int distance;   //bits the entry differs by from the query
+}SRPHashMatch;
+
+/**
+ * SRPHashIndex writes the perceptual hash of the recorded screen next to the recording, so that thousands of hours
+ * of recordings can be searched for a screen without decoding them.\n
+ * The hash is the classic DCT one: the luma is averaged into a PHASH_SIZE square, the 8 x 8 lowest frequencies of
+ * its DCT each give one bit, set when it is above their median. It survives scaling, compression and small edits;
+ * two captures of the same screen are a few bits apart, unrelated screens about 32.\n
+ * send() hashes a frame every PHASH_INTERVAL ms and every forced keyframe (segment cuts, scene changes). An entry is
+ * only written when the screen moved PHASH_MIN_DISTANCE bits away from the previous one: a static hour costs an
+ * entry, not 3600. The entries are sorted by pts and reach the file as they are added, like SRKeyIndex.\n
+ * search() runs over a mapped index: 4 entries at a time with AVX2 (a nibble table popcount), one with the POPCNT
+ * instruction otherwise.
+ *
+ * @Note ProducerThread only, apart from open() and close(); system memory frames only
+ */
+class SRPHashIndex {
+
+private:
+    std::string path;
+    FILE *file;
+    uint64_t entries;
+    uint64_t hashed;
+    int64_t nextPts;
+    uint64_t lastHash;
+
+    void add(int64_t pts, uint64_t hash);
+
+public:
+    SRPHashIndex();
+    ~SRPHashIndex();
+
+    SRPHashIndex(const SRPHashIndex&) = delete;
+    SRPHashIndex &operator=(const SRPHashIndex&) = delete;
+
+    /**
+     * open() creates the index and writes its header
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int open(const char *path);
+
+    /**
+     * send() hashes frame when it is due
+     * @param keyframe the encoder is asked for a keyframe on it
+     * @Note frame pts in microseconds on the capture clock
+     */
+    void send(const AVFrame *frame, bool keyframe);
+
+    void close();
+
+    const std::string &name() const { return path; }
+    uint64_t size() const { return entries; }
+    uint64_t hashedFrames() const { return hashed; }
+
+    /**
+     * hash() is the perceptual hash of an 8 bit plane, for the query of a screenshot as for the recorded frames
+     * @param step bytes between two samples of a row (4 reads one channel of a packed 32 bit RGB picture)
+     */
+    static uint64_t hash(const uint8_t *data, int linesize, int width, int height, int step);
+
+    /**
+     * hashFrame() is the perceptual hash of the luma of frame, of its green channel for an RGB format
+     * @return false for a hardware frame or a format without 8 to 16 bit samples
+     */
+    static bool hashFrame(const AVFrame *frame, uint64_t &hash);
+
+    static int distance(uint64_t a, uint64_t b);
+
+    /**
+     * search() appends the entries of a mapped or loaded index within maxDistance bits of hash
+     * @param data the whole index file, header included
+     * @return the number of entries searched, 0 when data is not an index
+     */
+    static size_t search(const void *data, size_t size, uint64_t hash, int maxDistance,
+                         std::vector<SRPHashMatch> &matches);
+};
+
+#endif //CPPSCREENRECORDER_SRPHASHINDEX_H
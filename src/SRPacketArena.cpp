@@ -0,0 +1,190 @@
+#include "SRPacketArena.h"
+
+#include <algorithm>
+#include <cstring>
+
+extern "C"
+{
+#include "libavutil/error.h"
+#include "libavutil/mem.h"
+}
+
+SRPacketArena::SRPacketArena(int64_t maxBytes, size_t slabSize): slabSize(slabSize),
+        maxSpare((size_t) (maxBytes / (int64_t) slabSize) + 1), current(nullptr), allocated(0) {}
+
+SRPacketArena::~SRPacketArena() {
+    //the owner released its packets first: the current slab only holds its own reference
+    if (current)
+        unref(current);
+    for (Slab *slab : spare)
+        freeSlab(slab);
+}
+
+SRPacketArena::Slab *SRPacketArena::newSlab(size_t size) {
+    if (size == slabSize) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!spare.empty()) {
+            Slab *slab = spare.back();
+            spare.pop_back();
+            slab->used = 0;
+            slab->refs = 1;
+            return slab;
+        }
+    }
+    uint8_t *data = (uint8_t *) av_malloc(size);
+    if (!data)
+        return nullptr;
+    Slab *slab = new Slab();
+    slab->owner = this;
+    slab->data = data;
+    slab->size = size;
+    slab->used = 0;
+    slab->refs = 1;
+    allocated++;
+    std::lock_guard<std::mutex> guard(lock);
+    slabs.push_back(slab);
+    return slab;
+}
+
+/**
+ * reserve() takes need bytes of the current slab, or of a new one when it is full
+ * @param data set to the first byte
+ * @return the slab, with a reference for the caller, nullptr when no memory is left
+ */
+SRPacketArena::Slab *SRPacketArena::reserve(size_t need, uint8_t **data) {
+    Slab *slab = current;
+    if (need > slabSize) {
+        //an oversized payload: its own slab, recycled nowhere
+        slab = newSlab(need);
+        if (!slab)
+            return nullptr;
+    } else if (!slab || slab->used + need > slab->size) {
+        Slab *fresh = newSlab(slabSize);
+        if (!fresh)
+            return nullptr;
+        if (current)
+            unref(current);
+        current = slab = fresh;
+        slab->refs++;
+    } else
+        slab->refs++;
+    *data = slab->data + slab->used;
+    slab->used += need;
+    return slab;
+}
+
+bool SRPacketArena::store(const AVPacket *pkt, SRArenaPacket &out) {
+    size_t need = FFALIGN((size_t) pkt->size + AV_INPUT_BUFFER_PADDING_SIZE, ARENA_ALIGNMENT);
+    Slab *slab = reserve(need, &out.data);
+    if (!slab)
+        return false;
+    memcpy(out.data, pkt->data, pkt->size);
+    memset(out.data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    out.size = pkt->size;
+    out.pts = pkt->pts;
+    out.dts = pkt->dts;
+    out.duration = pkt->duration;
+    out.flags = pkt->flags;
+    out.stream_index = pkt->stream_index;
+    out.slab = slab;
+    return true;
+}
+
+AVBufferRef *SRPacketArena::allocate(int size) {
+    uint8_t *data;
+    Slab *slab = reserve(FFALIGN((size_t) size + AV_INPUT_BUFFER_PADDING_SIZE, ARENA_ALIGNMENT), &data);
+    if (!slab)
+        return nullptr;
+    AVBufferRef *buf = av_buffer_create(data, size + AV_INPUT_BUFFER_PADDING_SIZE, freeBuffer, slab, 0);
+    if (!buf)
+        unref(slab);
+    return buf;
+}
+
+void SRPacketArena::freeBuffer(void *opaque, uint8_t *data) {
+    Slab *slab = (Slab *) opaque;
+    (void) data;
+    slab->owner->unref(slab);
+}
+
+int SRPacketArena::getEncodeBuffer(struct AVCodecContext *ctx, AVPacket *pkt, int flags) {
+    SRPacketArena *arena = (SRPacketArena *) ctx->opaque;
+    (void) flags;
+    pkt->buf = arena->allocate(pkt->size);
+    if (!pkt->buf)
+        return AVERROR(ENOMEM);
+    pkt->data = pkt->buf->data;
+    return 0;
+}
+
+bool SRPacketArena::adopt(const AVPacket *pkt, SRArenaPacket &out) {
+    if (!pkt->buf)
+        return false;
+    //the packet keeps its slab alive: only the lookup needs the lock
+    Slab *slab = (Slab *) av_buffer_get_opaque(pkt->buf);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (std::find(slabs.begin(), slabs.end(), slab) == slabs.end())
+            return false;
+    }
+    slab->refs++;
+    out.data = pkt->data;
+    out.size = pkt->size;
+    out.pts = pkt->pts;
+    out.dts = pkt->dts;
+    out.duration = pkt->duration;
+    out.flags = pkt->flags;
+    out.stream_index = pkt->stream_index;
+    out.slab = slab;
+    return true;
+}
+
+void SRPacketArena::retain(const SRArenaPacket &packet) {
+    ((Slab *) packet.slab)->refs++;
+}
+
+void SRPacketArena::release(SRArenaPacket &packet) {
+    if (!packet.slab)
+        return;
+    //an adopted packet goes back to the arena of its slab
+    Slab *slab = (Slab *) packet.slab;
+    slab->owner->unref(slab);
+    packet.slab = nullptr;
+    packet.data = nullptr;
+}
+
+/**
+ * unref() drops one reference of slab: the last one puts it back on the free list, or frees it beyond maxSpare
+ */
+void SRPacketArena::unref(Slab *slab) {
+    if (--slab->refs > 0)
+        return;
+    if (slab->size == slabSize) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (spare.size() < maxSpare) {
+            spare.push_back(slab);
+            return;
+        }
+    }
+    freeSlab(slab);
+}
+
+void SRPacketArena::freeSlab(Slab *slab) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        slabs.erase(std::find(slabs.begin(), slabs.end(), slab));
+    }
+    av_free(slab->data);
+    delete slab;
+}
+
+void SRPacketArena::toPacket(const SRArenaPacket &packet, AVPacket *pkt) {
+    av_init_packet(pkt);
+    pkt->data = packet.data;
+    pkt->size = packet.size;
+    pkt->pts = packet.pts;
+    pkt->dts = packet.dts;
+    pkt->duration = packet.duration;
+    pkt->flags = packet.flags;
+    pkt->stream_index = packet.stream_index;
+}
@@ -0,0 +1,119 @@
+//
+// Slab allocator for the payloads of the encoded packets kept by the replay buffer, and written by the video encoder.
+//
+
+#ifndef CPPSCREENRECORDER_SRPACKETARENA_H
+#define CPPSCREENRECORDER_SRPACKETARENA_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+}
+
+#define ARENA_SLAB_SIZE (4 << 20)   //bytes of each slab, a few GOPs of a screen recording
+#define ARENA_ALIGNMENT 64  //alignment of each payload in its slab
+
+/**
+ * An encoded packet whose payload lives in an SRPacketArena slab: a plain struct, no heap allocation of its own.
+ * Side data is not kept.
+ */
+typedef struct AP{
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+    uint8_t *data;
+    int size;
+    int flags;
+    int stream_index;
+    void *slab;
+}SRArenaPacket;
+
+/**
+ * SRPacketArena copies packet payloads one after the other into large slabs, instead of a heap buffer each.\n
+ * A slab counts the packets it holds: when the last one is released the whole slab goes back to a free list
+ * and is reused as it is, so a replay buffer evicting its oldest GOPs recycles their memory in bulk
+ * and, once warm, allocates nothing. A payload larger than a slab gets a slab of its own, freed with it.\n
+ * getEncodeBuffer() lets an encoder write its packets straight into the slabs: they are refcounted AVPackets
+ * the muxer may hold as usual, and another arena may adopt() them without a copy.
+ *
+ * @Note store() and allocate() from one thread only, retain(), release() and adopt() from any thread
+ */
+class SRPacketArena {
+
+private:
+    struct Slab {
+        SRPacketArena *owner;
+        uint8_t *data;
+        size_t size;
+        size_t used;
+        std::atomic<int> refs;  //packets stored in it, plus one while it is the current slab
+    };
+
+    size_t slabSize;
+    size_t maxSpare;
+    Slab *current;
+    std::mutex lock;
+    std::vector<Slab*> spare;
+    std::vector<Slab*> slabs;   //all of them, under lock: adopt() only trusts these
+    std::atomic<uint64_t> allocated;
+
+    Slab *newSlab(size_t size);
+    Slab *reserve(size_t need, uint8_t **data);
+    void unref(Slab *slab);
+    void freeSlab(Slab *slab);
+    static void freeBuffer(void *opaque, uint8_t *data);
+
+public:
+    /**
+     * @param maxBytes slabs kept on the free list, in bytes: the memory the owner expects to hold at most
+     */
+    explicit SRPacketArena(int64_t maxBytes, size_t slabSize = ARENA_SLAB_SIZE);
+    ~SRPacketArena();
+
+    SRPacketArena(const SRPacketArena&) = delete;
+    SRPacketArena &operator=(const SRPacketArena&) = delete;
+
+    /**
+     * store() copies pkt into the current slab, or into a new one when it is full
+     * @return false when no memory is left
+     */
+    bool store(const AVPacket *pkt, SRArenaPacket &out);
+
+    /**
+     * allocate() gives a buffer of size bytes plus the padding in a slab, which it keeps alive until unreferenced
+     * @return nullptr when no memory is left
+     */
+    AVBufferRef *allocate(int size);
+
+    /**
+     * adopt() takes a reference on the slab holding the payload of pkt, when it is a buffer of allocate()
+     * @return false when pkt is not in this arena: the caller copies it
+     */
+    bool adopt(const AVPacket *pkt, SRArenaPacket &out);
+
+    /**
+     * getEncodeBuffer() is an AVCodecContext.get_encode_buffer of the arena in the opaque of the context
+     */
+    static int getEncodeBuffer(struct AVCodecContext *ctx, AVPacket *pkt, int flags);
+
+    /**
+     * retain() keeps the slab of packet alive for one more release(), also for the packets of adopt()
+     */
+    void retain(const SRArenaPacket &packet);
+    void release(SRArenaPacket &packet);
+
+    /**
+     * toPacket() points pkt at the payload, without a reference: valid until the packet is released
+     */
+    static void toPacket(const SRArenaPacket &packet, AVPacket *pkt);
+
+    uint64_t slabsAllocated() const { return allocated; }
+};
+
+#endif //CPPSCREENRECORDER_SRPACKETARENA_H
@@ -0,0 +1,72 @@
+#include "SRPacketReorder.h"
+
+SRPacketReorder::SRPacketReorder(): depth(1), rewrite(false), lastDts(AV_NOPTS_VALUE), fixed(0) {}
+
+void SRPacketReorder::init(int reorderDepth) {
+    depth = reorderDepth > 0 ? reorderDepth : 1;
+    rewrite = false;
+    lastDts = AV_NOPTS_VALUE;
+    fixed = 0;
+    held.clear();
+    heldPts = decltype(heldPts)();
+}
+
+/* the last checks of a packet leaving: increasing dts, pts not below it */
+void SRPacketReorder::release(AVPacket *pkt, std::vector<AVPacket*> &out) {
+    int64_t dts = pkt->dts;
+    if(lastDts != AV_NOPTS_VALUE && dts <= lastDts)
+        dts = lastDts + 1;
+    //the dts gives way: a moved pts would show the frame at another time
+    if(pkt->pts != AV_NOPTS_VALUE && pkt->pts < dts) {
+        if(lastDts == AV_NOPTS_VALUE || pkt->pts > lastDts)
+            dts = pkt->pts;
+        else
+            pkt->pts = dts;     //no dts fits between the last one and the pts, the frame moves a tick
+    }
+    if(dts != pkt->dts)
+        fixed++;
+    pkt->dts = dts;
+    lastDts = dts;
+    out.push_back(pkt);
+}
+
+/* the oldest held packet leaves with the lowest held pts as its dts */
+void SRPacketReorder::releaseOldest(std::vector<AVPacket*> &out) {
+    AVPacket *next = held.front();
+    held.pop_front();
+    int64_t dts = lastDts != AV_NOPTS_VALUE ? lastDts + 1 : 0;
+    if(!heldPts.empty()) {
+        dts = heldPts.top();
+        heldPts.pop();
+    }
+    if(next->dts != dts)
+        fixed++;
+    next->dts = dts;
+    release(next, out);
+}
+
+void SRPacketReorder::push(AVPacket *pkt, std::vector<AVPacket*> &out) {
+    if(!rewrite) {
+        bool valid = pkt->dts != AV_NOPTS_VALUE && (pkt->pts == AV_NOPTS_VALUE || pkt->dts <= pkt->pts) &&
+                     (lastDts == AV_NOPTS_VALUE || pkt->dts >= lastDts);
+        if(valid || pkt->pts == AV_NOPTS_VALUE) {
+            if(pkt->dts == AV_NOPTS_VALUE)
+                pkt->dts = lastDts != AV_NOPTS_VALUE ? lastDts + 1 : 0;
+            release(pkt, out);
+            return;
+        }
+        rewrite = true;
+    }
+
+    //a packet without pts cannot be placed: it keeps its position and follows the one before
+    if(pkt->pts != AV_NOPTS_VALUE)
+        heldPts.push(pkt->pts);
+    held.push_back(pkt);
+    while((int) held.size() > depth)
+        releaseOldest(out);
+}
+
+void SRPacketReorder::flush(std::vector<AVPacket*> &out) {
+    while(!held.empty())
+        releaseOldest(out);
+}
@@ -0,0 +1,70 @@
+//
+// Decode timestamps of the encoded video packets, checked before they reach the muxer.
+//
+
+#ifndef CPPSCREENRECORDER_SRPACKETREORDER_H
+#define CPPSCREENRECORDER_SRPACKETREORDER_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <vector>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+}
+
+/**
+ * SRPacketReorder keeps the dts of one encoded stream strictly increasing and never above the pts.\n
+ * The packets of an encoder with valid timestamps go through as they are, only the collisions of the rescale to the
+ * coarser time base of the stream are moved one tick on. The first packet without a dts, or with one that goes back
+ * or past its pts (the frame-threaded and hardware encoders with B-frames), switches it to rewriting: the packets
+ * are held depth at a time and each one leaving gets the lowest pts still held, which is the dts a decoder reorders
+ * them with. The muxer then takes the packets in the order of their dts, it never buffers to sort them out.
+ *
+ * @Note one thread, the one receiving the packets from the encoder
+ */
+class SRPacketReorder {
+
+private:
+    int depth;
+    bool rewrite;
+    int64_t lastDts;
+    uint64_t fixed;
+    std::deque<AVPacket*> held;
+    std::priority_queue<int64_t, std::vector<int64_t>, std::greater<int64_t>> heldPts;
+
+    void release(AVPacket *pkt, std::vector<AVPacket*> &out);
+    void releaseOldest(std::vector<AVPacket*> &out);
+
+public:
+    SRPacketReorder();
+
+    /**
+     * init() resets the stream state
+     * @param depth packets a frame can be coded ahead of the ones it is shown after
+     */
+    void init(int depth);
+
+    /**
+     * push() takes pkt, in the time base of the stream, and appends to out the packets ready for the muxer
+     * @param pkt packet of the pool, owned by the reorder buffer or by out afterwards
+     */
+    void push(AVPacket *pkt, std::vector<AVPacket*> &out);
+
+    /**
+     * flush() appends the held packets to out, after the last one of the encoder
+     */
+    void flush(std::vector<AVPacket*> &out);
+
+    bool rewriting() const { return rewrite; }
+
+    /**
+     * fixedCount() counts the packets whose dts differs from the one of the encoder
+     */
+    uint64_t fixedCount() const { return fixed; }
+};
+
+#endif //CPPSCREENRECORDER_SRPACKETREORDER_H
@@ -0,0 +1,129 @@
+//
+// Battery and thermal state of the machine, read by the power profile of settings._power.
+//
+
+#include "SRPowerMonitor.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#ifdef __linux__
+#include <dirent.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifdef __APPLE__
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/ps/IOPowerSources.h>
+#include <IOKit/ps/IOPSKeys.h>
+#endif
+
+#ifdef __linux__
+#define POWER_SUPPLY_DIR "/sys/class/power_supply/"
+#define THERMAL_DIR "/sys/class/thermal/"
+#define RAPL_DIR "/sys/class/powercap/intel-rapl:0/"     //package 0, AMD Zen included since Linux 5.8
+
+/* first line of a sysfs attribute, without its newline */
+static std::string readAttribute(const std::string &path) {
+    char line[64] = "";
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f)
+        return std::string();
+    if (!fgets(line, sizeof(line), f))
+        line[0] = 0;
+    fclose(f);
+    line[strcspn(line, "\n")] = 0;
+    return line;
+}
+
+static int64_t readNumber(const std::string &path) {
+    std::string value = readAttribute(path);
+    return value.empty() ? -1 : strtoll(value.c_str(), nullptr, 10);
+}
+#endif
+
+SRPowerStatus SRPowerMonitor::query() {
+    SRPowerStatus status = {false, -1, -1, false};
+#ifdef __linux__
+    DIR *dir = opendir(POWER_SUPPLY_DIR);
+    if (dir) {
+        bool mains = false, discharging = false;
+        while (struct dirent *entry = readdir(dir)) {
+            if (entry->d_name[0] == '.')
+                continue;
+            std::string base = std::string(POWER_SUPPLY_DIR) + entry->d_name + "/";
+            std::string type = readAttribute(base + "type");
+            if (type == "Mains" || type == "USB") {
+                mains |= readNumber(base + "online") == 1;
+            } else if (type == "Battery" && readAttribute(base + "scope") != "Device") {
+                discharging |= readAttribute(base + "status") == "Discharging";
+                int capacity = (int) readNumber(base + "capacity");
+                if (capacity >= 0)
+                    status.batteryPercent = status.batteryPercent < 0 ? capacity : std::min(status.batteryPercent, capacity);
+            }
+        }
+        closedir(dir);
+        //a desktop has no battery, a laptop on its charger reports both
+        status.onBattery = discharging && !mains;
+    }
+    dir = opendir(THERMAL_DIR);
+    if (dir) {
+        while (struct dirent *entry = readdir(dir)) {
+            if (strncmp(entry->d_name, "thermal_zone", 12))
+                continue;
+            int64_t milli = readNumber(std::string(THERMAL_DIR) + entry->d_name + "/temp");
+            if (milli > 0 && milli / 1000 > status.temperature)
+                status.temperature = (int) (milli / 1000);
+        }
+        closedir(dir);
+    }
+#elif defined(_WIN32)
+    SYSTEM_POWER_STATUS power;
+    if (GetSystemPowerStatus(&power)) {
+        status.onBattery = power.ACLineStatus == 0;
+        if (power.BatteryLifePercent <= 100)
+            status.batteryPercent = power.BatteryLifePercent;
+    }
+#elif defined(__APPLE__)
+    CFTypeRef info = IOPSCopyPowerSourcesInfo();
+    if (info) {
+        CFStringRef source = IOPSGetProvidingPowerSourceType(info);
+        status.onBattery = source && CFStringCompare(source, CFSTR(kIOPSBatteryPowerValue), 0) == kCFCompareEqualTo;
+        CFArrayRef list = IOPSCopyPowerSourcesList(info);
+        for (CFIndex i = 0; list && i < CFArrayGetCount(list); i++) {
+            CFDictionaryRef description = IOPSGetPowerSourceDescription(info, CFArrayGetValueAtIndex(list, i));
+            CFNumberRef capacity = description ? (CFNumberRef) CFDictionaryGetValue(description, CFSTR(kIOPSCurrentCapacityKey)) : nullptr;
+            int percent;
+            if (capacity && CFNumberGetValue(capacity, kCFNumberIntType, &percent))
+                status.batteryPercent = percent;
+        }
+        if (list)
+            CFRelease(list);
+        CFRelease(info);
+    }
+#endif
+    status.hot = status.temperature >= POWER_HOT_TEMP;
+    return status;
+}
+
+int64_t SRPowerMonitor::energy() {
+#ifdef __linux__
+    return readNumber(RAPL_DIR "energy_uj");
+#else
+    return -1;
+#endif
+}
+
+int64_t SRPowerMonitor::energyRange() {
+#ifdef __linux__
+    return readNumber(RAPL_DIR "max_energy_range_uj");
+#else
+    return -1;
+#endif
+}
@@ -0,0 +1,57 @@
+//
+// Battery and thermal state of the machine, read by the power profile of settings._power.
+//
+
+#ifndef CPPSCREENRECORDER_SRPOWERMONITOR_H
+#define CPPSCREENRECORDER_SRPOWERMONITOR_H
+
+#include <cstdint>
+
+#define POWER_POLL 5    //s between two reads of the battery and thermal state by the VideoThread
+#define POWER_HOT_TEMP 85   //°C of the hottest thermal zone from which the machine counts as hot
+#define POWER_FPS 15    //capture rate cap on battery
+#define POWER_FPS_HOT 5     //capture rate cap while the machine is hot
+#define POWER_ENCODE_THREADS 2  //encoder threads of the power profile, when settings._encthreads leaves it to the recorder
+#define POWER_TIMER_SLACK 2000  //us the kernel may defer the wake-ups of the pipeline threads to batch them
+
+/**
+ * Power state of the machine, -1 where the platform does not tell.
+ */
+typedef struct PW{
+    bool onBattery;     //running from a discharging battery
+    int batteryPercent;
+    int temperature;    //°C of the hottest thermal zone
+    bool hot;   //temperature at POWER_HOT_TEMP or above
+}SRPowerStatus;
+
+/**
+ * SRPowerMonitor reads the power source and the temperature the power profile adapts to.\n
+ * Linux reads the power_supply and thermal classes of sysfs (the device batteries of mice and keyboards are left
+ * out), windows GetSystemPowerStatus(), macOS the providing power source of IOKit; only Linux tells the
+ * temperature.\n
+ * energy() reads the package energy counter of the RAPL powercap interface, for the benchmark.
+ */
+class SRPowerMonitor {
+
+public:
+    static SRPowerStatus query();
+
+    /**
+     * constrained() tells if status asks for the power profile: on battery, or hot
+     */
+    static bool constrained(const SRPowerStatus &status) { return status.onBattery || status.hot; }
+
+    /**
+     * fpsCap() is the capture rate the power profile allows in status, 0 for no cap
+     */
+    static int fpsCap(const SRPowerStatus &status) { return status.hot ? POWER_FPS_HOT : status.onBattery ? POWER_FPS : 0; }
+
+    /**
+     * energy() is the energy counter of the CPU package, it wraps at energyRange()
+     * @return uJ, -1 without RAPL or without the right to read it (root only on the kernels since 5.10)
+     */
+    static int64_t energy();
+    static int64_t energyRange();
+};
+
+#endif //CPPSCREENRECORDER_SRPOWERMONITOR_H
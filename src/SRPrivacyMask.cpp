@@ -0,0 +1,116 @@
+#include "SRPrivacyMask.h"
+
+#include <algorithm>
+#include <cstring>
+
+extern "C"
+{
+#include "libavutil/pixdesc.h"
+}
+
+SRPrivacyMask::SRPrivacyMask(): rects(std::make_shared<const Rects>()), changes(0) {}
+
+void SRPrivacyMask::publish(const std::shared_ptr<const Rects> &next) {
+    std::atomic_store(&rects, next);
+    changes.fetch_add(1, std::memory_order_release);
+}
+
+void SRPrivacyMask::setRect(int id, int x, int y, int width, int height) {
+    //outwards to even bounds: a chroma sample is either blanked or not, a masked pixel never leaks through it
+    Rect r;
+    r.id = id;
+    r.x = x & ~1;
+    r.y = y & ~1;
+    r.width = (x + width - r.x + 1) & ~1;
+    r.height = (y + height - r.y + 1) & ~1;
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<Rects> next = std::make_shared<Rects>(*std::atomic_load(&rects));
+    auto it = std::find_if(next->begin(), next->end(), [id](const Rect &m){return m.id == id;});
+    if (it != next->end())
+        *it = r;
+    else
+        next->push_back(r);
+    publish(next);
+}
+
+void SRPrivacyMask::removeRect(int id) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<Rects> next = std::make_shared<Rects>(*std::atomic_load(&rects));
+    auto it = std::remove_if(next->begin(), next->end(), [id](const Rect &m){return m.id == id;});
+    if (it == next->end())
+        return;
+    next->erase(it, next->end());
+    publish(next);
+}
+
+void SRPrivacyMask::clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    publish(std::make_shared<const Rects>());
+}
+
+bool SRPrivacyMask::empty() const {
+    return std::atomic_load(&rects)->empty();
+}
+
+bool SRPrivacyMask::supported(enum AVPixelFormat format) {
+    switch (format) {
+        case AV_PIX_FMT_YUV420P:
+        case AV_PIX_FMT_YUVJ420P:
+        case AV_PIX_FMT_YUV422P:
+        case AV_PIX_FMT_YUVJ422P:
+        case AV_PIX_FMT_YUV444P:
+        case AV_PIX_FMT_YUVJ444P:
+        case AV_PIX_FMT_NV12:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* fills height rows of width bytes of a plane */
+static void fillPlane(uint8_t *dst, int stride, int width, int height, uint8_t value) {
+    for (int j = 0; j < height; j++, dst += stride)
+        memset(dst, value, width);
+}
+
+bool SRPrivacyMask::apply(AVFrame *frame, std::vector<AVRegionOfInterest> &regions) const {
+    std::shared_ptr<const Rects> current = std::atomic_load(&rects);
+    if (current->empty())
+        return true;
+    enum AVPixelFormat format = (enum AVPixelFormat) frame->format;
+    if (frame->hw_frames_ctx || !supported(format))
+        return false;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    int cw = desc->log2_chroma_w, ch = desc->log2_chroma_h;
+    //the full range formats are black at 0, the limited range ones at 16
+    bool fullRange = format == AV_PIX_FMT_YUVJ420P || format == AV_PIX_FMT_YUVJ422P || format == AV_PIX_FMT_YUVJ444P;
+
+    for (const Rect &r : *current) {
+        int x0 = std::max(r.x, 0), y0 = std::max(r.y, 0);
+        int x1 = std::min(r.x + r.width, frame->width & ~1), y1 = std::min(r.y + r.height, frame->height & ~1);
+        if (x1 <= x0 || y1 <= y0)
+            continue;
+        int w = x1 - x0, h = y1 - y0;
+        fillPlane(frame->data[0] + (size_t) y0 * frame->linesize[0] + x0, frame->linesize[0], w, h, fullRange ? 0 : 16);
+        if (format == AV_PIX_FMT_NV12) {
+            fillPlane(frame->data[1] + (size_t) (y0 >> 1) * frame->linesize[1] + x0, frame->linesize[1], w, h >> 1, 128);
+        } else {
+            for (int p = 1; p < 3; p++)
+                fillPlane(frame->data[p] + (size_t) (y0 >> ch) * frame->linesize[p] + (x0 >> cw), frame->linesize[p],
+                          w >> cw, h >> ch, 128);
+        }
+
+        //the whole macroblocks only: a block half visible keeps the quality of the rest of the frame
+        AVRegionOfInterest roi;
+        roi.self_size = sizeof(AVRegionOfInterest);
+        roi.left = (x0 + MASK_ROI_BLOCK - 1) / MASK_ROI_BLOCK * MASK_ROI_BLOCK;
+        roi.top = (y0 + MASK_ROI_BLOCK - 1) / MASK_ROI_BLOCK * MASK_ROI_BLOCK;
+        roi.right = x1 == (frame->width & ~1) ? frame->width : x1 / MASK_ROI_BLOCK * MASK_ROI_BLOCK;
+        roi.bottom = y1 == (frame->height & ~1) ? frame->height : y1 / MASK_ROI_BLOCK * MASK_ROI_BLOCK;
+        roi.qoffset = (AVRational){1, 1};
+        if (roi.right > roi.left && roi.bottom > roi.top)
+            regions.push_back(roi);
+    }
+    return true;
+}
@@ -0,0 +1,78 @@
+//
+// Privacy masks (password fields, windows) blanked on the converted YUV frames before they are encoded.
+//
+
+#ifndef CPPSCREENRECORDER_SRPRIVACYMASK_H
+#define CPPSCREENRECORDER_SRPRIVACYMASK_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+extern "C"
+{
+#include "libavutil/frame.h"
+#include "libavutil/pixfmt.h"
+}
+
+#define MASK_ROI_BLOCK 16   //macroblock of the encoders, only the blocks inside a mask get a region of interest
+
+/**
+ * SRPrivacyMask holds the rectangles of the output frame that must never reach the recording.\n
+ * apply() fills them with flat black on the planes of each frame, after the overlays, and describes the macroblocks
+ * they cover as regions of interest at the highest quantizer: the encoders with per-block QP (libx264, libx265)
+ * code them as cheap flat blocks, so a large mask lowers the cost of the encode instead of adding to it.
+ * The rectangles are published as an immutable snapshot, apply() never waits for setRect().
+ *
+ * @Note planar YUV (420, 422, 444) and NV12 frames, supported() tells the others apart before the recording starts
+ */
+class SRPrivacyMask {
+
+private:
+    struct Rect {
+        int id;
+        int x, y, width, height;    //even, in output pixels
+    };
+    typedef std::vector<Rect> Rects;
+
+    std::mutex lock;    //writers only
+    std::shared_ptr<const Rects> rects;
+    std::atomic<uint32_t> changes;
+
+    void publish(const std::shared_ptr<const Rects> &next);
+
+public:
+    SRPrivacyMask();
+
+    SRPrivacyMask(const SRPrivacyMask&) = delete;
+    SRPrivacyMask &operator=(const SRPrivacyMask&) = delete;
+
+    /**
+     * setRect() masks a rectangle of the output frame, or moves the one of the same id
+     * @param x position of the top left corner in output pixels, the rectangle grows to even bounds
+     */
+    void setRect(int id, int x, int y, int width, int height);
+
+    void removeRect(int id);
+    void clear();
+
+    /**
+     * changeCount() counts the changes of the rectangles: a frame identical to the previous one differs after a change
+     */
+    uint32_t changeCount() const { return changes.load(std::memory_order_acquire); }
+
+    bool empty() const;
+
+    static bool supported(enum AVPixelFormat format);
+
+    /**
+     * apply() blanks the rectangles on frame, clipped to it, and appends the macroblocks they cover to regions,
+     * given to the encoder by SRRegionMap::attach()
+     * @return false if frame has a format the rectangles cannot be blanked on
+     */
+    bool apply(AVFrame *frame, std::vector<AVRegionOfInterest> &regions) const;
+};
+
+#endif //CPPSCREENRECORDER_SRPRIVACYMASK_H
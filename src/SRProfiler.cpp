@@ -0,0 +1,132 @@
+#include "SRProfiler.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<uint64_t> allocations[SR_PROFILE_SLOTS];
+static std::atomic<int64_t> allocatedBytes[SR_PROFILE_SLOTS];
+static std::atomic<uint64_t> contended[SR_PROFILE_SLOTS];
+static std::atomic<int64_t> lockWait[SR_PROFILE_SLOTS];
+
+//constant initialized: reading it from inside malloc needs no TLS constructor
+static thread_local int profileStage = SR_STAGE_COUNT;
+
+void srProfileStage(int stage) {
+    profileStage = stage >= 0 && stage < SR_STAGE_COUNT ? stage : SR_STAGE_COUNT;
+}
+
+SRProfileStats srProfileSnapshot() {
+    SRProfileStats s = {};
+#ifdef SR_PROFILING
+    s.enabled = true;
+#endif
+    for (int i = 0; i < SR_PROFILE_SLOTS; i++) {
+        s.allocations[i] = allocations[i].load(std::memory_order_relaxed);
+        s.allocatedBytes[i] = allocatedBytes[i].load(std::memory_order_relaxed);
+        s.contended[i] = contended[i].load(std::memory_order_relaxed);
+        s.lockWait[i] = lockWait[i].load(std::memory_order_relaxed);
+    }
+    return s;
+}
+
+uint64_t srProfileAllocations() {
+    uint64_t total = 0;
+    for (int i = 0; i < SR_PROFILE_SLOTS; i++)
+        total += allocations[i].load(std::memory_order_relaxed);
+    return total;
+}
+
+void SRProfileMutex::lock() {
+    if (mutex.try_lock())
+        return;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    mutex.lock();
+    int64_t waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    contended[profileStage].fetch_add(1, std::memory_order_relaxed);
+    lockWait[profileStage].fetch_add(waited, std::memory_order_relaxed);
+}
+
+#ifdef SR_PROFILING
+
+static inline void countAllocation(size_t size) {
+    allocations[profileStage].fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes[profileStage].fetch_add((int64_t) size, std::memory_order_relaxed);
+}
+
+#ifdef __GLIBC__
+/*
+ * glibc: every heap allocation of the process goes through these, av_malloc() (posix_memalign) and av_realloc()
+ * of libavutil/mem.c, which has no hooks of its own, and operator new of libstdc++ included
+ */
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size) {
+    countAllocation(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    countAllocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    countAllocation(size);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    countAllocation(size);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    countAllocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    countAllocation(size);
+    return __libc_memalign(alignment, size);
+}
+}
+#else
+/* elsewhere the C++ allocations only: libavutil allocates behind the back of the process */
+void *operator new(size_t size) {
+    countAllocation(size);
+    void *ptr = std::malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+#endif
+
+#endif
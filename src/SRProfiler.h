@@ -0,0 +1,65 @@
+//
+// Profiling build (SR_PROFILING): heap allocations and lock waits of the pipeline threads, by stage.
+//
+
+#ifndef CPPSCREENRECORDER_SRPROFILER_H
+#define CPPSCREENRECORDER_SRPROFILER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include "SRStats.h"
+
+#define SR_PROFILE_SLOTS (SR_STAGE_COUNT + 1)   //the stages, then the threads of none (audio, stats, encoder threads)
+
+/**
+ * What the profiling build counted since the start of the process, by the stage of the calling thread:
+ * heap allocations (malloc, av_malloc and operator new alike) and their bytes, the lock() calls of an SRMutex
+ * that found it taken and the time they waited for it. All zero, enabled false, in the other builds.
+ */
+typedef struct PF{
+    bool enabled;
+    uint64_t allocations[SR_PROFILE_SLOTS];
+    int64_t allocatedBytes[SR_PROFILE_SLOTS];
+    uint64_t contended[SR_PROFILE_SLOTS];
+    int64_t lockWait[SR_PROFILE_SLOTS];     //us
+}SRProfileStats;
+
+/**
+ * srProfileStage() files what the calling thread allocates and waits for under stage, SR_STAGE_COUNT for none:
+ * called by each thread of the pipeline as it starts
+ */
+void srProfileStage(int stage);
+
+SRProfileStats srProfileSnapshot();
+
+/**
+ * srProfileAllocations() is the number of heap allocations of the process so far, 0 without SR_PROFILING
+ */
+uint64_t srProfileAllocations();
+
+/**
+ * SRProfileMutex is a std::mutex whose contended lock() calls are timed: an uncontended one is the try_lock()
+ * of std::mutex, so the profiling build keeps the run time of the other one
+ */
+class SRProfileMutex {
+
+private:
+    std::mutex mutex;
+
+public:
+    void lock();
+    bool try_lock() { return mutex.try_lock(); }
+    void unlock() { mutex.unlock(); }
+};
+
+//the locks of the pipeline: timed in the profiling build, plain std::mutex otherwise
+#ifdef SR_PROFILING
+typedef SRProfileMutex SRMutex;
+typedef std::condition_variable_any SRCondition;
+#else
+typedef std::mutex SRMutex;
+typedef std::condition_variable SRCondition;
+#endif
+
+#endif //CPPSCREENRECORDER_SRPROFILER_H
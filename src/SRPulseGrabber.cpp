@@ -0,0 +1,208 @@
+#include "SRPulseGrabber.h"
+#include "SRLog.h"
+
+#ifdef __unix__
+
+#include <cstring>
+#include <iostream>
+
+extern "C"
+{
+#include "libavutil/time.h"
+}
+
+using namespace std;
+
+SRPulseGrabber::SRPulseGrabber(): mainloop(nullptr), context(nullptr), stream(nullptr), lastChunk(0) {
+    spec.format = PA_SAMPLE_S16LE;
+    spec.rate = PULSE_SAMPLE_RATE;
+    spec.channels = PULSE_CHANNELS;
+}
+
+SRPulseGrabber::~SRPulseGrabber() {
+    //the loop thread must be stopped unlocked, before the objects it calls back are freed
+    if (mainloop)
+        pa_threaded_mainloop_stop(mainloop);
+    if (stream) {
+        pa_stream_disconnect(stream);
+        pa_stream_unref(stream);
+    }
+    if (context) {
+        pa_context_disconnect(context);
+        pa_context_unref(context);
+    }
+    if (mainloop)
+        pa_threaded_mainloop_free(mainloop);
+}
+
+void SRPulseGrabber::contextState(pa_context *c, void *opaque) {
+    (void) c;
+    pa_threaded_mainloop_signal(((SRPulseGrabber *) opaque)->mainloop, 0);
+}
+
+void SRPulseGrabber::streamState(pa_stream *s, void *opaque) {
+    (void) s;
+    pa_threaded_mainloop_signal(((SRPulseGrabber *) opaque)->mainloop, 0);
+}
+
+void SRPulseGrabber::streamReadable(pa_stream *s, size_t bytes, void *opaque) {
+    (void) s; (void) bytes;
+    pa_threaded_mainloop_signal(((SRPulseGrabber *) opaque)->mainloop, 0);
+}
+
+void SRPulseGrabber::timerElapsed(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *opaque) {
+    (void) api; (void) e; (void) tv;
+    pa_threaded_mainloop_signal(((SRPulseGrabber *) opaque)->mainloop, 0);
+}
+
+/* pa_threaded_mainloop_wait() up to deadline (av_gettime()), the lock held: false once it has passed */
+bool SRPulseGrabber::wait(int64_t deadline) {
+    int64_t now = av_gettime();
+    if (now >= deadline)
+        return false;
+    pa_time_event *timer = pa_context_rttime_new(context, pa_rtclock_now() + (pa_usec_t) (deadline - now),
+                                                 timerElapsed, this);
+    pa_threaded_mainloop_wait(mainloop);
+    if (timer)
+        pa_threaded_mainloop_get_api(mainloop)->time_free(timer);
+    return true;
+}
+
+int SRPulseGrabber::open(const char *device, int sampleRate, int channels, int fragmentUs) {
+    if (sampleRate > 0) spec.rate = (uint32_t) sampleRate;
+    if (channels > 0) spec.channels = (uint8_t) channels;
+    if (!pa_sample_spec_valid(&spec))
+        return AVERROR(EINVAL);
+
+    mainloop = pa_threaded_mainloop_new();
+    if (!mainloop)
+        return AVERROR(ENOMEM);
+    context = pa_context_new(pa_threaded_mainloop_get_api(mainloop), "ScreenRecorder");
+    if (!context)
+        return AVERROR(ENOMEM);
+    pa_context_set_state_callback(context, contextState, this);
+    if (pa_context_connect(context, nullptr, PA_CONTEXT_NOFLAGS, nullptr) < 0) {
+        cout << "\n[SRPulseGrabber] cannot connect to the server: " << pa_strerror(pa_context_errno(context));
+        return AVERROR(EIO);
+    }
+
+    pa_threaded_mainloop_lock(mainloop);
+    if (pa_threaded_mainloop_start(mainloop) < 0) {
+        pa_threaded_mainloop_unlock(mainloop);
+        return AVERROR(EIO);
+    }
+    int64_t deadline = av_gettime() + PULSE_CONNECT_TIMEOUT * 1000;
+    pa_context_state_t state;
+    while ((state = pa_context_get_state(context)) != PA_CONTEXT_READY) {
+        if (!PA_CONTEXT_IS_GOOD(state)) {
+            cout << "\n[SRPulseGrabber] cannot connect to the server: " << pa_strerror(pa_context_errno(context));
+            pa_threaded_mainloop_unlock(mainloop);
+            return AVERROR(EIO);
+        }
+        if (!wait(deadline)) {
+            cout << "\n[SRPulseGrabber] the server did not answer within " << PULSE_CONNECT_TIMEOUT << " ms";
+            pa_threaded_mainloop_unlock(mainloop);
+            return AVERROR(ETIMEDOUT);
+        }
+    }
+
+    stream = pa_stream_new(context, "capture", &spec, nullptr);
+    if (!stream) {
+        pa_threaded_mainloop_unlock(mainloop);
+        return AVERROR(ENOMEM);
+    }
+    pa_stream_set_state_callback(stream, streamState, this);
+    pa_stream_set_read_callback(stream, streamReadable, this);
+
+    //only fragsize matters for a record stream: the server delivers chunks of that size
+    pa_buffer_attr attr;
+    attr.maxlength = (uint32_t) -1;
+    attr.tlength = (uint32_t) -1;
+    attr.prebuf = (uint32_t) -1;
+    attr.minreq = (uint32_t) -1;
+    attr.fragsize = (uint32_t) pa_usec_to_bytes((pa_usec_t) fragmentUs, &spec);
+    pa_stream_flags_t flags = (pa_stream_flags_t) (PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING |
+                                                   PA_STREAM_AUTO_TIMING_UPDATE);
+    const char *source = device && *device && strcmp(device, "default") ? device : nullptr;
+    if (pa_stream_connect_record(stream, source, &attr, flags) < 0) {
+        cout << "\n[SRPulseGrabber] cannot record from " << (source ? source : "the default source") << ": "
+             << pa_strerror(pa_context_errno(context));
+        pa_threaded_mainloop_unlock(mainloop);
+        return AVERROR(EIO);
+    }
+    pa_stream_state_t current;
+    while ((current = pa_stream_get_state(stream)) != PA_STREAM_READY) {
+        if (!PA_STREAM_IS_GOOD(current)) {
+            cout << "\n[SRPulseGrabber] cannot record: " << pa_strerror(pa_context_errno(context));
+            pa_threaded_mainloop_unlock(mainloop);
+            return AVERROR(EIO);
+        }
+        if (!wait(deadline)) {
+            cout << "\n[SRPulseGrabber] the record stream did not start within " << PULSE_CONNECT_TIMEOUT << " ms";
+            pa_threaded_mainloop_unlock(mainloop);
+            return AVERROR(ETIMEDOUT);
+        }
+    }
+    lastChunk = av_gettime();
+    const pa_buffer_attr *granted = pa_stream_get_buffer_attr(stream);
+    if (granted)
+        cout << "\n[SRPulseGrabber] " << pa_bytes_to_usec(granted->fragsize, &spec) / 1000 << " ms fragments";
+    pa_threaded_mainloop_unlock(mainloop);
+    return 0;
+}
+
+int SRPulseGrabber::read(AVPacket *pkt) {
+    const void *data;
+    size_t bytes;
+    int ret = 0;
+    int64_t deadline = av_gettime() + PULSE_READ_TIMEOUT * 1000;
+
+    pa_threaded_mainloop_lock(mainloop);
+    while (true) {
+        if (!PA_STREAM_IS_GOOD(pa_stream_get_state(stream))) {
+            ret = AVERROR(EIO);
+            break;
+        }
+        if (pa_stream_readable_size(stream) == 0) {
+            if (wait(deadline))
+                continue;
+            ret = av_gettime() - lastChunk > PULSE_STALL_TIMEOUT * 1000 ? AVERROR(ETIMEDOUT) : AVERROR(EAGAIN);
+            break;
+        }
+        if (pa_stream_peek(stream, &data, &bytes) < 0) {
+            ret = AVERROR(EIO);
+            break;
+        }
+        if (!data) {
+            //a hole in the stream: the timestamps of the next chunk carry the gap
+            if (bytes)
+                pa_stream_drop(stream);
+            continue;
+        }
+
+        //the latency covers the peeked chunk too: it is still in the buffer
+        pa_usec_t latency = 0;
+        int negative = 0;
+        int64_t pts = av_gettime();
+        if (pa_stream_get_latency(stream, &latency, &negative) >= 0)
+            pts += negative ? (int64_t) latency : -(int64_t) latency;
+
+        ret = av_new_packet(pkt, (int) bytes);
+        if (ret >= 0) {
+            memcpy(pkt->data, data, bytes);
+            pkt->pts = pkt->dts = pts;
+            pkt->stream_index = 0;
+        }
+        pa_stream_drop(stream);
+        lastChunk = av_gettime();
+        break;
+    }
+    pa_threaded_mainloop_unlock(mainloop);
+    if (ret == AVERROR(EIO))
+        srLog(SR_LOG_ERROR, "[SRPulseGrabber] recording failed: %s", pa_strerror(pa_context_errno(context)));
+    if (ret == AVERROR(ETIMEDOUT))
+        srLog(SR_LOG_ERROR, "[SRPulseGrabber] the server delivered nothing for %d ms", PULSE_STALL_TIMEOUT);
+    return ret;
+}
+
+#endif
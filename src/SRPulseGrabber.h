@@ -0,0 +1,63 @@
+//
+// Asynchronous PulseAudio grabber with an explicit fragment size.
+//
+
+#ifndef CPPSCREENRECORDER_SRPULSEGRABBER_H
+#define CPPSCREENRECORDER_SRPULSEGRABBER_H
+
+#ifdef __unix__
+
+#include <pulse/pulseaudio.h>
+#include "SRAudioGrabber.h"
+
+#define PULSE_SAMPLE_RATE 48000
+#define PULSE_CHANNELS 2
+#define PULSE_CONNECT_TIMEOUT 5000  //ms open() waits for the server and the stream
+#define PULSE_READ_TIMEOUT 500      //ms read() waits for a chunk before it answers EAGAIN
+#define PULSE_STALL_TIMEOUT 3000    //ms without a chunk before a stream counts as lost: a record stream delivers silence too
+
+/**
+ * SRPulseGrabber records through the asynchronous API of PulseAudio (served by PipeWire as well):
+ * the stream asks for fragments of the requested size (PA_STREAM_ADJUST_LATENCY) instead of the server default,
+ * so the chunks are small and regular, and read() takes them straight from the server buffer on the AudioThread.\n
+ * Each chunk is stamped with the interpolated stream latency (pa_stream_get_latency()): now minus the time
+ * the samples spent in the buffers.\n
+ * The waits are bounded, a server over the network may stall: read() answers EAGAIN after PULSE_READ_TIMEOUT ms,
+ * and AVERROR(ETIMEDOUT) once nothing came for PULSE_STALL_TIMEOUT ms, a lost device the recorder opens again.
+ *
+ * @Note the samples are S16 interleaved
+ */
+class SRPulseGrabber : public SRAudioGrabber {
+
+private:
+    pa_threaded_mainloop *mainloop;
+    pa_context *context;
+    pa_stream *stream;
+    pa_sample_spec spec;
+    int64_t lastChunk;  //us, av_gettime() of the last chunk read
+
+    static void contextState(pa_context *c, void *opaque);
+    static void streamState(pa_stream *s, void *opaque);
+    static void streamReadable(pa_stream *s, size_t bytes, void *opaque);
+    static void timerElapsed(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *opaque);
+    bool wait(int64_t deadline);
+
+public:
+    SRPulseGrabber();
+    ~SRPulseGrabber() override;
+
+    SRPulseGrabber(const SRPulseGrabber&) = delete;
+    SRPulseGrabber &operator=(const SRPulseGrabber&) = delete;
+
+    int open(const char *device, int sampleRate, int channels, int fragmentUs) override;
+    int read(AVPacket *pkt) override;
+
+    enum AVCodecID codecId() const override { return AV_CODEC_ID_PCM_S16LE; }
+    int sampleRate() const override { return (int) spec.rate; }
+    int channels() const override { return spec.channels; }
+    const char *name() const override { return "pulse-async"; }
+};
+
+#endif
+
+#endif //CPPSCREENRECORDER_SRPULSEGRABBER_H
@@ -0,0 +1,329 @@
+//
+// Sampled quality of the encoded video: frames of the encoder compared with a decode of its packets, SSIM and PSNR.
+//
+
+#include "SRQualityProbe.h"
+#include "SRLog.h"
+#include "SRThreads.h"
+
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SR_HAVE_SSE2 1
+#endif
+
+extern "C"
+{
+#include "libavutil/common.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/time.h"
+}
+
+/* sums of a 4 x 4 block of the two planes: of the pixels, of their squares and of their products */
+struct BlockSums {
+    int s1, s2, ss, s12;
+};
+
+static void blockSums(const uint8_t *a, int strideA, const uint8_t *b, int strideB, int blocks, BlockSums *out) {
+    int i = 0;
+#ifdef SR_HAVE_SSE2
+    const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1);
+    for (; i + 4 <= blocks; i += 4) {
+        //two halves of 8 px, each lane of a sum holds a pair of pixels: a block is two neighbouring lanes
+        __m128i sa[2], sb[2], sq[2], sp[2];
+        for (int h = 0; h < 2; h++)
+            sa[h] = sb[h] = sq[h] = sp[h] = zero;
+        for (int row = 0; row < 4; row++) {
+            __m128i va = _mm_loadu_si128((const __m128i *) (a + (size_t) row * strideA + 4 * i));
+            __m128i vb = _mm_loadu_si128((const __m128i *) (b + (size_t) row * strideB + 4 * i));
+            for (int h = 0; h < 2; h++) {
+                __m128i xa = h ? _mm_unpackhi_epi8(va, zero) : _mm_unpacklo_epi8(va, zero);
+                __m128i xb = h ? _mm_unpackhi_epi8(vb, zero) : _mm_unpacklo_epi8(vb, zero);
+                sa[h] = _mm_add_epi32(sa[h], _mm_madd_epi16(xa, ones));
+                sb[h] = _mm_add_epi32(sb[h], _mm_madd_epi16(xb, ones));
+                sq[h] = _mm_add_epi32(sq[h], _mm_add_epi32(_mm_madd_epi16(xa, xa), _mm_madd_epi16(xb, xb)));
+                sp[h] = _mm_add_epi32(sp[h], _mm_madd_epi16(xa, xb));
+            }
+        }
+        int32_t lanes[4][2][4];
+        for (int h = 0; h < 2; h++) {
+            _mm_storeu_si128((__m128i *) lanes[0][h], sa[h]);
+            _mm_storeu_si128((__m128i *) lanes[1][h], sb[h]);
+            _mm_storeu_si128((__m128i *) lanes[2][h], sq[h]);
+            _mm_storeu_si128((__m128i *) lanes[3][h], sp[h]);
+        }
+        for (int k = 0; k < 4; k++) {
+            int h = k >> 1, lane = (k & 1) * 2;
+            out[i + k].s1 = lanes[0][h][lane] + lanes[0][h][lane + 1];
+            out[i + k].s2 = lanes[1][h][lane] + lanes[1][h][lane + 1];
+            out[i + k].ss = lanes[2][h][lane] + lanes[2][h][lane + 1];
+            out[i + k].s12 = lanes[3][h][lane] + lanes[3][h][lane + 1];
+        }
+    }
+#endif
+    for (; i < blocks; i++) {
+        BlockSums sums = {0, 0, 0, 0};
+        for (int row = 0; row < 4; row++)
+            for (int col = 4 * i; col < 4 * i + 4; col++) {
+                int va = a[(size_t) row * strideA + col], vb = b[(size_t) row * strideB + col];
+                sums.s1 += va;
+                sums.s2 += vb;
+                sums.ss += va * va + vb * vb;
+                sums.s12 += va * vb;
+            }
+        out[i] = sums;
+    }
+}
+
+/* SSIM of the 8 x 8 window of four blocks, the constants of x264 for sums of 64 pixels */
+static double windowSsim(const BlockSums &p, const BlockSums &q, const BlockSums &r, const BlockSums &s) {
+    const double c1 = .01 * .01 * 255 * 255 * 64, c2 = .03 * .03 * 255 * 255 * 64 * 63;
+    double s1 = p.s1 + q.s1 + r.s1 + s.s1, s2 = p.s2 + q.s2 + r.s2 + s.s2;
+    double ss = (double) p.ss + q.ss + r.ss + s.ss, s12 = (double) p.s12 + q.s12 + r.s12 + s.s12;
+    double vars = ss * 64 - s1 * s1 - s2 * s2, covar = s12 * 64 - s1 * s2;
+    return (2 * s1 * s2 + c1) * (2 * covar + c2) / ((s1 * s1 + s2 * s2 + c1) * (vars + c2));
+}
+
+double SRQualityProbe::ssim(const uint8_t *a, int strideA, const uint8_t *b, int strideB, int width, int height) {
+    const int columns = width / 4, rows = height / 4;
+    if (columns < 2 || rows < 2)
+        return 1;
+    std::vector<BlockSums> sums[2] = {std::vector<BlockSums>(columns), std::vector<BlockSums>(columns)};
+    double total = 0;
+    blockSums(a, strideA, b, strideB, columns, sums[0].data());
+    for (int row = 1; row < rows; row++) {
+        const std::vector<BlockSums> &above = sums[(row - 1) & 1];
+        std::vector<BlockSums> &current = sums[row & 1];
+        blockSums(a + (size_t) row * 4 * strideA, strideA, b + (size_t) row * 4 * strideB, strideB, columns,
+                  current.data());
+        for (int col = 0; col + 1 < columns; col++)
+            total += windowSsim(above[col], above[col + 1], current[col], current[col + 1]);
+    }
+    return total / ((double) (columns - 1) * (rows - 1));
+}
+
+double SRQualityProbe::psnr(const uint8_t *a, int strideA, const uint8_t *b, int strideB, int width, int height) {
+    uint64_t sse = 0;
+    for (int row = 0; row < height; row++) {
+        const uint8_t *pa = a + (size_t) row * strideA, *pb = b + (size_t) row * strideB;
+        int col = 0;
+#ifdef SR_HAVE_SSE2
+        //a lane takes two squares of at most 255^2 per 16 px: a row of 32K px stays within 32 bits
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc = zero;
+        for (; col + 16 <= width; col += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i *) (pa + col)), vb = _mm_loadu_si128((const __m128i *) (pb + col));
+            __m128i low = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+            __m128i high = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high)));
+        }
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i *) lanes, acc);
+        sse += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+        for (; col < width; col++) {
+            int d = pa[col] - pb[col];
+            sse += (uint64_t) (d * d);
+        }
+    }
+    if (!sse)
+        return 100;
+    return FFMIN(10 * log10(255.0 * 255.0 * width * height / (double) sse), 100.0);
+}
+
+bool SRQualityProbe::supported(enum AVPixelFormat format) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    return desc && !(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)) &&
+           desc->nb_components >= 3 && desc->comp[0].depth == 8 && desc->comp[0].plane == 0 && desc->comp[0].step == 1;
+}
+
+SRQualityProbe::SRQualityProbe(): decoder(nullptr), interval(0), nextSample(AV_NOPTS_VALUE), dropping(false),
+                                  gap(false), stopping(false), totals{0, 0, 0, 1, 0} {}
+
+SRQualityProbe::~SRQualityProbe() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (worker.joinable())
+        worker.join();
+    for (AVPacket *packet : packets)
+        av_packet_free(&packet);
+    for (AVFrame *frame : sources)
+        av_frame_free(&frame);
+    avcodec_free_context(&decoder);
+}
+
+int SRQualityProbe::open(const AVCodecContext *encoder, int intervalMs) {
+    AVCodec *codec = avcodec_find_decoder(encoder->codec_id);
+    if (!codec)
+        return AVERROR_DECODER_NOT_FOUND;
+    AVCodecParameters *par = avcodec_parameters_alloc();
+    if (!par || !(decoder = avcodec_alloc_context3(codec))) {
+        avcodec_parameters_free(&par);
+        return AVERROR(ENOMEM);
+    }
+    //the parameter sets of a global header are in the extradata
+    int ret = avcodec_parameters_from_context(par, encoder);
+    if (ret >= 0)
+        ret = avcodec_parameters_to_context(decoder, par);
+    avcodec_parameters_free(&par);
+    if (ret < 0)
+        return ret;
+    decoder->pkt_timebase = encoder->time_base;
+    decoder->thread_count = 1;
+    interval = (int64_t) FFMAX(intervalMs, 1) * 1000;
+    worker = std::thread(&SRQualityProbe::run, this);
+    return 0;
+}
+
+void SRQualityProbe::sendFrame(const AVFrame *frame, int64_t capture) {
+    if (nextSample != AV_NOPTS_VALUE && capture < nextSample)
+        return;
+    nextSample = capture + interval;
+    AVFrame *kept = av_frame_clone(frame);
+    if (!kept)
+        return;
+    std::lock_guard<std::mutex> guard(lock);
+    if (stopping) {
+        av_frame_free(&kept);
+        return;
+    }
+    sources.push_back(kept);
+    if (sources.size() > QUALITY_PENDING) {
+        av_frame_free(&sources.front());
+        sources.pop_front();
+    }
+}
+
+void SRQualityProbe::sendPacket(const AVPacket *packet) {
+    bool key = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (stopping || (dropping && !key))
+            return;
+        if (packets.size() >= QUALITY_QUEUE) {
+            //the GOP on the way cannot be decoded whole any more: the next one starts afresh
+            for (AVPacket *queued : packets)
+                av_packet_free(&queued);
+            packets.clear();
+            dropping = gap = true;
+            std::lock_guard<std::mutex> statsGuard(statsLock);
+            totals.skippedGops++;
+            return;
+        }
+        AVPacket *copy = av_packet_clone(packet);
+        if (!copy)
+            return;
+        dropping = false;
+        packets.push_back(copy);
+    }
+    wake.notify_one();
+}
+
+SRQualityStats SRQualityProbe::stats() {
+    std::lock_guard<std::mutex> guard(statsLock);
+    return totals;
+}
+
+/**
+ * run() is the thread of the probe: it decodes the GOPs the budget allows and compares the sampled frames
+ */
+void SRQualityProbe::run() {
+    //before the decoder opens: its threads inherit the class
+    idleThread();
+    int ret = avcodec_open2(decoder, decoder->codec, nullptr);
+    if (ret < 0) {
+        srLog(SR_LOG_WARNING, "[SRQualityProbe] cannot open the %s decoder (%d), no quality is measured",
+              decoder->codec->name, ret);
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        return;
+    }
+    AVFrame *frame = av_frame_alloc();
+    bool decoding = false;
+    int64_t windowStart = av_gettime_relative(), busy = 0;
+    double load = 0;
+    while (frame) {
+        AVPacket *packet;
+        bool interrupted;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&](){ return stopping || !packets.empty(); });
+            if (stopping)
+                break;
+            packet = packets.front();
+            packets.pop_front();
+            interrupted = gap;
+            gap = false;
+        }
+        int64_t start = av_gettime_relative();
+        if (start - windowStart >= (int64_t) QUALITY_WINDOW * 1000) {
+            load = (double) busy / (start - windowStart);
+            windowStart = start;
+            busy = 0;
+        }
+        bool allowed = load * 100 <= QUALITY_BUDGET;
+        if (interrupted)
+            decoding = false;
+        if (packet->flags & AV_PKT_FLAG_KEY) {
+            //a skipped GOP leaves the references of the decoder behind
+            if (allowed && !decoding)
+                avcodec_flush_buffers(decoder);
+            if (!allowed) {
+                std::lock_guard<std::mutex> guard(statsLock);
+                totals.skippedGops++;
+            }
+            decoding = allowed;
+        } else if (decoding && !allowed) {
+            //the rest of a long GOP is given up as well
+            decoding = false;
+            std::lock_guard<std::mutex> guard(statsLock);
+            totals.skippedGops++;
+        }
+        if (decoding && avcodec_send_packet(decoder, packet) >= 0)
+            while (avcodec_receive_frame(decoder, frame) >= 0) {
+                compare(frame);
+                av_frame_unref(frame);
+            }
+        av_packet_free(&packet);
+        busy += av_gettime_relative() - start;
+    }
+    av_frame_free(&frame);
+}
+
+/**
+ * compare() measures a decoded frame against its source when it was sampled, the sources it passed are let go
+ */
+void SRQualityProbe::compare(const AVFrame *decoded) {
+    int64_t pts = decoded->pts != AV_NOPTS_VALUE ? decoded->pts : decoded->best_effort_timestamp;
+    AVFrame *source = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        while (!sources.empty() && sources.front()->pts < pts) {
+            av_frame_free(&sources.front());
+            sources.pop_front();
+        }
+        if (!sources.empty() && sources.front()->pts == pts) {
+            source = sources.front();
+            sources.pop_front();
+        }
+    }
+    if (!source)
+        return;
+    if (source->width == decoded->width && source->height == decoded->height &&
+        supported((enum AVPixelFormat) decoded->format)) {
+        double s = ssim(source->data[0], source->linesize[0], decoded->data[0], decoded->linesize[0],
+                        source->width, source->height);
+        double p = psnr(source->data[0], source->linesize[0], decoded->data[0], decoded->linesize[0],
+                        source->width, source->height);
+        std::lock_guard<std::mutex> guard(statsLock);
+        totals.samples++;
+        totals.ssimSum += s;
+        totals.psnrSum += p;
+        totals.ssimMin = FFMIN(totals.ssimMin, s);
+    }
+    av_frame_free(&source);
+}
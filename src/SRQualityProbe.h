@@ -0,0 +1,115 @@
+//
+// Sampled quality of the encoded video: frames of the encoder compared with a decode of its packets, SSIM and PSNR.
+//
+
+#ifndef CPPSCREENRECORDER_SRQUALITYPROBE_H
+#define CPPSCREENRECORDER_SRQUALITYPROBE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+}
+
+#define QUALITY_INTERVAL 1000   //ms between two sampled frames, default settings._qualityprobe
+#define QUALITY_BUDGET 10   //% of a core the probe may take, beyond it the next GOP is not decoded
+#define QUALITY_WINDOW 2000     //ms the budget is measured over
+#define QUALITY_QUEUE 256   //packets waiting for the decoder, beyond the GOP is given up
+#define QUALITY_PENDING 8   //sampled frames waiting for their decode, beyond the oldest is let go
+
+/**
+ * Totals of an SRQualityProbe since open(): the means are the sums over the samples.
+ */
+typedef struct QS{
+    uint64_t samples;   //frames compared
+    double ssimSum;
+    double psnrSum;     //dB
+    double ssimMin;     //worst frame, 1 before the first sample
+    uint64_t skippedGops;   //left undecoded over QUALITY_BUDGET or a full queue
+}SRQualityStats;
+
+/**
+ * SRQualityProbe measures what the encoder does to the picture on the recording itself: a frame every interval
+ * is kept as it was sent to the encoder, the packets are decoded again by a decoder of the same codec and the
+ * decode of the kept frame is compared with it, SSIM (8 x 8 windows on a 4 px grid, as x264 and libavfilter
+ * compute it) and PSNR of the luma, with SSE2.\n
+ * The decoding and the comparison run on a thread of their own, in the background class of the scheduler: the
+ * ProducerThread only references the frames and packets. The probe decodes whole GOPs or none, a GOP decodes on its
+ * own: when the thread took more than QUALITY_BUDGET % of a core over the last QUALITY_WINDOW ms, or fell
+ * QUALITY_QUEUE packets behind, the next GOP is left out, so the cost stays bounded whatever the codec and the rate.
+ *
+ * @Note send() from the ProducerThread only; system memory frames with 8 bit luma
+ */
+class SRQualityProbe {
+
+private:
+    AVCodecContext *decoder;
+    int64_t interval;   //us
+    int64_t nextSample;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<AVPacket *> packets;
+    std::deque<AVFrame *> sources;      //sampled frames, in pts order
+    bool dropping;      //the queue overflowed: packets are left out until a keyframe
+    bool gap;       //the thread has yet to learn the GOP it is decoding lost packets
+    bool stopping;
+    std::thread worker;
+
+    std::mutex statsLock;
+    SRQualityStats totals;
+
+    void run();
+    void compare(const AVFrame *decoded);
+
+public:
+    SRQualityProbe();
+    ~SRQualityProbe();
+
+    SRQualityProbe(const SRQualityProbe&) = delete;
+    SRQualityProbe &operator=(const SRQualityProbe&) = delete;
+
+    /**
+     * supported() tells whether frames of format can be compared: 8 bit YUV in system memory
+     */
+    static bool supported(enum AVPixelFormat format);
+
+    /**
+     * open() creates a decoder for the packets of encoder, opened and started on the thread of the probe
+     * @param intervalMs between two sampled frames
+     * @return 0 on success, a negative AVERROR code otherwise
+     */
+    int open(const AVCodecContext *encoder, int intervalMs);
+
+    /**
+     * sendFrame() keeps frame for the comparison when a sample is due
+     * @param frame as the encoder gets it, pts in encoder ticks
+     * @param capture us of the frame on the capture clock, paces the samples
+     */
+    void sendFrame(const AVFrame *frame, int64_t capture);
+
+    /**
+     * sendPacket() hands a packet of the encoder to the decoder, before its timestamps leave the encoder time base
+     */
+    void sendPacket(const AVPacket *packet);
+
+    SRQualityStats stats();
+
+    /**
+     * ssim() is the mean SSIM of two 8 bit planes, 1 for identical ones
+     */
+    static double ssim(const uint8_t *a, int strideA, const uint8_t *b, int strideB, int width, int height);
+
+    /**
+     * psnr() is the PSNR of two 8 bit planes in dB, capped to 100 for identical ones
+     */
+    static double psnr(const uint8_t *a, int strideA, const uint8_t *b, int strideB, int width, int height);
+};
+
+#endif //CPPSCREENRECORDER_SRQUALITYPROBE_H
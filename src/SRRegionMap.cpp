@@ -0,0 +1,152 @@
+#include "SRRegionMap.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+extern "C"
+{
+#include "libavutil/pixdesc.h"
+}
+
+SRRegionMap::SRRegionMap(): regions(std::make_shared<const Regions>()), detect(false),
+        textOffset((AVRational){TEXT_QOFFSET_NUM, TEXT_QOFFSET_DEN}) {}
+
+void SRRegionMap::setDetection(bool on, AVRational qoffset) {
+    //before the recording: the workers read the offset without a lock
+    textOffset = qoffset;
+    detect.store(on, std::memory_order_relaxed);
+}
+
+void SRRegionMap::setRegion(int id, int x, int y, int width, int height, AVRational qoffset) {
+    Region r = {id, x, y, width, height, qoffset};
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<Regions> next = std::make_shared<Regions>(*std::atomic_load(&regions));
+    auto it = std::find_if(next->begin(), next->end(), [id](const Region &m){return m.id == id;});
+    if (it != next->end())
+        *it = r;
+    else
+        next->push_back(r);
+    std::atomic_store(&regions, std::shared_ptr<const Regions>(next));
+}
+
+void SRRegionMap::removeRegion(int id) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<Regions> next = std::make_shared<Regions>(*std::atomic_load(&regions));
+    auto it = std::remove_if(next->begin(), next->end(), [id](const Region &m){return m.id == id;});
+    if (it == next->end())
+        return;
+    next->erase(it, next->end());
+    std::atomic_store(&regions, std::shared_ptr<const Regions>(next));
+}
+
+void SRRegionMap::clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::atomic_store(&regions, std::make_shared<const Regions>());
+}
+
+bool SRRegionMap::empty() const {
+    return std::atomic_load(&regions)->empty();
+}
+
+/* sharp steps between horizontal neighbours on every other row of a block, up to 128 */
+static int blockEdges(const uint8_t *luma, int stride, int width, int height) {
+    int edges = 0;
+    int w = std::min(width - 1, REGION_BLOCK);
+    for (int j = 0; j < height; j += 2, luma += 2 * (size_t) stride)
+        for (int i = 0; i < w; i++)
+            edges += abs(luma[i + 1] - luma[i]) > TEXT_EDGE_STEP;
+    return edges;
+}
+
+void SRRegionMap::detectText(const AVFrame *frame, std::vector<AVRegionOfInterest> &out) const {
+    //text blocks, merged into runs along each row of blocks, then the runs of the same columns into rectangles
+    struct Run {
+        int x0, x1;     //blocks
+        int y0;         //first row of blocks
+    };
+    static thread_local std::vector<Run> open, next;
+    open.clear();
+    int columns = (frame->width + REGION_BLOCK - 1) / REGION_BLOCK;
+    int rows = (frame->height + REGION_BLOCK - 1) / REGION_BLOCK;
+
+    auto emit = [&](const Run &r, int y1) {
+        if (out.size() >= REGION_MAX)
+            return;
+        AVRegionOfInterest roi;
+        roi.self_size = sizeof(AVRegionOfInterest);
+        roi.left = r.x0 * REGION_BLOCK;
+        roi.top = r.y0 * REGION_BLOCK;
+        roi.right = std::min(r.x1 * REGION_BLOCK, frame->width);
+        roi.bottom = std::min(y1 * REGION_BLOCK, frame->height);
+        roi.qoffset = textOffset;
+        out.push_back(roi);
+    };
+
+    for (int by = 0; by <= rows; by++) {
+        next.clear();
+        if (by < rows) {
+            const uint8_t *row = frame->data[0] + (size_t) by * REGION_BLOCK * frame->linesize[0];
+            int h = std::min(REGION_BLOCK, frame->height - by * REGION_BLOCK);
+            for (int bx = 0; bx < columns; bx++) {
+                int x = bx * REGION_BLOCK;
+                if (blockEdges(row + x, frame->linesize[0], frame->width - x, h) < TEXT_EDGE_MIN)
+                    continue;
+                if (!next.empty() && next.back().x1 == bx)
+                    next.back().x1 = bx + 1;
+                else
+                    next.push_back({bx, bx + 1, by});
+            }
+        }
+        //a run over the same columns as one of the row above continues its rectangle
+        for (Run &r : next)
+            for (const Run &o : open)
+                if (o.x0 == r.x0 && o.x1 == r.x1)
+                    r.y0 = o.y0;
+        for (const Run &o : open) {
+            bool continued = false;
+            for (const Run &r : next)
+                continued |= r.x0 == o.x0 && r.x1 == o.x1;
+            if (!continued)
+                emit(o, by);
+        }
+        std::swap(open, next);
+    }
+}
+
+void SRRegionMap::build(const AVFrame *frame, std::vector<AVRegionOfInterest> &out) const {
+    std::shared_ptr<const Regions> current = std::atomic_load(&regions);
+    for (const Region &r : *current) {
+        int x0 = std::max(r.x, 0), y0 = std::max(r.y, 0);
+        int x1 = std::min(r.x + r.width, frame->width), y1 = std::min(r.y + r.height, frame->height);
+        if (x1 <= x0 || y1 <= y0 || out.size() >= REGION_MAX)
+            continue;
+        AVRegionOfInterest roi;
+        roi.self_size = sizeof(AVRegionOfInterest);
+        roi.left = x0;
+        roi.top = y0;
+        roi.right = x1;
+        roi.bottom = y1;
+        roi.qoffset = r.qoffset;
+        out.push_back(roi);
+    }
+
+    //the luma of the 8 bit formats only, a device surface is not searched
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat) frame->format);
+    if (!detection() || frame->hw_frames_ctx || !desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_HWACCEL)) ||
+        desc->comp[0].depth != 8)
+        return;
+    detectText(frame, out);
+}
+
+int SRRegionMap::attach(AVFrame *frame, const std::vector<AVRegionOfInterest> &regions) {
+    av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    if (regions.empty())
+        return 0;
+    AVFrameSideData *sd = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                                 (int) (regions.size() * sizeof(AVRegionOfInterest)));
+    if (!sd)
+        return AVERROR(ENOMEM);
+    memcpy(sd->data, regions.data(), regions.size() * sizeof(AVRegionOfInterest));
+    return 0;
+}
@@ -0,0 +1,90 @@
+//
+// Regions of interest of the encoded frames: text found on the converted frames and the regions set by the application.
+//
+
+#ifndef CPPSCREENRECORDER_SRREGIONMAP_H
+#define CPPSCREENRECORDER_SRREGIONMAP_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+extern "C"
+{
+#include "libavutil/frame.h"
+#include "libavutil/rational.h"
+}
+
+#define REGION_BLOCK 16     //macroblock of the text search, the H.264 one
+#define TEXT_EDGE_STEP 48   //luma step between two neighbours that counts as the edge of a glyph
+#define TEXT_EDGE_MIN 12    //edges out of the 128 samples of a block that make it text: a lone line or border has 8
+#define TEXT_QOFFSET_NUM (-1)   //qoffset of the text blocks, -1/5 of the range: about -5 QP with libx264
+#define TEXT_QOFFSET_DEN 5
+#define REGION_MAX 256      //regions given to the encoder with each frame, the blocks found after are left out
+
+/**
+ * SRRegionMap gives per-block quantizer offsets to the encoders that support them, as
+ * AV_FRAME_DATA_REGIONS_OF_INTEREST side data: the text of the screen gets a lower quantizer and, since the rate control
+ * keeps the bitrate, the flat areas pay for it.\n
+ * With setDetection() every converted frame gets a cheap edge count on its luma: a macroblock with many sharp steps
+ * is text, the text blocks are merged into rectangles. The regions set by the application come before them,
+ * with their own offsets; the encoders use the first region that covers a block.
+ * The regions are published as an immutable snapshot, build() never waits for setRegion().
+ */
+class SRRegionMap {
+
+private:
+    struct Region {
+        int id;
+        int x, y, width, height;    //output pixels
+        AVRational qoffset;
+    };
+    typedef std::vector<Region> Regions;
+
+    std::mutex lock;    //writers only
+    std::shared_ptr<const Regions> regions;
+    std::atomic<bool> detect;
+    AVRational textOffset;
+
+    void detectText(const AVFrame *frame, std::vector<AVRegionOfInterest> &out) const;
+
+public:
+    SRRegionMap();
+
+    SRRegionMap(const SRRegionMap&) = delete;
+    SRRegionMap &operator=(const SRRegionMap&) = delete;
+
+    /**
+     * setDetection() turns the text search on the converted frames on or off
+     * @param qoffset of the text blocks, -1 to 1 like AVRegionOfInterest: negative is better quality
+     */
+    void setDetection(bool on, AVRational qoffset = (AVRational){TEXT_QOFFSET_NUM, TEXT_QOFFSET_DEN});
+    bool detection() const { return detect.load(std::memory_order_relaxed); }
+
+    /**
+     * setRegion() gives a rectangle of the output frame its own quantizer offset, or moves the one of the same id
+     * @param qoffset -1 to 1: -1 is the best quality the encoder allows, 1 the worst
+     */
+    void setRegion(int id, int x, int y, int width, int height, AVRational qoffset);
+
+    void removeRegion(int id);
+    void clear();
+
+    bool empty() const;
+
+    /**
+     * build() appends to out the regions of the application, then the text blocks of frame with detection()
+     * @Note any thread: the convert workers call it at the same time
+     */
+    void build(const AVFrame *frame, std::vector<AVRegionOfInterest> &out) const;
+
+    /**
+     * attach() replaces the regions of interest side data of frame with regions, nothing when empty
+     * @return 0 on success, AVERROR(ENOMEM)
+     */
+    static int attach(AVFrame *frame, const std::vector<AVRegionOfInterest> &regions);
+};
+
+#endif //CPPSCREENRECORDER_SRREGIONMAP_H
@@ -0,0 +1,219 @@
+#include "SRRendition.h"
+#include "SRLog.h"
+
+#include <cstring>
+#include <iostream>
+
+extern "C"
+{
+#include "libavutil/imgutils.h"
+#include "libavutil/opt.h"
+}
+
+using namespace std;
+
+SRRendition::SRRendition(const char *filename, int width, int height, int bitrate): filename(filename),
+        width(width), height(height), bitrate(bitrate), ctx(nullptr), enc(nullptr),
+        queue(RENDITION_QUEUE, SR_WAIT_PARK), pkt(nullptr), done(false), started(false), lastPts(AV_NOPTS_VALUE),
+        encoded(0), dropped(0) {}
+
+SRRendition::~SRRendition() {
+    finish();
+    task.reset();
+    av_packet_free(&pkt);
+    avcodec_free_context(&enc);
+    if (ctx) {
+        if (!(ctx->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&ctx->pb);
+        avformat_free_context(ctx);
+    }
+}
+
+int SRRendition::open(const AVCodecContext *source) {
+    int ret = avformat_alloc_output_context2(&ctx, nullptr, nullptr, filename.c_str());
+    if (ret < 0) {
+        cout << "\n[SRRendition] cannot guess the container of " << filename;
+        return ret;
+    }
+
+    //H.264 when the build has it, like the fallback of the recording otherwise
+    const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec)
+        codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    if (!codec || !(enc = avcodec_alloc_context3(codec)))
+        return AVERROR_ENCODER_NOT_FOUND;
+    enc->width = width;
+    enc->height = height;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->time_base = source->time_base;
+    enc->framerate = source->framerate.num > 0 ? source->framerate : av_inv_q(source->time_base);
+    enc->gop_size = (int) (av_q2d(enc->framerate) * RENDITION_GOP_SECONDS);
+    enc->max_b_frames = 0;
+    enc->bit_rate = (int64_t) bitrate * 1000;
+    enc->rc_max_rate = enc->bit_rate;
+    enc->rc_buffer_size = (int) enc->bit_rate;
+    enc->thread_type = FF_THREAD_SLICE;
+    if (!strcmp(codec->name, "libx264")) {
+        av_opt_set(enc->priv_data, "preset", "veryfast", 0);
+        av_opt_set(enc->priv_data, "tune", "zerolatency", 0);
+    }
+    if (ctx->oformat->flags & AVFMT_GLOBALHEADER)
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if ((ret = avcodec_open2(enc, codec, nullptr)) < 0) {
+        cout << "\n[SRRendition] cannot open " << codec->name << " for " << filename;
+        return ret;
+    }
+
+    AVStream *st = avformat_new_stream(ctx, nullptr);
+    if (!st)
+        return AVERROR(ENOMEM);
+    if ((ret = avcodec_parameters_from_context(st->codecpar, enc)) < 0)
+        return ret;
+    st->time_base = enc->time_base;
+
+    if ((ret = scaled.initVideo(enc->pix_fmt, width, height, RENDITION_QUEUE)) < 0)
+        return ret;
+    if (!(ctx->oformat->flags & AVFMT_NOFILE) &&
+        (ret = avio_open2(&ctx->pb, filename.c_str(), AVIO_FLAG_WRITE, nullptr, nullptr)) < 0) {
+        cout << "\n[SRRendition] cannot create " << filename;
+        return ret;
+    }
+    if ((ret = avformat_write_header(ctx, nullptr)) < 0)
+        return ret;
+    cout << "\n[SRRendition] " << filename << ": " << codec->name << " " << width << "x" << height << " at "
+         << bitrate << " kbit/s";
+    return 0;
+}
+
+void SRRendition::start(SRTaskPool *pool) {
+    if (!enc || started)
+        return;
+    if (pool) {
+        pkt = av_packet_alloc();
+        task.reset(new SRSerialTask(*pool, [this](){return step();}, SR_TASK_BACKGROUND));
+    } else {
+        encoder = std::thread(&SRRendition::run, this);
+    }
+    started = true;
+}
+
+void SRRendition::send(const AVFrame *frame) {
+    if (!started || frame->hw_frames_ctx) {
+        dropped++;
+        return;
+    }
+    AVFrame *queued = refs.getEmpty();
+    if (!queued || av_frame_ref(queued, frame) < 0 || !queue.tryPush(queued)) {
+        refs.release(queued);
+        dropped++;
+        return;
+    }
+    if (task)
+        task->schedule();
+}
+
+/**
+ * run() is the encoder thread: it scales, encodes and writes every queued frame until finish()
+ */
+void SRRendition::run() {
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame;
+    while (queue.pop(frame))
+        encodeFrame(frame, pkt);
+    drain(pkt);
+    av_packet_free(&pkt);
+}
+
+/**
+ * step() is the encoder task: one queued frame per call, the trailer once finish() closed the empty queue
+ * @return whether there may be more to do
+ */
+bool SRRendition::step() {
+    AVFrame *frame;
+    if (queue.tryPop(frame)) {
+        encodeFrame(frame, pkt);
+        return true;
+    }
+    //the queue is closed before the last schedule(): an empty closed queue stays empty
+    if (!queue.isClosed() || queue.size() > 0)
+        return false;
+    std::lock_guard<std::mutex> guard(doneLock);
+    if (!done) {
+        drain(pkt);
+        done = true;
+        doneCv.notify_all();
+    }
+    return false;
+}
+
+/**
+ * encodeFrame() scales, encodes and writes frame and gives it back to the pool of references
+ */
+void SRRendition::encodeFrame(AVFrame *frame, AVPacket *pkt) {
+    AVFrame *out = scaled.get();
+    if (!out || !pkt || scaler.configure(frame->width, frame->height, (enum AVPixelFormat) frame->format,
+                                         width, height, enc->pix_fmt, SWS_BILINEAR, 1) < 0) {
+        srLog(SR_LOG_ERROR, "[SRRendition] cannot scale the frames for %s", filename.c_str());
+        scaled.release(out);
+        refs.release(frame);
+        dropped++;
+        return;
+    }
+    scaler.scale(frame, out);
+    //capture clock microseconds to encoder ticks, two frames within a tick must not share it
+    int64_t pts = av_rescale_q(frame->pts, AV_TIME_BASE_Q, enc->time_base);
+    if (lastPts != AV_NOPTS_VALUE && pts <= lastPts)
+        pts = lastPts + 1;
+    out->pts = lastPts = pts;
+    refs.release(frame);
+    encode(out, pkt);
+    scaled.release(out);
+    encoded++;
+}
+
+/**
+ * drain() flushes the encoder and writes the trailer
+ */
+void SRRendition::drain(AVPacket *pkt) {
+    if (pkt) {
+        encode(nullptr, pkt);
+        av_write_trailer(ctx);
+    }
+}
+
+/**
+ * encode() gives frame to the encoder, nullptr drains it, and writes the packets it has ready
+ */
+void SRRendition::encode(AVFrame *frame, AVPacket *pkt) {
+    if (avcodec_send_frame(enc, frame) < 0) {
+        srLog(SR_LOG_WARNING, "[SRRendition] cannot encode a frame for %s", filename.c_str());
+        return;
+    }
+    while (avcodec_receive_packet(enc, pkt) >= 0) {
+        pkt->stream_index = 0;
+        av_packet_rescale_ts(pkt, enc->time_base, ctx->streams[0]->time_base);
+        if (av_write_frame(ctx, pkt) < 0)
+            srLog(SR_LOG_ERROR, "[SRRendition] error in writing %s", filename.c_str());
+        av_packet_unref(pkt);
+    }
+}
+
+void SRRendition::finish() {
+    if (!started.exchange(false))
+        return;
+    queue.close();
+    if (task) {
+        task->schedule();
+        std::unique_lock<std::mutex> guard(doneLock);
+        doneCv.wait(guard, [this](){return done;});
+    } else {
+        encoder.join();
+    }
+    cout << "\n[SRRendition] " << filename << ": " << encoded << " frames";
+    if (dropped)
+        cout << ", " << dropped << " dropped";
+}
+
+int64_t SRRendition::reservedBytes() const {
+    return (int64_t) av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 32) * RENDITION_QUEUE * 2;
+}
@@ -0,0 +1,111 @@
+//
+// Extra encode of the recorded frames (e.g. a low bitrate preview), with its own encoder thread or task and muxer.
+//
+
+#ifndef CPPSCREENRECORDER_SRRENDITION_H
+#define CPPSCREENRECORDER_SRRENDITION_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "SRFramePool.h"
+#include "SRRingBuffer.h"
+#include "SRScaler.h"
+#include "SRTaskPool.h"
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+#define RENDITION_GOP_SECONDS 2     //keyframe interval of a rendition, a late viewer waits at most this long
+#define RENDITION_QUEUE 8   //frames a rendition may be behind before they are dropped
+
+/**
+ * SRRendition encodes the frames the recording already grabbed and converted, at its own size and bitrate,
+ * into its own output: the screen is read and color converted once for all the renditions.\n
+ * send() only references the frame into a bounded queue, the encoder thread scales the frame down, encodes
+ * and writes it, so a slow rendition never blocks the ProducerThread. When the queue is full the frame is dropped.\n
+ * Started on a task pool, the encoder is a background serial task instead of a thread: one frame per step.
+ *
+ * @Note system memory frames only, hardware surfaces are dropped
+ */
+class SRRendition {
+
+private:
+    std::string filename;
+    int width, height, bitrate;
+    AVFormatContext *ctx;
+    AVCodecContext *enc;
+    SRScaler scaler;
+    SRFramePool refs;
+    SRFramePool scaled;
+    SRRingBuffer<AVFrame*> queue;
+    std::thread encoder;
+    std::unique_ptr<SRSerialTask> task;     //instead of the encoder thread
+    AVPacket *pkt;      //of the task
+    std::mutex doneLock;
+    std::condition_variable doneCv;
+    bool done;          //the task wrote the trailer
+    std::atomic<bool> started;
+    int64_t lastPts;    //encoder thread only
+
+    std::atomic<uint64_t> encoded;
+    std::atomic<uint64_t> dropped;
+
+    void run();
+    bool step();
+    void encodeFrame(AVFrame *frame, AVPacket *pkt);
+    void drain(AVPacket *pkt);
+    void encode(AVFrame *frame, AVPacket *pkt);
+
+public:
+    /**
+     * @param width size of the rendition, the recording frames are scaled to it
+     * @param bitrate kbit/s
+     */
+    SRRendition(const char *filename, int width, int height, int bitrate);
+    ~SRRendition();
+
+    SRRendition(const SRRendition&) = delete;
+    SRRendition &operator=(const SRRendition&) = delete;
+
+    /**
+     * open() opens the encoder and writes the header of the output
+     * @param source encoder of the recording: frame rate and time base are shared
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int open(const AVCodecContext *source);
+
+    /**
+     * start() starts the encoder thread, or the encoder task at background priority on pool when given
+     */
+    void start(SRTaskPool *pool = nullptr);
+
+    /**
+     * send() queues a reference to frame, without ever waiting
+     * @Note ProducerThread only, frame pts in microseconds on the capture clock
+     */
+    void send(const AVFrame *frame);
+
+    /**
+     * finish() encodes what is queued, drains the encoder and writes the trailer
+     */
+    void finish();
+
+    const std::string &name() const { return filename; }
+    uint64_t encodedFrames() const { return encoded; }
+    uint64_t droppedFrames() const { return dropped; }
+
+    /**
+     * reservedBytes() estimates the memory of the rendition: the scaled frames of its queue and as many in the encoder
+     */
+    int64_t reservedBytes() const;
+};
+
+#endif //CPPSCREENRECORDER_SRRENDITION_H
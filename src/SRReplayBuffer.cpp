@@ -0,0 +1,213 @@
+#include "SRReplayBuffer.h"
+#include "SRLog.h"
+
+#include <cstdio>
+#include <iostream>
+
+using namespace std;
+
+SRReplayBuffer::SRReplayBuffer(int duration, int64_t maxBytes): maxDuration((int64_t) duration * 1000000),
+        maxBytes(maxBytes), videoIndex(-1), arena(maxBytes), source(nullptr), bytes(0), evicted(0), saving(false), saved(0) {}
+
+SRReplayBuffer::~SRReplayBuffer() {
+    finish();
+    for (Gop &gop : gops)
+        releasePackets(gop.packets);
+    for (AVCodecParameters *par : parameters)
+        avcodec_parameters_free(&par);
+}
+
+int SRReplayBuffer::init(const AVFormatContext *source) {
+    for (unsigned int i = 0; i < source->nb_streams; i++) {
+        AVCodecParameters *par = avcodec_parameters_alloc();
+        if (!par)
+            return AVERROR(ENOMEM);
+        parameters.push_back(par);
+        int ret = avcodec_parameters_copy(par, source->streams[i]->codecpar);
+        if (ret < 0)
+            return ret;
+        timeBases.push_back(source->streams[i]->time_base);
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO && videoIndex < 0)
+            videoIndex = (int) i;
+    }
+    return 0;
+}
+
+void SRReplayBuffer::push(const AVPacket *pkt) {
+    if (pkt->pts == AV_NOPTS_VALUE || pkt->stream_index >= (int) timeBases.size())
+        return;
+    int64_t pts = av_rescale_q(pkt->pts, timeBases[pkt->stream_index], AV_TIME_BASE_Q);
+    bool key = pkt->stream_index == videoIndex && (pkt->flags & AV_PKT_FLAG_KEY);
+    //without video every packet starts a GOP: audio frames are all keyframes
+    if (videoIndex < 0)
+        key = true;
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (!key && gops.empty())
+        return;
+    SRArenaPacket stored;
+    if (!(source && source->adopt(pkt, stored)) && !arena.store(pkt, stored)) {
+        srLog(SR_LOG_WARNING, "[SRReplayBuffer] cannot store a packet, the replay will have a gap");
+        return;
+    }
+    if (key) {
+        gops.push_back(Gop{pts, pts, 0, {}});
+        if (!spareLists.empty()) {
+            gops.back().packets.swap(spareLists.back());
+            spareLists.pop_back();
+        }
+    }
+    Gop &gop = gops.back();
+    gop.packets.push_back(stored);
+    gop.end = FFMAX(gop.end, pts);
+    gop.bytes += stored.size;
+    bytes += stored.size;
+    evict();
+}
+
+/**
+ * evict() drops the oldest GOP while the ones after it still span the duration, or while the buffer is too large.
+ * The newest GOP is always kept.
+ */
+void SRReplayBuffer::evict() {
+    while (gops.size() > 1 && (gops.back().end - gops[1].start >= maxDuration || bytes > maxBytes)) {
+        bytes -= gops.front().bytes;
+        releasePackets(gops.front().packets);
+        spareLists.push_back(std::move(gops.front().packets));
+        gops.pop_front();
+        evicted++;
+    }
+}
+
+int SRReplayBuffer::save(const char *path) {
+    if (saving.exchange(true))
+        return AVERROR(EBUSY);
+    //the previous replay is written: its thread is done or about to be
+    if (saver.joinable())
+        saver.join();
+
+    std::vector<SRArenaPacket> packets;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (gops.empty()) {
+            saving = false;
+            return AVERROR(EAGAIN);
+        }
+        size_t count = 0;
+        for (const Gop &gop : gops)
+            count += gop.packets.size();
+        packets.reserve(count);
+        //the slabs stay alive for the saver even if the GOPs are evicted meanwhile
+        for (const Gop &gop : gops)
+            for (const SRArenaPacket &packet : gop.packets) {
+                arena.retain(packet);
+                packets.push_back(packet);
+            }
+    }
+    saver = std::thread(&SRReplayBuffer::write, this, std::string(path), std::move(packets));
+    return 0;
+}
+
+/**
+ * write() is the thread of save(): it muxes the packets into path, the first one at 0, and releases them.
+ * They are in mux order already: av_write_frame() takes them as they are, without copying the payloads.
+ */
+void SRReplayBuffer::write(std::string path, std::vector<SRArenaPacket> packets) {
+    AVFormatContext *out = nullptr;
+    int ret = avformat_alloc_output_context2(&out, nullptr, nullptr, path.c_str());
+    for (size_t i = 0; ret >= 0 && i < parameters.size(); i++) {
+        AVStream *st = avformat_new_stream(out, nullptr);
+        ret = st ? avcodec_parameters_copy(st->codecpar, parameters[i]) : AVERROR(ENOMEM);
+        if (st) {
+            st->codecpar->codec_tag = 0;
+            st->time_base = timeBases[i];
+        }
+    }
+    if (ret >= 0 && !(out->oformat->flags & AVFMT_NOFILE))
+        ret = avio_open(&out->pb, path.c_str(), AVIO_FLAG_WRITE);
+    if (ret >= 0)
+        ret = avformat_write_header(out, nullptr);
+
+    //the first packet is the keyframe of the oldest GOP, in mux order nothing has a lower dts
+    int64_t origin = packets.empty() ? 0 : av_rescale_q(packets[0].dts != AV_NOPTS_VALUE ? packets[0].dts : packets[0].pts,
+                                                         timeBases[packets[0].stream_index], AV_TIME_BASE_Q);
+    int64_t first = AV_NOPTS_VALUE, last = AV_NOPTS_VALUE;
+    AVPacket pkt;
+    for (const SRArenaPacket &packet : packets) {
+        if (ret < 0)
+            break;
+        SRPacketArena::toPacket(packet, &pkt);
+        AVRational tb = timeBases[pkt.stream_index];
+        int64_t shift = av_rescale_q(origin, AV_TIME_BASE_Q, tb);
+        int64_t pts = av_rescale_q(pkt.pts, tb, AV_TIME_BASE_Q);
+        if (first == AV_NOPTS_VALUE)
+            first = pts;
+        last = FFMAX(last, pts);
+        pkt.pts -= shift;
+        if (pkt.dts != AV_NOPTS_VALUE)
+            pkt.dts -= shift;
+        av_packet_rescale_ts(&pkt, tb, out->streams[pkt.stream_index]->time_base);
+        pkt.pos = -1;
+        ret = av_write_frame(out, &pkt);
+    }
+    if (ret >= 0)
+        ret = av_write_trailer(out);
+
+    if (out) {
+        if (!(out->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&out->pb);
+        avformat_free_context(out);
+    }
+    releasePackets(packets);
+    if (ret < 0) {
+        srLog(SR_LOG_ERROR, "[SRReplayBuffer] cannot write the replay %s", path.c_str());
+        remove(path.c_str());
+    } else {
+        saved++;
+        srLog(SR_LOG_INFO, "[SRReplayBuffer] replay of %.1f s written to %s", (last - first) / 1000000.0, path.c_str());
+    }
+    saving = false;
+}
+
+void SRReplayBuffer::drain(const std::function<void(AVPacket *pkt)> &sink) {
+    std::deque<Gop> taken;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        taken.swap(gops);
+        bytes = 0;
+    }
+    AVPacket pkt;
+    for (Gop &gop : taken) {
+        for (const SRArenaPacket &packet : gop.packets) {
+            SRPacketArena::toPacket(packet, &pkt);
+            pkt.pos = -1;
+            sink(&pkt);
+        }
+        releasePackets(gop.packets);
+        std::lock_guard<std::mutex> guard(lock);
+        spareLists.push_back(std::move(gop.packets));
+    }
+}
+
+void SRReplayBuffer::finish() {
+    if (saver.joinable())
+        saver.join();
+}
+
+void SRReplayBuffer::releasePackets(std::vector<SRArenaPacket> &packets) {
+    for (SRArenaPacket &packet : packets)
+        arena.release(packet);
+    packets.clear();
+}
+
+SRReplayStats SRReplayBuffer::stats() const {
+    std::lock_guard<std::mutex> guard(lock);
+    SRReplayStats s;
+    s.duration = gops.empty() ? 0 : gops.back().end - gops.front().start;
+    s.bytes = bytes;
+    s.gops = gops.size();
+    s.evictedGops = evicted;
+    s.saved = saved;
+    s.slabs = arena.slabsAllocated();
+    return s;
+}
@@ -0,0 +1,133 @@
+//
+// Instant replay: the last seconds of encoded packets kept in memory, saved to a file on demand.
+//
+
+#ifndef CPPSCREENRECORDER_SRREPLAYBUFFER_H
+#define CPPSCREENRECORDER_SRREPLAYBUFFER_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SRPacketArena.h"
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+#define REPLAY_DURATION 30  //s kept by SR_OUTPUT_REPLAY
+#define REPLAY_MAX_BYTES (512 << 20)    //bytes kept by SR_OUTPUT_REPLAY, whatever the duration
+#define REPLAY_GOP_DURATION 2   //s between the keyframes of SR_OUTPUT_REPLAY, the granularity of the eviction
+
+/**
+ * Statistics of an SRReplayBuffer: what it holds now, the GOPs evicted so far and the replays written.
+ */
+typedef struct U{
+    int64_t duration;   //us
+    int64_t bytes;
+    uint64_t gops;
+    uint64_t evictedGops;
+    uint64_t saved;
+    uint64_t slabs;     //arena slabs allocated so far
+}SRReplayStats;
+
+/**
+ * SRReplayBuffer keeps the packets of the recording, in mux order, as a queue of GOPs: each GOP starts
+ * on a video keyframe and holds every packet, audio included, until the next one.
+ * Whole GOPs are evicted from the front, so the buffer always starts on a keyframe and spans
+ * at least the requested duration, within one GOP, unless the byte limit is reached first.\n
+ * The payloads are copied into an SRPacketArena and the GOPs are lists of plain structs, recycled on eviction:
+ * once the buffer is full, keeping an hour of packets costs no heap allocation per packet.\n
+ * save() references the packets it holds and writes them from its own thread, with timestamps from 0:
+ * the MuxerThread keeps pushing while the replay is written, neither the capture nor the encoders wait.
+ *
+ * @Note push() is MuxerThread only, save() and stats() may be called from any thread
+ */
+class SRReplayBuffer {
+
+private:
+    struct Gop {
+        int64_t start;  //us, pts of the keyframe
+        int64_t end;    //us, newest pts of the GOP
+        int64_t bytes;
+        std::vector<SRArenaPacket> packets;
+    };
+
+    int64_t maxDuration;    //us
+    int64_t maxBytes;
+    std::vector<AVCodecParameters*> parameters;
+    std::vector<AVRational> timeBases;
+    int videoIndex;
+
+    SRPacketArena arena;
+    SRPacketArena *source;  //packets written there by an encoder are held by reference
+    mutable std::mutex lock;
+    std::deque<Gop> gops;
+    std::vector<std::vector<SRArenaPacket>> spareLists;     //packet lists of the evicted GOPs, with their capacity
+    int64_t bytes;
+    uint64_t evicted;
+
+    std::thread saver;
+    std::atomic<bool> saving;
+    std::atomic<uint64_t> saved;
+
+    void evict();
+    void write(std::string path, std::vector<SRArenaPacket> packets);
+    void releasePackets(std::vector<SRArenaPacket> &packets);
+
+public:
+    /**
+     * @param duration s kept, at least
+     * @param maxBytes bytes kept, at most, whole GOPs are dropped to stay below
+     */
+    SRReplayBuffer(int duration, int64_t maxBytes);
+    ~SRReplayBuffer();
+
+    SRReplayBuffer(const SRReplayBuffer&) = delete;
+    SRReplayBuffer &operator=(const SRReplayBuffer&) = delete;
+
+    /**
+     * init() takes the streams of the recording: codec parameters and time bases of the packets
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int init(const AVFormatContext *source);
+
+    /**
+     * setSource() holds the packets whose payload is in arena by reference instead of copying them
+     * @Note arena must outlive the replay buffer
+     */
+    void setSource(SRPacketArena *arena) { source = arena; }
+
+    /**
+     * push() copies pkt, or references it in the source arena, without its side data; packets before the first video keyframe are dropped
+     */
+    void push(const AVPacket *pkt);
+
+    /**
+     * save() starts writing the buffered packets to path, in the container of its extension, and returns
+     * @return 0 when the replay is being written, AVERROR(EBUSY) while the previous one is, AVERROR(EAGAIN) when
+     * the buffer holds no keyframe yet
+     */
+    int save(const char *path);
+
+    /**
+     * drain() hands the buffered packets to sink, oldest first, in the time bases of init(), and empties the buffer
+     * @Note MuxerThread only, like push(): the packets are valid during the call only
+     */
+    void drain(const std::function<void(AVPacket *pkt)> &sink);
+
+    /**
+     * finish() waits for the replay being written, if any
+     */
+    void finish();
+
+    SRReplayStats stats() const;
+};
+
+#endif //CPPSCREENRECORDER_SRREPLAYBUFFER_H
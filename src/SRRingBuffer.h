@@ -0,0 +1,303 @@
+//
+// Bounded lock-free ring used to hand frames and packets between pipeline stages.
+//
+
+#ifndef CPPSCREENRECORDER_SRRINGBUFFER_H
+#define CPPSCREENRECORDER_SRRINGBUFFER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "SRProfiler.h"
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define SR_CPU_RELAX() _mm_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define SR_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define SR_CPU_RELAX() do {} while (0)
+#endif
+
+#define SR_CACHE_LINE 64
+#define SR_SPIN_COUNT 128   //busy iterations of SR_WAIT_PARK before sleeping
+
+/**
+ * How a blocked push() or pop() waits:\n
+ * - SR_WAIT_SPIN burns its core, lowest latency, for stages that never idle \n
+ * - SR_WAIT_YIELD gives the core back to the scheduler at every check \n
+ * - SR_WAIT_PARK spins briefly, then sleeps until the other side moves (futex on Linux) \n
+ * - SR_WAIT_SLEEP sleeps at once like SR_WAIT_PARK after its spins: a wake-up later, but no core kept awake \n
+ */
+typedef enum W{
+    SR_WAIT_SPIN,
+    SR_WAIT_YIELD,
+    SR_WAIT_PARK,
+    SR_WAIT_SLEEP
+}SRWaitStrategy;
+
+/**
+ * SRRingBuffer is a fixed-capacity single-producer/single-consumer queue.\n
+ * Exactly one thread may call push() and exactly one thread may call pop().\n
+ * The producer calls close() when it will not push anymore: the consumer can still
+ * drain the remaining elements, after which pop() returns false.\n
+ * Producer and consumer indexes live on their own cache lines and each side keeps a cached copy
+ * of the other index, so the shared lines are only touched when the ring looks full or empty.
+ */
+template <typename T>
+class SRRingBuffer {
+
+private:
+    std::vector<T> slots;
+    const size_t capacity;
+    const SRWaitStrategy strategy;
+
+    char pad0[SR_CACHE_LINE];
+    std::atomic<size_t> head;   // next slot to read, owned by the consumer
+    size_t cachedTail;          // consumer copy of tail
+    char pad1[SR_CACHE_LINE];
+    std::atomic<size_t> tail;   // next slot to write, owned by the producer
+    size_t cachedHead;          // producer copy of head
+    size_t highWater;           // written by the producer only
+    char pad2[SR_CACHE_LINE];
+
+    //parking: seq changes on every push, pop and close, sleepers tells whether to wake anybody
+    std::atomic<uint32_t> seq;
+    std::atomic<int> sleepers;
+    std::atomic<bool> closed;
+    SRMutex parkLock;
+    SRCondition parkCv;
+
+    void wake() {
+        if (strategy != SR_WAIT_PARK && strategy != SR_WAIT_SLEEP)
+            return;
+        seq.fetch_add(1, std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_seq_cst) == 0)
+            return;
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&seq), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#else
+        { std::lock_guard<SRMutex> guard(parkLock); }
+        parkCv.notify_all();
+#endif
+    }
+
+    /**
+     * idle() waits for the other side according to the strategy
+     * @param spins number of checks done so far
+     * @param seen value of seq read before the failed check
+     * @param timeoutUs longest sleep, negative sleeps until woken
+     */
+    void idle(unsigned int spins, uint32_t seen, int64_t timeoutUs = -1) {
+        if (strategy == SR_WAIT_SPIN || (strategy == SR_WAIT_PARK && spins < SR_SPIN_COUNT)) {
+            SR_CPU_RELAX();
+            return;
+        }
+        if (strategy == SR_WAIT_YIELD) {
+            std::this_thread::yield();
+            return;
+        }
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+#ifdef __linux__
+        struct timespec limit = {(time_t) (timeoutUs / 1000000), (long) (timeoutUs % 1000000) * 1000};
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&seq), FUTEX_WAIT_PRIVATE, seen,
+                timeoutUs < 0 ? nullptr : &limit, nullptr, 0);
+#else
+        {
+            std::unique_lock<SRMutex> guard(parkLock);
+            int64_t sleepUs = timeoutUs < 0 || timeoutUs > 10000 ? 10000 : timeoutUs;
+            parkCv.wait_for(guard, std::chrono::microseconds(sleepUs),
+                            [&](){return seq.load(std::memory_order_seq_cst) != seen;});
+        }
+#endif
+        sleepers.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+public:
+    explicit SRRingBuffer(size_t capacity = 1, SRWaitStrategy strategy = SR_WAIT_YIELD):
+            slots(capacity + 1), capacity(capacity + 1), strategy(strategy),
+            head(0), cachedTail(0), tail(0), cachedHead(0), highWater(0), seq(0), sleepers(0), closed(false) {
+        static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be a plain 32 bit integer");
+    }
+
+    SRRingBuffer(const SRRingBuffer&) = delete;
+    SRRingBuffer &operator=(const SRRingBuffer&) = delete;
+
+    /**
+     * tryPush() stores an element if there is a free slot
+     * @return false if the ring is full
+     */
+    bool tryPush(const T &item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % capacity;
+        if (next == cachedHead) {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (next == cachedHead)
+                return false;
+        }
+        slots[t] = item;
+        tail.store(next, std::memory_order_release);
+
+        size_t used = (next + capacity - cachedHead) % capacity;
+        if (used > highWater) highWater = used;
+        wake();
+        return true;
+    }
+
+    /**
+     * tryPushBatch() stores as many of the count items as there are free slots,
+     * published with a single store and a single wakeup of the consumer
+     * @return the number of items stored
+     */
+    size_t tryPushBatch(const T *items, size_t count) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t free = (cachedHead + capacity - t - 1) % capacity;
+        if (free < count) {
+            cachedHead = head.load(std::memory_order_acquire);
+            free = (cachedHead + capacity - t - 1) % capacity;
+        }
+        size_t n = count < free ? count : free;
+        if (!n)
+            return 0;
+        for (size_t i = 0; i < n; i++)
+            slots[(t + i) % capacity] = items[i];
+        size_t next = (t + n) % capacity;
+        tail.store(next, std::memory_order_release);
+
+        size_t used = (next + capacity - cachedHead) % capacity;
+        if (used > highWater) highWater = used;
+        wake();
+        return n;
+    }
+
+    /**
+     * tryPop() takes the oldest element if there is one
+     * @return false if the ring is empty
+     */
+    bool tryPop(T &item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == cachedTail) {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (h == cachedTail)
+                return false;
+        }
+        item = slots[h];
+        head.store((h + 1) % capacity, std::memory_order_release);
+        wake();
+        return true;
+    }
+
+    /**
+     * push() waits for a free slot
+     * @return false if the ring has been closed while waiting
+     */
+    bool push(const T &item) {
+        for (unsigned int spins = 0; ; spins++) {
+            uint32_t seen = seq.load(std::memory_order_seq_cst);
+            if (tryPush(item))
+                return true;
+            if (closed.load(std::memory_order_acquire))
+                return false;
+            idle(spins, seen);
+        }
+    }
+
+    /**
+     * pushBatch() waits until the count items are stored, in as few publications as the free slots allow
+     * @return the number of items stored, fewer than count if the ring has been closed while waiting
+     */
+    size_t pushBatch(const T *items, size_t count) {
+        size_t done = 0;
+        for (unsigned int spins = 0; done < count; spins++) {
+            uint32_t seen = seq.load(std::memory_order_seq_cst);
+            size_t n = tryPushBatch(items + done, count - done);
+            done += n;
+            if (n)
+                continue;
+            if (closed.load(std::memory_order_acquire))
+                break;
+            idle(spins, seen);
+        }
+        return done;
+    }
+
+    /**
+     * pop() waits for an element
+     * @return false once the ring is closed and drained
+     */
+    bool pop(T &item) {
+        for (unsigned int spins = 0; ; spins++) {
+            uint32_t seen = seq.load(std::memory_order_seq_cst);
+            if (tryPop(item))
+                return true;
+            if (closed.load(std::memory_order_acquire))
+                return tryPop(item);
+            idle(spins, seen);
+        }
+    }
+
+    /**
+     * waitReadable() waits until there is an element or the ring is closed, without taking it
+     * @param timeoutUs gives up after this many microseconds, negative waits forever
+     * @return false if the timeout expired first
+     */
+    bool waitReadable(int64_t timeoutUs = -1) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+        for (unsigned int spins = 0; ; spins++) {
+            uint32_t seen = seq.load(std::memory_order_seq_cst);
+            if (size() > 0 || closed.load(std::memory_order_acquire))
+                return true;
+            if (timeoutUs < 0) {
+                idle(spins, seen);
+                continue;
+            }
+            int64_t left = std::chrono::duration_cast<std::chrono::microseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+            if (left <= 0)
+                return false;
+            idle(spins, seen, left);
+        }
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+        wake();
+    }
+
+    bool isClosed() const {
+        return closed.load(std::memory_order_acquire);
+    }
+
+    size_t size() const {
+        size_t h = head.load(std::memory_order_acquire);
+        size_t t = tail.load(std::memory_order_acquire);
+        return (t + capacity - h) % capacity;
+    }
+
+    /**
+     * highWaterMark() is the highest number of queued elements seen by the producer (an upper bound,
+     * the producer measures against its cached consumer index): a ring that reaches its capacity is a stage that cannot keep up
+     * @Note read it from the producer thread or once the producer has stopped
+     */
+    size_t highWaterMark() const {
+        return highWater;
+    }
+
+    size_t maxSize() const {
+        return capacity - 1;
+    }
+};
+
+#endif //CPPSCREENRECORDER_SRRINGBUFFER_H
@@ -0,0 +1,267 @@
+#include "SRScaler.h"
+
+extern "C"
+{
+#include "libavutil/common.h"
+#include "libavutil/error.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
+}
+
+#if defined(__GNUC__)
+#define SR_PREFETCH(p) __builtin_prefetch(p)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define SR_PREFETCH(p) _mm_prefetch((const char *) (p), _MM_HINT_T0)
+#else
+#define SR_PREFETCH(p) ((void) 0)
+#endif
+
+#define TILE_PREFETCH_ROWS 2    //source rows of the next tile prefetched before a tile is converted
+
+/**
+ * bandPlanes() points the planes of a frame at the given luma row
+ */
+static void bandPlanes(enum AVPixelFormat format, uint8_t *const data[], const int linesize[], int row, uint8_t *planes[4]) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    int nbPlanes = av_pix_fmt_count_planes(format);
+    for (int i = 0; i < 4; i++) {
+        if (i >= nbPlanes) {
+            planes[i] = nullptr;
+            continue;
+        }
+        //planes 1 and 2 carry the chroma of YUV formats, NV12 included
+        int shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+        planes[i] = data[i] + (int64_t) (row >> shift) * linesize[i];
+    }
+}
+
+SRScaler::SRScaler(): fastPath(nullptr), downscale(SR_DOWNSCALE_NONE), pool(nullptr), tileWidth(0), tileHeight(0), generation(0), pending(0), quit(false), src(nullptr), dst(nullptr),
+                      srcFormat(AV_PIX_FMT_NONE), dstFormat(AV_PIX_FMT_NONE), colorspace(AVCOL_SPC_UNSPECIFIED),
+                      colorRange(AVCOL_RANGE_UNSPECIFIED), srcWidth(0), srcHeight(0), dstWidth(0), dstHeight(0), swsFlags(0), requestedBands(0) {}
+
+SRScaler::~SRScaler() {
+    stopHelpers();
+    freeContexts();
+}
+
+void SRScaler::stopHelpers() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        quit = true;
+    }
+    startCv.notify_all();
+    for (auto &t : helpers)
+        t.join();
+    helpers.clear();
+    quit = false;
+}
+
+void SRScaler::freeContexts() {
+    for (auto ctx : contexts)
+        sws_freeContext(ctx);
+    contexts.clear();
+}
+
+void SRScaler::setColorspace(enum AVColorSpace space, enum AVColorRange range) {
+    if (space == colorspace && range == colorRange)
+        return;
+    colorspace = space;
+    colorRange = range;
+    //the next configure() rebuilds the contexts
+    srcWidth = 0;
+}
+
+/**
+ * applyColorspace() gives the matrix of space to both sides of a context, and range to its YUV destination
+ */
+static void applyColorspace(struct SwsContext *ctx, enum AVColorSpace space, enum AVColorRange range) {
+    int *invTable, *table, srcRange, dstRange, brightness, contrast, saturation;
+    bool matrix = space != AVCOL_SPC_UNSPECIFIED && space != AVCOL_SPC_RGB;
+    if ((!matrix && range == AVCOL_RANGE_UNSPECIFIED) ||
+        sws_getColorspaceDetails(ctx, &invTable, &srcRange, &table, &dstRange, &brightness, &contrast, &saturation) < 0)
+        return;
+    const int *srcTable = invTable, *dstTable = table;
+    //the SWS_CS_ values are the AVColorSpace ones
+    if (matrix)
+        srcTable = dstTable = sws_getCoefficients(space);
+    if (range != AVCOL_RANGE_UNSPECIFIED)
+        dstRange = range == AVCOL_RANGE_JPEG;
+    sws_setColorspaceDetails(ctx, srcTable, srcRange, dstTable, dstRange, brightness, contrast, saturation);
+}
+
+int SRScaler::configure(int srcW, int srcH, enum AVPixelFormat srcFmt, int dstW, int dstH, enum AVPixelFormat dstFmt,
+                        int flags, int bands) {
+    if (srcW == srcWidth && srcH == srcHeight && srcFmt == srcFormat && dstW == dstWidth && dstH == dstHeight &&
+        dstFmt == dstFormat && flags == swsFlags && bands == requestedBands)
+        return 0;
+
+    const AVPixFmtDescriptor *srcDesc = av_pix_fmt_desc_get(srcFmt);
+    const AVPixFmtDescriptor *dstDesc = av_pix_fmt_desc_get(dstFmt);
+    if (!srcDesc || !dstDesc) return AVERROR(EINVAL);
+    srcWidth = srcW;
+    srcHeight = srcH;
+    srcFormat = srcFmt;
+    dstWidth = dstW;
+    dstHeight = dstH;
+    dstFormat = dstFmt;
+    swsFlags = flags;
+    requestedBands = bands;
+
+    //the exact downscales of 8 bit RGB need no filter taps of swscale either
+    bool rgb8 = srcFmt == AV_PIX_FMT_BGR0 || srcFmt == AV_PIX_FMT_BGRA || srcFmt == AV_PIX_FMT_RGB0 || srcFmt == AV_PIX_FMT_RGBA;
+    downscale = rgb8 ? getDownscale(srcW, srcH, dstW, dstH) : SR_DOWNSCALE_NONE;
+    fastPath = (srcW == dstW && srcH == dstH) || downscale != SR_DOWNSCALE_NONE ?
+               getColorConverter(srcFmt, dstFmt, colorspace, colorRange) : nullptr;
+    if (!fastPath)
+        downscale = SR_DOWNSCALE_NONE;
+
+    //a band needs whole chroma rows on both sides and enough rows for the filter taps
+    int srcAlign = 1 << srcDesc->log2_chroma_h;
+    int dstAlign = FFMAX(1 << dstDesc->log2_chroma_h, srcAlign);
+    //4:3 bands start on a group of 3 output rows, 6 with the chroma pairs
+    if (downscale == SR_DOWNSCALE_THREE_QUARTERS)
+        dstAlign = 6;
+    bands = av_clip(bands, 1, FFMAX(dstH / (16 * dstAlign), 1));
+    if (bands != bandCount())
+        stopHelpers();
+
+    srcRows.assign(bands + 1, 0);
+    dstRows.assign(bands + 1, 0);
+    for (int i = 1; i < bands; i++) {
+        dstRows[i] = (int) ((int64_t) dstH * i / bands) / dstAlign * dstAlign;
+        srcRows[i] = (int) ((int64_t) dstRows[i] * srcH / dstH) / srcAlign * srcAlign;
+    }
+    srcRows[bands] = srcH;
+    dstRows[bands] = dstH;
+
+    if (fastPath) {
+        freeContexts();
+        scratch.resize(downscale != SR_DOWNSCALE_NONE ? bands : 0);
+        for (auto &rows : scratch)
+            rows.resize((size_t) 8 * dstW);
+    } else {
+        scratch.clear();
+        //sws_getCachedContext() keeps a context whose parameters did not change
+        while ((int) contexts.size() > bands) {
+            sws_freeContext(contexts.back());
+            contexts.pop_back();
+        }
+        contexts.resize(bands, nullptr);
+        for (int i = 0; i < bands; i++) {
+            contexts[i] = sws_getCachedContext(contexts[i], srcW, srcRows[i + 1] - srcRows[i], srcFmt,
+                                               dstW, dstRows[i + 1] - dstRows[i], dstFmt,
+                                               flags, nullptr, nullptr, nullptr);
+            if (!contexts[i]) {
+                freeContexts();
+                srcWidth = 0;
+                return AVERROR(EINVAL);
+            }
+            applyColorspace(contexts[i], colorspace, colorRange);
+        }
+    }
+    for (int i = (int) helpers.size() + 1; i < bands && !pool; i++)
+        helpers.emplace_back([this, i](){helper(i);});
+    return 0;
+}
+
+void SRScaler::scaleBand(int band) {
+    uint8_t *in[4], *out[4];
+    bandPlanes(srcFormat, src->data, src->linesize, srcRows[band], in);
+    bandPlanes(dstFormat, dst->data, dst->linesize, dstRows[band], out);
+    if (fastPath && downscale != SR_DOWNSCALE_NONE) {
+        convertDownscaled(downscale, fastPath, av_pix_fmt_desc_get(dstFormat)->log2_chroma_h, in[0], src->linesize[0],
+                          out, dst->linesize, dst->width, dstRows[band + 1] - dstRows[band], scratch[band].data());
+        return;
+    }
+    if (isTiled()) {
+        convertTiles(dstRows[band], dstRows[band + 1]);
+        return;
+    }
+    if (fastPath) {
+        fastPath(in[0], src->linesize[0], out, dst->linesize, dst->width, dstRows[band + 1] - dstRows[band]);
+        return;
+    }
+    sws_scale(contexts[band], in, src->linesize, 0, srcRows[band + 1] - srcRows[band], out, dst->linesize);
+}
+
+/**
+ * convertTile() converts the tile of rows output rows from row, and columns from x
+ */
+void SRScaler::convertTile(int row, int rows, int x) {
+    uint8_t *in[4], *out[4];
+    int offsets[4] = {0, 0, 0, 0};
+    bandPlanes(srcFormat, src->data, src->linesize, row, in);
+    bandPlanes(dstFormat, dst->data, dst->linesize, row, out);
+    //the bytes of x pixels in each plane, chroma included: what a row of width x takes
+    av_image_fill_linesizes(offsets, dstFormat, x);
+    for (int i = 0; i < 4; i++)
+        if (out[i]) out[i] += offsets[i];
+    fastPath(in[0] + 4 * x, src->linesize[0], out, dst->linesize, FFMIN(tileWidth, dstWidth - x), rows);
+}
+
+/**
+ * convertTiles() converts the tiles of the output rows [firstRow, lastRow), prefetching the head of each next tile
+ */
+void SRScaler::convertTiles(int firstRow, int lastRow) {
+    for (int row = firstRow; row < lastRow; row += tileHeight) {
+        int rows = FFMIN(tileHeight, lastRow - row);
+        for (int x = 0; x < dstWidth; x += tileWidth) {
+            int nextRow = x + tileWidth < dstWidth ? row : row + tileHeight, nextX = x + tileWidth < dstWidth ? x + tileWidth : 0;
+            if (nextRow < lastRow) {
+                const uint8_t *next = src->data[0] + (size_t) nextRow * src->linesize[0] + 4 * nextX;
+                int bytes = 4 * FFMIN(tileWidth, dstWidth - nextX);
+                for (int k = 0; k < TILE_PREFETCH_ROWS && nextRow + k < lastRow; k++)
+                    for (int b = 0; b < bytes; b += 64)
+                        SR_PREFETCH(next + (size_t) k * src->linesize[0] + b);
+            }
+            convertTile(row, rows, x);
+        }
+    }
+}
+
+void SRScaler::helper(int band) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        startCv.wait(guard, [&](){return quit || generation != seen;});
+        if (quit) return;
+        seen = generation;
+        guard.unlock();
+        scaleBand(band);
+        guard.lock();
+        if (--pending == 0)
+            doneCv.notify_one();
+    }
+}
+
+void SRScaler::scale(const AVFrame *src, AVFrame *dst) {
+    this->src = src;
+    this->dst = dst;
+    if (pool && isTiled()) {
+        //every tile is a task, in row order: the tiles running together read neighbouring source lines
+        int tileRows = (dstHeight + tileHeight - 1) / tileHeight, columns = tileColumns();
+        pool->parallelFor(tileRows * columns, [this, columns](int tile){
+            int row = tile / columns * tileHeight;
+            convertTile(row, FFMIN(tileHeight, dstHeight - row), tile % columns * tileWidth);
+        });
+        return;
+    }
+    if (pool && bandCount() > 1) {
+        pool->parallelFor(bandCount(), [this](int band){scaleBand(band);});
+        return;
+    }
+    if (helpers.empty()) {
+        scaleBand(0);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pending = (int) helpers.size();
+        generation++;
+    }
+    startCv.notify_all();
+    scaleBand(0);
+    std::unique_lock<std::mutex> guard(lock);
+    doneCv.wait(guard, [&](){return pending == 0;});
+}
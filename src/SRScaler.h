@@ -0,0 +1,137 @@
+//
+// Frame converter of the convert workers, splitting a frame in bands scaled in parallel.
+//
+
+#ifndef CPPSCREENRECORDER_SRSCALER_H
+#define CPPSCREENRECORDER_SRSCALER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "SRColorConvert.h"
+#include "SRTaskPool.h"
+
+extern "C"
+{
+#include "libavutil/common.h"
+#include "libavutil/frame.h"
+#include "libavutil/pixfmt.h"
+#include "libswscale/swscale.h"
+}
+
+/**
+ * SRScaler converts frames with one SwsContext per horizontal band.\n
+ * Band 0 runs on the calling thread, every other band has its own helper thread, or is a task
+ * of the pool given to setTaskPool(): scale() returns once all the bands have been written in the destination planes.\n
+ * Band boundaries are aligned to the chroma subsampling of both formats, so each band is an
+ * independent conversion of its rows; with vertical scaling the filter does not cross the band edges.\n
+ * Unscaled packed RGB to YUV420P/NV12, and X2RGB10 to YUV420P10/P010, skips swscale entirely and runs
+ * the SRColorConvert kernels on each band; so do the exact 2:1 and 4:3 downscales of 8 bit RGB, with convertDownscaled().\n
+ * With setTiling() the unscaled kernels convert tiles instead of whole rows: the source rows of a tile stay in L2
+ * across its chroma pairs, and every tile is a task of the pool.
+ *
+ * @Note a single thread may call scale()
+ */
+class SRScaler {
+
+private:
+    std::vector<struct SwsContext*> contexts;
+    SRColorConvertFn fastPath;  //set instead of the contexts for the unscaled conversions
+    enum SRDownscale downscale; //ratio fused with fastPath by convertDownscaled()
+    std::vector<std::vector<uint8_t>> scratch;  //rows of convertDownscaled(), per band
+    std::vector<int> srcRows;   //first row of each band, plus the frame height
+    std::vector<int> dstRows;
+    std::vector<std::thread> helpers;
+    SRTaskPool *pool;   //runs the bands instead of the helpers when set
+    int tileWidth;      //0 converts whole rows
+    int tileHeight;
+
+    std::mutex lock;
+    std::condition_variable startCv;
+    std::condition_variable doneCv;
+    uint64_t generation;
+    int pending;
+    bool quit;
+
+    const AVFrame *src;
+    AVFrame *dst;
+    enum AVPixelFormat srcFormat;
+    enum AVPixelFormat dstFormat;
+    enum AVColorSpace colorspace;
+    enum AVColorRange colorRange;
+
+    //parameters of the last configure()
+    int srcWidth;
+    int srcHeight;
+    int dstWidth;
+    int dstHeight;
+    int swsFlags;
+    int requestedBands;
+
+    void scaleBand(int band);
+    void convertTile(int row, int rows, int x);
+    void convertTiles(int firstRow, int lastRow);
+    int tileColumns() const { return (dstWidth + tileWidth - 1) / tileWidth; }
+    void helper(int band);
+    void stopHelpers();
+    void freeContexts();
+
+public:
+    SRScaler();
+    ~SRScaler();
+
+    SRScaler(const SRScaler&) = delete;
+    SRScaler &operator=(const SRScaler&) = delete;
+
+    /**
+     * setTaskPool() runs the bands of the next configure() on pool, at real-time priority, instead of helper threads
+     * @Note call it before the first configure()
+     */
+    void setTaskPool(SRTaskPool *pool) { this->pool = pool; }
+
+    /**
+     * setColorspace() sets the YUV matrix and range of the RGB conversions of the next configure(),
+     * AVCOL_SPC_UNSPECIFIED keeps the swscale default (BT.601), AVCOL_RANGE_UNSPECIFIED limited range
+     */
+    void setColorspace(enum AVColorSpace space, enum AVColorRange range = AVCOL_RANGE_UNSPECIFIED);
+
+    /**
+     * setTiling() splits the unscaled conversions in tiles of width x height output pixels, 0 converts whole rows
+     * @Note height is rounded up to the chroma rows of every format
+     */
+    void setTiling(int width, int height) {
+        tileWidth = width > 0 ? FFALIGN(width, 2) : 0;
+        tileHeight = FFALIGN(FFMAX(height, 2), 2);
+    }
+
+    /**
+     * configure() builds the contexts and starts the helper threads.\n
+     * It is cheap when nothing changed, so it can be called for every frame: only a new geometry,
+     * format or flags rebuilds the contexts, and a new band count restarts the helpers.
+     * @param bands number of bands, reduced when the frame is too short for them
+     * @return 0 on success, a negative AVERROR code otherwise
+     */
+    int configure(int srcW, int srcH, enum AVPixelFormat srcFmt, int dstW, int dstH, enum AVPixelFormat dstFmt,
+                  int flags, int bands);
+
+    /**
+     * scale() converts src into the buffers of dst
+     */
+    void scale(const AVFrame *src, AVFrame *dst);
+
+    int bandCount() const { return (int) srcRows.size() - 1; }
+
+    bool isFastPath() const { return fastPath != nullptr; }
+
+    bool isTiled() const { return tileWidth > 0 && fastPath && downscale == SR_DOWNSCALE_NONE; }
+
+    /**
+     * downscaleRatio() is the ratio of a fast path fused with the downscale, SR_DOWNSCALE_NONE when it is unscaled
+     */
+    enum SRDownscale downscaleRatio() const { return downscale; }
+};
+
+#endif //CPPSCREENRECORDER_SRSCALER_H
@@ -0,0 +1,88 @@
+//
+// ScreenCaptureKit grabber, frames stay IOSurface-backed pixel buffers.
+//
+
+#ifndef CPPSCREENRECORDER_SRSCKGRABBER_H
+#define CPPSCREENRECORDER_SRSCKGRABBER_H
+
+#ifdef __APPLE__
+
+#include <cstdint>
+#include "SRVideoGrabber.h"
+
+/* pixel buffers ScreenCaptureKit may have in flight: the frames queued in the pipeline hold some of them */
+#define SCK_QUEUE_DEPTH 8
+
+/**
+ * SRSckGrabber streams a display with ScreenCaptureKit (macOS 12.3 and later): the window server crops the region,
+ * scales it to the output size and converts it to NV12, and delivers IOSurface-backed CVPixelBuffers
+ * that are wrapped as AV_PIX_FMT_VIDEOTOOLBOX frames of hwFramesContext() and go to the VideoToolbox encoder
+ * as they are: the CPU never touches the pixels.\n
+ * With systemMemory the window server delivers BGRA pixel buffers of the output size instead, which the frames map
+ * read-only, BGR0, for the convert stage: a Retina display recorded at 1440p maps a quarter of its pixels and
+ * nothing is copied.\n
+ * ScreenCaptureKit only delivers a frame when the screen changed: grab() takes the newest one,
+ * SR_GRAB_UNCHANGED if none arrived since the previous grab.\n
+ * The device is the index of the display, the capture offset then being inside it, or any other name
+ * for the display containing the capture offset (global coordinates, in points).\n
+ * A followed window is captured alone (desktop independent window filter), wherever it moves and whatever covers it.
+ *
+ * @Note the application needs the screen recording permission, open() fails until it is granted
+ */
+class SRSckGrabber : public SRVideoGrabber {
+
+private:
+    struct State;
+
+    State *state;
+    AVBufferRef *deviceRef;
+    AVBufferRef *framesRef;
+    int outWidth, outHeight, fps;
+    bool systemMemory;
+    uint32_t window;
+
+public:
+    /**
+     * @param outWidth size of the frames delivered, the encoder geometry
+     * @param fps most frames per second ScreenCaptureKit delivers
+     * @param systemMemory mapped BGR0 frames instead of VideoToolbox surfaces
+     */
+    SRSckGrabber(int outWidth, int outHeight, int fps, bool systemMemory = false);
+    ~SRSckGrabber() override;
+
+    SRSckGrabber(const SRSckGrabber&) = delete;
+    SRSckGrabber &operator=(const SRSckGrabber&) = delete;
+
+    /**
+     * followWindow() captures a window (CGWindowID) instead of a region of a display, called before open()
+     */
+    void followWindow(uint32_t window) { this->window = window; }
+
+    /**
+     * windowSize() is the size of a window in points
+     * @return false if there is no such window
+     */
+    static bool windowSize(uint32_t window, int &width, int &height);
+
+    int open(const char *device, int x, int y, int width, int height) override;
+    int grab(AVFrame *frame) override;
+
+    enum AVPixelFormat pixelFormat() const override { return systemMemory ? AV_PIX_FMT_BGR0 : AV_PIX_FMT_VIDEOTOOLBOX; }
+    const char *name() const override { return systemMemory ? "screencapturekit-mapped" : "screencapturekit"; }
+    AVBufferRef *hwFramesContext() const override { return framesRef; }
+    bool allocatesFrames() const override { return true; }
+    bool scaledSize(int &width, int &height) const override {
+        if (!systemMemory)
+            return false;
+        width = outWidth;
+        height = outHeight;
+        return true;
+    }
+    int64_t reservedBytes() const override {
+        return systemMemory ? (int64_t) SCK_QUEUE_DEPTH * outWidth * outHeight * 4 : 0;
+    }
+};
+
+#endif
+
+#endif //CPPSCREENRECORDER_SRSCKGRABBER_H
@@ -0,0 +1,308 @@
+#include "SRSckGrabber.h"
+#include "SRLog.h"
+
+#ifdef __APPLE__
+
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#import <Foundation/Foundation.h>
+#import <CoreGraphics/CoreGraphics.h>
+#import <CoreMedia/CoreMedia.h>
+#import <CoreVideo/CoreVideo.h>
+#import <ScreenCaptureKit/ScreenCaptureKit.h>
+
+extern "C"
+{
+#include "libavutil/hwcontext.h"
+#include "libavutil/time.h"
+}
+
+#define SCK_START_WAIT 5        //s open() waits for the window server to answer
+
+using namespace std;
+
+/**
+ * SRSckOutput receives the frames on the queue of the stream and keeps the newest complete one for grab()
+ */
+API_AVAILABLE(macos(12.3))
+@interface SRSckOutput : NSObject <SCStreamOutput, SCStreamDelegate> {
+@public
+    std::mutex lock;
+    CVPixelBufferRef latest;
+    bool stopped;
+}
+@end
+
+@implementation SRSckOutput
+
+- (void)stream:(SCStream *)stream didOutputSampleBuffer:(CMSampleBufferRef)sampleBuffer ofType:(SCStreamOutputType)type {
+    if (type != SCStreamOutputTypeScreen)
+        return;
+    //idle and blank frames carry no image: nothing changed on the screen
+    CFArrayRef attachments = CMSampleBufferGetSampleAttachmentsArray(sampleBuffer, false);
+    if (!attachments || CFArrayGetCount(attachments) == 0)
+        return;
+    NSDictionary *info = (__bridge NSDictionary *) CFArrayGetValueAtIndex(attachments, 0);
+    NSNumber *status = info[SCStreamFrameInfoStatus];
+    if (!status || status.integerValue != SCFrameStatusComplete)
+        return;
+    CVPixelBufferRef buffer = CMSampleBufferGetImageBuffer(sampleBuffer);
+    if (!buffer)
+        return;
+
+    CVPixelBufferRetain(buffer);
+    std::lock_guard<std::mutex> guard(lock);
+    if (latest)
+        CVPixelBufferRelease(latest);
+    latest = buffer;
+}
+
+- (void)stream:(SCStream *)stream didStopWithError:(NSError *)error {
+    srLog(SR_LOG_ERROR, "[SRSckGrabber] capture stopped: %s", error.localizedDescription.UTF8String);
+    std::lock_guard<std::mutex> guard(lock);
+    stopped = true;
+}
+
+- (void)dealloc {
+    if (latest)
+        CVPixelBufferRelease(latest);
+}
+
+@end
+
+struct SRSckGrabber::State {
+    SCStream *stream API_AVAILABLE(macos(12.3));
+    SRSckOutput *output API_AVAILABLE(macos(12.3));
+    dispatch_queue_t queue;
+};
+
+SRSckGrabber::SRSckGrabber(int outWidth, int outHeight, int fps, bool systemMemory): state(new State()), deviceRef(nullptr),
+                                                                                     framesRef(nullptr), outWidth(outWidth),
+                                                                                     outHeight(outHeight), fps(fps),
+                                                                                     systemMemory(systemMemory), window(0) {}
+
+SRSckGrabber::~SRSckGrabber() {
+    if (@available(macOS 12.3, *)) {
+        if (state->stream) {
+            dispatch_semaphore_t done = dispatch_semaphore_create(0);
+            [state->stream stopCaptureWithCompletionHandler:^(NSError *error) {
+                dispatch_semaphore_signal(done);
+            }];
+            dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, SCK_START_WAIT * NSEC_PER_SEC));
+        }
+    }
+    delete state;
+    //the frames still held by the encoder keep their pixel buffers
+    av_buffer_unref(&framesRef);
+    av_buffer_unref(&deviceRef);
+}
+
+bool SRSckGrabber::windowSize(uint32_t window, int &width, int &height) {
+    CFArrayRef list = CGWindowListCopyWindowInfo(kCGWindowListOptionIncludingWindow, window);
+    if (!list)
+        return false;
+    bool found = false;
+    if (CFArrayGetCount(list) > 0) {
+        CFDictionaryRef info = (CFDictionaryRef) CFArrayGetValueAtIndex(list, 0);
+        CFDictionaryRef bounds = (CFDictionaryRef) CFDictionaryGetValue(info, kCGWindowBounds);
+        CGRect rect;
+        if (bounds && CGRectMakeWithDictionaryRepresentation(bounds, &rect)) {
+            width = (int) rect.size.width;
+            height = (int) rect.size.height;
+            found = width > 0 && height > 0;
+        }
+    }
+    CFRelease(list);
+    return found;
+}
+
+static void releasePixelBuffer(void *opaque, uint8_t *data) {
+    (void) opaque;
+    CVPixelBufferRelease((CVPixelBufferRef) data);
+}
+
+static void unlockPixelBuffer(void *opaque, uint8_t *data) {
+    (void) data;
+    CVPixelBufferRef buffer = (CVPixelBufferRef) opaque;
+    CVPixelBufferUnlockBaseAddress(buffer, kCVPixelBufferLock_ReadOnly);
+    CVPixelBufferRelease(buffer);
+}
+
+int SRSckGrabber::open(const char *device, int x, int y, int width, int height) {
+    if (@available(macOS 12.3, *)) {
+        //a number picks the display, anything else the one containing the capture offset
+        char *end = nullptr;
+        long index = device && *device ? strtol(device, &end, 10) : -1;
+        if (!end || *end)
+            index = -1;
+
+        //a command line tool has no window server connection until CoreGraphics is asked something
+        CGMainDisplayID();
+
+        __block SCShareableContent *content = nil;
+        __block NSError *failure = nil;
+        dispatch_semaphore_t done = dispatch_semaphore_create(0);
+        [SCShareableContent getShareableContentWithCompletionHandler:^(SCShareableContent *shareable, NSError *error) {
+            content = shareable;
+            failure = error;
+            dispatch_semaphore_signal(done);
+        }];
+        if (dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, SCK_START_WAIT * NSEC_PER_SEC)) || !content) {
+            cout << "\n[SRSckGrabber] cannot list the displays, is screen recording allowed? "
+                 << (failure ? failure.localizedDescription.UTF8String : "");
+            return AVERROR(EACCES);
+        }
+
+        SCContentFilter *filter = nil;
+        SCStreamConfiguration *config = [[SCStreamConfiguration alloc] init];
+        if (window) {
+            //the window alone, followed by the window server
+            for (SCWindow *candidate in content.windows)
+                if (candidate.windowID == window)
+                    filter = [[SCContentFilter alloc] initWithDesktopIndependentWindow:candidate];
+            if (!filter) {
+                cout << "\n[SRSckGrabber] no window " << window;
+                return AVERROR(ENODEV);
+            }
+        }
+
+        SCDisplay *display = nil;
+        CGRect bounds = CGRectZero;
+        for (NSUInteger i = 0; i < content.displays.count && !display && !filter; i++) {
+            CGRect candidate = CGDisplayBounds(content.displays[i].displayID);
+            if (index >= 0 ? (long) i == index : CGRectContainsPoint(candidate, CGPointMake(x, y))) {
+                display = content.displays[i];
+                bounds = candidate;
+            }
+        }
+        if (!filter) {
+            if (!display) {
+                cout << "\n[SRSckGrabber] no display " << (device ? device : "") << " at " << x << "," << y;
+                return AVERROR(ENODEV);
+            }
+            //without an index the region is in global coordinates, the source rectangle in the ones of the display
+            CGRect source = CGRectMake(index >= 0 ? x : x - bounds.origin.x, index >= 0 ? y : y - bounds.origin.y,
+                                       width, height);
+            if (!CGRectContainsRect(CGRectMake(0, 0, bounds.size.width, bounds.size.height), source)) {
+                cout << "\n[SRSckGrabber] the capture region does not fit in the display";
+                return AVERROR(EINVAL);
+            }
+            filter = [[SCContentFilter alloc] initWithDisplay:display excludingWindows:@[]];
+            config.sourceRect = source;
+        }
+
+        //the window server crops, scales and converts: the pixel buffers have the encoder geometry
+        config.width = (size_t) outWidth;
+        config.height = (size_t) outHeight;
+        if (systemMemory) {
+            config.pixelFormat = kCVPixelFormatType_32BGRA;
+        } else {
+            config.pixelFormat = kCVPixelFormatType_420YpCbCr8BiPlanarVideoRange;
+            config.colorMatrix = kCVImageBufferYCbCrMatrix_ITU_R_709_2;
+        }
+        config.minimumFrameInterval = CMTimeMake(1, fps);
+        config.queueDepth = SCK_QUEUE_DEPTH;
+        config.showsCursor = NO;
+
+        state->output = [[SRSckOutput alloc] init];
+        state->queue = dispatch_queue_create("SRSckGrabber", DISPATCH_QUEUE_SERIAL);
+        state->stream = [[SCStream alloc] initWithFilter:filter configuration:config delegate:state->output];
+        NSError *error = nil;
+        if (![state->stream addStreamOutput:state->output type:SCStreamOutputTypeScreen
+                         sampleHandlerQueue:state->queue error:&error]) {
+            cout << "\n[SRSckGrabber] cannot receive the frames: " << error.localizedDescription.UTF8String;
+            return AVERROR(EIO);
+        }
+
+        //the pixel buffers are wrapped as they come, the frames context only describes them
+        if (!systemMemory) {
+            int ret = av_hwdevice_ctx_create(&deviceRef, AV_HWDEVICE_TYPE_VIDEOTOOLBOX, nullptr, nullptr, 0);
+            if (ret < 0)
+                return ret;
+            framesRef = av_hwframe_ctx_alloc(deviceRef);
+            if (!framesRef)
+                return AVERROR(ENOMEM);
+            AVHWFramesContext *frames = (AVHWFramesContext *) framesRef->data;
+            frames->format = AV_PIX_FMT_VIDEOTOOLBOX;
+            frames->sw_format = AV_PIX_FMT_NV12;
+            frames->width = outWidth;
+            frames->height = outHeight;
+            if ((ret = av_hwframe_ctx_init(framesRef)) < 0)
+                return ret;
+        }
+
+        __block NSError *startFailure = nil;
+        [state->stream startCaptureWithCompletionHandler:^(NSError *startError) {
+            startFailure = startError;
+            dispatch_semaphore_signal(done);
+        }];
+        if (dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, SCK_START_WAIT * NSEC_PER_SEC)) || startFailure) {
+            cout << "\n[SRSckGrabber] cannot start the capture "
+                 << (startFailure ? startFailure.localizedDescription.UTF8String : "");
+            return AVERROR(EIO);
+        }
+
+        cout << "\n[SRSckGrabber] " << width << "x" << height << " points to " << outWidth << "x" << outHeight
+             << (systemMemory ? " BGRA, mapped" : " NV12");
+        return 0;
+    }
+    cout << "\n[SRSckGrabber] ScreenCaptureKit needs macOS 12.3";
+    return AVERROR(ENOSYS);
+}
+
+int SRSckGrabber::grab(AVFrame *frame) {
+    if (@available(macOS 12.3, *)) {
+        CVPixelBufferRef buffer;
+        {
+            std::lock_guard<std::mutex> guard(state->output->lock);
+            if (state->output->stopped)
+                return AVERROR(EIO);
+            buffer = state->output->latest;
+            state->output->latest = nullptr;
+        }
+        if (!buffer)
+            return SR_GRAB_UNCHANGED;
+
+        av_frame_unref(frame);
+        if (systemMemory) {
+            //the frame maps the pixel buffer, unlocked and released with its last reference
+            if (CVPixelBufferLockBaseAddress(buffer, kCVPixelBufferLock_ReadOnly) != kCVReturnSuccess) {
+                CVPixelBufferRelease(buffer);
+                return AVERROR(EIO);
+            }
+            uint8_t *base = (uint8_t *) CVPixelBufferGetBaseAddress(buffer);
+            int stride = (int) CVPixelBufferGetBytesPerRow(buffer);
+            frame->buf[0] = av_buffer_create(base, stride * outHeight, unlockPixelBuffer, buffer, AV_BUFFER_FLAG_READONLY);
+            if (!frame->buf[0]) {
+                unlockPixelBuffer(buffer, base);
+                return AVERROR(ENOMEM);
+            }
+            frame->data[0] = base;
+            frame->linesize[0] = stride;
+            frame->format = AV_PIX_FMT_BGR0;
+            frame->width = outWidth;
+            frame->height = outHeight;
+            frame->pts = av_gettime();
+            return 0;
+        }
+
+        //the frame owns the retained pixel buffer, released with its last reference
+        frame->buf[0] = av_buffer_create((uint8_t *) buffer, 1, releasePixelBuffer, nullptr, AV_BUFFER_FLAG_READONLY);
+        if (!frame->buf[0]) {
+            CVPixelBufferRelease(buffer);
+            return AVERROR(ENOMEM);
+        }
+        frame->hw_frames_ctx = av_buffer_ref(framesRef);
+        if (!frame->hw_frames_ctx)
+            return AVERROR(ENOMEM);
+        frame->data[3] = (uint8_t *) buffer;
+        frame->format = AV_PIX_FMT_VIDEOTOOLBOX;
+        frame->width = outWidth;
+        frame->height = outHeight;
+        return 0;
+    }
+    return AVERROR(ENOSYS);
+}
+
+#endif
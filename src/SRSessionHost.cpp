@@ -0,0 +1,89 @@
+#include "SRSessionHost.h"
+#include "SRNuma.h"
+#include "SRThreads.h"
+
+#include <algorithm>
+
+SRSessionHost::SRSessionHost(int expected, int threads): expected(std::max(expected, 1)) {
+    int nodes = numaNodeCount();
+    for (int node = 0; node < nodes && nodes > 1; node++) {
+        std::vector<int> cores = numaNodeCores(node);
+        if (cores.empty())
+            continue;
+        pools.emplace_back(new SRTaskPool(threads > 0 ? std::max(threads / nodes, 1) : 0, cores));
+        poolNodes.push_back(node);
+    }
+    if (pools.empty()) {
+        pools.emplace_back(new SRTaskPool(threads));
+        poolNodes.push_back(-1);
+    }
+}
+
+SRSessionHost::~SRSessionHost() {
+    //the watcher stops before the recorders it reconfigures
+    budget.reset();
+    while (!sessions.empty())
+        endSession(*sessions.back());
+}
+
+ScreenRecorder &SRSessionHost::addSession() {
+    std::unique_ptr<ScreenRecorder> session(new ScreenRecorder());
+    //the node with the fewest sessions
+    std::vector<int> load(pools.size(), 0);
+    for (auto &s : sessions)
+        for (size_t i = 0; i < pools.size(); i++)
+            if (s->settings._numanode == poolNodes[i])
+                load[i]++;
+    size_t index = std::min_element(load.begin(), load.end()) - load.begin();
+    session->attachTaskPool(pools[index].get());
+    session->settings._numanode = poolNodes[index];
+    //more sessions than planned share what is left rather than oversubscribe
+    int sessionsNow = std::max(expected, (int) sessions.size() + 1);
+    session->settings._encthreads = std::max(cpuCount() / sessionsNow, 1);
+    sessions.push_back(std::move(session));
+    return *sessions.back();
+}
+
+#ifdef __unix__
+ScreenRecorder &SRSessionHost::addDisplaySession(const char *display) {
+    if (!displays)
+        displays.reset(new SRDisplayLoop());
+    ScreenRecorder &session = addSession();
+    session.settings.videourl = (char *) display;
+    session.settings._damagecapture = true;
+    session.attachDisplayLoop(displays.get());
+    return session;
+}
+#endif
+
+int SRSessionHost::shareBudget(int totalKbps, int totalFps, const char *display) {
+    if (budget)
+        budget->stop();
+    budget.reset(new SRFocusBudget(totalKbps, totalFps));
+    for (auto &s : sessions)
+        budget->addSource(*s);
+    return display ? budget->start(display) : 0;
+}
+
+void SRSessionHost::joinBudget(ScreenRecorder &session) {
+    if (budget)
+        budget->addSource(session);
+}
+
+void SRSessionHost::endSession(ScreenRecorder &session) {
+    auto it = std::find_if(sessions.begin(), sessions.end(),
+                           [&](const std::unique_ptr<ScreenRecorder> &s){ return s.get() == &session; });
+    if (it == sessions.end())
+        return;
+    if (budget)
+        budget->removeSource(session);
+    (*it)->endCapture();
+    sessions.erase(it);
+}
+
+int SRSessionHost::poolThreads() const {
+    int threads = 0;
+    for (auto &pool : pools)
+        threads += pool->size();
+    return threads;
+}
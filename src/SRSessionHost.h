@@ -0,0 +1,97 @@
+//
+// Many recording sessions in one process, sharing one thread pool for the conversion.
+//
+
+#ifndef CPPSCREENRECORDER_SRSESSIONHOST_H
+#define CPPSCREENRECORDER_SRSESSIONHOST_H
+
+#include <memory>
+#include <vector>
+#include "ScreenRecorder.h"
+#include "SRTaskPool.h"
+#include "SRDisplayLoop.h"
+#include "SRFocusBudget.h"
+
+/**
+ * SRSessionHost runs one ScreenRecorder per user session of a VDI host in a single process.\n
+ * The convert workers of every session are serial tasks of one SRTaskPool sized to the cores, taking turns
+ * every TASK_QUANTUM frames, and the software encoders share the cores: each session gets its part of them
+ * as encoder threads. A session keeps its own grab, encode, audio and mux threads, whose work is sequential
+ * and paced by the capture clock; the thread count grows with the cores, plus four per session.\n
+ * On a multi-socket host there is one pool per NUMA node, its workers bound to the cores of the node, and each
+ * session is bound to the node with the fewest sessions: its threads, its frames and its conversion stay local.\n
+ * Each session keeps its settings, sources and output: addSession() returns the recorder to set up,
+ * then openVideoSource(), initOutputFile() and initThreads() are called on it as for a recorder of its own.\n
+ * On Linux, addDisplaySession() records a display of its own per session (the Xvfb servers of a CI host): the
+ * X events of all of them are read by a single SRDisplayLoop, a session only grabs when its display was drawn on.\n
+ * shareBudget() caps the bitrate and the frame rate of all the sessions together, shared out by the focus of the
+ * windows they record (SRFocusBudget).
+ *
+ * @Note the log level and the cpu flags are process-wide: the last session to set them sets them for all
+ */
+class SRSessionHost {
+
+private:
+    std::vector<std::unique_ptr<SRTaskPool>> pools;    //one per NUMA node
+    std::vector<int> poolNodes;     //node of each pool, -1 for the single pool of a single-node host
+    int expected;
+#ifdef __unix__
+    std::unique_ptr<SRDisplayLoop> displays;    //started by the first addDisplaySession()
+#endif
+    std::vector<std::unique_ptr<ScreenRecorder>> sessions;
+    std::unique_ptr<SRFocusBudget> budget;
+
+public:
+    /**
+     * @param expected sessions the host is planned for, shares the cores among the encoders
+     * @param threads workers of the pools, 0 for one per core
+     */
+    explicit SRSessionHost(int expected, int threads = 0);
+
+    /**
+     * ~SRSessionHost() ends the sessions still recording, before the pool stops
+     */
+    ~SRSessionHost();
+
+    SRSessionHost(const SRSessionHost&) = delete;
+    SRSessionHost &operator=(const SRSessionHost&) = delete;
+
+    /**
+     * addSession() creates a recorder attached to the pool, its encoder threads set to its share of the cores
+     */
+    ScreenRecorder &addSession();
+
+#ifdef __unix__
+    /**
+     * addDisplaySession() creates a session recording the X display name (":12") with the XDamage grabber, its
+     * events read by the display loop of the host; the region and the output are set on it as for addSession()
+     * @param display kept by the settings, not copied: it must outlive the session
+     */
+    ScreenRecorder &addDisplaySession(const char *display);
+#endif
+
+    /**
+     * shareBudget() shares totalKbps and totalFps between the sessions by focus, followed on display (nullptr for
+     * focus() only); the sessions opened later join with joinBudget()
+     * @Note call it once the sessions are opened: their frame rates are known
+     * @return 0 on success, a negative AVERROR if display cannot be followed: the caps are still shared
+     */
+    int shareBudget(int totalKbps, int totalFps, const char *display);
+
+    /**
+     * joinBudget() adds an opened session to the budget of shareBudget(), if any
+     */
+    void joinBudget(ScreenRecorder &session);
+
+    SRFocusBudget *focusBudget() { return budget.get(); }
+
+    /**
+     * endSession() ends the recording of session and destroys it, its share of the budget goes to the others
+     */
+    void endSession(ScreenRecorder &session);
+
+    size_t size() const { return sessions.size(); }
+    int poolThreads() const;
+};
+
+#endif //CPPSCREENRECORDER_SRSESSIONHOST_H
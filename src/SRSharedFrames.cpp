@@ -0,0 +1,350 @@
+#include "SRSharedFrames.h"
+
+#include <cerrno>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+extern "C"
+{
+#include "libavutil/common.h"
+#include "libavutil/error.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
+}
+
+static size_t alignUp(size_t value) {
+    return (value + SHM_ALIGN - 1) & ~(size_t) (SHM_ALIGN - 1);
+}
+
+SRSharedFrames::SRSharedFrames(const char *name, int slots): name(name), slotCount(slots), header(nullptr), data(nullptr),
+        size(0),
+#ifdef _WIN32
+        mapping(nullptr),
+#else
+        fd(-1),
+#endif
+        position(0), frames(0), skipped(0) {
+    if (slotCount < 2)
+        slotCount = 2;
+    if (slotCount > SHM_MAX_SLOTS)
+        slotCount = SHM_MAX_SLOTS;
+}
+
+SRSharedFrames::~SRSharedFrames() {
+#ifdef _WIN32
+    if (header)
+        UnmapViewOfFile(header);
+    if (mapping)
+        CloseHandle((HANDLE) mapping);
+#else
+    if (header)
+        munmap(header, size);
+    if (fd >= 0) {
+        ::close(fd);
+        shm_unlink(name.c_str());
+    }
+#endif
+}
+
+int SRSharedFrames::init(enum AVPixelFormat format, int width, int height) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    int linesize[4];
+    if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) || av_image_fill_linesizes(linesize, format, width) < 0)
+        return AVERROR(EINVAL);
+
+    //the planes of a slot one after the other, rows and planes aligned
+    SRSharedHeader layout = {};
+    layout.magic = SHM_MAGIC;
+    layout.version = SHM_VERSION;
+    layout.format = format;
+    layout.width = width;
+    layout.height = height;
+    layout.planes = av_pix_fmt_count_planes(format);
+    size_t offset = 0;
+    for (int p = 0; p < layout.planes; p++) {
+        int rows = (p == 1 || p == 2) ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+        layout.linesize[p] = (int32_t) alignUp(linesize[p]);
+        layout.planeOffset[p] = offset;
+        offset += alignUp((size_t) layout.linesize[p] * rows);
+    }
+    layout.slotSize = offset;
+    layout.dataOffset = alignUp(sizeof(SRSharedHeader));
+    layout.slotCount = slotCount;
+    size = layout.dataOffset + layout.slotSize * slotCount;
+
+    void *base = nullptr;
+#ifdef _WIN32
+    mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD) ((uint64_t) size >> 32),
+                                 (DWORD) size, name.c_str());
+    if (!mapping)
+        return AVERROR(EIO);
+    base = MapViewOfFile((HANDLE) mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (!base)
+        return AVERROR(ENOMEM);
+#else
+    //a mapping left by a recorder that was killed is replaced
+    shm_unlink(name.c_str());
+    fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        return AVERROR(errno);
+    if (ftruncate(fd, (off_t) size) < 0)
+        return AVERROR(errno);
+    base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        return AVERROR(errno);
+#endif
+    header = (SRSharedHeader *) base;
+    data = (uint8_t *) base + layout.dataOffset;
+
+    //the layout before the magic: a reader that sees it sees a complete header
+    header->format = layout.format;
+    header->width = layout.width;
+    header->height = layout.height;
+    header->planes = layout.planes;
+    memcpy(header->linesize, layout.linesize, sizeof(layout.linesize));
+    memcpy(header->planeOffset, layout.planeOffset, sizeof(layout.planeOffset));
+    header->slotSize = layout.slotSize;
+    header->dataOffset = layout.dataOffset;
+    header->slotCount = layout.slotCount;
+    header->written.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < SHM_MAX_SLOTS; i++) {
+        header->slots[i].sequence.store(0, std::memory_order_relaxed);
+        header->slots[i].held.store(0, std::memory_order_relaxed);
+    }
+    header->version = layout.version;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = layout.magic;
+    return 0;
+}
+
+bool SRSharedFrames::write(const AVFrame *frame) {
+    if (!header || frame->hw_frames_ctx || frame->format != header->format || frame->width != header->width ||
+        frame->height != header->height) {
+        skipped++;
+        return false;
+    }
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat) frame->format);
+
+    //a slot held by a reader is passed over: the ring goes on in the others, however long the hold
+    for (int tries = 0; tries < slotCount; tries++, position++) {
+        SRSharedSlot &slot = header->slots[position % slotCount];
+        uint8_t *dst = data + (position % slotCount) * header->slotSize;
+
+        //odd while the planes change, the readers of the previous frame of this slot see it; the check of the holds
+        //after it: a reader holding in between sees the odd sequence and lets go, see SRSharedReader::hold()
+        uint64_t previous = slot.sequence.load(std::memory_order_relaxed);
+        slot.sequence.store(2 * position + 1, std::memory_order_seq_cst);
+        if (slot.held.load(std::memory_order_seq_cst)) {
+            slot.sequence.store(previous, std::memory_order_release);
+            continue;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        for (int p = 0; p < header->planes; p++) {
+            int rows = (p == 1 || p == 2) ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+            av_image_copy_plane(dst + header->planeOffset[p], header->linesize[p], frame->data[p], frame->linesize[p],
+                                FFMIN(header->linesize[p], FFABS(frame->linesize[p])), rows);
+        }
+        slot.pts = frame->pts;
+        position++;
+        frames++;
+        slot.sequence.store(2 * position, std::memory_order_release);
+        header->written.store(position, std::memory_order_release);
+        return true;
+    }
+    skipped++;
+    return false;
+}
+
+void SRSharedFrames::releaseHolds() {
+    if (!header)
+        return;
+    for (int i = 0; i < slotCount; i++)
+        header->slots[i].held.store(0, std::memory_order_release);
+}
+
+SRSharedReader::SRSharedReader(): header(nullptr), data(nullptr), size(0),
+#ifdef _WIN32
+        mapping(nullptr)
+#else
+        fd(-1)
+#endif
+        {}
+
+SRSharedReader::~SRSharedReader() {
+    close();
+}
+
+int SRSharedReader::open(const char *name, bool holding) {
+    close();
+    void *base = nullptr;
+#ifdef _WIN32
+    DWORD access = holding ? FILE_MAP_READ | FILE_MAP_WRITE : FILE_MAP_READ;
+    mapping = OpenFileMappingA(access, FALSE, name);
+    if (!mapping)
+        return AVERROR(ENOENT);
+    base = MapViewOfFile((HANDLE) mapping, access, 0, 0, 0);
+    if (!base) {
+        close();
+        return AVERROR(ENOMEM);
+    }
+    MEMORY_BASIC_INFORMATION info;
+    size = VirtualQuery(base, &info, sizeof(info)) ? info.RegionSize : 0;
+#else
+    fd = shm_open(name, holding ? O_RDWR : O_RDONLY, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        close();
+        return AVERROR(ENOENT);
+    }
+    size = (size_t) st.st_size;
+    base = size >= sizeof(SRSharedHeader) ? mmap(nullptr, size, holding ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                                                           fd, 0) : MAP_FAILED;
+    if (base == MAP_FAILED) {
+        close();
+        return AVERROR_INVALIDDATA;
+    }
+#endif
+    header = (SRSharedHeader *) base;
+    if (header->magic != SHM_MAGIC || header->version != SHM_VERSION ||
+        header->dataOffset + header->slotSize * header->slotCount > size) {
+        close();
+        return AVERROR_INVALIDDATA;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    data = (const uint8_t *) base + header->dataOffset;
+    return 0;
+}
+
+void SRSharedReader::close() {
+#ifdef _WIN32
+    if (header)
+        UnmapViewOfFile(header);
+    if (mapping)
+        CloseHandle((HANDLE) mapping);
+    mapping = nullptr;
+#else
+    if (header)
+        munmap((void *) header, size);
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+#endif
+    header = nullptr;
+    data = nullptr;
+}
+
+uint64_t SRSharedReader::latest() const {
+    uint64_t written = header ? header->written.load(std::memory_order_acquire) : 0;
+    return written * 2;
+}
+
+const uint8_t *SRSharedReader::plane(uint64_t sequence, int p) const {
+    if (!header || !sequence || p < 0 || p >= header->planes)
+        return nullptr;
+    return data + (sequence / 2 - 1) % header->slotCount * header->slotSize + header->planeOffset[p];
+}
+
+int64_t SRSharedReader::pts(uint64_t sequence) const {
+    return header && sequence ? header->slots[(sequence / 2 - 1) % header->slotCount].pts : AV_NOPTS_VALUE;
+}
+
+bool SRSharedReader::valid(uint64_t sequence) const {
+    if (!header || !sequence)
+        return false;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return header->slots[(sequence / 2 - 1) % header->slotCount].sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+bool SRSharedReader::hold(uint64_t sequence) {
+    if (!header || !sequence)
+        return false;
+    SRSharedSlot &slot = header->slots[(sequence / 2 - 1) % header->slotCount];
+    //the hold before the check, the odd sequence before the check of the holds in write(): one of the two sees the other
+    slot.held.fetch_add(1, std::memory_order_seq_cst);
+    if (slot.sequence.load(std::memory_order_seq_cst) == sequence)
+        return true;
+    slot.held.fetch_sub(1, std::memory_order_release);
+    return false;
+}
+
+void SRSharedReader::release(uint64_t sequence) {
+    if (!header || !sequence)
+        return;
+    header->slots[(sequence / 2 - 1) % header->slotCount].held.fetch_sub(1, std::memory_order_release);
+}
+
+SRSharedGrabber::SRSharedGrabber(const char *name): ringName(name), holds(), last(0) {}
+
+int SRSharedGrabber::connect() {
+    int ret = reader.open(ringName.c_str(), true);
+    if (ret < 0)
+        return ret;
+    if (av_pix_fmt_count_planes((enum AVPixelFormat) reader.layout()->format) != reader.layout()->planes) {
+        reader.close();
+        return AVERROR_INVALIDDATA;
+    }
+    for (Hold &hold : holds)
+        hold.reader = &reader;
+    return 0;
+}
+
+int SRSharedGrabber::open(const char *device, int x, int y, int width, int height) {
+    const SRSharedHeader *layout = reader.layout();
+    if (!layout && connect() < 0)
+        return AVERROR(ENOENT);
+    layout = reader.layout();
+    return width == layout->width && height == layout->height ? 0 : AVERROR(EINVAL);
+}
+
+enum AVPixelFormat SRSharedGrabber::pixelFormat() const {
+    return reader.layout() ? (enum AVPixelFormat) reader.layout()->format : AV_PIX_FMT_NONE;
+}
+
+void SRSharedGrabber::release(void *opaque, uint8_t *data) {
+    Hold *hold = (Hold *) opaque;
+    hold->reader->release(hold->sequence);
+}
+
+int SRSharedGrabber::grab(AVFrame *frame) {
+    const SRSharedHeader *layout = reader.layout();
+    if (!layout)
+        return AVERROR(EINVAL);
+    uint64_t sequence = reader.latest();
+    //the writer may be on the slot already: the newest frame after it then
+    if (sequence && sequence != last && !reader.hold(sequence)) {
+        sequence = reader.latest();
+        if (sequence != last && !reader.hold(sequence))
+            sequence = last;
+    }
+    if (!sequence || sequence == last)
+        return SR_GRAB_UNCHANGED;
+
+    //the frame references the slot instead of a buffer of its own, read only: other readers share it
+    Hold &hold = holds[(sequence / 2 - 1) % layout->slotCount];
+    hold.sequence = sequence;
+    av_frame_unref(frame);
+    frame->buf[0] = av_buffer_create((uint8_t *) reader.plane(sequence, 0), (int) layout->slotSize, release, &hold,
+                                     AV_BUFFER_FLAG_READONLY);
+    if (!frame->buf[0]) {
+        reader.release(sequence);
+        return AVERROR(ENOMEM);
+    }
+    for (int p = 0; p < layout->planes; p++) {
+        frame->data[p] = (uint8_t *) reader.plane(sequence, p);
+        frame->linesize[p] = layout->linesize[p];
+    }
+    frame->format = layout->format;
+    frame->width = layout->width;
+    frame->height = layout->height;
+    frame->pts = reader.pts(sequence);
+    last = sequence;
+    return 0;
+}
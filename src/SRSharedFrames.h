@@ -0,0 +1,219 @@
+//
+// Ring of converted frames in shared memory, read in place by other local processes.
+//
+
+#ifndef CPPSCREENRECORDER_SRSHAREDFRAMES_H
+#define CPPSCREENRECORDER_SRSHAREDFRAMES_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "SRVideoGrabber.h"
+
+extern "C"
+{
+#include "libavutil/frame.h"
+#include "libavutil/pixfmt.h"
+}
+
+#define SHM_MAGIC 0x58465253    //"SRFX" at the head of the mapping
+#define SHM_VERSION 2     //2: held counts of the slots
+#define SHM_SLOTS 4     //frames of the ring: a reader has three frame intervals before its slot is written again
+#define SHM_MAX_SLOTS 32
+#define SHM_ALIGN 64    //of the rows, the planes and the slots: SIMD loads of the readers never split a cache line
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the shared sequences need lock-free 64 bit atomics");
+
+/**
+ * Slot of the ring: sequence is odd while the frame is written, 2 * (position + 1) once it is complete.
+ * held counts the frames of the slot a reader works on in place for longer than a check, see SRSharedReader::hold()
+ */
+typedef struct SS{
+    std::atomic<uint64_t> sequence;
+    int64_t pts;    //us of the capture clock
+    std::atomic<uint32_t> held;
+}SRSharedSlot;
+
+/**
+ * Head of the mapping, followed at dataOffset by slotCount slots of slotSize bytes.
+ * Plane p of a slot starts planeOffset[p] bytes into it, rows of linesize[p] bytes.
+ */
+typedef struct SD{
+    uint32_t magic;
+    uint32_t version;
+    int32_t format;     //AVPixelFormat
+    int32_t width;
+    int32_t height;
+    int32_t planes;
+    int32_t linesize[4];
+    uint64_t planeOffset[4];
+    uint64_t slotSize;
+    uint64_t dataOffset;
+    uint32_t slotCount;
+    //positions of the ring used, the held slots passed over too: the newest frame is in slot (written - 1) % slotCount
+    std::atomic<uint64_t> written;
+    SRSharedSlot slots[SHM_MAX_SLOTS];
+}SRSharedHeader;
+
+/**
+ * SRSharedFrames publishes the frames of the recording to a named shared memory (POSIX shm_open, a file mapping
+ * on Windows) laid out as SRSharedHeader and a ring of slots. The writer copies each frame once into the next slot
+ * under a sequence lock, nothing waits on the readers: a reader takes the newest slot, works on its planes in place
+ * and checks afterwards with SRSharedReader::valid() that the writer did not come back to it meanwhile.
+ * One grab then feeds the encoder and any number of local consumers (OCR, analytics) without a second capture.\n
+ * The one exception is a slot held by a reader: the writer passes over it to the next one and never waits either.
+ *
+ * @Note write() from one thread; the mapping is removed when the writer is destroyed, the readers keep theirs
+ */
+class SRSharedFrames {
+
+private:
+    std::string name;
+    int slotCount;
+    SRSharedHeader *header;
+    uint8_t *data;
+    size_t size;
+#ifdef _WIN32
+    void *mapping;
+#else
+    int fd;
+#endif
+    uint64_t position;  //of the next slot in the ring
+    uint64_t frames;
+    uint64_t skipped;
+
+public:
+    /**
+     * @param name "/name" on POSIX, "Local\\name" for a Windows mapping
+     */
+    SRSharedFrames(const char *name, int slots = SHM_SLOTS);
+    ~SRSharedFrames();
+
+    SRSharedFrames(const SRSharedFrames&) = delete;
+    SRSharedFrames &operator=(const SRSharedFrames&) = delete;
+
+    /**
+     * init() creates the mapping for frames of one geometry
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int init(enum AVPixelFormat format, int width, int height);
+
+    /**
+     * write() copies frame into the next slot a reader does not hold
+     * @return false for a device frame, one of another geometry or while every slot is held, left out
+     */
+    bool write(const AVFrame *frame);
+
+    /**
+     * releaseHolds() drops the holds of the slots, those of a reader process that died holding frames
+     */
+    void releaseHolds();
+
+    uint64_t writtenFrames() const { return frames; }
+    uint64_t skippedFrames() const { return skipped; }
+};
+
+/**
+ * SRSharedReader maps the ring of an SRSharedFrames read only, for the consumers; read-write for those that hold.
+ */
+class SRSharedReader {
+
+private:
+    SRSharedHeader *header;
+    const uint8_t *data;
+    size_t size;
+#ifdef _WIN32
+    void *mapping;
+#else
+    int fd;
+#endif
+
+public:
+    SRSharedReader();
+    ~SRSharedReader();
+
+    SRSharedReader(const SRSharedReader&) = delete;
+    SRSharedReader &operator=(const SRSharedReader&) = delete;
+
+    /**
+     * @param holding maps the ring read-write, for hold()
+     * @return 0 on success, AVERROR(ENOENT) while the recorder has not created it, AVERROR_INVALIDDATA
+     */
+    int open(const char *name, bool holding = false);
+    void close();
+
+    const SRSharedHeader *layout() const { return header; }
+
+    /**
+     * latest() is the sequence of the newest complete frame, 0 if none: its slot is (sequence / 2 - 1) % slotCount
+     */
+    uint64_t latest() const;
+
+    /**
+     * plane() is plane p of the slot of sequence, valid to read until valid() says otherwise
+     */
+    const uint8_t *plane(uint64_t sequence, int p) const;
+    int64_t pts(uint64_t sequence) const;
+
+    /**
+     * valid() tells if the slot of sequence still holds that frame, checked after reading it
+     */
+    bool valid(uint64_t sequence) const;
+
+    /**
+     * hold() keeps the writer off the slot of sequence until release(): the frame can be read in place for any time.
+     * The writer passes over a held slot: the ring is a slot shorter for the other readers while the hold lasts.
+     * @return false if the slot no longer holds that frame, not held
+     */
+    bool hold(uint64_t sequence);
+    void release(uint64_t sequence);
+};
+
+/**
+ * SRSharedGrabber records the ring of a capture process (see capturehost.cpp) in place of a capture of its own:
+ * grab() hands out the newest frame in place, held until the pipeline releases it, no copy. A process that only
+ * encodes and muxes can then crash and be started again while the capture goes on.
+ */
+class SRSharedGrabber : public SRVideoGrabber {
+
+private:
+    struct Hold {
+        SRSharedReader *reader;
+        uint64_t sequence;
+    };
+
+    std::string ringName;
+    SRSharedReader reader;
+    Hold holds[SHM_MAX_SLOTS];  //of each slot: the writer does not come back to a held one
+    uint64_t last;
+
+    static void release(void *opaque, uint8_t *data);
+
+public:
+    /**
+     * @param name of the ring, the sharedframes of the capture process
+     */
+    explicit SRSharedGrabber(const char *name);
+
+    /**
+     * connect() maps the ring: frameWidth(), frameHeight() and pixelFormat() are those of its frames
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int connect();
+
+    /**
+     * open() checks the region is the one of the ring: device and offset are left out
+     */
+    int open(const char *device, int x, int y, int width, int height) override;
+    int grab(AVFrame *frame) override;
+
+    enum AVPixelFormat pixelFormat() const override;
+    const char *name() const override { return "sharedframes"; }
+    bool allocatesFrames() const override { return true; }
+
+    int frameWidth() const { return reader.layout() ? reader.layout()->width : 0; }
+    int frameHeight() const { return reader.layout() ? reader.layout()->height : 0; }
+};
+
+#endif //CPPSCREENRECORDER_SRSHAREDFRAMES_H
@@ -0,0 +1,132 @@
+#include "SRSnapshot.h"
+#include "SRLog.h"
+#include "SRThreads.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+extern "C"
+{
+#include "libavformat/avformat.h"
+}
+
+using namespace std;
+
+SRSnapshot::SRSnapshot(const char *pattern, int interval, int width): pattern(pattern),
+        interval((int64_t) (interval > 0 ? interval : SNAPSHOT_INTERVAL) * 1000000), width(width & ~1), height(0),
+        enc(nullptr), queue(1, SR_WAIT_PARK), nextPts(AV_NOPTS_VALUE), written(0), skipped(0) {}
+
+SRSnapshot::~SRSnapshot() {
+    finish();
+    avcodec_free_context(&enc);
+}
+
+int SRSnapshot::open(int sourceWidth, int sourceHeight) {
+    //PNG keeps the text sharp, JPEG is a tenth of its size
+    size_t dot = pattern.find_last_of('.');
+    bool png = dot != string::npos && !strcasecmp(pattern.c_str() + dot, ".png");
+    const AVCodec *codec = avcodec_find_encoder(png ? AV_CODEC_ID_PNG : AV_CODEC_ID_MJPEG);
+    if (!codec || !(enc = avcodec_alloc_context3(codec)))
+        return AVERROR_ENCODER_NOT_FOUND;
+    if (width <= 0 || width > sourceWidth)
+        width = sourceWidth & ~1;
+    height = FFMAX((int) av_rescale(sourceHeight, width, sourceWidth) & ~1, 2);
+    enc->width = width;
+    enc->height = height;
+    enc->pix_fmt = png ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_YUVJ420P;
+    enc->time_base = AV_TIME_BASE_Q;
+    if (!png) {
+        enc->flags |= AV_CODEC_FLAG_QSCALE;
+        enc->global_quality = FF_QP2LAMBDA * SNAPSHOT_QUALITY;
+    }
+    int ret = avcodec_open2(enc, codec, nullptr);
+    if (ret < 0) {
+        cout << "\n[SRSnapshot] cannot open " << codec->name << " for " << pattern;
+        return ret;
+    }
+    if ((ret = scaled.initVideo(enc->pix_fmt, width, height, 1)) < 0)
+        return ret;
+    cout << "\n[SRSnapshot] " << pattern << ": " << codec->name << " " << width << "x" << height << " every "
+         << interval / 1000000 << " s";
+    return 0;
+}
+
+void SRSnapshot::start() {
+    if (enc && !encoder.joinable())
+        encoder = std::thread(&SRSnapshot::run, this);
+}
+
+void SRSnapshot::send(const AVFrame *frame) {
+    if (!encoder.joinable() || frame->pts == AV_NOPTS_VALUE)
+        return;
+    if (nextPts != AV_NOPTS_VALUE && frame->pts < nextPts)
+        return;
+    //the next one is due an interval after this one, taken or not
+    nextPts = frame->pts + interval;
+    AVFrame *queued = frame->hw_frames_ctx ? nullptr : refs.getEmpty();
+    if (!queued || av_frame_ref(queued, frame) < 0 || !queue.tryPush(queued)) {
+        refs.release(queued);
+        skipped++;
+    }
+}
+
+/**
+ * run() is the snapshot thread: it writes every queued frame until finish()
+ */
+void SRSnapshot::run() {
+    idleThread();
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame;
+    int number = 0;
+    while (queue.pop(frame)) {
+        writeSnapshot(frame, pkt, number++);
+        refs.release(frame);
+    }
+    av_packet_free(&pkt);
+}
+
+/**
+ * writeSnapshot() shrinks, encodes and writes frame as the file number of the pattern
+ */
+void SRSnapshot::writeSnapshot(AVFrame *frame, AVPacket *pkt, int number) {
+    AVFrame *out = scaled.get();
+    char name[1024];
+    if (!out || !pkt || scaler.configure(frame->width, frame->height, (enum AVPixelFormat) frame->format,
+                                         width, height, enc->pix_fmt, SWS_AREA, 1) < 0) {
+        srLog(SR_LOG_ERROR, "[SRSnapshot] cannot scale the frames for %s", pattern.c_str());
+        scaled.release(out);
+        skipped++;
+        return;
+    }
+    scaler.scale(frame, out);
+    out->pts = frame->pts;
+    int ret = avcodec_send_frame(enc, out);
+    scaled.release(out);
+    if (ret >= 0)
+        ret = avcodec_receive_packet(enc, pkt);
+    if (ret < 0) {
+        srLog(SR_LOG_WARNING, "[SRSnapshot] cannot encode a snapshot for %s", pattern.c_str());
+        skipped++;
+        return;
+    }
+    //a pattern without a number is overwritten by every snapshot: the newest one for a preview
+    if (av_get_frame_filename(name, sizeof(name), pattern.c_str(), number) < 0)
+        snprintf(name, sizeof(name), "%s", pattern.c_str());
+    FILE *file = fopen(name, "wb");
+    if (!file || fwrite(pkt->data, 1, pkt->size, file) != (size_t) pkt->size) {
+        srLog(SR_LOG_ERROR, "[SRSnapshot] error in writing %s", name);
+        skipped++;
+    } else {
+        written++;
+    }
+    if (file)
+        fclose(file);
+    av_packet_unref(pkt);
+}
+
+void SRSnapshot::finish() {
+    queue.close();
+    if (encoder.joinable())
+        encoder.join();
+}
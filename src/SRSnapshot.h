@@ -0,0 +1,92 @@
+//
+// Periodic thumbnails of the recorded frames, encoded as JPEG or PNG files by a background thread.
+//
+
+#ifndef CPPSCREENRECORDER_SRSNAPSHOT_H
+#define CPPSCREENRECORDER_SRSNAPSHOT_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include "SRFramePool.h"
+#include "SRRingBuffer.h"
+#include "SRScaler.h"
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+}
+
+#define SNAPSHOT_INTERVAL 10    //s between two snapshots
+#define SNAPSHOT_WIDTH 320      //px of the snapshots, the height keeps the aspect of the recording
+#define SNAPSHOT_QUALITY 5      //MJPEG quantizer, 2 is the best
+
+/**
+ * SRSnapshot writes a small picture of the recording every interval: the frame the encoder gets is referenced,
+ * never copied, on the ProducerThread, and the snapshot thread shrinks it with an area average (a box filter)
+ * and encodes it with the MJPEG or PNG encoder of libavcodec into a file of its own.
+ * The queue holds a single frame: a snapshot still being encoded when the next one is due makes it skipped,
+ * the recording never waits for a snapshot.
+ *
+ * @Note system memory frames only, hardware surfaces are skipped
+ */
+class SRSnapshot {
+
+private:
+    std::string pattern;
+    int64_t interval;   //us
+    int width, height;
+    AVCodecContext *enc;
+    SRScaler scaler;
+    SRFramePool refs;
+    SRFramePool scaled;
+    SRRingBuffer<AVFrame*> queue;
+    std::thread encoder;
+    int64_t nextPts;    //ProducerThread only
+
+    std::atomic<uint64_t> written;
+    std::atomic<uint64_t> skipped;
+
+    void run();
+    void writeSnapshot(AVFrame *frame, AVPacket *pkt, int number);
+
+public:
+    /**
+     * @param pattern file name with a frame number ("thumb_%05d.jpg"), .png for PNG files, JPEG otherwise
+     * @param interval s between two snapshots
+     * @param width of the snapshots, even
+     */
+    SRSnapshot(const char *pattern, int interval = SNAPSHOT_INTERVAL, int width = SNAPSHOT_WIDTH);
+    ~SRSnapshot();
+
+    SRSnapshot(const SRSnapshot&) = delete;
+    SRSnapshot &operator=(const SRSnapshot&) = delete;
+
+    /**
+     * open() opens the image encoder for frames of sourceWidth x sourceHeight
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int open(int sourceWidth, int sourceHeight);
+
+    /**
+     * start() starts the snapshot thread, in the background class of the scheduler
+     */
+    void start();
+
+    /**
+     * send() takes a reference to frame when a snapshot is due, without ever waiting
+     * @Note ProducerThread only, frame pts in microseconds on the capture clock
+     */
+    void send(const AVFrame *frame);
+
+    /**
+     * finish() writes the queued snapshot and stops the thread
+     */
+    void finish();
+
+    uint64_t writtenSnapshots() const { return written; }
+    uint64_t skippedSnapshots() const { return skipped; }
+};
+
+#endif //CPPSCREENRECORDER_SRSNAPSHOT_H
@@ -0,0 +1,159 @@
+#include "SRSrtp.h"
+
+#include <cstring>
+
+extern "C"
+{
+#include "libavutil/aes.h"
+#include "libavutil/base64.h"
+#include "libavutil/error.h"
+#include "libavutil/hmac.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/mem.h"
+}
+
+/* AES counter mode of RFC 3711: the block number is in the last 16 bits of iv */
+static void keystream(struct AVAES *aes, uint8_t iv[16], uint8_t *data, int size) {
+    uint8_t block[16];
+    for (int i = 0, pos = 0; pos < size; i++) {
+        AV_WB16(&iv[14], i);
+        av_aes_crypt(aes, block, iv, 1, nullptr, 0);
+        for (int j = 0; j < 16 && pos < size; j++, pos++)
+            data[pos] ^= block[j];
+    }
+}
+
+/* session key of label from the master key and salt, the key derivation rate is 0 */
+static void deriveKey(struct AVAES *master, const uint8_t *salt, int label, uint8_t *out, int size) {
+    uint8_t iv[16] = {0};
+    memcpy(iv, salt, 14);
+    iv[7] ^= label;
+    memset(out, 0, size);
+    keystream(master, iv, out, size);
+}
+
+/* IV of a packet: (salt * 2^16) XOR (ssrc * 2^64) XOR (index * 2^16) */
+static void packetIv(uint8_t iv[16], const uint8_t *salt, uint32_t ssrc, uint64_t index) {
+    uint8_t indexBytes[8];
+    memset(iv, 0, 16);
+    AV_WB32(&iv[4], ssrc);
+    AV_WB64(indexBytes, index);
+    for (int i = 0; i < 8; i++)
+        iv[6 + i] ^= indexBytes[i];
+    for (int i = 0; i < 14; i++)
+        iv[i] ^= salt[i];
+}
+
+SRSrtp::SRSrtp(): rtpCipher(av_aes_alloc()), rtcpCipher(av_aes_alloc()), hmac(av_hmac_alloc(AV_HMAC_SHA1)),
+                  rtpAuth(), rtpSalt(), rtcpAuth(), rtcpSalt(), rtcpIndex(0) {}
+
+SRSrtp::~SRSrtp() {
+    av_free(rtpCipher);
+    av_free(rtcpCipher);
+    av_hmac_free(hmac);
+}
+
+bool SRSrtp::init(const char *key) {
+    uint8_t master[SRTP_MASTER_SIZE + 3];
+    uint8_t sessionKey[16];
+    if (!rtpCipher || !rtcpCipher || !hmac || !key || av_base64_decode(master, key, sizeof(master)) != SRTP_MASTER_SIZE)
+        return false;
+    struct AVAES *derive = av_aes_alloc();
+    if (!derive)
+        return false;
+    av_aes_init(derive, master, 128, 0);
+    const uint8_t *salt = master + 16;
+    deriveKey(derive, salt, 0, sessionKey, 16);
+    av_aes_init(rtpCipher, sessionKey, 128, 0);
+    deriveKey(derive, salt, 1, rtpAuth, 20);
+    deriveKey(derive, salt, 2, rtpSalt, 14);
+    deriveKey(derive, salt, 3, sessionKey, 16);
+    av_aes_init(rtcpCipher, sessionKey, 128, 0);
+    deriveKey(derive, salt, 4, rtcpAuth, 20);
+    deriveKey(derive, salt, 5, rtcpSalt, 14);
+    av_free(derive);
+    memset(master, 0, sizeof(master));
+    memset(sessionKey, 0, sizeof(sessionKey));
+    rollovers.clear();
+    rtcpIndex = 0;
+    return true;
+}
+
+/**
+ * rolloverOf() is the rollover counter of seq on ssrc: it goes up when the sequence numbers wrap
+ */
+uint32_t SRSrtp::rolloverOf(uint32_t ssrc, uint16_t seq) {
+    for (Rollover &r : rollovers) {
+        if (r.ssrc != ssrc)
+            continue;
+        if ((int16_t) (seq - r.seq) > 0) {
+            if (seq < r.seq)
+                r.roc++;
+            r.seq = seq;
+        }
+        return r.roc;
+    }
+    rollovers.push_back({ssrc, seq, 0});
+    return 0;
+}
+
+void SRSrtp::tag(const uint8_t *auth, const uint8_t *data, int size, const uint8_t *roc, uint8_t *out) {
+    uint8_t digest[20];
+    av_hmac_init(hmac, auth, 20);
+    av_hmac_update(hmac, data, size);
+    if (roc)
+        av_hmac_update(hmac, roc, 4);
+    av_hmac_final(hmac, digest, sizeof(digest));
+    memcpy(out, digest, SRTP_TAG_SIZE);
+}
+
+int SRSrtp::protectRtp(uint8_t *packet, int size) {
+    if (size < 12 || (packet[0] >> 6) != 2)
+        return AVERROR_INVALIDDATA;
+    int offset = 12 + 4 * (packet[0] & 0x0f);
+    if ((packet[0] & 0x10) && offset + 4 <= size)
+        offset += 4 + 4 * AV_RB16(&packet[offset + 2]);
+    if (offset > size)
+        return AVERROR_INVALIDDATA;
+    uint16_t seq = AV_RB16(&packet[2]);
+    uint32_t ssrc = AV_RB32(&packet[8]);
+    uint32_t roc = rolloverOf(ssrc, seq);
+    uint8_t iv[16], rocBytes[4];
+    packetIv(iv, rtpSalt, ssrc, ((uint64_t) roc << 16) | seq);
+    keystream(rtpCipher, iv, packet + offset, size - offset);
+    AV_WB32(rocBytes, roc);
+    tag(rtpAuth, packet, size, rocBytes, packet + size);
+    return size + SRTP_TAG_SIZE;
+}
+
+int SRSrtp::protectRtcp(uint8_t *packet, int size) {
+    if (size < 8)
+        return AVERROR_INVALIDDATA;
+    uint32_t index = rtcpIndex++ & 0x7fffffff;
+    uint8_t iv[16];
+    packetIv(iv, rtcpSalt, AV_RB32(&packet[4]), index);
+    keystream(rtcpCipher, iv, packet + 8, size - 8);
+    AV_WB32(&packet[size], 0x80000000 | index);
+    tag(rtcpAuth, packet, size + 4, nullptr, packet + size + 4);
+    return size + SRTP_OVERHEAD;
+}
+
+int SRSrtp::unprotectRtcp(uint8_t *packet, int size) {
+    if (size < 8 + SRTP_OVERHEAD)
+        return AVERROR_INVALIDDATA;
+    uint8_t expected[SRTP_TAG_SIZE];
+    tag(rtcpAuth, packet, size - SRTP_TAG_SIZE, nullptr, expected);
+    uint8_t differ = 0;
+    for (int i = 0; i < SRTP_TAG_SIZE; i++)
+        differ |= expected[i] ^ packet[size - SRTP_TAG_SIZE + i];
+    if (differ)
+        return AVERROR_INVALIDDATA;
+    int plain = size - SRTP_OVERHEAD;
+    uint32_t word = AV_RB32(&packet[plain]);
+    if (word & 0x80000000) {
+        uint8_t iv[16];
+        packetIv(iv, rtcpSalt, AV_RB32(&packet[4]), word & 0x7fffffff);
+        keystream(rtcpCipher, iv, packet + 8, plain - 8);
+    }
+    return plain;
+}
@@ -0,0 +1,82 @@
+//
+// SRTP and SRTCP (AES_CM_128_HMAC_SHA1_80) of one direction of an RTP session keyed by SDES.
+//
+
+#ifndef CPPSCREENRECORDER_SRSRTP_H
+#define CPPSCREENRECORDER_SRSRTP_H
+
+#include <cstdint>
+#include <vector>
+
+struct AVAES;
+struct AVHMAC;
+
+#define SRTP_MASTER_SIZE 30 //bytes of an inline key: the 16 of the master key, the 14 of the master salt
+#define SRTP_TAG_SIZE 10    //bytes of the HMAC-SHA1-80 tag at the end of every packet
+#define SRTP_OVERHEAD 14    //bytes the protection adds at most: SRTCP puts its index before the tag
+
+/**
+ * SRSrtp protects the RTP and RTCP packets sent with one master key, or checks and decrypts the RTCP packets
+ * received with it, as RFC 3711 and the AES_CM_128_HMAC_SHA1_80 suite of SDES (RFC 4568) have it: the session keys
+ * are derived once (key derivation rate 0), the payload is encrypted in AES-128 counter mode and the packet
+ * authenticated with the first 80 bits of an HMAC-SHA1. The master key is the base64 inline key of the SDP,
+ * the one a gateway (mediasoup PlainTransport, Janus) is given or gives out.
+ *
+ * @Note one thread per direction: the rollover counters of the sent streams are not locked
+ */
+class SRSrtp {
+
+private:
+    struct Rollover {
+        uint32_t ssrc;
+        uint16_t seq;   //highest sent
+        uint32_t roc;
+    };
+
+    struct AVAES *rtpCipher;
+    struct AVAES *rtcpCipher;
+    struct AVHMAC *hmac;
+    uint8_t rtpAuth[20], rtpSalt[14];
+    uint8_t rtcpAuth[20], rtcpSalt[14];
+    std::vector<Rollover> rollovers;
+    uint32_t rtcpIndex;
+
+    uint32_t rolloverOf(uint32_t ssrc, uint16_t seq);
+    void tag(const uint8_t *auth, const uint8_t *data, int size, const uint8_t *roc, uint8_t *out);
+
+public:
+    SRSrtp();
+    ~SRSrtp();
+
+    SRSrtp(const SRSrtp&) = delete;
+    SRSrtp &operator=(const SRSrtp&) = delete;
+
+    /**
+     * init() derives the session keys of the base64 inline key of SRTP_MASTER_SIZE bytes
+     * @return false if key is not one
+     */
+    bool init(const char *key);
+
+    /**
+     * protectRtp() encrypts the payload of the RTP packet and appends the tag
+     * @param packet size bytes, followed by room for SRTP_TAG_SIZE more
+     * @return the size of the protected packet, AVERROR_INVALIDDATA if the packet is not RTP
+     */
+    int protectRtp(uint8_t *packet, int size);
+
+    /**
+     * protectRtcp() encrypts the compound RTCP packet after the SSRC of its sender and appends the index and the tag
+     * @param packet size bytes, followed by room for SRTP_OVERHEAD more
+     * @return the size of the protected packet, AVERROR_INVALIDDATA if the packet is too short
+     */
+    int protectRtcp(uint8_t *packet, int size);
+
+    /**
+     * unprotectRtcp() checks the tag of the SRTCP packet and decrypts it in place
+     * @return the size of the plain compound packet, AVERROR_INVALIDDATA if it is not authentic
+     * @Note no replay list: a replayed report only moves the rate control back to a state it already had
+     */
+    int unprotectRtcp(uint8_t *packet, int size);
+};
+
+#endif //CPPSCREENRECORDER_SRSRTP_H
@@ -0,0 +1,71 @@
+#include "SRStats.h"
+
+SRHistogram::SRHistogram(): sum(0), max(0) {
+    for (auto &bucket : buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+void SRHistogram::record(int64_t us) {
+    if (us < 0) us = 0;
+    //bucket i holds [2^(i-1), 2^i) us, bucket 0 the durations under a microsecond
+    int bucket = 0;
+    for (uint64_t v = (uint64_t) us; v && bucket < SR_HISTOGRAM_BUCKETS - 1; v >>= 1)
+        bucket++;
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(us, std::memory_order_relaxed);
+    if (us > max.load(std::memory_order_relaxed))
+        max.store(us, std::memory_order_relaxed);
+}
+
+int64_t SRHistogram::percentile(const uint64_t *counts, uint64_t total, double fraction) {
+    uint64_t rank = (uint64_t) (total * fraction), seen = 0;
+    for (int i = 0; i < SR_HISTOGRAM_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > rank)
+            return i ? (int64_t) 1 << i : 0;
+    }
+    return (int64_t) 1 << (SR_HISTOGRAM_BUCKETS - 1);
+}
+
+SRLatencyStats SRHistogram::snapshot() const {
+    uint64_t counts[SR_HISTOGRAM_BUCKETS], total = 0;
+    for (int i = 0; i < SR_HISTOGRAM_BUCKETS; i++)
+        total += counts[i] = buckets[i].load(std::memory_order_relaxed);
+
+    SRLatencyStats s;
+    s.count = total;
+    s.mean = total ? sum.load(std::memory_order_relaxed) / (int64_t) total : 0;
+    s.p50 = total ? percentile(counts, total, 0.5) : 0;
+    s.p99 = total ? percentile(counts, total, 0.99) : 0;
+    s.max = max.load(std::memory_order_relaxed);
+    //the buckets bound the percentiles from above, the maximum is exact
+    if (s.p50 > s.max) s.p50 = s.max;
+    if (s.p99 > s.max) s.p99 = s.max;
+    return s;
+}
+
+SRLatencyStats SRHistogram::interval(SRHistogramMark &mark) const {
+    uint64_t counts[SR_HISTOGRAM_BUCKETS], total = 0;
+    int top = -1;
+    for (int i = 0; i < SR_HISTOGRAM_BUCKETS; i++) {
+        uint64_t seen = buckets[i].load(std::memory_order_relaxed);
+        total += counts[i] = seen - mark.counts[i];
+        mark.counts[i] = seen;
+        if (counts[i])
+            top = i;
+    }
+    int64_t seenSum = sum.load(std::memory_order_relaxed);
+
+    SRLatencyStats s;
+    s.count = total;
+    s.mean = total ? (seenSum - mark.sum) / (int64_t) total : 0;
+    mark.sum = seenSum;
+    s.p50 = total ? percentile(counts, total, 0.5) : 0;
+    s.p99 = total ? percentile(counts, total, 0.99) : 0;
+    s.max = top > 0 ? (int64_t) 1 << top : 0;
+    if (s.max > max.load(std::memory_order_relaxed))
+        s.max = max.load(std::memory_order_relaxed);
+    if (s.p50 > s.max) s.p50 = s.max;
+    if (s.p99 > s.max) s.p99 = s.max;
+    return s;
+}
@@ -0,0 +1,73 @@
+//
+// Lock-free latency histograms of the capture pipeline stages.
+//
+
+#ifndef CPPSCREENRECORDER_SRSTATS_H
+#define CPPSCREENRECORDER_SRSTATS_H
+
+#include <atomic>
+#include <cstdint>
+
+#define SR_HISTOGRAM_BUCKETS 32   //power of two buckets of microseconds, the last one takes everything longer
+
+/**
+ * Pipeline stages measured by ScreenRecorder::getStats()
+ */
+typedef enum N{
+    SR_STAGE_GRAB,
+    SR_STAGE_DECODE,
+    SR_STAGE_SCALE,
+    SR_STAGE_ENCODE,
+    SR_STAGE_MUX,
+    SR_STAGE_COUNT
+}SRStage;
+
+/**
+ * Summary of an SRHistogram in microseconds, the percentiles are the upper bound of their bucket
+ */
+typedef struct L{
+    uint64_t count;
+    int64_t mean;
+    int64_t p50;
+    int64_t p99;
+    int64_t max;
+}SRLatencyStats;
+
+/**
+ * What SRHistogram::interval() has summarized of a histogram so far, zero initialized before the first call
+ */
+typedef struct HM{
+    uint64_t counts[SR_HISTOGRAM_BUCKETS];
+    int64_t sum;
+}SRHistogramMark;
+
+/**
+ * SRHistogram counts durations in power of two buckets.\n
+ * record() is a few relaxed atomic adds, no lock and no allocation, so it can stay on in the capture loops;
+ * snapshot() can be called from any thread while they record.
+ */
+class SRHistogram {
+
+private:
+    std::atomic<uint64_t> buckets[SR_HISTOGRAM_BUCKETS];
+    std::atomic<int64_t> sum;
+    std::atomic<int64_t> max;
+
+    static int64_t percentile(const uint64_t *counts, uint64_t total, double fraction);
+
+public:
+    SRHistogram();
+
+    SRHistogram(const SRHistogram&) = delete;
+    SRHistogram &operator=(const SRHistogram&) = delete;
+
+    void record(int64_t us);
+    SRLatencyStats snapshot() const;
+    /**
+     * interval() summarizes the durations recorded since mark and moves mark to now, for the periodic exporters:
+     * the maximum is the upper bound of the highest bucket hit
+     */
+    SRLatencyStats interval(SRHistogramMark &mark) const;
+};
+
+#endif //CPPSCREENRECORDER_SRSTATS_H
@@ -0,0 +1,200 @@
+#include "SRStreamOutput.h"
+#include "SRLog.h"
+
+#include <cstring>
+#include <iostream>
+
+extern "C"
+{
+#include "libavutil/time.h"
+}
+
+using namespace std;
+
+SRStreamOutput::SRStreamOutput(const char *url, size_t queuePackets, bool flush): url(url), ctx(nullptr),
+        queue(queuePackets, SR_WAIT_PARK), flush(flush), pacedRate(0), ttl(UDP_TTL), connected(false), failed(false), closingSince(0), dropped(0) {
+    pool.reserve((int) queuePackets + 1);
+}
+
+SRStreamOutput::~SRStreamOutput() {
+    finish();
+    if (ctx) {
+        if (!(ctx->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&ctx->pb);
+        avformat_free_context(ctx);
+    }
+}
+
+/**
+ * guessFormat() picks the container of a live URL: FLV for RTMP, MPEG-TS for SRT and UDP,
+ * MPEG-TS over RTP for RTP so that audio and video share one session
+ */
+AVOutputFormat *SRStreamOutput::guessFormat(const char *url) {
+    const char *name = nullptr;
+    if (!strncmp(url, "rtmp", 4))
+        name = "flv";
+    else if (!strncmp(url, "srt://", 6) || !strncmp(url, "udp://", 6))
+        name = "mpegts";
+    else if (!strncmp(url, "rtp://", 6))
+        name = "rtp_mpegts";
+    return av_guess_format(name, url, nullptr);
+}
+
+int SRStreamOutput::interrupted(void *opaque) {
+    SRStreamOutput *out = (SRStreamOutput *) opaque;
+    int64_t since = out->closingSince;
+    return since && av_gettime_relative() - since > (int64_t) STREAM_CLOSE_TIMEOUT * 1000;
+}
+
+/**
+ * init() creates the output streams with the codec parameters of source, the recording once its header is written.
+ * No I/O happens here: the writer thread connects.
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int SRStreamOutput::init(const AVFormatContext *source) {
+    AVOutputFormat *format = guessFormat(url.c_str());
+    if (!format) {
+        cout << "\n[SRStreamOutput] cannot guess the container of " << url;
+        return AVERROR_MUXER_NOT_FOUND;
+    }
+    int ret = avformat_alloc_output_context2(&ctx, format, nullptr, url.c_str());
+    if (ret < 0)
+        return ret;
+    ctx->interrupt_callback.callback = interrupted;
+    ctx->interrupt_callback.opaque = this;
+    if (flush) {
+        //no PCR lead nor buffered I/O: the packet is on the wire as soon as av_write_frame() returns
+        ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+        ctx->max_delay = 0;
+    }
+
+    for (unsigned int i = 0; i < source->nb_streams; i++) {
+        AVStream *st = avformat_new_stream(ctx, nullptr);
+        if (!st)
+            return AVERROR(ENOMEM);
+        if ((ret = avcodec_parameters_copy(st->codecpar, source->streams[i]->codecpar)) < 0)
+            return ret;
+        if (!avformat_query_codec(format, st->codecpar->codec_id, FF_COMPLIANCE_NORMAL)) {
+            cout << "\n[SRStreamOutput] " << format->name << " cannot carry " << avcodec_get_name(st->codecpar->codec_id);
+            return AVERROR(EINVAL);
+        }
+        st->codecpar->codec_tag = 0;
+        st->time_base = source->streams[i]->time_base;
+        sourceTimeBases.push_back(source->streams[i]->time_base);
+    }
+    skipToKey.assign(source->nb_streams, true);
+    return 0;
+}
+
+void SRStreamOutput::pace(int64_t bitrate, int ttl) {
+    if (strncmp(url.c_str(), "udp://", 6)) {
+        cout << "\n[SRStreamOutput] only udp:// outputs are paced, " << url << " is sent as it comes";
+        return;
+    }
+    pacedRate = bitrate;
+    this->ttl = ttl;
+}
+
+void SRStreamOutput::start() {
+    if (ctx && !writer.joinable())
+        writer = std::thread(&SRStreamOutput::run, this);
+}
+
+/**
+ * send() queues a reference to pkt, without ever waiting.
+ * Packets are dropped while the connection is not up or when the writer is behind, up to the next keyframe.
+ * @Note MuxerThread only, pkt timestamps are in the time base of the recording stream
+ */
+void SRStreamOutput::send(const AVPacket *pkt) {
+    unsigned int stream = pkt->stream_index;
+    if (failed || stream >= skipToKey.size())
+        return;
+    if (!connected) {
+        skipToKey[stream] = true;
+        dropped++;
+        return;
+    }
+    if (skipToKey[stream] && !(pkt->flags & AV_PKT_FLAG_KEY)) {
+        dropped++;
+        return;
+    }
+    skipToKey[stream] = false;
+
+    AVPacket *queued = pool.get();
+    if (!queued || av_packet_ref(queued, pkt) < 0 || !queue.tryPush(queued)) {
+        pool.release(queued);
+        skipToKey[stream] = true;
+        dropped++;
+    }
+}
+
+/**
+ * run() is the writer thread: it connects, writes the header and then every queued packet until finish()
+ */
+void SRStreamOutput::run() {
+    int ret = 0;
+    AVDictionary *io = nullptr, *mux = nullptr;
+    if (pacedRate > 0) {
+        //udp: a FIFO drained by its own thread at bitrate, a datagram at a time
+        av_dict_set_int(&io, "pkt_size", UDP_PACKET_SIZE, 0);
+        av_dict_set_int(&io, "bitrate", pacedRate, 0);
+        av_dict_set_int(&io, "ttl", ttl, 0);
+        //mpegts: constant rate, the PCR follows it
+        av_dict_set_int(&mux, "muxrate", pacedRate, 0);
+    }
+    if (!(ctx->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open2(&ctx->pb, url.c_str(), AVIO_FLAG_WRITE, &ctx->interrupt_callback, pacedRate > 0 ? &io : nullptr);
+        //the sender thread of udp needs pthread_cancel, some builds have no pacing
+        if (ret < 0 && pacedRate > 0) {
+            srLog(SR_LOG_WARNING, "[SRStreamOutput] this libavformat cannot pace %s, sent as it comes", url.c_str());
+            av_dict_free(&io);
+            av_dict_set_int(&io, "pkt_size", UDP_PACKET_SIZE, 0);
+            av_dict_set_int(&io, "ttl", ttl, 0);
+            ret = avio_open2(&ctx->pb, url.c_str(), AVIO_FLAG_WRITE, &ctx->interrupt_callback, &io);
+        }
+    }
+    if (ret >= 0)
+        ret = avformat_write_header(ctx, &mux);
+    av_dict_free(&io);
+    av_dict_free(&mux);
+    if (ret < 0) {
+        srLog(SR_LOG_ERROR, "[SRStreamOutput] cannot connect to %s", url.c_str());
+        failed = true;
+    } else {
+        if (pacedRate > 0)
+            srLog(SR_LOG_INFO, "[SRStreamOutput] streaming to %s at %lld kbit/s", url.c_str(), (long long) (pacedRate / 1000));
+        else
+            srLog(SR_LOG_INFO, "[SRStreamOutput] streaming to %s", url.c_str());
+        connected = true;
+    }
+
+    AVPacket *pkt;
+    while (queue.pop(pkt)) {
+        if (!failed) {
+            unsigned int stream = pkt->stream_index;
+            av_packet_rescale_ts(pkt, sourceTimeBases[stream], ctx->streams[stream]->time_base);
+            if (av_write_frame(ctx, pkt) < 0) {
+                srLog(SR_LOG_ERROR, "[SRStreamOutput] connection to %s lost", url.c_str());
+                failed = true;
+            }
+        }
+        pool.release(pkt);
+    }
+
+    if (connected && !failed)
+        av_write_trailer(ctx);
+    connected = false;
+}
+
+/**
+ * finish() lets the writer flush what is queued, for at most STREAM_CLOSE_TIMEOUT ms, and stops it
+ */
+void SRStreamOutput::finish() {
+    if (!writer.joinable())
+        return;
+    closingSince = av_gettime_relative();
+    queue.close();
+    writer.join();
+    if (dropped)
+        cout << "\n[SRStreamOutput] " << url << ": " << dropped << " packets dropped";
+}
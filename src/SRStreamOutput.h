@@ -0,0 +1,82 @@
+//
+// Live output (RTMP, SRT, RTP, UDP multicast) fed with the encoded packets of the recording, written by its own thread.
+//
+
+#ifndef CPPSCREENRECORDER_SRSTREAMOUTPUT_H
+#define CPPSCREENRECORDER_SRSTREAMOUTPUT_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SRFramePool.h"
+#include "SRRingBuffer.h"
+
+extern "C"
+{
+#include "libavformat/avformat.h"
+}
+
+#define STREAM_CLOSE_TIMEOUT 2000   //ms a live output may take to flush before its connection is cut
+#define UDP_PACKET_SIZE 1316    //bytes of a datagram of udp://: 7 TS packets, below the Ethernet MTU
+#define UDP_RATE_MARGIN 1.3     //paced rate over the bitrate of the encoders: TS and PES overhead, VBV overshoot
+#define UDP_TTL 4   //hops of the multicast datagrams, the routers of a LAN
+
+/**
+ * SRStreamOutput is a second muxer sharing the packets of the recording: no second encode.\n
+ * send() only references the packet into a bounded queue, the writer thread opens the connection
+ * and writes, so a slow or dead network never blocks the MuxerThread. When the queue is full the packet is dropped
+ * and the stream resumes on its next keyframe.\n
+ * A paced udp:// output (multicast for many viewers at no cost per viewer) is MPEG-TS at the constant muxrate,
+ * stuffed with null packets, in datagrams of UDP_PACKET_SIZE: the sender thread of libavformat udp sends them
+ * at that rate, a keyframe is spread over the time its bits take at it instead of bursting into the switches.
+ */
+class SRStreamOutput {
+
+private:
+    std::string url;
+    AVFormatContext *ctx;
+    std::vector<AVRational> sourceTimeBases;
+    std::vector<bool> skipToKey;    //MuxerThread only
+    SRRingBuffer<AVPacket*> queue;
+    SRPacketPool pool;
+    std::thread writer;
+    bool flush;
+    int64_t pacedRate;  //bit/s, 0 unpaced
+    int ttl;
+
+    std::atomic<bool> connected;
+    std::atomic<bool> failed;
+    std::atomic<int64_t> closingSince;
+    std::atomic<uint64_t> dropped;
+
+    void run();
+    static int interrupted(void *opaque);
+
+public:
+    /**
+     * @param flush every packet goes to the network as soon as it is written, for the live profile
+     */
+    SRStreamOutput(const char *url, size_t queuePackets, bool flush = false);
+    ~SRStreamOutput();
+
+    SRStreamOutput(const SRStreamOutput&) = delete;
+    SRStreamOutput &operator=(const SRStreamOutput&) = delete;
+
+    int init(const AVFormatContext *source);
+
+    /**
+     * pace() sends a udp:// output at a constant bitrate, before start()
+     * @param bitrate bit/s of the transport stream, above the peak rate of the encoders
+     * @param ttl hops of multicast datagrams
+     */
+    void pace(int64_t bitrate, int ttl = UDP_TTL);
+    void start();
+    void send(const AVPacket *pkt);
+    void finish();
+
+    static AVOutputFormat *guessFormat(const char *url);
+};
+
+#endif //CPPSCREENRECORDER_SRSTREAMOUTPUT_H
@@ -0,0 +1,226 @@
+#include "SRSyncControl.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "SRLog.h"
+
+#ifdef __linux__
+#include <sys/timex.h>
+#endif
+
+extern "C"
+{
+#include "libavutil/time.h"
+}
+
+SRClockState srClockState() {
+    SRClockState state = SRClockState();
+#ifdef __linux__
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    int ret = ntp_adjtime(&tx);
+    if (ret < 0)
+        return state;
+    state.known = true;
+    state.synced = ret != TIME_ERROR && !(tx.status & STA_UNSYNC);
+    state.maxError = tx.maxerror;
+    state.estError = tx.esterror;
+#endif
+    return state;
+}
+
+SRSyncControl::SRSyncControl(): io(nullptr), startAt(0), stopAt(0), started(false), stopping(false) {}
+
+SRSyncControl::~SRSyncControl() {
+    close();
+}
+
+int SRSyncControl::interrupted(void *opaque) {
+    return ((SRSyncControl *) opaque)->stopping;
+}
+
+int SRSyncControl::open(const char *url, SRSyncHandlers handlers) {
+    this->url = url;
+    this->handlers = std::move(handlers);
+    stopping = false;
+    server = std::thread(&SRSyncControl::serve, this);
+    timer = std::thread(&SRSyncControl::schedule, this);
+    return 0;
+}
+
+void SRSyncControl::close() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    //the interrupt callback ends the accept and the read the server waits in
+    if (server.joinable())
+        server.join();
+    if (timer.joinable())
+        timer.join();
+}
+
+/**
+ * serve() is the server thread: one controller at a time, a reply for each line it sends
+ */
+void SRSyncControl::serve() {
+    AVIOInterruptCB callback = {interrupted, this};
+    while (!stopping) {
+        AVDictionary *options = nullptr;
+        av_dict_set(&options, "listen", "1", 0);
+        int ret = avio_open2(&io, url.c_str(), AVIO_FLAG_READ_WRITE, &callback, &options);
+        av_dict_free(&options);
+        if (ret < 0) {
+            if (!stopping) {
+                srLog(SR_LOG_WARNING, "[SyncControl] cannot listen on %s: %d", url.c_str(), ret);
+                av_usleep(100000);
+            }
+            continue;
+        }
+        srLog(SR_LOG_INFO, "[SyncControl] controller connected");
+        std::string line;
+        while (!stopping) {
+            int c = avio_r8(io);
+            if (avio_feof(io))
+                break;
+            if (c == '\r')
+                continue;
+            if (c != '\n') {
+                if (line.size() < SYNC_LINE)
+                    line += (char) c;
+                continue;
+            }
+            std::string reply = line.size() < SYNC_LINE ? command(line) : "ERR line too long";
+            line.clear();
+            reply += "\n";
+            avio_write(io, (const unsigned char *) reply.data(), (int) reply.size());
+            avio_flush(io);
+        }
+        avio_closep(&io);
+    }
+}
+
+/**
+ * command() runs one command of the controller
+ * @return the reply, without its newline
+ */
+std::string SRSyncControl::command(const std::string &line) {
+    char verb[16] = "";
+    long long at = 0;
+    int fields = sscanf(line.c_str(), "%15s %lld", verb, &at);
+    int64_t now = av_gettime();
+    char reply[SYNC_LINE];
+    if (fields < 1)
+        return "ERR empty command";
+
+    if (!strcmp(verb, "TIME")) {
+        snprintf(reply, sizeof(reply), "OK %lld", (long long) now);
+        return reply;
+    }
+    if (!strcmp(verb, "STATUS"))
+        return "OK " + (handlers.status ? handlers.status() : std::string());
+    if (!strcmp(verb, "ARM")) {
+        int ret = handlers.arm ? handlers.arm() : 0;
+        if (ret < 0) {
+            snprintf(reply, sizeof(reply), "ERR not ready %d", ret);
+            return reply;
+        }
+        SRClockState clock = srClockState();
+        if (!clock.known)
+            return "OK ARMED UNKNOWN";
+        snprintf(reply, sizeof(reply), "OK ARMED %smaxerror=%lld esterror=%lld", clock.synced ? "" : "UNSYNCED ",
+                 (long long) clock.maxError, (long long) clock.estError);
+        return reply;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (!strcmp(verb, "START")) {
+        if (fields < 2)
+            return "ERR START needs a time";
+        if (started || startAt)
+            return "ERR already started";
+        if (at <= now) {
+            snprintf(reply, sizeof(reply), "ERR %lld us late", (long long) (now - at));
+            return reply;
+        }
+        startAt = at;
+        wake.notify_all();
+        snprintf(reply, sizeof(reply), "OK START in %lld us", (long long) (at - now));
+        return reply;
+    }
+    if (!strcmp(verb, "STOP")) {
+        if (!started && !startAt)
+            return "ERR not started";
+        if (fields < 2 || at < now)
+            at = now;
+        if (!started && at <= startAt)
+            return "ERR stop before the start, CANCEL drops the start";
+        stopAt = at;
+        wake.notify_all();
+        snprintf(reply, sizeof(reply), "OK STOP in %lld us", (long long) (at - now));
+        return reply;
+    }
+    if (!strcmp(verb, "CANCEL")) {
+        startAt = 0;
+        stopAt = 0;
+        wake.notify_all();
+        return "OK";
+    }
+    return "ERR unknown command " + std::string(verb);
+}
+
+/**
+ * waitUntil() waits for the wall time at, the schedule unchanged
+ * @return false when at is no longer scheduled or the control stops
+ */
+bool SRSyncControl::waitUntil(std::unique_lock<std::mutex> &guard, int64_t at) {
+    while (!stopping && (startAt == at || stopAt == at)) {
+        int64_t left = at - av_gettime();
+        if (left <= 0)
+            return true;
+        if (left > SYNC_SPIN) {
+            wake.wait_for(guard, std::chrono::microseconds(left - SYNC_SPIN));
+            continue;
+        }
+        //the last microseconds: a wake up of the scheduler is later than that
+        guard.unlock();
+        while (av_gettime() < at)
+            std::this_thread::yield();
+        guard.lock();
+    }
+    return false;
+}
+
+/**
+ * schedule() is the timer thread: the start, then the stop, each at its instant
+ */
+void SRSyncControl::schedule() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (!stopping) {
+        int64_t next = !started && startAt ? startAt : stopAt;
+        if (!next) {
+            wake.wait(guard);
+            continue;
+        }
+        if (!waitUntil(guard, next))
+            continue;
+        bool start = !started && startAt == next;
+        if (start) {
+            started = true;
+            startAt = 0;
+        } else {
+            stopAt = 0;
+        }
+        guard.unlock();
+        int64_t late = av_gettime() - next;
+        if (start && handlers.start)
+            handlers.start(next);
+        if (!start && handlers.stop)
+            handlers.stop(next);
+        srLog(SR_LOG_INFO, "[SyncControl] %s at %lld, %lld us late", start ? "started" : "stopped", (long long) next,
+              (long long) late);
+        guard.lock();
+    }
+}
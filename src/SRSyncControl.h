@@ -0,0 +1,108 @@
+//
+// Network control of synchronized recordings: many prewarmed recorders armed and started at one absolute time.
+//
+
+#ifndef CPPSCREENRECORDER_SRSYNCCONTROL_H
+#define CPPSCREENRECORDER_SRSYNCCONTROL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+extern "C"
+{
+#include "libavformat/avio.h"
+}
+
+#define SYNC_LINE 256       //bytes of a command line, longer ones are refused
+#define SYNC_SPIN 2000      //us before a scheduled instant the timer stops sleeping and polls the clock
+#define SYNC_SUFFIX ".sync.json"
+
+/**
+ * State of the discipline of the system clock, as the kernel keeps it for NTP (chrony, ntpd) and for PTP
+ * (phc2sys writing the system clock from the NIC clock ptp4l follows)
+ */
+typedef struct SC{
+    bool known;     //false where the state cannot be read: not Linux
+    bool synced;    //the daemon disciplines the clock
+    int64_t maxError;   //us, the bound the daemon gives
+    int64_t estError;   //us, its estimate
+}SRClockState;
+
+/**
+ * srClockState() reads the discipline of the wall clock av_gettime() reads
+ */
+SRClockState srClockState();
+
+/**
+ * What a controller asks of the recorder: arm() answers whether it can start at once, start() and stop() run
+ * on the timer thread at the scheduled wall time (av_gettime() us) they are given, status() is a one line report
+ */
+typedef struct SH{
+    std::function<int()> arm;
+    std::function<void(int64_t)> start;
+    std::function<void(int64_t)> stop;
+    std::function<std::string()> status;
+}SRSyncHandlers;
+
+/**
+ * SRSyncControl lets a controller drive the recorders of many machines over TCP, one line of text per command
+ * and one line back, "OK ..." or "ERR ...":\n
+ * TIME: the wall clock of the machine, in us since the epoch, to check the offsets between the machines\n
+ * ARM: the recorder is ready (devices open, header written, every thread waiting on its first frame) and tells
+ * the discipline of its clock; a recorder whose clock is not synchronized answers "OK ARMED UNSYNCED ..."\n
+ * START t: the capture starts at the wall time t, in us since the epoch, with t as the origin of its clock: the
+ * timestamps of every recorder started at the same t are offsets from the same instant, whenever their threads
+ * woke up. A t in the past is refused.\n
+ * STOP [t]: the capture ends at t, at once without it\n
+ * CANCEL: the scheduled start or stop is dropped\n
+ * STATUS: the line of the status handler\n
+ * The timer sleeps until SYNC_SPIN us before the instant and polls the clock from there: the start lands within
+ * microseconds of t, the remaining error is the one of the clock discipline. One controller is served at a time,
+ * the next one connects once it hangs up.
+ */
+class SRSyncControl {
+
+private:
+    std::string url;
+    SRSyncHandlers handlers;
+    AVIOContext *io;
+    std::thread server;
+    std::thread timer;
+    std::mutex lock;
+    std::condition_variable wake;
+    int64_t startAt;    //wall us, 0 when nothing is scheduled
+    int64_t stopAt;
+    bool started;
+    std::atomic<bool> stopping;
+
+    static int interrupted(void *opaque);
+    void serve();
+    void schedule();
+    std::string command(const std::string &line);
+    bool waitUntil(std::unique_lock<std::mutex> &guard, int64_t at);
+
+public:
+    SRSyncControl();
+    ~SRSyncControl();
+
+    SRSyncControl(const SRSyncControl&) = delete;
+    SRSyncControl &operator=(const SRSyncControl&) = delete;
+
+    /**
+     * open() listens on url ("tcp://0.0.0.0:7070") and starts the server and timer threads
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int open(const char *url, SRSyncHandlers handlers);
+
+    /**
+     * close() stops the threads, a scheduled start or stop is dropped
+     */
+    void close();
+};
+
+#endif //CPPSCREENRECORDER_SRSYNCCONTROL_H
@@ -0,0 +1,144 @@
+#include "SRTaskPool.h"
+#include "SRThreads.h"
+
+#include <algorithm>
+
+static thread_local int poolWorker = -1;   //index of the calling worker in its pool, -1 outside any pool
+static thread_local const SRTaskPool *poolOwner = nullptr;
+
+SRTaskPool::SRTaskPool(int threads, const std::vector<int> &cores): queued(0), nextWorker(0), stopping(false) {
+    int count = threads > 0 ? threads : cores.empty() ? cpuCount() : (int) cores.size();
+    for (int i = 0; i < count; i++)
+        workers.emplace_back(new Worker());
+    for (int i = 0; i < count; i++) {
+        workers[i]->thread = std::thread(&SRTaskPool::run, this, i);
+        if (!cores.empty())
+            pinThread(workers[i]->thread, cores);
+    }
+}
+
+SRTaskPool::~SRTaskPool() {
+    {
+        std::lock_guard<std::mutex> guard(idleLock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+        worker->thread.join();
+}
+
+void SRTaskPool::submit(std::function<void()> task, SRTaskPriority priority, bool yield) {
+    bool local = poolOwner == this;
+    int index = local ? poolWorker : (int) (nextWorker++ % workers.size());
+    {
+        std::lock_guard<std::mutex> guard(workers[index]->lock);
+        if (local && yield)
+            workers[index]->tasks[priority].push_front(std::move(task));
+        else
+            workers[index]->tasks[priority].push_back(std::move(task));
+    }
+    queued++;
+    //the lock orders the count with the check of an idle worker about to sleep
+    std::lock_guard<std::mutex> guard(idleLock);
+    wake.notify_one();
+}
+
+/**
+ * take() pops the newest task of worker index, or steals the oldest one of another worker, lane by lane
+ */
+bool SRTaskPool::take(int index, std::function<void()> &task) {
+    int count = (int) workers.size();
+    for (int lane = 0; lane < SR_TASK_LANES; lane++)
+        for (int i = 0; i < count; i++) {
+            Worker &worker = *workers[(index + i) % count];
+            std::lock_guard<std::mutex> guard(worker.lock);
+            std::deque<std::function<void()>> &tasks = worker.tasks[lane];
+            if (tasks.empty())
+                continue;
+            if (i == 0) {
+                task = std::move(tasks.back());
+                tasks.pop_back();
+            } else {
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            queued--;
+            return true;
+        }
+    return false;
+}
+
+void SRTaskPool::parallelFor(int count, const std::function<void(int)> &fn, SRTaskPriority priority) {
+    //the items are claimed from a shared counter: a helper task that runs late finds none left and leaves
+    struct State {
+        std::atomic<int> next;
+        std::atomic<int> done;
+        std::mutex lock;
+        std::condition_variable finished;
+        const std::function<void(int)> *fn;
+        int count;
+    };
+    std::shared_ptr<State> state = std::make_shared<State>();
+    state->next = 0;
+    state->done = 0;
+    state->fn = &fn;
+    state->count = count;
+    auto work = [](State &s) {
+        for (int i = s.next++; i < s.count; i = s.next++) {
+            (*s.fn)(i);
+            if (++s.done == s.count) {
+                std::lock_guard<std::mutex> guard(s.lock);
+                s.finished.notify_all();
+            }
+        }
+    };
+    for (int i = 1; i < std::min(count, size() + 1); i++)
+        submit([state, work]{ work(*state); }, priority);
+    work(*state);
+    std::unique_lock<std::mutex> guard(state->lock);
+    state->finished.wait(guard, [&]{ return state->done == count; });
+}
+
+void SRTaskPool::run(int index) {
+    poolWorker = index;
+    poolOwner = this;
+    std::function<void()> task;
+    while (true) {
+        if (take(index, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(idleLock);
+        wake.wait(guard, [this]{ return queued > 0 || stopping; });
+        if (stopping && queued <= 0)
+            return;
+    }
+}
+
+SRSerialTask::SRSerialTask(SRTaskPool &pool, std::function<bool()> step, SRTaskPriority priority): pool(pool),
+        step(std::move(step)), priority(priority), scheduled(false), again(false), running(0) {}
+
+SRSerialTask::~SRSerialTask() {
+    while (scheduled || running)
+        std::this_thread::yield();
+}
+
+void SRSerialTask::schedule() {
+    again = true;
+    if (!scheduled.exchange(true))
+        pool.submit([this]{ run(); }, priority);
+}
+
+void SRSerialTask::run() {
+    running++;
+    again = false;
+    bool more = true;
+    for (int i = 0; i < TASK_QUANTUM && more; i++)
+        more = step();
+    //new work announced during the run is seen by the next one: either this run queues it, or schedule() does
+    scheduled = false;
+    if ((more || again) && !scheduled.exchange(true))
+        pool.submit([this]{ run(); }, priority, more);
+    running--;
+}
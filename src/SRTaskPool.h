@@ -0,0 +1,124 @@
+//
+// Work-stealing thread pool for the pipeline stages, shared by the recorders of one process, with serial tasks on top.
+//
+
+#ifndef CPPSCREENRECORDER_SRTASKPOOL_H
+#define CPPSCREENRECORDER_SRTASKPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define TASK_QUANTUM 4  //steps a serial task runs before it goes back to the end of the queue
+
+/**
+ * Lanes of an SRTaskPool: a worker takes every real-time task it can find, its own or stolen,
+ * before it looks at the background ones.\n
+ * - SR_TASK_REALTIME is the work on the capture deadline: conversion of the captured frames, their bands \n
+ * - SR_TASK_BACKGROUND can fall behind and drop: renditions, anything a late frame does not wait for
+ */
+typedef enum TP{
+    SR_TASK_REALTIME,
+    SR_TASK_BACKGROUND,
+    SR_TASK_LANES
+}SRTaskPriority;
+
+/**
+ * SRTaskPool runs tasks on one thread per core it is given.\n
+ * Every worker has its own deque per lane: a task submitted from a worker goes to the back of that worker's deque,
+ * one submitted from outside goes to the next deque in turn. A worker takes its newest task first and,
+ * when its deque is empty, steals the oldest task of the others, so the load spreads without a shared queue.
+ * A task must not block for long: a blocked worker is a core less for every session.\n
+ * The grab and audio threads are not tasks: they sleep on the capture clock and must wake on time,
+ * so they keep pinned threads of their own and the pool is sized to the cores they leave.
+ */
+class SRTaskPool {
+
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks[SR_TASK_LANES];
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex idleLock;
+    std::condition_variable wake;
+    std::atomic<int> queued;
+    std::atomic<unsigned int> nextWorker;
+    bool stopping;
+
+    void run(int index);
+    bool take(int index, std::function<void()> &task);
+
+public:
+    /**
+     * @param threads workers, 0 for one per core
+     * @param cores the workers are bound to, e.g. those of a NUMA node; empty leaves them to the scheduler
+     */
+    explicit SRTaskPool(int threads = 0, const std::vector<int> &cores = std::vector<int>());
+
+    /**
+     * ~SRTaskPool() runs what is still queued, then stops the workers
+     */
+    ~SRTaskPool();
+
+    SRTaskPool(const SRTaskPool&) = delete;
+    SRTaskPool &operator=(const SRTaskPool&) = delete;
+
+    /**
+     * submit() queues task
+     * @param yield from a worker, task goes to the front of its deque: the worker runs its other tasks first
+     */
+    void submit(std::function<void()> task, SRTaskPriority priority = SR_TASK_REALTIME, bool yield = false);
+
+    /**
+     * parallelFor() runs fn(0) .. fn(count - 1) on the pool and returns when they are all done.
+     * The caller runs the items nobody took yet, so it can be a task of the pool itself.
+     */
+    void parallelFor(int count, const std::function<void(int)> &fn, SRTaskPriority priority = SR_TASK_REALTIME);
+    int size() const { return (int) workers.size(); }
+};
+
+/**
+ * SRSerialTask runs step() on an SRTaskPool, never on two workers at the same time: the work of one stage
+ * of one session stays in order, as on a thread of its own.\n
+ * schedule() is cheap and can be called from any thread whenever new work may be ready. The task runs step()
+ * until it returns false or for TASK_QUANTUM steps; then it is queued again behind the other sessions,
+ * so a busy session cannot keep a worker to itself.
+ */
+class SRSerialTask {
+
+private:
+    SRTaskPool &pool;
+    std::function<bool()> step;
+    SRTaskPriority priority;
+    std::atomic<bool> scheduled;
+    std::atomic<bool> again;    //schedule() was called while the task was running
+    std::atomic<int> running;
+
+    void run();
+
+public:
+    /**
+     * @param step does one unit of work, false when there was nothing to do
+     */
+    SRSerialTask(SRTaskPool &pool, std::function<bool()> step, SRTaskPriority priority = SR_TASK_REALTIME);
+
+    /**
+     * ~SRSerialTask() waits for a run in progress: the owner stops calling schedule() first
+     */
+    ~SRSerialTask();
+
+    SRSerialTask(const SRSerialTask&) = delete;
+    SRSerialTask &operator=(const SRSerialTask&) = delete;
+
+    void schedule();
+};
+
+#endif //CPPSCREENRECORDER_SRTASKPOOL_H
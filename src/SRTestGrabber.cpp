@@ -0,0 +1,60 @@
+#include "SRTestGrabber.h"
+
+extern "C"
+{
+#include "libavutil/error.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/intreadwrite.h"
+}
+
+SRTestGrabber::SRTestGrabber(enum AVPixelFormat format): width(0), height(0), next(0), format(format) {}
+
+int SRTestGrabber::open(const char *device, int x, int y, int width, int height) {
+    (void) device; (void) x; (void) y;
+    bool deep = false;
+#ifdef AV_PIX_FMT_X2RGB10
+    deep = format == AV_PIX_FMT_X2RGB10LE;
+#endif
+    if (width <= 0 || height <= 0 || (format != AV_PIX_FMT_BGR0 && !deep))
+        return AVERROR(EINVAL);
+    this->width = width;
+    this->height = height;
+
+    patterns.assign(TEST_PATTERNS, std::vector<uint8_t>((size_t) width * height * 4));
+    int bar = width / 16 > 0 ? width / 16 : 1;
+    for (int p = 0; p < TEST_PATTERNS; p++) {
+        uint8_t *pixel = patterns[p].data();
+        int barStart = (int) ((int64_t) width * p / TEST_PATTERNS);
+        for (int row = 0; row < height; row++) {
+            for (int col = 0; col < width; col++, pixel += 4) {
+                bool inBar = col >= barStart && col < barStart + bar;
+                if (deep) {
+                    uint32_t b = inBar ? 1023 : (uint32_t) (col * 1023 / width);
+                    uint32_t g = inBar ? 1023 : (uint32_t) (row * 1023 / height);
+                    uint32_t r = inBar ? 1023 : (uint32_t) ((col + row + p * 128) & 0x3ff);
+                    AV_WL32(pixel, r << 20 | g << 10 | b);
+                    continue;
+                }
+                pixel[0] = inBar ? 255 : (uint8_t) (col * 255 / width);
+                pixel[1] = inBar ? 255 : (uint8_t) (row * 255 / height);
+                pixel[2] = inBar ? 255 : (uint8_t) ((col + row + p * 32) & 0xff);
+                pixel[3] = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+int SRTestGrabber::grab(AVFrame *frame) {
+    //frames coming from a pool already have their buffer
+    if (!frame->buf[0]) {
+        frame->format = pixelFormat();
+        frame->width = width;
+        frame->height = height;
+        int ret = av_frame_get_buffer(frame, 32);
+        if (ret < 0) return ret;
+    }
+    const std::vector<uint8_t> &pattern = patterns[next++ % TEST_PATTERNS];
+    av_image_copy_plane(frame->data[0], frame->linesize[0], pattern.data(), width * 4, width * 4, height);
+    return 0;
+}
@@ -0,0 +1,42 @@
+//
+// Synthetic screen grabber: memory-backed frames, no display needed.
+//
+
+#ifndef CPPSCREENRECORDER_SRTESTGRABBER_H
+#define CPPSCREENRECORDER_SRTESTGRABBER_H
+
+#include <cstdint>
+#include <vector>
+#include "SRVideoGrabber.h"
+
+#define TEST_PATTERNS 8     //distinct frames cycled by SRTestGrabber
+
+/**
+ * SRTestGrabber plays TEST_PATTERNS pre-rendered BGR0 frames in a loop: a gradient with a bar moving across it,
+ * so the encoder sees motion and settings._skipstatic never drops a frame; X2RGB10 frames stand in for
+ * a deep color desktop with the same pattern in 10 bits.\n
+ * grab() is one copy of the frame: the capture cost of a real display is left out, the rest of the pipeline
+ * runs on it as it does on a screen.
+ */
+class SRTestGrabber : public SRVideoGrabber {
+
+private:
+    std::vector<std::vector<uint8_t>> patterns;
+    int width, height;
+    unsigned int next;
+    enum AVPixelFormat format;
+
+public:
+    /**
+     * @param format AV_PIX_FMT_BGR0 or AV_PIX_FMT_X2RGB10LE
+     */
+    explicit SRTestGrabber(enum AVPixelFormat format = AV_PIX_FMT_BGR0);
+
+    int open(const char *device, int x, int y, int width, int height) override;
+    int grab(AVFrame *frame) override;
+
+    enum AVPixelFormat pixelFormat() const override { return format; }
+    const char *name() const override { return "testgrab"; }
+};
+
+#endif //CPPSCREENRECORDER_SRTESTGRABBER_H
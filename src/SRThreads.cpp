@@ -0,0 +1,176 @@
+//
+// Core detection and thread placement for the capture pipeline.
+//
+
+#include "SRThreads.h"
+
+#include <cstdlib>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#include <avrt.h>
+#endif
+
+#ifdef __APPLE__
+#include <pthread.h>
+#endif
+
+int cpuCount() {
+    unsigned int n = std::thread::hardware_concurrency();
+    return n ? (int) n : 1;
+}
+
+bool pinThread(std::thread &t, int core) {
+    core %= cpuCount();
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    return pthread_setaffinity_np(t.native_handle(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    return SetThreadAffinityMask((HANDLE) t.native_handle(), (DWORD_PTR) 1 << core) != 0;
+#else
+    (void) t;
+    return false;
+#endif
+}
+
+#ifdef __linux__
+static bool setAffinity(pthread_t t, const std::vector<int> &cores) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; cores.empty() && i < cpuCount(); i++)
+        CPU_SET(i, &set);
+    for (int core : cores)
+        CPU_SET(core % cpuCount(), &set);
+    return pthread_setaffinity_np(t, sizeof(set), &set) == 0;
+}
+#elif defined(_WIN32)
+static bool setAffinity(HANDLE t, const std::vector<int> &cores) {
+    DWORD_PTR mask = 0, system = 0, process = 0;
+    for (int core : cores)
+        mask |= (DWORD_PTR) 1 << (core % cpuCount());
+    if (cores.empty() && GetProcessAffinityMask(GetCurrentProcess(), &process, &system))
+        mask = process;
+    return mask && SetThreadAffinityMask(t, mask) != 0;
+}
+#endif
+
+bool pinThread(std::thread &t, const std::vector<int> &cores) {
+#ifdef __linux__
+    return setAffinity(t.native_handle(), cores);
+#elif defined(_WIN32)
+    return setAffinity((HANDLE) t.native_handle(), cores);
+#else
+    (void) t;
+    (void) cores;
+    return false;
+#endif
+}
+
+bool pinCurrentThread(const std::vector<int> &cores) {
+#ifdef __linux__
+    return setAffinity(pthread_self(), cores);
+#elif defined(_WIN32)
+    return setAffinity(GetCurrentThread(), cores);
+#else
+    (void) cores;
+    return false;
+#endif
+}
+
+std::vector<int> parseCores(const char *spec) {
+    std::vector<int> cores;
+    while (spec && *spec) {
+        char *end;
+        long first = strtol(spec, &end, 10), last = first;
+        if (end == spec)
+            break;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (long core = first; core <= last; core++)
+            if (core >= 0 && core < cpuCount())
+                cores.push_back((int) core);
+        spec = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',')
+            break;
+    }
+    return cores;
+}
+
+#ifdef _WIN32
+/**
+ * MmcssTask leaves the MMCSS task when its thread ends
+ */
+struct MmcssTask {
+    HANDLE handle = nullptr;
+    ~MmcssTask() {
+        if (handle)
+            AvRevertMmThreadCharacteristics(handle);
+    }
+};
+#endif
+
+bool realtimeThread(SRRealtimePolicy policy, int priority) {
+    if (policy == SR_REALTIME_OFF)
+        return true;
+#ifdef __linux__
+    struct sched_param param = {};
+    param.sched_priority = priority;
+    return pthread_setschedparam(pthread_self(), policy == SR_REALTIME_RR ? SCHED_RR : SCHED_FIFO, &param) == 0;
+#elif defined(_WIN32)
+    //MMCSS boosts the thread for the periods it is scheduled, and takes the boost back when it hogs the core
+    (void) priority;
+    static thread_local MmcssTask task;
+    DWORD index = 0;
+    if (!task.handle)
+        task.handle = AvSetMmThreadCharacteristicsW(L"Capture", &index);
+    return task.handle != nullptr;
+#elif defined(__APPLE__)
+    (void) priority;
+    return pthread_set_qos_class_self_np(QOS_CLASS_USER_INTERACTIVE, 0) == 0;
+#else
+    (void) priority;
+    return false;
+#endif
+}
+
+bool idleThread() {
+#ifdef __linux__
+    //per thread on Linux: the rest of the process keeps its priority
+    struct sched_param param = {};
+    return pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) == 0;
+#elif defined(_WIN32)
+    return SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN) != 0;
+#elif defined(__APPLE__)
+    return pthread_set_qos_class_self_np(QOS_CLASS_BACKGROUND, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+bool efficientThread(int64_t slackUs) {
+#ifdef __linux__
+    //per thread as well, the default is 50 us
+    return prctl(PR_SET_TIMERSLACK, (unsigned long) (slackUs > 0 ? slackUs * 1000 : 1), 0, 0, 0) == 0;
+#elif defined(_WIN32) && defined(THREAD_POWER_THROTTLING_CURRENT_VERSION)
+    (void) slackUs;
+    THREAD_POWER_THROTTLING_STATE state = {};
+    state.Version = THREAD_POWER_THROTTLING_CURRENT_VERSION;
+    state.ControlMask = THREAD_POWER_THROTTLING_EXECUTION_SPEED;
+    state.StateMask = THREAD_POWER_THROTTLING_EXECUTION_SPEED;
+    return SetThreadInformation(GetCurrentThread(), ThreadPowerThrottling, &state, sizeof(state)) != 0;
+#elif defined(__APPLE__)
+    (void) slackUs;
+    return pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0) == 0;
+#else
+    (void) slackUs;
+    return false;
+#endif
+}
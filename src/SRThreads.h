@@ -0,0 +1,82 @@
+//
+// Core detection and thread placement for the capture pipeline.
+//
+
+#ifndef CPPSCREENRECORDER_SRTHREADS_H
+#define CPPSCREENRECORDER_SRTHREADS_H
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#define REALTIME_PRIORITY 10    //linux SCHED_FIFO/SCHED_RR priority of the capture threads, under the kernel IRQ threads (50)
+
+/**
+ * Scheduling of the grab and audio threads, which sleep on the capture clock and must wake on time.\n
+ * - SR_REALTIME_OFF leaves them to the normal scheduler \n
+ * - SR_REALTIME_FIFO runs them before any normal thread: SCHED_FIFO on Linux \n
+ * - SR_REALTIME_RR the same, but threads of equal priority share the core: SCHED_RR on Linux \n
+ * Windows registers both in the MMCSS "Capture" task, macOS moves them to the user-interactive QoS class.
+ *
+ * @Note Linux needs CAP_SYS_NICE or an RLIMIT_RTPRIO of at least the priority, the threads keep running normally otherwise
+ */
+typedef enum RT{
+    SR_REALTIME_OFF,
+    SR_REALTIME_FIFO,
+    SR_REALTIME_RR
+}SRRealtimePolicy;
+
+/**
+ * cpuCount() returns the number of logical cores, at least 1
+ */
+int cpuCount();
+
+/**
+ * pinThread() binds a thread to a logical core.\n
+ * Core indexes wrap around the available cores.
+ *
+ * @return false if the platform does not support it (macOS only takes affinity hints) or the call fails
+ */
+bool pinThread(std::thread &t, int core);
+
+/**
+ * pinThread() binds a thread to a set of logical cores, all of them when cores is empty
+ */
+bool pinThread(std::thread &t, const std::vector<int> &cores);
+
+/**
+ * pinCurrentThread() binds the calling thread to a set of logical cores, all of them when cores is empty.\n
+ * On Linux the threads it creates afterwards inherit the set, on Windows they get the process mask.
+ */
+bool pinCurrentThread(const std::vector<int> &cores);
+
+/**
+ * parseCores() reads a core list such as "0,1" or "0-3,6", the cores out of range are left out
+ */
+std::vector<int> parseCores(const char *spec);
+
+/**
+ * realtimeThread() moves the calling thread to the real-time class of policy, see SRRealtimePolicy
+ * @param priority Linux only, 1 to 99
+ * @return false if the call fails, true with SR_REALTIME_OFF
+ */
+bool realtimeThread(SRRealtimePolicy policy, int priority = REALTIME_PRIORITY);
+
+/**
+ * idleThread() moves the calling thread to the background class of the scheduler:
+ * it only runs, and only does I/O where the platform allows it, on what the other threads leave idle
+ *
+ * @return false if the call fails
+ */
+bool idleThread();
+
+/**
+ * efficientThread() trades the latency of the calling thread for energy: Linux lets the kernel defer its timer
+ * wake-ups by slackUs to batch them with others, windows asks for EcoQoS (efficiency cores of the hybrid CPUs,
+ * lower clocks), macOS moves it to the utility QoS class, which prefers the efficiency cores too
+ *
+ * @return false if the call fails
+ */
+bool efficientThread(int64_t slackUs);
+
+#endif //CPPSCREENRECORDER_SRTHREADS_H
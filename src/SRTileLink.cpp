@@ -0,0 +1,365 @@
+#include "SRTileLink.h"
+#include "SRLog.h"
+
+#include <cstring>
+
+extern "C"
+{
+#include "libavutil/imgutils.h"
+#include "libavutil/mem.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/time.h"
+}
+
+#define TILE_LINK_MAX_SIDE 16384    //pixels of a screen a header may announce
+#define TILE_LINK_MAX_PACKET (1 << 24)  //bytes of a strip packet, far above what the codec makes of one
+
+/* the strips are RGB32 pictures of the codec, any packed format of 4 bytes a pixel goes through unchanged */
+static bool packable(enum AVPixelFormat format) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    return desc && !(desc->flags & (AV_PIX_FMT_FLAG_PLANAR | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)) &&
+           desc->nb_components && desc->comp[0].step == 4;
+}
+
+static AVFrame *allocStrip(int tileSize) {
+    AVFrame *strip = av_frame_alloc();
+    if (!strip)
+        return nullptr;
+    strip->format = AV_PIX_FMT_RGB32;
+    strip->width = TILE_LINK_STRIP * tileSize;
+    strip->height = tileSize;
+    if (av_frame_get_buffer(strip, 32) < 0)
+        av_frame_free(&strip);
+    return strip;
+}
+
+SRTileSender::SRTileSender(const char *url): url(url), io(nullptr), packer(nullptr), strip(nullptr), packet(nullptr),
+                                             format(AV_PIX_FMT_NONE), width(0), height(0), packed(0), counters() {}
+
+SRTileSender::~SRTileSender() {
+    close();
+    avcodec_free_context(&packer);
+    av_frame_free(&strip);
+    av_packet_free(&packet);
+}
+
+int SRTileSender::open(enum AVPixelFormat format, int width, int height) {
+    if (!packable(format) || width <= 0 || height <= 0) {
+        srLog(SR_LOG_ERROR, "[SRTileSender] the tiles of %s frames cannot be packed", av_get_pix_fmt_name(format));
+        return AVERROR(EINVAL);
+    }
+    this->format = format;
+    this->width = width;
+    this->height = height;
+    if (!packer) {
+        const AVCodec *codec = avcodec_find_encoder_by_name(TILE_LINK_CODEC);
+        if (!codec)
+            return AVERROR_ENCODER_NOT_FOUND;
+        if (!(packer = avcodec_alloc_context3(codec)) || !(strip = allocStrip(SR_TILE_SIZE)) || !(packet = av_packet_alloc()))
+            return AVERROR(ENOMEM);
+        packer->width = strip->width;
+        packer->height = strip->height;
+        packer->pix_fmt = AV_PIX_FMT_RGB32;
+        packer->time_base = {1, 1000000};
+        //a strip is small: a second thread costs more than it saves
+        packer->thread_count = 1;
+        int ret = avcodec_open2(packer, codec, nullptr);
+        if (ret < 0) {
+            avcodec_free_context(&packer);
+            return ret;
+        }
+    }
+
+    int ret = avio_open2(&io, url.c_str(), AVIO_FLAG_WRITE, nullptr, nullptr);
+    if (ret < 0)
+        return ret;
+    //the node has nothing yet: the first frame sends every tile
+    hasher.reset();
+    const char *name = av_get_pix_fmt_name(format);
+    avio_wl32(io, TILE_LINK_MAGIC);
+    avio_wl32(io, TILE_LINK_VERSION);
+    avio_wl32(io, (unsigned int) strlen(name));
+    avio_write(io, (const unsigned char *) name, (int) strlen(name));
+    avio_wl32(io, (unsigned int) width);
+    avio_wl32(io, (unsigned int) height);
+    avio_wl32(io, SR_TILE_SIZE);
+    avio_wl32(io, TILE_LINK_STRIP);
+    avio_wl32(io, (unsigned int) packer->extradata_size);
+    avio_write(io, packer->extradata, packer->extradata_size);
+    avio_flush(io);
+    if (io->error < 0) {
+        ret = io->error;
+        close();
+        return ret;
+    }
+    counters.connections++;
+    srLog(SR_LOG_INFO, "[SRTileSender] sending %dx%d %s to %s", width, height, name, url.c_str());
+    return 0;
+}
+
+void SRTileSender::close() {
+    avio_closep(&io);
+}
+
+/**
+ * writeStrip() packs count tiles of frame, TILE_LINK_STRIP at most, into the strip picture and writes its packet.
+ * The tiles cut by the right and bottom edges keep what the strip had there, the node reads their inside only.
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int SRTileSender::writeStrip(const AVFrame *frame, const int *tiles, int count) {
+    int ret = av_frame_make_writable(strip);
+    if (ret < 0)
+        return ret;
+    int cols = (width + SR_TILE_SIZE - 1) / SR_TILE_SIZE;
+    for (int i = 0; i < TILE_LINK_STRIP; i++) {
+        uint8_t *dst = strip->data[0] + i * SR_TILE_SIZE * 4;
+        if (i >= count) {
+            //blank slots of the last strip: the cheapest picture for the codec
+            for (int row = 0; row < SR_TILE_SIZE; row++)
+                memset(dst + row * strip->linesize[0], 0, SR_TILE_SIZE * 4);
+            continue;
+        }
+        int x = tiles[i] % cols * SR_TILE_SIZE, y = tiles[i] / cols * SR_TILE_SIZE;
+        av_image_copy_plane(dst, strip->linesize[0], frame->data[0] + (size_t) y * frame->linesize[0] + x * 4,
+                            frame->linesize[0], FFMIN(SR_TILE_SIZE, width - x) * 4, FFMIN(SR_TILE_SIZE, height - y));
+    }
+    strip->pts = packed++;
+    if ((ret = avcodec_send_frame(packer, strip)) < 0 || (ret = avcodec_receive_packet(packer, packet)) < 0)
+        return ret;
+    avio_wl32(io, (unsigned int) packet->size);
+    avio_write(io, packet->data, packet->size);
+    counters.bytes += 4 + packet->size;
+    av_packet_unref(packet);
+    return 0;
+}
+
+int SRTileSender::send(const AVFrame *frame) {
+    if (!io)
+        return AVERROR(ENOTCONN);
+    if (frame->format != format || frame->width != width || frame->height != height)
+        return AVERROR(EINVAL);
+    if (!hasher.update(frame->data[0], frame->linesize[0], width, height, 4)) {
+        counters.unchanged++;
+        return 0;
+    }
+    const std::vector<int> &tiles = hasher.changedTiles();
+    int count = (int) tiles.size();
+    avio_wl64(io, (uint64_t) frame->pts);
+    avio_wl32(io, (unsigned int) count);
+    for (int tile : tiles)
+        avio_wl32(io, (unsigned int) tile);
+    counters.bytes += 12 + 4 * (int64_t) count;
+    int ret = 0;
+    for (int i = 0; i < count && ret >= 0; i += TILE_LINK_STRIP)
+        ret = writeStrip(frame, tiles.data() + i, FFMIN(TILE_LINK_STRIP, count - i));
+    avio_flush(io);
+    if (ret >= 0 && io->error < 0)
+        ret = io->error;
+    if (ret < 0) {
+        srLog(SR_LOG_ERROR, "[SRTileSender] connection to %s lost %d", url.c_str(), ret);
+        close();
+        return ret;
+    }
+    counters.updates++;
+    counters.tiles += count;
+    return 0;
+}
+
+SRTileGrabber::SRTileGrabber(const char *url): url(url), io(nullptr), unpacker(nullptr), strip(nullptr), packet(nullptr),
+                                               format(AV_PIX_FMT_NONE), width(0), height(0), tileSize(0), dirty(true),
+                                               stopping(false), counters() {}
+
+SRTileGrabber::~SRTileGrabber() {
+    stopping = true;
+    if (receiver.joinable())
+        receiver.join();
+    avio_closep(&io);
+    avcodec_free_context(&unpacker);
+    av_frame_free(&strip);
+    av_packet_free(&packet);
+}
+
+int SRTileGrabber::interrupted(void *opaque) {
+    return ((SRTileGrabber *) opaque)->stopping;
+}
+
+/**
+ * accept() waits for a client on the url, nothing but the destructor interrupts it
+ */
+int SRTileGrabber::accept() {
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "listen", "1", 0);
+    AVIOInterruptCB callback = {interrupted, this};
+    int ret = avio_open2(&io, url.c_str(), AVIO_FLAG_READ, &callback, &options);
+    av_dict_free(&options);
+    return ret;
+}
+
+/**
+ * readHeader() reads the header of the client and opens the decoder of its strips. The first client sets the
+ * geometry, the next ones must have the same.
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int SRTileGrabber::readHeader() {
+    if (avio_rl32(io) != TILE_LINK_MAGIC || avio_rl32(io) != TILE_LINK_VERSION)
+        return AVERROR_INVALIDDATA;
+    char name[64];
+    unsigned int length = avio_rl32(io);
+    if (!length || length >= sizeof(name) || avio_read(io, (unsigned char *) name, (int) length) != (int) length)
+        return AVERROR_INVALIDDATA;
+    name[length] = 0;
+    enum AVPixelFormat f = av_get_pix_fmt(name);
+    int w = (int) avio_rl32(io), h = (int) avio_rl32(io), tile = (int) avio_rl32(io), tiles = (int) avio_rl32(io);
+    int extra = (int) avio_rl32(io);
+    if (avio_feof(io) || !packable(f) || w <= 0 || h <= 0 || w > TILE_LINK_MAX_SIDE || h > TILE_LINK_MAX_SIDE ||
+        tile <= 0 || tile > 256 || tiles != TILE_LINK_STRIP || extra < 0 || extra > TILE_LINK_MAX_PACKET)
+        return AVERROR_INVALIDDATA;
+    if (width && (w != width || h != height || f != format || tile != tileSize)) {
+        srLog(SR_LOG_WARNING, "[SRTileGrabber] a client with a %dx%d %s screen cannot take the place of the %dx%d one",
+              w, h, name, width, height);
+        return AVERROR(EINVAL);
+    }
+
+    const AVCodec *codec = avcodec_find_decoder_by_name(TILE_LINK_CODEC);
+    if (!codec)
+        return AVERROR_DECODER_NOT_FOUND;
+    avcodec_free_context(&unpacker);
+    if (!(unpacker = avcodec_alloc_context3(codec)))
+        return AVERROR(ENOMEM);
+    unpacker->width = TILE_LINK_STRIP * tile;
+    unpacker->height = tile;
+    unpacker->thread_count = 1;
+    if (extra > 0) {
+        if (!(unpacker->extradata = (uint8_t *) av_mallocz(extra + AV_INPUT_BUFFER_PADDING_SIZE)))
+            return AVERROR(ENOMEM);
+        unpacker->extradata_size = extra;
+        if (avio_read(io, unpacker->extradata, extra) != extra)
+            return AVERROR_INVALIDDATA;
+    }
+    int ret = avcodec_open2(unpacker, codec, nullptr);
+    if (ret < 0)
+        return ret;
+    if ((!strip && !(strip = av_frame_alloc())) || (!packet && !(packet = av_packet_alloc())))
+        return AVERROR(ENOMEM);
+    format = f;
+    width = w;
+    height = h;
+    tileSize = tile;
+    counters.connections++;
+    return 0;
+}
+
+int SRTileGrabber::listen() {
+    int ret = accept();
+    if (ret >= 0 && (ret = readHeader()) < 0)
+        avio_closep(&io);
+    if (ret >= 0)
+        srLog(SR_LOG_INFO, "[SRTileGrabber] tile client connected, %dx%d %s", width, height, av_get_pix_fmt_name(format));
+    return ret;
+}
+
+int SRTileGrabber::open(const char *device, int x, int y, int width, int height) {
+    (void) device; (void) x; (void) y;
+    if (!io || width != this->width || height != this->height)
+        return AVERROR(EINVAL);
+    canvas.assign((size_t) width * height * 4, 0);
+    receiver = std::thread(&SRTileGrabber::receive, this);
+    return 0;
+}
+
+/**
+ * readUpdate() reads the next update of the client: the indices of its tiles and the packets of its strips
+ * @return 0 on success, a negative AVERROR once the client is gone or sent something else
+ */
+int SRTileGrabber::readUpdate(std::vector<uint32_t> &tiles, std::vector<std::vector<uint8_t>> &strips) {
+    int cols = (width + tileSize - 1) / tileSize, rows = (height + tileSize - 1) / tileSize;
+    avio_rl64(io);
+    uint32_t count = avio_rl32(io);
+    if (avio_feof(io))
+        return io->error < 0 ? io->error : AVERROR_EOF;
+    if (!count || count > (uint32_t) (cols * rows))
+        return AVERROR_INVALIDDATA;
+    tiles.resize(count);
+    for (uint32_t &tile : tiles)
+        if ((tile = avio_rl32(io)) >= (uint32_t) (cols * rows))
+            return AVERROR_INVALIDDATA;
+    strips.resize((count + TILE_LINK_STRIP - 1) / TILE_LINK_STRIP);
+    for (std::vector<uint8_t> &data : strips) {
+        uint32_t size = avio_rl32(io);
+        if (!size || size > TILE_LINK_MAX_PACKET)
+            return avio_feof(io) ? AVERROR_EOF : AVERROR_INVALIDDATA;
+        //the padding of the decoders stays zeroed
+        data.assign(size + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+        if (avio_read(io, data.data(), (int) size) != (int) size)
+            return AVERROR_EOF;
+        data.resize(size);
+        counters.bytes += 4 + size;
+    }
+    counters.bytes += 12 + 4 * (int64_t) count;
+    return 0;
+}
+
+/**
+ * receive() is the receiver thread: the updates are read off the network first, then decoded into the canvas
+ * under the lock, so that grab() never copies half of one
+ */
+void SRTileGrabber::receive() {
+    std::vector<uint32_t> tiles;
+    std::vector<std::vector<uint8_t>> strips;
+    int cols = (width + tileSize - 1) / tileSize, stride = width * 4;
+    while (!stopping) {
+        int ret = readUpdate(tiles, strips);
+        for (size_t s = 0; ret >= 0 && s < strips.size(); s++) {
+            packet->data = strips[s].data();
+            packet->size = (int) strips[s].size();
+            std::lock_guard<std::mutex> guard(lock);
+            if ((ret = avcodec_send_packet(unpacker, packet)) < 0 || (ret = avcodec_receive_frame(unpacker, strip)) < 0)
+                break;
+            for (size_t i = s * TILE_LINK_STRIP; i < tiles.size() && i < (s + 1) * TILE_LINK_STRIP; i++) {
+                int x = (int) (tiles[i] % cols) * tileSize, y = (int) (tiles[i] / cols) * tileSize;
+                av_image_copy_plane(canvas.data() + (size_t) y * stride + x * 4, stride,
+                                    strip->data[0] + (i % TILE_LINK_STRIP) * tileSize * 4, strip->linesize[0],
+                                    FFMIN(tileSize, width - x) * 4, FFMIN(tileSize, height - y));
+            }
+            av_frame_unref(strip);
+            dirty = true;
+        }
+        if (ret >= 0) {
+            counters.updates++;
+            counters.tiles += tiles.size();
+            continue;
+        }
+        if (stopping)
+            break;
+        srLog(SR_LOG_WARNING, "[SRTileGrabber] tile client gone %d after %llu updates (%lld KiB), listening again", ret,
+              (unsigned long long) counters.updates, (long long) (counters.bytes / 1024));
+        avio_closep(&io);
+        //the canvas keeps the last picture until the next client sends all its tiles
+        while (!stopping) {
+            if (accept() >= 0 && readHeader() >= 0) {
+                srLog(SR_LOG_INFO, "[SRTileGrabber] tile client connected again");
+                break;
+            }
+            avio_closep(&io);
+            av_usleep(100000);
+        }
+    }
+}
+
+int SRTileGrabber::grab(AVFrame *frame) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!dirty)
+        return SR_GRAB_UNCHANGED;
+    //frames coming from a pool already have their buffer
+    if (!frame->buf[0]) {
+        frame->format = format;
+        frame->width = width;
+        frame->height = height;
+        int ret = av_frame_get_buffer(frame, 32);
+        if (ret < 0)
+            return ret;
+    }
+    av_image_copy_plane(frame->data[0], frame->linesize[0], canvas.data(), width * 4, width * 4, height);
+    dirty = false;
+    return 0;
+}
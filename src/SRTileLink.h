@@ -0,0 +1,160 @@
+//
+// Split capture and encode: a thin client sends the changed tiles of the screen, the encode node rebuilds the frames.
+//
+
+#ifndef CPPSCREENRECORDER_SRTILELINK_H
+#define CPPSCREENRECORDER_SRTILELINK_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SRFrameHash.h"
+#include "SRVideoGrabber.h"
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+#define TILE_LINK_MAGIC 0x4c545253  //"SRTL" at the head of the stream
+#define TILE_LINK_VERSION 1
+#define TILE_LINK_CODEC "ffvhuff"   //lossless intra codec the tiles are packed with
+#define TILE_LINK_STRIP 16  //tiles packed side by side into one picture of the codec
+#define TILE_LINK_RECONNECT 1000    //ms between two connection attempts of the client
+
+/**
+ * Statistics of one end of a tile link: the frames sent or received with a change, the tiles they carried
+ * and the bytes on the wire.
+ */
+typedef struct TL{
+    uint64_t updates;
+    uint64_t unchanged;     //frames the client had nothing to send for
+    uint64_t tiles;
+    int64_t bytes;
+    uint64_t connections;
+}SRTileLinkStats;
+
+/**
+ * SRTileSender is the client end of a tile link: it hashes each captured frame in SR_TILE_SIZE tiles, as
+ * settings._skipstatic does, and sends only the tiles that changed since the previous frame it sent, packed
+ * TILE_LINK_STRIP at a time into pictures of the lossless TILE_LINK_CODEC. A static screen sends nothing, a
+ * typing cursor a strip. No scaling, conversion nor encoding happens on the client.\n
+ * The stream is the header (magic, version, name of the pixel format, width, height, tile size, strip tiles, extradata
+ * of the codec) followed by one update per changed frame: its pts, the number of tiles, their indices row major
+ * and the packets of the strips, each after its size; integers are little-endian.
+ * send() writes synchronously: a slow link slows the client down to what it carries, and after a frame left out
+ * the next one is still compared with what the node has.
+ *
+ * @Note packed formats of 4 bytes per pixel in system memory only, BGR0 as the X11 and GDI captures give
+ */
+class SRTileSender {
+
+private:
+    std::string url;
+    AVIOContext *io;
+    AVCodecContext *packer;
+    AVFrame *strip;
+    AVPacket *packet;
+    SRTileHasher hasher;
+    enum AVPixelFormat format;
+    int width, height;
+    int64_t packed;     //strips so far, the pts of the next one
+    SRTileLinkStats counters;
+
+    int writeStrip(const AVFrame *frame, const int *tiles, int count);
+
+public:
+    explicit SRTileSender(const char *url);
+    ~SRTileSender();
+
+    SRTileSender(const SRTileSender&) = delete;
+    SRTileSender &operator=(const SRTileSender&) = delete;
+
+    /**
+     * open() connects to the encode node and sends the header, again after close()
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int open(enum AVPixelFormat format, int width, int height);
+
+    /**
+     * send() sends what changed in frame since the previous frame sent
+     * @return 0 on success, a negative AVERROR once the link is lost
+     */
+    int send(const AVFrame *frame);
+
+    /**
+     * close() ends the connection, the next open() starts with every tile
+     */
+    void close();
+
+    SRTileLinkStats stats() const { return counters; }
+};
+
+/**
+ * SRTileGrabber is the encode node end of a tile link, a capture back-end for the recorder: its screen is the one
+ * of the client, rebuilt from the tiles it sends. The receiver thread decodes each update into a canvas, grab()
+ * copies the canvas into the frame and returns SR_GRAB_UNCHANGED when no update came since the previous grab,
+ * so the pipeline of the node runs from there as on a local display, on its own frame clock.\n
+ * The client that goes away leaves the last picture on the canvas: the node listens again and takes the next
+ * client with the same geometry, which starts with all its tiles.
+ */
+class SRTileGrabber : public SRVideoGrabber {
+
+private:
+    std::string url;
+    AVIOContext *io;    //receiver thread once started
+    AVCodecContext *unpacker;
+    AVFrame *strip;
+    AVPacket *packet;
+    enum AVPixelFormat format;
+    int width, height;
+    int tileSize;
+
+    std::mutex lock;
+    std::vector<uint8_t> canvas;    //width * 4 bytes a row
+    bool dirty;
+    std::thread receiver;
+    std::atomic<bool> stopping;
+    SRTileLinkStats counters;   //receiver thread
+
+    int accept();
+    int readHeader();
+    int readUpdate(std::vector<uint32_t> &tiles, std::vector<std::vector<uint8_t>> &strips);
+    void receive();
+    static int interrupted(void *opaque);
+
+public:
+    /**
+     * @param url tcp://address:port the node listens on
+     */
+    explicit SRTileGrabber(const char *url);
+    ~SRTileGrabber() override;
+
+    SRTileGrabber(const SRTileGrabber&) = delete;
+    SRTileGrabber &operator=(const SRTileGrabber&) = delete;
+
+    /**
+     * listen() waits for the first client and reads its header: frameWidth(), frameHeight() and pixelFormat() are its own
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int listen();
+
+    /**
+     * open() starts the receiver, the region must be the screen of the client: device and offset are left out
+     */
+    int open(const char *device, int x, int y, int width, int height) override;
+    int grab(AVFrame *frame) override;
+
+    enum AVPixelFormat pixelFormat() const override { return format; }
+    const char *name() const override { return "tilelink"; }
+    int64_t reservedBytes() const override { return (int64_t) width * height * 4; }
+
+    int frameWidth() const { return width; }
+    int frameHeight() const { return height; }
+};
+
+#endif //CPPSCREENRECORDER_SRTILELINK_H
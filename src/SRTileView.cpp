@@ -0,0 +1,471 @@
+#include "SRTileView.h"
+#include "SRLog.h"
+
+#include <cstring>
+
+extern "C"
+{
+#include "libavutil/avstring.h"
+#include "libavutil/base64.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/mem.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/sha.h"
+#include "libavutil/time.h"
+}
+
+#define TILE_VIEW_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"  //RFC 6455 key suffix of the accept hash
+
+//the connections share the interrupt callback of the server: the deadline belongs to the thread waiting, the listener
+static thread_local int64_t ioDeadline = 0;
+
+/* the canvas of a viewer: it redraws the tiles of each update, several strips decoded at once */
+static const char viewerPage[] = R"(<!DOCTYPE html>
+<html><head><meta charset="utf-8"><title>screen</title>
+<style>html,body{margin:0;height:100%;background:#202020}canvas{display:block;margin:auto;max-width:100%;max-height:100%}</style>
+</head><body><canvas id="screen"></canvas><script>
+const canvas = document.getElementById('screen'), context = canvas.getContext('2d');
+let tile = 64, strip = 16, cols = 1, drawn = Promise.resolve();
+async function update(data) {
+    const view = new DataView(data);
+    if (view.getUint32(0, true) == 1) {
+        canvas.width = view.getUint32(8, true);
+        canvas.height = view.getUint32(12, true);
+        tile = view.getUint32(16, true);
+        strip = view.getUint32(20, true);
+        cols = Math.ceil(canvas.width / tile);
+        return;
+    }
+    const count = view.getUint32(12, true), pictures = [];
+    for (let at = 16 + 4 * count, s = 0; s * strip < count; s++) {
+        const size = view.getUint32(at, true);
+        pictures.push(createImageBitmap(new Blob([new Uint8Array(data, at + 4, size)], {type: 'image/png'})));
+        at += 4 + size;
+    }
+    const images = await Promise.all(pictures);
+    for (let i = 0; i < count; i++) {
+        const t = view.getUint32(16 + 4 * i, true), x = t % cols * tile, y = Math.floor(t / cols) * tile;
+        const w = Math.min(tile, canvas.width - x), h = Math.min(tile, canvas.height - y);
+        context.drawImage(images[Math.floor(i / strip)], i % strip * tile, 0, w, h, x, y, w, h);
+    }
+    images.forEach(image => image.close());
+}
+function connect() {
+    const socket = new WebSocket((location.protocol == 'https:' ? 'wss://' : 'ws://') + location.host + location.pathname);
+    socket.binaryType = 'arraybuffer';
+    socket.onmessage = event => { const data = event.data; drawn = drawn.then(() => update(data)); };
+    socket.onclose = () => setTimeout(connect, 1000);
+}
+connect();
+</script></body></html>
+)";
+
+static void put32(std::vector<uint8_t> &out, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        out.push_back((uint8_t) (v >> (8 * i)));
+}
+
+static void put64(std::vector<uint8_t> &out, uint64_t v) {
+    put32(out, (uint32_t) v);
+    put32(out, (uint32_t) (v >> 32));
+}
+
+/* Sec-WebSocket-Accept of key: the base64 SHA-1 of key and the GUID */
+static std::string acceptKey(const std::string &key) {
+    std::string text = key + TILE_VIEW_GUID;
+    uint8_t digest[20];
+    struct AVSHA *sha = av_sha_alloc();
+    if (!sha)
+        return "";
+    av_sha_init(sha, 160);
+    av_sha_update(sha, (const uint8_t *) text.data(), (unsigned int) text.size());
+    av_sha_final(sha, digest);
+    av_free(sha);
+    char encoded[AV_BASE64_SIZE(sizeof(digest))];
+    return av_base64_encode(encoded, sizeof(encoded), digest, sizeof(digest)) ? encoded : "";
+}
+
+static void writeText(AVIOContext *io, const std::string &text) {
+    avio_write(io, (const unsigned char *) text.data(), (int) text.size());
+    avio_flush(io);
+}
+
+SRTileView::SRTileView(): server(nullptr), stopping(false), watching(0), pending(nullptr), replaced(0), current(nullptr),
+                          packer(nullptr), strip(nullptr), packet(nullptr), format(AV_PIX_FMT_NONE), width(0),
+                          height(0), offsets(), packed(0), counters() {}
+
+SRTileView::~SRTileView() {
+    close();
+    avcodec_free_context(&packer);
+    av_frame_free(&strip);
+    av_packet_free(&packet);
+    av_frame_free(&pending);
+    av_frame_free(&current);
+}
+
+int SRTileView::interrupted(void *opaque) {
+    return ((SRTileView *) opaque)->stopping || (ioDeadline && av_gettime_relative() > ioDeadline);
+}
+
+int SRTileView::open(const char *url) {
+    this->url = url;
+    if ((!pending && !(pending = av_frame_alloc())) || (!current && !(current = av_frame_alloc())))
+        return AVERROR(ENOMEM);
+    //listen 2: one server socket, each viewer accepted on a connection of its own
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "listen", "2", 0);
+    AVIOInterruptCB callback = {interrupted, this};
+    stopping = false;
+    int ret = avio_open2(&server, url, AVIO_FLAG_READ_WRITE, &callback, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        srLog(SR_LOG_ERROR, "[SRTileView] cannot listen on %s: %d", url, ret);
+        return ret;
+    }
+    listener = std::thread(&SRTileView::listen, this);
+    sender = std::thread(&SRTileView::run, this);
+    return 0;
+}
+
+void SRTileView::close() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    //the interrupt callback ends the accept and the writes the threads wait in
+    if (listener.joinable())
+        listener.join();
+    if (sender.joinable())
+        sender.join();
+    for (Viewer &viewer : joining)
+        avio_closep(&viewer.io);
+    joining.clear();
+    for (Viewer &viewer : viewers)
+        avio_closep(&viewer.io);
+    viewers.clear();
+    watching = 0;
+    avio_closep(&server);
+}
+
+void SRTileView::push(const AVFrame *frame) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        //the last frame is kept without viewers too: the first one to come sees the screen at once
+        if (pending->buf[0] && watching.load(std::memory_order_relaxed))
+            replaced++;
+        av_frame_unref(pending);
+        if (av_frame_ref(pending, frame) < 0)
+            return;
+    }
+    wake.notify_one();
+}
+
+/**
+ * listen() is the listener thread: each connection is a GET of the page or of the WebSocket
+ */
+void SRTileView::listen() {
+    while (!stopping) {
+        AVIOContext *client = nullptr;
+        int ret = avio_accept(server, &client);
+        if (ret < 0) {
+            if (!stopping) {
+                srLog(SR_LOG_WARNING, "[SRTileView] accept on %s failed: %d", url.c_str(), ret);
+                av_usleep(100000);
+            }
+            continue;
+        }
+        //a client that connects and sends nothing must not keep the others out
+        ioDeadline = av_gettime_relative() + (int64_t) TILE_VIEW_HANDSHAKE * 1000;
+        while ((ret = avio_handshake(client)) > 0);
+        if (ret >= 0)
+            ret = handshake(client);
+        ioDeadline = 0;
+        if (ret <= 0) {
+            avio_closep(&client);
+            continue;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        joining.push_back({client, true});
+        wake.notify_one();
+    }
+}
+
+/**
+ * handshake() reads the HTTP request of a connection and answers it: the page, the upgrade to a WebSocket, or a
+ * refusal once TILE_VIEW_VIEWERS watch
+ * @return 1 for a viewer to send the tiles to, 0 once answered, a negative AVERROR otherwise
+ */
+int SRTileView::handshake(AVIOContext *client) {
+    std::string request, key;
+    while (request.size() < TILE_VIEW_REQUEST &&
+           (request.size() < 4 || request.compare(request.size() - 4, 4, "\r\n\r\n"))) {
+        int c = avio_r8(client);
+        if (avio_feof(client))
+            return AVERROR_EOF;
+        request += (char) c;
+    }
+    if (request.compare(0, 4, "GET "))
+        return AVERROR_INVALIDDATA;
+    for (size_t at = request.find("\r\n"); at != std::string::npos; at = request.find("\r\n", at + 2)) {
+        const char *line = request.c_str() + at + 2;
+        if (!av_strncasecmp(line, "Sec-WebSocket-Key:", 18)) {
+            size_t start = request.find_first_not_of(' ', at + 2 + 18);
+            if (start != std::string::npos)
+                key = request.substr(start, request.find("\r\n", start) - start);
+        }
+    }
+    if (key.empty()) {
+        writeText(client, "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: " +
+                          std::to_string(sizeof(viewerPage) - 1) + "\r\nConnection: close\r\n\r\n" + viewerPage);
+        return 0;
+    }
+    int viewers;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        viewers = watching.load() + (int) joining.size();
+    }
+    if (viewers >= TILE_VIEW_VIEWERS) {
+        writeText(client, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        srLog(SR_LOG_WARNING, "[SRTileView] %d viewers already, one more turned away", TILE_VIEW_VIEWERS);
+        return 0;
+    }
+    writeText(client, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                      "Sec-WebSocket-Accept: " + acceptKey(key) + "\r\n\r\n");
+    return client->error < 0 ? client->error : 1;
+}
+
+/**
+ * prepare() opens the packer for the geometry of frame, every viewer starts over on a change of it
+ * @return 0 on success, a negative AVERROR for a frame that cannot be packed
+ */
+int SRTileView::prepare(const AVFrame *frame) {
+    if (packer && frame->format == format && frame->width == width && frame->height == height)
+        return 0;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat) frame->format);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_PLANAR | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)) ||
+        desc->nb_components < 3 || desc->comp[0].step != 4 || frame->width <= 0 || frame->height <= 0)
+        return AVERROR(EINVAL);
+    for (int c = 0; c < 4; c++)
+        offsets[c] = c < desc->nb_components ? desc->comp[c].offset : -1;
+
+    avcodec_free_context(&packer);
+    const AVCodec *codec = avcodec_find_encoder_by_name(TILE_VIEW_CODEC);
+    if (!codec)
+        return AVERROR_ENCODER_NOT_FOUND;
+    if (!(packer = avcodec_alloc_context3(codec)) || (!strip && !(strip = av_frame_alloc())) ||
+        (!packet && !(packet = av_packet_alloc())))
+        return AVERROR(ENOMEM);
+    av_frame_unref(strip);
+    strip->format = AV_PIX_FMT_RGBA;
+    strip->width = TILE_VIEW_STRIP * SR_TILE_SIZE;
+    strip->height = SR_TILE_SIZE;
+    int ret = av_frame_get_buffer(strip, 32);
+    if (ret < 0)
+        return ret;
+    packer->width = strip->width;
+    packer->height = strip->height;
+    packer->pix_fmt = AV_PIX_FMT_RGBA;
+    packer->time_base = {1, 1000000};
+    packer->thread_count = 1;
+    //the fastest deflate: screen content is flat, the left neighbour removes most of what is left
+    packer->compression_level = 1;
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "pred", "sub", 0);
+    ret = avcodec_open2(packer, codec, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        avcodec_free_context(&packer);
+        return ret;
+    }
+    format = (enum AVPixelFormat) frame->format;
+    width = frame->width;
+    height = frame->height;
+    hasher.reset();
+    for (Viewer &viewer : viewers)
+        viewer.fresh = true;
+    srLog(SR_LOG_INFO, "[SRTileView] viewing %dx%d %s on %s", width, height, desc->name, url.c_str());
+    return 0;
+}
+
+/**
+ * pack() copies count tiles of frame, TILE_VIEW_STRIP at most, into the strip as RGBA and appends its picture.
+ * The tiles cut by the right and bottom edges keep what the strip had there, the viewers draw their inside only.
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int SRTileView::pack(const AVFrame *frame, const int *tiles, int count) {
+    int ret = av_frame_make_writable(strip);
+    if (ret < 0)
+        return ret;
+    int cols = (width + SR_TILE_SIZE - 1) / SR_TILE_SIZE;
+    for (int i = 0; i < TILE_VIEW_STRIP; i++) {
+        uint8_t *dst = strip->data[0] + i * SR_TILE_SIZE * 4;
+        if (i >= count) {
+            for (int row = 0; row < SR_TILE_SIZE; row++)
+                memset(dst + row * strip->linesize[0], 0, SR_TILE_SIZE * 4);
+            continue;
+        }
+        int x = tiles[i] % cols * SR_TILE_SIZE, y = tiles[i] / cols * SR_TILE_SIZE;
+        int w = FFMIN(SR_TILE_SIZE, width - x), h = FFMIN(SR_TILE_SIZE, height - y);
+        for (int row = 0; row < h; row++) {
+            const uint8_t *src = frame->data[0] + (size_t) (y + row) * frame->linesize[0] + x * 4;
+            uint8_t *out = dst + row * strip->linesize[0];
+            for (int px = 0; px < w; px++, src += 4, out += 4) {
+                out[0] = src[offsets[0]];
+                out[1] = src[offsets[1]];
+                out[2] = src[offsets[2]];
+                //the padding byte of BGR0 is not an alpha
+                out[3] = offsets[3] >= 0 ? src[offsets[3]] : 255;
+            }
+        }
+    }
+    strip->pts = packed++;
+    if ((ret = avcodec_send_frame(packer, strip)) < 0 || (ret = avcodec_receive_packet(packer, packet)) < 0)
+        return ret;
+    put32(message, (uint32_t) packet->size);
+    message.insert(message.end(), packet->data, packet->data + packet->size);
+    av_packet_unref(packet);
+    return 0;
+}
+
+/**
+ * build() makes the SR_TILE_VIEW_UPDATE message of tiles of frame
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int SRTileView::build(const AVFrame *frame, const std::vector<int> &tiles) {
+    int count = (int) tiles.size();
+    message.clear();
+    put32(message, SR_TILE_VIEW_UPDATE);
+    put64(message, (uint64_t) frame->pts);
+    put32(message, (uint32_t) count);
+    for (int tile : tiles)
+        put32(message, (uint32_t) tile);
+    int ret = 0;
+    for (int i = 0; i < count && ret >= 0; i += TILE_VIEW_STRIP)
+        ret = pack(frame, tiles.data() + i, FFMIN(TILE_VIEW_STRIP, count - i));
+    return ret;
+}
+
+void SRTileView::header() {
+    message.clear();
+    put32(message, SR_TILE_VIEW_HEADER);
+    put32(message, TILE_VIEW_VERSION);
+    put32(message, (uint32_t) width);
+    put32(message, (uint32_t) height);
+    put32(message, SR_TILE_SIZE);
+    put32(message, TILE_VIEW_STRIP);
+}
+
+/**
+ * send() writes the message as one unmasked binary WebSocket frame to the viewers that are fresh or not, the ones
+ * the connection of is lost are dropped
+ */
+void SRTileView::send(bool fresh) {
+    uint8_t head[10];
+    int length = 2;
+    uint64_t size = message.size();
+    head[0] = 0x82;
+    if (size < 126) {
+        head[1] = (uint8_t) size;
+    } else if (size < 65536) {
+        head[1] = 126;
+        head[2] = (uint8_t) (size >> 8);
+        head[3] = (uint8_t) size;
+        length = 4;
+    } else {
+        head[1] = 127;
+        for (int i = 0; i < 8; i++)
+            head[2 + i] = (uint8_t) (size >> (56 - 8 * i));
+        length = 10;
+    }
+    for (size_t i = 0; i < viewers.size();) {
+        Viewer &viewer = viewers[i];
+        if (viewer.fresh != fresh) {
+            i++;
+            continue;
+        }
+        avio_write(viewer.io, head, length);
+        avio_write(viewer.io, message.data(), (int) message.size());
+        avio_flush(viewer.io);
+        if (viewer.io->error < 0) {
+            if (!stopping)
+                srLog(SR_LOG_INFO, "[SRTileView] a viewer left: %d", viewer.io->error);
+            avio_closep(&viewer.io);
+            viewers.erase(viewers.begin() + i);
+            watching = (int) viewers.size();
+            continue;
+        }
+        counters.bytes += length + size;
+        i++;
+    }
+}
+
+/**
+ * run() is the sender thread: the changed tiles of the last frame go to the viewers that have the previous one,
+ * the header and every tile to the ones that just came
+ */
+void SRTileView::run() {
+    std::vector<int> all;
+    std::unique_lock<std::mutex> guard(lock);
+    while (!stopping) {
+        bool arrived = !joining.empty();
+        for (Viewer &viewer : joining)
+            viewers.push_back(viewer);
+        joining.clear();
+        watching = (int) viewers.size();
+        bool frame = pending->buf[0] && !viewers.empty();
+        if (frame) {
+            av_frame_unref(current);
+            av_frame_move_ref(current, pending);
+        }
+        if (!frame && !(arrived && current->buf[0])) {
+            wake.wait(guard);
+            continue;
+        }
+        guard.unlock();
+
+        int ret = prepare(current);
+        if (ret < 0) {
+            srLog(SR_LOG_ERROR, "[SRTileView] %s frames cannot be viewed: %d",
+                  av_get_pix_fmt_name((enum AVPixelFormat) current->format), ret);
+            av_frame_unref(current);
+        }
+        //the viewers that have the previous frame get what changed since
+        int changed = ret >= 0 && frame ? hasher.update(current->data[0], current->linesize[0], width, height, 4) : 0;
+        if (changed > 0 && (ret = build(current, hasher.changedTiles())) >= 0) {
+            send(false);
+            counters.updates++;
+            counters.tiles += changed;
+        } else if (frame && ret >= 0) {
+            counters.unchanged++;
+        }
+        bool fresh = false;
+        for (const Viewer &viewer : viewers)
+            fresh |= viewer.fresh;
+        if (ret >= 0 && fresh) {
+            int tiles = ((width + SR_TILE_SIZE - 1) / SR_TILE_SIZE) * ((height + SR_TILE_SIZE - 1) / SR_TILE_SIZE);
+            if ((int) all.size() != tiles) {
+                all.resize(tiles);
+                for (int t = 0; t < tiles; t++)
+                    all[t] = t;
+            }
+            header();
+            send(true);
+            if ((ret = build(current, all)) >= 0)
+                send(true);
+            for (Viewer &viewer : viewers) {
+                counters.viewers += viewer.fresh;
+                viewer.fresh = false;
+            }
+        }
+        if (ret < 0)
+            srLog(SR_LOG_WARNING, "[SRTileView] cannot pack the tiles: %d", ret);
+        guard.lock();
+    }
+}
+
+SRTileViewStats SRTileView::stats() const {
+    SRTileViewStats s = counters;
+    s.replaced = replaced;
+    return s;
+}
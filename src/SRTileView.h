@@ -0,0 +1,140 @@
+//
+// Live view of the screen in a browser: the changed tiles of each captured frame pushed over a WebSocket.
+//
+
+#ifndef CPPSCREENRECORDER_SRTILEVIEW_H
+#define CPPSCREENRECORDER_SRTILEVIEW_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SRFrameHash.h"
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avio.h"
+}
+
+#define TILE_VIEW_VERSION 1
+#define TILE_VIEW_CODEC "png"   //what the tiles are packed with, any browser decodes it
+#define TILE_VIEW_STRIP 16  //tiles packed side by side into one picture
+#define TILE_VIEW_VIEWERS 8     //viewers watching at once, the next ones are turned away
+#define TILE_VIEW_REQUEST 4096  //bytes of the HTTP request of a viewer at most
+#define TILE_VIEW_HANDSHAKE 2000    //ms a connection has for its request, the next ones wait on the listener meanwhile
+
+typedef enum VM{
+    SR_TILE_VIEW_HEADER = 1,    //version, width, height, tile size and strip tiles, u32 each
+    SR_TILE_VIEW_UPDATE         //u64 pts, u32 count, the u32 indices of the tiles and the packed strips
+}SRTileViewMessage;
+
+/**
+ * Statistics of a tile view: the frames that changed and the tiles sent for them, the frames the sender was too
+ * late for, the bytes sent to all viewers and the viewers that connected.
+ */
+typedef struct TV{
+    uint64_t updates;
+    uint64_t unchanged;
+    uint64_t replaced;  //frames a newer one took the place of before they were compared
+    uint64_t tiles;
+    int64_t bytes;
+    uint64_t viewers;
+}SRTileViewStats;
+
+/**
+ * SRTileView serves the recorded screen to browsers, for the remote viewing of a mostly static desktop without a
+ * video codec: a GET of the url returns a page drawing into a canvas, which opens a WebSocket on the same url and
+ * receives only the tiles that changed, hashed in SR_TILE_SIZE tiles as settings._skipstatic does and packed
+ * TILE_VIEW_STRIP at a time into pictures of TILE_VIEW_CODEC. A viewer that connects gets the header and every tile
+ * of the last frame first.\n
+ * push() only keeps a reference of the frame: the hashing, packing and sending run on a thread of the view, a
+ * frame that comes while it is busy takes the place of the one waiting, and the next comparison is still with what
+ * the viewers have. A frame the grabber found unchanged is never pushed: the work and the bandwidth follow what
+ * changes on the screen, not its resolution. A slow viewer slows the others down, not the capture.\n
+ * Every message is one binary WebSocket message, its integers little-endian: SR_TILE_VIEW_HEADER, then
+ * SR_TILE_VIEW_UPDATE for each changed frame, each strip after its u32 size.
+ *
+ * @Note packed formats of 4 bytes per pixel in system memory only, BGR0 as the X11 and GDI captures give
+ */
+class SRTileView {
+
+private:
+    struct Viewer {
+        AVIOContext *io;
+        bool fresh;     //has nothing yet: the header and every tile go first
+    };
+
+    std::string url;
+    AVIOContext *server;
+    std::thread listener;
+    std::thread sender;
+    std::atomic<bool> stopping;
+    std::atomic<int> watching;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    AVFrame *pending;   //last pushed frame the sender has not taken yet
+    std::vector<Viewer> joining;
+    uint64_t replaced;
+
+    //sender thread
+    std::vector<Viewer> viewers;
+    AVFrame *current;   //last frame sent, for the viewers still to come
+    AVCodecContext *packer;
+    AVFrame *strip;
+    AVPacket *packet;
+    SRTileHasher hasher;
+    enum AVPixelFormat format;
+    int width, height;
+    int offsets[4];     //bytes of the red, green, blue and alpha of a pixel, -1 without alpha
+    int64_t packed;
+    std::vector<uint8_t> message;
+    SRTileViewStats counters;
+
+    static int interrupted(void *opaque);
+    void listen();
+    int handshake(AVIOContext *client);
+    void run();
+    int prepare(const AVFrame *frame);
+    int pack(const AVFrame *frame, const int *tiles, int count);
+    int build(const AVFrame *frame, const std::vector<int> &tiles);
+    void header();
+    void send(bool fresh);
+
+public:
+    SRTileView();
+    ~SRTileView();
+
+    SRTileView(const SRTileView&) = delete;
+    SRTileView &operator=(const SRTileView&) = delete;
+
+    /**
+     * open() listens for viewers on url ("tcp://0.0.0.0:8080") and starts the listener and sender threads
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int open(const char *url);
+
+    /**
+     * push() hands a captured frame to the sender, frame pts in us on the capture clock
+     * @Note one thread only (the VideoThread)
+     */
+    void push(const AVFrame *frame);
+
+    /**
+     * close() stops the threads and hangs up on the viewers
+     */
+    void close();
+
+    int viewerCount() const { return watching.load(std::memory_order_relaxed); }
+
+    /**
+     * stats() of the sender thread, once close() stopped it
+     */
+    SRTileViewStats stats() const;
+};
+
+#endif //CPPSCREENRECORDER_SRTILEVIEW_H
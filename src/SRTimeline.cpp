@@ -0,0 +1,42 @@
+#include "SRTimeline.h"
+
+extern "C"
+{
+#include "libavutil/mathematics.h"
+}
+
+SRStreamTimeline::SRStreamTimeline(): codecTb({1, 1000000}), streamTb({1, 1000000}), last(AV_NOPTS_VALUE),
+                                      first(AV_NOPTS_VALUE) {}
+
+void SRStreamTimeline::configure(AVRational codecTb, AVRational streamTb) {
+    this->codecTb = codecTb;
+    this->streamTb = streamTb;
+}
+
+void SRStreamTimeline::mark(int64_t us) {
+    //published once, read by the other threads without a lock
+    int64_t unset = AV_NOPTS_VALUE;
+    if (first.load(std::memory_order_relaxed) == AV_NOPTS_VALUE)
+        first.compare_exchange_strong(unset, us, std::memory_order_release, std::memory_order_relaxed);
+}
+
+int64_t SRStreamTimeline::stamp(int64_t us) {
+    mark(us);
+    int64_t pts = av_rescale_q(us, AV_TIME_BASE_Q, codecTb);
+    if (last != AV_NOPTS_VALUE && pts <= last)
+        pts = last + 1;
+    return last = pts;
+}
+
+int64_t SRStreamTimeline::stampSamples(int64_t samples, int rate) {
+    mark(av_rescale(samples, 1000000, rate));
+    return last = av_rescale_q(samples, (AVRational){1, rate}, codecTb);
+}
+
+void SRStreamTimeline::toStream(AVPacket *pkt) const {
+    av_packet_rescale_ts(pkt, codecTb, streamTb);
+}
+
+int64_t SRStreamTimeline::startTime() const {
+    return first.load(std::memory_order_acquire);
+}
@@ -0,0 +1,66 @@
+//
+// Per-stream output timeline of a recorder: timestamps of the encoder, of the muxer and where the stream starts.
+//
+
+#ifndef CPPSCREENRECORDER_SRTIMELINE_H
+#define CPPSCREENRECORDER_SRTIMELINE_H
+
+#include <atomic>
+#include <cstdint>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+}
+
+/**
+ * SRStreamTimeline turns the capture clock time of the frames of one output stream into encoder timestamps,
+ * and the encoded packets into the time base the muxer chose for the stream. State lives in the recorder,
+ * one timeline per output stream: a second recorder of the process, or the next recording, starts from zero.\n
+ * stamp() and stampSamples() are called by the thread feeding the encoder only; startTime() from any thread.
+ */
+class SRStreamTimeline {
+
+private:
+    AVRational codecTb;
+    AVRational streamTb;
+    int64_t last;   //encoder ticks of the last frame, the encoder thread only
+    std::atomic<int64_t> first;     //us of the first frame on the capture clock, AV_NOPTS_VALUE before it
+
+    void mark(int64_t us);
+
+public:
+    SRStreamTimeline();
+
+    SRStreamTimeline(const SRStreamTimeline&) = delete;
+    SRStreamTimeline &operator=(const SRStreamTimeline&) = delete;
+
+    /**
+     * configure() sets the time bases, once avformat_write_header() has fixed the one of the stream
+     */
+    void configure(AVRational codecTb, AVRational streamTb);
+
+    /**
+     * stamp() is the encoder pts of a frame captured at us on the capture clock:
+     * two frames within one encoder tick get consecutive ones
+     */
+    int64_t stamp(int64_t us);
+
+    /**
+     * stampSamples() is the encoder pts of an audio frame starting samples into the stream, at rate Hz
+     */
+    int64_t stampSamples(int64_t samples, int rate);
+
+    /**
+     * toStream() rescales the timestamps and duration of an encoded packet to the stream time base
+     */
+    void toStream(AVPacket *pkt) const;
+
+    /**
+     * startTime() is the capture clock time of the first frame, in us: the streams of a recorder share the clock,
+     * the difference of two start times is their offset in the file
+     */
+    int64_t startTime() const;
+};
+
+#endif //CPPSCREENRECORDER_SRTIMELINE_H
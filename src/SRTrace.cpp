@@ -0,0 +1,126 @@
+#include "SRTrace.h"
+#include "SRFrameClock.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+
+extern "C"
+{
+#include "libavutil/error.h"
+}
+
+static const char *stageNames[SR_STAGE_COUNT] = {"grab", "decode", "scale", "encode", "mux"};
+
+static std::atomic<int> threadCount(0);
+
+SRTracer::SRTracer(int64_t duration, size_t capacity): events(new SRTraceEvent[capacity]), capacity(capacity), next(0),
+                                                       duration(duration), origin(0) {}
+
+int SRTracer::threadIndex() {
+    //process-wide: the sessions of a host share their pool threads
+    static thread_local int index = -1;
+    if (index < 0)
+        index = threadCount.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+void SRTracer::start() {
+    int64_t unset = 0;
+    origin.compare_exchange_strong(unset, SRFrameClock::now());
+}
+
+void SRTracer::nameThread(const std::string &name) {
+    int index = threadIndex();
+    if (index >= TRACE_MAX_THREADS)
+        return;
+    std::lock_guard<std::mutex> guard(lock);
+    names[index] = name;
+}
+
+void SRTracer::record(SRStage stage, int64_t id, int64_t start, int64_t end) {
+    int64_t from = origin.load(std::memory_order_relaxed);
+    if (!from || start < from || start - from >= duration)
+        return;
+    uint64_t slot = next.fetch_add(1, std::memory_order_relaxed);
+    if (slot >= capacity)
+        return;
+    SRTraceEvent &e = events[slot];
+    e.start = start;
+    e.id = id;
+    e.duration = (int32_t) std::min<int64_t>(end - start, INT32_MAX);
+    e.stage = (uint16_t) stage;
+    e.thread = (uint16_t) threadIndex();
+}
+
+/* a frame the encoder dropped never gets its packet: the oldest id of the stream makes room */
+void SRTracer::bound(std::map<std::pair<int, int64_t>, int64_t> &ids, int stream) {
+    if (ids.size() < TRACE_MAX_PENDING)
+        return;
+    auto oldest = ids.lower_bound(std::make_pair(stream, INT64_MIN));
+    ids.erase(oldest != ids.end() && oldest->first.first == stream ? oldest : ids.begin());
+}
+
+void SRTracer::encoded(int stream, int64_t encoderPts, int64_t id) {
+    std::lock_guard<std::mutex> guard(idLock);
+    bound(encoding, stream);
+    encoding[std::make_pair(stream, encoderPts)] = id;
+}
+
+void SRTracer::packetized(int stream, int64_t encoderPts, int64_t streamPts) {
+    std::lock_guard<std::mutex> guard(idLock);
+    auto sent = encoding.find(std::make_pair(stream, encoderPts));
+    if (sent == encoding.end())
+        return;
+    bound(muxing, stream);
+    muxing[std::make_pair(stream, streamPts)] = sent->second;
+    encoding.erase(sent);
+}
+
+int64_t SRTracer::muxedId(int stream, int64_t streamPts) {
+    std::lock_guard<std::mutex> guard(idLock);
+    auto queued = muxing.find(std::make_pair(stream, streamPts));
+    if (queued == muxing.end())
+        return -1;
+    int64_t id = queued->second;
+    muxing.erase(queued);
+    return id;
+}
+
+int SRTracer::write(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return AVERROR(errno);
+    int64_t from = origin.load(std::memory_order_relaxed);
+    uint64_t count = std::min<uint64_t>(next.load(std::memory_order_relaxed), capacity);
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+            if (names[i].empty())
+                continue;
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    first ? "" : ",\n", i, names[i].c_str());
+            first = false;
+        }
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        const SRTraceEvent &e = events[i];
+        fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%d,\"pid\":1,\"tid\":%d,\"args\":{\"frame\":%" PRId64 "}}",
+                first ? "" : ",\n", stageNames[e.stage], e.start - from, (int) e.duration, (int) e.thread, e.id);
+        first = false;
+    }
+    fprintf(f, "\n]}\n");
+    return fclose(f) ? AVERROR(errno) : 0;
+}
+
+uint64_t SRTracer::recorded() const {
+    return std::min<uint64_t>(next.load(std::memory_order_relaxed), capacity);
+}
+
+uint64_t SRTracer::dropped() const {
+    uint64_t n = next.load(std::memory_order_relaxed);
+    return n > capacity ? n - capacity : 0;
+}
@@ -0,0 +1,99 @@
+//
+// Per-frame trace of the pipeline stages, written as Chrome trace_event JSON.
+//
+
+#ifndef CPPSCREENRECORDER_SRTRACE_H
+#define CPPSCREENRECORDER_SRTRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "SRStats.h"
+
+#define TRACE_MAX_EVENTS (1 << 18)  //events kept, 6 MiB: a minute of 60 fps with every stage fits many times
+#define TRACE_MAX_THREADS 64    //threads named in the trace, the others are numbered
+#define TRACE_MAX_PENDING 1024  //ids of each map waiting for their packet, the oldest of the stream make room
+
+/**
+ * One stage of one frame: a frame and its packet are told apart by the capture time of the frame, in us,
+ * an audio frame by the capture time of its first sample
+ */
+typedef struct TE{
+    int64_t start;      //us, SRFrameClock
+    int64_t id;
+    int32_t duration;   //us
+    uint16_t stage;
+    uint16_t thread;
+}SRTraceEvent;
+
+/**
+ * SRTracer records the stage spans of the frames into a buffer allocated once, for duration us from start().\n
+ * record() is a relaxed atomic add and a store, from any thread: once the buffer is full or the duration over
+ * the events are only counted. write() exports them for chrome://tracing or Perfetto, a track per thread.
+ *
+ * @Note write() once the recording threads stopped
+ */
+class SRTracer {
+
+private:
+    std::unique_ptr<SRTraceEvent[]> events;
+    size_t capacity;
+    std::atomic<uint64_t> next;
+    int64_t duration;
+    std::atomic<int64_t> origin;    //0 until start()
+    std::mutex lock;
+    std::string names[TRACE_MAX_THREADS];
+    std::mutex idLock;
+    std::map<std::pair<int, int64_t>, int64_t> encoding;    //(stream, encoder pts) of the frames sent, to their id
+    std::map<std::pair<int, int64_t>, int64_t> muxing;      //(stream, stream pts) of the packets queued, to their id
+
+    static int threadIndex();
+    static void bound(std::map<std::pair<int, int64_t>, int64_t> &ids, int stream);
+
+public:
+    /**
+     * @param duration us traced from start()
+     */
+    explicit SRTracer(int64_t duration, size_t capacity = TRACE_MAX_EVENTS);
+
+    SRTracer(const SRTracer&) = delete;
+    SRTracer &operator=(const SRTracer&) = delete;
+
+    /**
+     * start() opens the traced interval, the first call only: a resumed capture goes on in it
+     */
+    void start();
+
+    /**
+     * nameThread() gives the calling thread its name in the trace
+     */
+    void nameThread(const std::string &name);
+
+    void record(SRStage stage, int64_t id, int64_t start, int64_t end);
+
+    /**
+     * The id of a frame goes with it through the encoder and the mux queue, the pts of the frame being the one of
+     * its packet: encoded() as the frame is sent, packetized() once its packet has the pts of the stream,
+     * muxedId() gives it back to the muxer. The timestamps of the ticks do not carry it, the rescales quantize them.
+     * @return -1 for a packet of no frame encoded()
+     */
+    void encoded(int stream, int64_t encoderPts, int64_t id);
+    void packetized(int stream, int64_t encoderPts, int64_t streamPts);
+    int64_t muxedId(int stream, int64_t streamPts);
+
+    /**
+     * write() writes the events in the trace_event JSON format
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int write(const char *path);
+
+    uint64_t recorded() const;
+    uint64_t dropped() const;
+};
+
+#endif //CPPSCREENRECORDER_SRTRACE_H
@@ -0,0 +1,579 @@
+#include "SRUploader.h"
+#include "SRLog.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+extern "C"
+{
+#include "libavformat/avformat.h"
+#include "libavutil/base64.h"
+#include "libavutil/hmac.h"
+#include "libavutil/md5.h"
+#include "libavutil/mem.h"
+#include "libavutil/sha.h"
+#include "libavutil/time.h"
+}
+
+enum {
+    UPLOAD_TASK_CREATE,
+    UPLOAD_TASK_PART,
+    UPLOAD_TASK_COMPLETE,
+    UPLOAD_TASK_ABORT
+};
+
+static std::string hex(const uint8_t *data, int size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string s;
+    s.reserve(size * 2);
+    for (int i = 0; i < size; i++) {
+        s += digits[data[i] >> 4];
+        s += digits[data[i] & 15];
+    }
+    return s;
+}
+
+static std::string sha256(const std::string &s) {
+    uint8_t digest[32];
+    struct AVSHA *sha = av_sha_alloc();
+    if (!sha)
+        return std::string();
+    av_sha_init(sha, 256);
+    av_sha_update(sha, (const uint8_t *) s.data(), (unsigned int) s.size());
+    av_sha_final(sha, digest);
+    av_free(sha);
+    return hex(digest, sizeof(digest));
+}
+
+static std::string hmac(const std::string &key, const std::string &data) {
+    uint8_t digest[32];
+    AVHMAC *ctx = av_hmac_alloc(AV_HMAC_SHA256);
+    if (!ctx)
+        return std::string();
+    int size = av_hmac_calc(ctx, (const uint8_t *) data.data(), (unsigned int) data.size(),
+                            (const uint8_t *) key.data(), (unsigned int) key.size(), digest, sizeof(digest));
+    av_hmac_free(ctx);
+    return std::string((const char *) digest, size > 0 ? size : 0);
+}
+
+/* the value of a tag of an S3 reply, empty without one */
+static std::string xmlValue(const std::string &xml, const char *tag) {
+    std::string open = std::string("<") + tag + ">", close = std::string("</") + tag + ">";
+    size_t start = xml.find(open);
+    if (start == std::string::npos)
+        return std::string();
+    start += open.size();
+    size_t end = xml.find(close, start);
+    return end == std::string::npos ? std::string() : xml.substr(start, end - start);
+}
+
+static const char *getEnv(const char *name) {
+    const char *value = getenv(name);
+    return value ? value : "";
+}
+
+SRUploader::SRUploader(const char *url, int threads): threads(threads > 0 ? threads : 1), following(nullptr),
+                                                      stopping(false), objects(0), failedObjects(0), sentParts(0),
+                                                      retries(0), bytes(0), started(0), elapsed(0) {
+    char proto[16], auth[256], hostname[256], dir[1024];
+    int port = -1;
+    av_url_split(proto, sizeof(proto), auth, sizeof(auth), hostname, sizeof(hostname), &port, dir, sizeof(dir), url);
+    scheme = proto;
+    host = hostname;
+    if (port > 0)
+        host += ":" + std::to_string(port);
+    //the objects are named after the files, under the bucket and the prefix
+    path = encode(dir, true);
+    while (!path.empty() && path.back() == '/')
+        path.pop_back();
+}
+
+SRUploader::~SRUploader() {
+    finish();
+}
+
+std::string SRUploader::encode(const std::string &s, bool slash) {
+    static const char digits[] = "0123456789ABCDEF";
+    std::string out;
+    for (unsigned char c : s) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (slash && c == '/')) {
+            out += (char) c;
+        } else {
+            out += '%';
+            out += digits[c >> 4];
+            out += digits[c & 15];
+        }
+    }
+    return out;
+}
+
+int SRUploader::start() {
+    if ((scheme != "http" && scheme != "https") || host.empty() || path.empty()) {
+        srLog(SR_LOG_ERROR, "[SRUploader] the upload URL must be http(s)://host/bucket[/prefix]");
+        return AVERROR(EINVAL);
+    }
+    accessKey = getEnv("AWS_ACCESS_KEY_ID");
+    secretKey = getEnv("AWS_SECRET_ACCESS_KEY");
+    sessionToken = getEnv("AWS_SESSION_TOKEN");
+    region = *getEnv("AWS_REGION") ? getEnv("AWS_REGION") : "us-east-1";
+    if (accessKey.empty() || secretKey.empty())
+        srLog(SR_LOG_WARNING, "[SRUploader] no AWS credentials in the environment, the requests to %s are anonymous",
+              host.c_str());
+    started = av_gettime_relative();
+    for (int i = 0; i < threads; i++)
+        workers.emplace_back(&SRUploader::run, this);
+    return 0;
+}
+
+/**
+ * add() creates the upload of file, the object is created by the first thread free
+ * @Note under lock
+ */
+SRUploader::Upload *SRUploader::add(const char *file) {
+    const char *name = strrchr(file, '/');
+#ifdef _WIN32
+    const char *backslash = strrchr(file, '\\');
+    if (backslash && (!name || backslash > name))
+        name = backslash;
+#endif
+    Upload upload;
+    upload.path = file;
+    upload.key = path + "/" + encode(name ? name + 1 : file);
+    upload.queued = 0;
+    upload.partsPending = 0;
+    upload.closed = false;
+    upload.creating = false;
+    upload.completing = false;
+    upload.failed = false;
+    uploads.push_back(upload);
+    cv.notify_all();
+    return &uploads.back();
+}
+
+/**
+ * queueParts() queues the whole parts up to end, the rest too when last
+ * @Note under lock
+ */
+void SRUploader::queueParts(Upload *upload, int64_t end, bool last) {
+    if (upload->failed)
+        return;
+    while (end - upload->queued >= UPLOAD_PART_SIZE || (last && end > upload->queued)) {
+        int size = (int) FFMIN(end - upload->queued, (int64_t) UPLOAD_PART_SIZE);
+        upload->etags.emplace_back();
+        parts.push_back({upload, (int) upload->etags.size(), upload->queued, size, 0});
+        upload->queued += size;
+        upload->partsPending++;
+    }
+    cv.notify_all();
+}
+
+void SRUploader::follow(const char *file) {
+    std::lock_guard<std::mutex> guard(lock);
+    following = add(file);
+}
+
+void SRUploader::advance(int64_t end) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (following)
+        queueParts(following, end, false);
+}
+
+void SRUploader::endFollow() {
+    Upload *upload;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        upload = following;
+        following = nullptr;
+    }
+    if (!upload)
+        return;
+    //the file is closed: its size is final, the trailer included
+    AVIOContext *io = nullptr;
+    int64_t size = avio_open(&io, upload->path.c_str(), AVIO_FLAG_READ) >= 0 ? avio_size(io) : -1;
+    avio_closep(&io);
+    std::lock_guard<std::mutex> guard(lock);
+    if (size <= 0) {
+        srLog(SR_LOG_ERROR, "[SRUploader] %s is empty or cannot be read back", upload->path.c_str());
+        upload->failed = true;
+    }
+    queueParts(upload, size, true);
+    upload->closed = true;
+    cv.notify_all();
+}
+
+void SRUploader::upload(const char *file) {
+    AVIOContext *io = nullptr;
+    int64_t size = avio_open(&io, file, AVIO_FLAG_READ) >= 0 ? avio_size(io) : -1;
+    //a file smaller than a part, a playlist rewritten at every segment, is read at once: it goes as it is now
+    std::vector<uint8_t> data;
+    if (size > 0 && size < UPLOAD_PART_SIZE) {
+        data.resize(size);
+        if (avio_read(io, data.data(), (int) size) != size)
+            size = -1;
+    }
+    avio_closep(&io);
+    if (size <= 0) {
+        srLog(SR_LOG_WARNING, "[SRUploader] %s is empty or cannot be read, it is not uploaded", file);
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if (stopping)
+        return;
+    Upload *upload = add(file);
+    upload->data.swap(data);
+    queueParts(upload, size, true);
+    upload->closed = true;
+}
+
+/**
+ * next() waits for the next task a thread may run: the creation of an object, a part whose object exists
+ * and whose bytes are in the file, the completion of an object all the parts of which are sent,
+ * the abort of a failed upload once no part of it is being sent, the followed one included
+ * @return false once finish() is called and nothing is left
+ */
+bool SRUploader::next(Upload *&upload, Part &part, int &task) {
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        for (Upload &u : uploads) {
+            if (u.creating || u.completing)
+                continue;
+            //a followed file that failed is not sent any further: it is aborted now, not when the recording ends
+            if (u.failed && !u.partsPending && (u.closed || &u == following)) {
+                if (&u == following)
+                    following = nullptr;
+                u.closed = true;
+                u.completing = true;
+                upload = &u;
+                task = UPLOAD_TASK_ABORT;
+                return true;
+            }
+            if (u.failed)
+                continue;
+            if (u.id.empty()) {
+                u.creating = true;
+                upload = &u;
+                task = UPLOAD_TASK_CREATE;
+                return true;
+            }
+            if (u.closed && !u.partsPending) {
+                u.completing = true;
+                upload = &u;
+                task = UPLOAD_TASK_COMPLETE;
+                return true;
+            }
+        }
+        int64_t now = av_gettime_relative(), wake = INT64_MAX;
+        for (auto it = parts.begin(); it != parts.end();) {
+            //the parts of a failed upload are dropped, it is aborted once none is being sent
+            if (it->upload->failed) {
+                it->upload->partsPending--;
+                it = parts.erase(it);
+                continue;
+            }
+            if (it->upload->id.empty()) {
+                ++it;
+                continue;
+            }
+            if (it->notBefore > now) {
+                wake = FFMIN(wake, it->notBefore);
+                ++it;
+                continue;
+            }
+            part = *it;
+            parts.erase(it);
+            task = UPLOAD_TASK_PART;
+            return true;
+        }
+        if (stopping && uploads.empty())
+            return false;
+        if (wake != INT64_MAX)
+            cv.wait_for(guard, std::chrono::microseconds(wake - now));
+        else
+            cv.wait(guard);
+    }
+}
+
+void SRUploader::run() {
+    Upload *upload = nullptr;
+    Part part = {};
+    int task;
+    while (next(upload, part, task)) {
+        switch (task) {
+            case UPLOAD_TASK_CREATE:
+                create(upload);
+                break;
+            case UPLOAD_TASK_PART:
+                send(part);
+                break;
+            case UPLOAD_TASK_COMPLETE:
+                complete(upload);
+                break;
+            default:
+                abort(upload);
+        }
+    }
+}
+
+void SRUploader::create(Upload *upload) {
+    std::string reply;
+    int ret = retried("POST", upload->key, "uploads=", std::vector<uint8_t>(), std::string(), &reply);
+    std::string id = ret >= 0 ? xmlValue(reply, "UploadId") : std::string();
+    std::lock_guard<std::mutex> guard(lock);
+    upload->creating = false;
+    if (id.empty()) {
+        srLog(SR_LOG_ERROR, "[SRUploader] cannot create the object of %s %d", upload->path.c_str(), ret);
+        upload->failed = true;
+    } else {
+        upload->id = id;
+    }
+    cv.notify_all();
+}
+
+/**
+ * send() reads the part back from the file and sends it, ahead of the writer it waits UPLOAD_WAIT_FILE ms
+ */
+void SRUploader::send(Part part) {
+    Upload *upload = part.upload;
+    std::vector<uint8_t> data;
+    int ret = part.size;
+    if (!upload->data.empty()) {
+        data = upload->data;
+    } else {
+        data.resize(part.size);
+        AVIOContext *io = nullptr;
+        ret = avio_open(&io, upload->path.c_str(), AVIO_FLAG_READ);
+        if (ret >= 0 && (ret = (int) avio_seek(io, part.offset, SEEK_SET)) >= 0)
+            ret = avio_read(io, data.data(), part.size);
+        avio_closep(&io);
+    }
+    bool closed;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = upload->closed;
+        if (ret >= 0 && ret < part.size && !closed) {
+            part.notBefore = av_gettime_relative() + (int64_t) UPLOAD_WAIT_FILE * 1000;
+            parts.push_front(part);
+            cv.notify_all();
+            return;
+        }
+    }
+
+    uint8_t digest[16];
+    char md5[AV_BASE64_SIZE(16)];
+    if (ret == part.size) {
+        av_md5_sum(digest, data.data(), part.size);
+        av_base64_encode(md5, sizeof(md5), digest, sizeof(digest));
+        std::string query = "partNumber=" + std::to_string(part.number) + "&uploadId=" + encode(upload->id);
+        ret = retried("PUT", upload->key, query, data, md5, nullptr);
+    } else {
+        srLog(SR_LOG_ERROR, "[SRUploader] cannot read %s back", upload->path.c_str());
+        ret = AVERROR(EIO);
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (ret >= 0) {
+        upload->etags[part.number - 1] = "\"" + hex(digest, sizeof(digest)) + "\"";
+        sentParts++;
+        bytes += part.size;
+    } else if (!upload->failed) {
+        srLog(SR_LOG_ERROR, "[SRUploader] part %d of %s not sent %d", part.number, upload->path.c_str(), ret);
+        upload->failed = true;
+    }
+    upload->partsPending--;
+    cv.notify_all();
+}
+
+void SRUploader::complete(Upload *upload) {
+    std::string xml = "<CompleteMultipartUpload>";
+    for (size_t i = 0; i < upload->etags.size(); i++)
+        xml += "<Part><PartNumber>" + std::to_string(i + 1) + "</PartNumber><ETag>" + upload->etags[i] + "</ETag></Part>";
+    xml += "</CompleteMultipartUpload>";
+    std::vector<uint8_t> body(xml.begin(), xml.end());
+    std::string reply;
+    int ret = retried("POST", upload->key, "uploadId=" + encode(upload->id), body, std::string(), &reply);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (ret >= 0) {
+        objects++;
+        srLog(SR_LOG_INFO, "[SRUploader] %s uploaded in %zu parts", upload->path.c_str(), upload->etags.size());
+        for (auto it = uploads.begin(); it != uploads.end(); ++it)
+            if (&*it == upload) {
+                uploads.erase(it);
+                break;
+            }
+    } else {
+        srLog(SR_LOG_ERROR, "[SRUploader] cannot complete the object of %s %d", upload->path.c_str(), ret);
+        upload->failed = true;
+        upload->completing = false;
+    }
+    cv.notify_all();
+}
+
+/**
+ * abort() drops the parts the storage holds of a failed upload, once, and forgets it
+ */
+void SRUploader::abort(Upload *upload) {
+    if (!upload->id.empty())
+        request("DELETE", upload->key, "uploadId=" + encode(upload->id), std::vector<uint8_t>(), std::string(), nullptr);
+    srLog(SR_LOG_ERROR, "[SRUploader] upload of %s aborted, the file stays local", upload->path.c_str());
+    failedObjects++;
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = uploads.begin(); it != uploads.end(); ++it)
+        if (&*it == upload) {
+            uploads.erase(it);
+            break;
+        }
+    cv.notify_all();
+}
+
+/**
+ * retried() sends the request UPLOAD_RETRIES times at most, an error reply included, waiting longer each time
+ */
+int SRUploader::retried(const char *method, const std::string &key, const std::string &query,
+                        const std::vector<uint8_t> &body, const std::string &md5, std::string *reply) {
+    int ret = 0;
+    int64_t delay = (int64_t) UPLOAD_RETRY_DELAY * 1000;
+    for (int attempt = 0; attempt < UPLOAD_RETRIES; attempt++) {
+        if (attempt) {
+            retries++;
+            av_usleep((unsigned int) delay);
+            delay *= 2;
+        }
+        if (reply)
+            reply->clear();
+        ret = request(method, key, query, body, md5, reply);
+        //a completion may fail after its 200 OK: the error is in the body
+        if (ret >= 0 && reply && reply->find("<Error>") != std::string::npos)
+            ret = AVERROR(EIO);
+        if (ret >= 0)
+            return ret;
+    }
+    return ret;
+}
+
+/**
+ * request() sends a request through the http protocol of libavformat: the body goes as its post_data, so that
+ * the status of the reply is the result of avio_open2(), and reply gets the body of the reply
+ * @return 0 on success, a negative AVERROR otherwise, AVERROR_HTTP_* for an error status
+ */
+int SRUploader::request(const char *method, const std::string &key, const std::string &query,
+                        const std::vector<uint8_t> &body, const std::string &md5, std::string *reply) {
+    time_t now = time(nullptr);
+    struct tm utc;
+#ifdef _WIN32
+    gmtime_s(&utc, &now);
+#else
+    gmtime_r(&now, &utc);
+#endif
+    char date[16], stamp[32];
+    strftime(date, sizeof(date), "%Y%m%d", &utc);
+    strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &utc);
+
+    std::string headers = std::string("x-amz-date: ") + stamp + "\r\nx-amz-content-sha256: UNSIGNED-PAYLOAD\r\n";
+    if (!sessionToken.empty())
+        headers += "x-amz-security-token: " + sessionToken + "\r\n";
+    if (!md5.empty())
+        headers += "Content-MD5: " + md5 + "\r\n";
+    if (body.empty())
+        headers += "Content-Length: 0\r\n";
+    if (!accessKey.empty() && !secretKey.empty())
+        headers += "Authorization: " + sign(method, key, query, date, stamp) + "\r\n";
+
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "method", method, 0);
+    av_dict_set(&options, "headers", headers.c_str(), 0);
+    //no Range nor Icy-MetaData header: the storage takes the request as it is signed
+    av_dict_set(&options, "seekable", "0", 0);
+    av_dict_set(&options, "icy", "0", 0);
+    av_dict_set_int(&options, "rw_timeout", (int64_t) UPLOAD_TIMEOUT * 1000, 0);
+    if (!body.empty()) {
+        //a binary option is set from hex digits
+        static const char digits[] = "0123456789abcdef";
+        char *data = (char *) av_malloc(body.size() * 2 + 1);
+        if (!data) {
+            av_dict_free(&options);
+            return AVERROR(ENOMEM);
+        }
+        for (size_t i = 0; i < body.size(); i++) {
+            data[2 * i] = digits[body[i] >> 4];
+            data[2 * i + 1] = digits[body[i] & 15];
+        }
+        data[body.size() * 2] = 0;
+        av_dict_set(&options, "post_data", data, AV_DICT_DONT_STRDUP_VAL);
+    }
+
+    std::string url = scheme + "://" + host + key + (query.empty() ? "" : "?" + query);
+    AVIOContext *io = nullptr;
+    int ret = avio_open2(&io, url.c_str(), AVIO_FLAG_READ, nullptr, &options);
+    av_dict_free(&options);
+    if (ret >= 0 && reply) {
+        unsigned char buffer[4096];
+        int read;
+        while (reply->size() < UPLOAD_REPLY_SIZE && (read = avio_read(io, buffer, sizeof(buffer))) > 0)
+            reply->append((const char *) buffer, read);
+    }
+    avio_closep(&io);
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * sign() is the Authorization header of the request, AWS Signature V4 with the payload unsigned:
+ * the storage checks the body against its Content-MD5 instead
+ */
+std::string SRUploader::sign(const char *method, const std::string &key, const std::string &query,
+                             const std::string &date, const std::string &time) const {
+    std::string signedHeaders = "host;x-amz-content-sha256;x-amz-date";
+    std::string canonical = std::string(method) + "\n" + key + "\n" + query + "\nhost:" + host +
+                            "\nx-amz-content-sha256:UNSIGNED-PAYLOAD\nx-amz-date:" + time + "\n";
+    if (!sessionToken.empty()) {
+        signedHeaders += ";x-amz-security-token";
+        canonical += "x-amz-security-token:" + sessionToken + "\n";
+    }
+    canonical += "\n" + signedHeaders + "\nUNSIGNED-PAYLOAD";
+
+    std::string scope = date + "/" + region + "/s3/aws4_request";
+    std::string toSign = "AWS4-HMAC-SHA256\n" + time + "\n" + scope + "\n" + sha256(canonical);
+    std::string signingKey = hmac(hmac(hmac(hmac("AWS4" + secretKey, date), region), "s3"), "aws4_request");
+    std::string signature = hmac(signingKey, toSign);
+    return "AWS4-HMAC-SHA256 Credential=" + accessKey + "/" + scope + ", SignedHeaders=" + signedHeaders +
+           ", Signature=" + hex((const uint8_t *) signature.data(), (int) signature.size());
+}
+
+void SRUploader::finish() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (stopping && workers.empty())
+            return;
+        stopping = true;
+        //a file still followed has no end: its upload cannot complete
+        if (following) {
+            following->failed = true;
+            following->closed = true;
+            following = nullptr;
+        }
+        cv.notify_all();
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+    workers.clear();
+    if (started)
+        elapsed = av_gettime_relative() - started;
+}
+
+int64_t SRUploader::reservedBytes() const {
+    return (int64_t) threads * UPLOAD_PART_SIZE * 4;
+}
+
+SRUploadStats SRUploader::stats() const {
+    SRUploadStats s;
+    s.objects = objects;
+    s.failed = failedObjects;
+    s.parts = sentParts;
+    s.retries = retries;
+    s.bytes = bytes;
+    s.elapsed = elapsed;
+    return s;
+}
@@ -0,0 +1,177 @@
+//
+// Upload of the recording to S3-compatible object storage while it is being written, multipart over libavformat http.
+//
+
+#ifndef CPPSCREENRECORDER_SRUPLOADER_H
+#define CPPSCREENRECORDER_SRUPLOADER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define UPLOAD_PART_SIZE (5 << 20)  //bytes of a part, the smallest S3 takes for all but the last one
+#define UPLOAD_THREADS 4    //parts sent at once
+#define UPLOAD_RETRIES 5    //attempts of a request before its upload is aborted
+#define UPLOAD_RETRY_DELAY 500  //ms before the second attempt, doubled at each of the next ones
+#define UPLOAD_WAIT_FILE 200    //ms before reading again a part the writer has not put in the file yet
+#define UPLOAD_TIMEOUT 30000    //ms a request may go without any byte in or out
+#define UPLOAD_REPLY_SIZE 65536     //bytes of a reply read, at most
+
+/**
+ * Statistics of an SRUploader: objects and parts sent so far, requests sent again, bytes on the wire.
+ */
+typedef struct UL{
+    uint64_t objects;   //complete
+    uint64_t failed;    //aborted
+    uint64_t parts;
+    uint64_t retries;
+    int64_t bytes;
+    int64_t elapsed;    //us from start() to finish()
+}SRUploadStats;
+
+/**
+ * SRUploader sends the files of the recording to a bucket while the recording goes on, so that nothing is left to
+ * upload when it stops: each file is a multipart upload whose parts, UPLOAD_PART_SIZE bytes each, go by
+ * several threads at once.\n
+ * A file that only grows, a fragmented MP4 or a live WebM, is followed: advance() tells how much of it the muxer has
+ * written, every complete part is sent at once and endFollow() sends the last one and completes the object.
+ * upload() sends a finished file, a segment or a playlist the moment the packager closes it, which makes it
+ * available a few seconds after its capture; a multipart object only appears once complete.\n
+ * The parts are read back from the file by the thread sending them, a file smaller than a part by upload():
+ * the file is the backlog, the memory sent at once stays below four times UPLOAD_PART_SIZE per thread (the part,
+ * its hex digits in the options and in http, the copy http sends) however far behind the network is. Each part is checked by the storage against its MD5,
+ * which is also the ETag completing the object. A request failing is sent again after UPLOAD_RETRY_DELAY ms,
+ * doubled each time; after UPLOAD_RETRIES the upload is aborted and the file stays local.\n
+ * The URL is http(s)://host[:port]/bucket[/prefix], the objects are named after the files. The requests are signed
+ * with AWS Signature V4 when AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY are set (AWS_SESSION_TOKEN and AWS_REGION too),
+ * anonymous otherwise, for a bucket open to writes or a signing proxy.
+ *
+ * @Note follow(), advance() and endFollow() are MuxerThread only, upload() may be called from any thread
+ */
+class SRUploader {
+
+private:
+    struct Upload {
+        std::string path;
+        std::string key;    //URI encoded, with the path of the URL
+        std::string id;     //UploadId, empty until created
+        int64_t queued;     //bytes in the parts queued so far
+        int partsPending;   //queued or being sent
+        std::vector<std::string> etags;     //of each part, by number from 1
+        std::vector<uint8_t> data;  //the content of a file smaller than a part, read by upload()
+        bool closed;    //every part is queued
+        bool creating;
+        bool completing;
+        bool failed;
+    };
+    struct Part {
+        Upload *upload;
+        int number;
+        int64_t offset;
+        int size;
+        int64_t notBefore;  //us, when the file had not the part yet
+    };
+
+    std::string scheme;
+    std::string host;   //with the port, as in the Host header
+    std::string path;   //of the URL, URI encoded
+    std::string accessKey;
+    std::string secretKey;
+    std::string sessionToken;
+    std::string region;
+    int threads;
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::list<Upload> uploads;
+    std::deque<Part> parts;
+    Upload *following;  //under lock, cleared by next() when the followed upload failed
+    bool stopping;
+    std::vector<std::thread> workers;
+
+    std::atomic<uint64_t> objects;
+    std::atomic<uint64_t> failedObjects;
+    std::atomic<uint64_t> sentParts;
+    std::atomic<uint64_t> retries;
+    std::atomic<int64_t> bytes;
+    int64_t started;
+    int64_t elapsed;
+
+    Upload *add(const char *file);
+    void queueParts(Upload *upload, int64_t end, bool last);
+    void run();
+    bool next(Upload *&upload, Part &part, int &task);
+    void create(Upload *upload);
+    void send(Part part);
+    void complete(Upload *upload);
+    void abort(Upload *upload);
+    int request(const char *method, const std::string &key, const std::string &query, const std::vector<uint8_t> &body,
+                const std::string &md5, std::string *reply);
+    int retried(const char *method, const std::string &key, const std::string &query, const std::vector<uint8_t> &body,
+                const std::string &md5, std::string *reply);
+    std::string sign(const char *method, const std::string &key, const std::string &query, const std::string &date,
+                     const std::string &time) const;
+
+public:
+    /**
+     * @param url http(s)://host[:port]/bucket[/prefix]
+     * @param threads parts sent at once
+     */
+    SRUploader(const char *url, int threads = UPLOAD_THREADS);
+    ~SRUploader();
+
+    SRUploader(const SRUploader&) = delete;
+    SRUploader &operator=(const SRUploader&) = delete;
+
+    /**
+     * start() reads the credentials and starts the threads
+     * @return 0 on success, a negative AVERROR for a URL it cannot send to
+     */
+    int start();
+
+    /**
+     * follow() starts the upload of file, which the muxer is writing
+     */
+    void follow(const char *file);
+
+    /**
+     * advance() queues the parts the first end bytes of the followed file complete
+     * @Note the bytes must be in the file or on their way to it, flushed from the AVIOContext of the muxer
+     */
+    void advance(int64_t end);
+
+    /**
+     * endFollow() queues the rest of the followed file, closed by now, and completes its object once sent
+     */
+    void endFollow();
+
+    /**
+     * upload() sends file, closed by now, in the background
+     */
+    void upload(const char *file);
+
+    /**
+     * finish() waits until every upload is complete or aborted, and stops the threads
+     */
+    void finish();
+
+    /**
+     * reservedBytes() is the memory of the parts being sent, at most
+     */
+    int64_t reservedBytes() const;
+
+    SRUploadStats stats() const;
+
+    /**
+     * encode() percent-encodes s the way Signature V4 canonicalizes it, '/' kept when slash is set
+     */
+    static std::string encode(const std::string &s, bool slash = false);
+};
+
+#endif //CPPSCREENRECORDER_SRUPLOADER_H
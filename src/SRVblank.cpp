@@ -0,0 +1,165 @@
+//
+// Vertical blank of the display, the clock of the native capture back-ends with settings._vblank.
+//
+
+#include "SRVblank.h"
+#include "SRFrameClock.h"
+
+#include <cmath>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <drm/drm.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#include <dwmapi.h>
+#endif
+
+#ifdef __APPLE__
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <CoreVideo/CoreVideo.h>
+#endif
+
+extern "C"
+{
+#include "libavutil/error.h"
+}
+
+#ifdef __linux__
+struct SRVblank::Source {
+    int fd;
+};
+#elif defined(__APPLE__)
+struct SRVblank::Source {
+    CVDisplayLinkRef link;
+    std::mutex lock;
+    std::condition_variable cv;
+    uint64_t count;     //vblanks so far, under lock
+};
+
+/* the display link thread counts the vblanks, wait() sleeps until the count moves */
+static CVReturn displayLinkFired(CVDisplayLinkRef link, const CVTimeStamp *now, const CVTimeStamp *output,
+                                 CVOptionFlags flagsIn, CVOptionFlags *flagsOut, void *opaque) {
+    (void) link; (void) now; (void) output; (void) flagsIn; (void) flagsOut;
+    SRVblank::Source *source = (SRVblank::Source *) opaque;
+    {
+        std::lock_guard<std::mutex> guard(source->lock);
+        source->count++;
+    }
+    source->cv.notify_all();
+    return kCVReturnSuccess;
+}
+#else
+struct SRVblank::Source {};
+#endif
+
+SRVblank::SRVblank(): source(nullptr), period(0), divisor(1) {}
+
+SRVblank::~SRVblank() {
+    if (!source)
+        return;
+#ifdef __linux__
+    close(source->fd);
+#elif defined(__APPLE__)
+    CVDisplayLinkStop(source->link);
+    CVDisplayLinkRelease(source->link);
+#endif
+    delete source;
+}
+
+int SRVblank::open(const char *device) {
+#ifdef __linux__
+    int fd = ::open(device ? device : VBLANK_DEVICE, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return AVERROR(errno);
+    source = new Source();
+    source->fd = fd;
+#elif defined(_WIN32)
+    (void) device;
+    BOOL composited = FALSE;
+    if (FAILED(DwmIsCompositionEnabled(&composited)) || !composited)
+        return AVERROR(ENOSYS);
+    source = new Source();
+#elif defined(__APPLE__)
+    (void) device;
+    source = new Source();
+    source->count = 0;
+    if (CVDisplayLinkCreateWithActiveCGDisplays(&source->link) != kCVReturnSuccess) {
+        delete source;
+        source = nullptr;
+        return AVERROR(ENOSYS);
+    }
+    CVDisplayLinkSetOutputCallback(source->link, displayLinkFired, source);
+    CVDisplayLinkStart(source->link);
+#else
+    (void) device;
+    return AVERROR(ENOSYS);
+#endif
+
+    //the first wait aligns on a vblank, the next ones are a period apart each
+    int64_t first = waitOne(), last = first;
+    for (int i = 0; i < VBLANK_PROBE && last >= 0; i++)
+        last = waitOne();
+    if (first < 0 || last <= first)
+        return AVERROR(EIO);
+    period = (last - first) / VBLANK_PROBE;
+    return period > 0 ? 0 : AVERROR(EIO);
+}
+
+int64_t SRVblank::setRate(double fps) {
+    double refresh = 1000000.0 / period;
+    //never faster than fps: 144 Hz at 60 fps captures every third vblank, 48 fps; the slack absorbs the measurement
+    divisor = fps > 0 ? (int) ceil(refresh / fps - VBLANK_RATE_SLACK) : 1;
+    if (divisor < 1)
+        divisor = 1;
+    return period * divisor;
+}
+
+/**
+ * waitOne() sleeps until the next vblank
+ * @return its time, monotonic microseconds, a negative AVERROR on failure
+ */
+int64_t SRVblank::waitOne() {
+#ifdef __linux__
+    union drm_wait_vblank vbl = {};
+    vbl.request.type = _DRM_VBLANK_RELATIVE;
+    vbl.request.sequence = 1;
+    int ret;
+    //EINTR: the kernel made the request absolute, asking again waits for the same vblank
+    while ((ret = ioctl(source->fd, DRM_IOCTL_WAIT_VBLANK, &vbl)) < 0 && errno == EINTR);
+    if (ret < 0)
+        return AVERROR(errno);
+    //the timestamps of the reply are on CLOCK_MONOTONIC, the one of SRFrameClock
+    return (int64_t) vbl.reply.tval_sec * 1000000 + vbl.reply.tval_usec;
+#elif defined(_WIN32)
+    if (FAILED(DwmFlush()))
+        return AVERROR(EIO);
+    return SRFrameClock::now();
+#elif defined(__APPLE__)
+    std::unique_lock<std::mutex> guard(source->lock);
+    uint64_t seen = source->count;
+    //a display link that stopped firing (display asleep) must not hang the capture
+    if (!source->cv.wait_for(guard, std::chrono::milliseconds(100), [&](){return source->count != seen;}))
+        return AVERROR(EAGAIN);
+    return SRFrameClock::now();
+#else
+    return AVERROR(ENOSYS);
+#endif
+}
+
+int64_t SRVblank::wait() {
+    int64_t time = 0;
+    for (int i = 0; i < divisor; i++) {
+        time = waitOne();
+        if (time < 0)
+            return time;
+    }
+    return time;
+}
@@ -0,0 +1,65 @@
+//
+// Vertical blank of the display, the clock of the native capture back-ends with settings._vblank.
+//
+
+#ifndef CPPSCREENRECORDER_SRVBLANK_H
+#define CPPSCREENRECORDER_SRVBLANK_H
+
+#include <cstdint>
+
+#define VBLANK_DEVICE "/dev/dri/card0"  //linux: DRM device of the display, its first CRTC is waited on
+#define VBLANK_PROBE 8                  //vblanks timed by open() to measure the refresh period
+#define VBLANK_RATE_SLACK 0.02          //of a divisor, the error of the measured period: 60.02 Hz at 30 fps is every second vblank
+
+/**
+ * SRVblank wakes the capture loop on the vertical blank of the display, where the compositor has finished
+ * a frame: a grab then copies a complete picture, and grabs one period apart never see the same one twice.\n
+ * Linux waits for the DRM vblank event of the first CRTC (DRM_IOCTL_WAIT_VBLANK), Windows for the end of
+ * the composition (DwmFlush), macOS for the CVDisplayLink of the active displays.\n
+ * open() measures the refresh period on VBLANK_PROBE vblanks, the capture rate is then rounded down to a divisor
+ * of the refresh rate: wait() returns every divisor vblanks.
+ *
+ * @Note wait() is meant for a single thread
+ */
+class SRVblank {
+
+public:
+    struct Source;  //of the platform
+
+private:
+    Source *source;
+    int64_t period;     //us of a refresh
+    int divisor;
+
+    int64_t waitOne();
+
+public:
+    SRVblank();
+    ~SRVblank();
+
+    SRVblank(const SRVblank&) = delete;
+    SRVblank &operator=(const SRVblank&) = delete;
+
+    /**
+     * @param device linux: the DRM device, the other platforms take the display of the desktop
+     * @return 0 on success, a negative AVERROR if the platform or the display gives no vblank
+     */
+    int open(const char *device = VBLANK_DEVICE);
+
+    /**
+     * setRate() rounds fps down to a divisor of the refresh rate, so the capture never runs faster than fps
+     * @return the interval of the capture, us
+     */
+    int64_t setRate(double fps);
+
+    /**
+     * wait() sleeps until the divisor-th next vblank
+     * @return its time, monotonic microseconds (SRFrameClock::now()): the timestamp of the frame grabbed now
+     */
+    int64_t wait();
+
+    int64_t refreshPeriod() const { return period; }
+    int refreshDivisor() const { return divisor; }
+};
+
+#endif //CPPSCREENRECORDER_SRVBLANK_H
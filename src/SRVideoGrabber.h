@@ -0,0 +1,73 @@
+//
+// Native video capture back-ends.
+//
+
+#ifndef CPPSCREENRECORDER_SRVIDEOGRABBER_H
+#define CPPSCREENRECORDER_SRVIDEOGRABBER_H
+
+#include <cstdint>
+
+extern "C"
+{
+#include "libavutil/frame.h"
+#include "libavutil/buffer.h"
+#include "libavutil/pixfmt.h"
+}
+
+/* returned by grab() when the captured region did not change since the previous grab */
+#define SR_GRAB_UNCHANGED 1
+
+/**
+ * SRVideoGrabber is a capture back-end that talks to the display system directly,
+ * taking the place of the libavdevice demuxer and of the rawvideo decoder.\n
+ * Frames are produced already decoded, with pts in microseconds (the same clock x11grab uses).
+ */
+class SRVideoGrabber {
+
+public:
+    virtual ~SRVideoGrabber() = default;
+
+    /**
+     * open() connects to the display and prepares the capture of a region
+     * @param device display name, back-end specific
+     * @return 0 on success, a negative AVERROR code otherwise
+     */
+    virtual int open(const char *device, int x, int y, int width, int height) = 0;
+
+    /**
+     * grab() captures the region in frame, allocating its buffers unless it already has them;
+     * the back-ends that allocatesFrames() replace them with their own
+     * @return 0 on success, SR_GRAB_UNCHANGED if nothing changed (frame is left untouched), a negative AVERROR code otherwise
+     */
+    virtual int grab(AVFrame *frame) = 0;
+
+    virtual enum AVPixelFormat pixelFormat() const = 0;
+    virtual const char *name() const = 0;
+
+    /**
+     * hwFramesContext() is the frames context of the device surfaces grab() fills, for the back-ends
+     * that keep the capture on the GPU; grab() then allocates the frames from it, already scaled
+     * @return nullptr for the back-ends producing frames in system memory
+     */
+    virtual AVBufferRef *hwFramesContext() const { return nullptr; }
+
+    /**
+     * allocatesFrames() tells whether grab() hands out buffers of the back-end: the frames given to it
+     * need no buffers of their own
+     */
+    virtual bool allocatesFrames() const { return hwFramesContext() != nullptr; }
+
+    /**
+     * scaledSize() is the size of the system memory frames of a back-end that scales the region itself,
+     * on the GPU before they are read back
+     * @return false for frames of the size of the region
+     */
+    virtual bool scaledSize(int &, int &) const { return false; }
+
+    /**
+     * reservedBytes() is the system memory the back-end may hold for its own buffers, at most
+     */
+    virtual int64_t reservedBytes() const { return 0; }
+};
+
+#endif //CPPSCREENRECORDER_SRVIDEOGRABBER_H
@@ -0,0 +1,298 @@
+#include "SRVideoWall.h"
+#include "SRLog.h"
+
+#include <cstring>
+#include <iostream>
+
+extern "C"
+{
+#include "libavutil/cpu.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/opt.h"
+}
+
+using namespace std;
+
+SRVideoWall::SRVideoWall(const char *filename, int columns, int rows, int bitrate): filename(filename),
+        columns(columns), rows(rows), bitrate(bitrate), canvasWidth(0), canvasHeight(0), ctx(nullptr),
+        started(false), sent(0), dropped(0), encoded(0), bytes(0) {}
+
+SRVideoWall::~SRVideoWall() {
+    finish();
+    //the tasks go before the tiles they step
+    for (auto &tile : tiles)
+        tile->task.reset();
+    tiles.clear();
+    if (ctx) {
+        if (!(ctx->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&ctx->pb);
+        avformat_free_context(ctx);
+    }
+}
+
+int SRVideoWall::open(int width, int height, const AVCodecContext *source) {
+    if (columns <= 0 || rows <= 0 || columns * rows > WALL_TILES_MAX ||
+        width / columns < WALL_TILE_MIN || height / rows < WALL_TILE_MIN) {
+        cout << "\n[SRVideoWall] a " << width << "x" << height << " canvas cannot be split in " << columns << "x" << rows
+             << " tiles";
+        return AVERROR(EINVAL);
+    }
+    int ret = avformat_alloc_output_context2(&ctx, nullptr, nullptr, filename.c_str());
+    if (ret < 0) {
+        cout << "\n[SRVideoWall] cannot guess the container of " << filename;
+        return ret;
+    }
+
+    //H.264 when the build has it, like the renditions
+    const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec)
+        codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    if (!codec)
+        return AVERROR_ENCODER_NOT_FOUND;
+    //the slice threads of the machine shared between the encoders
+    int threads = FFMAX(1, av_cpu_count() / (columns * rows));
+
+    //even tiles for the encoders, the last column and row take what is left
+    canvasWidth = width;
+    canvasHeight = height;
+    int tileWidth = (width / columns) & ~1, tileHeight = (height / rows) & ~1;
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < columns; c++) {
+            std::unique_ptr<Tile> tile(new Tile());
+            tile->x = c * tileWidth;
+            tile->y = r * tileHeight;
+            tile->width = (c == columns - 1 ? width - tile->x : tileWidth) & ~1;
+            tile->height = (r == rows - 1 ? height - tile->y : tileHeight) & ~1;
+            tile->stream = (int) tiles.size();
+            if ((ret = openTile(*tile, codec, source, threads)) < 0)
+                return ret;
+            tiles.push_back(std::move(tile));
+        }
+    }
+
+    if (!(ctx->oformat->flags & AVFMT_NOFILE) &&
+        (ret = avio_open2(&ctx->pb, filename.c_str(), AVIO_FLAG_WRITE, nullptr, nullptr)) < 0) {
+        cout << "\n[SRVideoWall] cannot create " << filename;
+        return ret;
+    }
+    if ((ret = avformat_write_header(ctx, nullptr)) < 0)
+        return ret;
+    cout << "\n[SRVideoWall] " << filename << ": " << columns << "x" << rows << " tracks of " << codec->name << " "
+         << tileWidth << "x" << tileHeight << " at " << bitrate << " kbit/s, " << threads << " threads each";
+    return 0;
+}
+
+/**
+ * openTile() opens the encoder of a tile and adds its track to the output, titled with the place of the tile
+ */
+int SRVideoWall::openTile(Tile &tile, const AVCodec *codec, const AVCodecContext *source, int threads) {
+    AVCodecContext *enc = tile.enc = avcodec_alloc_context3(codec);
+    if (!enc)
+        return AVERROR(ENOMEM);
+    enc->width = tile.width;
+    enc->height = tile.height;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->time_base = source->time_base;
+    enc->framerate = source->framerate.num > 0 ? source->framerate : av_inv_q(source->time_base);
+    //the same frames are keyframes in every track: a seek lands on the whole wall
+    enc->gop_size = (int) (av_q2d(enc->framerate) * WALL_GOP_SECONDS);
+    enc->keyint_min = enc->gop_size;
+    enc->max_b_frames = 0;
+    enc->bit_rate = (int64_t) bitrate * 1000;
+    enc->rc_max_rate = enc->bit_rate;
+    enc->rc_buffer_size = (int) enc->bit_rate;
+    enc->thread_type = FF_THREAD_SLICE;
+    enc->thread_count = threads;
+    if (!strcmp(codec->name, "libx264")) {
+        av_opt_set(enc->priv_data, "preset", "veryfast", 0);
+        av_opt_set(enc->priv_data, "tune", "zerolatency", 0);
+        av_opt_set(enc->priv_data, "x264-params", "scenecut=0", 0);
+    }
+    if (ctx->oformat->flags & AVFMT_GLOBALHEADER)
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    int ret = avcodec_open2(enc, codec, nullptr);
+    if (ret < 0) {
+        cout << "\n[SRVideoWall] cannot open " << codec->name << " for the tile at " << tile.x << "," << tile.y;
+        return ret;
+    }
+
+    AVStream *st = avformat_new_stream(ctx, nullptr);
+    if (!st)
+        return AVERROR(ENOMEM);
+    if ((ret = avcodec_parameters_from_context(st->codecpar, enc)) < 0)
+        return ret;
+    st->time_base = enc->time_base;
+    std::string title = "tile " + to_string(tile.x) + "," + to_string(tile.y) + " " + to_string(tile.width) + "x" +
+                        to_string(tile.height);
+    av_dict_set(&st->metadata, "title", title.c_str(), 0);
+    return tile.converted.initVideo(enc->pix_fmt, tile.width, tile.height, WALL_QUEUE);
+}
+
+void SRVideoWall::start(SRTaskPool *pool) {
+    if (tiles.empty() || started)
+        return;
+    for (auto &owned : tiles) {
+        Tile *tile = owned.get();
+        if (pool) {
+            tile->pkt = av_packet_alloc();
+            tile->task.reset(new SRSerialTask(*pool, [this, tile](){return step(tile);}, SR_TASK_BACKGROUND));
+        } else {
+            tile->encoder = std::thread(&SRVideoWall::run, this, tile);
+        }
+    }
+    started = true;
+}
+
+void SRVideoWall::send(const AVFrame *frame) {
+    if (!started || frame->hw_frames_ctx || frame->format == AV_PIX_FMT_DRM_PRIME ||
+        frame->width < canvasWidth || frame->height < canvasHeight) {
+        dropped++;
+        return;
+    }
+    //only this thread pushes: a queue with room keeps it until the frame is in
+    for (auto &tile : tiles)
+        if (tile->queue.size() >= tile->queue.maxSize()) {
+            dropped++;
+            return;
+        }
+    for (auto &tile : tiles) {
+        AVFrame *queued = tile->refs.getEmpty();
+        if (!queued || av_frame_ref(queued, frame) < 0) {
+            tile->refs.release(queued);
+            srLog(SR_LOG_WARNING, "[SRVideoWall] no memory for the tile at %d,%d, its track misses a frame",
+                  tile->x, tile->y);
+            continue;
+        }
+        //the tile is a window on the buffers of the frame, nothing is copied
+        queued->crop_left = (size_t) tile->x;
+        queued->crop_top = (size_t) tile->y;
+        queued->crop_right = (size_t) (frame->width - tile->x - tile->width);
+        queued->crop_bottom = (size_t) (frame->height - tile->y - tile->height);
+        if (av_frame_apply_cropping(queued, AV_FRAME_CROP_UNALIGNED) < 0 || !tile->queue.tryPush(queued)) {
+            tile->refs.release(queued);
+            continue;
+        }
+        if (tile->task)
+            tile->task->schedule();
+    }
+    sent++;
+}
+
+/**
+ * run() is the encoder thread of a tile: it converts, encodes and writes every queued frame until finish()
+ */
+void SRVideoWall::run(Tile *tile) {
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame;
+    while (tile->queue.pop(frame))
+        encodeFrame(*tile, frame, pkt);
+    drain(*tile, pkt);
+    av_packet_free(&pkt);
+}
+
+/**
+ * step() is the encoder task of a tile: one queued frame per call, the drain once finish() closed the empty queue
+ * @return whether there may be more to do
+ */
+bool SRVideoWall::step(Tile *tile) {
+    AVFrame *frame;
+    if (tile->queue.tryPop(frame)) {
+        encodeFrame(*tile, frame, tile->pkt);
+        return true;
+    }
+    //the queue is closed before the last schedule(): an empty closed queue stays empty
+    if (!tile->queue.isClosed() || tile->queue.size() > 0)
+        return false;
+    std::lock_guard<std::mutex> guard(doneLock);
+    if (!tile->done) {
+        drain(*tile, tile->pkt);
+        tile->done = true;
+        doneCv.notify_all();
+    }
+    return false;
+}
+
+/**
+ * encodeFrame() converts, encodes and writes the tile of frame and gives the reference back to the pool
+ */
+void SRVideoWall::encodeFrame(Tile &tile, AVFrame *frame, AVPacket *pkt) {
+    AVFrame *out = tile.converted.get();
+    if (!out || !pkt || tile.scaler.configure(frame->width, frame->height, (enum AVPixelFormat) frame->format,
+                                              tile.width, tile.height, tile.enc->pix_fmt, SWS_BILINEAR, 1) < 0) {
+        srLog(SR_LOG_ERROR, "[SRVideoWall] cannot convert the tile at %d,%d", tile.x, tile.y);
+        tile.converted.release(out);
+        tile.refs.release(frame);
+        return;
+    }
+    tile.scaler.scale(frame, out);
+    //capture clock microseconds to encoder ticks, the same for every tile of a frame
+    int64_t pts = av_rescale_q(frame->pts, AV_TIME_BASE_Q, tile.enc->time_base);
+    if (tile.lastPts != AV_NOPTS_VALUE && pts <= tile.lastPts)
+        pts = tile.lastPts + 1;
+    out->pts = tile.lastPts = pts;
+    tile.refs.release(frame);
+    encode(tile, out, pkt);
+    tile.converted.release(out);
+    encoded++;
+}
+
+/**
+ * drain() flushes the encoder of a tile, the trailer waits for every tile
+ */
+void SRVideoWall::drain(Tile &tile, AVPacket *pkt) {
+    if (pkt)
+        encode(tile, nullptr, pkt);
+}
+
+/**
+ * encode() gives frame to the encoder of the tile, nullptr drains it, and muxes the packets it has ready
+ */
+void SRVideoWall::encode(Tile &tile, AVFrame *frame, AVPacket *pkt) {
+    if (avcodec_send_frame(tile.enc, frame) < 0) {
+        srLog(SR_LOG_WARNING, "[SRVideoWall] cannot encode the tile at %d,%d", tile.x, tile.y);
+        return;
+    }
+    while (avcodec_receive_packet(tile.enc, pkt) >= 0) {
+        pkt->stream_index = tile.stream;
+        av_packet_rescale_ts(pkt, tile.enc->time_base, ctx->streams[tile.stream]->time_base);
+        bytes += pkt->size;
+        //the muxer interleaves the tracks, the packet is its own after the call
+        std::lock_guard<std::mutex> guard(muxLock);
+        if (av_interleaved_write_frame(ctx, pkt) < 0)
+            srLog(SR_LOG_ERROR, "[SRVideoWall] error in writing %s", filename.c_str());
+    }
+}
+
+void SRVideoWall::finish() {
+    if (!started.exchange(false))
+        return;
+    for (auto &tile : tiles) {
+        tile->queue.close();
+        if (tile->task)
+            tile->task->schedule();
+    }
+    for (auto &tile : tiles) {
+        if (tile->task) {
+            std::unique_lock<std::mutex> guard(doneLock);
+            Tile *waited = tile.get();
+            doneCv.wait(guard, [waited](){return waited->done;});
+        } else {
+            tile->encoder.join();
+        }
+    }
+    av_write_trailer(ctx);
+    cout << "\n[SRVideoWall] " << filename << ": " << sent << " frames in " << tiles.size() << " tracks, "
+         << bytes / 1024 << " KiB";
+    if (dropped)
+        cout << ", " << dropped << " dropped";
+}
+
+int64_t SRVideoWall::reservedBytes() const {
+    int64_t total = 0;
+    for (const auto &tile : tiles)
+        total += (int64_t) av_image_get_buffer_size(AV_PIX_FMT_YUV420P, tile->width, tile->height, 32) * WALL_QUEUE * 2;
+    //a canvas frame lives while any tile still queues it, or converts it: one more than the queue
+    if (!tiles.empty())
+        total += (int64_t) canvasWidth * canvasHeight * 4 * (WALL_QUEUE + 1);
+    return total;
+}
@@ -0,0 +1,141 @@
+//
+// Video wall capture: the captured canvas split into a grid of tiles, each encoded at full size into its own track.
+//
+
+#ifndef CPPSCREENRECORDER_SRVIDEOWALL_H
+#define CPPSCREENRECORDER_SRVIDEOWALL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SRFramePool.h"
+#include "SRRingBuffer.h"
+#include "SRScaler.h"
+#include "SRTaskPool.h"
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+#define WALL_GOP_SECONDS 2  //keyframe interval of every tile, the keyframes of the tracks fall on the same frames
+#define WALL_QUEUE 4        //frames the slowest tile may be behind before a frame is dropped for all of them
+#define WALL_TILES_MAX 64   //tiles of a grid
+#define WALL_TILE_MIN 64    //px of the narrowest or shortest tile
+
+/**
+ * SRVideoWall records a canvas too large for any single encoder (a control room wall of 15360x4320) as a grid of
+ * tiles: each tile has its own encoder, and each encoder its own video track of one output. The tracks share the
+ * timestamps of the canvas and their keyframes (fixed GOP of WALL_GOP_SECONDS, no scene cut), so a player or an
+ * editor puts the wall back together frame for frame; the title of each track tells where its tile goes.\n
+ * send() references the captured frame once per tile, cropped to the tile without a copy, into the bounded queue of
+ * the tile: its encoder thread, or its serial task on a pool, converts the tile with its own SRScaler, encodes it and
+ * writes it through the shared muxer. The tiles run on as many cores as there are, each encoder gets its share of
+ * the slice threads. A frame only goes when every queue has room for it: a slow tile drops the frame for all of them
+ * and the tracks never drift apart.
+ *
+ * @Note system memory frames only, hardware surfaces are dropped
+ */
+class SRVideoWall {
+
+private:
+    struct Tile {
+        int x, y, width, height;
+        AVCodecContext *enc;
+        int stream;
+        SRScaler scaler;
+        SRFramePool refs;
+        SRFramePool converted;
+        SRRingBuffer<AVFrame*> queue;
+        std::thread encoder;
+        std::unique_ptr<SRSerialTask> task;     //instead of the encoder thread
+        AVPacket *pkt;      //of the task
+        bool done;          //drained, under doneLock
+        int64_t lastPts;    //encoder thread only
+
+        Tile(): x(0), y(0), width(0), height(0), enc(nullptr), stream(0), queue(WALL_QUEUE, SR_WAIT_PARK),
+                pkt(nullptr), done(false), lastPts(AV_NOPTS_VALUE) {}
+        ~Tile() {
+            av_packet_free(&pkt);
+            avcodec_free_context(&enc);
+        }
+    };
+
+    std::string filename;
+    int columns, rows, bitrate;
+    int canvasWidth, canvasHeight;
+    AVFormatContext *ctx;
+    std::vector<std::unique_ptr<Tile>> tiles;
+    std::mutex muxLock;
+    std::mutex doneLock;
+    std::condition_variable doneCv;
+    std::atomic<bool> started;
+
+    std::atomic<uint64_t> sent;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> encoded;      //tile frames
+    std::atomic<int64_t> bytes;
+
+    int openTile(Tile &tile, const AVCodec *codec, const AVCodecContext *source, int threads);
+    void run(Tile *tile);
+    bool step(Tile *tile);
+    void encodeFrame(Tile &tile, AVFrame *frame, AVPacket *pkt);
+    void drain(Tile &tile, AVPacket *pkt);
+    void encode(Tile &tile, AVFrame *frame, AVPacket *pkt);
+
+public:
+    /**
+     * @param columns tiles across the canvas
+     * @param rows tiles down the canvas
+     * @param bitrate kbit/s of each tile
+     */
+    SRVideoWall(const char *filename, int columns, int rows, int bitrate);
+    ~SRVideoWall();
+
+    SRVideoWall(const SRVideoWall&) = delete;
+    SRVideoWall &operator=(const SRVideoWall&) = delete;
+
+    /**
+     * open() splits the canvas, opens the encoder of every tile and writes the header of the output
+     * @param width size of the captured canvas
+     * @param source encoder of the recording: frame rate and time base are shared
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int open(int width, int height, const AVCodecContext *source);
+
+    /**
+     * start() starts an encoder thread per tile, or a serial task per tile at background priority on pool when given
+     */
+    void start(SRTaskPool *pool = nullptr);
+
+    /**
+     * send() queues a cropped reference of frame for every tile, without ever waiting
+     * @Note one thread only (the VideoThread), frame pts in microseconds on the capture clock
+     */
+    void send(const AVFrame *frame);
+
+    /**
+     * finish() encodes what is queued, drains the encoders and writes the trailer
+     */
+    void finish();
+
+    const std::string &name() const { return filename; }
+    int tileCount() const { return (int) tiles.size(); }
+    uint64_t sentFrames() const { return sent; }
+    uint64_t droppedFrames() const { return dropped; }
+    uint64_t encodedTiles() const { return encoded; }
+
+    /**
+     * reservedBytes() estimates the memory of the wall: the converted tiles of the queues and as many in the encoders,
+     * and the captured canvas frames the queued tile references keep alive, 4 bytes a pixel at most
+     */
+    int64_t reservedBytes() const;
+};
+
+#endif //CPPSCREENRECORDER_SRVIDEOWALL_H
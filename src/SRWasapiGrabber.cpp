@@ -0,0 +1,175 @@
+#include "SRWasapiGrabber.h"
+#include "SRLog.h"
+
+#ifdef _WIN32
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <avrt.h>
+#include <mmreg.h>
+
+extern "C"
+{
+#include "libavutil/time.h"
+}
+
+using namespace std;
+
+SRWasapiGrabber::SRWasapiGrabber(): endpoint(nullptr), client(nullptr), capture(nullptr), event(nullptr), format(nullptr),
+                                    codec(AV_CODEC_ID_NONE), mmcss(nullptr), comInitialized(false) {
+    counterFrequency.QuadPart = 0;
+}
+
+SRWasapiGrabber::~SRWasapiGrabber() {
+    if (client) client->Stop();
+    if (capture) capture->Release();
+    if (client) client->Release();
+    if (endpoint) endpoint->Release();
+    if (format) CoTaskMemFree(format);
+    if (event) CloseHandle(event);
+    if (comInitialized) CoUninitialize();
+}
+
+/**
+ * mixFormatCodec() is the PCM decoder of a shared-mode mix format:
+ * the extensible formats carry the plain format tag in the first field of their subtype GUID
+ */
+static enum AVCodecID mixFormatCodec(const WAVEFORMATEX *format) {
+    WORD tag = format->wFormatTag;
+    if (tag == WAVE_FORMAT_EXTENSIBLE)
+        tag = (WORD) ((const WAVEFORMATEXTENSIBLE *) format)->SubFormat.Data1;
+    if (tag == WAVE_FORMAT_IEEE_FLOAT && format->wBitsPerSample == 32)
+        return AV_CODEC_ID_PCM_F32LE;
+    if (tag != WAVE_FORMAT_PCM)
+        return AV_CODEC_ID_NONE;
+    switch (format->wBitsPerSample) {
+        case 16: return AV_CODEC_ID_PCM_S16LE;
+        case 24: return AV_CODEC_ID_PCM_S24LE;
+        case 32: return AV_CODEC_ID_PCM_S32LE;
+        default: return AV_CODEC_ID_NONE;
+    }
+}
+
+int SRWasapiGrabber::open(const char *device, int sampleRate, int channels, int fragmentUs) {
+    //shared mode records in the engine mix format, whatever is asked
+    (void) sampleRate; (void) channels;
+
+    HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+    comInitialized = SUCCEEDED(hr);
+    if (FAILED(hr) && hr != RPC_E_CHANGED_MODE)
+        return AVERROR(EIO);
+
+    string name = device && *device ? device : "default";
+    bool loopback = name.compare(0, 8, "loopback") == 0;
+    string id = loopback ? (name.size() > 9 ? name.substr(9) : "") : (name == "default" ? "" : name);
+
+    IMMDeviceEnumerator *enumerator = nullptr;
+    hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_ALL, __uuidof(IMMDeviceEnumerator),
+                          (void **) &enumerator);
+    if (FAILED(hr)) {
+        cout << "\n[SRWasapiGrabber] cannot create the device enumerator";
+        return AVERROR(EIO);
+    }
+    if (id.empty()) {
+        hr = enumerator->GetDefaultAudioEndpoint(loopback ? eRender : eCapture, eConsole, &endpoint);
+    } else {
+        vector<wchar_t> wide(id.size() + 1);
+        MultiByteToWideChar(CP_UTF8, 0, id.c_str(), -1, wide.data(), (int) wide.size());
+        hr = enumerator->GetDevice(wide.data(), &endpoint);
+    }
+    enumerator->Release();
+    if (FAILED(hr)) {
+        cout << "\n[SRWasapiGrabber] cannot find the endpoint " << name;
+        return AVERROR(ENODEV);
+    }
+
+    if (FAILED(endpoint->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr, (void **) &client)) ||
+        FAILED(client->GetMixFormat(&format))) {
+        cout << "\n[SRWasapiGrabber] cannot activate " << name;
+        return AVERROR(EIO);
+    }
+    codec = mixFormatCodec(format);
+    if (codec == AV_CODEC_ID_NONE) {
+        cout << "\n[SRWasapiGrabber] unsupported mix format";
+        return AVERROR(ENOSYS);
+    }
+
+    //the buffer is one fragment: the engine signals every period and read() empties it right away
+    DWORD flags = AUDCLNT_STREAMFLAGS_EVENTCALLBACK | (loopback ? AUDCLNT_STREAMFLAGS_LOOPBACK : 0);
+    hr = client->Initialize(AUDCLNT_SHAREMODE_SHARED, flags, (REFERENCE_TIME) fragmentUs * 10, 0, format, nullptr);
+    if (FAILED(hr)) {
+        cout << "\n[SRWasapiGrabber] cannot initialize " << name << " (0x" << hex << hr << dec << ")";
+        return AVERROR(EIO);
+    }
+    event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (!event || FAILED(client->SetEventHandle(event)) ||
+        FAILED(client->GetService(__uuidof(IAudioCaptureClient), (void **) &capture))) {
+        cout << "\n[SRWasapiGrabber] cannot set up the capture of " << name;
+        return AVERROR(EIO);
+    }
+    QueryPerformanceFrequency(&counterFrequency);
+
+    REFERENCE_TIME period = 0;
+    client->GetDevicePeriod(&period, nullptr);
+    cout << "\n[SRWasapiGrabber] " << name << ", " << format->nSamplesPerSec << " Hz, " << period / 10000 << " ms period";
+    if (FAILED(client->Start()))
+        return AVERROR(EIO);
+    return 0;
+}
+
+int SRWasapiGrabber::read(AVPacket *pkt) {
+    //the AudioThread is the one calling: it gets the audio scheduling class on its first read
+    if (!mmcss) {
+        DWORD task = 0;
+        mmcss = AvSetMmThreadCharacteristicsW(L"Pro Audio", &task);
+    }
+
+    UINT32 frames = 0;
+    while (true) {
+        if (FAILED(capture->GetNextPacketSize(&frames)))
+            return AVERROR(EIO);
+        if (frames)
+            break;
+        DWORD wait = WaitForSingleObject(event, WASAPI_WAIT);
+        if (wait == WAIT_TIMEOUT)
+            return AVERROR(EAGAIN);
+        if (wait != WAIT_OBJECT_0)
+            return AVERROR(EIO);
+    }
+
+    BYTE *data = nullptr;
+    DWORD flags = 0;
+    UINT64 position = 0, counter = 0;
+    HRESULT hr = capture->GetBuffer(&data, &frames, &flags, &position, &counter);
+    if (FAILED(hr)) {
+        srLog(SR_LOG_ERROR, "[SRWasapiGrabber] recording failed (0x%lx)", (unsigned long) hr);
+        return AVERROR(EIO);
+    }
+
+    //counter is the performance counter time of the device position, in 100 ns units
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    int64_t wall = av_gettime();
+    int64_t nowTicks = (int64_t) (now.QuadPart / counterFrequency.QuadPart * 10000000 +
+                                  now.QuadPart % counterFrequency.QuadPart * 10000000 / counterFrequency.QuadPart);
+    int64_t pts = flags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR
+                  ? wall - (int64_t) frames * 1000000 / format->nSamplesPerSec
+                  : wall - (nowTicks - (int64_t) counter) / 10;
+
+    int bytes = (int) (frames * format->nBlockAlign);
+    int ret = av_new_packet(pkt, bytes);
+    if (ret >= 0) {
+        if (flags & AUDCLNT_BUFFERFLAGS_SILENT)
+            memset(pkt->data, 0, bytes);
+        else
+            memcpy(pkt->data, data, bytes);
+        pkt->pts = pkt->dts = pts;
+        pkt->stream_index = 0;
+    }
+    capture->ReleaseBuffer(frames);
+    return ret;
+}
+
+#endif
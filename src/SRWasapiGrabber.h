@@ -0,0 +1,59 @@
+//
+// WASAPI shared-mode audio grabber, event driven, with loopback of the output.
+//
+
+#ifndef CPPSCREENRECORDER_SRWASAPIGRABBER_H
+#define CPPSCREENRECORDER_SRWASAPIGRABBER_H
+
+#ifdef _WIN32
+
+#include <windows.h>
+#include <mmdeviceapi.h>
+#include <audioclient.h>
+#include "SRAudioGrabber.h"
+
+#define WASAPI_WAIT 100     //ms read() waits for a packet before giving the AudioThread back
+
+/**
+ * SRWasapiGrabber records an endpoint in shared mode, woken by the audio engine every period
+ * (AUDCLNT_STREAMFLAGS_EVENTCALLBACK) instead of going through the DirectShow buffering.\n
+ * The device is "default" (the default microphone), "loopback" (what the default output plays),
+ * an endpoint id, or "loopback:" followed by the endpoint id of an output.\n
+ * Packets are stamped with the performance counter time the engine reports for their device position,
+ * moved onto the wall clock; samples come in the engine mix format, the resampler converts them.
+ *
+ * @Note a loopback endpoint delivers nothing while the output is silent: read() returns AVERROR(EAGAIN)
+ * after WASAPI_WAIT ms and the gap shows in the timestamps
+ */
+class SRWasapiGrabber : public SRAudioGrabber {
+
+private:
+    IMMDevice *endpoint;
+    IAudioClient *client;
+    IAudioCaptureClient *capture;
+    HANDLE event;
+    WAVEFORMATEX *format;
+    enum AVCodecID codec;
+    LARGE_INTEGER counterFrequency;
+    HANDLE mmcss;
+    bool comInitialized;
+
+public:
+    SRWasapiGrabber();
+    ~SRWasapiGrabber() override;
+
+    SRWasapiGrabber(const SRWasapiGrabber&) = delete;
+    SRWasapiGrabber &operator=(const SRWasapiGrabber&) = delete;
+
+    int open(const char *device, int sampleRate, int channels, int fragmentUs) override;
+    int read(AVPacket *pkt) override;
+
+    enum AVCodecID codecId() const override { return codec; }
+    int sampleRate() const override { return format ? (int) format->nSamplesPerSec : 0; }
+    int channels() const override { return format ? format->nChannels : 0; }
+    const char *name() const override { return "wasapi"; }
+};
+
+#endif
+
+#endif //CPPSCREENRECORDER_SRWASAPIGRABBER_H
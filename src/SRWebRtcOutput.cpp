@@ -0,0 +1,531 @@
+#include "SRWebRtcOutput.h"
+#include "SRLog.h"
+
+#include <climits>
+#include <cstring>
+#include <iostream>
+
+extern "C"
+{
+#include "libavutil/common.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/parseutils.h"
+#include "libavutil/random_seed.h"
+#include "libavutil/time.h"
+}
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#define socketOf(s) ((SOCKET) (s))
+#define closeSocket(s) closesocket(socketOf(s))
+#define pollSockets WSAPoll
+#else
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define socketOf(s) ((int) (s))
+#define closeSocket(s) close(socketOf(s))
+#define pollSockets poll
+#endif
+
+using namespace std;
+
+#define NTP_OFFSET_US 2208988800000000LL    //us from 1900, the NTP epoch, to 1970
+
+/* middle 32 bits of the NTP time of the wall clock, the unit of LSR and DLSR: 1/65536 s */
+static uint32_t ntpMiddle(int64_t wallUs) {
+    int64_t ntp = wallUs + NTP_OFFSET_US;
+    uint64_t seconds = (uint64_t) (ntp / 1000000), fraction = (uint64_t) ((ntp % 1000000) << 32) / 1000000;
+    return (uint32_t) ((((seconds << 32) | fraction) >> 16) & 0xffffffff);
+}
+
+SRWebRtcOutput::SRWebRtcOutput(const char *url, size_t queuePackets): url(url), port(0), secure(false), sock(-1),
+        videoTrack(-1), queue(queuePackets, SR_WAIT_PARK), filtered(nullptr), stopping(false), datagram(), nextSend(0),
+        history(WEBRTC_HISTORY), historySeq(WEBRTC_HISTORY, -1), maxKbps(0), estimate(0), appliedKbps(0), minRtt(-1),
+        lastReport(0), lastKeyframe(0), target(0), bucketBytes(0), bucketTime(0), counters() {
+    pool.reserve((int) queuePackets + 1);
+    counters.rtt = -1;
+}
+
+SRWebRtcOutput::~SRWebRtcOutput() {
+    finish();
+    for (Track &track : tracks) {
+        if (track.ctx->pb) {
+            av_freep(&track.ctx->pb->buffer);
+            avio_context_free(&track.ctx->pb);
+        }
+        avformat_free_context(track.ctx);
+        av_bsf_free(&track.bsf);
+    }
+    av_packet_free(&filtered);
+    if (sock != -1)
+        closeSocket(sock);
+}
+
+/**
+ * openTrack() opens the RTP muxer of source, its packets written through writePacket() a datagram at a time
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int SRWebRtcOutput::openTrack(const AVStream *source, int payloadType) {
+    Track track = {nullptr, nullptr, source->time_base, av_get_random_seed() | 1, true};
+    string session = "rtp://" + host + ":" + to_string(port);
+    int ret = avformat_alloc_output_context2(&track.ctx, av_guess_format("rtp", nullptr, nullptr), nullptr, session.c_str());
+    if (ret < 0)
+        return ret;
+    tracks.push_back(track);
+    Track &t = tracks.back();
+    const AVCodecParameters *par = source->codecpar;
+    if (par->codec_id == AV_CODEC_ID_H264 && par->extradata_size > 0 && par->extradata[0] == 1) {
+        //the browsers start on an IDR that carries its parameter sets, the SDP of a gateway is not enough
+        const AVBitStreamFilter *filter = av_bsf_get_by_name("h264_mp4toannexb");
+        if (!filter || (ret = av_bsf_alloc(filter, &t.bsf)) < 0)
+            return filter ? ret : AVERROR_BSF_NOT_FOUND;
+        if ((ret = avcodec_parameters_copy(t.bsf->par_in, par)) < 0)
+            return ret;
+        t.bsf->time_base_in = source->time_base;
+        if ((ret = av_bsf_init(t.bsf)) < 0)
+            return ret;
+        par = t.bsf->par_out;
+    }
+    AVStream *st = avformat_new_stream(t.ctx, nullptr);
+    if (!st)
+        return AVERROR(ENOMEM);
+    if ((ret = avcodec_parameters_copy(st->codecpar, par)) < 0)
+        return ret;
+    st->codecpar->codec_tag = 0;
+    st->time_base = source->time_base;
+
+    uint8_t *buffer = (uint8_t *) av_malloc(WEBRTC_MTU);
+    if (!buffer || !(t.ctx->pb = avio_alloc_context(buffer, WEBRTC_MTU, 1, this, nullptr, writePacket, nullptr))) {
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+    //room for the protection of each datagram
+    t.ctx->pb->max_packet_size = WEBRTC_MTU - SRTP_OVERHEAD;
+
+    AVDictionary *options = nullptr;
+    av_dict_set_int(&options, "payload_type", payloadType, 0);
+    av_dict_set_int(&options, "ssrc", (int32_t) t.ssrc, 0);
+    //the RTP muxer still calls its VP9 payload experimental
+    if (par->codec_id == AV_CODEC_ID_VP9)
+        t.ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+    ret = avformat_write_header(t.ctx, &options);
+    av_dict_free(&options);
+    return ret;
+}
+
+int SRWebRtcOutput::init(const AVFormatContext *source, int videoStream, int64_t bitrate) {
+    char proto[16], hostname[256], path[1024];
+    av_url_split(proto, sizeof(proto), nullptr, 0, hostname, sizeof(hostname), &port, path, sizeof(path), url.c_str());
+    secure = !strcmp(proto, "srtp");
+    if ((strcmp(proto, "rtp") && !secure) || !*hostname || port <= 0) {
+        cout << "\n[SRWebRtcOutput] " << url << " is not rtp://host:port nor srtp://host:port?key=...";
+        return AVERROR(EINVAL);
+    }
+    host = hostname;
+    char key[128] = "", peerKey[128] = "";
+    if (secure) {
+        const char *query = strchr(path, '?');
+        if (query) {
+            av_find_info_tag(key, sizeof(key), "key", query);
+            av_find_info_tag(peerKey, sizeof(peerKey), "peerkey", query);
+        }
+        if (!srtp.init(key) || !peerSrtp.init(*peerKey ? peerKey : key)) {
+            cout << "\n[SRWebRtcOutput] the keys of " << host << " are not base64 keys of " << SRTP_MASTER_SIZE << " bytes";
+            return AVERROR(EINVAL);
+        }
+    }
+
+    //connected: only the peer's datagrams come back, the gateway learns the address of the first one (comedia)
+    avformat_network_init();
+    struct addrinfo hints, *peer = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &peer) || !peer) {
+        cout << "\n[SRWebRtcOutput] cannot resolve " << host;
+        return AVERROR(EIO);
+    }
+    sock = (intptr_t) socket(peer->ai_family, SOCK_DGRAM, 0);
+    int ret = sock == -1 || connect(socketOf(sock), peer->ai_addr, (int) peer->ai_addrlen) ? AVERROR(EIO) : 0;
+    freeaddrinfo(peer);
+    if (ret < 0) {
+        cout << "\n[SRWebRtcOutput] cannot open a socket to " << host << ":" << port;
+        return ret;
+    }
+
+    int audioStream = -1;
+    for (unsigned int i = 0; i < source->nb_streams; i++)
+        if (source->streams[i]->codecpar->codec_id == AV_CODEC_ID_OPUS) {
+            audioStream = (int) i;
+            break;
+        }
+    if (videoStream >= 0) {
+        AVCodecID id = source->streams[videoStream]->codecpar->codec_id;
+        if (id != AV_CODEC_ID_H264 && id != AV_CODEC_ID_VP8 && id != AV_CODEC_ID_VP9) {
+            cout << "\n[SRWebRtcOutput] the browsers take H.264, VP8 or VP9, not " << avcodec_get_name(id);
+            return AVERROR(EINVAL);
+        }
+    }
+    if (videoStream < 0 && audioStream < 0) {
+        cout << "\n[SRWebRtcOutput] nothing to send: no video and no Opus track";
+        return AVERROR(EINVAL);
+    }
+    if (!(filtered = av_packet_alloc()))
+        return AVERROR(ENOMEM);
+    trackOf.assign(source->nb_streams, -1);
+    for (int stream : {videoStream, audioStream}) {
+        if (stream < 0)
+            continue;
+        if ((ret = openTrack(source->streams[stream], stream == videoStream ? WEBRTC_VIDEO_PT : WEBRTC_AUDIO_PT)) < 0) {
+            cout << "\n[SRWebRtcOutput] cannot open the RTP session of stream " << stream;
+            return ret;
+        }
+        trackOf[stream] = (int) tracks.size() - 1;
+        if (stream == videoStream)
+            videoTrack = trackOf[stream];
+    }
+    if (audioStream < 0 && source->nb_streams > (unsigned int) (videoStream >= 0))
+        srLog(SR_LOG_WARNING, "[SRWebRtcOutput] no Opus track, %s gets the video only", url.c_str());
+
+    vector<AVFormatContext*> sessions;
+    for (Track &track : tracks)
+        sessions.push_back(track.ctx);
+    char sdp[4096];
+    if (av_sdp_create(sessions.data(), (int) sessions.size(), sdp, sizeof(sdp)) >= 0) {
+        //RTCP comes and goes on the port of RTP; SDES gives the peer the key of what it receives (RFC 4568)
+        for (const char *line = sdp; *line; ) {
+            const char *end = strchr(line, '\n');
+            size_t length = end ? (size_t) (end - line + 1) : strlen(line);
+            string text(line, length);
+            size_t profile = text.find(" RTP/AVP ");
+            if (secure && !strncmp(line, "m=", 2) && profile != string::npos)
+                text.replace(profile, 9, " RTP/SAVP ");
+            sdpText += text;
+            if (!strncmp(line, "m=", 2)) {
+                sdpText += "a=rtcp-mux\r\n";
+                if (secure)
+                    sdpText += string("a=crypto:1 AES_CM_128_HMAC_SHA1_80 inline:") + key + "\r\n";
+            }
+            line += length;
+        }
+    }
+
+    maxKbps = (int) (bitrate / 1000);
+    estimate = appliedKbps = maxKbps;
+    target = maxKbps;
+    counters.targetKbps = maxKbps;
+    return 0;
+}
+
+/**
+ * writePacket() is the AVIOContext of every RTP muxer: each flush is one RTP or RTCP datagram
+ */
+int SRWebRtcOutput::writePacket(void *opaque, uint8_t *buf, int size) {
+    ((SRWebRtcOutput *) opaque)->transmit(buf, size);
+    return size;
+}
+
+/**
+ * transmit() protects a datagram of the muxers, keeps the video ones for NACK and sends it at the pace of the target
+ * @Note writer thread only
+ */
+void SRWebRtcOutput::transmit(const uint8_t *packet, int size) {
+    if (size < 8 || size > WEBRTC_MTU - SRTP_OVERHEAD)
+        return;
+    memcpy(datagram, packet, size);
+    //RFC 5761: payload types 192 to 223 are RTCP, the dynamic ones of RTP are above
+    bool rtcp = datagram[1] >= 192 && datagram[1] <= 223;
+    int length = size;
+    if (secure)
+        length = rtcp ? srtp.protectRtcp(datagram, size) : srtp.protectRtp(datagram, size);
+    if (length < 0)
+        return;
+
+    if (!rtcp && size >= 12 && videoTrack >= 0 && AV_RB32(&datagram[8]) == tracks[videoTrack].ssrc) {
+        uint16_t seq = AV_RB16(&datagram[2]);
+        std::lock_guard<std::mutex> guard(historyLock);
+        history[seq % WEBRTC_HISTORY].assign(datagram, datagram + length);
+        historySeq[seq % WEBRTC_HISTORY] = seq;
+    }
+
+    int64_t now = av_gettime_relative();
+    int kbps = target.load(std::memory_order_relaxed);
+    if (kbps > 0) {
+        if (nextSend > now)
+            av_usleep((unsigned int) (nextSend - now));
+        nextSend = FFMAX(nextSend, now) + (int64_t) (length * 8000.0 / (kbps * WEBRTC_PACE_FACTOR));
+    }
+    //a full socket buffer loses the datagram like the network would, NACK or the refresh repair it
+    ::send(socketOf(sock), (const char *) datagram, length, 0);
+    std::lock_guard<std::mutex> guard(statsLock);
+    if (!rtcp) {
+        counters.packets++;
+        counters.bytes += length;
+    }
+}
+
+void SRWebRtcOutput::start() {
+    if (tracks.empty() || writer.joinable())
+        return;
+    stopping = false;
+    writer = std::thread(&SRWebRtcOutput::run, this);
+    feedback = std::thread(&SRWebRtcOutput::listen, this);
+    srLog(SR_LOG_INFO, "[SRWebRtcOutput] sending to %s:%d%s", host.c_str(), port, secure ? " over SRTP" : "");
+}
+
+void SRWebRtcOutput::drainBucket(int64_t now) {
+    if (bucketTime)
+        bucketBytes = FFMAX(0.0, bucketBytes - (now - bucketTime) * target.load(std::memory_order_relaxed) / 8000.0);
+    bucketTime = now;
+}
+
+void SRWebRtcOutput::send(const AVPacket *pkt) {
+    unsigned int stream = pkt->stream_index;
+    int index = stream < trackOf.size() ? trackOf[stream] : -1;
+    if (index < 0)
+        return;
+    Track &track = tracks[index];
+    if (track.skipToKey && !(pkt->flags & AV_PKT_FLAG_KEY)) {
+        std::lock_guard<std::mutex> guard(statsLock);
+        counters.droppedPackets++;
+        return;
+    }
+    track.skipToKey = false;
+
+    AVPacket *queued = pool.get();
+    if (!queued || av_packet_ref(queued, pkt) < 0 || !queue.tryPush(queued)) {
+        pool.release(queued);
+        track.skipToKey = true;
+        std::lock_guard<std::mutex> guard(statsLock);
+        counters.droppedPackets++;
+        return;
+    }
+    //only what leaves fills the bucket, the dropped packets would hold the congestion on
+    if (index == videoTrack && maxKbps > 0) {
+        std::lock_guard<std::mutex> guard(bucketLock);
+        drainBucket(av_gettime_relative());
+        bucketBytes += pkt->size;
+    }
+}
+
+bool SRWebRtcOutput::congested() {
+    if (maxKbps <= 0)
+        return false;
+    std::lock_guard<std::mutex> guard(bucketLock);
+    drainBucket(av_gettime_relative());
+    return bucketBytes > target.load(std::memory_order_relaxed) * (double) WEBRTC_DROP_WINDOW / 8;
+}
+
+/**
+ * run() is the writer thread: every queued packet through its muxer, the trailers (RTCP BYE) at the end
+ */
+void SRWebRtcOutput::run() {
+    AVPacket *pkt;
+    while (queue.pop(pkt)) {
+        Track &track = tracks[trackOf[pkt->stream_index]];
+        AVPacket *out = pkt;
+        int ret = 0;
+        if (track.bsf)
+            ret = av_bsf_send_packet(track.bsf, pkt);
+        while (ret >= 0) {
+            if (track.bsf) {
+                if (av_bsf_receive_packet(track.bsf, filtered) < 0)
+                    break;
+                out = filtered;
+            }
+            out->stream_index = 0;
+            av_packet_rescale_ts(out, track.sourceTimeBase, track.ctx->streams[0]->time_base);
+            if (av_write_frame(track.ctx, out) < 0)
+                srLog(SR_LOG_WARNING, "[SRWebRtcOutput] a packet of %s could not be packetized", url.c_str());
+            if (!track.bsf)
+                break;
+            av_packet_unref(filtered);
+        }
+        pool.release(pkt);
+    }
+    for (Track &track : tracks)
+        av_write_trailer(track.ctx);
+}
+
+/**
+ * listen() is the feedback thread: the RTCP of the peer, answered as it comes
+ */
+void SRWebRtcOutput::listen() {
+    uint8_t packet[2048];
+    struct pollfd fd;
+    fd.fd = socketOf(sock);
+    fd.events = POLLIN;
+    while (!stopping.load(std::memory_order_relaxed)) {
+        fd.revents = 0;
+        if (pollSockets(&fd, 1, WEBRTC_POLL_TIMEOUT) <= 0 || !(fd.revents & POLLIN))
+            continue;
+        int size = (int) recv(socketOf(sock), (char *) packet, sizeof(packet), 0);
+        if (size < 8 || packet[1] < 192 || packet[1] > 223)
+            continue;
+        if (secure && (size = peerSrtp.unprotectRtcp(packet, size)) < 0) {
+            srLog(SR_LOG_DEBUG, "[SRWebRtcOutput] an RTCP packet of %s failed authentication", host.c_str());
+            continue;
+        }
+        onRtcp(packet, size);
+    }
+}
+
+/**
+ * onRtcp() walks the compound packet: receiver reports (in SR and RR), NACK, PLI, FIR and REMB
+ */
+void SRWebRtcOutput::onRtcp(const uint8_t *packet, int size) {
+    while (size >= 8) {
+        int length = (AV_RB16(&packet[2]) + 1) * 4, count = packet[0] & 0x1f, type = packet[1];
+        if (length > size)
+            return;
+        if (type == 200 || type == 201) {
+            //SR: 20 bytes of sender info before the report blocks
+            int offset = type == 200 ? 28 : 8;
+            for (int i = 0; i < count && offset + 24 <= length; i++, offset += 24)
+                onReport(packet + offset);
+        } else if (type == 205 && count == 1 && length >= 12 && videoTrack >= 0 &&
+                   AV_RB32(&packet[8]) == tracks[videoTrack].ssrc) {
+            onNack(packet + 12, length - 12);
+        } else if (type == 206 && (count == 1 || count == 4)) {
+            int64_t now = av_gettime_relative();
+            bool ours = count == 1 ? videoTrack >= 0 && AV_RB32(&packet[8]) == tracks[videoTrack].ssrc :
+                        length >= 16 && videoTrack >= 0 && AV_RB32(&packet[12]) == tracks[videoTrack].ssrc;
+            if (ours && now - lastKeyframe >= (int64_t) WEBRTC_KEYFRAME_GAP * 1000) {
+                lastKeyframe = now;
+                {
+                    std::lock_guard<std::mutex> guard(statsLock);
+                    counters.keyframeRequests++;
+                }
+                if (keyframeCallback)
+                    keyframeCallback();
+            }
+        } else if (type == 206 && count == 15 && length >= 24 && !memcmp(&packet[12], "REMB", 4)) {
+            uint32_t word = AV_RB32(&packet[16]);
+            uint64_t bps = (uint64_t) (word & 0x3ffff) << ((word >> 18) & 0x3f);
+            onRemb((int) FFMIN(bps / 1000, (uint64_t) INT_MAX));
+        }
+        packet += length;
+        size -= length;
+    }
+}
+
+/**
+ * onReport() takes the report block of the video: loss and round trip
+ */
+void SRWebRtcOutput::onReport(const uint8_t *block) {
+    if (videoTrack < 0 || AV_RB32(block) != tracks[videoTrack].ssrc)
+        return;
+    double loss = block[4] / 256.0;
+    uint32_t lsr = AV_RB32(&block[16]), dlsr = AV_RB32(&block[20]);
+    int rtt = -1;
+    if (lsr) {
+        uint32_t elapsed = ntpMiddle(av_gettime()) - lsr - dlsr;
+        if (elapsed < 65536 * 10)
+            rtt = (int) (((int64_t) elapsed * 1000) >> 16);
+    }
+    if (rtt >= 0)
+        minRtt = minRtt < 0 ? rtt : FFMIN(minRtt, rtt);
+    int64_t now = av_gettime_relative();
+    if (maxKbps > 0) {
+        if (loss > 0.10)
+            estimate *= 1 - 0.5 * loss;
+        else if (rtt >= 0 && rtt - minRtt > WEBRTC_QUEUE_DELAY)
+            estimate *= 0.85;
+        else if (loss < 0.02 && lastReport)
+            estimate *= 1 + 0.08 * FFMIN((now - lastReport) / 1000000.0, 1.0);
+    }
+    lastReport = now;
+    {
+        std::lock_guard<std::mutex> guard(statsLock);
+        counters.reports++;
+        counters.loss = loss;
+        if (rtt >= 0)
+            counters.rtt = rtt;
+    }
+    updateTarget();
+}
+
+void SRWebRtcOutput::onRemb(int kbps) {
+    {
+        std::lock_guard<std::mutex> guard(statsLock);
+        counters.rembKbps = kbps;
+    }
+    updateTarget();
+}
+
+/**
+ * onNack() sends again the video packets of the generic NACK fields still in the history
+ */
+void SRWebRtcOutput::onNack(const uint8_t *fci, int size) {
+    vector<vector<uint8_t>> resend;
+    {
+        std::lock_guard<std::mutex> guard(historyLock);
+        for (; size >= 4; fci += 4, size -= 4) {
+            uint16_t pid = AV_RB16(fci), blp = AV_RB16(&fci[2]);
+            for (int i = 0; i <= 16; i++) {
+                if (i > 0 && !(blp & (1 << (i - 1))))
+                    continue;
+                uint16_t seq = (uint16_t) (pid + i);
+                if (historySeq[seq % WEBRTC_HISTORY] == seq)
+                    resend.push_back(history[seq % WEBRTC_HISTORY]);
+            }
+        }
+    }
+    for (const vector<uint8_t> &packet : resend)
+        ::send(socketOf(sock), (const char *) packet.data(), (int) packet.size(), 0);
+    std::lock_guard<std::mutex> guard(statsLock);
+    counters.nacks++;
+    counters.retransmitted += resend.size();
+}
+
+/**
+ * updateTarget() bounds the estimate and hands it to the encoder once it is 5% off the rate it has
+ */
+void SRWebRtcOutput::updateTarget() {
+    if (maxKbps <= 0)
+        return;
+    int remb;
+    {
+        std::lock_guard<std::mutex> guard(statsLock);
+        remb = counters.rembKbps;
+    }
+    estimate = av_clipd(estimate, FFMIN(WEBRTC_MIN_KBPS, maxKbps), maxKbps);
+    if (remb > 0)
+        estimate = FFMIN(estimate, FFMAX(remb, FFMIN(WEBRTC_MIN_KBPS, maxKbps)));
+    int kbps = (int) estimate;
+    target = kbps;
+    {
+        std::lock_guard<std::mutex> guard(statsLock);
+        counters.targetKbps = kbps;
+    }
+    if (FFABS(kbps - appliedKbps) * 20 < appliedKbps)
+        return;
+    srLog(SR_LOG_DEBUG, "[SRWebRtcOutput] target %d kbit/s", kbps);
+    appliedKbps = kbps;
+    if (bitrateCallback)
+        bitrateCallback(kbps);
+}
+
+/**
+ * finish() sends what is queued, the RTCP BYE last, and stops both threads
+ */
+void SRWebRtcOutput::finish() {
+    if (!writer.joinable())
+        return;
+    queue.close();
+    writer.join();
+    stopping = true;
+    feedback.join();
+    SRWebRtcStats s = stats();
+    cout << "\n[SRWebRtcOutput] " << host << ":" << port << ": " << s.packets << " packets, " << s.retransmitted
+         << " sent again for " << s.nacks << " NACKs, " << s.keyframeRequests << " keyframes asked, "
+         << s.droppedPackets << " packets dropped, last target " << s.targetKbps << " kbit/s";
+}
+
+SRWebRtcStats SRWebRtcOutput::stats() {
+    std::lock_guard<std::mutex> guard(statsLock);
+    return counters;
+}
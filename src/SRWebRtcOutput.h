@@ -0,0 +1,196 @@
+//
+// WebRTC media egress: RTP and RTCP on one socket, SRTP, the encoder rate driven by the RTCP feedback of the peer.
+//
+
+#ifndef CPPSCREENRECORDER_SRWEBRTCOUTPUT_H
+#define CPPSCREENRECORDER_SRWEBRTCOUTPUT_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SRFramePool.h"
+#include "SRRingBuffer.h"
+#include "SRSrtp.h"
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+#define WEBRTC_MTU 1200     //bytes of the largest datagram, protection included: what the browsers send, below any tunnel
+#define WEBRTC_VIDEO_PT 96
+#define WEBRTC_AUDIO_PT 111
+#define WEBRTC_MIN_KBPS 150     //kbit/s the congestion control never asks the encoder to go below
+#define WEBRTC_HISTORY 1024     //video packets kept for the retransmissions a NACK asks for, a second of 10 Mbit/s
+#define WEBRTC_PACE_FACTOR 2.5  //rate of the pacer over the target: a keyframe leaves in a few frame times, not at once
+#define WEBRTC_DROP_WINDOW 250  //ms of the target the encoded video may run ahead of it before frames are dropped
+#define WEBRTC_QUEUE_DELAY 100  //ms the round trip may grow over its minimum before it counts as an overuse
+#define WEBRTC_KEYFRAME_GAP 500 //ms between two keyframes asked by PLI or FIR, the repeats of a gateway are one request
+#define WEBRTC_POLL_TIMEOUT 100 //ms the feedback thread waits for a datagram before it checks finish()
+
+/**
+ * Statistics of an SRWebRtcOutput: the RTP packets sent, the ones sent again for a NACK, the RTCP feedback
+ * received, the packets dropped before the queue (none while the frame dropper keeps up), and the last state of the
+ * congestion control: target, round trip (-1 before the first report on a sender report), fraction lost, REMB cap.
+ */
+typedef struct WR{
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t retransmitted;
+    uint64_t nacks;
+    uint64_t keyframeRequests;
+    uint64_t reports;
+    uint64_t droppedPackets;
+    int targetKbps;
+    int rtt;    //ms
+    double loss;
+    int rembKbps;   //0 without REMB
+}SRWebRtcStats;
+
+/**
+ * SRWebRtcOutput sends the encoded packets of the recording to a WebRTC peer for live viewing under a second:
+ * the video (H.264, packetization mode 1, SPS and PPS in front of every IDR) and the first Opus track go
+ * through the RTP muxers of libavformat onto one UDP socket, RTCP multiplexed with RTP (RFC 5761) and both protected
+ * by SRTP when the URL gives a key:\n
+ * rtp://host:port, srtp://host:port?key=<base64>[&peerkey=<base64>], the keys the SDES inline keys of
+ * AES_CM_128_HMAC_SHA1_80, key for what is sent, peerkey (key when absent) for the RTCP received.\n
+ * ICE and DTLS stay with the peer: this is the media plane a gateway terminates for the browsers (a mediasoup
+ * PlainTransport with rtcpMux and comedia, a Janus RTP mountpoint), given the SDP of sdp().\n
+ * The RTCP feedback of the peer drives the encoder: the receiver reports give the fraction lost and the round trip
+ * (from the sender reports of the RTP muxer), REMB caps the rate, NACK is answered from the history of the video
+ * packets, PLI and FIR ask for a keyframe. The target follows the loss based control of GCC: down by half the loss
+ * above 10%, held from 2%, up by 8% a second below; down by 15% as well when the round trip grows by more than
+ * WEBRTC_QUEUE_DELAY ms over its minimum, a queue building up before any loss. A target 5% off the last applied one
+ * goes to onBitrate(), the encoder reconfigures in place.\n
+ * When the bandwidth falls faster than the encoder follows, frames are dropped before the encoder, not packets on
+ * the network: congested() holds while the encoded video is more than WEBRTC_DROP_WINDOW ms of the target ahead of
+ * it, a leaky bucket as the frame dropper of WebRTC. The packets leave through a pacer at WEBRTC_PACE_FACTOR
+ * times the target.
+ *
+ * @Note the encoder is the recording's: its file gets the same rate and the same dropped frames
+ */
+class SRWebRtcOutput {
+
+private:
+    struct Track {
+        AVFormatContext *ctx;
+        AVBSFContext *bsf;  //Annex B with the parameter sets in band, H.264 in MP4 form only
+        AVRational sourceTimeBase;
+        uint32_t ssrc;
+        bool skipToKey;     //MuxerThread only
+    };
+
+    std::string url;
+    std::string host;
+    int port;
+    bool secure;
+    SRSrtp srtp;        //writer thread
+    SRSrtp peerSrtp;    //feedback thread
+    intptr_t sock;
+    std::vector<Track> tracks;
+    std::vector<int> trackOf;   //track of each stream of the recording, -1 for none
+    int videoTrack;
+    std::string sdpText;
+    SRRingBuffer<AVPacket*> queue;
+    SRPacketPool pool;
+    AVPacket *filtered;
+    std::thread writer;
+    std::thread feedback;
+    std::atomic<bool> stopping;
+    std::function<void(int)> bitrateCallback;
+    std::function<void()> keyframeCallback;
+
+    uint8_t datagram[WEBRTC_MTU];   //writer thread
+    int64_t nextSend;
+
+    std::mutex historyLock;
+    std::vector<std::vector<uint8_t>> history;  //protected video packets, by sequence number modulo WEBRTC_HISTORY
+    std::vector<int> historySeq;
+
+    //congestion control, feedback thread
+    int maxKbps;
+    double estimate;
+    int appliedKbps;
+    int minRtt;
+    int64_t lastReport;
+    int64_t lastKeyframe;
+    std::atomic<int> target;    //kbit/s
+
+    std::mutex bucketLock;
+    double bucketBytes;
+    int64_t bucketTime;
+
+    std::mutex statsLock;
+    SRWebRtcStats counters;
+
+    int openTrack(const AVStream *source, int payloadType);
+    static int writePacket(void *opaque, uint8_t *buf, int size);
+    void transmit(const uint8_t *packet, int size);
+    void drainBucket(int64_t now);
+    void run();
+    void listen();
+    void onRtcp(const uint8_t *packet, int size);
+    void onReport(const uint8_t *block);
+    void onRemb(int kbps);
+    void onNack(const uint8_t *fci, int size);
+    void updateTarget();
+
+public:
+    /**
+     * @param queuePackets packets queued for the writer thread before they are dropped up to the next keyframe
+     */
+    SRWebRtcOutput(const char *url, size_t queuePackets);
+    ~SRWebRtcOutput();
+
+    SRWebRtcOutput(const SRWebRtcOutput&) = delete;
+    SRWebRtcOutput &operator=(const SRWebRtcOutput&) = delete;
+
+    /**
+     * init() opens the socket and the RTP muxers of the video and the first Opus track of source, the recording
+     * once its header is written
+     * @param videoStream index of the video in source, -1 for none
+     * @param bitrate bit/s the encoder was opened with, the highest target; 0 leaves the rate alone
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int init(const AVFormatContext *source, int videoStream, int64_t bitrate);
+
+    /**
+     * onBitrate() is called, from the feedback thread, with each new target in kbit/s
+     */
+    void onBitrate(std::function<void(int kbps)> callback) { bitrateCallback = std::move(callback); }
+
+    /**
+     * onKeyframe() is called, from the feedback thread, when the peer asks for a keyframe
+     */
+    void onKeyframe(std::function<void()> callback) { keyframeCallback = std::move(callback); }
+
+    void start();
+
+    /**
+     * send() queues a reference to pkt, without ever waiting
+     * @Note MuxerThread only, pkt timestamps are in the time base of the recording stream
+     */
+    void send(const AVPacket *pkt);
+
+    /**
+     * congested() tells the encoder input to drop the next frame
+     */
+    bool congested();
+
+    void finish();
+
+    /**
+     * sdp() describes the RTP sessions, for the peer: payload types, SSRCs, parameter sets, and with srtp:// the
+     * RTP/SAVP profile and the a=crypto line of the key the media is protected with
+     */
+    const std::string &sdp() const { return sdpText; }
+
+    SRWebRtcStats stats();
+};
+
+#endif //CPPSCREENRECORDER_SRWEBRTCOUTPUT_H
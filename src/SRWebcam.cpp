@@ -0,0 +1,185 @@
+//
+// Webcam picture-in-picture: a second video input, decoded and shrunk by a thread of its own into an overlay layer.
+//
+
+#include "SRWebcam.h"
+#include "SRLog.h"
+#include "SRThreads.h"
+
+#include <cstring>
+#include <iostream>
+
+extern "C"
+{
+#include "libavdevice/avdevice.h"
+#include "libavutil/time.h"
+}
+
+using namespace std;
+
+SRWebcam::SRWebcam(): input(nullptr), decoder(nullptr), streamIndex(-1), overlay(nullptr), width(0), height(0),
+                      x(0), y(0), outWidth(0), outHeight(0), stopping(false), frames(0), errors(0) {}
+
+SRWebcam::~SRWebcam() {
+    stop();
+    avcodec_free_context(&decoder);
+    avformat_close_input(&input);
+}
+
+int SRWebcam::interrupted(void *opaque) {
+    return ((SRWebcam *) opaque)->stopping.load(std::memory_order_relaxed);
+}
+
+int SRWebcam::open(const char *source, const char *url, const char *options) {
+    //the recorder only registers the devices for a capture demuxer of its own
+    avdevice_register_all();
+    AVInputFormat *format = av_find_input_format(source);
+    if (!format) {
+        cout << "\n[SRWebcam] unknown camera source " << source;
+        return AVERROR_DEMUXER_NOT_FOUND;
+    }
+    AVDictionary *dict = nullptr;
+    if (options && *options && av_dict_parse_string(&dict, options, "=", ":", 0) < 0) {
+        cout << "\n[SRWebcam] invalid camera options " << options << ", expected key=value:key=value";
+        av_dict_free(&dict);
+        return AVERROR(EINVAL);
+    }
+    //a USB 2 camera only has the bandwidth for its large modes compressed
+    if (!strcmp(source, "v4l2"))
+        av_dict_set(&dict, "input_format", "mjpeg", AV_DICT_DONT_OVERWRITE);
+    else if (!strcmp(source, "dshow"))
+        av_dict_set(&dict, "vcodec", "mjpeg", AV_DICT_DONT_OVERWRITE);
+    av_dict_set(&dict, "video_size", WEBCAM_SIZE, AV_DICT_DONT_OVERWRITE);
+    av_dict_set_int(&dict, "framerate", WEBCAM_FPS, AV_DICT_DONT_OVERWRITE);
+
+    input = avformat_alloc_context();
+    if (!input) {
+        av_dict_free(&dict);
+        return AVERROR(ENOMEM);
+    }
+    input->interrupt_callback.callback = interrupted;
+    input->interrupt_callback.opaque = this;
+    int ret = avformat_open_input(&input, url, format, &dict);
+    av_dict_free(&dict);
+    if (ret < 0) {
+        cout << "\n[SRWebcam] cannot open the camera " << url;
+        return ret;
+    }
+    if ((ret = avformat_find_stream_info(input, nullptr)) < 0 ||
+        (ret = streamIndex = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0)) < 0) {
+        cout << "\n[SRWebcam] no video stream in the camera " << url;
+        return ret;
+    }
+    AVCodecParameters *par = input->streams[streamIndex]->codecpar;
+    AVCodec *codec = avcodec_find_decoder(par->codec_id);
+    if (!codec || !(decoder = avcodec_alloc_context3(codec)))
+        return AVERROR_DECODER_NOT_FOUND;
+    if ((ret = avcodec_parameters_to_context(decoder, par)) < 0)
+        return ret;
+    //a JPEG per frame: the frames decode side by side, the slices of a frame too where the decoder has them
+    decoder->thread_count = WEBCAM_THREADS;
+    decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    cout << "\n[SRWebcam] " << url << ": " << codec->name << " " << par->width << "x" << par->height;
+    return 0;
+}
+
+void SRWebcam::start(SROverlay *layers, int recordingWidth, int recordingHeight, int pipWidth) {
+    if (!decoder || reader.joinable())
+        return;
+    overlay = layers;
+    outWidth = recordingWidth;
+    outHeight = recordingHeight;
+    width = FFMIN(pipWidth > 0 ? pipWidth : WEBCAM_WIDTH, outWidth / 2) & ~1;
+    //the aspect of the camera, known for sure with the first frame
+    height = decoder->width > 0 ? FFMAX((int) av_rescale(decoder->height, width, decoder->width) & ~1, 2) : 0;
+    stopping.store(false);
+    reader = std::thread(&SRWebcam::run, this);
+}
+
+void SRWebcam::stop() {
+    stopping.store(true);
+    if (reader.joinable())
+        reader.join();
+    if (overlay)
+        overlay->removeLayer(WEBCAM_LAYER);
+    overlay = nullptr;
+}
+
+/**
+ * run() is the camera thread: it reads and decodes the camera until stop(), each decoded frame replaces the picture
+ */
+void SRWebcam::run() {
+    //before the decoder opens: its threads inherit the class
+    idleThread();
+    int ret = avcodec_open2(decoder, decoder->codec, nullptr);
+    if (ret < 0) {
+        srLog(SR_LOG_ERROR, "[SRWebcam] cannot open the %s decoder (%d)", decoder->codec->name, ret);
+        return;
+    }
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc(), *scaled = av_frame_alloc();
+    while (pkt && frame && scaled && !stopping.load(std::memory_order_relaxed)) {
+        ret = av_read_frame(input, pkt);
+        if (ret == AVERROR(EAGAIN)) {
+            av_usleep(1000000 / WEBCAM_FPS / 2);
+            continue;
+        }
+        if (ret < 0) {
+            if (!stopping.load())
+                srLog(SR_LOG_ERROR, "[SRWebcam] the camera stopped (%d), the picture-in-picture is taken off", ret);
+            break;
+        }
+        if (pkt->stream_index != streamIndex) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        ret = avcodec_send_packet(decoder, pkt);
+        av_packet_unref(pkt);
+        if (ret < 0) {
+            //a corrupt JPEG of a USB transfer error: the next frame is whole again
+            errors++;
+            continue;
+        }
+        while (avcodec_receive_frame(decoder, frame) >= 0) {
+            show(frame, scaled);
+            av_frame_unref(frame);
+        }
+    }
+    if (overlay)
+        overlay->removeLayer(WEBCAM_LAYER);
+    av_frame_free(&scaled);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+}
+
+/**
+ * show() shrinks a camera frame into the picture-in-picture and sets it as the layer of the overlays
+ */
+void SRWebcam::show(const AVFrame *frame, AVFrame *scaled) {
+    if (!scaled->buf[0]) {
+        if (!height)
+            height = FFMAX((int) av_rescale(frame->height, width, frame->width) & ~1, 2);
+        x = FFMAX(outWidth - width - WEBCAM_MARGIN, 0);
+        y = FFMAX(outHeight - height - WEBCAM_MARGIN, 0);
+        scaled->format = AV_PIX_FMT_BGRA;
+        scaled->width = width;
+        scaled->height = height;
+        if (av_frame_get_buffer(scaled, 0) < 0) {
+            errors++;
+            return;
+        }
+        pixels.resize((size_t) width * height);
+    }
+    if (scaler.configure(frame->width, frame->height, (enum AVPixelFormat) frame->format, width, height,
+                         AV_PIX_FMT_BGRA, SWS_AREA, 1) < 0) {
+        errors++;
+        return;
+    }
+    scaler.scale(frame, scaled);
+    //BGRA in memory is 0xAARRGGBB on the little endian hosts, opaque: premultiplied as it is
+    for (int row = 0; row < height; row++)
+        memcpy(pixels.data() + (size_t) row * width, scaled->data[0] + (size_t) row * scaled->linesize[0],
+               (size_t) width * 4);
+    overlay->setLayer(WEBCAM_LAYER, pixels.data(), width, height, x, y);
+    frames++;
+}
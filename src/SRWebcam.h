@@ -0,0 +1,92 @@
+//
+// Webcam picture-in-picture: a second video input, decoded and shrunk by a thread of its own into an overlay layer.
+//
+
+#ifndef CPPSCREENRECORDER_SRWEBCAM_H
+#define CPPSCREENRECORDER_SRWEBCAM_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SROverlay.h"
+#include "SRScaler.h"
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+#define WEBCAM_SIZE "1280x720"  //asked of the camera, it answers with the nearest mode it has
+#define WEBCAM_FPS 30
+#define WEBCAM_WIDTH 320    //px of the picture-in-picture, default settings._webcamwidth, the height keeps the aspect
+#define WEBCAM_MARGIN 16    //px between the picture-in-picture and the bottom right corner of the recording
+#define WEBCAM_THREADS 2    //decoder threads, frame and slice
+#define WEBCAM_LAYER 1000   //overlay id of the picture-in-picture: above the layers of the application
+
+/**
+ * SRWebcam adds the picture of a camera to the recording: the camera demuxer (v4l2, dshow or avfoundation) is asked
+ * for MJPEG, which the USB cameras only deliver at their larger sizes, a thread reads and decodes it with frame
+ * and slice threads, shrinks it once per camera frame and sets it as a layer of the overlays: the convert workers
+ * only blend the small picture into each screen frame, never wait for the camera, and a screen frame drawn
+ * between two camera frames gets the previous picture.\n
+ * The thread and the threads of its decoder run in the background class of the scheduler: the camera loses
+ * frames, never the screen.
+ */
+class SRWebcam {
+
+private:
+    AVFormatContext *input;
+    AVCodecContext *decoder;
+    int streamIndex;
+    SROverlay *overlay;
+    int width, height;  //of the picture-in-picture
+    int x, y;
+    int outWidth, outHeight;    //of the recording
+    SRScaler scaler;
+    std::vector<uint32_t> pixels;
+    std::thread reader;
+    std::atomic<bool> stopping;
+
+    std::atomic<uint64_t> frames;
+    std::atomic<uint64_t> errors;
+
+    static int interrupted(void *opaque);
+    void run();
+    void show(const AVFrame *frame, AVFrame *scaled);
+
+public:
+    SRWebcam();
+    ~SRWebcam();
+
+    SRWebcam(const SRWebcam&) = delete;
+    SRWebcam &operator=(const SRWebcam&) = delete;
+
+    /**
+     * open() opens the camera url of the demuxer source
+     * @param options "key=value:key=value" demuxer options, over the MJPEG, WEBCAM_SIZE and WEBCAM_FPS asked for
+     * @return 0 on success, a negative AVERROR code otherwise
+     */
+    int open(const char *source, const char *url, const char *options);
+
+    /**
+     * start() starts the camera thread, the picture goes WEBCAM_MARGIN px off the bottom right corner of a
+     * recording of recordingWidth x recordingHeight
+     * @param pipWidth of the picture-in-picture, even
+     */
+    void start(SROverlay *layers, int recordingWidth, int recordingHeight, int pipWidth);
+
+    /**
+     * stop() stops the thread and takes the picture off the recording
+     */
+    void stop();
+
+    uint64_t frameCount() const { return frames.load(std::memory_order_relaxed); }
+    uint64_t errorCount() const { return errors.load(std::memory_order_relaxed); }
+    int pictureWidth() const { return width; }
+    int pictureHeight() const { return height; }
+};
+
+#endif //CPPSCREENRECORDER_SRWEBCAM_H
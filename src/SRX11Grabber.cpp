@@ -0,0 +1,571 @@
+#include "SRX11Grabber.h"
+#include "SRXErrorTrap.h"
+#include "SRLog.h"
+#include "SRBlend.h"
+#include "SRNuma.h"
+
+#ifdef __unix__
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+
+extern "C"
+{
+#include "libavutil/mem.h"
+#include "libavutil/time.h"
+}
+
+using namespace std;
+
+SRX11Grabber::SRX11Grabber(bool drawCursor, bool hugePages): display(nullptr), events(nullptr), connection(nullptr), root(0), sharedPixmaps(false), gc(nullptr), damage(0),
+                                             damageEventBase(0), x(0), y(0), width(0), height(0), fullGrab(true),
+                                             undelivered(false), drawCursor(drawCursor), hugePages(hugePages), localImages(false),
+                                             fixesEventBase(0),
+                                             cursorChanged(true), cursorWidth(0), cursorHeight(0), cursorHotX(0),
+                                             cursorHotY(0), pointerShown(false), pointerLeft(0), pointerTop(0),
+                                             window(0), windowMoved(false), loop(nullptr) {
+    pointerArea = XRectangle();
+}
+
+SRX11Grabber::~SRX11Grabber() {
+    if (!display) return;
+    if (loop && events)
+        loop->remove(ConnectionNumber(events));
+    if (damage) XDamageDestroy(events, damage);
+    if (gc) XFreeGC(display, gc);
+    //the server lets the segments go, the frames still holding one unmap it when they are released
+    for (Segment *segment : segments) {
+        if (segment->pixmap) XFreePixmap(display, segment->pixmap);
+        if (segment->shminfo.shmaddr) XShmDetach(display, &segment->shminfo);
+    }
+    XSync(display, False);
+    for (Segment *segment : segments)
+        releaseSegment(segment, nullptr);
+    if (events && events != display)
+        XCloseDisplay(events);
+    XCloseDisplay(display);
+}
+
+/**
+ * releaseSegment() drops a reference to a segment: the buffer free callback of the frames,
+ * and the grabber when it goes away. The last one unmaps the memory.
+ */
+void SRX11Grabber::releaseSegment(void *opaque, uint8_t *data) {
+    (void) data;
+    Segment *segment = (Segment *) opaque;
+    if (--segment->refs > 0)
+        return;
+    if (segment->shminfo.shmaddr)
+        shmdt(segment->shminfo.shmaddr);
+    else
+        av_free(segment->image->data);
+    segment->image->data = nullptr;
+    XDestroyImage(segment->image);
+    delete segment;
+}
+
+/**
+ * createSegment() adds a shared memory image of the region to the ring, grabbed whole the first time
+ * @return the new segment, nullptr on failure
+ */
+SRX11Grabber::Segment *SRX11Grabber::createSegment() {
+    int screen = DefaultScreen(display);
+    Segment *segment = new Segment();
+    segment->shminfo.shmid = -1;
+    segment->shminfo.shmaddr = nullptr;
+    segment->pixmap = 0;
+    segment->full = true;
+    segment->refs = 1;
+    segment->image = XShmCreateImage(display, DefaultVisual(display, screen), DefaultDepth(display, screen),
+                                     ZPixmap, nullptr, &segment->shminfo, width, height);
+    if (!segment->image || segment->image->bits_per_pixel != 32) {
+        cout << "\n[SRX11Grabber] only 32 bits per pixel displays are supported";
+        if (segment->image) XDestroyImage(segment->image);
+        delete segment;
+        return nullptr;
+    }
+
+    size_t size = (size_t) segment->image->bytes_per_line * segment->image->height;
+    bool hugeSegment = false;
+    segment->shminfo.shmid = -1;
+#ifdef SHM_HUGETLB
+    if (hugePages) {
+        size_t rounded = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        segment->shminfo.shmid = shmget(IPC_PRIVATE, rounded, IPC_CREAT | SHM_HUGETLB | 0777);
+        hugeSegment = segment->shminfo.shmid != -1;
+    }
+#endif
+    if (segment->shminfo.shmid == -1)
+        segment->shminfo.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0777);
+    if (segment->shminfo.shmid == -1) {
+        cout << "\n[SRX11Grabber] cannot get shared memory";
+        XDestroyImage(segment->image);
+        delete segment;
+        return nullptr;
+    }
+    segment->shminfo.shmaddr = segment->image->data = (char *) shmat(segment->shminfo.shmid, nullptr, 0);
+#ifdef MADV_HUGEPAGE
+    if (hugePages && !hugeSegment && segment->shminfo.shmaddr != (char *) -1)
+        madvise(segment->shminfo.shmaddr, size, MADV_HUGEPAGE);
+#endif
+    segment->shminfo.readOnly = False;
+    //a server on another host answers the attach with an error, the default handler would end the process
+    SRXErrorTrap trap(display);
+    bool attached = XShmAttach(display, &segment->shminfo);
+    if (trap.release())
+        attached = false;
+    if (!attached) {
+        cout << "\n[SRX11Grabber] cannot attach shared memory";
+        shmctl(segment->shminfo.shmid, IPC_RMID, nullptr);
+        shmdt(segment->shminfo.shmaddr);
+        segment->shminfo.shmaddr = nullptr;
+        segment->image->data = nullptr;
+        XDestroyImage(segment->image);
+        delete segment;
+        return nullptr;
+    }
+    //the segment goes away with the last detach
+    shmctl(segment->shminfo.shmid, IPC_RMID, nullptr);
+
+    if (sharedPixmaps)
+        segment->pixmap = XShmCreatePixmap(display, root, segment->shminfo.shmaddr, &segment->shminfo, width, height,
+                                           DefaultDepth(display, screen));
+    segments.push_back(segment);
+    return segment;
+}
+
+/**
+ * createLocalSegment() adds an image of the region in the memory of the recorder, for the servers without XShm
+ * @return the new segment, nullptr on failure
+ */
+SRX11Grabber::Segment *SRX11Grabber::createLocalSegment() {
+    int screen = DefaultScreen(display);
+    Segment *segment = new Segment();
+    segment->shminfo.shmid = -1;
+    segment->shminfo.shmaddr = nullptr;
+    segment->pixmap = 0;
+    segment->full = true;
+    segment->refs = 1;
+    segment->image = XCreateImage(display, DefaultVisual(display, screen), DefaultDepth(display, screen),
+                                  ZPixmap, 0, nullptr, width, height, 32, 0);
+    if (!segment->image || segment->image->bits_per_pixel != 32) {
+        cout << "\n[SRX11Grabber] only 32 bits per pixel displays are supported";
+        if (segment->image) XDestroyImage(segment->image);
+        delete segment;
+        return nullptr;
+    }
+    segment->image->data = (char *) av_malloc((size_t) segment->image->bytes_per_line * height);
+    if (!segment->image->data) {
+        XDestroyImage(segment->image);
+        delete segment;
+        return nullptr;
+    }
+    segments.push_back(segment);
+    return segment;
+}
+
+/**
+ * freeSegment() is a segment no frame references, the ring grows up to X11_SHM_RING_MAX when they are all held
+ * @return the segment, nullptr if the ring is full
+ */
+SRX11Grabber::Segment *SRX11Grabber::freeSegment() {
+    for (Segment *segment : segments)
+        if (segment->refs.load() == 1)
+            return segment;
+    if (segments.size() >= X11_SHM_RING_MAX)
+        return nullptr;
+    return connection ? createLocalSegment() : createSegment();
+}
+
+bool SRX11Grabber::windowArea(const char *device, Window window, int &x, int &y, int &width, int &height) {
+    string name(device);
+    Display *display = XOpenDisplay(name.substr(0, name.find('+')).c_str());
+    if (!display)
+        return false;
+    //a window that went away must not take the recorder with it
+    SRXErrorTrap trap(display);
+    XWindowAttributes attributes;
+    Window child;
+    bool found = XGetWindowAttributes(display, window, &attributes) &&
+                 XTranslateCoordinates(display, window, attributes.root, 0, 0, &x, &y, &child);
+    trap.release();
+    if (found) {
+        width = attributes.width;
+        height = attributes.height;
+    }
+    XCloseDisplay(display);
+    return found;
+}
+
+int SRX11Grabber::open(const char *device, int x, int y, int width, int height) {
+    int errorBase, major, minor;
+    Bool pixmaps;
+
+    //x11grab style urls carry the offset after '+': only the display name is needed here
+    string name(device);
+    name = name.substr(0, name.find('+'));
+
+    this->x = x;
+    this->y = y;
+    this->width = width;
+    this->height = height;
+
+    display = XOpenDisplay(name.c_str());
+    if (!display) {
+        cout << "\n[SRX11Grabber] cannot open display " << name;
+        return AVERROR(EIO);
+    }
+    root = DefaultRootWindow(display);
+    events = loop ? XOpenDisplay(name.c_str()) : display;
+    if (!events) {
+        cout << "\n[SRX11Grabber] cannot open display " << name;
+        return AVERROR(EIO);
+    }
+
+    if (!XDamageQueryExtension(events, &damageEventBase, &errorBase)) {
+        cout << "\n[SRX11Grabber] XDamage is required";
+        return AVERROR(ENOSYS);
+    }
+    bool shared = !localImages && XShmQueryVersion(display, &major, &minor, &pixmaps);
+    sharedPixmaps = shared && pixmaps && XShmPixmapFormat(display) == ZPixmap;
+
+    for (int i = 0; i < X11_SHM_RING && shared; i++)
+        if (!createSegment()) {
+            if (i > 0)
+                return AVERROR(ENOMEM);
+            shared = false;
+        }
+    if (!shared) {
+        srLog(SR_LOG_INFO, "[SRX11Grabber] no shared memory with %s, fetching the images over the connection",
+              name.c_str());
+        connection = XGetXCBConnection(display);
+        sharedPixmaps = false;
+        for (int i = 0; i < X11_SHM_RING; i++)
+            if (!createLocalSegment())
+                return AVERROR(ENOMEM);
+    }
+
+    if (sharedPixmaps) {
+        //one GC serves the pixmaps of every segment: same root, same depth
+        XGCValues values;
+        values.subwindow_mode = IncludeInferiors;
+        gc = XCreateGC(display, segments[0]->pixmap, GCSubwindowMode, &values);
+    }
+
+    damage = XDamageCreate(events, root, XDamageReportRawRectangles);
+    fullGrab = true;
+
+    //cursor changes come as events: the image is only fetched when it changes
+    if (drawCursor) {
+        if (!XFixesQueryExtension(events, &fixesEventBase, &errorBase)) {
+            cout << "\n[SRX11Grabber] XFixes is required to draw the pointer";
+            return AVERROR(ENOSYS);
+        }
+        XFixesSelectCursorInput(events, root, XFixesDisplayCursorNotifyMask);
+        cursorChanged = true;
+    }
+    if (window) {
+        XSelectInput(events, window, StructureNotifyMask);
+        windowMoved = true;
+    }
+    XFlush(events);
+    if (loop && !loop->add(ConnectionNumber(events), [this](){ readEvents(); }))
+        loop = nullptr;
+    return 0;
+}
+
+/**
+ * collectDamage() drains the pending XDamage events and keeps the rectangles intersecting the captured region,
+ * clipped to it and relative to the root window
+ */
+void SRX11Grabber::collectDamage() {
+    XEvent event;
+
+    //with a loop the socket is its to read: only the events it brought in are left
+    while (loop ? XEventsQueued(events, QueuedAlready) : XPending(events)) {
+        XNextEvent(events, &event);
+        if (drawCursor && event.type == fixesEventBase + XFixesCursorNotify) {
+            cursorChanged = true;
+            continue;
+        }
+        if (window && event.type == ConfigureNotify && event.xconfigure.window == window) {
+            windowMoved = true;
+            continue;
+        }
+        if (window && event.type == DestroyNotify && event.xdestroywindow.window == window) {
+            srLog(SR_LOG_WARNING, "[SRX11Grabber] the window is gone, recording where it was");
+            window = 0;
+            continue;
+        }
+        if (event.type != damageEventBase + XDamageNotify) continue;
+        if (fullGrab) continue;
+
+        XRectangle area = ((XDamageNotifyEvent *) &event)->area;
+        int x0 = max<int>(area.x, x), y0 = max<int>(area.y, y);
+        int x1 = min<int>(area.x + area.width, x + width), y1 = min<int>(area.y + area.height, y + height);
+        if (x0 >= x1 || y0 >= y1) continue;
+
+        if (dirty.size() >= X11_MAX_DAMAGE_RECTS) {
+            fullGrab = true;
+            dirty.clear();
+            continue;
+        }
+        XRectangle clipped;
+        clipped.x = x0;
+        clipped.y = y0;
+        clipped.width = x1 - x0;
+        clipped.height = y1 - y0;
+        dirty.push_back(clipped);
+    }
+}
+
+/**
+ * readEvents() is the handler of the SRDisplayLoop: it reads what the server sent and collects the damage in it
+ */
+void SRX11Grabber::readEvents() {
+    std::lock_guard<std::mutex> guard(eventLock);
+    XEventsQueued(events, QueuedAfterReading);
+    collectDamage();
+}
+
+/**
+ * updatePointer() refetches the cursor image after a change and finds where the pointer is
+ * @param imageChanged the server told the cursor image changed since the previous grab
+ * @return true if the pointer drawn in the region changed since the previous grab
+ */
+bool SRX11Grabber::updatePointer(bool imageChanged) {
+    if (!drawCursor)
+        return false;
+    bool changed = false;
+    if (imageChanged) {
+        XFixesCursorImage *image = XFixesGetCursorImage(display);
+        if (image) {
+            //the pixels are longs, 64 bit on LP64 systems
+            cursor.resize((size_t) image->width * image->height);
+            for (size_t i = 0; i < cursor.size(); i++)
+                cursor[i] = (uint32_t) image->pixels[i];
+            cursorWidth = image->width;
+            cursorHeight = image->height;
+            cursorHotX = image->xhot;
+            cursorHotY = image->yhot;
+            XFree(image);
+        }
+        changed = true;
+    }
+
+    Window rootReturn, child;
+    int rootX, rootY, windowX, windowY;
+    unsigned int mask;
+    XRectangle area = XRectangle();
+    bool shown = false;
+    if (XQueryPointer(display, root, &rootReturn, &child, &rootX, &rootY, &windowX, &windowY, &mask) && !cursor.empty()) {
+        pointerLeft = rootX - cursorHotX;
+        pointerTop = rootY - cursorHotY;
+        int x0 = max(pointerLeft, x), y0 = max(pointerTop, y);
+        int x1 = min(pointerLeft + cursorWidth, x + width), y1 = min(pointerTop + cursorHeight, y + height);
+        shown = x0 < x1 && y0 < y1;
+        if (shown) {
+            area.x = (short) x0;
+            area.y = (short) y0;
+            area.width = (unsigned short) (x1 - x0);
+            area.height = (unsigned short) (y1 - y0);
+        }
+    }
+    changed = (changed && (shown || pointerShown)) || shown != pointerShown ||
+              (shown && (area.x != pointerArea.x || area.y != pointerArea.y ||
+                         area.width != pointerArea.width || area.height != pointerArea.height));
+    pointerShown = shown;
+    pointerArea = area;
+    return changed;
+}
+
+/**
+ * drawPointer() blends the pointer into the image of a segment, the covered pixels are missed damage from then on
+ */
+void SRX11Grabber::drawPointer(Segment *segment) {
+    if (!drawCursor || !pointerShown)
+        return;
+    //the area is clipped to the region: the cursor pixels start at its offset from the cursor corner
+    const XRectangle &a = pointerArea;
+    const uint32_t *src = cursor.data() + (size_t) (a.y - pointerTop) * cursorWidth + (a.x - pointerLeft);
+    uint8_t *dst = (uint8_t *) segment->image->data + (size_t) (a.y - y) * segment->image->bytes_per_line + (size_t) (a.x - x) * 4;
+    blendPremultiplied(dst, segment->image->bytes_per_line, src, cursorWidth, a.width, a.height);
+    segment->missed.push_back(a);
+}
+
+/**
+ * trackWindow() moves the region onto the followed window, kept inside the screen: XShmGetImage fails outside it
+ */
+void SRX11Grabber::trackWindow(Window followed) {
+    int rootX, rootY;
+    Window child;
+    SRXErrorTrap trap(display);
+    bool found = XTranslateCoordinates(display, followed, root, 0, 0, &rootX, &rootY, &child);
+    trap.release();
+    if (!found)
+        return;
+    int screen = DefaultScreen(display);
+    rootX = max(0, min(rootX, DisplayWidth(display, screen) - width));
+    rootY = max(0, min(rootY, DisplayHeight(display, screen) - height));
+    if (rootX == x && rootY == y)
+        return;
+    //every image holds the old place: all of them are grabbed whole
+    std::unique_lock<std::mutex> guard(eventLock, std::defer_lock);
+    if (loop)
+        guard.lock();
+    x = rootX;
+    y = rootY;
+    fullGrab = true;
+    dirty.clear();
+}
+
+/**
+ * fetchImage() fills a local image with xcb_get_image: the missed damage, or the whole region in tiles of
+ * X11_XCB_TILE_ROWS rows. Every request goes out before the first reply is read, the round trips overlap
+ * and the copy of a tile runs while the next ones are still on the wire.
+ * @return 0 on success, AVERROR(EIO) if the server refused a request
+ */
+int SRX11Grabber::fetchImage(Segment *segment) {
+    requested.clear();
+    if (segment->full) {
+        for (int top = 0; top < height; top += X11_XCB_TILE_ROWS) {
+            XRectangle tile;
+            tile.x = (short) x;
+            tile.y = (short) (y + top);
+            tile.width = (unsigned short) width;
+            tile.height = (unsigned short) min(X11_XCB_TILE_ROWS, height - top);
+            requested.push_back(tile);
+        }
+    } else {
+        requested = segment->missed;
+    }
+
+    //the Xlib requests queued so far go first, the replies come back in order
+    XFlush(display);
+    cookies.clear();
+    for (const XRectangle &r : requested)
+        cookies.push_back(xcb_get_image(connection, XCB_IMAGE_FORMAT_Z_PIXMAP, root, r.x, r.y, r.width, r.height, ~0u));
+    xcb_flush(connection);
+
+    int ret = 0;
+    XImage *image = segment->image;
+    for (size_t i = 0; i < cookies.size(); i++) {
+        //every reply is taken, even after a failed one: none is left queued on the connection
+        xcb_generic_error_t *error = nullptr;
+        xcb_get_image_reply_t *reply = xcb_get_image_reply(connection, cookies[i], &error);
+        free(error);
+        const XRectangle &r = requested[i];
+        size_t row = (size_t) r.width * 4;
+        if (!reply || (size_t) xcb_get_image_data_length(reply) < row * r.height) {
+            free(reply);
+            ret = AVERROR(EIO);
+            continue;
+        }
+        //32 bits per pixel rows are already on the scanline pad of the server
+        const uint8_t *src = xcb_get_image_data(reply);
+        uint8_t *dst = (uint8_t *) image->data + (size_t) (r.y - y) * image->bytes_per_line + (size_t) (r.x - x) * 4;
+        for (int line = 0; line < r.height; line++)
+            memcpy(dst + (size_t) line * image->bytes_per_line, src + line * row, row);
+        free(reply);
+    }
+    return ret;
+}
+
+int SRX11Grabber::grab(AVFrame *frame) {
+    //a loop that stopped on an error leaves the connection to the grab
+    if (loop && !loop->running()) {
+        loop->remove(ConnectionNumber(events));
+        loop = nullptr;
+    }
+    //the lock only covers what the loop shares with the grab: the requests go out without it
+    std::unique_lock<std::mutex> guard(eventLock, std::defer_lock);
+    if (loop)
+        guard.lock();
+    collectDamage();
+    bool moved = windowMoved, imageChanged = cursorChanged;
+    Window followed = window;
+    windowMoved = cursorChanged = false;
+    if (loop)
+        guard.unlock();
+    if (moved && followed)
+        trackWindow(followed);
+    bool pointerChanged = updatePointer(imageChanged);
+
+    if (loop)
+        guard.lock();
+    bool whole = fullGrab;
+    fullGrab = false;
+    taken.clear();
+    taken.swap(dirty);
+    if (loop)
+        guard.unlock();
+    if (!whole && taken.empty() && !undelivered && !pointerChanged)
+        return SR_GRAB_UNCHANGED;
+
+    //every image misses the damage since the previous grab
+    for (Segment *segment : segments) {
+        if (segment->full)
+            continue;
+        if (whole || segment->missed.size() + taken.size() > X11_MAX_DAMAGE_RECTS) {
+            segment->full = true;
+            segment->missed.clear();
+        } else {
+            segment->missed.insert(segment->missed.end(), taken.begin(), taken.end());
+        }
+    }
+
+    Segment *segment = freeSegment();
+    if (!segment) {
+        //the pipeline holds the whole ring: the change is delivered by the next grab
+        if (!undelivered)
+            srLog(SR_LOG_WARNING, "[SRX11Grabber] all %d images are in use, frame skipped", X11_SHM_RING_MAX);
+        undelivered = true;
+        return SR_GRAB_UNCHANGED;
+    }
+    undelivered = false;
+
+    if (connection) {
+        if (fetchImage(segment) < 0) {
+            srLog(SR_LOG_ERROR, "[SRX11Grabber] cannot grab the screen");
+            return AVERROR(EIO);
+        }
+    } else if (segment->full || !segment->pixmap) {
+        if (!XShmGetImage(display, root, segment->image, x, y, AllPlanes)) {
+            srLog(SR_LOG_ERROR, "[SRX11Grabber] cannot grab the screen");
+            return AVERROR(EIO);
+        }
+    } else {
+        for (const XRectangle &r : segment->missed)
+            XCopyArea(display, root, segment->pixmap, gc, r.x, r.y, r.width, r.height, r.x - x, r.y - y);
+        //wait for the server to have written the shared memory
+        XSync(display, False);
+    }
+    segment->full = false;
+    segment->missed.clear();
+    drawPointer(segment);
+
+    //the frame references the image instead of a buffer of its own
+    av_frame_unref(frame);
+    segment->refs++;
+    frame->buf[0] = av_buffer_create((uint8_t *) segment->image->data,
+                                     segment->image->bytes_per_line * segment->image->height,
+                                     releaseSegment, segment, 0);
+    if (!frame->buf[0]) {
+        segment->refs--;
+        return AVERROR(ENOMEM);
+    }
+    frame->data[0] = frame->buf[0]->data;
+    frame->linesize[0] = segment->image->bytes_per_line;
+    frame->format = pixelFormat();
+    frame->width = width;
+    frame->height = height;
+    frame->pts = av_gettime();
+    return 0;
+}
+
+#endif
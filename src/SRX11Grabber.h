@@ -0,0 +1,156 @@
+//
+// XShm + XDamage screen grabber, with pipelined XCB image requests on servers without shared memory.
+//
+
+#ifndef CPPSCREENRECORDER_SRX11GRABBER_H
+#define CPPSCREENRECORDER_SRX11GRABBER_H
+
+#ifdef __unix__
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include "SRVideoGrabber.h"
+#include "SRDisplayLoop.h"
+
+/* above this many damaged rectangles a single full grab is cheaper than the copies */
+#define X11_MAX_DAMAGE_RECTS 64
+#define X11_SHM_RING 4          //shared memory images allocated by open()
+#define X11_SHM_RING_MAX 16     //images the ring grows to while the pipeline holds the others
+#define X11_XCB_TILE_ROWS 64    //rows of a tile of a whole image fetched without shared memory
+
+/**
+ * SRX11Grabber keeps a ring of XShm images of the captured region and subscribes to XDamage events
+ * on the root window, so that only the damaged rectangles are copied into the shared images.\n
+ * The frames reference the image they were grabbed in, nothing is copied: the next grab goes to an image
+ * no frame holds any more, while the previous ones are still being converted or encoded.
+ * Each image keeps the damage it missed since it was last grabbed in.\n
+ * When no damage intersects the region grab() returns SR_GRAB_UNCHANGED and the pipeline can skip the frame.\n
+ * Partial updates go through a shared memory pixmap (XCopyArea); servers without shared pixmaps
+ * get a full XShmGetImage whenever something changed.\n
+ * With drawCursor the pointer is blended into the frames: its image is fetched once per XFixes cursor change
+ * and kept, each grab only asks where it is (XQueryPointer). A pointer that moved is a change of the region.
+ * The pixels it covered are damage the image missed, restored when the image is reused.\n
+ * A followed window moves the region with it: its ConfigureNotify events (real or sent by the window manager)
+ * place the region on the window again, the size stays the one of open().\n
+ * With hugePages the shared images are huge page segments (SHM_HUGETLB) when huge pages are reserved,
+ * else they ask for transparent huge pages, which shmem gives when the system enables them for it.\n
+ * A server that cannot share memory with the recorder (a remote display, a container without the IPC namespace
+ * of the server) gets images in local memory, filled by xcb_get_image on the XCB connection of the display:
+ * the requests for the damaged rectangles, or for the tiles of a whole image, are all sent before the first reply
+ * is waited for, so a grab costs one round trip whatever the number of rectangles.\n
+ * A grabber attached to an SRDisplayLoop has its connection read by the loop: the events are taken off the
+ * socket as they come, under the lock grab() holds, and grab() only drains the ones already read.
+ */
+class SRX11Grabber : public SRVideoGrabber {
+
+private:
+    struct Segment {
+        XShmSegmentInfo shminfo;
+        XImage *image;
+        Pixmap pixmap;
+        std::vector<XRectangle> missed;     //damage since the image was last grabbed in
+        bool full;                          //too much missed damage, the image is grabbed whole
+        std::atomic<int> refs;              //the grabber and the frame grabbed in it
+    };
+
+    Display *display;
+    Display *events;                    //the damage is read from: display, or a connection of its own with a loop
+    xcb_connection_t *connection;       //set when the images are fetched with xcb_get_image
+    Window root;
+    bool sharedPixmaps;
+    std::vector<Segment *> segments;
+    GC gc;
+    Damage damage;
+    int damageEventBase;
+
+    int x, y, width, height;
+    bool fullGrab;
+    bool undelivered;
+    std::vector<XRectangle> dirty;
+    std::vector<XRectangle> taken;      //the damage of the current grab, out of the lock
+    std::vector<XRectangle> requested;  //of fetchImage()
+    std::vector<xcb_get_image_cookie_t> cookies;
+
+    bool drawCursor;
+    bool hugePages;
+    bool localImages;                   //no shared memory even when the server offers it
+    int fixesEventBase;
+    bool cursorChanged;
+    std::vector<uint32_t> cursor;       //premultiplied ARGB
+    int cursorWidth, cursorHeight, cursorHotX, cursorHotY;
+    bool pointerShown;                  //the pointer covers part of the region
+    XRectangle pointerArea;             //where it does, clipped to the region
+    int pointerLeft, pointerTop;        //corner of the cursor image, root coordinates
+
+    Window window;                      //followed window, 0 for a fixed region
+    bool windowMoved;
+
+    SRDisplayLoop *loop;                //reading the connection, nullptr when grab() does
+    std::mutex eventLock;               //of the damage and the flags the loop sets, never held over a request
+
+    Segment *createSegment();
+    Segment *createLocalSegment();
+    int fetchImage(Segment *segment);
+    Segment *freeSegment();
+    void collectDamage();
+    void readEvents();
+    bool updatePointer(bool imageChanged);
+    void drawPointer(Segment *segment);
+    void trackWindow(Window followed);
+    static void releaseSegment(void *opaque, uint8_t *data);
+
+public:
+    /**
+     * @param drawCursor composite the mouse pointer into the frames
+     * @param hugePages back the shared images with huge pages
+     */
+    explicit SRX11Grabber(bool drawCursor = false, bool hugePages = false);
+    ~SRX11Grabber() override;
+
+    SRX11Grabber(const SRX11Grabber&) = delete;
+    SRX11Grabber &operator=(const SRX11Grabber&) = delete;
+
+    /**
+     * followWindow() makes the region follow a window as it moves, called before open()
+     */
+    void followWindow(Window window) { this->window = window; }
+
+    /**
+     * fetchOverConnection() gets the images with xcb_get_image even from a server that could share memory,
+     * the path of the remote displays, called before open()
+     */
+    void fetchOverConnection() { localImages = true; }
+
+    /**
+     * attachLoop() has the events of the display read by loop, called before open(); loop must outlive the grabber.
+     * They come on a second connection to the display: the loop never waits for a grab, nor a grab for the loop
+     */
+    void attachLoop(SRDisplayLoop *loop) { this->loop = loop; }
+
+    /**
+     * windowArea() finds where the inside of a window is on its screen
+     * @param device display name, as for open()
+     * @return false if the display cannot be opened or the window does not exist
+     */
+    static bool windowArea(const char *device, Window window, int &x, int &y, int &width, int &height);
+
+    int open(const char *device, int x, int y, int width, int height) override;
+    int grab(AVFrame *frame) override;
+
+    enum AVPixelFormat pixelFormat() const override { return AV_PIX_FMT_BGR0; }
+    const char *name() const override { return "x11damage"; }
+    bool allocatesFrames() const override { return true; }
+    int64_t reservedBytes() const override { return (int64_t) X11_SHM_RING_MAX * width * height * 4; }
+};
+
+#endif
+
+#endif //CPPSCREENRECORDER_SRX11GRABBER_H
@@ -0,0 +1,47 @@
+//
+// Scoped trap of the X errors of one display.
+//
+
+#include "SRXErrorTrap.h"
+
+#ifdef __unix__
+
+std::mutex SRXErrorTrap::lock;
+Display *SRXErrorTrap::trapped = nullptr;
+int (*SRXErrorTrap::previous)(Display *, XErrorEvent *) = nullptr;
+int SRXErrorTrap::errorCode = 0;
+
+int SRXErrorTrap::handler(Display *display, XErrorEvent *error) {
+    if (display != trapped)
+        return previous ? previous(display, error) : 0;
+    if (!errorCode)
+        errorCode = error->error_code;
+    return 0;
+}
+
+SRXErrorTrap::SRXErrorTrap(Display *display): held(true) {
+    lock.lock();
+    //errors of requests sent before the trap belong to their sender
+    XSync(display, False);
+    trapped = display;
+    errorCode = 0;
+    previous = XSetErrorHandler(handler);
+}
+
+SRXErrorTrap::~SRXErrorTrap() {
+    release();
+}
+
+int SRXErrorTrap::release() {
+    if (!held)
+        return 0;
+    XSync(trapped, False);
+    XSetErrorHandler(previous);
+    int code = errorCode;
+    trapped = nullptr;
+    held = false;
+    lock.unlock();
+    return code;
+}
+
+#endif
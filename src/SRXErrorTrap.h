@@ -0,0 +1,43 @@
+//
+// Scoped trap of the X errors of one display.
+//
+
+#ifndef CPPSCREENRECORDER_SRXERRORTRAP_H
+#define CPPSCREENRECORDER_SRXERRORTRAP_H
+
+#ifdef __unix__
+
+#include <mutex>
+#include <X11/Xlib.h>
+
+/**
+ * SRXErrorTrap swallows the X errors of one display from its construction to release(): a window that went away
+ * or a refused XShmAttach() must not end the process through the default handler.\n
+ * The error handler of Xlib is global to the process, the grabber, the masks and the focus watcher call on their
+ * own displays from their own threads: the traps take turns on a mutex, and the errors of any other display
+ * go on to the handler that was installed before, as if there were no trap.
+ */
+class SRXErrorTrap {
+private:
+    static std::mutex lock;
+    static Display *trapped;
+    static int (*previous)(Display *, XErrorEvent *);
+    static int errorCode;
+    bool held;
+
+    static int handler(Display *display, XErrorEvent *error);
+
+public:
+    explicit SRXErrorTrap(Display *display);
+    ~SRXErrorTrap();
+
+    /**
+     * release() waits for the answers to the requests sent under the trap (XSync()) and puts the previous handler back
+     * @return the code of the first error trapped, 0 for none
+     */
+    int release();
+};
+
+#endif
+
+#endif //CPPSCREENRECORDER_SRXERRORTRAP_H
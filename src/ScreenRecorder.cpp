@@ -1,131 +1,531 @@
 
 #include "ScreenRecorder.h"
+#include "SRX11Grabber.h"
+#include "SRFbdevGrabber.h"
+#include "SRCompositeGrabber.h"
+#include "SRPulseGrabber.h"
+#include "SRWasapiGrabber.h"
+#include "SRDxgiGrabber.h"
+#include "SRSckGrabber.h"
 
 
 
 using namespace std;
 
+/**
+ * findDevice() looks up a capture demuxer, registering the devices of libavdevice on the first one: a recording
+ * on the native back-ends never touches them
+ */
+static AVInputFormat *findDevice(const char *source) {
+    static std::once_flag registered;
+    std::call_once(registered, avdevice_register_all);
+    return av_find_input_format(source);
+}
+
+/**
+ * resamplerHasSoxr() tells whether swresample was built with libsoxr, the engine of SR_RESAMPLER_HIGH
+ */
+static bool resamplerHasSoxr() {
+    return strstr(swresample_configuration(), "--enable-libsoxr") != nullptr;
+}
+
 
 
 
-ScreenRecorder::ScreenRecorder():captureSwitch(false), killSwitch(false), rawVideoFrame(nullptr), rawAudioFrame(nullptr) {
-    initBuffers();
+ScreenRecorder::ScreenRecorder():inVFormatContext(nullptr), inVOptions(nullptr), inVDeviceOptions(nullptr), inVCodecContext(nullptr), outAVFormatContext(nullptr), outVCodecContext(nullptr), outVOpenError(0), outVideoStreamIndex(-1), captureSwitch(false), killSwitch(false), rawVideoFrame(nullptr), rawAudioFrame(nullptr), hwDeviceContext(nullptr), filterGraph(nullptr), filterSrc(nullptr), filterSink(nullptr), convertWorkers(CONVERT_WORKERS), toneMapping(false), gpuCaptureFailed(false), burstEncoding(false), captureBuffer(CAPTURE_BUFFER), taskPool(nullptr), displayLoop(nullptr), scaleFlags(0), scaleBands(1), surfaceMapFailed(false), videoFrameCount(0), encodedFrames(0), encodedBytes(0), skippedStaticFrames(0), scrolledFrames(0), sceneGop(0), sceneKeyframes(0), overlaySeen(0), overlayWarned(false), maskWindowsPolled(0), maskWarned(false), policyDroppedFrames(0), firstCriticalFrame(AV_NOPTS_VALUE), nextCriticalFrame(AV_NOPTS_VALUE), vfrLast(nullptr), vfrPending(nullptr), vfrLastQueued(AV_NOPTS_VALUE), vfrMergedFrames(0), vfrKeepaliveFrames(0), numaRemoteFrames(0), numaRemoteBytes(0), qualityStep(0), shedFrames(0), shedCount(0), calmWindows(0), videoPassthrough(false), videoCopy(false), videoCopyIntra(false), videoCopyStarted(false), audioOverflows(0), audioUnderruns(0), audioDroppedSamples(0), muxQueuedBytes(0), muxQueuedDelay(0), muxOverflows(0), muxDroppedPackets(0), defaultIoOpen(nullptr), defaultIoClose(nullptr), rotatePending(false), keyframeRequested(false), muxContext(nullptr), rotations(0), pendingBitrate(0), congestionBitrate(0), congestionDroppedFrames(0), captureInterval(0), decimatedFrames(0), idleFrames(0), powerSaving(false), storageDegraded(false), storageFailed(false), moovReserve(0), muxedPackets(0), keyIndexDataStart(0), keyIndexFirstPts(AV_NOPTS_VALUE), keyIndexAfterWrite(false), lastActivity(AV_NOPTS_VALUE), activityOpen(false), activityEvents(0), uploadFollowing(false), uploadAdvanced(0), stopRequested(0), drainDeadline(0), shutdownTime(0), framesFlushed(0), framesAbandoned(0), packetsFlushed(0), threadsPending(0), statsEnded(false), videoHeartbeat(0), videoLost(false), resumeWall(0), staleDeviceFrames(0), audioStalePackets(0), syncStart(0), syncStop(0), videoOrigin(AV_NOPTS_VALUE) {
     initOptions();
-    avdevice_register_all();
+    attachLibavLog();
     cout << "\nScreen Recorder initialized correctly";
 }
 ScreenRecorder::~ScreenRecorder() {
 
-    if(settings._recvideo) videoThread.join();
-    if(settings._recaudio) audioThread.join();
-    //producerThread.join();
-
-    if( av_write_trailer(outAVFormatContext) < 0)
+    finishCapture();
+    for (auto &live : liveOutputs)
+        live->finish();
+    if(webrtcOutput)
+        webrtcOutput->finish();
+    if(capsCache) {
+        SRCapsStats caps = capsCache->stats();
+        capsCache->save();
+        cout << "\ncapability cache: " << caps.hits << " probes skipped, " << caps.misses << " run, "
+             << caps.stores << " results stored";
+    }
+    if(settings._recvideo) {
+        SRClockStats clock = getVideoClockStats();
+        cout << "\nvideo clock: " << clock.ticks << " frames, " << clock.missed << " missed deadlines, jitter "
+             << clock.meanJitter << " us mean, " << clock.maxJitter << " us max";
+    }
+    if(staleDeviceFrames || audioStalePackets)
+        cout << "\nresume: " << staleDeviceFrames << " video frames and " << audioStalePackets
+             << " audio packets buffered by the devices dropped";
+    if(congestionDroppedFrames)
+        cout << "\nWebRTC: " << congestionDroppedFrames << " frames dropped before the encoder while the bandwidth fell";
+    if(decimatedFrames)
+        cout << "\nframe rate: " << decimatedFrames << " device frames left out below the rate they were captured at";
+    if(idleFrames)
+        cout << "\nidle rate: " << idleFrames << " frames left out while the desktop got no input";
+    SRProfileStats profile = srProfileSnapshot();
+    if(profile.enabled) {
+        static const char *stageNames[SR_STAGE_COUNT] = {"grab", "decode", "scale", "encode", "mux"};
+        cout << "\nprofile: allocations per frame and lock waits";
+        for (int i = 0; i < SR_STAGE_COUNT; i++) {
+            uint64_t frames = stageTimes[i].snapshot().count;
+            cout << (i ? ", " : " ") << stageNames[i] << " "
+                 << (frames ? (double) profile.allocations[i] / frames : 0) << " / " << profile.contended[i] << " ("
+                 << profile.lockWait[i] / 1000 << " ms)";
+        }
+    }
+    for (size_t i = 0; i < muxQueues.size(); i++)
+        cout << "\nmux queue " << i << " high-water mark: " << muxQueues[i]->highWaterMark() << "/" << muxQueues[i]->maxSize();
+    if(muxOverflows)
+        cout << "\nmux queues: " << muxOverflows << " interleaving limit overruns, " << muxDroppedPackets << " packets dropped";
+    for (int i = 0; i < (int) scaledVideoQueues.size(); i++)
+        cout << "\nconvert worker " << i << " high-water marks: in " << rawVideoQueues[i]->highWaterMark()
+             << ", out " << scaledVideoQueues[i]->highWaterMark() << "/" << captureBuffer;
+    if(!audioTracks.empty())
+        cout << "\naudio ring: " << audioOverflows << " overflows (" << audioDroppedSamples << " samples dropped), "
+             << audioUnderruns << " underruns";
+    for (auto &track : audioTracks)
+        if(track->outACodecContext)
+            cout << "\naudio track " << track->index << " drift: " << track->drift / 1000.0 << " ms at the end, "
+                 << track->maxDrift / 1000.0 << " ms max, "
+                 << av_rescale(track->compensatedSamples, 1000, track->outACodecContext->sample_rate)
+                 << " ms compensated by the resampler";
+    for (auto &track : audioTracks)
+        if(track->outACodecContext && track->resampledSamples) {
+            //of one core: the time in the resampler over the duration of the audio it produced
+            double seconds = (double) track->resampledSamples / track->outACodecContext->sample_rate;
+            cout << "\naudio track " << track->index << " resampler ("
+                 << (settings._resampler == SR_RESAMPLER_FAST ? "fast" :
+                     settings._resampler == SR_RESAMPLER_HIGH ? (resamplerHasSoxr() ? "high, soxr" : "high") : "default")
+                 << "): " << track->resampleTime / 1000 << " ms for " << seconds << " s of audio, "
+                 << 100.0 * track->resampleTime / 1000000 / seconds << "% of a core";
+        }
+    for (auto &track : audioTracks)
+        if(track->outACodecContext && (track->gatedSamples || track->repeatedFrames))
+            cout << "\naudio track " << track->index << " silence: "
+                 << av_rescale(track->gatedSamples, 1000, track->outACodecContext->sample_rate) << " ms gated, "
+                 << track->repeatedFrames << " frames repeated instead of encoded";
+    for (auto &track : audioTracks)
+        if(track->dsp.active())
+            cout << "\naudio track " << track->index << " clean-up: normalization gain " << track->dsp.gainDb() << " dB"
+                 << (track->dsp.bypassed() ? ", noise suppression bypassed over its CPU budget" : "");
+    if(videoReader && videoReader->packetsDropped())
+        cout << "\nvideo reader: " << videoReader->packetsDropped() << " of " << videoReader->packetsRead()
+             << " packets dropped on a full queue of " << videoReader->maxSize();
+    for (auto &track : audioTracks)
+        if(track->reader && track->reader->packetsDropped())
+            cout << "\naudio track " << track->index << " reader: " << track->reader->packetsDropped() << " of "
+                 << track->reader->packetsRead() << " packets dropped on a full queue of " << track->reader->maxSize();
+    for (const SRCaptureGap &gap : captureGaps)
+        cout << "\nstream " << gap.stream << ": device lost at " << gap.start / 1000 << " ms for " << gap.duration / 1000 << " ms";
+    //the streams share the capture clock: what separates their first frames is their offset in the file
+    if(timelines && outVideoStreamIndex >= 0 && timelines[outVideoStreamIndex].startTime() != AV_NOPTS_VALUE)
+        for (auto &track : audioTracks)
+            if(track->outAudioStreamIndex >= 0 && timelines[track->outAudioStreamIndex].startTime() != AV_NOPTS_VALUE)
+                cout << "\naudio track " << track->index << " starts "
+                     << (timelines[track->outAudioStreamIndex].startTime() - timelines[outVideoStreamIndex].startTime()) / 1000.0
+                     << " ms after the video";
+    for (auto &track : audioTracks)
+        if(track->trimmedSamples && track->outACodecContext)
+            cout << "\naudio track " << track->index << ": "
+                 << av_rescale(track->trimmedSamples, 1000, FFMAX(track->inACodecContext->sample_rate, 1))
+                 << " ms captured before the first video frame left out";
+    av_buffer_unref(&hwDeviceContext);
+    avfilter_graph_free(&filterGraph);
+
+    if(replayBuffer) {
+        replayBuffer->finish();
+        SRReplayStats replay = replayBuffer->stats();
+        cout << "\nreplay buffer: " << replay.duration / 1000000.0 << " s in " << replay.gops << " GOPs ("
+             << replay.bytes / 1024 << " KiB, " << replay.slabs << " slabs allocated), " << replay.evictedGops << " GOPs evicted, "
+             << replay.saved << " replays saved";
+    }
+    if(frameReplay) {
+        frameReplay->finish();
+        SRFrameReplayStats replay = frameReplay->stats();
+        cout << "\nraw replay buffer: " << replay.duration / 1000000.0 << " s in " << replay.frames << " frames ("
+             << replay.bytes / 1024 << " KiB" << (replay.packed ? ", packed" : "") << "), " << replay.evictedFrames
+             << " frames evicted, " << replay.saved << " replays saved";
+    }
+    if(burstArena) {
+        SRBurstStats burst = burstArena->stats();
+        cout << "\nburst: " << burst.duration / 1000000.0 << " s in " << burst.frames << " frames, "
+             << (burst.used >> 20) << " of " << (burst.capacity >> 20) << " MiB ("
+             << (double) burst.rawBytes / FFMAX(burst.used, (int64_t) 1) << ":1), " << burst.refused << " frames refused";
+    }
+    if(prerollBuffer) {
+        SRReplayStats preroll = prerollBuffer->stats();
+        cout << "\nactivity gate: " << activityEvents << " activities written, " << preroll.evictedGops
+             << " GOPs of idle screen left out";
+    }
+    if(encoderArena)
+        cout << "\nencoder arena: " << encoderArena->slabsAllocated() << " slabs allocated for the video packets";
+    if(sharedFrames)
+        cout << "\nshared frames: " << sharedFrames->writtenFrames() << " written, " << sharedFrames->skippedFrames()
+             << " left out";
+    if(tileView) {
+        tileView->close();
+        SRTileViewStats view = tileView->stats();
+        cout << "\ntile view: " << view.viewers << " viewers, " << view.updates << " updates of " << view.tiles
+             << " tiles (" << view.bytes / 1024 << " KiB sent), " << view.unchanged << " frames unchanged, "
+             << view.replaced << " replaced";
+    }
+    if(tracer) {
+        if(tracer->write(settings.tracefile) < 0)
+            cout << "\ncannot write the trace to " << settings.tracefile;
+        else
+            cout << "\ntrace: " << tracer->recorded() << " events written to " << settings.tracefile << " ("
+                 << tracer->dropped() << " dropped)";
+    }
+    bool rewrite = finishFaststart();
+    if(settings._outputmode != SR_OUTPUT_REPLAY && settings._outputmode != SR_OUTPUT_CALLBACK && muxContext && av_write_trailer(muxContext) < 0)
     {
-        cout<<"\nerror in writing av trailer";
-        exit(1);
+        fail(SR_ERROR_OUTPUT, 0, "error in writing av trailer");
+    }
+    if(muxContext && closeOutputFile(muxContext) < 0) {
+        fail(SR_ERROR_OUTPUT, 0, "error in writing the output file");
+    }
+    if(muxContext != outAVFormatContext)
+        avformat_free_context(muxContext);
+    muxContext = nullptr;
+    if(rotations)
+        cout << "\noutput rotated " << rotations << " times";
+    if(rewrite)
+        rewriteFaststart(settings.filename);
+    uploadOutputFile();
+    bool indexed = (bool) keyIndex;
+    closeKeyIndex();
+    bool logged = (bool) inputLog;
+    closeInputLog();
+    bool tracked = (bool) cursorTrack;
+    closeCursorTrack();
+    closeWebcam();
+    bool hashed = (bool) phashIndex;
+    closePHashIndex();
+    closeQualityProbe();
+    if (contentRate)
+        cout << "\ncontent rate: VBV cap between " << contentRate->lowestCap() / 1000 << " and "
+             << contentRate->highestCap() / 1000 << " kbit/s, " << contentRate->changeCount() << " changes";
+    if(uploader) {
+        if(indexed)
+            uploader->upload((std::string(settings.filename) + ".idx").c_str());
+        if(logged)
+            uploader->upload((std::string(settings.filename) + ".input").c_str());
+        if(tracked)
+            uploader->upload((std::string(settings.filename) + CURSOR_SUFFIX).c_str());
+        if(hashed)
+            uploader->upload((std::string(settings.filename) + ".phash").c_str());
+        uploadRenamedFiles();
+        uploader->finish();
+        SRUploadStats up = uploader->stats();
+        cout << "\nupload: " << up.objects << " objects, " << up.parts << " parts, " << up.bytes / 1024 << " KiB in "
+             << up.elapsed / 1000000.0 << " s, " << up.retries << " requests sent again";
+        if(up.failed)
+            cout << ", " << up.failed << " uploads aborted, their files stay local";
     }
     avformat_close_input(&inVFormatContext);
     if (!inVFormatContext) {
         cout << "\nfile closed sucessfully";
     } else {
-        cout << "\nunable to close the file";
-        exit(1);
+        fail(SR_ERROR_VIDEO_DEVICE, 0, "unable to close the file");
     }
+    //avformat_close_input() has freed the input contexts: the tracks free theirs, with their codecs and rings
+    audioTracks.clear();
+    av_dict_free(&inVOptions);
+    av_dict_free(&inVDeviceOptions);
+    avcodec_free_context(&inVCodecContext);
+    avcodec_free_context(&outVCodecContext);
+    avformat_free_context(outAVFormatContext);
+    outAVFormatContext = nullptr;
+    cout << "\navformat free successfully";
+}
+
+/**
+ * ~AudioTrack() frees what the track opened, whether or not it reached the recording
+ */
+ScreenRecorder::AudioTrack::~AudioTrack() {
     avformat_close_input(&inAFormatContext);
-    if (!inAFormatContext) {
-        cout << "\nfile closed sucessfully";
-    } else {
-        cout << "\nunable to close the file";
-        exit(1);
+    av_dict_free(&inAOptions);
+    av_dict_free(&deviceOptions);
+    avcodec_free_context(&inACodecContext);
+    avcodec_free_context(&outACodecContext);
+    if (fifo)
+        av_audio_fifo_free(fifo);
+}
+
+/**
+ * The interrupt callback of the capture demuxers: a read blocked on a lost device returns once the watchdog flags it
+ */
+static int deviceInterrupted(void *opaque) {
+    return ((const std::atomic<bool> *) opaque)->load(std::memory_order_relaxed) ? 1 : 0;
+}
+
+/**
+ * watchedContext() gives a capture demuxer context the interrupt of the watchdog, allocating it when ctx is null
+ */
+static AVFormatContext *watchedContext(AVFormatContext *ctx, std::atomic<bool> *lost) {
+    if (!ctx)
+        ctx = avformat_alloc_context();
+    if (ctx) {
+        ctx->interrupt_callback.callback = deviceInterrupted;
+        ctx->interrupt_callback.opaque = lost;
     }
-    avformat_free_context(inVFormatContext);
-    if (!inVFormatContext) {
-        cout << "\n[IN_V] avformat free successfully";
-    } else {
-        cout << "\nunable to free avformat context [IN_VIDEO]";
-        exit(1);
+    return ctx;
+}
+
+SRError ScreenRecorder::lastError() const {
+    std::lock_guard<std::mutex> guard(errorLock);
+    return lastFailure;
+}
+
+/**
+ * report() keeps error for lastError() and hands it to the callback of onError(), outside the lock
+ */
+void ScreenRecorder::report(const SRError &error) {
+    {
+        std::lock_guard<std::mutex> guard(errorLock);
+        lastFailure = error;
     }
-    avformat_free_context(inAFormatContext);
-    if (!inAFormatContext) {
-        cout << "\n[IN_A]avformat free successfully";
-    } else {
-        cout << "\nunable to free avformat context [IN_AUDIO]";
+    if (errorCallback)
+        errorCallback(error);
+}
+
+/**
+ * fail() is the end of an open or init call that cannot go on: the message is printed and reported,
+ * then the process exits with settings._exitonerror
+ * @param averror the AVERROR of libav, 0 picks one from code
+ * @return the AVERROR for the call to return
+ */
+int ScreenRecorder::fail(SRErrorCode code, int averror, const string &message) {
+    cout << "\n" << message;
+    if (averror >= 0)
+        averror = code == SR_ERROR_MEMORY ? AVERROR(ENOMEM) : code == SR_ERROR_SETTINGS ? AVERROR(EINVAL) : AVERROR(EIO);
+    report({code, averror, false, message});
+    if (settings._exitonerror)
         exit(1);
-    }
-    avformat_free_context(outAVFormatContext);
-    if (!outAVFormatContext) {
-        cout << "\navformat free successfully";
-    } else {
-        cout << "\nunable to free avformat context [OUT_AV] ";
+    return averror;
+}
+
+/**
+ * failVideoSource() is fail() for openVideoSource(): the input it was opening is freed, so a retry starts from nothing
+ */
+int ScreenRecorder::failVideoSource(SRErrorCode code, int averror, const string &message) {
+    avformat_close_input(&inVFormatContext);
+    avcodec_free_context(&inVCodecContext);
+    av_dict_free(&inVOptions);
+    av_dict_free(&inVDeviceOptions);
+    return fail(code, averror, message);
+}
+
+/**
+ * failCapture() is fail() for the pipeline threads, printf style like srLog(): without settings._exitonerror
+ * the capture ends as with endCapture(), the caller gives back what it holds and lets the drain run
+ */
+void ScreenRecorder::failCapture(SRErrorCode code, int averror, const char *format, ...) {
+    char message[LOG_RECORD_SIZE];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    srLog(SR_LOG_ERROR, "%s", message);
+    if (averror >= 0)
+        averror = code == SR_ERROR_MEMORY ? AVERROR(ENOMEM) : AVERROR(EIO);
+    report({code, averror, false, message});
+    if (settings._exitonerror) {
+        flushLog();
         exit(1);
     }
+    endCapture();
 }
 
-
 int ScreenRecorder::openVideoSource() {
+    if(!settings._recvideo) return 0;
     int value = 0;
     inVOptions = nullptr;
     inVFormatContext = avformat_alloc_context();
 
 	cout<<"[openVideoSource] entering\n";
+
+    if (settings._gpupath)
+        negotiateGpuPath();
+
+    if (settings.tilesource && *settings.tilesource)
+        return openTileSource();
+    if (settings.sharedsource && *settings.sharedsource)
+        return openSharedSource();
+#if defined(__unix__) || defined(__APPLE__)
+    if (settings.window && *settings.window)
+        return openWindowSource();
+#endif
+#ifdef __unix__
+    if (settings.monitors && *settings.monitors)
+        return openMonitorSources();
+    if (!strcmp(settings.videosource, FBDEV_SOURCE))
+        return openFramebufferSource();
+    if (settings._damagecapture) {
+        SRX11Grabber *grabber = new SRX11Grabber(settings._drawcursor && !settings._cursortrack, settings._hugepages);
+        grabber->attachLoop(displayLoop);
+        return openNativeVideoSource(grabber);
+    }
+#else
+    if (settings.monitors && *settings.monitors)
+        cout << "\nmulti-monitor capture needs the X11 grabber, recording a single region";
+#endif
+#ifdef _WIN32
+    //the desktop duplication records monitors: a window goes through gdigrab
+    if (settings._gpucapture && !(settings.window && *settings.window)) {
+        //the grabber converts to the encoder geometry on the GPU
+        if (settings._outscreenres.width <= 0 || settings._outscreenres.height <= 0)
+            settings._outscreenres = settings._inscreenres;
+        return openNativeVideoSource(new SRDxgiGrabber(settings._outscreenres.width, settings._outscreenres.height));
+    }
+    //a HiDPI monitor recorded smaller: the video processor scales before the read back
+    if (sourceScaling() && !(settings.window && *settings.window))
+        return openNativeVideoSource(new SRDxgiGrabber(settings._outscreenres.width, settings._outscreenres.height, true));
+#endif
+#ifdef __APPLE__
+    if (settings._gpucapture) {
+        //the window server converts to the encoder geometry
+        if (settings._outscreenres.width <= 0 || settings._outscreenres.height <= 0)
+            settings._outscreenres = settings._inscreenres;
+        return openNativeVideoSource(new SRSckGrabber(settings._outscreenres.width, settings._outscreenres.height,
+                                                      settings._fps));
+    }
+    //a Retina display recorded smaller: the window server scales, the CPU maps the scaled pixel buffers
+    if (sourceScaling())
+        return openNativeVideoSource(new SRSckGrabber(settings._outscreenres.width, settings._outscreenres.height,
+                                                      settings._fps, true));
+#endif
+
     /*Defining options for the device initialization*/
 
     #ifdef __APPLE__
     value = av_dict_set(&inVOptions, "pixel_format", "0rgb", 0);
     if (value < 0) {
-        cout << "\nerror in setting dictionary value";
-        exit(1);
+        return failVideoSource(SR_ERROR_MEMORY, value, "error in setting dictionary value");
     }
     value = av_dict_set(&inVOptions, "video_device_index", "1", 0);
 
     if (value < 0) {
-        cout << "\nerror in setting dictionary value";
-        exit(1);
+        return failVideoSource(SR_ERROR_MEMORY, value, "error in setting dictionary value");
     }
 
     #endif
 
    // value = av_dict_set(&inVOptions, "framerate", "25", 0);
     if (value < 0) {
-        cout << "\nerror in setting dictionary value";
-        exit(1);
+        return failVideoSource(SR_ERROR_MEMORY, value, "error in setting dictionary value");
     }
     char s[30];
     sprintf(s,"%dx%d", settings._inscreenres.width,settings._inscreenres.height);
 
     value = av_dict_set(&inVOptions, "video_size", s, 0);
     if (value < 0) {
-        cout << "\nerror in setting dictionary value";
-        exit(1);
+        return failVideoSource(SR_ERROR_MEMORY, value, "error in setting dictionary value");
     }
     value = av_dict_set(&inVOptions, "preset", "medium", 0);
     if (value < 0) {
-        cout << "\nerror in setting preset values";
-        exit(1);
+        return failVideoSource(SR_ERROR_MEMORY, value, "error in setting preset values");
     }
 
     value = av_dict_set(&inVOptions, "probesize", "60M", 0);
     if (value < 0) {
-        cout << "\nerror in setting preset values";
-        exit(1);
+        return failVideoSource(SR_ERROR_MEMORY, value, "error in setting preset values");
+    }
+    if (settings._fastopen) {
+        //the stream parameters come from the options alone: the rate must be one of them
+        sprintf(s, "%d", settings._fps);
+        value = av_dict_set(&inVOptions, "framerate", s, 0);
+        if (value < 0) {
+            return failVideoSource(SR_ERROR_MEMORY, value, "error in setting dictionary value");
+        }
+    }
+
+    const char *videoSource = *settings.videosource ? settings.videosource : VIDEO_SOURCE;
+    const char *videoUrl = *settings.videourl ? settings.videourl : VIDEO_URL;
+#ifdef __unix__
+    if (settings._gpucapture) {
+        /* kmsgrab exports the scanout buffer as DRM PRIME frames: nothing is copied to system memory */
+        sprintf(s, "%d", settings._fps);
+        value = av_dict_set(&inVOptions, "framerate", s, 0);
+        if (value >= 0) value = av_dict_set(&inVOptions, "device", KMS_DEVICE, 0);
+        if (value < 0) {
+            return failVideoSource(SR_ERROR_MEMORY, value, "error in setting dictionary value");
+        }
+        videoSource = KMS_SOURCE;
+        videoUrl = "-";
+    }
+#endif
+    //the device grabs the region itself, nothing is cropped afterwards
+    std::string regionUrl;
+    if (!strcmp(videoSource, "x11grab")) {
+        regionUrl = std::string(videoUrl).substr(0, std::string(videoUrl).find('+')) + "+" +
+                    std::to_string(settings._screenoffset.x) + "," + std::to_string(settings._screenoffset.y);
+        videoUrl = regionUrl.c_str();
+        //the cursor track carries the pointer
+        if (settings._cursortrack && (value = av_dict_set(&inVOptions, "draw_mouse", "0", 0)) < 0)
+            return failVideoSource(SR_ERROR_MEMORY, value, "error in setting dictionary value");
+    } else if (!strcmp(videoSource, "gdigrab") && settings.window && *settings.window) {
+        //gdigrab follows the window, the size is the one of the window
+        regionUrl = std::string("title=") + settings.window;
+        videoUrl = regionUrl.c_str();
+        av_dict_set(&inVOptions, "video_size", nullptr, 0);
+    } else if (!strcmp(videoSource, "gdigrab")) {
+        value = av_dict_set_int(&inVOptions, "offset_x", settings._screenoffset.x, 0);
+        if (value >= 0) value = av_dict_set_int(&inVOptions, "offset_y", settings._screenoffset.y, 0);
+        if (value < 0) {
+            return failVideoSource(SR_ERROR_MEMORY, value, "error in setting dictionary value");
+        }
     }
+    //the options of the settings come last: they override the ones above
+    if ((value = applyDeviceOptions(&inVOptions, settings.videooptions)) < 0)
+        return failVideoSource(SR_ERROR_SETTINGS, value, string("invalid device options ") + settings.videooptions +
+                                              ", expected key=value:key=value");
 
     //get input format
-    inVInputFormat = av_find_input_format(VIDEO_SOURCE);
-    value = avformat_open_input(&inVFormatContext, VIDEO_URL, inVInputFormat, &inVOptions);
+    inVInputFormat = findDevice(videoSource);
+    if (!inVInputFormat) {
+        return failVideoSource(SR_ERROR_SETTINGS, 0, string("Unknown capture source ") + videoSource);
+    }
+    //a format the encoder takes as it is, when the device delivers it: nothing left to convert
+    value = -1;
+    for (const std::string &format : capturePixelFormats(inVInputFormat)) {
+        AVDictionary *options = nullptr;
+        av_dict_copy(&options, inVOptions, 0);
+        av_dict_set(&options, "pixel_format", format.c_str(), 0);
+        //a failed open frees the context
+        inVFormatContext = watchedContext(inVFormatContext, &videoLost);
+        value = avformat_open_input(&inVFormatContext, videoUrl, inVInputFormat, &options);
+        av_dict_free(&options);
+        if (value == 0) {
+            cout << "\nCapture pixel format: " << format;
+            av_dict_copy(&inVDeviceOptions, inVOptions, 0);
+            av_dict_set(&inVDeviceOptions, "pixel_format", format.c_str(), 0);
+            break;
+        }
+    }
     if (value != 0) {
-        cout << "\nCannot open selected device";
-        exit(1);
+        av_dict_copy(&inVDeviceOptions, inVOptions, 0);
+        inVFormatContext = watchedContext(inVFormatContext, &videoLost);
+        value = avformat_open_input(&inVFormatContext, videoUrl, inVInputFormat, &inVOptions);
+    }
+    if (value != 0 && settings._gpupath && settings._gpucapture) {
+        av_dict_free(&inVOptions);
+        av_dict_free(&inVDeviceOptions);
+        return fallBackFromGpuCapture();
+    }
+    if (value != 0) {
+        return failVideoSource(SR_ERROR_VIDEO_DEVICE, value, "Cannot open selected device");
     }
+    inVUrl = videoUrl;
 
 
 
     //get video stream infos from context
-    value = avformat_find_stream_info(inVFormatContext, nullptr);
+    value = probeStreams(inVFormatContext, AVMEDIA_TYPE_VIDEO);
     if (value < 0) {
-        cout << "\nCannot find the stream information";
-        exit(1);
+        return failVideoSource(SR_ERROR_VIDEO_DEVICE, value, "Cannot find the stream information");
     }
 
     //find the first video stream with a given code
@@ -138,707 +538,6825 @@ int ScreenRecorder::openVideoSource() {
     }
 
     if (inVideoStreamIndex == -1) {
-        cout << "\nCannot find the video stream index. (-1)";
-        exit(1);
+        return failVideoSource(SR_ERROR_VIDEO_DEVICE, AVERROR_STREAM_NOT_FOUND, "Cannot find the video stream index. (-1)");
     }
 
     AVCodecParameters *params = inVFormatContext->streams[inVideoStreamIndex]->codecpar;
     inVCodec = avcodec_find_decoder(params->codec_id);
     if (inVCodec == nullptr) {
-        cout << "\nCannot find the decoder";
-        exit(1);
+        return failVideoSource(SR_ERROR_VIDEO_DEVICE, AVERROR_DECODER_NOT_FOUND, "Cannot find the decoder");
     }
 
     inVCodecContext = avcodec_alloc_context3(inVCodec);
     avcodec_parameters_to_context(inVCodecContext, params);
+    inVCodecContext->thread_count = settings._decthreads;
 
     value = avcodec_open2(inVCodecContext, inVCodec, nullptr);
     if (value < 0) {
-        cout << "\nCannot open the av codec";
-        exit(1);
+        return failVideoSource(SR_ERROR_VIDEO_DEVICE, value, "Cannot open the av codec");
+    }
+
+    return 0;
+}
+/**
+ * openVideoSource() with a grabber captures from a caller supplied back-end, e.g. an SRTestGrabber,
+ * in place of the display
+ * @param grabber back-end to use, the recorder takes its ownership
+ */
+int ScreenRecorder::openVideoSource(SRVideoGrabber *grabber) {
+    if(!settings._recvideo) {
+        delete grabber;
+        return 0;
+    }
+    inVOptions = nullptr;
+    inVFormatContext = avformat_alloc_context();
+    return openNativeVideoSource(grabber);
+}
+
+#ifdef __unix__
+/**
+ * openMonitorSources() records the regions of settings.monitors, each one grabbed by its own SRX11Grabber and thread
+ * and composited left to right: the canvas becomes the input resolution, and the output one when it is not set.
+ */
+int ScreenRecorder::openMonitorSources() {
+    SRCompositeGrabber *composite = new SRCompositeGrabber();
+    const char *spec = settings.monitors;
+    while (*spec) {
+        int w, h, x, y, used = 0;
+        if (sscanf(spec, "%dx%d+%d,%d%n", &w, &h, &x, &y, &used) != 4 || w <= 0 || h <= 0) {
+            return fail(SR_ERROR_SETTINGS, 0, string("invalid monitor list ") + settings.monitors +
+                                              ", expected WxH+X,Y;WxH+X,Y");
+        }
+        SRX11Grabber *grabber = new SRX11Grabber(settings._drawcursor && !settings._cursortrack, settings._hugepages);
+        grabber->attachLoop(displayLoop);
+        composite->add(grabber, x, y, w, h);
+        spec += used;
+        while (*spec == ';' || *spec == ' ')
+            spec++;
+    }
+    settings._inscreenres = {composite->width(), composite->height()};
+    if (settings._outscreenres.width <= 0 || settings._outscreenres.height <= 0)
+        settings._outscreenres = settings._inscreenres;
+    cout << "\nMonitors composited on a " << composite->width() << "x" << composite->height() << " canvas";
+    return openNativeVideoSource(composite);
+}
+
+/**
+ * openFramebufferSource() records the framebuffer device of settings.videourl, FBDEV_DEVICE by default, with
+ * SRFbdevGrabber in place of the fbdev demuxer: the visible screen unless settings._inscreenres is set,
+ * compared page by page with settings._damagecapture.
+ */
+int ScreenRecorder::openFramebufferSource() {
+    if (!*settings.videourl)
+        settings.videourl = (char *) FBDEV_DEVICE;
+    if (settings._inscreenres.width <= 0 || settings._inscreenres.height <= 0) {
+        int width = 0, height = 0;
+        if (!SRFbdevGrabber::screenSize(settings.videourl, width, height)) {
+            return fail(SR_ERROR_VIDEO_DEVICE, AVERROR(ENODEV), string("no framebuffer ") + settings.videourl);
+        }
+        //the encoders want even sizes
+        settings._inscreenres = {(width - settings._screenoffset.x) & ~1, (height - settings._screenoffset.y) & ~1};
+    }
+    if (settings._outscreenres.width <= 0 || settings._outscreenres.height <= 0)
+        settings._outscreenres = settings._inscreenres;
+    cout << "\nRecording framebuffer " << settings.videourl << ", " << settings._inscreenres.width << "x"
+         << settings._inscreenres.height;
+    return openNativeVideoSource(new SRFbdevGrabber(settings._damagecapture));
+}
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+/**
+ * openWindowSource() records the window of settings.window, the region following it as it moves:
+ * an X11 window id with the XDamage grabber, a CGWindowID with ScreenCaptureKit.
+ * The window size becomes the input resolution, and the output one when it is not set.
+ */
+int ScreenRecorder::openWindowSource() {
+    char *end = nullptr;
+    unsigned long id = strtoul(settings.window, &end, 0);
+    if (!id || *end) {
+        return fail(SR_ERROR_SETTINGS, 0, string("invalid window ") + settings.window + ", expected a window id");
+    }
+    int x = 0, y = 0, width = 0, height = 0;
+#ifdef __unix__
+    if (!SRX11Grabber::windowArea(*settings.videourl ? settings.videourl : VIDEO_URL, (Window) id, x, y, width, height)) {
+#else
+    if (!SRSckGrabber::windowSize((uint32_t) id, width, height)) {
+#endif
+        return fail(SR_ERROR_VIDEO_DEVICE, AVERROR(ENODEV), string("no window ") + settings.window);
+    }
+    //the encoders want even sizes
+    settings._screenoffset = {x, y};
+    settings._inscreenres = {width & ~1, height & ~1};
+    if (settings._outscreenres.width <= 0 || settings._outscreenres.height <= 0)
+        settings._outscreenres = settings._inscreenres;
+    cout << "\nRecording window " << settings.window << ", " << settings._inscreenres.width << "x" << settings._inscreenres.height;
+#ifdef __unix__
+    SRX11Grabber *grabber = new SRX11Grabber(settings._drawcursor && !settings._cursortrack, settings._hugepages);
+    grabber->followWindow((Window) id);
+    grabber->attachLoop(displayLoop);
+#else
+    SRSckGrabber *grabber = new SRSckGrabber(settings._outscreenres.width, settings._outscreenres.height, settings._fps);
+    grabber->followWindow((uint32_t) id);
+#endif
+    return openNativeVideoSource(grabber);
+}
+#endif
+
+/**
+ * Capture demuxers that fill the codec parameters of their streams when they are opened.
+ */
+static const char *const deviceDemuxers[] = {
+        "x11grab", "kmsgrab", "gdigrab", "dshow", "avfoundation", "pulse", "alsa", "lavfi",
+};
+
+/**
+ * streamValues() reads the parameters of the first stream of the given type a probe would fill: width, height and
+ * pixel format, or sample rate, channels and sample format
+ * @return false if there is no such stream or the device left one of them unset
+ */
+static bool streamValues(const AVFormatContext *ctx, enum AVMediaType type, int32_t values[CAPS_VALUES]) {
+    for (unsigned int i = 0; i < ctx->nb_streams; i++) {
+        const AVCodecParameters *par = ctx->streams[i]->codecpar;
+        if (par->codec_type != type)
+            continue;
+        values[0] = type == AVMEDIA_TYPE_VIDEO ? par->width : par->sample_rate;
+        values[1] = type == AVMEDIA_TYPE_VIDEO ? par->height : par->channels;
+        values[2] = par->format;
+        return values[0] > 0 && values[1] > 0 && values[2] >= 0;
+    }
+    return false;
+}
+
+/**
+ * probeStreams() makes sure the codec parameters of the first stream of the given type are known.\n
+ * With settings._fastopen the parameters a capture device set when it was opened are used as they are,
+ * which saves avformat_find_stream_info() reading and decoding frames before the capture starts;
+ * any other input, or a device that left them incomplete, is probed.\n
+ * With a capability cache a device whose probe last changed none of the parameters it opened with skips it as
+ * well, as long as it opens with the same ones.
+ */
+int ScreenRecorder::probeStreams(AVFormatContext *ctx, enum AVMediaType type) {
+    bool device = false;
+    for (const char *name : deviceDemuxers)
+        device = device || !strcmp(ctx->iformat->name, name);
+
+    int32_t opened[CAPS_VALUES] = {0};
+    bool complete = device && streamValues(ctx, type, opened);
+    if (settings._fastopen && device) {
+        if (complete)
+            return 0;
+        cout << "\n" << ctx->iformat->name << " left its stream parameters incomplete, probing";
+    }
+
+    SRCapabilityCache *caps = device ? capabilities() : nullptr;
+    string key = string("probe:") + ctx->iformat->name + ":" + (ctx->url ? ctx->url : "") + ":" +
+                 av_get_media_type_string(type);
+    SRCapsEntry entry;
+    if (caps && complete && caps->lookup(key.c_str(), entry) && entry.result == 0 &&
+        !memcmp(entry.values, opened, sizeof(opened))) {
+        cout << "\n" << ctx->iformat->name << " opened with the parameters its last probe found, not probed";
+        return 0;
+    }
+
+    int ret = avformat_find_stream_info(ctx, nullptr);
+    int32_t probed[CAPS_VALUES] = {0};
+    if (caps && ret >= 0) {
+        //only a probe that found what the device said at open can be skipped the next time
+        if (complete && streamValues(ctx, type, probed) && !memcmp(probed, opened, sizeof(opened)))
+            caps->store(key.c_str(), 0, opened, CAPS_VALUES);
+        else
+            caps->store(key.c_str(), AVERROR(EAGAIN));
+    }
+    return ret;
+}
+
+/**
+ * openTileSource() makes this recorder the encode node of a tileclient: it waits on settings.tilesource for the
+ * client, whose screen becomes the input resolution, and the output one when it is not set.
+ */
+int ScreenRecorder::openTileSource() {
+    SRTileGrabber *grabber = new SRTileGrabber(settings.tilesource);
+    cout << "\nwaiting for a tile client on " << settings.tilesource;
+    int ret = grabber->listen();
+    if (ret < 0) {
+        delete grabber;
+        return fail(SR_ERROR_VIDEO_DEVICE, ret, string("no tile client on ") + settings.tilesource + ": " +
+                                                to_string(ret));
+    }
+    settings._screenoffset = {0, 0};
+    settings._inscreenres = {grabber->frameWidth(), grabber->frameHeight()};
+    if (settings._outscreenres.width <= 0 || settings._outscreenres.height <= 0)
+        settings._outscreenres = settings._inscreenres;
+    cout << "\nRecording the " << grabber->frameWidth() << "x" << grabber->frameHeight() << " screen of the tile client";
+    return openNativeVideoSource(grabber);
+}
+
+/**
+ * openSharedSource() makes this recorder the encode process of a capturehost: the frames of the ring of
+ * settings.sharedsource, whose geometry becomes the input resolution, and the output one when it is not set.
+ */
+int ScreenRecorder::openSharedSource() {
+    SRSharedGrabber *grabber = new SRSharedGrabber(settings.sharedsource);
+    int ret = grabber->connect();
+    if (ret < 0) {
+        delete grabber;
+        return fail(SR_ERROR_VIDEO_DEVICE, ret, string("no capture ring ") + settings.sharedsource + ": " +
+                                                to_string(ret));
+    }
+    settings._screenoffset = {0, 0};
+    settings._inscreenres = {grabber->frameWidth(), grabber->frameHeight()};
+    if (settings._outscreenres.width <= 0 || settings._outscreenres.height <= 0)
+        settings._outscreenres = settings._inscreenres;
+    cout << "\nRecording the " << grabber->frameWidth() << "x" << grabber->frameHeight() << " frames of the capture ring "
+         << settings.sharedsource;
+    return openNativeVideoSource(grabber);
+}
+
+/**
+ * openNativeVideoSource() opens a native capture back-end in place of the libavdevice demuxer.
+ * inVCodecContext is only allocated to describe the frames the grabber produces, no decoder is opened.
+ *
+ * @param grabber back-end to use, the recorder takes its ownership
+ */
+int ScreenRecorder::openNativeVideoSource(SRVideoGrabber *grabber) {
+    videoGrabber.reset(grabber);
+    avformat_free_context(inVFormatContext);
+    inVFormatContext = nullptr;
+
+    if (videoGrabber->open(*settings.videourl ? settings.videourl : VIDEO_URL, settings._screenoffset.x, settings._screenoffset.y,
+                           settings._inscreenres.width, settings._inscreenres.height) < 0) {
+        if (settings._gpupath && settings._gpucapture) {
+            videoGrabber.reset();
+            return fallBackFromGpuCapture();
+        }
+        return fail(SR_ERROR_VIDEO_DEVICE, 0, "Cannot open selected device");
+    }
+
+    inVCodecContext = avcodec_alloc_context3(nullptr);
+    if (!inVCodecContext) {
+        return fail(SR_ERROR_MEMORY, 0, "Cannot allocate the video input description");
+    }
+    inVCodecContext->codec_type = AVMEDIA_TYPE_VIDEO;
+    inVCodecContext->width = settings._inscreenres.width;
+    inVCodecContext->height = settings._inscreenres.height;
+    inVCodecContext->pix_fmt = videoGrabber->pixelFormat();
+    inVCodecContext->time_base = {1, 1000000};
+    if (videoGrabber->hwFramesContext()) {
+        //device surfaces, already at the size of the frames context
+        AVHWFramesContext *frames = (AVHWFramesContext *) videoGrabber->hwFramesContext()->data;
+        inVCodecContext->hw_frames_ctx = av_buffer_ref(videoGrabber->hwFramesContext());
+        inVCodecContext->width = frames->width;
+        inVCodecContext->height = frames->height;
+    } else if (videoGrabber->scaledSize(inVCodecContext->width, inVCodecContext->height)) {
+        //scaled at the source: the convert stage only changes the pixel format
+        cout << "\nScaled at the source to " << inVCodecContext->width << "x" << inVCodecContext->height;
     }
+    cout << "\nVideo grabber: " << videoGrabber->name();
 
     return 0;
 }
+
+/**
+ * applyDeviceOptions() adds the "key=value:key=value" options of a settings string to a demuxer dictionary
+ * @return 0 on success, a negative AVERROR for a malformed string
+ */
+int ScreenRecorder::applyDeviceOptions(AVDictionary **options, const char *spec) {
+    if (!spec || !*spec)
+        return 0;
+    return av_dict_parse_string(options, spec, "=", ":", 0);
+}
+
+/**
+ * capturePixelFormats() are the pixel formats to ask the capture demuxer for, in order, from settings.capturepixfmt.
+ * "auto" takes the 8 bit YUV formats of the encoder the recording will most likely get: NV12 first, the input of
+ * the hardware encoders, then the ones of the software encoder of the profile.
+ * @return nothing when the demuxer has no pixel_format option or settings.videooptions sets one
+ */
+std::vector<std::string> ScreenRecorder::capturePixelFormats(const AVInputFormat *format) const {
+    std::vector<std::string> formats;
+    if (!*settings.capturepixfmt || strstr(settings.videooptions, "pixel_format") ||
+        !format->priv_class || !av_opt_find((void *) &format->priv_class, "pixel_format", nullptr, 0, AV_OPT_SEARCH_FAKE_OBJ))
+        return formats;
+    if (strcmp(settings.capturepixfmt, "auto")) {
+        formats.push_back(settings.capturepixfmt);
+        return formats;
+    }
+    //the intermediate codecs pick the format of the capture, whatever it is; 4:4:4, RGB and 10 bit recordings
+    //keep the device default, the 8 bit YUV formats would subsample or truncate it
+    if (settings._profile == SR_PROFILE_INTERMEDIATE || settings._chroma != SR_CHROMA_420 || settings._hdr != SR_HDR_OFF)
+        return formats;
+    if (settings._encoder != SR_ENCODER_SOFTWARE)
+        formats.push_back("nv12");
+    const char *name = settings._codec == SR_CODEC_VP8 ? "libvpx" : settings._codec == SR_CODEC_VP9 ? "libvpx-vp9" :
+                       settings._profile == SR_PROFILE_LEGACY && settings._codec != SR_CODEC_X264 ? "mpeg4" :
+                       settings._codec == SR_CODEC_HEVC ? "libx265" : "libx264";
+    const AVCodec *codec = avcodec_find_encoder_by_name(name);
+    if (!codec)
+        codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    for (int i = 0; codec && codec->pix_fmts && codec->pix_fmts[i] != AV_PIX_FMT_NONE; i++) {
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(codec->pix_fmts[i]);
+        //the full range variants are the same buffers with another flag: asking for them again gives nothing
+        if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_HWACCEL)) || desc->comp[0].depth != 8 ||
+            !strncmp(desc->name, "yuvj", 4) || std::find(formats.begin(), formats.end(), desc->name) != formats.end())
+            continue;
+        formats.push_back(desc->name);
+    }
+    if (formats.size() > CAPTURE_FORMAT_TRIES)
+        formats.resize(CAPTURE_FORMAT_TRIES);
+    return formats;
+}
+
+/**
+ * printDevices() lists the devices a capture demuxer enumerates, the default one is marked with a '*'
+ */
+static void printDevices(const char *kind, const char *source) {
+    AVInputFormat *format = findDevice(source);
+    AVDeviceInfoList *list = nullptr;
+    cout << "\n" << kind << " devices of " << source << ":";
+    if (!format) {
+        cout << " unknown capture source";
+        return;
+    }
+    int count = avdevice_list_input_sources(format, nullptr, nullptr, &list);
+    if (count < 0) {
+        char error[AV_ERROR_MAX_STRING_SIZE];
+        cout << " cannot be listed (" << av_make_error_string(error, sizeof(error), count) << ")";
+        return;
+    }
+    for (int i = 0; i < list->nb_devices; i++)
+        cout << "\n " << (i == list->default_device ? "* " : "  ") << list->devices[i]->device_name
+             << " - " << list->devices[i]->device_description;
+    if (!list->nb_devices)
+        cout << " none";
+    avdevice_free_list_devices(&list);
+}
+
+/**
+ * listDevices() prints the devices of the video and audio capture sources of the settings,
+ * the names can be used as settings.videourl and settings.audiourl
+ * @Note devices that cannot enumerate (x11grab, gdigrab) only take their display or window as url
+ */
+void ScreenRecorder::listDevices() const {
+    printDevices("video", *settings.videosource ? settings.videosource : VIDEO_SOURCE);
+    printDevices("audio", *settings.audiosource ? settings.audiosource : AUDIO_SOURCE);
+    cout << "\n";
+}
+
 int ScreenRecorder::openAudioSource() {
-    if(!settings._recaudio) return 0;
-    int value = 0;
-    inAOptions = nullptr;
+    if(settings._recaudio && settings._burst)
+        cout << "\nthe burst mode records no audio";
+    if(!settings._recaudio || settings._burst) return 0;
 
 	cout<<"[openAudioSource] entering\n";
 
-    inAFormatContext = avformat_alloc_context();
+    audioTracks.emplace_back(new AudioTrack(0));
+    SRAudioGrabber *native = settings._nativeaudio ? nativeAudioGrabber() : nullptr;
+    int ret;
+    if (native)
+        ret = openNativeAudioSource(*audioTracks[0], native, settings.audiourl);
+    else
+        ret = openDemuxerAudioSource(*audioTracks[0], *settings.audiosource ? settings.audiosource : AUDIO_SOURCE,
+                                     *settings.audiourl ? settings.audiourl : AUDIO_URL, settings.audiooptions);
+    if (ret < 0)
+        return ret;
+    return openAudioTracks();
+}
+
+/**
+ * nativeAudioGrabber() is the native audio back-end of the platform: PulseAudio on linux, WASAPI on windows
+ * @return a new grabber, nullptr where there is none
+ */
+SRAudioGrabber *ScreenRecorder::nativeAudioGrabber() {
+#ifdef __unix__
+    return new SRPulseGrabber();
+#elif defined(_WIN32)
+    return new SRWasapiGrabber();
+#else
+    return nullptr;
+#endif
+}
 
+/**
+ * openAudioTracks() opens the sources of settings.audiotracks, after track 0: each one is recorded
+ * by its own AudioThread and encoder into a stream of its own
+ */
+int ScreenRecorder::openAudioTracks() {
+    const char *spec = settings.audiotracks;
+    int ret;
+    while (*spec) {
+        size_t length = strcspn(spec, ";");
+        std::string entry(spec, length);
+        spec += length;
+        while (*spec == ';' || *spec == ' ')
+            spec++;
+        size_t split = entry.find('=');
+        if (split == std::string::npos || !split) {
+            return fail(SR_ERROR_SETTINGS, 0, string("invalid audio track list ") + settings.audiotracks +
+                                              ", expected source=url;source=url");
+        }
+        std::string source = entry.substr(0, split), url = entry.substr(split + 1);
+
+        audioTracks.emplace_back(new AudioTrack((int) audioTracks.size()));
+        AudioTrack &track = *audioTracks.back();
+        if (source == "native") {
+            SRAudioGrabber *native = nativeAudioGrabber();
+            if (!native) {
+                return fail(SR_ERROR_AUDIO_DEVICE, AVERROR(ENOSYS),
+                            "no native audio back-end on this platform for the track " + url);
+            }
+            ret = openNativeAudioSource(track, native, url.c_str());
+        } else
+            ret = openDemuxerAudioSource(track, source.c_str(), url.c_str(), "");
+        if (ret < 0)
+            return ret;
+        cout << "\naudio track " << track.index << ": " << entry;
+    }
+    return 0;
+}
 
-    inAInputFormat = av_find_input_format(AUDIO_SOURCE);
-    value = avformat_open_input(&inAFormatContext, AUDIO_URL, inAInputFormat, &inAOptions);
+/**
+ * openDemuxerAudioSource() opens url with the libavdevice demuxer source and its decoder for the track
+ * @param options "key=value:key=value" demuxer options
+ */
+int ScreenRecorder::openDemuxerAudioSource(AudioTrack &a, const char *source, const char *url, const char *options) {
+    int value = 0;
+    a.inAOptions = nullptr;
+    a.inAFormatContext = avformat_alloc_context();
+    if ((value = applyDeviceOptions(&a.inAOptions, options)) < 0)
+        return fail(SR_ERROR_SETTINGS, value, string("invalid device options ") + options +
+                                              ", expected key=value:key=value");
+    //the rate of the encoder: the samples then only change format on the way, settings.audiooptions may set another
+    if (!strcmp(source, "pulse") || !strcmp(source, "alsa") || !strcmp(source, "dshow"))
+        av_dict_set_int(&a.inAOptions, "sample_rate", AUDIO_ENCODER_RATE, AV_DICT_DONT_OVERWRITE);
+
+    a.inAInputFormat = findDevice(source);
+    if (!a.inAInputFormat) {
+        return fail(SR_ERROR_SETTINGS, 0, string("Unknown capture source ") + source);
+    }
+    a.deviceUrl = url;
+    av_dict_copy(&a.deviceOptions, a.inAOptions, 0);
+    a.inAFormatContext = watchedContext(a.inAFormatContext, &a.lost);
+    value = avformat_open_input(&a.inAFormatContext, url, a.inAInputFormat, &a.inAOptions);
     if (value != 0) {
-        cout << "\nCannot open selected device";
-        exit(1);
+        return fail(SR_ERROR_AUDIO_DEVICE, value, "Cannot open selected device");
     }
 
-    value = avformat_find_stream_info(inAFormatContext, nullptr);
+    value = probeStreams(a.inAFormatContext, AVMEDIA_TYPE_AUDIO);
     if (value < 0) {
-        cout << "\nCannot find the audio stream information";
-        exit(1);
+        return fail(SR_ERROR_AUDIO_DEVICE, value, "Cannot find the audio stream information");
     }
 
     //find the first video stream with a given code
-    inAudioStreamIndex = -1;
-    for (int i = 0; i < inAFormatContext->nb_streams; i++){
-        if (inAFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-            inAudioStreamIndex = i;
+    a.inAudioStreamIndex = -1;
+    for (int i = 0; i < a.inAFormatContext->nb_streams; i++){
+        if (a.inAFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+            a.inAudioStreamIndex = i;
             break;
         }
     }
 
-    if (inAudioStreamIndex == -1) {
-        cout << "\nCannot find the audio stream index. (-1)";
-        exit(1);
+    if (a.inAudioStreamIndex == -1) {
+        return fail(SR_ERROR_AUDIO_DEVICE, AVERROR_STREAM_NOT_FOUND, "Cannot find the audio stream index. (-1)");
     }
 
-    AVCodecParameters *params = inAFormatContext->streams[inAudioStreamIndex]->codecpar;
-    inACodec = avcodec_find_decoder(params->codec_id);
-    if (inACodec == nullptr) {
-        cout << "\nCannot find the audio decoder";
-        exit(1);
+    AVCodecParameters *params = a.inAFormatContext->streams[a.inAudioStreamIndex]->codecpar;
+    a.inACodec = avcodec_find_decoder(params->codec_id);
+    if (a.inACodec == nullptr) {
+        return fail(SR_ERROR_AUDIO_DEVICE, AVERROR_DECODER_NOT_FOUND, "Cannot find the audio decoder");
     }
-    cout << "Input audio codec:" << inACodec->name;
+    cout << "Input audio codec:" << a.inACodec->name;
 
-    inACodecContext = avcodec_alloc_context3(inACodec);
+    a.inACodecContext = avcodec_alloc_context3(a.inACodec);
 
-    if(avcodec_parameters_to_context(inACodecContext, params)<0)
+    if(avcodec_parameters_to_context(a.inACodecContext, params)<0)
         cout<<"Cannot create codec context for audio input";
 
 
-    value = avcodec_open2(inACodecContext, inACodec, nullptr);
+    value = avcodec_open2(a.inACodecContext, a.inACodec, nullptr);
     if (value < 0) {
-        cout << "\nCannot open the input audio codec";
-        exit(1);
+        return fail(SR_ERROR_AUDIO_DEVICE, value, "Cannot open the input audio codec");
+    }
+
+
+    return 0;
+}
+
+/**
+ * openAudioSource() with a grabber records from a caller supplied back-end in place of the libavdevice demuxer
+ * @param grabber back-end to use, the recorder takes its ownership
+ */
+int ScreenRecorder::openAudioSource(SRAudioGrabber *grabber) {
+    if(!settings._recaudio || settings._burst) {
+        delete grabber;
+        return 0;
     }
+    audioTracks.emplace_back(new AudioTrack(0));
+    int ret = openNativeAudioSource(*audioTracks[0], grabber, settings.audiourl);
+    if (ret < 0)
+        return ret;
+    return openAudioTracks();
+}
 
+/**
+ * openNativeAudioSource() opens a native audio back-end: its packets go through the PCM decoder
+ * of the back-end format, like the demuxer ones do
+ *
+ * @param grabber back-end to use, the recorder takes its ownership
+ * @param url device of the back-end, empty for the default one
+ */
+int ScreenRecorder::openNativeAudioSource(AudioTrack &a, SRAudioGrabber *grabber, const char *url) {
+    a.audioGrabber.reset(grabber);
+    a.inAFormatContext = nullptr;
+    //without video nothing needs the audio sooner: fewer, longer chunks let the cores sleep
+    if (settings._lowpower && !settings._recvideo)
+        settings._audiofragment = FFMAX(settings._audiofragment, AUDIO_LOWPOWER_FRAGMENT);
+    if (a.audioGrabber->open(*url ? url : "default", AUDIO_ENCODER_RATE, 0,
+                           settings._audiofragment * 1000) < 0) {
+        return fail(SR_ERROR_AUDIO_DEVICE, 0, "Cannot open selected device");
+    }
 
+    a.inACodec = avcodec_find_decoder(a.audioGrabber->codecId());
+    if (a.inACodec == nullptr) {
+        return fail(SR_ERROR_AUDIO_DEVICE, AVERROR_DECODER_NOT_FOUND, "Cannot find the audio decoder");
+    }
+    a.inACodecContext = avcodec_alloc_context3(a.inACodec);
+    if (!a.inACodecContext) {
+        return fail(SR_ERROR_MEMORY, 0, "Cannot allocate the audio input description");
+    }
+    a.inACodecContext->sample_rate = a.audioGrabber->sampleRate();
+    a.inACodecContext->channels = a.audioGrabber->channels();
+    a.inACodecContext->channel_layout = av_get_default_channel_layout(a.audioGrabber->channels());
+    a.inACodecContext->time_base = {1, 1000000};
+    //the capture clock filter expects chunks of this many samples
+    a.inACodecContext->frame_size = (int) av_rescale(settings._audiofragment, a.audioGrabber->sampleRate(), 1000);
+    if (avcodec_open2(a.inACodecContext, a.inACodec, nullptr) < 0) {
+        return fail(SR_ERROR_AUDIO_DEVICE, 0, "Cannot open the input audio codec");
+    }
+    cout << "\nAudio grabber: " << a.audioGrabber->name();
     return 0;
 }
 
+/**
+ * audioSourceTimeBase() is the time base of the captured audio packets: microseconds for the native back-ends
+ */
+AVRational ScreenRecorder::audioSourceTimeBase(const AudioTrack &a) const {
+    return a.audioGrabber ? AV_TIME_BASE_Q : a.inAFormatContext->streams[a.inAudioStreamIndex]->time_base;
+}
+
 int ScreenRecorder::initOutputFile(){
     char* filename = settings.filename;
     bool audio_recorded = settings._recaudio;
 
+    //what a failed attempt left behind, its streams included: a retry starts from an empty context
+    avcodec_free_context(&outVCodecContext);
+    avformat_free_context(outAVFormatContext);
     outAVFormatContext = nullptr;
     int value = 0;
 
 	cout<<"[initOutputFile] entering\n";
+    applyCpuFlags();
+    applyPowerProfile();
 
     /*get the filetype from filename extension*/
     outAVOutputFormat = av_guess_format(nullptr,filename, nullptr);
+    if(!outAVOutputFormat && settings._outputmode == SR_OUTPUT_CALLBACK)
+        outAVOutputFormat = av_guess_format("matroska", nullptr, nullptr);     //takes any codec, nothing is written
+    if(settings._profile == SR_PROFILE_INTERMEDIATE && (!outAVOutputFormat || strcmp(outAVOutputFormat->name, "matroska"))) {
+        //the lossless codecs only have a mapping in Matroska
+        cout << "\nintermediate recordings are written as Matroska, whatever the extension of " << filename;
+        outAVOutputFormat = av_guess_format("matroska", nullptr, nullptr);
+    }
     if(!outAVOutputFormat) {
-        cout << "\nCannot get the video format. try with correct format";
-        exit(1);
+        return fail(SR_ERROR_OUTPUT, AVERROR_MUXER_NOT_FOUND, "Cannot get the video format. try with correct format");
+    }
+    if(settings.encryptkey && *settings.encryptkey) {
+        uint8_t key[CIPHER_KEY_SIZE];
+        if(!SRCipher::parseKey(settings.encryptkey, key)) {
+            return fail(SR_ERROR_SETTINGS, 0, "invalid encryption key, expected 32 hex digits");
+        }
+        //the files the packagers open themselves would be written in the clear
+        if(settings._outputmode != SR_OUTPUT_FILE && settings._outputmode != SR_OUTPUT_FRAGMENTED) {
+            return fail(SR_ERROR_SETTINGS, 0, "only the plain and fragmented files can be encrypted");
+        }
+        if(settings._faststart) {
+            cout << "\nthe faststart pass reads the file back: the index of an encrypted recording stays at its end";
+            settings._faststart = false;
+        }
+    }
+    if(liveMatroska() && !settings._keyindex) {
+        //the cues of the muxer would grow until the trailer: the index file holds them, each one as it is known
+        cout << "\nfragmented Matroska: the cues are written to the keyframe index " << filename << ".idx";
+        settings._keyindex = true;
+    }
+    if(settings._manifest) {
+        std::vector<uint8_t> key;
+        if(settings.manifestkey && *settings.manifestkey && !SRManifest::parseKey(settings.manifestkey, key)) {
+            return fail(SR_ERROR_SETTINGS, 0, "invalid manifest key, expected hex digits");
+        }
+        if(settings._outputmode != SR_OUTPUT_FILE && settings._outputmode != SR_OUTPUT_FRAGMENTED) {
+            cout << "\nonly the plain and fragmented files get a manifest";
+            settings._manifest = false;
+        } else if(settings._faststart) {
+            //the rewrite would come after the manifest
+            cout << "\nthe faststart pass rewrites the file: the index of a hashed recording stays at its end";
+            settings._faststart = false;
+        }
     }
 
     /*allocate the format context*/
-    avformat_alloc_output_context2(&outAVFormatContext, outAVOutputFormat, outAVOutputFormat->name, filename);
+    if(settings._outputmode == SR_OUTPUT_SEGMENTED) {
+        //the segment muxer owns the files, outAVOutputFormat is the format of each segment
+        std::string pattern = segmentPattern(filename);
+        avformat_alloc_output_context2(&outAVFormatContext, nullptr, "segment", pattern.c_str());
+    } else if(settings._outputmode == SR_OUTPUT_HLS || settings._outputmode == SR_OUTPUT_DASH) {
+        //filename is the playlist or the manifest, the packager writes the segments next to it
+        outAVOutputFormat = av_guess_format(settings._outputmode == SR_OUTPUT_HLS ? "hls" : "dash", nullptr, nullptr);
+        if(!outAVOutputFormat) {
+            return fail(SR_ERROR_OUTPUT, AVERROR_MUXER_NOT_FOUND, string("this FFmpeg build has no ") +
+                                                                  (settings._outputmode == SR_OUTPUT_HLS ? "HLS" : "DASH") + " packager");
+        }
+        avformat_alloc_output_context2(&outAVFormatContext, outAVOutputFormat, outAVOutputFormat->name, filename);
+    } else
+        avformat_alloc_output_context2(&outAVFormatContext, outAVOutputFormat, outAVOutputFormat->name, filename);
     if (!outAVFormatContext) {
-        cout << "\nCannot allocate the output context";
-        exit(1);
+        return fail(SR_ERROR_MEMORY, 0, "Cannot allocate the output context");
     }
 
-    if(settings._recvideo)generateVideoOutputStream();
-   if(audio_recorded) generateAudioOutputStream();
+    //the picture-in-picture is a layer: the encoder and the conversion are chosen for the overlays
+    if(settings._recvideo && *settings.webcam)
+        settings._overlay = true;
+    if(settings._recvideo && (value = generateVideoOutputStream()) < 0)
+        return value;
+    //the trials are behind: a recorder crashing later keeps them
+    if(capsCache && capsCache->save() < 0)
+        cout << "\ncannot write the capability cache " << capsCache->name();
+    if(settings._recvideo && *settings.webcam)
+        openWebcam();
+   if(audio_recorded)
+       for (auto &track : audioTracks)
+           if ((value = generateAudioOutputStream(*track)) < 0)
+               return value;
+
+   const bool fileless = settings._outputmode == SR_OUTPUT_REPLAY || settings._outputmode == SR_OUTPUT_CALLBACK;
+   if (fileless) {
+       //no muxer takes the streams: they keep the encoder time bases
+       if (settings._recvideo)
+           outAVFormatContext->streams[outVideoStreamIndex]->time_base = outVCodecContext->time_base;
+       for (auto &track : audioTracks)
+           outAVFormatContext->streams[track->outAudioStreamIndex]->time_base = track->outACodecContext->time_base;
+   }
 
    /* create empty video file */
-   if (!(outAVFormatContext->flags & AVFMT_NOFILE)) {
-       value = avio_open2(&outAVFormatContext->pb, filename, AVIO_FLAG_WRITE, nullptr, nullptr);
+   if (!fileless && !(outAVFormatContext->oformat->flags & AVFMT_NOFILE)) {
+       value = openOutputFile(outAVFormatContext, filename);
        if (value < 0) {
-           cout << "\nerror in creating the video file";
-           exit(1);
+           return fail(SR_ERROR_OUTPUT, value, "error in creating the video file");
        }
+       if (liveMatroska())
+           outAVFormatContext->pb->seekable = 0;
    }
 
    if (!outAVFormatContext->nb_streams) {
-       cout << "\noutput file dose not contain any stream";
-       exit(1);
+       return fail(SR_ERROR_OUTPUT, 0, "output file dose not contain any stream");
    }
+   if (!fileless && settings.uploadurl && *settings.uploadurl && (value = openUploader()) < 0)
+       return value;
 
 
    /* imp: mp4 container or some advanced container file required header information*/
-   value = avformat_write_header(outAVFormatContext, nullptr);
-   if (value < 0) {
-       cout << "\nerror in writing the header context";
-       exit(1);
+   if (settings._outputmode == SR_OUTPUT_FILE && settings._faststart && settings._expectedduration > 0 &&
+       (!strcmp(outAVOutputFormat->name, "mp4") || !strcmp(outAVOutputFormat->name, "mov"))) {
+       //worst case sample tables of the expected packets, video frames and audio frames: a sample table entry for
+       //each encoded audio frame, 1024 samples for the encoders of a variable frame size as captureAudio() sends them
+       int64_t rate = settings._recvideo ? settings._fps : 0;
+       for (auto &track : audioTracks) {
+           int frameSize = track->outACodecContext->frame_size > 0 ? track->outACodecContext->frame_size : 1024;
+           rate += (track->outACodecContext->sample_rate + frameSize - 1) / frameSize;
+       }
+       moovReserve = moovBytes(rate * settings._expectedduration);
+   }
+   if (!fileless) {
+       AVDictionary *options = outputOptions();
+       //the packagers open their files while writing the header
+       hookOutputIo();
+       value = avformat_write_header(outAVFormatContext, &options);
+       av_dict_free(&options);
+       if (value < 0) {
+           return fail(SR_ERROR_OUTPUT, value, "error in writing the header context");
+       }
+       reserveMoov();
+       if (settings._keyindex)
+           openKeyIndex();
+       if (settings._inputlog)
+           openInputLog();
+       if (settings._cursortrack)
+           openCursorTrack();
+       if (settings._phashindex)
+           openPHashIndex();
+   }
+   if (settings._qualityprobe)
+       openQualityProbe();
+   if (settings._contentrate)
+       openContentRate();
+   muxContext = outAVFormatContext;
+
+   if (settings.streamurl && *settings.streamurl) {
+       //same packets, second muxer: the encoders run once
+       std::unique_ptr<SRStreamOutput> live(new SRStreamOutput(settings.streamurl, muxQueuePackets(),
+                                                               settings._profile == SR_PROFILE_LIVE));
+       if (live->init(outAVFormatContext) < 0) {
+           return fail(SR_ERROR_OUTPUT, 0, string("cannot prepare the live output ") + settings.streamurl);
+       }
+       if (!strncmp(settings.streamurl, "udp://", 6) && settings._udprate >= 0) {
+           int64_t rate = (int64_t) settings._udprate * 1000;
+           if (rate == 0 && settings._recvideo)
+               rate = FFMAX(outVCodecContext->rc_max_rate, outVCodecContext->bit_rate);
+           if (rate > 0 && settings._udprate == 0) {
+               for (auto &track : audioTracks)
+                   rate += track->outACodecContext->bit_rate;
+               rate = (int64_t) (rate * UDP_RATE_MARGIN);
+           }
+           if (rate > 0)
+               live->pace(rate, settings._udpttl);
+           else
+               srLog(SR_LOG_WARNING, "[initOutputFile] the encoders have no rate to pace %s on, set _udprate",
+                     settings.streamurl);
+       }
+       liveOutputs.push_back(std::move(live));
+   }
+   if (settings.webrtcurl && *settings.webrtcurl && (value = openWebRtc()) < 0)
+       return value;
+   if (settings._recvideo && settings.renditions && *settings.renditions && (value = openRenditions()) < 0)
+       return value;
+   if (settings._recvideo && settings.videowall && *settings.videowall && (value = openVideoWall()) < 0)
+       return value;
+   if (settings._recvideo && settings.sharedframes && *settings.sharedframes && (value = openSharedFrames()) < 0)
+       return value;
+   if (settings._recvideo && settings.tileview && *settings.tileview) {
+       tileView.reset(new SRTileView());
+       if ((value = tileView->open(settings.tileview)) < 0)
+           return fail(SR_ERROR_OUTPUT, value, string("cannot serve the tile view on ") + settings.tileview);
+       cout << "\ntile view: " << settings.tileview;
+   }
+   if (settings._recvideo && settings.thumbnails && *settings.thumbnails) {
+       //system memory frames only, like the renditions
+       if (outVCodecContext->hw_frames_ctx) {
+           cout << "\nthe thumbnails need system memory frames, not available with the GPU capture or conversion";
+       } else {
+           snapshots.reset(new SRSnapshot(settings.thumbnails, settings._thumbinterval, settings._thumbwidth));
+           if (snapshots->open(outVCodecContext->width, outVCodecContext->height) < 0) {
+               return fail(SR_ERROR_OUTPUT, 0, string("cannot prepare the thumbnails ") + settings.thumbnails);
+           }
+       }
    }
 
-	cout<<"[initOuputFile] exiting\n";
+   if ((value = enforceMemoryBudget()) < 0)
+       return value;
+   if (settings._outputmode == SR_OUTPUT_REPLAY && settings._replayraw) {
+       frameReplay.reset(new SRFrameReplay(settings._replayduration, settings._replaymaxbytes, settings._replaypack));
+       if (frameReplay->open(outVCodecContext) < 0) {
+           srLog(SR_LOG_WARNING, "[initOutputFile] the encoder frames cannot be kept raw, the replay buffer keeps packets");
+           frameReplay.reset();
+       } else {
+           if (!audioTracks.empty())
+               srLog(SR_LOG_WARNING, "[initOutputFile] the raw replay buffer keeps no audio");
+           cout << "\nraw replay buffer: last " << settings._replayduration << " s, at most "
+                << (settings._replaymaxbytes >> 20) << " MiB of frames";
+       }
+   }
+   if (settings._burst && settings._recvideo && !videoCopy) {
+       if (settings._outputmode == SR_OUTPUT_REPLAY || outVCodecContext->hw_frames_ctx) {
+           srLog(SR_LOG_WARNING, "[initOutputFile] the burst needs system memory frames and an output file, encoding live");
+       } else {
+           burstArena.reset(new SRBurstArena(settings._burstmaxbytes, settings._bursttiles, settings._hugepages));
+           //in flight: what every queue and pool between the grab and the ProducerThread may hold
+           int ret = burstArena->open(outVCodecContext->pix_fmt, outVCodecContext->width, outVCodecContext->height,
+                                      captureBuffer * 2 * convertWorkerCount() + 4);
+           if (ret < 0) {
+               return fail(SR_ERROR_MEMORY, ret, string("cannot reserve the burst arena of ") +
+                                                 to_string(settings._burstmaxbytes >> 20) + " MiB" +
+                                                 (ret == AVERROR(ENOSPC) ? ": smaller than the frames in flight" : ""));
+           }
+           SRBurstStats burst = burstArena->stats();
+           cout << "\nburst: " << (burst.capacity >> 20) << " MiB arena, at least " << burst.minFrames << " frames ("
+                << (double) burst.minFrames / FFMAX(settings._fps, 1) << " s), packed in " << burstArena->tileCount()
+                << " tiles";
+       }
+   }
+   if (settings._outputmode == SR_OUTPUT_REPLAY && !frameReplay) {
+       replayBuffer.reset(new SRReplayBuffer(settings._replayduration, settings._replaymaxbytes));
+       if (replayBuffer->init(outAVFormatContext) < 0) {
+           return fail(SR_ERROR_MEMORY, 0, "cannot prepare the replay buffer");
+       }
+       replayBuffer->setSource(encoderArena.get());
+       cout << "\nreplay buffer: last " << settings._replayduration << " s, at most "
+            << (settings._replaymaxbytes >> 20) << " MiB";
+   }
+   if (settings._activitygate && settings._outputmode != SR_OUTPUT_REPLAY && settings._outputmode != SR_OUTPUT_CALLBACK) {
+       if (!settings._recvideo) {
+           srLog(SR_LOG_WARNING, "[initOutputFile] the activity gate needs the video, the whole recording is written");
+       } else {
+           prerollBuffer.reset(new SRReplayBuffer(settings._activitypreroll, settings._replaymaxbytes));
+           if (prerollBuffer->init(outAVFormatContext) < 0) {
+               return fail(SR_ERROR_MEMORY, 0, "cannot prepare the pre-roll of the activity gate");
+           }
+           prerollBuffer->setSource(encoderArena.get());
+           cout << "\nactivity gate: " << settings._activitypreroll << " s before and " << settings._activitytail
+                << " s after the changes of the screen are written";
+       }
+   }
+
+    reportCpuFeatures();
+	cout<<"[initOuputFile] exiting\n";
 
    return 0;
 }
-void ScreenRecorder::generateVideoOutputStream(){
-        int i;
-		
-		cout<<"[generateVideoOutputStream] entering\n";
 
-        AVStream *video_st = avformat_new_stream(outAVFormatContext, nullptr);
+/**
+ * SIMD flags of libavutil with their av_parse_cpu_caps() names
+ */
+static const struct {
+    int flag;
+    const char *name;
+} cpuFeatures[] = {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+        {AV_CPU_FLAG_MMX, "mmx"}, {AV_CPU_FLAG_MMXEXT, "mmxext"}, {AV_CPU_FLAG_SSE, "sse"}, {AV_CPU_FLAG_SSE2, "sse2"},
+        {AV_CPU_FLAG_SSE3, "sse3"}, {AV_CPU_FLAG_SSSE3, "ssse3"}, {AV_CPU_FLAG_SSE4, "sse4.1"}, {AV_CPU_FLAG_SSE42, "sse4.2"},
+        {AV_CPU_FLAG_AVX, "avx"}, {AV_CPU_FLAG_XOP, "xop"}, {AV_CPU_FLAG_FMA3, "fma3"}, {AV_CPU_FLAG_FMA4, "fma4"},
+        {AV_CPU_FLAG_AVX2, "avx2"}, {AV_CPU_FLAG_AVX512, "avx512"},
+#elif defined(__aarch64__) || defined(__arm__) || defined(_M_ARM64)
+        {AV_CPU_FLAG_VFP, "vfp"}, {AV_CPU_FLAG_NEON, "neon"}, {AV_CPU_FLAG_ARMV8, "armv8"},
+#endif
+};
+
+//flags with kernels in swscale and swresample, the other ones are not looked at there
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SWS_CPU_FLAGS (AV_CPU_FLAG_MMX | AV_CPU_FLAG_MMXEXT | AV_CPU_FLAG_SSE2 | AV_CPU_FLAG_SSSE3 | AV_CPU_FLAG_SSE4 | AV_CPU_FLAG_AVX | AV_CPU_FLAG_AVX2)
+#define SWR_CPU_FLAGS (AV_CPU_FLAG_SSE | AV_CPU_FLAG_SSE2 | AV_CPU_FLAG_SSSE3 | AV_CPU_FLAG_AVX | AV_CPU_FLAG_AVX2 | AV_CPU_FLAG_FMA3 | AV_CPU_FLAG_XOP)
+#else
+#define SWS_CPU_FLAGS AV_CPU_FLAG_NEON
+#define SWR_CPU_FLAGS AV_CPU_FLAG_NEON
+#endif
+
+static std::string cpuFlagNames(int flags) {
+    std::string names;
+    for (const auto &feature : cpuFeatures) {
+        if (!(flags & feature.flag)) continue;
+        if (!names.empty()) names += " ";
+        names += feature.name;
+    }
+    return names.empty() ? "none" : names;
+}
+
+/**
+ * applyCpuFlags() restricts or forces the SIMD paths of libav and of SRColorConvert with settings.cpuflags.\n
+ * It runs before the encoders, the scalers and the resampler are created: they pick their kernels when they are.
+ */
+void ScreenRecorder::applyCpuFlags() {
+    if (!settings.cpuflags || !*settings.cpuflags)
+        return;
+    const char *spec = settings.cpuflags;
+    unsigned int flags = av_get_cpu_flags();
+    if (*spec == '=') {
+        flags = 0;
+        spec++;
+    }
+    if (av_parse_cpu_caps(&flags, spec) < 0) {
+        cout << "\ninvalid cpu flags " << settings.cpuflags << ", keeping the detected ones";
+        return;
+    }
+    av_force_cpu_flags((int) flags);
+}
+
+/**
+ * applyPowerProfile() decides with settings._power whether the power profile applies, before the encoders and the
+ * workers are created: the hardware encoders are tried first anyway, the profile adds their GPU conversion and leaves
+ * the thread counts still left to the recorder at their minimum. The capture rate caps are the VideoThread's.
+ */
+void ScreenRecorder::applyPowerProfile() {
+    if (settings._power == SR_POWER_OFF)
+        return;
+    SRPowerStatus status = SRPowerMonitor::query();
+    cout << "\npower: " << (status.onBattery ? "battery" : "mains");
+    if (status.batteryPercent >= 0)
+        cout << " " << status.batteryPercent << "%";
+    if (status.temperature >= 0)
+        cout << ", " << status.temperature << " C";
+    powerSaving = settings._power == SR_POWER_SAVE || SRPowerMonitor::constrained(status);
+    if (!powerSaving)
+        return;
+    cout << ", power profile";
+    if (settings._encoder != SR_ENCODER_SOFTWARE && settings._profile != SR_PROFILE_INTERMEDIATE)
+        settings._gpuconvert = true;
+    if (settings._encthreads <= 0)
+        settings._encthreads = FFMIN(POWER_ENCODE_THREADS, FFMAX(cpuCount() - 2, 1));
+    if (settings._convertthreads <= 0)
+        settings._convertthreads = 1;
+    if (settings._filterthreads <= 0)
+        settings._filterthreads = 1;
+    if (settings._scalebands <= 0)
+        settings._scalebands = 1;
+}
+
+/**
+ * efficientPipelineThread() moves the calling pipeline thread to the energy efficient scheduling of the power profile
+ */
+void ScreenRecorder::efficientPipelineThread(const char *name) {
+    if (powerSaving && !efficientThread(POWER_TIMER_SLACK))
+        srLog(SR_LOG_WARNING, "[%s] cannot switch to energy efficient scheduling", name);
+}
+
+/**
+ * reportCpuFeatures() tells which SIMD paths the conversion, the resampler and the encoder use
+ */
+void ScreenRecorder::reportCpuFeatures() const {
+    int flags = av_get_cpu_flags();
+    cout << "\ncpu: " << cpuFlagNames(flags);
+    if (settings.cpuflags && *settings.cpuflags)
+        cout << " (cpu flags \"" << settings.cpuflags << "\")";
+
+    if (settings._recvideo && videoCopy) {
+        cout << "\ncpu: video copied, no conversion nor encoder";
+    } else if (settings._recvideo) {
+        bool unscaled = inVCodecContext->width == outVCodecContext->width && inVCodecContext->height == outVCodecContext->height;
+        const char *kernel = unscaled ? getColorConverterName(inVCodecContext->pix_fmt, outVSwPixFmt,
+                                                               outVCodecContext->colorspace, outVCodecContext->color_range) : nullptr;
+        if (filterGraph && hasVideoFilters())
+            cout << "\ncpu: conversion in the video filters";
+        else if (filterGraph)
+            cout << "\ncpu: conversion on the GPU";
+        else if (unscaled && inVCodecContext->pix_fmt == outVSwPixFmt)
+            cout << "\ncpu: no conversion";
+        else if (kernel)
+            cout << "\ncpu: conversion SRColorConvert " << kernel;
+        else
+            cout << "\ncpu: conversion swscale " << cpuFlagNames(flags & SWS_CPU_FLAGS);
+
+        //x264 and x265 detect the cpu themselves, the libavcodec encoders follow the flags
+        if (outVCodecContext->hw_frames_ctx || outVCodecContext->hw_device_ctx)
+            cout << "\ncpu: encoder " << outVCodec->name << " on the GPU";
+        else if (!strncmp(outVCodec->name, "libx26", 6))
+            cout << "\ncpu: encoder " << outVCodec->name << " with its own cpu detection";
+        else
+            cout << "\ncpu: encoder " << outVCodec->name << " " << cpuFlagNames(flags);
+    }
+    if (settings._recaudio)
+        cout << "\ncpu: resampler swresample " << cpuFlagNames(flags & SWR_CPU_FLAGS);
+}
+
+/**
+ * needsGlobalHeader() tells whether the codec headers must go to the extradata, for the recording or for a live output
+ */
+bool ScreenRecorder::needsGlobalHeader() const {
+    if (outAVFormatContext->oformat->flags & AVFMT_GLOBALHEADER)
+        return true;
+    if (!settings.streamurl || !*settings.streamurl)
+        return false;
+    AVOutputFormat *live = SRStreamOutput::guessFormat(settings.streamurl);
+    return live && (live->flags & AVFMT_GLOBALHEADER);
+}
+
+/**
+ * needsInbandHeaders() tells whether a reader of the packets takes the codec headers from the stream itself:
+ * a recording or a live container without global headers, or the files the segmenting muxers open on their own
+ */
+bool ScreenRecorder::needsInbandHeaders() const {
+    if (!(outAVFormatContext->oformat->flags & AVFMT_GLOBALHEADER) ||
+        settings._outputmode == SR_OUTPUT_SEGMENTED || settings._outputmode == SR_OUTPUT_HLS)
+        return true;
+    if (!settings.streamurl || !*settings.streamurl)
+        return false;
+    AVOutputFormat *live = SRStreamOutput::guessFormat(settings.streamurl);
+    return live && !(live->flags & AVFMT_GLOBALHEADER);
+}
+
+/**
+ * liveMatroska() tells whether the recording is a Matroska or WebM file of SR_OUTPUT_FRAGMENTED: its output is
+ * opened as unseekable, so the muxer keeps no cues until the trailer and leaves the segment of unknown size,
+ * readable up to its last cluster
+ */
+bool ScreenRecorder::liveMatroska() const {
+    return settings._outputmode == SR_OUTPUT_FRAGMENTED &&
+           (!strcmp(outAVOutputFormat->name, "matroska") || !strcmp(outAVOutputFormat->name, "webm"));
+}
+
+/**
+ * outputOptions() translates settings._outputmode into muxer options for avformat_write_header()
+ * @return the options, to be freed by the caller
+ */
+AVDictionary *ScreenRecorder::outputOptions() const {
+    AVDictionary *options = nullptr;
+    bool mov = strstr(outAVOutputFormat->name, "mp4") || strstr(outAVOutputFormat->name, "mov");
+
+    if(liveMatroska()) {
+        //a cluster bounded in time and size reaches the file as soon as it is complete
+        av_dict_set_int(&options, "cluster_time_limit", settings._fragduration, 0);
+        av_dict_set_int(&options, "cluster_size_limit", FRAGMENT_CLUSTER_SIZE, 0);
+        av_dict_set(&options, "flush_packets", "1", 0);
+    } else if(settings._outputmode == SR_OUTPUT_FRAGMENTED) {
+        if(!mov) {
+            cout << "\nfragmented output needs an MP4, MOV, Matroska or WebM file, writing a plain "
+                 << outAVOutputFormat->name << " file";
+            return options;
+        }
+        //empty moov: the header carries no samples, every fragment indexes itself
+        av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        av_dict_set_int(&options, "frag_duration", (int64_t) settings._fragduration * 1000, 0);
+        //each fragment reaches the file as soon as it is complete
+        av_dict_set(&options, "flush_packets", "1", 0);
+    }
+    if(settings._profile == SR_PROFILE_LIVE) {
+        //every packet reaches the output as soon as it is written, the muxer keeps nothing for its own interleaving
+        av_dict_set(&options, "flush_packets", "1", 0);
+        av_dict_set_int(&options, "max_delay", 0, 0);
+    }
+    if(settings._outputmode == SR_OUTPUT_FILE && settings._faststart && mov) {
+        if(moovReserve > 0)
+            av_dict_set_int(&options, "moov_size", moovReserve, 0);
+        else
+            av_dict_set(&options, "movflags", "+faststart", 0);
+    }
+    if(settings._webmlive && !strcmp(outAVOutputFormat->name, "webm") &&
+       (settings._outputmode == SR_OUTPUT_FILE || settings._outputmode == SR_OUTPUT_FRAGMENTED)) {
+        //the browsers play it as it grows: no cues at the end, no seek back to patch the header and the durations
+        av_dict_set(&options, "live", "1", 0);
+    }
+    if(settings._outputmode == SR_OUTPUT_SEGMENTED) {
+        //segments start on keyframes only: packets are never copied nor re-encoded
+        av_dict_set(&options, "segment_format", outAVOutputFormat->name, 0);
+        av_dict_set_int(&options, "segment_time", settings._segmentduration, 0);
+        av_dict_set(&options, "reset_timestamps", "1", 0);
+        if(settings._segmentkeep > 0)
+            av_dict_set_int(&options, "segment_wrap", settings._segmentkeep, 0);
+    }
+    if(settings._outputmode == SR_OUTPUT_HLS || settings._outputmode == SR_OUTPUT_DASH) {
+        char duration[32];
+        snprintf(duration, sizeof(duration), "%.3f", settings._livesegment / 1000.0);
+        if(settings._outputmode == SR_OUTPUT_HLS) {
+            av_dict_set(&options, "hls_time", duration, 0);
+            av_dict_set_int(&options, "hls_list_size", settings._livewindow, 0);
+            //program date-time tags let the players measure the glass-to-glass latency
+            av_dict_set(&options, "hls_flags", "delete_segments+independent_segments+program_date_time", 0);
+        } else {
+            av_dict_set(&options, "seg_duration", duration, 0);
+            av_dict_set_int(&options, "window_size", settings._livewindow, 0);
+            av_dict_set(&options, "streaming", "1", 0);
+        }
+        //a player starts about three segments behind the live edge
+        cout << "\nlive packaging: " << settings._livesegment << " ms segments, expected latency about "
+             << 3 * settings._livesegment << " ms";
+    }
+    return options;
+}
+
+/**
+ * openOutputFile() opens path as the I/O of ctx: through the mapped writer with settings._mmapwrite,
+ * the async writer with settings._asyncwrite, settings.encryptkey or settings._manifest, avio otherwise.\n
+ * The writers are reopened on the new path when a rotation opens the next file.
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int ScreenRecorder::openOutputFile(AVFormatContext *ctx, const char *path) {
+    //the faststart pass reads the file back while it is open, longer than its content with the mapping
+    bool encrypted = settings.encryptkey && *settings.encryptkey;
+    if (settings._mmapwrite && !encrypted && !settings._manifest && !(settings._outputmode == SR_OUTPUT_FILE && settings._faststart)) {
+        if (!mappedWriter)
+            mappedWriter.reset(new SRMappedWriter());
+        if (mappedWriter->open(path) >= 0) {
+            ctx->pb = mappedWriter->avio();
+            ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+            return 0;
+        }
+        mappedWriter->close();
+        mappedWriter.reset();
+        cout << "\nthe output file cannot be mapped, it is written by the usual writer";
+    }
+    if (settings._asyncwrite || encrypted || settings._manifest) {
+        if (!fileWriter) {
+            fileWriter.reset(new SRAsyncWriter());
+            fileWriter->setSpillLimit(FFMAX(settings._writerspill, 0));
+            uint8_t key[CIPHER_KEY_SIZE];
+            if (encrypted && SRCipher::parseKey(settings.encryptkey, key)) {
+                fileWriter->encrypt(key);
+                cout << "\nrecording encrypted in AES-128-CTR by the writer thread, " << fileWriter->cipherName() << " rounds";
+            }
+            std::vector<uint8_t> signature;
+            if (settings._manifest) {
+                if (settings.manifestkey && *settings.manifestkey)
+                    SRManifest::parseKey(settings.manifestkey, signature);
+                fileWriter->writeManifest(signature);
+            }
+        }
+        int ret = fileWriter->open(path, settings._directio, FFMAX(settings._iobuffer, 4096));
+        ctx->pb = fileWriter->avio();
+        ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+        return ret;
+    }
+    return avio_open2(&ctx->pb, path, AVIO_FLAG_WRITE, nullptr, nullptr);
+}
+
+/**
+ * closeOutputFile() closes the I/O of ctx once its trailer is written, with the statistics of the writer
+ * @return 0, or the first write error of the file
+ */
+int ScreenRecorder::closeOutputFile(AVFormatContext *ctx) {
+    int err = 0;
+    if(fileWriter) {
+        err = fileWriter->close();
+        SRWriterStats io = fileWriter->stats();
+        cout << "\nfile writer: " << io.bytes << " bytes in " << io.writes << " buffers, " << io.syscalls << " write calls ("
+             << (io.syscalls ? io.bytes / io.syscalls / 1024 : 0) << " KiB each, "
+             << (io.elapsed > 0 ? io.syscalls * 1000000.0 / io.elapsed : 0.0) << " per second), muxer stalled "
+             << io.stalls << " times (" << io.stallTime << " us)";
+        if(io.spills)
+            cout << "\nslow storage: up to " << io.peakBacklog / 1024 << " KiB staged in memory, " << io.spills
+                 << " buffers spilled";
+        if(settings._manifest) {
+            SRManifestStats hashed = fileWriter->manifestStats();
+            cout << "\nmanifest: " << hashed.chunks << " chunks of " << (MANIFEST_CHUNK_SIZE >> 20) << " MiB hashed, "
+                 << hashed.readBack << " read back" << (settings.manifestkey && *settings.manifestkey ? ", signed" : ", unsigned");
+        }
+        ctx->pb = nullptr;
+    } else if(mappedWriter) {
+        err = mappedWriter->close();
+        SRMappedStats io = mappedWriter->stats();
+        cout << "\nmapped writer: " << io.bytes << " bytes through " << io.windows << " chunks of "
+             << (MAPPED_CHUNK_SIZE >> 20) << " MiB, " << io.directWrites << " header writes";
+        ctx->pb = nullptr;
+    } else if(!(ctx->oformat->flags & AVFMT_NOFILE))
+        err = avio_closep(&ctx->pb);
+    return err;
+}
+
+int ScreenRecorder::rotateOutput(const char *filename) {
+    if((settings._outputmode != SR_OUTPUT_FILE && settings._outputmode != SR_OUTPUT_FRAGMENTED) ||
+       settings._faststart || settings._keyindex)
+        return AVERROR(ENOSYS);
+    if(!filename || !*filename)
+        return AVERROR(EINVAL);
+    if(rotatePending)
+        return AVERROR(EBUSY);
+    //a path that cannot be created fails here, while the recording is still in the current file
+    FILE *probe = fopen(filename, "wb");
+    if(!probe)
+        return AVERROR(errno);
+    fclose(probe);
+    {
+        std::lock_guard<std::mutex> guard(rotateLock);
+        rotatePath = filename;
+    }
+    rotatePending = true;
+    keyframeRequested = true;
+    return 0;
+}
+
+int ScreenRecorder::setBitrate(int kbps) {
+    if(kbps < 1)
+        return AVERROR(EINVAL);
+    if(!settings._recvideo)
+        return AVERROR(ENOSYS);
+    pendingBitrate = kbps;
+    return 0;
+}
+
+int ScreenRecorder::setFrameRate(int fps) {
+    if(fps < 1 || fps > settings._fps)
+        return AVERROR(EINVAL);
+    if(!settings._recvideo)
+        return AVERROR(ENOSYS);
+    captureInterval = 1000000 / fps;
+    return 0;
+}
+
+/**
+ * applyBitrate() sets the rate control of the video encoder to kbps before the frame that starts the next GOP,
+ * the VBV scaled with it: libx264 reconfigures when it sees it changed, libx265 keeps the rate it was
+ * opened with
+ */
+void ScreenRecorder::applyBitrate(int kbps) {
+    int64_t bitrate = (int64_t) kbps * 1000, previous = outVCodecContext->bit_rate;
+    if(previous > 0) {
+        if(outVCodecContext->rc_max_rate > 0)
+            outVCodecContext->rc_max_rate = av_rescale(outVCodecContext->rc_max_rate, bitrate, previous);
+        if(outVCodecContext->rc_buffer_size > 0)
+            outVCodecContext->rc_buffer_size = (int) av_rescale(outVCodecContext->rc_buffer_size, bitrate, previous);
+    }
+    outVCodecContext->bit_rate = bitrate;
+    if(contentRate)
+        contentRate->setBase(bitrate);
+    srLog(SR_LOG_INFO, "[ProducerThread] video bitrate %d kbit/s from the next keyframe", kbps);
+}
+
+/**
+ * rotateMuxer() ends the file of muxContext before cut, the keyframe forced by rotateOutput(), and goes on in the
+ * next file with the same streams: its timestamps start at the cut. A file that cannot be prepared keeps the
+ * recording in the current one.
+ */
+void ScreenRecorder::rotateMuxer(const AVPacket *cut) {
+    std::string path;
+    {
+        std::lock_guard<std::mutex> guard(rotateLock);
+        path = rotatePath;
+    }
+    rotatePending = false;
+
+    AVFormatContext *next = nullptr;
+    avformat_alloc_output_context2(&next, outAVOutputFormat, outAVOutputFormat->name, path.c_str());
+    int ret = next ? 0 : AVERROR(ENOMEM);
+    for (unsigned int i = 0; ret >= 0 && i < outAVFormatContext->nb_streams; i++) {
+        AVStream *st = avformat_new_stream(next, nullptr);
+        if(!st) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        ret = avcodec_parameters_copy(st->codecpar, outAVFormatContext->streams[i]->codecpar);
+        st->time_base = outAVFormatContext->streams[i]->time_base;
+    }
+    if(ret < 0) {
+        srLog(SR_LOG_ERROR, "[MuxerThread] cannot prepare %s, the recording goes on in the current file", path.c_str());
+        avformat_free_context(next);
+        return;
+    }
+
+    //the writers move to the new file: the current one ends first
+    if(av_write_trailer(muxContext) < 0)
+        srLog(SR_LOG_ERROR, "[MuxerThread] error in writing the trailer before the cut");
+    if(closeOutputFile(muxContext) < 0)
+        srLog(SR_LOG_ERROR, "[MuxerThread] error in writing the file before the cut");
+    uploadOutputFile();
+    uploadPath.clear();
+    if(muxContext != outAVFormatContext)
+        avformat_free_context(muxContext);
+    muxContext = next;
+    ret = openOutputFile(next, path.c_str());
+    if(ret >= 0 && liveMatroska())
+        next->pb->seekable = 0;
+    if(ret >= 0) {
+        AVDictionary *options = outputOptions();
+        ret = avformat_write_header(next, &options);
+        av_dict_free(&options);
+    }
+    if(ret < 0) {
+        srLog(SR_LOG_ERROR, "[MuxerThread] cannot open %s, the rest of the recording is lost", path.c_str());
+        closeOutputFile(next);
+        avformat_free_context(next);
+        muxContext = nullptr;
+        return;
+    }
+    if(uploader) {
+        uploadPath = path;
+        if(uploadFollowing)
+            uploader->follow(path.c_str());
+    }
+
+    int64_t start = av_rescale_q(cut->dts != AV_NOPTS_VALUE ? cut->dts : cut->pts,
+                                 outAVFormatContext->streams[cut->stream_index]->time_base, AV_TIME_BASE_Q);
+    muxOffsets.resize(outAVFormatContext->nb_streams);
+    for (unsigned int i = 0; i < outAVFormatContext->nb_streams; i++)
+        muxOffsets[i] = av_rescale_q(start, AV_TIME_BASE_Q, outAVFormatContext->streams[i]->time_base);
+    rotations++;
+    srLog(SR_LOG_INFO, "[MuxerThread] the recording goes on in %s", path.c_str());
+}
+
+/**
+ * moovBytes() is the worst case size of the MP4 index of the given packets over the tracks of the output
+ */
+int64_t ScreenRecorder::moovBytes(int64_t packets) const {
+    return MOOV_BASE_SIZE + MOOV_TRACK_SIZE * (int64_t) outAVFormatContext->nb_streams + MOOV_BYTES_PER_SAMPLE * packets;
+}
+
+/**
+ * reserveMoov() labels the space movenc skipped for the index as a free atom,
+ * so the file stays valid if the index ends up at the tail instead.\n
+ * The header ends with the reserved space and the 16 bytes of the wide placeholder and mdat atoms.
+ */
+void ScreenRecorder::reserveMoov() {
+    if(moovReserve <= 0)
+        return;
+    AVIOContext *pb = outAVFormatContext->pb;
+    int64_t end = avio_tell(pb);
+    avio_seek(pb, end - 16 - moovReserve, SEEK_SET);
+    avio_wb32(pb, (unsigned int) moovReserve);
+    avio_write(pb, (const unsigned char *) "free", 4);
+    avio_seek(pb, end, SEEK_SET);
+    cout << "\nreserved " << moovReserve / 1024 << " KiB for the index of " << settings._expectedduration << " s";
+}
+
+/**
+ * hookOutputIo() routes the files the muxer opens itself through openOutputIo() and closeOutputIo(), before its header.
+ * With the async writer, the faststart second pass reads the file back: the writer is synced first.
+ * With settings.uploadurl, every file a packager closes, a segment or a playlist, is uploaded.
+ */
+void ScreenRecorder::hookOutputIo() {
+    if(!fileWriter && !uploader)
+        return;
+    outAVFormatContext->opaque = this;
+    defaultIoOpen = outAVFormatContext->io_open;
+    outAVFormatContext->io_open = openOutputIo;
+    if(uploader && (outAVFormatContext->oformat->flags & AVFMT_NOFILE)) {
+        defaultIoClose = outAVFormatContext->io_close;
+        outAVFormatContext->io_close = closeOutputIo;
+    }
+}
+
+int ScreenRecorder::openOutputIo(AVFormatContext *s, AVIOContext **pb, const char *url, int flags, AVDictionary **options) {
+    ScreenRecorder *recorder = (ScreenRecorder *) s->opaque;
+    if((flags & AVIO_FLAG_READ) && recorder->fileWriter)
+        recorder->fileWriter->sync();
+    if(!recorder->defaultIoClose)
+        return recorder->defaultIoOpen(s, pb, url, flags, options);
+    //the file renamed since it was closed may be reopened under its temporary name now
+    recorder->uploadRenamedFiles();
+    int ret = recorder->defaultIoOpen(s, pb, url, flags, options);
+    if(ret >= 0 && (flags & AVIO_FLAG_WRITE))
+        recorder->ioPaths[*pb] = url;
+    return ret;
+}
+
+void ScreenRecorder::closeOutputIo(AVFormatContext *s, AVIOContext *pb) {
+    ScreenRecorder *recorder = (ScreenRecorder *) s->opaque;
+    std::string path;
+    auto it = recorder->ioPaths.find(pb);
+    if(it != recorder->ioPaths.end()) {
+        path = it->second;
+        recorder->ioPaths.erase(it);
+    }
+    recorder->defaultIoClose(s, pb);
+    recorder->uploadRenamedFiles();
+    if(path.empty())
+        return;
+    //DASH writes the manifest, and its segments, to a temporary file renamed once closed
+    if(path.size() > 4 && !path.compare(path.size() - 4, 4, ".tmp"))
+        recorder->ioRenamed.push_back(path);
+    else
+        recorder->uploader->upload(path.c_str());
+}
+
+/**
+ * uploadRenamedFiles() uploads the files closed under a temporary name the packager has renamed since
+ */
+void ScreenRecorder::uploadRenamedFiles() {
+    for(auto it = ioRenamed.begin(); it != ioRenamed.end();) {
+        FILE *tmp = fopen(it->c_str(), "rb");
+        if(tmp) {
+            fclose(tmp);
+            ++it;
+            continue;
+        }
+        uploader->upload(it->substr(0, it->size() - 4).c_str());
+        it = ioRenamed.erase(it);
+    }
+}
+
+/**
+ * appendOnlyOutput() tells whether the muxer never seeks back into the output file: a fragmented MP4 or Matroska,
+ * MPEG-TS or a live WebM. Every byte written is final, settings.uploadurl sends them while the recording goes on.
+ */
+bool ScreenRecorder::appendOnlyOutput() const {
+    const char *name = outAVOutputFormat->name;
+    if(settings._outputmode == SR_OUTPUT_FRAGMENTED && (strstr(name, "mp4") || strstr(name, "mov")))
+        return true;
+    if(liveMatroska())
+        return true;
+    if(settings._outputmode != SR_OUTPUT_FILE && settings._outputmode != SR_OUTPUT_FRAGMENTED)
+        return false;
+    return !strcmp(name, "mpegts") || (settings._webmlive && !strcmp(name, "webm"));
+}
+
+/**
+ * openUploader() starts the uploads of settings.uploadurl. An output that only grows is followed from its header on,
+ * another one goes once closed; the packagers have each of their files uploaded by closeOutputIo().
+ */
+int ScreenRecorder::openUploader() {
+    uploader.reset(new SRUploader(settings.uploadurl, FFMAX(settings._uploadthreads, 1)));
+    if(uploader->start() < 0) {
+        return fail(SR_ERROR_OUTPUT, 0, string("cannot upload to ") + settings.uploadurl);
+    }
+    if(outAVFormatContext->oformat->flags & AVFMT_NOFILE) {
+        cout << "\nupload: every file of the output goes to " << settings.uploadurl << " once written";
+        return 0;
+    }
+    uploadPath = settings.filename;
+    uploadFollowing = appendOnlyOutput();
+    if(uploadFollowing)
+        uploader->follow(settings.filename);
+    cout << "\nupload: the recording goes to " << settings.uploadurl
+         << (uploadFollowing ? " while it is written" : " once closed, the muxer seeks back into it");
+    return 0;
+}
+
+/**
+ * uploadOutputFile() hands the output file, closed by now, to the uploader: the rest of it when followed, all of it otherwise
+ */
+void ScreenRecorder::uploadOutputFile() {
+    if(!uploader || uploadPath.empty())
+        return;
+    if(uploadFollowing)
+        uploader->endFollow();
+    else
+        uploader->upload(uploadPath.c_str());
+    //the manifest is complete too by now, written when the file was closed
+    if(settings._manifest)
+        uploader->upload((uploadPath + MANIFEST_SUFFIX).c_str());
+    uploadAdvanced = 0;
+}
+
+/**
+ * finishFaststart() runs before the trailer: if the recording went past the packets the reservation covers,
+ * the index moves to the tail (the file stays valid thanks to reserveMoov()) and rewriteFaststart() fixes it afterwards.
+ * @return true when the rewrite is needed
+ */
+bool ScreenRecorder::finishFaststart() {
+    if(moovReserve <= 0 || moovBytes((int64_t) muxedPackets) <= moovReserve)
+        return false;
+    cout << "\nthe index outgrew the reserved space (" << muxedPackets << " packets), falling back to a faststart rewrite";
+    av_opt_set_int(outAVFormatContext->priv_data, "moov_size", 0, 0);
+    return true;
+}
+
+/**
+ * rewriteFaststart() copies the finished recording into a faststart file, without re-encoding, and replaces it
+ */
+void ScreenRecorder::rewriteFaststart(const char *path) {
+    std::string tmp = std::string(path) + ".faststart";
+    AVFormatContext *in = nullptr, *out = nullptr;
+    AVDictionary *options = nullptr;
+    AVPacket pkt;
+    int ret = avformat_open_input(&in, path, nullptr, nullptr);
+    if(ret >= 0)
+        ret = avformat_find_stream_info(in, nullptr);
+    if(ret >= 0)
+        ret = avformat_alloc_output_context2(&out, av_guess_format(nullptr, path, nullptr), nullptr, tmp.c_str());
+    for(unsigned int i = 0; ret >= 0 && i < in->nb_streams; i++) {
+        AVStream *st = avformat_new_stream(out, nullptr);
+        ret = st ? avcodec_parameters_copy(st->codecpar, in->streams[i]->codecpar) : AVERROR(ENOMEM);
+        if(st) {
+            st->codecpar->codec_tag = 0;
+            st->time_base = in->streams[i]->time_base;
+        }
+    }
+    if(ret >= 0)
+        ret = avio_open(&out->pb, tmp.c_str(), AVIO_FLAG_WRITE);
+    av_dict_set(&options, "movflags", "+faststart", 0);
+    if(ret >= 0)
+        ret = avformat_write_header(out, &options);
+    av_dict_free(&options);
+
+    av_init_packet(&pkt);
+    while(ret >= 0 && av_read_frame(in, &pkt) >= 0) {
+        av_packet_rescale_ts(&pkt, in->streams[pkt.stream_index]->time_base, out->streams[pkt.stream_index]->time_base);
+        pkt.pos = -1;
+        ret = av_interleaved_write_frame(out, &pkt);
+        av_packet_unref(&pkt);
+    }
+    if(ret >= 0)
+        ret = av_write_trailer(out);
+
+    avformat_close_input(&in);
+    if(out) {
+        avio_closep(&out->pb);
+        avformat_free_context(out);
+    }
+    if(ret < 0) {
+        cout << "\nfaststart rewrite failed, the recording keeps its index at the end";
+        remove(tmp.c_str());
+        return;
+    }
+    remove(path);
+    rename(tmp.c_str(), path);
+}
+
+/**
+ * mp4DataStart() finds the first sample byte of an MP4 file: the payload of its top level mdat box
+ * @return the offset, -1 when the file has none
+ */
+static int64_t mp4DataStart(const char *path) {
+    AVIOContext *in = nullptr;
+    if (avio_open(&in, path, AVIO_FLAG_READ) < 0)
+        return -1;
+    int64_t position = 0, start = -1;
+    while (start < 0 && avio_seek(in, position, SEEK_SET) == position) {
+        uint64_t size = avio_rb32(in);
+        uint32_t type = avio_rl32(in);
+        int header = 8;
+        if (size == 1) {
+            size = avio_rb64(in);
+            header = 16;
+        }
+        if (avio_feof(in))
+            break;
+        if (type == MKTAG('m', 'd', 'a', 't'))
+            start = position + header;
+        else if (size < (uint64_t) header)
+            break;  //0 runs to the end of the file: no mdat after it
+        position += (int64_t) size;
+    }
+    avio_closep(&in);
+    return start;
+}
+
+/**
+ * openKeyIndex() creates the index of settings._keyindex next to the recording.\n
+ * The segmenting outputs write one file per segment: their entries locate the segment, not a byte.
+ */
+void ScreenRecorder::openKeyIndex() {
+    if (!settings._recvideo)
+        return;
+    std::string path = std::string(settings.filename) + ".idx";
+    bool segmented = forcedKeyframeInterval() > 0;
+    keyIndex.reset(new SRKeyIndex());
+    if (keyIndex->open(path.c_str(), segmented ? KEYINDEX_SEGMENTED : 0) < 0) {
+        keyIndex.reset();
+        return;
+    }
+    bool mov = strstr(outAVOutputFormat->name, "mp4") || strstr(outAVOutputFormat->name, "mov");
+    keyIndexAfterWrite = settings._outputmode == SR_OUTPUT_FRAGMENTED && mov;
+    keyIndexDataStart = outAVFormatContext->pb ? avio_tell(outAVFormatContext->pb) : 0;
+    cout << "\nkeyframe index: " << path;
+}
+
+/**
+ * indexKeyframe() adds the video keyframe the MuxerThread just wrote.\n
+ * A plain file has it at the position before the write; a fragmented MP4 flushes the previous fragment
+ * when a keyframe arrives, so the position after the write is the start of the fragment of this one.
+ * The segment numbers follow the keyframes produce() forces: one segment every forcedKeyframeInterval()
+ * from the first keyframe, wrapping with settings._segmentkeep like the segment muxer; DASH counts from 1.
+ * @param before position of the output before the write, -1 without one
+ */
+void ScreenRecorder::indexKeyframe(const AVPacket *pkt, int64_t before) {
+    int64_t pts = av_rescale_q(pkt->pts, outAVFormatContext->streams[outVideoStreamIndex]->time_base, AV_TIME_BASE_Q);
+    if (keyIndexFirstPts == AV_NOPTS_VALUE)
+        keyIndexFirstPts = pts;
+    int64_t offset = before;
+    uint32_t segment = 0;
+    int64_t interval = forcedKeyframeInterval();
+    if (interval > 0) {
+        int64_t number = (pts - keyIndexFirstPts) / interval;
+        if (settings._outputmode == SR_OUTPUT_SEGMENTED && settings._segmentkeep > 0)
+            number %= settings._segmentkeep;
+        else if (settings._outputmode == SR_OUTPUT_DASH)
+            number++;
+        segment = (uint32_t) number;
+        offset = -1;
+    } else if (keyIndexAfterWrite && outAVFormatContext->pb)
+        offset = avio_tell(outAVFormatContext->pb);
+    keyIndex->add(pts, offset, segment);
+}
+
+/**
+ * closeKeyIndex() runs once the recording is closed. A faststart MP4 has its index moved in front of the samples,
+ * by the trailer or by rewriteFaststart(): the offsets move by the distance the first sample byte did.
+ */
+void ScreenRecorder::closeKeyIndex() {
+    if (!keyIndex)
+        return;
+    bool mov = strstr(outAVOutputFormat->name, "mp4") || strstr(outAVOutputFormat->name, "mov");
+    if (settings._outputmode == SR_OUTPUT_FILE && settings._faststart && mov) {
+        int64_t start = mp4DataStart(settings.filename);
+        if (start >= 0)
+            keyIndex->shift(start - keyIndexDataStart);
+    }
+    cout << "\nkeyframe index: " << keyIndex->size() << " keyframes in " << keyIndex->name();
+    keyIndex->close();
+    keyIndex.reset();
+}
+
+/**
+ * openInputLog() starts the recording of the keys and pointer of settings._inputlog next to the recording.
+ * The events are stamped on captureClock, the timeline of the packets; those of a pause, or before the capture
+ * starts, are dropped like its frames.
+ */
+void ScreenRecorder::openInputLog() {
+    if (settings.tilesource && *settings.tilesource) {
+        cout << "\ninput log: the display is the one of the tile client, not recorded";
+        return;
+    }
+#ifdef __unix__
+    std::string path = std::string(settings.filename) + ".input";
+    const char *device = *settings.videourl ? settings.videourl : VIDEO_URL;
+    inputLog.reset(new SRInputLog());
+    int ret = inputLog->open(path.c_str(), device, settings._screenoffset.x, settings._screenoffset.y,
+                             settings._inscreenres.width, settings._inscreenres.height,
+                             [this](int64_t wall) {
+                                 return captureSwitch.load(std::memory_order_acquire) ? captureClock.elapsed(wall)
+                                                                                      : AV_NOPTS_VALUE;
+                             }, settings._inputkeys);
+    if (ret < 0) {
+        inputLog.reset();
+        cout << "\ninput log: cannot record the input of " << device;
+        return;
+    }
+    cout << "\ninput log: " << path << (settings._inputkeys ? ", with the keycodes" : "");
+#else
+    cout << "\ninput log: only recorded from an X display";
+#endif
+}
+
+/**
+ * closeInputLog() stops the input log thread and writes its last block
+ */
+void ScreenRecorder::closeInputLog() {
+    if (!inputLog)
+        return;
+    inputLog->close();
+    cout << "\ninput log: " << inputLog->size() << " events in " << inputLog->blockCount() << " blocks, "
+         << inputLog->fileBytes() / 1024 << " KiB in " << inputLog->name();
+    inputLog.reset();
+}
+
+/**
+ * openCursorTrack() starts the recording of the pointer of settings._cursortrack next to the recording, sampled at
+ * the frame rate and stamped on captureClock like the input log. The grabbers were opened without the pointer: a
+ * track that cannot start leaves it out of the recording.
+ */
+void ScreenRecorder::openCursorTrack() {
+    if (settings.tilesource && *settings.tilesource) {
+        cout << "\ncursor track: the display is the one of the tile client, not recorded";
+        return;
+    }
+#ifdef __unix__
+    std::string path = std::string(settings.filename) + CURSOR_SUFFIX;
+    const char *device = *settings.videourl ? settings.videourl : VIDEO_URL;
+    cursorTrack.reset(new SRCursorTrack());
+    int ret = cursorTrack->open(path.c_str(), device, settings._screenoffset.x, settings._screenoffset.y,
+                                settings._inscreenres.width, settings._inscreenres.height,
+                                1000000 / FFMAX(settings._fps, 1), [this](int64_t wall) {
+                                    return captureSwitch.load(std::memory_order_acquire) ? captureClock.elapsed(wall)
+                                                                                         : AV_NOPTS_VALUE;
+                                });
+    if (ret < 0) {
+        cursorTrack.reset();
+        srLog(SR_LOG_WARNING, "[ScreenRecorder] cursor track: cannot follow the pointer of %s, it is not recorded",
+              device);
+        return;
+    }
+    cout << "\ncursor track: " << path;
+#else
+    cout << "\ncursor track: only recorded from an X display, the pointer is drawn by the grabber";
+#endif
+}
+
+/**
+ * closeCursorTrack() stops the cursor track thread and writes its last block
+ */
+void ScreenRecorder::closeCursorTrack() {
+    if (!cursorTrack)
+        return;
+    cursorTrack->close();
+    cout << "\ncursor track: " << cursorTrack->size() << " events, " << cursorTrack->shapesWritten() << " shapes in "
+         << cursorTrack->blockCount() << " blocks, " << cursorTrack->fileBytes() / 1024 << " KiB in "
+         << cursorTrack->name();
+    cursorTrack.reset();
+}
+
+/**
+ * openWebcam() opens the camera of settings.webcam and starts its thread, the picture goes into the overlays
+ */
+void ScreenRecorder::openWebcam() {
+    webcam.reset(new SRWebcam());
+    if (webcam->open(*settings.webcamsource ? settings.webcamsource : WEBCAM_SOURCE, settings.webcam,
+                     settings.webcamoptions) < 0) {
+        webcam.reset();
+        cout << "\nwebcam: cannot record " << settings.webcam << ", the recording goes on without it";
+        return;
+    }
+    webcam->start(&overlay, outVCodecContext->width, outVCodecContext->height, settings._webcamwidth);
+}
+
+/**
+ * closeWebcam() stops the camera thread
+ */
+void ScreenRecorder::closeWebcam() {
+    if (!webcam)
+        return;
+    webcam->stop();
+    cout << "\nwebcam: " << webcam->frameCount() << " frames at " << webcam->pictureWidth() << "x"
+         << webcam->pictureHeight();
+    if (webcam->errorCount())
+        cout << ", " << webcam->errorCount() << " lost";
+    webcam.reset();
+}
+
+/**
+ * openPHashIndex() creates the perceptual hash index of settings._phashindex next to the recording, the
+ * ProducerThread hashes the frames the encoder gets
+ */
+void ScreenRecorder::openPHashIndex() {
+    if (!settings._recvideo)
+        return;
+    if (outVCodecContext->hw_frames_ctx) {
+        cout << "\nperceptual hash index: the frames are GPU surfaces, not hashed";
+        return;
+    }
+    std::string path = std::string(settings.filename) + ".phash";
+    phashIndex.reset(new SRPHashIndex());
+    if (phashIndex->open(path.c_str()) < 0) {
+        phashIndex.reset();
+        return;
+    }
+    cout << "\nperceptual hash index: " << path;
+}
+
+void ScreenRecorder::closePHashIndex() {
+    if (!phashIndex)
+        return;
+    cout << "\nperceptual hash index: " << phashIndex->size() << " changes of the screen in "
+         << phashIndex->hashedFrames() << " frames hashed, " << phashIndex->name();
+    phashIndex->close();
+    phashIndex.reset();
+}
+
+/**
+ * openQualityProbe() starts the SSIM and PSNR measure of settings._qualityprobe on the frames the encoder gets
+ */
+void ScreenRecorder::openQualityProbe() {
+    if (!settings._recvideo || settings._outputmode == SR_OUTPUT_REPLAY)
+        return;
+    if (outVCodecContext->hw_frames_ctx || !SRQualityProbe::supported(outVCodecContext->pix_fmt)) {
+        cout << "\nquality probe: the encoder gets " << (outVCodecContext->hw_frames_ctx ? "GPU surfaces" : "no 8 bit YUV")
+             << ", no quality is measured";
+        return;
+    }
+    qualityProbe.reset(new SRQualityProbe());
+    if (qualityProbe->open(outVCodecContext, settings._qualityprobe) < 0) {
+        cout << "\nquality probe: no decoder for " << outVCodecContext->codec->name << ", no quality is measured";
+        qualityProbe.reset();
+        return;
+    }
+    cout << "\nquality probe: a frame every " << settings._qualityprobe << " ms";
+}
+
+void ScreenRecorder::closeQualityProbe() {
+    if (!qualityProbe)
+        return;
+    SRQualityStats q = qualityProbe->stats();
+    qualityProbe.reset();
+    cout << "\nquality probe: " << q.samples << " frames compared";
+    if (q.samples)
+        cout << ", SSIM " << q.ssimSum / q.samples << " mean, " << q.ssimMin << " min, PSNR " << q.psnrSum / q.samples
+             << " dB mean";
+    if (q.skippedGops)
+        cout << ", " << q.skippedGops << " GOPs left out over the CPU budget";
+}
+
+/**
+ * openContentRate() starts the content-adaptive VBV cap of settings._contentrate on the VBV the profile opened
+ * the encoder with. Only libx264 reads a changed VBV while it runs: nvenc, libx265 and the others keep the one they
+ * were opened with and would need a reopen at every change, a keyframe and a new sequence header each time
+ */
+void ScreenRecorder::openContentRate() {
+    if (!outVCodecContext)
+        return;
+    const char *name = outVCodecContext->codec ? outVCodecContext->codec->name : "";
+    if (strcmp(name, "libx264") != 0) {
+        cout << "\ncontent rate: " << name << " keeps the VBV it was opened with, only libx264 can follow the content";
+        return;
+    }
+    if (outVCodecContext->rc_max_rate <= 0 || outVCodecContext->bit_rate <= 0) {
+        cout << "\ncontent rate: the encoder has no VBV, one of the screen or live profile is needed";
+        return;
+    }
+    contentRate.reset(new SRContentRate(outVCodecContext->bit_rate, settings._fps));
+    cout << "\ncontent rate: quality " << settings._crf << ", VBV cap from " << outVCodecContext->bit_rate * CONTENT_RATE_MIN / 100000
+         << " to " << outVCodecContext->bit_rate * CONTENT_RATE_MAX / 100000 << " kbit/s";
+}
+
+/**
+ * applyContentRate() sets the VBV of the video encoder to cap for the next frame, a one second buffer as the screen
+ * profile opens it with; in the rate modes without a quality target the average follows
+ */
+void ScreenRecorder::applyContentRate(int64_t cap) {
+    outVCodecContext->rc_max_rate = cap;
+    outVCodecContext->rc_buffer_size = (int) cap;
+    outVCodecContext->bit_rate = cap;
+    srLog(SR_LOG_DEBUG, "[ProducerThread] content rate: VBV cap %lld kbit/s", (long long) (cap / 1000));
+}
+
+/**
+ * forcedKeyframeInterval() is the distance in us between the keyframes produce() forces so that
+ * every cut of a segmenting output, or every eviction of the replay buffer, lands on one, 0 when the output does not cut
+ */
+int64_t ScreenRecorder::forcedKeyframeInterval() const {
+    switch(settings._outputmode) {
+        case SR_OUTPUT_SEGMENTED:
+            return (int64_t) settings._segmentduration * 1000000;
+        case SR_OUTPUT_HLS:
+        case SR_OUTPUT_DASH:
+            return (int64_t) settings._livesegment * 1000;
+        case SR_OUTPUT_REPLAY:
+            return (int64_t) REPLAY_GOP_DURATION * 1000000;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * openRenditions() opens the encoders and outputs of settings.renditions.
+ * They take the converted frames of the recording, so they need system memory frames: not with the GPU paths.
+ */
+int ScreenRecorder::openRenditions() {
+    if (outVCodecContext->hw_frames_ctx) {
+        cout << "\nthe renditions need system memory frames, not available with the GPU capture or conversion";
+        return 0;
+    }
+    const char *spec = settings.renditions;
+    while (*spec) {
+        int w, h, kbps, used = 0;
+        if (sscanf(spec, "%dx%d@%d:%n", &w, &h, &kbps, &used) != 3 || !used || w <= 0 || h <= 0 || kbps <= 0) {
+            return fail(SR_ERROR_SETTINGS, 0, string("invalid rendition list ") + settings.renditions +
+                                              ", expected WxH@kbps:file;WxH@kbps:file");
+        }
+        spec += used;
+        size_t length = strcspn(spec, ";");
+        std::string file(spec, length);
+        spec += length;
+        while (*spec == ';' || *spec == ' ')
+            spec++;
+
+        //the encoders want even sizes
+        std::unique_ptr<SRRendition> rendition(new SRRendition(file.c_str(), w & ~1, h & ~1, kbps));
+        if (file.empty() || rendition->open(outVCodecContext) < 0) {
+            return fail(SR_ERROR_ENCODER, 0, string("cannot open the rendition ") + file);
+        }
+        renditionOutputs.push_back(std::move(rendition));
+    }
+    return 0;
+}
+
+/**
+ * openWebRtc() opens the WebRTC output of settings.webrtcurl on the recording, its feedback wired to the encoder:
+ * the targets of the congestion control and the keyframes the peer asks for, an IDR each whatever the refresh
+ */
+int ScreenRecorder::openWebRtc() {
+    if (settings._profile != SR_PROFILE_LIVE)
+        return fail(SR_ERROR_OUTPUT, AVERROR(EINVAL), string("the WebRTC output needs the live profile: ") + settings.webrtcurl);
+    bool encoded = settings._recvideo && outVCodecContext && !videoCopy && !videoPassthrough;
+    std::unique_ptr<SRWebRtcOutput> webrtc(new SRWebRtcOutput(settings.webrtcurl, muxQueuePackets()));
+    int ret = webrtc->init(outAVFormatContext, settings._recvideo ? outVideoStreamIndex : -1,
+                           encoded ? outVCodecContext->bit_rate : 0);
+    if (ret < 0)
+        return fail(SR_ERROR_OUTPUT, ret, string("cannot open the WebRTC output ") + settings.webrtcurl);
+    if (encoded) {
+        //a PLI starts a new refresh wave otherwise, which a browser joining late cannot decode from
+        av_opt_set_int(outVCodecContext->priv_data, "forced-idr", 1, 0);
+        webrtc->onBitrate([this](int kbps) { congestionBitrate = kbps; });
+        webrtc->onKeyframe([this]() { keyframeRequested = true; });
+    }
+    cout << "\nWebRTC output: " << settings.webrtcurl << "\n" << webrtc->sdp();
+    webrtcOutput = std::move(webrtc);
+    return 0;
+}
+
+/**
+ * openVideoWall() opens the tiles of settings.videowall on the captured canvas.
+ * They take the frames as they were grabbed, before the convert workers scale them to the output: the recording
+ * itself can be an overview of the wall at settings._outscreenres. System memory captures only.
+ */
+int ScreenRecorder::openVideoWall() {
+    if (inVCodecContext->hw_frames_ctx || inVCodecContext->pix_fmt == AV_PIX_FMT_DRM_PRIME) {
+        cout << "\nthe video wall needs system memory captures, not available with the GPU capture";
+        return 0;
+    }
+    int columns, rows, kbps, used = 0;
+    if (sscanf(settings.videowall, "%dx%d@%d:%n", &columns, &rows, &kbps, &used) != 3 || !used || kbps <= 0 ||
+        !settings.videowall[used]) {
+        return fail(SR_ERROR_SETTINGS, 0, string("invalid video wall ") + settings.videowall +
+                                          ", expected CxR@kbps:file");
+    }
+    videoWall.reset(new SRVideoWall(settings.videowall + used, columns, rows, kbps));
+    int ret = videoWall->open(inVCodecContext->width, inVCodecContext->height, outVCodecContext);
+    if (ret < 0) {
+        videoWall.reset();
+        return fail(SR_ERROR_ENCODER, ret, string("cannot open the video wall ") + settings.videowall);
+    }
+    return 0;
+}
+
+/**
+ * openSharedFrames() creates the shared memory ring of settings.sharedframes for the frames the encoder gets:
+ * the captured ones with passthrough(), the converted ones otherwise. System memory frames only, like the renditions.
+ */
+int ScreenRecorder::openSharedFrames() {
+    if (outVCodecContext->hw_frames_ctx) {
+        cout << "\nthe shared frames need system memory frames, not available with the GPU capture or conversion";
+        return 0;
+    }
+    bool captured = passthrough();
+    enum AVPixelFormat format = captured ? inVCodecContext->pix_fmt : outVSwPixFmt;
+    int width = captured ? inVCodecContext->width : outVCodecContext->width;
+    int height = captured ? inVCodecContext->height : outVCodecContext->height;
+    sharedFrames.reset(new SRSharedFrames(settings.sharedframes, settings._sharedslots));
+    if (sharedFrames->init(format, width, height) < 0) {
+        return fail(SR_ERROR_OUTPUT, 0, string("cannot create the shared memory ") + settings.sharedframes);
+    }
+    cout << "\nshared frames: " << settings.sharedframes << ", " << settings._sharedslots << " frames of "
+         << av_get_pix_fmt_name(format) << " " << width << "x" << height;
+    return 0;
+}
+
+/**
+ * segmentPattern() numbers the segments after the output name: "rec.mp4" becomes "rec_%05d.mp4"
+ */
+std::string ScreenRecorder::segmentPattern(const char *filename) {
+    std::string name = filename;
+    size_t dot = name.find_last_of('.');
+    size_t slash = name.find_last_of("/\\");
+    if(dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = name.size();
+    return name.substr(0, dot) + "_%05d" + name.substr(dot);
+}
+/**
+ * Hardware encoders tried by generateVideoOutputStream(), in order of preference.
+ */
+static const SRHardwareEncoder hardwareEncoders[] = {
+#ifdef __unix__
+        {SR_ENCODER_VAAPI, "h264_vaapi", "hevc_vaapi", AV_HWDEVICE_TYPE_VAAPI, AV_PIX_FMT_VAAPI, AV_PIX_FMT_NV12},
+        {SR_ENCODER_QSV, "h264_qsv", "hevc_qsv", AV_HWDEVICE_TYPE_QSV, AV_PIX_FMT_QSV, AV_PIX_FMT_NV12},
+#endif
+#ifdef _WIN32
+        {SR_ENCODER_QSV, "h264_qsv", "hevc_qsv", AV_HWDEVICE_TYPE_QSV, AV_PIX_FMT_QSV, AV_PIX_FMT_NV12},
+#endif
+#ifdef __APPLE__
+        {SR_ENCODER_VIDEOTOOLBOX, "h264_videotoolbox", "hevc_videotoolbox", AV_HWDEVICE_TYPE_NONE, AV_PIX_FMT_NONE, AV_PIX_FMT_NONE},
+#else
+        {SR_ENCODER_NVENC, "h264_nvenc", "hevc_nvenc", AV_HWDEVICE_TYPE_NONE, AV_PIX_FMT_NONE, AV_PIX_FMT_NONE},
+#endif
+#ifdef _WIN32
+        {SR_ENCODER_AMF, "h264_amf", "hevc_amf", AV_HWDEVICE_TYPE_NONE, AV_PIX_FMT_NONE, AV_PIX_FMT_NONE},
+#endif
+};
+
+#if defined(_WIN32) || defined(__APPLE__)
+/**
+ * Encoders taking the device surfaces of the native GPU grabbers (settings._gpucapture), in order of preference:
+ * D3D11 textures of the desktop duplication, IOSurface pixel buffers of ScreenCaptureKit.
+ */
+static const SRHardwareEncoder surfaceEncoders[] = {
+#ifdef _WIN32
+        {SR_ENCODER_NVENC, "h264_nvenc", "hevc_nvenc", AV_HWDEVICE_TYPE_D3D11VA, AV_PIX_FMT_D3D11, AV_PIX_FMT_NV12},
+        {SR_ENCODER_AMF, "h264_amf", "hevc_amf", AV_HWDEVICE_TYPE_D3D11VA, AV_PIX_FMT_D3D11, AV_PIX_FMT_NV12},
+#else
+        {SR_ENCODER_VIDEOTOOLBOX, "h264_videotoolbox", "hevc_videotoolbox", AV_HWDEVICE_TYPE_VIDEOTOOLBOX,
+         AV_PIX_FMT_VIDEOTOOLBOX, AV_PIX_FMT_NV12},
+#endif
+};
+#endif
+
+/**
+ * Low-latency options of the screen profile. Options an encoder build does not know are skipped.
+ */
+static const SREncoderOption screenOptions[] = {
+        {"libx264", "preset", "veryfast"},
+        {"libx264", "tune", "zerolatency"},
+        {"libx265", "preset", "veryfast"},
+        {"libx265", "tune", "zerolatency"},
+        {"h264_nvenc", "preset", "llhq"},
+        {"h264_nvenc", "zerolatency", "1"},
+        {"hevc_nvenc", "preset", "llhq"},
+        {"hevc_nvenc", "zerolatency", "1"},
+        {"h264_qsv", "preset", "veryfast"},
+        {"h264_qsv", "look_ahead", "0"},
+        {"hevc_qsv", "preset", "veryfast"},
+        {"h264_vaapi", "rc_mode", "VBR"},
+        {"hevc_vaapi", "rc_mode", "VBR"},
+        {"h264_videotoolbox", "realtime", "1"},
+        {"hevc_videotoolbox", "realtime", "1"},
+        {"libaom-av1", "usage", "realtime"},
+        {"libaom-av1", "cpu-used", "8"},
+        {"libaom-av1", "row-mt", "1"},
+        {"libaom-av1", "enable-intrabc", "1"},
+        {"libaom-av1", "enable-palette", "1"},
+        {"libaom-av1", "aom-params", "tune-content=screen"},
+        {"libsvtav1", "preset", "10"},
+        {"libsvtav1", "svtav1-params", "scm=1"},
+        {"libvpx", "screen-content-mode", "1"},
+        {"libvpx-vp9", "tune-content", "screen"},
+};
+
+/**
+ * Options of the live profile on top of the screen ones: no frame is held back for look-ahead or reordering
+ * and slices fit a network packet. zerolatency already does it for libx264 and libx265.
+ */
+static const SREncoderOption liveOptions[] = {
+        {"libx264", "slice-max-size", "1200"},
+        {"h264_nvenc", "rc-lookahead", "0"},
+        {"h264_nvenc", "delay", "0"},
+        {"hevc_nvenc", "rc-lookahead", "0"},
+        {"hevc_nvenc", "delay", "0"},
+        {"h264_qsv", "async_depth", "1"},
+        {"hevc_qsv", "async_depth", "1"},
+        {"h264_amf", "usage", "ultralowlatency"},
+        {"hevc_amf", "usage", "ultralowlatency"},
+};
+
+/**
+ * Intra-refresh options of the screen profile, left out when the output forces keyframes on its cuts.
+ */
+static const SREncoderOption intraRefreshOptions[] = {
+        {"libx264", "intra-refresh", "1"},
+        {"libx265", "x265-params", "intra-refresh=1"},
+        {"h264_qsv", "int_ref_type", "horizontal"},
+        {"hevc_qsv", "int_ref_type", "horizontal"},
+        {"h264_nvenc", "intra-refresh", "1"},
+        {"hevc_nvenc", "intra-refresh", "1"},
+};
+
+/**
+ * Lossless encoders of the intermediate profile, fastest first: all of them are intra-only and slice or frame threaded.
+ */
+static const char *const intermediateEncoders[] = {"utvideo", "ffv1", "ffvhuff"};
+
+/**
+ * Options of the intermediate encoders: the cheapest prediction and coder, many small independent slices.
+ */
+static const SREncoderOption intermediateOptions[] = {
+        {"utvideo", "pred", "left"},
+        {"ffv1", "level", "3"},
+        {"ffv1", "coder", "rice"},
+        {"ffv1", "context", "0"},
+        {"ffv1", "slicecrc", "0"},
+        {"ffvhuff", "pred", "left"},
+};
+
+/**
+ * Encoders of SR_CODEC_SCREEN_CONTENT, in order: the lossless ones for palette content, then AV1 with screen tools.
+ */
+static const char *const paletteEncoders[] = {"zmbv", "qtrle"};
+static const char *const screenContentEncoders[] = {"libaom-av1", "libsvtav1"};
+
+/**
+ * encoderName() is the name of the hardware encoder for the codec chosen in the settings
+ */
+static const char *encoderName(const SRHardwareEncoder &hw, const SRSettings &settings){
+    return (settings._profile == SR_PROFILE_SCREEN || settings._profile == SR_PROFILE_LIVE) && settings._codec == SR_CODEC_HEVC ?
+           hw.hevcName : hw.name;
+}
+
+/**
+ * deepColor420() tells the 10 bit 4:2:0 YUV formats (YUV420P10, P010) apart
+ */
+static bool deepColor420(enum AVPixelFormat format){
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    return desc && !(desc->flags & AV_PIX_FMT_FLAG_RGB) && desc->comp[0].depth == 10 &&
+           desc->log2_chroma_w == 1 && desc->log2_chroma_h == 1;
+}
+
+/**
+ * formatTier() ranks an encoder format against settings._chroma and settings._hdr: 0 matches both,
+ * 1 has the wrong depth, 2 the wrong chroma, 3 neither
+ */
+static int formatTier(enum AVPixelFormat format, SRHdrMode hdr, SRChromaMode chroma){
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    if(!desc) return 3;
+    bool rgb = desc->flags & AV_PIX_FMT_FLAG_RGB;
+    bool chromaOk = chroma == SR_CHROMA_RGB ? rgb :
+                    chroma == SR_CHROMA_444 ? !rgb && desc->nb_components >= 3 && !desc->log2_chroma_w && !desc->log2_chroma_h :
+                    true;
+    bool depthOk = hdr == SR_HDR_OFF || (desc->comp[0].depth == 10 && (chroma != SR_CHROMA_420 || deepColor420(format)));
+    return (chromaOk ? 0 : 2) + (depthOk ? 0 : 1);
+}
+
+/**
+ * conversionCost() ranks the conversion of the captured frames to an encoder format, 0 is none:
+ * 1 for an SRColorConvert kernel, 2 for a repack of the same YUV sampling (YUYV or NV12 to planar), 3 for swscale
+ */
+static int conversionCost(enum AVPixelFormat captured, enum AVPixelFormat format, bool scaled, enum AVColorSpace matrix){
+    if(format == captured)
+        return 0;
+    if(!scaled && getColorConverter(captured, format, matrix))
+        return 1;
+    const AVPixFmtDescriptor *src = av_pix_fmt_desc_get(captured), *dst = av_pix_fmt_desc_get(format);
+    if(src && dst && !((src->flags | dst->flags) & AV_PIX_FMT_FLAG_RGB) && src->comp[0].depth == dst->comp[0].depth &&
+       src->log2_chroma_w == dst->log2_chroma_w && src->log2_chroma_h == dst->log2_chroma_h &&
+       !strncmp(src->name, "yuvj", 4) == !strncmp(dst->name, "yuvj", 4))
+        return 2;
+    return 3;
+}
+
+/**
+ * selectEncoderPixelFormat() picks the system memory pixel format given to a software-input encoder:
+ * the one of its list with the cheapest conversion from the captured format (none when it takes it as it is),
+ * NV12 (P010) on a tie, then the order of the encoder.\n
+ * The formats of the best formatTier() come first: with hdr the 10 bit ones, the 8 bit ones only when the list
+ * has none; with chroma the 4:4:4 or RGB ones, the 4:2:0 ones only when it has none.
+ */
+static enum AVPixelFormat selectEncoderPixelFormat(const AVCodec *codec, enum AVPixelFormat captured, bool scaled,
+                                                   SRHdrMode hdr, SRChromaMode chroma){
+    if(!codec->pix_fmts) return AV_PIX_FMT_YUV420P;
+    int tier = 3;
+    for (int i = 0; codec->pix_fmts[i] != AV_PIX_FMT_NONE; i++)
+        tier = FFMIN(tier, formatTier(codec->pix_fmts[i], hdr, chroma));
+    bool deep = hdr != SR_HDR_OFF && !(tier & 1);
+    //the matrix of applyColorDescription(), only BT.601 has 8 bit kernels
+    enum AVColorSpace matrix = hdr == SR_HDR_OFF ? AVCOL_SPC_UNSPECIFIED :
+                               hdr == SR_HDR_PQ && deep ? AVCOL_SPC_BT2020_NCL : AVCOL_SPC_BT709;
+    enum AVPixelFormat best = AV_PIX_FMT_NONE;
+    int bestCost = 0;
+    for (int i = 0; codec->pix_fmts[i] != AV_PIX_FMT_NONE; i++) {
+        enum AVPixelFormat format = codec->pix_fmts[i];
+        if(formatTier(format, hdr, chroma) != tier)
+            continue;
+        int cost = conversionCost(captured, format, scaled, matrix);
+        if(best == AV_PIX_FMT_NONE || cost < bestCost ||
+           (cost == bestCost && cost > 0 && (format == AV_PIX_FMT_NV12 || format == AV_PIX_FMT_P010))) {
+            best = format;
+            bestCost = cost;
+        }
+    }
+    return best;
+}
+
+/**
+ * openHardwareEncoder() is openVideoEncoder() for a hardware encoder through the capability cache: an encoder that
+ * refused this configuration (size, chroma, profile, codec, HDR, frame path) is not tried again until
+ * CAPS_FAILURE_TTL s later. Only a refusal is cached, EINVAL, ENOSYS or PATCHWELCOME: a busy GPU, a full session
+ * table or a device that did not open are tried again at the next launch. A missing encoder is only a lookup.
+ * @param path what feeds the encoder: "surface" (the GPU capture), "gpuconvert" or "system"
+ */
+bool ScreenRecorder::openHardwareEncoder(const SRHardwareEncoder &hw, const char *path) {
+    const char *name = encoderName(hw, settings);
+    AVCodec *codec = avcodec_find_encoder_by_name(name);
+    SRCapabilityCache *caps = codec ? capabilities() : nullptr;
+    if (!caps)
+        return openVideoEncoder(codec, &hw);
+    string key = string("encoder:") + name + ":" + to_string(settings._outscreenres.width) + "x" +
+                 to_string(settings._outscreenres.height) + ":" + to_string(settings._chroma) + ":" +
+                 to_string(settings._profile) + ":" + to_string(settings._codec) + ":" + to_string(settings._hdr) +
+                 ":" + path;
+    SRCapsEntry entry;
+    if (caps->lookup(key.c_str(), entry) && entry.result < 0) {
+        cout << "\nHardware encoder " << name << " failed to open here before, skipped";
+        return false;
+    }
+    bool opened = openVideoEncoder(codec, &hw);
+    bool refused = outVOpenError == AVERROR(EINVAL) || outVOpenError == AVERROR(ENOSYS) ||
+                   outVOpenError == AVERROR_PATCHWELCOME;
+    if (opened || refused)
+        caps->store(key.c_str(), opened ? 0 : outVOpenError);
+    return opened;
+}
+
+/**
+ * openVideoEncoder() allocates and opens outVCodecContext for the given encoder.
+ * When hw describes a surface based encoder, a device and a frames context are created as well.
+ *
+ * @return false if the encoder is missing or cannot be opened on this machine, nothing is left allocated in that case
+ */
+bool ScreenRecorder::openVideoEncoder(AVCodec *codec, const SRHardwareEncoder *hw){
+    outVOpenError = AVERROR_ENCODER_NOT_FOUND;
+    if (!codec) return false;
+
+    outVOpenError = AVERROR(ENOMEM);
+    outVCodecContext = avcodec_alloc_context3(codec);
+    if (!outVCodecContext) {
+        cout << "\nCannot create related VideoCodecContext";
+        return false;
+    }
+
+    /* set properties for the video stream encoding */
+    outVCodecContext->codec_id = codec->id;// AV_CODEC_ID_MPEG4; // AV_CODEC_ID_H264 // AV_CODEC_ID_MPEG1VIDEO
+    outVCodecContext->codec_type = AVMEDIA_TYPE_VIDEO;
+    outVCodecContext->bit_rate = 400000; // 2500000
+    outVCodecContext->width = settings._outscreenres.width;
+    outVCodecContext->height = settings._outscreenres.height;
+    outVCodecContext->gop_size = 3;
+    outVCodecContext->max_b_frames = 2;
+    outVCodecContext->time_base.num = 1;
+    outVCodecContext->time_base.den = settings._fps; // 15fps
+    if (settings._vfr) {
+        /* the frames keep their capture time: finer ticks, the nominal rate still drives the rate control */
+        outVCodecContext->time_base = {1, VFR_TIME_BASE};
+        outVCodecContext->framerate = {settings._fps, 1};
+    }
+    outVCodecContext->compression_level = 1;
+    /* the content-adaptive cap rides on a constant quality encode */
+    if (settings._contentrate && settings._crf <= 0)
+        settings._crf = CONTENT_CRF;
+    if (settings._profile == SR_PROFILE_INTERMEDIATE)
+        applyIntermediateProfile(outVCodecContext, codec);
+    else if (settings._profile != SR_PROFILE_LEGACY)
+        applyScreenProfile(outVCodecContext, codec);
+    /* reduce preset to slow if H264 to avoid resources leak */
+    else if(outVCodecContext->codec_id == AV_CODEC_ID_H264)
+        av_opt_set(outVCodecContext->priv_data, "preset", "slow", 0);
+    /* scene keyframes: produce() starts the GOPs of an active screen, the encoder interval only bounds a static one;
+       the live profile keeps its refresh period, the cutting outputs their forced keyframes */
+    if (settings._scenekeys && outVCodecContext->gop_size > 1 && !forcedKeyframeInterval() &&
+        settings._profile != SR_PROFILE_LIVE) {
+        sceneGop = (int64_t) outVCodecContext->gop_size * 1000000 / FFMAX(settings._fps, 1);
+        outVCodecContext->gop_size *= SCENE_GOP_STRETCH;
+    }
+
+    /* capture, convert and mux threads keep their cores, the encoder gets the others */
+    outVCodecContext->thread_count = settings._encthreads;
+    if (outVCodecContext->thread_count <= 0)
+        outVCodecContext->thread_count = FFMAX(cpuCount() - 1 - convertWorkerCount() - (settings._recaudio ? 1 : 0), 1);
+    /* frame threading adds a frame of delay per thread, the screen profile stays on slices */
+    outVCodecContext->thread_type = settings._profile == SR_PROFILE_SCREEN || settings._profile == SR_PROFILE_LIVE ?
+                                    FF_THREAD_SLICE : FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (settings._codec == SR_CODEC_X264 && (!strcmp(codec->name, "libx264") || !strcmp(codec->name, "libx264rgb")))
+        applyX264Options(outVCodecContext);
+    if (codec->id == AV_CODEC_ID_VP8 || codec->id == AV_CODEC_ID_VP9)
+        applyVpxOptions(outVCodecContext, codec);
+
+    if (hw && filterSink) {
+        /* surfaces come already scaled and converted out of the GPU filter graph */
+        AVBufferRef *framesRef = av_buffersink_get_hw_frames_ctx(filterSink);
+        outVCodecContext->hw_frames_ctx = av_buffer_ref(framesRef);
+        outVCodecContext->pix_fmt = (enum AVPixelFormat) av_buffersink_get_format(filterSink);
+        outVSwPixFmt = ((AVHWFramesContext *) framesRef->data)->sw_format;
+    } else if (hw && inVCodecContext->hw_frames_ctx) {
+        /* the grabber surfaces are already converted and scaled for the encoder */
+        outVCodecContext->hw_frames_ctx = av_buffer_ref(inVCodecContext->hw_frames_ctx);
+        outVCodecContext->pix_fmt = inVCodecContext->pix_fmt;
+        outVSwPixFmt = ((AVHWFramesContext *) inVCodecContext->hw_frames_ctx->data)->sw_format;
+    } else if (hw && hw->hwFormat != AV_PIX_FMT_NONE) {
+        /* frames are uploaded by the convert workers, the encoder only sees device surfaces */
+        //the device of an encoder tried before is not reused
+        av_buffer_unref(&hwDeviceContext);
+        if ((outVOpenError = av_hwdevice_ctx_create(&hwDeviceContext, hw->deviceType, nullptr, nullptr, 0)) < 0) {
+            avcodec_free_context(&outVCodecContext);
+            return false;
+        }
+        AVBufferRef *framesRef = av_hwframe_ctx_alloc(hwDeviceContext);
+        if (!framesRef) {
+            cout << "\nCannot allocate the hardware frames context";
+            av_buffer_unref(&hwDeviceContext);
+            avcodec_free_context(&outVCodecContext);
+            return false;
+        }
+        enum AVPixelFormat swFormat = hw->swFormat;
+        if (settings._chroma != SR_CHROMA_420 && swFormat == AV_PIX_FMT_NV12) {
+            //4:4:4 surfaces (H.264 High 4:4:4, HEVC RExt), av_hwframe_ctx_init() or the encoder fail where they are missing
+            swFormat = AV_PIX_FMT_YUV444P;
+        } else if (settings._hdr != SR_HDR_OFF && codec->id == AV_CODEC_ID_HEVC && swFormat == AV_PIX_FMT_NV12) {
+            //Main 10 surfaces, av_hwframe_ctx_init() fails on the devices without them
+            swFormat = AV_PIX_FMT_P010;
+            outVCodecContext->profile = FF_PROFILE_HEVC_MAIN_10;
+        }
+        AVHWFramesContext *frames = (AVHWFramesContext *) framesRef->data;
+        frames->format = hw->hwFormat;
+        frames->sw_format = swFormat;
+        frames->width = outVCodecContext->width;
+        frames->height = outVCodecContext->height;
+        frames->initial_pool_size = CAPTURE_BUFFER * convertWorkerCount() + 4;
+        if ((outVOpenError = av_hwframe_ctx_init(framesRef)) < 0) {
+            av_buffer_unref(&framesRef);
+            av_buffer_unref(&hwDeviceContext);
+            avcodec_free_context(&outVCodecContext);
+            return false;
+        }
+        outVCodecContext->hw_frames_ctx = framesRef;
+        outVCodecContext->pix_fmt = hw->hwFormat;
+        outVSwPixFmt = swFormat;
+    } else {
+        outVCodecContext->pix_fmt = selectEncoderPixelFormat(codec, inVCodecContext->pix_fmt,
+                                                             outVCodecContext->width != inVCodecContext->width ||
+                                                             outVCodecContext->height != inVCodecContext->height,
+                                                             settings._hdr, settings._chroma);
+        outVSwPixFmt = outVCodecContext->pix_fmt;
+    }
+    applyColorDescription(outVCodecContext);
+
+    /*setting global headers because some formats require them*/
+    if (needsGlobalHeader()) {
+        outVCodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (forcedKeyframeInterval() || settings._outputmode == SR_OUTPUT_FILE || settings._outputmode == SR_OUTPUT_FRAGMENTED) {
+        //the forced keyframes of produce() must be IDR frames, the cuts and the rotated files start a closed GOP
+        av_opt_set(outVCodecContext->priv_data, "forced-idr", "1", 0);
+    }
+
+    //the packets land in pooled slabs instead of a buffer of their own, the replay buffer holds them as they are
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100)
+    //get_encode_buffer and the DR1 encoders came with FFmpeg 4.4, the older ones keep their own packet buffers
+    if (codec->capabilities & AV_CODEC_CAP_DR1) {
+        if (!encoderArena)
+            encoderArena.reset(new SRPacketArena(settings._outputmode == SR_OUTPUT_REPLAY && !settings._replayraw ?
+                                                 settings._replaymaxbytes : ENCODER_ARENA_BYTES));
+        outVCodecContext->opaque = encoderArena.get();
+        outVCodecContext->get_encode_buffer = SRPacketArena::getEncodeBuffer;
+    }
+#endif
+
+    //the encoder threads start in avcodec_open2(): on Linux they inherit the cores of the opening thread
+    std::vector<int> cores = encoderCores();
+    if (!cores.empty())
+        pinCurrentThread(cores);
+    int opened = avcodec_open2(outVCodecContext, codec, nullptr);
+    if (!cores.empty())
+        pinCurrentThread(std::vector<int>());
+    if (opened < 0) {
+        outVOpenError = opened;
+        avcodec_free_context(&outVCodecContext);
+        av_buffer_unref(&hwDeviceContext);
+        return false;
+    }
+    outVOpenError = 0;
+    outVCodec = codec;
+    return true;
+}
+
+/**
+ * applyScreenProfile() overrides the legacy encoder settings for screen content:
+ * a GOP of SCREEN_GOP_SECONDS without B-frames, and a VBV of one second scaled with the output resolution.\n
+ * Screen content is mostly static, so long GOPs and intra-refresh save the bitrate a GOP of 3 spends on I-frames,
+ * while text stays legible at a fraction of the original encode time.\n
+ * The live profile refreshes every LIVE_REFRESH_SECONDS instead, in LIVE_SLICES slices and without look-ahead:
+ * a packet leaves the encoder with the frame it was given. The refresh is the intra-refresh wave, the GOP itself
+ * stays long: an encoder without intra-refresh keeps the long GOP too rather than a keyframe burst every period.
+ */
+void ScreenRecorder::applyScreenProfile(AVCodecContext *ctx, const AVCodec *codec){
+    //libx264rgb is libx264 with RGB input, same options
+    const char *name = strcmp(codec->name, "libx264rgb") ? codec->name : "libx264";
+    int64_t bitrate = (int64_t) settings._bitrate * 1000;
+    if (bitrate <= 0) {
+        double bpp = SCREEN_BITS_PER_PIXEL * (ctx->codec_id == AV_CODEC_ID_HEVC ? 0.6 : 1.0);
+        bitrate = FFMAX((int64_t) (bpp * ctx->width * ctx->height * settings._fps), 250000);
+    }
+
+    bool live = settings._profile == SR_PROFILE_LIVE;
+    ctx->max_b_frames = 0;
+    ctx->bit_rate = bitrate;
+    ctx->rc_max_rate = bitrate;
+    ctx->rc_buffer_size = (int) bitrate;
+
+    for (const SREncoderOption &opt : screenOptions)
+        if (!strcmp(opt.encoder, name))
+            av_opt_set(ctx->priv_data, opt.key, opt.value, 0);
+    bool refresh = false;
+    if (!forcedKeyframeInterval()) {
+        for (const SREncoderOption &opt : intraRefreshOptions)
+            if (!strcmp(opt.encoder, name))
+                refresh = av_opt_set(ctx->priv_data, opt.key, opt.value, 0) >= 0;
+    }
+    //with intra-refresh the GOP size is the period of the wave, the encoder sends no further keyframe
+    ctx->gop_size = settings._fps * (live && refresh ? LIVE_REFRESH_SECONDS : SCREEN_GOP_SECONDS);
+    if (live) {
+        ctx->slices = LIVE_SLICES;
+        ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        for (const SREncoderOption &opt : liveOptions)
+            if (!strcmp(opt.encoder, name))
+                av_opt_set(ctx->priv_data, opt.key, opt.value, 0);
+    }
+
+    if (settings._crf > 0) {
+        /* capped constant quality: the VBV keeps the peaks, the quality target saves the static parts */
+        if (!strcmp(name, "libx264") || !strcmp(name, "libx265") || !strcmp(name, "libaom-av1"))
+            av_opt_set_int(ctx->priv_data, "crf", settings._crf, 0);
+        else if (strstr(codec->name, "_nvenc"))
+            av_opt_set_int(ctx->priv_data, "cq", settings._crf, 0);
+        else if (strstr(codec->name, "_qsv"))
+            ctx->global_quality = settings._crf;
+    }
+}
+
+/**
+ * applyX264Options() sets up the libx264 wrapper for SR_CODEC_X264, on top of the profile: settings.x264preset and
+ * settings.x264tune, CRF with settings._crf, and slice threads with settings._slicedthreads, which the wrapper takes
+ * from a thread_type of FF_THREAD_SLICE alone. The legacy profile gets a GOP of SOFTWARE_GOP_SECONDS instead of 3 frames,
+ * zerolatency no B-frames: the wrapper would otherwise restore the ones of the context over the tune.\n
+ * With global headers the SPS and PPS only go to the extradata: the outputs reading them in the stream get them
+ * repeated on every keyframe too.
+ */
+void ScreenRecorder::applyX264Options(AVCodecContext *ctx) {
+    if (settings.x264preset && *settings.x264preset && av_opt_set(ctx->priv_data, "preset", settings.x264preset, 0) < 0)
+        cout << "\nunknown x264 preset " << settings.x264preset;
+    if (settings.x264tune && *settings.x264tune && av_opt_set(ctx->priv_data, "tune", settings.x264tune, 0) < 0)
+        cout << "\nunknown x264 tune " << settings.x264tune;
+    if (settings._crf > 0)
+        av_opt_set_int(ctx->priv_data, "crf", settings._crf, 0);
+    if (settings._profile == SR_PROFILE_LEGACY)
+        ctx->gop_size = settings._fps * SOFTWARE_GOP_SECONDS;
+    if (settings.x264tune && strstr(settings.x264tune, "zerolatency"))
+        ctx->max_b_frames = 0;
+    ctx->thread_type = settings._slicedthreads ? FF_THREAD_SLICE : FF_THREAD_FRAME;
+    if (needsGlobalHeader() && needsInbandHeaders())
+        av_opt_set(ctx->priv_data, "x264-params", "repeat-headers=1", 0);
+}
+
+/**
+ * applyVpxOptions() sets up libvpx for SR_CODEC_VP8 and SR_CODEC_VP9, on top of the profile: the realtime deadline
+ * at settings._vpxcpuused with no frame lagged behind, CRF capped by the bitrate with settings._crf.
+ * VP9 threads over tile columns, as many as the threads and the VPX_MIN_TILE_WIDTH of the frame allow, and with
+ * settings._vpxrowmt over the rows within them; VP8 splits the frame in token partitions instead.
+ */
+void ScreenRecorder::applyVpxOptions(AVCodecContext *ctx, const AVCodec *codec) {
+    av_opt_set(ctx->priv_data, "deadline", "realtime", 0);
+    av_opt_set_int(ctx->priv_data, "cpu-used", settings._vpxcpuused, 0);
+    av_opt_set_int(ctx->priv_data, "lag-in-frames", 0, 0);
+    if (settings._crf > 0)
+        av_opt_set_int(ctx->priv_data, "crf", settings._crf, 0);
+    if (settings._profile == SR_PROFILE_LEGACY)
+        ctx->gop_size = settings._fps * SOFTWARE_GOP_SECONDS;
+    ctx->max_b_frames = 0;
+    //log2 of the tile columns and of the token partitions
+    int parallel = 0;
+    while ((1 << (parallel + 1)) <= ctx->thread_count &&
+           (codec->id != AV_CODEC_ID_VP9 || (ctx->width >> (parallel + 1)) >= VPX_MIN_TILE_WIDTH))
+        parallel++;
+    if (codec->id == AV_CODEC_ID_VP9) {
+        av_opt_set_int(ctx->priv_data, "tile-columns", parallel, 0);
+        av_opt_set_int(ctx->priv_data, "row-mt", settings._vpxrowmt ? 1 : 0, 0);
+        av_opt_set_int(ctx->priv_data, "frame-parallel", 0, 0);
+    } else {
+        //the wrapper takes the token partitions from the slices
+        ctx->slices = 1 << FFMIN(parallel, 3);
+    }
+}
+
+/**
+ * applyIntermediateProfile() sets the intra-only lossless encoding of the intermediate profile:
+ * every frame is a keyframe and the bitrate is whatever the content needs.
+ */
+void ScreenRecorder::applyIntermediateProfile(AVCodecContext *ctx, const AVCodec *codec){
+    ctx->gop_size = 1;
+    ctx->max_b_frames = 0;
+    ctx->bit_rate = 0;
+    ctx->slices = INTERMEDIATE_SLICES;
+    for (const SREncoderOption &opt : intermediateOptions)
+        if (!strcmp(opt.encoder, codec->name))
+            av_opt_set(ctx->priv_data, opt.key, opt.value, 0);
+}
+
+/**
+ * applyColorDescription() tags the stream with the colors of settings._hdr, the convert workers use its matrix:
+ * BT.709 for the 10 bit SDR recordings, HDR10 (BT.2020, PQ) when the encoder takes the 10 bit frames,
+ * BT.709 again when an 8 bit encoder gets them tone-mapped. SR_HDR_OFF leaves the stream untagged.
+ * RGB frames carry no matrix at all.
+ */
+void ScreenRecorder::applyColorDescription(AVCodecContext *ctx){
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(outVSwPixFmt);
+    bool rgb = desc && (desc->flags & AV_PIX_FMT_FLAG_RGB);
+    if (rgb)
+        ctx->colorspace = AVCOL_SPC_RGB;
+    if (settings._hdr == SR_HDR_OFF)
+        return;
+    bool hdr10 = settings._hdr == SR_HDR_PQ && desc && desc->comp[0].depth > 8;
+    ctx->color_primaries = hdr10 ? AVCOL_PRI_BT2020 : AVCOL_PRI_BT709;
+    ctx->color_trc = hdr10 ? AVCOL_TRC_SMPTE2084 : AVCOL_TRC_BT709;
+    ctx->colorspace = rgb ? AVCOL_SPC_RGB : hdr10 ? AVCOL_SPC_BT2020_NCL : AVCOL_SPC_BT709;
+    ctx->color_range = rgb ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+}
+
+/**
+ * buildFilterGraph() builds filterGraph from buffersrc to buffersink around the given filters.\n
+ * framesCtx describes hardware input frames, device is given to the filters that upload system memory frames.
+ * threads are the slice threads of the filters, 0 for one per core.
+ *
+ * @return false if the graph cannot be configured, nothing is left allocated in that case
+ */
+bool ScreenRecorder::buildFilterGraph(int format, int width, int height, AVRational timeBase,
+                                      AVBufferRef *framesCtx, AVBufferRef *device, const char *filters, int threads) {
+    int ret;
+    filterGraph = avfilter_graph_alloc();
+    if (filterGraph) {
+        //before the first filter: the thread pool of the graph is created with it
+        filterGraph->nb_threads = threads;
+        filterGraph->thread_type = AVFILTER_THREAD_SLICE;
+    }
+    filterSrc = filterGraph ? avfilter_graph_alloc_filter(filterGraph, avfilter_get_by_name("buffer"), "in") : nullptr;
+    AVBufferSrcParameters *par = av_buffersrc_parameters_alloc();
+    if (!filterGraph || !filterSrc || !par) {
+        cout << "\nCannot allocate the filter graph";
+        av_free(par);
+        avfilter_graph_free(&filterGraph);
+        filterSrc = nullptr;
+        return false;
+    }
+    par->format = format;
+    par->width = width;
+    par->height = height;
+    par->time_base = timeBase;
+    par->hw_frames_ctx = framesCtx;
+    av_buffersrc_parameters_set(filterSrc, par);
+    av_free(par);
+    if (avfilter_init_str(filterSrc, nullptr) < 0 ||
+        avfilter_graph_create_filter(&filterSink, avfilter_get_by_name("buffersink"), "out", nullptr, nullptr, filterGraph) < 0) {
+        cout << "\nCannot create the filter graph endpoints";
+        avfilter_graph_free(&filterGraph);
+        filterSrc = filterSink = nullptr;
+        return false;
+    }
+
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    AVFilterInOut *inputs = avfilter_inout_alloc();
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = filterSrc;
+    outputs->pad_idx = 0;
+    outputs->next = nullptr;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = filterSink;
+    inputs->pad_idx = 0;
+    inputs->next = nullptr;
+
+    ret = avfilter_graph_parse_ptr(filterGraph, filters, &inputs, &outputs, nullptr);
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    if (ret >= 0 && device) {
+        for (unsigned int i = 0; i < filterGraph->nb_filters; i++)
+            filterGraph->filters[i]->hw_device_ctx = av_buffer_ref(device);
+    }
+    if (ret < 0 || avfilter_graph_config(filterGraph, nullptr) < 0) {
+        avfilter_graph_free(&filterGraph);
+        filterSrc = filterSink = nullptr;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * GPU conversion stages of settings._gpuconvert: the captured frames are uploaded once and scaled/converted
+ * to NV12 on the device by the video processor of the encoder back-end.
+ */
+static const SRGpuConverter gpuConverters[] = {
+        {SR_ENCODER_VAAPI, AV_HWDEVICE_TYPE_VAAPI, "hwupload,scale_vaapi=w=%d:h=%d:format=nv12"},
+        {SR_ENCODER_NVENC, AV_HWDEVICE_TYPE_CUDA, "hwupload_cuda,scale_npp=w=%d:h=%d:format=nv12"},
+};
+
+/**
+ * initGpuConvert() builds the GPU conversion graph of the given back-end for system memory captures
+ * @return false if the device or its filters are missing
+ */
+bool ScreenRecorder::initGpuConvert(const SRGpuConverter &conv) {
+    char args[256];
+    AVRational tb = videoGrabber ? inVCodecContext->time_base : inVFormatContext->streams[inVideoStreamIndex]->time_base;
+
+    av_buffer_unref(&hwDeviceContext);
+    if (av_hwdevice_ctx_create(&hwDeviceContext, conv.deviceType, nullptr, nullptr, 0) < 0)
+        return false;
+    sprintf(args, conv.filters, settings._outscreenres.width, settings._outscreenres.height);
+    if (!buildFilterGraph(inVCodecContext->pix_fmt, inVCodecContext->width, inVCodecContext->height, tb,
+                          nullptr, hwDeviceContext, args)) {
+        av_buffer_unref(&hwDeviceContext);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * gpuDeviceAvailable() tells whether a device of the given type opens on this machine, AV_HWDEVICE_TYPE_NONE always does
+ */
+static bool gpuDeviceAvailable(enum AVHWDeviceType type, const char *device = nullptr) {
+    if (type == AV_HWDEVICE_TYPE_NONE)
+        return true;
+    AVBufferRef *ctx = nullptr;
+    if (av_hwdevice_ctx_create(&ctx, type, device, nullptr, 0) < 0)
+        return false;
+    av_buffer_unref(&ctx);
+    return true;
+}
+
+/**
+ * capabilities() loads settings.capscache the first time a probe asks for it
+ * @return nullptr without one
+ */
+SRCapabilityCache *ScreenRecorder::capabilities() {
+    if (!capsCache && settings.capscache && *settings.capscache) {
+        capsCache.reset(new SRCapabilityCache(settings.capscache));
+        capsCache->load();
+        SRCapsStats caps = capsCache->stats();
+        cout << "\ncapability cache: " << capsCache->name() << ", " << caps.entries << " entries"
+             << (caps.invalidated ? " (the drivers, the displays or the libraries changed: started over)" : "");
+    }
+    return capsCache.get();
+}
+
+/**
+ * deviceAvailable() is gpuDeviceAvailable() through the capability cache: a device type that opened, or failed to
+ * open, on this machine is not created again to know
+ */
+bool ScreenRecorder::deviceAvailable(enum AVHWDeviceType type, const char *device) {
+    SRCapabilityCache *caps = type == AV_HWDEVICE_TYPE_NONE ? nullptr : capabilities();
+    if (!caps)
+        return gpuDeviceAvailable(type, device);
+    string key = string("device:") + av_hwdevice_get_type_name(type) + ":" + (device ? device : "");
+    SRCapsEntry entry;
+    if (caps->lookup(key.c_str(), entry))
+        return entry.result == 0;
+    bool available = gpuDeviceAvailable(type, device);
+    caps->store(key.c_str(), available ? 0 : AVERROR(ENODEV));
+    return available;
+}
+
+/**
+ * negotiateGpuPath() turns settings._gpupath into settings._gpucapture and settings._gpuconvert before the source
+ * opens: the GPU capture when an encoder of its surfaces is there, otherwise the GPU conversion when a hardware
+ * encoder has a video processor, otherwise the frames stay in system memory and generateVideoOutputStream() picks
+ * the encoder as usual. What needs system memory frames (video filters, privacy masks, overlays, 4:4:4, HDR) or
+ * another source keeps the capture on the CPU. The probes only open the devices: a stage failing later falls back
+ * on its own, the capture in fallBackFromGpuCapture(), the conversion in generateVideoOutputStream().
+ */
+void ScreenRecorder::negotiateGpuPath() {
+    settings._gpucapture = false;
+    settings._gpuconvert = false;
+    if (settings._encoder == SR_ENCODER_SOFTWARE || settings._profile == SR_PROFILE_INTERMEDIATE) {
+        cout << "\nGPU path: software encoder, the frames stay in system memory";
+        return;
+    }
+    bool systemFrames = hasVideoFilters() || privacyMasking() || settings._overlay || settings._textregions ||
+                        (settings.webcam && *settings.webcam) || settings._chroma != SR_CHROMA_420 ||
+                        settings._hdr != SR_HDR_OFF;
+    bool otherSource = (settings.window && *settings.window) || (settings.monitors && *settings.monitors) ||
+                       (settings.tilesource && *settings.tilesource) || (settings.sharedsource && *settings.sharedsource) ||
+                       settings._damagecapture || settings._streamcopy;
+#ifdef __unix__
+    otherSource = otherSource || !strcmp(settings.videosource, FBDEV_SOURCE);
+#endif
+
+    if (!systemFrames && !otherSource && !gpuCaptureFailed) {
+#ifdef __unix__
+        //initGpuCapture() feeds the first hardware encoder, VAAPI
+        const SRHardwareEncoder &hw = hardwareEncoders[0];
+        settings._gpucapture = (settings._encoder == SR_ENCODER_AUTO || settings._encoder == hw.backend) &&
+                               findDevice(KMS_SOURCE) && deviceAvailable(AV_HWDEVICE_TYPE_DRM, KMS_DEVICE) &&
+                               avcodec_find_encoder_by_name(encoderName(hw, settings)) &&
+                               deviceAvailable(hw.deviceType);
+#else
+        for (const SRHardwareEncoder &hw : surfaceEncoders) {
+            if (settings._encoder != SR_ENCODER_AUTO && settings._encoder != hw.backend) continue;
+            if ((settings._gpucapture = avcodec_find_encoder_by_name(encoderName(hw, settings)) &&
+                                        deviceAvailable(hw.deviceType))) break;
+        }
+#endif
+    }
+    if (settings._gpucapture) {
+        cout << "\nGPU path: GPU capture";
+        return;
+    }
+    if (!systemFrames) {
+        for (const SRHardwareEncoder &hw : hardwareEncoders) {
+            if (settings._encoder != SR_ENCODER_AUTO && settings._encoder != hw.backend) continue;
+            if (!avcodec_find_encoder_by_name(encoderName(hw, settings))) continue;
+            for (const SRGpuConverter &conv : gpuConverters)
+                if (conv.backend == hw.backend && deviceAvailable(conv.deviceType)) settings._gpuconvert = true;
+            if (settings._gpuconvert) break;
+        }
+    }
+    cout << "\nGPU path: capture in system memory ("
+         << (systemFrames ? "the recording needs system memory frames" : otherSource ? "the source has no GPU capture" :
+             gpuCaptureFailed ? "the GPU capture did not open" : "no GPU capture with an encoder of its surfaces")
+         << "), " << (settings._gpuconvert ? "converted on the GPU" : "converted on the CPU");
+}
+
+/**
+ * fallBackFromGpuCapture() opens the source again in system memory once the GPU capture negotiated by
+ * settings._gpupath did not open, the conversion and the encoder negotiated again for it
+ * @return the result of openVideoSource()
+ */
+int ScreenRecorder::fallBackFromGpuCapture() {
+    cout << "\nGPU path: the GPU capture cannot open, capturing in system memory";
+    gpuCaptureFailed = true;
+    settings._gpucapture = false;
+    return openVideoSource();
+}
+
+/**
+ * initVideoFilters() builds the graph of settings.videofilters on the CPU: the captured frames go through the chain,
+ * then the graph scales and converts them to the encoder geometry itself, in place of the swscale workers.\n
+ * The filters run on settings._filterthreads slice threads, a single ConvertThread feeds the graph in capture order,
+ * which the temporal filters (hqdn3d, fps) need. The frames are moved in and out of the graph by reference.
+ */
+int ScreenRecorder::initVideoFilters() {
+    if (settings._gpucapture || inVCodecContext->hw_frames_ctx) {
+        return fail(SR_ERROR_SETTINGS, AVERROR(ENOSYS), "The video filters need system memory frames, they cannot run on a GPU capture");
+    }
+    //the tone mapping works on the captured PQ pixels, before anything else
+    string chain = settings.videofilters ? settings.videofilters : "";
+    if (toneMapping)
+        chain = chain.empty() ? string(HDR_TONEMAP_FILTERS) : string(HDR_TONEMAP_FILTERS) + "," + chain;
+    string filters = chain + ",scale=w=" + to_string(outVCodecContext->width) +
+                     ":h=" + to_string(outVCodecContext->height) + ",format=pix_fmts=" + av_get_pix_fmt_name(outVSwPixFmt);
+    //the frames carry microseconds of the capture clock
+    if (!buildFilterGraph(inVCodecContext->pix_fmt, inVCodecContext->width, inVCodecContext->height, AV_TIME_BASE_Q,
+                          nullptr, nullptr, filters.c_str(), settings._filterthreads)) {
+        return fail(SR_ERROR_SETTINGS, 0, string("Cannot configure the video filters \"") + chain + "\"");
+    }
+    cout << "\nVideo filters: " << chain;
+    return 0;
+}
+
+/**
+ * initToneMapping() tone-maps the HDR10 frames of SR_HDR_PQ for an encoder without 10 bit input: HDR_TONEMAP_FILTERS
+ * run on the CPU ahead of settings.videofilters. Without zscale and tonemap in libavfilter, or on GPU frames,
+ * the PQ pixels are recorded as they are, with a warning.
+ */
+void ScreenRecorder::initToneMapping() {
+    if (settings._gpucapture || inVCodecContext->hw_frames_ctx || filterGraph ||
+        !avfilter_get_by_name("zscale") || !avfilter_get_by_name("tonemap")) {
+        cout << "\nThe encoder " << outVCodec->name << " takes no 10 bit frames and the HDR frames cannot be tone-mapped"
+             << ", the recording is 8 bit without tone mapping";
+        return;
+    }
+    toneMapping = true;
+    cout << "\nThe encoder " << outVCodec->name << " takes no 10 bit frames, the HDR frames are tone-mapped to SDR";
+}
+
+/**
+ * initPrivacyMasks() checks that the converted frames can be masked on the CPU and masks the areas of settings.masks
+ * and settings.maskwindows: the masked pixels must never reach the encoder, there is no fallback.
+ */
+int ScreenRecorder::initPrivacyMasks() {
+    if (settings._gpucapture || inVCodecContext->hw_frames_ctx || !SRPrivacyMask::supported(outVSwPixFmt)) {
+        return fail(SR_ERROR_SETTINGS, AVERROR(ENOSYS), string("The privacy masks need system memory ") +
+                                                        (settings._gpucapture ? "frames" : "YUV frames") +
+                                                        ", they cannot be applied to this recording");
+    }
+    const char *spec = settings.masks;
+    for (int id = -1; *spec; id--) {
+        int w, h, x, y, used = 0;
+        if (sscanf(spec, "%dx%d+%d,%d%n", &w, &h, &x, &y, &used) != 4 || w <= 0 || h <= 0) {
+            return fail(SR_ERROR_SETTINGS, 0, string("invalid mask list ") + settings.masks +
+                                              ", expected WxH+X,Y;WxH+X,Y");
+        }
+        maskScreenArea(id, x, y, w, h);
+        spec += used;
+        while (*spec == ';' || *spec == ' ')
+            spec++;
+    }
+    spec = settings.maskwindows;
+    while (*spec) {
+        char *end = nullptr;
+        unsigned long id = strtoul(spec, &end, 0);
+        if (!id || (*end && *end != ',')) {
+            return fail(SR_ERROR_SETTINGS, 0, string("invalid mask window list ") + settings.maskwindows +
+                                              ", expected window ids");
+        }
+        maskedWindows.push_back({id, 0, 0, 0, 0});
+        spec = *end ? end + 1 : end;
+    }
+#ifdef __unix__
+    trackMaskedWindows();
+#else
+    if (!maskedWindows.empty()) {
+        return fail(SR_ERROR_SETTINGS, AVERROR(ENOSYS), "The windows of settings.maskwindows can only be masked on linux");
+    }
+#endif
+    cout << "\nPrivacy masks: " << (privacyMask.empty() ? "none yet" : "on");
+    return 0;
+}
+
+/**
+ * maskScreenArea() masks a screen area of the captured region, mapped to the output frame and rounded outwards.
+ * The region is settings._inscreenres on the screen: inVCodecContext has the size of the frames, smaller once they
+ * are scaled at the source
+ * @Note a window followed with settings.window keeps the offset it had when the recording started
+ */
+void ScreenRecorder::maskScreenArea(int id, int x, int y, int width, int height) {
+    bool scaled = !inVCodecContext->hw_frames_ctx && sourceScaling();
+    int64_t inW = scaled ? settings._inscreenres.width : inVCodecContext->width;
+    int64_t inH = scaled ? settings._inscreenres.height : inVCodecContext->height;
+    int64_t outW = outVCodecContext->width, outH = outVCodecContext->height;
+    x -= settings._screenoffset.x;
+    y -= settings._screenoffset.y;
+    int x0 = (int) av_rescale_rnd(x, outW, inW, AV_ROUND_DOWN);
+    int y0 = (int) av_rescale_rnd(y, outH, inH, AV_ROUND_DOWN);
+    int x1 = (int) av_rescale_rnd(x + width, outW, inW, AV_ROUND_UP);
+    int y1 = (int) av_rescale_rnd(y + height, outH, inH, AV_ROUND_UP);
+    privacyMask.setRect(id, x0, y0, x1 - x0, y1 - y0);
+}
+
+/**
+ * trackMaskedWindows() looks the windows of settings.maskwindows up and moves their masks after them.
+ * A window that cannot be found keeps the mask of its last place.
+ */
+void ScreenRecorder::trackMaskedWindows() {
+#ifdef __unix__
+    const char *url = *settings.videourl ? settings.videourl : VIDEO_URL;
+    for (size_t i = 0; i < maskedWindows.size(); i++) {
+        MaskedWindow &w = maskedWindows[i];
+        int x, y, width, height;
+        if (!SRX11Grabber::windowArea(url, (Window) w.id, x, y, width, height))
+            continue;
+        //an unchanged mask must not count as a change of the frames
+        if (x == w.x && y == w.y && width == w.width && height == w.height)
+            continue;
+        w.x = x;
+        w.y = y;
+        w.width = width;
+        w.height = height;
+        maskScreenArea(MASK_WINDOW_ID - (int) i, x, y, width, height);
+    }
+#endif
+}
+
+/* encoders of FFmpeg reading AV_FRAME_DATA_REGIONS_OF_INTEREST */
+static const char *const regionEncoders[] = {"libx264", "libx264rgb", "libx265", "libvpx", "libvpx-vp9",
+                                             "h264_nvenc", "hevc_nvenc", "h264_qsv", "hevc_qsv"};
+
+/**
+ * initTextRegions() starts the text search of settings._textregions when the encoder takes per-block offsets:
+ * for the others it would cost a pass over every frame for nothing
+ */
+void ScreenRecorder::initTextRegions() {
+    bool supported = false;
+    for (const char *name : regionEncoders)
+        supported |= !strcmp(name, outVCodec->name);
+    if (!supported) {
+        cout << "\nText regions: " << outVCodec->name << " has no per-block quantizer, the search is off";
+        return;
+    }
+    regionMap.setDetection(true);
+    cout << "\nText regions: qoffset " << TEXT_QOFFSET_NUM << "/" << TEXT_QOFFSET_DEN;
+}
+
+/**
+ * applyRegions() blanks the privacy masks on a converted frame, then gives the encoder the macroblocks of the masks,
+ * of regionMaps() and of the text as regions of interest, in this order: the first one covering a block is used
+ * @return false if the frame cannot be masked, it must not be encoded then
+ */
+bool ScreenRecorder::applyRegions(AVFrame *frame) {
+    std::vector<AVRegionOfInterest> regions;
+    if (privacyMasking() && !privacyMask.apply(frame, regions)) {
+        if (!maskWarned.exchange(true))
+            srLog(SR_LOG_ERROR, "[ConvertThread] the privacy masks cannot be applied to %s frames, they are dropped",
+                  av_get_pix_fmt_name((enum AVPixelFormat) frame->format));
+        return false;
+    }
+    regionMap.build(frame, regions);
+    //the masked pixels are blanked already, the regions only move bits around
+    SRRegionMap::attach(frame, regions);
+    return true;
+}
+
+#ifdef __unix__
+/**
+ * initGpuCapture() builds the GPU conversion graph used with settings._gpucapture.\n
+ * The DRM PRIME frames of kmsgrab are mapped into VAAPI surfaces (hwmap) and scaled/converted to NV12
+ * by the video processor (scale_vaapi), then handed to the VAAPI encoder: the frame never reaches system memory.\n
+ * The graph input needs the frames context of the device, so one frame is read and dropped here.
+ *
+ * @Note kmsgrab needs CAP_SYS_ADMIN (or root) to export the framebuffer
+ */
+int ScreenRecorder::initGpuCapture() {
+    int ret;
+    char args[256];
+    SRPacketPtr packetHolder(av_packet_alloc());
+    SRFramePtr frameHolder(av_frame_alloc());
+    AVPacket *packet = packetHolder.get();
+    AVFrame *frame = frameHolder.get();
+
+    if (!packet || !frame) {
+        return fail(SR_ERROR_MEMORY, 0, "Cannot allocate the GPU capture probe");
+    }
+    do {
+        ret = av_read_frame(inVFormatContext, packet);
+        if (ret < 0) {
+            return fail(SR_ERROR_VIDEO_DEVICE, ret, "Cannot read a frame from the KMS device");
+        }
+        ret = avcodec_send_packet(inVCodecContext, packet) < 0 ? -1 : avcodec_receive_frame(inVCodecContext, frame);
+        av_packet_unref(packet);
+    } while (ret == AVERROR(EAGAIN));
+    if (ret < 0 || !frame->hw_frames_ctx) {
+        return fail(SR_ERROR_VIDEO_DEVICE, 0, "The KMS device does not deliver DRM frames");
+    }
+
+    sprintf(args, "hwmap=derive_device=vaapi,scale_vaapi=w=%d:h=%d:format=nv12",
+            settings._outscreenres.width, settings._outscreenres.height);
+    if (!buildFilterGraph(frame->format, frame->width, frame->height, inVFormatContext->streams[inVideoStreamIndex]->time_base,
+                          frame->hw_frames_ctx, nullptr, args)) {
+        return fail(SR_ERROR_VIDEO_DEVICE, 0, "Cannot configure the GPU filter graph");
+    }
+    return 0;
+}
+#endif
+
+/**
+ * paletteShare() is the fraction of the 16x16 blocks of a packed 32 bit RGB frame with at most SCREEN_PALETTE_COLORS
+ * colors: close to 1 for terminals and editors, low for photos and video
+ * @return -1 for the other formats
+ */
+static double paletteShare(const AVFrame *frame) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat) frame->format);
+    if (!desc || !(desc->flags & AV_PIX_FMT_FLAG_RGB) || (desc->flags & AV_PIX_FMT_FLAG_PLANAR) || desc->comp[0].step != 4)
+        return -1;
+    int blocks = 0, palette = 0;
+    for (int y = 0; y + 16 <= frame->height; y += 16) {
+        for (int x = 0; x + 16 <= frame->width; x += 16) {
+            uint32_t colors[SCREEN_PALETTE_COLORS];
+            int n = 0;
+            bool few = true;
+            for (int j = 0; j < 16 && few; j++) {
+                const uint32_t *row = (const uint32_t *) (frame->data[0] + (size_t) (y + j) * frame->linesize[0]) + x;
+                for (int i = 0; i < 16 && few; i++) {
+                    int k = 0;
+                    while (k < n && colors[k] != row[i])
+                        k++;
+                    if (k < n)
+                        continue;
+                    if (n == SCREEN_PALETTE_COLORS)
+                        few = false;
+                    else
+                        colors[n++] = row[i];
+                }
+            }
+            blocks++;
+            palette += few;
+        }
+    }
+    return blocks ? (double) palette / blocks : -1;
+}
+
+/**
+ * probeVideoFrame() captures a first frame to measure the content on, before the encoder is chosen
+ * @return the frame to free, nullptr if there is none in system memory
+ */
+AVFrame *ScreenRecorder::probeVideoFrame() {
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *packet = av_packet_alloc();
+    int ret = -1;
+    if (frame && packet && videoGrabber) {
+        ret = videoGrabber->grab(frame);
+    } else if (frame && packet) {
+        while ((ret = av_read_frame(inVFormatContext, packet)) >= 0 && packet->stream_index != inVideoStreamIndex)
+            av_packet_unref(packet);
+        if (ret >= 0)
+            ret = avcodec_send_packet(inVCodecContext, packet) < 0 ? -1 : avcodec_receive_frame(inVCodecContext, frame);
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    if (ret != 0 || frame->hw_frames_ctx)
+        av_frame_free(&frame);
+    return frame;
+}
+
+/**
+ * streamCopyable() tells whether settings._streamcopy can remux the packets of the video device as they are:
+ * a compressed stream of a demuxer, in a codec the output container takes, the size of the recording,
+ * and no stage that works on the pictures
+ */
+bool ScreenRecorder::streamCopyable() const {
+    //the native back-ends and the GPU capture give pictures
+    if (videoGrabber || !inVFormatContext || settings._gpucapture) {
+        cout << "\nstream copy: the screen is captured as pictures, they are encoded";
+        return false;
+    }
+    const AVCodecParameters *par = inVFormatContext->streams[inVideoStreamIndex]->codecpar;
+    if (par->codec_id == AV_CODEC_ID_RAWVIDEO || par->codec_id == AV_CODEC_ID_NONE) {
+        cout << "\nstream copy: the device delivers raw video, it is encoded";
+        return false;
+    }
+    if (avformat_query_codec(outAVFormatContext->oformat, par->codec_id, FF_COMPLIANCE_NORMAL) != 1) {
+        cout << "\nstream copy: " << outAVFormatContext->oformat->name << " cannot carry "
+             << avcodec_get_name(par->codec_id) << ", the video is encoded";
+        return false;
+    }
+    if ((settings._outscreenres.width > 0 && settings._outscreenres.width != par->width) ||
+        (settings._outscreenres.height > 0 && settings._outscreenres.height != par->height)) {
+        cout << "\nstream copy: the recording is scaled, the video is encoded";
+        return false;
+    }
+    const char *stage = hasVideoFilters() || settings._hdr == SR_HDR_PQ ? "the video filters" :
+                        privacyMasking() ? "the privacy masks" :
+                        settings._overlay ? "the overlays" :
+                        settings._textregions ? "the text regions" :
+                        settings._skipstatic || settings._vfr || settings._activitygate ? "the change detection" :
+                        settings._scenekeys ? "the scene keyframes" :
+                        settings._contentrate || settings._qualityprobe ? "the rate control" :
+                        settings.renditions && *settings.renditions ? "the renditions" :
+                        settings.thumbnails && *settings.thumbnails ? "the thumbnails" :
+                        settings.sharedframes && *settings.sharedframes ? "the shared frames" :
+                        settings._outputmode == SR_OUTPUT_REPLAY && settings._replayraw ? "the raw replay buffer" :
+                        forcedKeyframeInterval() > 0 ? "the segment keyframes" : nullptr;
+    if (stage) {
+        cout << "\nstream copy: " << stage << " need the pictures, the video is encoded";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * openStreamCopy() sets up settings._streamcopy: outVCodecContext is never opened, it only describes the copied
+ * stream, in the time base of the device, to the stages reading the encoder settings
+ */
+int ScreenRecorder::openStreamCopy() {
+    AVStream *in = inVFormatContext->streams[inVideoStreamIndex];
+    outVCodecContext = avcodec_alloc_context3(nullptr);
+    if (!outVCodecContext || avcodec_parameters_to_context(outVCodecContext, in->codecpar) < 0) {
+        return fail(SR_ERROR_ENCODER, 0, "Cannot describe the copied video stream");
+    }
+    outVCodecContext->time_base = in->time_base;
+    outVCodecContext->framerate = av_guess_frame_rate(inVFormatContext, in, nullptr);
+    outVSwPixFmt = outVCodecContext->pix_fmt;
+    const AVCodecDescriptor *desc = avcodec_descriptor_get(in->codecpar->codec_id);
+    videoCopyIntra = desc && (desc->props & AV_CODEC_PROP_INTRA_ONLY);
+    videoCopy = true;
+    cout << "\nVideo copied: " << avcodec_get_name(in->codecpar->codec_id) << " " << in->codecpar->width << "x"
+         << in->codecpar->height << (videoCopyIntra ? ", intra-only" : "");
+    return 0;
+}
+
+/**
+ * openScreenContentEncoder() opens the encoder of SR_CODEC_SCREEN_CONTENT for what a first frame shows.\n
+ * The lossless screen codecs need a plain file in a container that takes them, and frames nobody draws on
+ * in YUV (overlays, privacy masks).
+ * @return false if none of them is available, the H.264 encoders are tried next
+ */
+bool ScreenRecorder::openScreenContentEncoder() {
+    AVFrame *probe = probeVideoFrame();
+    double share = probe ? paletteShare(probe) : -1;
+    av_frame_free(&probe);
+    if (share >= 0)
+        cout << "\nScreen content: " << (int) (share * 100) << "% palette blocks";
+
+    bool lossless = share >= SCREEN_LOSSLESS_SHARE && settings._profile == SR_PROFILE_SCREEN &&
+                    settings._outputmode == SR_OUTPUT_FILE && !*settings.streamurl && !*settings.renditions &&
+                    !settings._overlay && !privacyMasking();
+    for (const char *name : paletteEncoders) {
+        AVCodec *codec = lossless ? avcodec_find_encoder_by_name(name) : nullptr;
+        if (codec && avformat_query_codec(outAVFormatContext->oformat, codec->id, FF_COMPLIANCE_NORMAL) == 1 &&
+            openVideoEncoder(codec, nullptr))
+            return true;
+    }
+    for (const char *name : screenContentEncoders) {
+        AVCodec *codec = avcodec_find_encoder_by_name(name);
+        if (codec && avformat_query_codec(outAVFormatContext->oformat, codec->id, FF_COMPLIANCE_NORMAL) == 1 &&
+            openVideoEncoder(codec, nullptr))
+            return true;
+        cout << "\nScreen content encoder " << name << " not available";
+    }
+    return false;
+}
+
+/**
+ * generateVideoOutputStream() creates the output video stream and its encoder.\n
+ * With settings._encoder set to SR_ENCODER_AUTO the hardware encoders available on the platform are tried in order,
+ * a specific back-end restricts the search to it; the software MPEG-4 encoder is the fallback in any case.\n
+ * The screen profile looks for H.264 or HEVC encoders (settings._codec) and tries libx264/libx265 before MPEG-4,
+ * SR_CODEC_SCREEN_CONTENT tries the screen content software encoders before all of them, SR_CODEC_X264 libx264,
+ * SR_CODEC_VP8 and SR_CODEC_VP9 libvpx.\n
+ * With settings._gpuconvert a hardware encoder with a GPU conversion stage gets the captured frames uploaded as they are,
+ * the convert workers are replaced by the video processor of the device.
+ */
+int ScreenRecorder::generateVideoOutputStream(){
+        int i;
+        bool opened = false;
+        int ret;
+		
+		cout<<"[generateVideoOutputStream] entering\n";
+
+        AVStream *video_st = avformat_new_stream(outAVFormatContext, nullptr);
+
+        if (!video_st) {
+            return fail(SR_ERROR_MEMORY, 0, "Cannot create video stream");
+        }
+        //the packets of the device as they are: no encoder to open
+        if (settings._streamcopy && streamCopyable()) {
+            if ((ret = openStreamCopy()) < 0)
+                return ret;
+            opened = true;
+        }
+
+#ifdef __unix__
+        if (settings._gpucapture) {
+            /* DRM frames can only be consumed by VAAPI, there is no software fallback */
+            if ((ret = initGpuCapture()) < 0)
+                return ret;
+            if (!openVideoEncoder(avcodec_find_encoder_by_name(encoderName(hardwareEncoders[0], settings)), &hardwareEncoders[0])) {
+                return fail(SR_ERROR_ENCODER, AVERROR_ENCODER_NOT_FOUND, "Cannot open the VAAPI encoder for GPU capture");
+            }
+            opened = true;
+        }
+#endif
+#if defined(_WIN32) || defined(__APPLE__)
+        if (settings._gpucapture) {
+            /* device surfaces need an encoder reading them, there is no software fallback */
+            for (const SRHardwareEncoder &hw : surfaceEncoders) {
+                if (settings._encoder != SR_ENCODER_AUTO && settings._encoder != hw.backend) continue;
+                if ((opened = openHardwareEncoder(hw, "surface"))) break;
+                cout << "\nHardware encoder " << encoderName(hw, settings) << " not available";
+            }
+            if (!opened) {
+                return fail(SR_ERROR_ENCODER, AVERROR_ENCODER_NOT_FOUND, "Cannot open a hardware encoder for GPU capture");
+            }
+        }
+#endif
+        if (!opened && settings._codec == SR_CODEC_SCREEN_CONTENT &&
+            (settings._profile == SR_PROFILE_SCREEN || settings._profile == SR_PROFILE_LIVE))
+            opened = openScreenContentEncoder();
+        if (!opened && (settings._codec == SR_CODEC_VP8 || settings._codec == SR_CODEC_VP9) &&
+            settings._profile != SR_PROFILE_INTERMEDIATE) {
+            //software only: the hardware VP9 encoders are rare and none writes VP8
+            const char *name = settings._codec == SR_CODEC_VP8 ? "libvpx" : "libvpx-vp9";
+            if (!(opened = openVideoEncoder(avcodec_find_encoder_by_name(name), nullptr)))
+                cout << "\nSoftware encoder " << name << " not available";
+        }
+        if (!opened && settings._codec == SR_CODEC_X264 && settings._profile != SR_PROFILE_INTERMEDIATE) {
+            //software H.264 asked for: no hardware search, the RGB input of x264 is a separate encoder
+            const char *name = settings._chroma == SR_CHROMA_RGB ? "libx264rgb" : "libx264";
+            if (!(opened = openVideoEncoder(avcodec_find_encoder_by_name(name), nullptr)))
+                cout << "\nSoftware encoder " << name << " not available";
+            if (!opened && settings._chroma == SR_CHROMA_RGB &&
+                !(opened = openVideoEncoder(avcodec_find_encoder_by_name("libx264"), nullptr)))
+                cout << "\nSoftware encoder libx264 not available";
+        }
+        if (!opened && settings._profile == SR_PROFILE_INTERMEDIATE) {
+            //cheap lossless intra-only codecs, compacted later
+            for (const char *name : intermediateEncoders) {
+                if ((opened = openVideoEncoder(avcodec_find_encoder_by_name(name), nullptr))) break;
+                cout << "\nIntermediate encoder " << name << " not available";
+            }
+        }
+        if (!opened && settings._encoder != SR_ENCODER_SOFTWARE && settings._profile != SR_PROFILE_INTERMEDIATE) {
+            for (const SRHardwareEncoder &hw : hardwareEncoders) {
+                if (settings._encoder != SR_ENCODER_AUTO && settings._encoder != hw.backend) continue;
+                //the device scalers output NV12
+                if (settings._gpuconvert && !hasVideoFilters() && !privacyMasking() && settings._chroma == SR_CHROMA_420) {
+                    for (const SRGpuConverter &conv : gpuConverters) {
+                        if (conv.backend != hw.backend || !initGpuConvert(conv)) continue;
+                        if ((opened = openHardwareEncoder(hw, "gpuconvert"))) break;
+                        avfilter_graph_free(&filterGraph);
+                        filterSrc = filterSink = nullptr;
+                        av_buffer_unref(&hwDeviceContext);
+                    }
+                    if (opened) break;
+                    cout << "\nGPU conversion for " << encoderName(hw, settings) << " not available";
+                }
+                if ((opened = openHardwareEncoder(hw, "system"))) break;
+                cout << "\nHardware encoder " << encoderName(hw, settings) << " not available";
+            }
+        }
+        if (!opened && (settings._profile == SR_PROFILE_SCREEN || settings._profile == SR_PROFILE_LIVE)) {
+            //software H.264/HEVC before the MPEG-4 fallback, the RGB input of x264 is a separate encoder
+            const char *name = settings._codec == SR_CODEC_HEVC ? "libx265" :
+                               settings._chroma == SR_CHROMA_RGB ? "libx264rgb" : "libx264";
+            if (!(opened = openVideoEncoder(avcodec_find_encoder_by_name(name), nullptr)))
+                cout << "\nSoftware encoder " << name << " not available";
+            if (!opened && settings._chroma == SR_CHROMA_RGB && settings._codec != SR_CODEC_HEVC &&
+                !(opened = openVideoEncoder(avcodec_find_encoder_by_name("libx264"), nullptr)))
+                cout << "\nSoftware encoder libx264 not available";
+        }
+        if (!opened && !openVideoEncoder(avcodec_find_encoder(AV_CODEC_ID_MPEG4), nullptr)) {
+            return fail(SR_ERROR_ENCODER, AVERROR_ENCODER_NOT_FOUND, "Cannot find requested encoder");
+        }
+        if (!videoCopy) {
+            cout << "\nVideo encoder: " << outVCodec->name;
+            if (settings._hdr == SR_HDR_PQ && outVCodecContext->color_trc != AVCOL_TRC_SMPTE2084)
+                initToneMapping();
+            if (hasVideoFilters() && (ret = initVideoFilters()) < 0)
+                return ret;
+            if (privacyMasking() && (ret = initPrivacyMasks()) < 0)
+                return ret;
+            if (settings._textregions)
+                initTextRegions();
+            SRPipelinePath path = getPipelinePath();
+            cout << "\nPipeline path: capture " << (path.capture == SR_PATH_GPU ? "GPU" : "CPU")
+                 << " > convert " << (path.convert == SR_PATH_GPU ? "GPU" : "CPU")
+                 << " > encode " << (path.encode == SR_PATH_GPU ? "GPU" : "CPU")
+                 << (path.resident ? ", the frames never leave the GPU" :
+                     path.convert == SR_PATH_GPU || path.encode == SR_PATH_GPU ? ", one upload" : "");
+        }
+
+        //find a free stream index
+        outVideoStreamIndex = -1;
+        for(i=0; i < outAVFormatContext->nb_streams; i++)
+            if(outAVFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_UNKNOWN)
+                outVideoStreamIndex = i;
+
+            if(outVideoStreamIndex < 0) {
+                return fail(SR_ERROR_OUTPUT, 0, "Cannot find a free stream for video on the output");
+            }
+
+        if (videoCopy) {
+            AVCodecParameters *par = outAVFormatContext->streams[outVideoStreamIndex]->codecpar;
+            avcodec_parameters_copy(par, inVFormatContext->streams[inVideoStreamIndex]->codecpar);
+            //the tag of the device container means nothing in the output one
+            par->codec_tag = 0;
+        } else
+            avcodec_parameters_from_context(outAVFormatContext->streams[outVideoStreamIndex]->codecpar, outVCodecContext);
+		cout<<"[generateVideoOutputStream] exiting\n";
+
+    return 0;
+}
+int ScreenRecorder::generateAudioOutputStream(AudioTrack &a){
+    avcodec_free_context(&a.outACodecContext);
+    a.outACodec = nullptr;
+    int i;
+
+	cout<<"[generateAudioOutputStream] entering\n";
+
+    AVStream *audio_st = avformat_new_stream(outAVFormatContext, nullptr);
+    if (!audio_st) {
+        return fail(SR_ERROR_MEMORY, 0, "Cannot create audio stream");
+    }
+    //WebM takes Opus and Vorbis only
+    bool aacRefused = avformat_query_codec(outAVFormatContext->oformat, AV_CODEC_ID_AAC, FF_COMPLIANCE_NORMAL) == 0;
+    if (settings._audiocodec == SR_AUDIO_OPUS || aacRefused) {
+        //the native Opus encoder is experimental and 20 ms only
+        a.outACodec = avcodec_find_encoder_by_name("libopus");
+        if (!a.outACodec)
+            cout << "\nlibopus not available, the audio falls back to AAC";
+        else if (!avformat_query_codec(outAVFormatContext->oformat, AV_CODEC_ID_OPUS, FF_COMPLIANCE_EXPERIMENTAL)) {
+            cout << "\n" << outAVFormatContext->oformat->name << " cannot carry Opus, the audio falls back to AAC";
+            a.outACodec = nullptr;
+        }
+    }
+    if (!a.outACodec)
+        a.outACodec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (!a.outACodec) {
+        return fail(SR_ERROR_ENCODER, AVERROR_ENCODER_NOT_FOUND, "Cannot find requested encoder");
+    }
+    a.outACodecContext = avcodec_alloc_context3(a.outACodec);
+    if (!a.outACodecContext) {
+        return fail(SR_ERROR_MEMORY, 0, "Cannot create related VideoCodecContext");
+    }
+
+
+    /* set properties for the video stream encoding*/
+
+    if ((a.outACodec)->supported_samplerates) {
+        a.outACodecContext->sample_rate = (a.outACodec)->supported_samplerates[0];
+        for (i = 0; (a.outACodec)->supported_samplerates[i]; i++) {
+            if ((a.outACodec)->supported_samplerates[i] == a.inACodecContext->sample_rate)
+                a.outACodecContext->sample_rate = a.inACodecContext->sample_rate;
+        }
+    }
+    a.outACodecContext->codec_id = a.outACodec->id;
+    a.outACodecContext->sample_fmt  = (a.outACodec)->sample_fmts ? (a.outACodec)->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+    a.outACodecContext->channels  = a.inACodecContext->channels;
+    a.outACodecContext->channel_layout = av_get_default_channel_layout(a.outACodecContext->channels);
+    a.outACodecContext->bit_rate = a.outACodec->id == AV_CODEC_ID_OPUS ? OPUS_BITRATE : AAC_BITRATE;
+    //the sample rate of the encoder, Opus resamples everything to 48 kHz
+    a.outACodecContext->time_base = { 1, a.outACodecContext->sample_rate };
+
+    a.outACodecContext->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+    if (a.outACodec->id == AV_CODEC_ID_OPUS) {
+        //frame_size follows the frame duration: the FIFO of captureAudio() hands out frames of that size
+        av_opt_set_double(a.outACodecContext->priv_data, "frame_duration", settings._opusframe, 0);
+        //the libopus wrappers before FFmpeg 6 have no dtx option: the repeated silent packets do without it
+        if (settings._silencegate)
+            av_opt_set_int(a.outACodecContext->priv_data, "dtx", 1, 0);
+        //Opus in MP4 is still experimental in the muxers of FFmpeg 4
+        outAVFormatContext->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+    }
+    if (settings._aacfast && !strcmp(a.outACodec->name, "aac")) {
+        /* the two-loop search quantizes every band until it fits the bits, the fast coder guesses the scale factors
+         * from the band energies in one pass; the tools left out each add a search of their own */
+        av_opt_set(a.outACodecContext->priv_data, "aac_coder", "fast", 0);
+        av_opt_set_int(a.outACodecContext->priv_data, "aac_tns", 0, 0);
+        av_opt_set_int(a.outACodecContext->priv_data, "aac_pns", 0, 0);
+        av_opt_set_int(a.outACodecContext->priv_data, "aac_is", 0, 0);
+    }
+
+    if (needsGlobalHeader()) {
+        a.outACodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if (avcodec_open2(a.outACodecContext, a.outACodec, nullptr)< 0) {
+        return fail(SR_ERROR_ENCODER, 0, "error in opening the avcodec with error: ");
+    }
+
+
+    //find a free stream index
+    a.outAudioStreamIndex = -1;
+    for(i=0; i < outAVFormatContext->nb_streams; i++)
+        if(outAVFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_UNKNOWN)
+            a.outAudioStreamIndex = i;
+
+        if(a.outAudioStreamIndex < 0) {
+            return fail(SR_ERROR_OUTPUT, 0, "Cannot find a free stream for audio on the output");
+        }
+
+    avcodec_parameters_from_context(outAVFormatContext->streams[a.outAudioStreamIndex]->codecpar, a.outACodecContext);
+    cout<<"[generateAudioOutputStream] exiting\n";
+    return 0;
+}
+
+void ScreenRecorder::initOptions() {
+    settings.filename = "";
+    settings.streamurl = "";
+    settings._udprate = 0;
+    settings._udpttl = UDP_TTL;
+    settings.webrtcurl = "";
+    settings.capscache = "";
+    settings.uploadurl = "";
+    settings._uploadthreads = UPLOAD_THREADS;
+    settings.renditions = "";
+    settings.videowall = "";
+    settings.audiotracks = "";
+    settings._recaudio=false;
+    settings._audiocodec = SR_AUDIO_AAC;
+    settings._resampler = SR_RESAMPLER_DEFAULT;
+    settings._opusframe = OPUS_FRAME;
+    settings._aacfast = false;
+    settings._silencegate = false;
+    settings._audiodsp = false;
+    settings._inscreenres={0,0};
+    settings._outscreenres={0,0};
+
+    settings._screenoffset={0,0};
+    settings._encoder = SR_ENCODER_AUTO;
+    settings._codec = SR_CODEC_H264;
+    settings._slicedthreads = true;
+    settings._vpxcpuused = VPX_CPU_USED;
+    settings._vpxrowmt = true;
+    settings._webmlive = true;
+    settings.x264preset = (char *) X264_PRESET;
+    settings.x264tune = (char *) X264_TUNE;
+    settings._profile = SR_PROFILE_LEGACY;
+    settings._hdr = SR_HDR_OFF;
+    settings._chroma = SR_CHROMA_420;
+    settings._crf = 0;
+    settings._contentrate = false;
+    settings._bitrate = 0;
+    settings._gpucapture = false;
+    settings._gpuconvert = false;
+    settings._sourcescale = false;
+    settings._gpupath = false;
+    settings._damagecapture = false;
+    settings._drawcursor = true;
+    settings._cursortrack = false;
+    settings._vblank = false;
+    settings.vblankdevice = (char *) VBLANK_DEVICE;
+    settings._skipstatic = false;
+    settings._scrollhints = false;
+    settings._scenekeys = false;
+    settings._overlay = false;
+    settings._streamcopy = false;
+    settings._webcamwidth = WEBCAM_WIDTH;
+    settings._privacymask = false;
+    settings._textregions = false;
+    settings._vfr = false;
+    settings._vfrmaxinterval = VFR_MAX_INTERVAL;
+    settings._vfrmininterval = 0;
+    settings._idlerate = false;
+    settings._droppolicy = SR_DROP_NONE;
+    settings._droplatency = DROP_LATENCY;
+    settings._adaptivequality = false;
+    settings._power = SR_POWER_OFF;
+    settings._encthreads = 0;
+    settings._decthreads = 0;
+    settings._convertthreads = 0;
+    settings._filterthreads = 0;
+    settings._scalequality = SR_SCALE_BICUBIC;
+    settings._scalebands = 0;
+    settings._scaletiles = false;
+    settings._pinthreads = true;
+    settings._taskpool = false;
+    settings._realtime = SR_REALTIME_OFF;
+    settings._rtpriority = REALTIME_PRIORITY;
+    settings._numanode = -1;
+    settings._hugepages = false;
+    settings._audiolatency = AUDIO_LATENCY;
+    settings._nativeaudio = false;
+    settings._audiofragment = AUDIO_FRAGMENT;
+    settings._audiobatch = AUDIO_BATCH;
+    settings._lowpower = false;
+    settings._outputmode = SR_OUTPUT_FILE;
+    settings._fragduration = FRAGMENT_DURATION;
+    settings._segmentduration = SEGMENT_DURATION;
+    settings._segmentkeep = 0;
+    settings._livesegment = LIVE_SEGMENT_DURATION;
+    settings._livewindow = LIVE_WINDOW;
+    settings._replayduration = REPLAY_DURATION;
+    settings._replayraw = false;
+    settings._replaypack = false;
+    settings._burst = false;
+    settings._burstmaxbytes = 0;
+    settings._bursttiles = 0;
+    settings._sharedslots = SHM_SLOTS;
+    settings._thumbinterval = SNAPSHOT_INTERVAL;
+    settings._thumbwidth = SNAPSHOT_WIDTH;
+    settings._replaymaxbytes = REPLAY_MAX_BYTES;
+    settings._activitygate = false;
+    settings._activitypreroll = ACTIVITY_PREROLL;
+    settings._activitytail = ACTIVITY_TAIL;
+    settings._activitytiles = ACTIVITY_MIN_TILES;
+    settings._memorybudget = 0;
+    settings._muxmaxbytes = MUX_MAX_BYTES;
+    settings._muxmaxdelay = MUX_MAX_DELAY;
+    settings._muxoverflow = SR_MUX_FLUSH;
+    settings._loglevel = SR_LOG_INFO;
+    settings._shutdowntimeout = SHUTDOWN_TIMEOUT;
+    settings._watchdogtimeout = WATCHDOG_TIMEOUT;
+    settings._exitonerror = true;
+    settings._threadqueuesize = THREAD_QUEUE_SIZE;
+    settings._faststart = false;
+    settings._expectedduration = 0;
+    settings._fastopen = true;
+    settings._asyncwrite = true;
+    settings._directio = false;
+    settings._iobuffer = ASYNC_IO_SIZE;
+    settings._writerspill = WRITER_SPILL_BYTES;
+    settings.encryptkey = "";
+    settings._manifest = false;
+    settings.manifestkey = "";
+    settings._mmapwrite = false;
+    settings._keyindex = false;
+    settings._inputlog = false;
+    settings._inputkeys = false;
+    settings._phashindex = false;
+    settings._qualityprobe = 0;
+    settings._statsinterval = 0;
+    settings._metricsinterval = METRICS_INTERVAL;
+    settings._traceduration = TRACE_DURATION;
+    settings.statsfile = "";
+    settings.metricsurl = "";
+    settings.metricsprefix = METRICS_PREFIX;
+    settings.controlurl = "";
+    settings.tracefile = "";
+    settings.videosource = "";
+    settings.videourl = "";
+    settings.capturepixfmt = "auto";
+    settings.videooptions = "";
+    settings.videofilters = "";
+    settings.audiosource = "";
+    settings.audiourl = "";
+    settings.audiooptions = "";
+    settings.webcam = "";
+    settings.webcamsource = "";
+    settings.webcamoptions = "";
+    settings.window = "";
+    settings.monitors = "";
+    settings.tilesource = "";
+    settings.sharedsource = "";
+    settings.masks = "";
+    settings.maskwindows = "";
+    settings.thumbnails = "";
+    settings.sharedframes = "";
+    settings.tileview = "";
+    settings.capturecores = "";
+    settings.cpuflags = "";
+}
+
+void ScreenRecorder::attachTaskPool(SRTaskPool *pool) {
+    taskPool = pool;
+}
+
+void ScreenRecorder::attachDisplayLoop(SRDisplayLoop *loop) {
+    displayLoop = loop;
+}
+
+int ScreenRecorder::saveReplay(const char *path) {
+    if (!replayBuffer && !frameReplay) {
+        cout << "\nsaveReplay() needs SR_OUTPUT_REPLAY";
+        return AVERROR(EINVAL);
+    }
+    int ret = frameReplay ? frameReplay->save(path) : replayBuffer->save(path);
+    if (ret == AVERROR(EBUSY))
+        cout << "\na replay is still being written, " << path << " skipped";
+    return ret;
+}
+
+SRClockStats ScreenRecorder::getVideoClockStats() const {
+    return videoClock.stats();
+}
+
+uint64_t ScreenRecorder::getAudioOverflows() const {
+    return audioOverflows;
+}
+
+uint64_t ScreenRecorder::getAudioUnderruns() const {
+    return audioUnderruns;
+}
+
+/**
+ * getMuxQueueBytes() is the size of the encoded packets waiting in the mux queues
+ */
+int64_t ScreenRecorder::getMuxQueueBytes() const {
+    return muxQueuedBytes;
+}
+
+/**
+ * getMuxQueueDelay() is the longest span, in us, of packets the muxer holds back for a single stream
+ */
+int64_t ScreenRecorder::getMuxQueueDelay() const {
+    return muxQueuedDelay;
+}
+
+/**
+ * getStats() reads the instrumentation of the pipeline, from any thread and at any time:
+ * the counters are relaxed atomics and the queue depths a sample of the moment
+ */
+SRPipelineStats ScreenRecorder::getStats() const {
+    SRPipelineStats s;
+    for (int i = 0; i < SR_STAGE_COUNT; i++)
+        s.stages[i] = stageTimes[i].snapshot();
+    s.videoLatency = videoLatency.snapshot();
+    s.audioLatency = audioLatency.snapshot();
+    s.rawQueued = s.scaledQueued = s.muxQueued = 0;
+    for (auto &queue : rawVideoQueues)
+        s.rawQueued += queue->size();
+    for (auto &queue : scaledVideoQueues)
+        s.scaledQueued += queue->size();
+    for (auto &queue : muxQueues)
+        s.muxQueued += queue->size();
+    s.muxQueuedBytes = muxQueuedBytes;
+    s.staticFrames = skippedStaticFrames;
+    s.scrolledFrames = scrolledFrames;
+    s.sceneKeyframes = sceneKeyframes;
+    s.missedFrames = videoClock.stats().missed;
+    s.staleFrames = staleDeviceFrames;
+    s.abandonedFrames = framesAbandoned;
+    s.droppedPackets = muxDroppedPackets;
+    s.droppedSamples = audioDroppedSamples;
+    s.policyDroppedFrames = policyDroppedFrames;
+    s.shedFrames = shedFrames;
+    s.qualityStep = qualityStep;
+    s.mergedFrames = vfrMergedFrames;
+    s.keepaliveFrames = vfrKeepaliveFrames;
+    s.remoteFrames = numaRemoteFrames;
+    s.remoteBytes = numaRemoteBytes;
+    s.capturedFrames = videoFrameCount;
+    s.encodedFrames = encodedFrames;
+    s.videoBytes = encodedBytes;
+    s.audioDrift = 0;
+    s.resampler = settings._resampler;
+    s.soxr = settings._resampler == SR_RESAMPLER_HIGH && resamplerHasSoxr();
+    s.resampleTime = 0;
+    s.resampledSamples = 0;
+    for (auto &track : audioTracks) {
+        int64_t drift = track->drift.load(std::memory_order_relaxed);
+        if(FFABS(drift) > FFABS(s.audioDrift))
+            s.audioDrift = drift;
+        s.resampleTime += track->resampleTime.load(std::memory_order_relaxed);
+        s.resampledSamples += track->resampledSamples.load(std::memory_order_relaxed);
+    }
+    s.writer = fileWriter ? fileWriter->stats() : SRWriterStats{0, 0, 0, 0, 0, 0, 0, 0};
+    s.quality = qualityProbe ? qualityProbe->stats() : SRQualityStats{0, 0, 0, 1, 0};
+    s.profile = srProfileSnapshot();
+    return s;
+}
+
+static void writeLatencyJson(std::ostream &out, const char *name, const SRLatencyStats &l) {
+    out << "\"" << name << "\":{\"count\":" << l.count << ",\"mean\":" << l.mean << ",\"p50\":" << l.p50
+        << ",\"p99\":" << l.p99 << ",\"max\":" << l.max << "}";
+}
+
+/**
+ * writeStatsJson() writes getStats() as one line of JSON, times in microseconds
+ */
+void ScreenRecorder::writeStatsJson(std::ostream &out) const {
+    static const char *stageNames[SR_STAGE_COUNT] = {"grab", "decode", "scale", "encode", "mux"};
+    static const char *resamplerNames[] = {"fast", "default", "high"};
+    SRPipelineStats s = getStats();
+
+    out << "{\"time\":" << (captureClock.started() ? captureClock.elapsed(av_gettime()) : 0) << ",\"stages\":{";
+    for (int i = 0; i < SR_STAGE_COUNT; i++) {
+        if(i) out << ",";
+        writeLatencyJson(out, stageNames[i], s.stages[i]);
+    }
+    out << "},\"latency\":{";
+    writeLatencyJson(out, "video", s.videoLatency);
+    out << ",";
+    writeLatencyJson(out, "audio", s.audioLatency);
+    out << "},\"frames\":{\"captured\":" << s.capturedFrames << ",\"encoded\":" << s.encodedFrames
+        << ",\"videoBytes\":" << s.videoBytes << "},\"audioDrift\":" << s.audioDrift << ",\"resampler\":{\"profile\":\""
+        << resamplerNames[s.resampler] << "\",\"soxr\":" << (s.soxr ? "true" : "false") << ",\"time\":" << s.resampleTime
+        << ",\"samples\":" << s.resampledSamples << "},\"queued\":{\"raw\":" << s.rawQueued << ",\"scaled\":" << s.scaledQueued << ",\"mux\":" << s.muxQueued
+        << ",\"muxBytes\":" << s.muxQueuedBytes << "},\"dropped\":{\"static\":" << s.staticFrames
+        << ",\"missed\":" << s.missedFrames << ",\"stale\":" << s.staleFrames << ",\"abandoned\":" << s.abandonedFrames
+        << ",\"packets\":" << s.droppedPackets << ",\"samples\":" << s.droppedSamples << ",\"policy\":" << s.policyDroppedFrames << ",\"shed\":" << s.shedFrames
+        << ",\"merged\":" << s.mergedFrames << "},\"keepalive\":" << s.keepaliveFrames << ",\"scrolled\":" << s.scrolledFrames
+        << ",\"sceneKeyframes\":" << s.sceneKeyframes
+        << ",\"qualityStep\":" << s.qualityStep << ",\"numa\":{\"remoteFrames\":" << s.remoteFrames
+        << ",\"remoteBytes\":" << s.remoteBytes << "},\"quality\":{\"samples\":" << s.quality.samples
+        << ",\"ssim\":" << (s.quality.samples ? s.quality.ssimSum / s.quality.samples : 0)
+        << ",\"psnr\":" << (s.quality.samples ? s.quality.psnrSum / s.quality.samples : 0)
+        << ",\"ssimMin\":" << s.quality.ssimMin << ",\"skippedGops\":" << s.quality.skippedGops << "},\"writer\":{\"bytes\":" << s.writer.bytes
+        << ",\"syscalls\":" << s.writer.syscalls << ",\"stalls\":" << s.writer.stalls << ",\"stallTime\":" << s.writer.stallTime
+        << ",\"backlog\":" << (fileWriter ? fileWriter->backlog() : 0) << ",\"peakBacklog\":" << s.writer.peakBacklog
+        << ",\"spills\":" << s.writer.spills << "}";
+    if(s.profile.enabled) {
+        //the VideoThread counts in grab, its decode included, and the threads of no stage in other
+        out << ",\"profile\":{";
+        for (int i = 0; i < SR_PROFILE_SLOTS; i++) {
+            uint64_t frames = i < SR_STAGE_COUNT ? s.stages[i].count : 0;
+            out << (i ? "," : "") << "\"" << (i < SR_STAGE_COUNT ? stageNames[i] : "other") << "\":{\"allocations\":"
+                << s.profile.allocations[i] << ",\"perFrame\":" << (frames ? (double) s.profile.allocations[i] / frames : 0)
+                << ",\"bytes\":" << s.profile.allocatedBytes[i] << ",\"contended\":" << s.profile.contended[i]
+                << ",\"lockWait\":" << s.profile.lockWait[i] << "}";
+        }
+        out << "}";
+    }
+    out << "}\n";
+}
+
+/**
+ * dumpStats() is the execution flow of the "StatsThread": one JSON line every settings._statsinterval ms,
+ * and a last one once finishCapture() has drained the pipeline
+ */
+void ScreenRecorder::dumpStats() {
+    std::ofstream file;
+    if(settings.statsfile && settings.statsfile[0]) {
+        file.open(settings.statsfile, std::ios::app);
+        if(!file)
+            srLog(SR_LOG_WARNING, "[StatsThread] cannot open %s, writing to the standard output", settings.statsfile);
+    }
+    std::ostream &out = file.is_open() ? (std::ostream &) file : cout;
+
+    bool ended = false;
+    while(!ended) {
+        {
+            std::unique_lock<SRMutex> r_lock(r_mutex);
+            ended = r_cv.wait_for(r_lock, std::chrono::milliseconds(settings._statsinterval),
+                                  [&](){return statsEnded;});
+        }
+        writeStatsJson(out);
+        out.flush();
+    }
+}
+
+/**
+ * exportMetrics() is the execution flow of the "MetricsThread": every settings._metricsinterval ms it samples
+ * getStats() and sends the rates of the interval to the StatsD server of settings.metricsurl, under
+ * settings.metricsprefix. The frame rates, the bitrate and the write throughput are gauges computed from the
+ * counter deltas, the encode percentiles cover the interval only, the drops are StatsD counters.
+ */
+void ScreenRecorder::exportMetrics() {
+    SRStatsd statsd;
+    if(statsd.open(settings.metricsurl, settings.metricsprefix) < 0) {
+        srLog(SR_LOG_WARNING, "[MetricsThread] cannot open %s, no metrics are sent", settings.metricsurl);
+        return;
+    }
+    SRHistogramMark encodeMark = {};
+    SRPipelineStats last = getStats();
+    stageTimes[SR_STAGE_ENCODE].interval(encodeMark);
+    int64_t lastTime = av_gettime_relative();
+
+    bool ended = false;
+    while(!ended) {
+        {
+            std::unique_lock<SRMutex> r_lock(r_mutex);
+            ended = r_cv.wait_for(r_lock, std::chrono::milliseconds(settings._metricsinterval),
+                                  [&](){return statsEnded;});
+        }
+        SRPipelineStats s = getStats();
+        SRLatencyStats encode = stageTimes[SR_STAGE_ENCODE].interval(encodeMark);
+        int64_t now = av_gettime_relative();
+        double seconds = FFMAX(now - lastTime, 1) / 1000000.0;
+        lastTime = now;
+
+        statsd.gauge("fps.in", (s.capturedFrames - last.capturedFrames) / seconds);
+        statsd.gauge("fps.out", (s.encodedFrames - last.encodedFrames) / seconds);
+        statsd.gauge("bitrate_kbps", (s.videoBytes - last.videoBytes) * 8 / seconds / 1000);
+        statsd.gauge("write_bytes_per_s", (s.writer.bytes - last.writer.bytes) / seconds);
+        statsd.gauge("encode_ms.p50", encode.p50 / 1000.0);
+        statsd.gauge("encode_ms.p99", encode.p99 / 1000.0);
+        statsd.gauge("av_drift_ms", s.audioDrift / 1000.0);
+        statsd.gauge("queue.raw", (double) s.rawQueued);
+        statsd.gauge("queue.scaled", (double) s.scaledQueued);
+        statsd.gauge("queue.mux", (double) s.muxQueued);
+        statsd.gauge("queue.mux_bytes", (double) s.muxQueuedBytes);
+        statsd.gauge("quality_step", s.qualityStep);
+        statsd.count("dropped.missed", (int64_t) (s.missedFrames - last.missedFrames));
+        statsd.count("dropped.policy", (int64_t) (s.policyDroppedFrames - last.policyDroppedFrames));
+        statsd.count("dropped.shed", (int64_t) (s.shedFrames - last.shedFrames));
+        statsd.count("dropped.abandoned", (int64_t) (s.abandonedFrames - last.abandonedFrames));
+        statsd.count("dropped.packets", (int64_t) (s.droppedPackets - last.droppedPackets));
+        statsd.count("dropped.samples", (int64_t) (s.droppedSamples - last.droppedSamples));
+        //the quality of the frames sampled within the interval
+        uint64_t samples = s.quality.samples - last.quality.samples;
+        if(samples) {
+            statsd.gauge("quality.ssim", (s.quality.ssimSum - last.quality.ssimSum) / samples);
+            statsd.gauge("quality.psnr_db", (s.quality.psnrSum - last.quality.psnrSum) / samples);
+        }
+        statsd.count("quality.skipped_gops", (int64_t) (s.quality.skippedGops - last.quality.skippedGops));
+        statsd.flush();
+        last = s;
+    }
+    if(statsd.errors())
+        srLog(SR_LOG_WARNING, "[MetricsThread] %llu metric datagrams could not be sent", (unsigned long long) statsd.errors());
+}
+
+/**
+ * watchdog() is the execution flow of the "WatchdogThread": a capture device that delivered nothing for
+ * settings._watchdogtimeout ms while capturing is flagged lost. The flag interrupts the demuxer read blocked on it,
+ * the capture thread of the device then recovers it with recoverVideoDevice() or recoverAudioDevice().
+ */
+void ScreenRecorder::watchdog() {
+    int64_t timeout = (int64_t) settings._watchdogtimeout * 1000;
+    bool ended = false;
+    while(!ended) {
+        {
+            std::unique_lock<SRMutex> r_lock(r_mutex);
+            ended = r_cv.wait_for(r_lock, std::chrono::milliseconds(FFMAX(settings._watchdogtimeout / 4, 1)),
+                                  [&](){return statsEnded;});
+        }
+        //a paused device delivers nothing on purpose, a resumed one gets the whole timeout from the resume
+        if(ended || !captureSwitch.load(std::memory_order_relaxed) || killSwitch.load(std::memory_order_relaxed))
+            continue;
+        int64_t now = av_gettime(), resumed = resumeWall.load(std::memory_order_relaxed);
+        if(settings._recvideo && !videoLost.load(std::memory_order_relaxed) &&
+           now - FFMAX(videoHeartbeat.load(std::memory_order_relaxed), resumed) > timeout) {
+            srLog(SR_LOG_WARNING, "[WatchdogThread] no video for %u ms, reopening the device", settings._watchdogtimeout);
+            videoLost.store(true, std::memory_order_relaxed);
+        }
+        for (auto &track : audioTracks) {
+            AudioTrack &a = *track;
+            if(!a.lost.load(std::memory_order_relaxed) &&
+               now - FFMAX(a.heartbeat.load(std::memory_order_relaxed), resumed) > timeout) {
+                srLog(SR_LOG_WARNING, "[WatchdogThread] no audio on track %d for %u ms, reopening the device",
+                      a.index, settings._watchdogtimeout);
+                a.lost.store(true, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+/**
+ * waitRetry() sleeps ms between two attempts to reopen a device
+ * @return false once endCapture() has been called
+ */
+bool ScreenRecorder::waitRetry(int64_t ms) {
+    std::unique_lock<SRMutex> r_lock(r_mutex);
+    return !r_cv.wait_for(r_lock, std::chrono::milliseconds(ms),
+                          [&](){return killSwitch.load(std::memory_order_acquire);});
+}
+
+/**
+ * recordGap() adds the interval a device of the output stream was lost in, from wall clock times
+ */
+void ScreenRecorder::recordGap(int stream, int64_t lostWall, int64_t backWall) {
+    SRCaptureGap gap = {stream, captureClock.elapsed(lostWall), backWall - lostWall};
+    std::lock_guard<std::mutex> g_lock(gapLock);
+    captureGaps.push_back(gap);
+}
+
+std::vector<SRCaptureGap> ScreenRecorder::getCaptureGaps() const {
+    std::lock_guard<std::mutex> g_lock(gapLock);
+    return captureGaps;
+}
+
+SRPipelinePath ScreenRecorder::getPipelinePath() const {
+    SRPipelinePath path = SRPipelinePath();
+    if (!outVCodec || videoCopy)
+        return path;
+    path.encoder = outVCodec->name;
+    //the GPU capture converts through its own graph or in the grabber, the GPU conversion after one upload
+    path.capture = settings._gpucapture ? SR_PATH_GPU : SR_PATH_CPU;
+    path.convert = settings._gpucapture || (filterGraph && hwDeviceContext) ? SR_PATH_GPU : SR_PATH_CPU;
+    path.encode = outVCodec->capabilities & AV_CODEC_CAP_HARDWARE ? SR_PATH_GPU : SR_PATH_CPU;
+    path.resident = path.capture == SR_PATH_GPU && path.convert == SR_PATH_GPU && path.encode == SR_PATH_GPU;
+    return path;
+}
+
+/**
+ * recoverVideoDevice() is called by the VideoThread once its device failed or was flagged lost: it reopens the device
+ * every WATCHDOG_RETRY ms, doubling up to WATCHDOG_RETRY_MAX, until it delivers again or the capture ends.\n
+ * The frames of the gap are missing from the stream: the player holds the last one until the pts after the gap,
+ * which starts on a keyframe.
+ * @return false if the capture ended first
+ */
+bool ScreenRecorder::recoverVideoDevice() {
+    //the reader ends with the capture too
+    if(killSwitch.load(std::memory_order_acquire))
+        return false;
+    int64_t lostAt = av_gettime();
+    srLog(SR_LOG_WARNING, "[VideoThread] video device lost, recovering");
+    report({SR_ERROR_VIDEO_DEVICE, AVERROR(EIO), true, "video device lost, recovering"});
+    //the lost flag is still set: it interrupts the read the reader is blocked in
+    if(videoReader)
+        videoReader->stop();
+    if(!videoGrabber)
+        avformat_close_input(&inVFormatContext);
+    videoLost.store(false, std::memory_order_relaxed);
+    int64_t delay = WATCHDOG_RETRY;
+    int attempts = 0;
+    while(waitRetry(delay)) {
+        attempts++;
+        //the watchdog must not interrupt an open that is slow on its own
+        videoHeartbeat.store(av_gettime(), std::memory_order_relaxed);
+        int ret = reopenVideoDevice();
+        if(ret >= 0) {
+            int64_t now = av_gettime();
+            recordGap(outVideoStreamIndex, lostAt, now);
+            keyframeRequested = true;
+            videoCopyStarted = false;
+            videoHeartbeat.store(now, std::memory_order_relaxed);
+            if(videoReader)
+                startVideoReader();
+            srLog(SR_LOG_INFO, "[VideoThread] video device back after %lld ms, %d attempts",
+                  (long long) (now - lostAt) / 1000, attempts);
+            return true;
+        }
+        srLog(SR_LOG_DEBUG, "[VideoThread] video device not back yet %d", ret);
+        delay = FFMIN(delay * 2, WATCHDOG_RETRY_MAX);
+    }
+    return false;
+}
+
+/**
+ * reopenVideoDevice() makes one attempt at getting the video device back with the format it was first opened with:
+ * a native back-end is probed with a grab, the demuxer is opened again from inVUrl and inVDeviceOptions.
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int ScreenRecorder::reopenVideoDevice() {
+    if(videoGrabber) {
+        AVFrame *frame = videoGrabber->allocatesFrames() ? grabPool.getEmpty() : grabPool.get();
+        if(!frame)
+            return AVERROR(ENOMEM);
+        int ret = videoGrabber->grab(frame);
+        grabPool.release(frame);
+        return ret < 0 ? ret : 0;
+    }
+    AVFormatContext *ctx = watchedContext(nullptr, &videoLost);
+    AVDictionary *options = nullptr;
+    av_dict_copy(&options, inVDeviceOptions, 0);
+    int ret = avformat_open_input(&ctx, inVUrl.c_str(), inVInputFormat, &options);
+    av_dict_free(&options);
+    if(ret < 0)
+        return ret;
+    ret = probeStreams(ctx, AVMEDIA_TYPE_VIDEO);
+    //the decoder, the scaler and the encoder were set up for the frames of the first open
+    if(ret >= 0 && (inVideoStreamIndex >= (int) ctx->nb_streams ||
+                    ctx->streams[inVideoStreamIndex]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO ||
+                    ctx->streams[inVideoStreamIndex]->codecpar->width != inVCodecContext->width ||
+                    ctx->streams[inVideoStreamIndex]->codecpar->height != inVCodecContext->height ||
+                    ctx->streams[inVideoStreamIndex]->codecpar->format != inVCodecContext->pix_fmt)) {
+        srLog(SR_LOG_WARNING, "[VideoThread] the video device came back with another format");
+        ret = AVERROR(EINVAL);
+    }
+    if(ret < 0) {
+        avformat_close_input(&ctx);
+        return ret;
+    }
+    inVFormatContext = ctx;
+    avcodec_flush_buffers(inVCodecContext);
+    return 0;
+}
+
+/**
+ * startVideoReader() starts reading the video demuxer in the reader thread, on the VideoThread
+ */
+void ScreenRecorder::startVideoReader() {
+    videoReader->start(inVFormatContext, inVideoStreamIndex, &videoHeartbeat, [this](){return waitRunning();},
+                       settings._realtime, settings._rtpriority, 0);
+}
+
+/**
+ * startAudioReader() starts reading the demuxer of a track in its reader thread, on the AudioThread:
+ * the non-blocking demuxers are polled twice a fragment
+ */
+void ScreenRecorder::startAudioReader(AudioTrack &a) {
+    a.reader->start(a.inAFormatContext, a.inAudioStreamIndex, &a.heartbeat, [this](){return waitRunning();},
+                    settings._realtime, settings._rtpriority, (int64_t) settings._audiofragment * 500);
+}
+
+/**
+ * recoverAudioDevice() is recoverVideoDevice() for the device of a track, called by its AudioThread.
+ * The samples of the gap are padded with silence by syncAudioClock(), the track stays in sync with the video.
+ * @return false if the capture ended first
+ */
+bool ScreenRecorder::recoverAudioDevice(AudioTrack &a) {
+    if(killSwitch.load(std::memory_order_acquire))
+        return false;
+    int64_t lostAt = av_gettime();
+    srLog(SR_LOG_WARNING, "[AudioThread] audio device of track %d lost, recovering", a.index);
+    report({SR_ERROR_AUDIO_DEVICE, AVERROR(EIO), true, "audio device of track " + to_string(a.index)
+                                                       + " lost, recovering"});
+    if(a.reader)
+        a.reader->stop();
+    if(!a.audioGrabber)
+        avformat_close_input(&a.inAFormatContext);
+    a.lost.store(false, std::memory_order_relaxed);
+    int64_t delay = WATCHDOG_RETRY;
+    int attempts = 0;
+    while(waitRetry(delay)) {
+        attempts++;
+        a.heartbeat.store(av_gettime(), std::memory_order_relaxed);
+        int ret = reopenAudioDevice(a);
+        if(ret >= 0) {
+            int64_t now = av_gettime();
+            recordGap(a.outAudioStreamIndex, lostAt, now);
+            a.recovered = true;
+            a.heartbeat.store(now, std::memory_order_relaxed);
+            if(a.reader)
+                startAudioReader(a);
+            srLog(SR_LOG_INFO, "[AudioThread] audio device of track %d back after %lld ms, %d attempts",
+                  a.index, (long long) (now - lostAt) / 1000, attempts);
+            return true;
+        }
+        srLog(SR_LOG_DEBUG, "[AudioThread] audio device of track %d not back yet %d", a.index, ret);
+        delay = FFMIN(delay * 2, WATCHDOG_RETRY_MAX);
+    }
+    return false;
+}
+
+/**
+ * reopenAudioDevice() makes one attempt at getting the device of a track back: a native back-end is probed
+ * with a read, the demuxer is opened again from a.deviceUrl and a.deviceOptions with the same sample format.
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int ScreenRecorder::reopenAudioDevice(AudioTrack &a) {
+    if(a.audioGrabber) {
+        AVPacket *packet = av_packet_alloc();
+        if(!packet)
+            return AVERROR(ENOMEM);
+        int ret = a.audioGrabber->read(packet);
+        av_packet_free(&packet);
+        //a device with nothing buffered yet answers EAGAIN
+        return ret < 0 && ret != AVERROR(EAGAIN) ? ret : 0;
+    }
+    AVFormatContext *ctx = watchedContext(nullptr, &a.lost);
+    AVDictionary *options = nullptr;
+    av_dict_copy(&options, a.deviceOptions, 0);
+    int ret = avformat_open_input(&ctx, a.deviceUrl.c_str(), a.inAInputFormat, &options);
+    av_dict_free(&options);
+    if(ret < 0)
+        return ret;
+    ret = probeStreams(ctx, AVMEDIA_TYPE_AUDIO);
+    //the resampler was set up for the samples of the first open
+    if(ret >= 0 && (a.inAudioStreamIndex >= (int) ctx->nb_streams ||
+                    ctx->streams[a.inAudioStreamIndex]->codecpar->codec_type != AVMEDIA_TYPE_AUDIO ||
+                    ctx->streams[a.inAudioStreamIndex]->codecpar->sample_rate != a.inACodecContext->sample_rate ||
+                    ctx->streams[a.inAudioStreamIndex]->codecpar->channels != a.inACodecContext->channels)) {
+        srLog(SR_LOG_WARNING, "[AudioThread] the audio device of track %d came back with another format", a.index);
+        ret = AVERROR(EINVAL);
+    }
+    if(ret < 0) {
+        avformat_close_input(&ctx);
+        return ret;
+    }
+    a.inAFormatContext = ctx;
+    avcodec_flush_buffers(a.inACodecContext);
+    return 0;
+}
+
+uint64_t ScreenRecorder::getMuxOverflows() const {
+    return muxOverflows;
+}
+
+/**
+ * convertWorkerCount() is the number of convert workers: settings._convertthreads,
+ * or a core out of four up to CONVERT_WORKERS.
+ * @Note the filter graphs are not thread-safe: a single worker drives them
+ */
+int ScreenRecorder::convertWorkerCount() const {
+    if (filterGraph || hasVideoFilters()) return 1;
+    if (settings._convertthreads > 0) return settings._convertthreads;
+    return FFMIN(FFMAX(cpuCount() / 4, 1), CONVERT_WORKERS);
+}
+
+/**
+ * scaleBandCount() is the number of bands a convert worker splits a frame in: settings._scalebands,
+ * or the cores left to each worker for output frames taller than 1080 lines (up to SCALE_BANDS)
+ */
+int ScreenRecorder::scaleBandCount() const {
+    if (settings._scalebands > 0) return settings._scalebands;
+    if (outVCodecContext->height <= 1080) return 1;
+    //on a pool the bands are tasks: they only use the workers the other convert workers leave idle
+    int cores = taskPool ? taskPool->size() : cpuCount();
+    return FFMIN(FFMAX(cores / convertWorkerCount(), 1), SCALE_BANDS);
+}
+
+/**
+ * nodeCores() are the cores of settings._numanode, empty without a node
+ */
+std::vector<int> ScreenRecorder::nodeCores() const {
+    return settings._numanode >= 0 ? numaNodeCores(settings._numanode) : std::vector<int>();
+}
+
+/**
+ * captureCores() are the cores of the grab, audio and convert threads: settings.capturecores,
+ * or with settings._pinthreads one core each from the first (of the node), when there are at least 4
+ */
+std::vector<int> ScreenRecorder::captureCores() const {
+    std::vector<int> cores = parseCores(settings.capturecores), node = nodeCores();
+    int available = node.empty() ? cpuCount() : (int) node.size();
+    if (!cores.empty() || !settings._pinthreads || available < 4)
+        return cores;
+    int threads = (settings._recvideo ? 1 : 0) + (settings._recaudio ? 1 : 0);
+    if (settings._recvideo && !taskPool && !settings._taskpool)
+        threads += convertWorkerCount();
+    for (int i = 0; i < FFMIN(threads, available - 1); i++)
+        cores.push_back(node.empty() ? i : node[i]);
+    return cores;
+}
+
+/**
+ * encoderCores() are the cores (of the node) left by captureCores(), empty (any core) when there is no restriction
+ */
+std::vector<int> ScreenRecorder::encoderCores() const {
+    std::vector<int> capture = captureCores(), node = nodeCores(), cores;
+    if (capture.empty())
+        return node;
+    for (int i = 0; i < cpuCount(); i++)
+        if (std::find(capture.begin(), capture.end(), i) == capture.end() &&
+            (node.empty() || std::find(node.begin(), node.end(), i) != node.end()))
+            cores.push_back(i);
+    return cores.empty() ? node : cores;
+}
+
+/**
+ * initTaskPool() creates the pool of settings._taskpool, sized to the cores left by the threads that keep their own:
+ * the grab and audio threads, and the encoder threads
+ */
+void ScreenRecorder::initTaskPool() {
+    if (taskPool || !settings._taskpool || !settings._recvideo)
+        return;
+    int reserved = 1 + (settings._recaudio ? 1 : 0) + FFMAX(outVCodecContext->thread_count, 1);
+    ownTaskPool.reset(new SRTaskPool(FFMAX(cpuCount() - reserved, 1)));
+    taskPool = ownTaskPool.get();
+    srLog(SR_LOG_INFO, "[MainThread] task pool of %d workers", taskPool->size());
+}
+
+/**
+ * swsScaleFlags() maps the scaling policy to the swscale flags
+ */
+static int swsScaleFlags(SRScaleQuality quality) {
+    switch (quality) {
+        case SR_SCALE_FAST_BILINEAR: return SWS_FAST_BILINEAR;
+        case SR_SCALE_BILINEAR: return SWS_BILINEAR;
+        case SR_SCALE_AREA: return SWS_AREA;
+        default: return SWS_BICUBIC;
+    }
+}
+
+/**
+ * initPools() sizes the frame and packet pools from the codec parameters,
+ * so that the capture loops do not allocate once they are running.
+ * Every queue between two stages can be full at the same time, the pools are sized accordingly.
+ */
+int ScreenRecorder::initPools() {
+    int frames = captureBuffer * 2 * convertWorkerCount() + 4;
+
+    //the frames are read on the node of the recording, wherever the thread that touches them first runs
+    grabPool.setNode(settings._numanode);
+    scaledPool.setNode(settings._numanode);
+    grabPool.setHugePages(settings._hugepages);
+    scaledPool.setHugePages(settings._hugepages);
+
+    packetPool.reserve(muxQueuePackets() * outAVFormatContext->nb_streams + 4);
+
+    if(settings._recvideo) {
+        //the encoder takes the captured frames as they are: nothing to convert
+        videoPassthrough = passthrough();
+
+        //device surfaces are allocated by the grabber, the pool only recycles the AVFrames;
+        //the grabbers with buffers of their own only need one frame for the warm-up conversion
+        int grabFrames = videoGrabber && videoGrabber->allocatesFrames() ? 1 : frames;
+        if(videoGrabber && !inVCodecContext->hw_frames_ctx && grabPool.initVideo(inVCodecContext->pix_fmt, inVCodecContext->width, inVCodecContext->height, grabFrames) < 0) {
+            return fail(SR_ERROR_MEMORY, 0, "Cannot allocate the capture frame pool");
+        }
+        //the video filters allocate the frames they give from a pool of their own
+        if(!videoCopy && !videoPassthrough && !filterGraph && scaledPool.initVideo(outVSwPixFmt, outVCodecContext->width, outVCodecContext->height, frames) < 0) {
+            return fail(SR_ERROR_MEMORY, 0, "Cannot allocate the converted frame pool");
+        }
+    }
+
+    for (auto &track : audioTracks) {
+        AVCodecContext *enc = track->outACodecContext;
+        if(enc->frame_size > 0 &&
+           track->audioPool.initAudio(enc->sample_fmt, enc->channels, enc->channel_layout, enc->sample_rate,
+                                      enc->frame_size, 4) < 0) {
+            return fail(SR_ERROR_MEMORY, 0, "Cannot allocate the audio frame pool");
+        }
+    }
+    return 0;
+}
+
+/**
+ * passthrough() tells whether the encoder takes the captured frames as they are
+ */
+bool ScreenRecorder::passthrough() const {
+    //the video filters give frames of their own
+    if (hasVideoFilters())
+        return false;
+    //the overlays and masks are drawn on the converted frames, the captured ones may belong to the grabber
+    return filterGraph || inVCodecContext->hw_frames_ctx ||
+           (!settings._overlay && !privacyMasking() && outVSwPixFmt == inVCodecContext->pix_fmt &&
+            outVCodecContext->width == inVCodecContext->width &&
+            outVCodecContext->height == inVCodecContext->height);
+}
+
+SRMemoryBudget ScreenRecorder::memoryBudget() const {
+    SRMemoryBudget b = {};
+    if (settings._recvideo) {
+        int frames = captureBuffer * 2 * convertWorkerCount() + 4;
+        int64_t captured = av_image_get_buffer_size(inVCodecContext->pix_fmt, inVCodecContext->width, inVCodecContext->height, 32);
+        int64_t converted = av_image_get_buffer_size(outVSwPixFmt, outVCodecContext->width, outVCodecContext->height, 32);
+        bool device = inVCodecContext->hw_frames_ctx != nullptr;
+        if (videoGrabber)
+            b.grabber = videoGrabber->reservedBytes();
+        if (videoGrabber && !device)
+            b.captureFrames = captured * (videoGrabber->allocatesFrames() ? 1 : frames);
+        if (!videoCopy && !passthrough())
+            b.convertedFrames = converted * frames;
+        if (!videoCopy && !outVCodecContext->hw_frames_ctx && !outVCodecContext->hw_device_ctx) {
+            int64_t lookahead = -1;
+            if (av_opt_get_int(outVCodecContext->priv_data, "rc-lookahead", 0, &lookahead) < 0 || lookahead < 0)
+                lookahead = outVCodecContext->gop_size == 1 ? 0 : ENCODER_LOOKAHEAD;
+            b.encoder = converted * (FFMAX(outVCodecContext->refs, 1) + outVCodecContext->max_b_frames +
+                                     FFMAX(outVCodecContext->thread_count, 1) + lookahead);
+        }
+    }
+    for (const auto &track : audioTracks) {
+        const AVCodecContext *enc = track->outACodecContext;
+        int frameSize = enc->frame_size > 0 ? enc->frame_size : 1024;
+        int64_t samples = av_rescale(settings._audiolatency, enc->sample_rate, 1000) + frameSize * 5;
+        b.audio += samples * enc->channels * av_get_bytes_per_sample(enc->sample_fmt);
+    }
+    //a live output holds references to the packets its queue is behind by, at the average packet size
+    int64_t averagePacket = settings._recvideo ? outVCodecContext->bit_rate / 8 / FFMAX(settings._fps, 1) : 0;
+    b.muxer = (int64_t) settings._muxmaxbytes + (int64_t) (liveOutputs.size() + (webrtcOutput ? 1 : 0)) * muxQueuePackets() * averagePacket;
+    if (fileWriter)
+        b.writer = SRAsyncWriter::reservedBytes(FFMAX(settings._iobuffer, 4096), FFMAX(settings._writerspill, 0));
+    if (uploader)
+        b.writer += uploader->reservedBytes();
+    if (settings._outputmode == SR_OUTPUT_REPLAY || settings._activitygate)
+        b.replay = settings._replaymaxbytes + ARENA_SLAB_SIZE;
+    if (settings._burst)
+        b.burst = settings._burstmaxbytes;
+    for (const auto &rendition : renditionOutputs)
+        b.renditions += rendition->reservedBytes();
+    if (videoWall)
+        b.renditions += videoWall->reservedBytes();
+    b.total = b.grabber + b.captureFrames + b.convertedFrames + b.encoder + b.audio + b.muxer + b.writer +
+              b.replay + b.burst + b.renditions;
+    return b;
+}
+
+/**
+ * enforceMemoryBudget() fits the recorder in settings._memorybudget, before any pool or queue is allocated.
+ * What only trades history or slack goes first: the replay buffer, the bytes the muxer may hold back,
+ * then the depth of the convert queues. If that is not enough the recording does not start, with the breakdown.
+ */
+int ScreenRecorder::enforceMemoryBudget() {
+    SRMemoryBudget b = memoryBudget();
+    const int64_t limit = settings._memorybudget;
+    //the burst lasts as long as its arena: what the budget leaves once the rest is reserved
+    if (settings._burst && settings._burstmaxbytes <= 0) {
+        settings._burstmaxbytes = limit > 0 ? FFMAX(limit - b.total, (int64_t) 0) : BURST_MAX_BYTES;
+        b = memoryBudget();
+    }
+    while (limit > 0 && b.total > limit) {
+        int64_t excess = b.total - limit;
+        if ((settings._outputmode == SR_OUTPUT_REPLAY || settings._activitygate) && settings._replaymaxbytes > REPLAY_MIN_BYTES)
+            settings._replaymaxbytes = FFMAX(settings._replaymaxbytes - excess, (int64_t) REPLAY_MIN_BYTES);
+        else if (settings._muxmaxbytes > MUX_MIN_BYTES)
+            settings._muxmaxbytes = (size_t) FFMAX((int64_t) settings._muxmaxbytes - excess, (int64_t) MUX_MIN_BYTES);
+        else if (captureBuffer > CAPTURE_BUFFER_MIN)
+            captureBuffer--;
+        else
+            break;
+        b = memoryBudget();
+    }
+
+    cout << "\nmemory: " << (b.total >> 20) << " MiB (grabber " << (b.grabber >> 20) << ", capture " << (b.captureFrames >> 20)
+         << ", converted " << (b.convertedFrames >> 20) << ", encoder " << (b.encoder >> 20) << ", audio " << (b.audio >> 20)
+         << ", muxer " << (b.muxer >> 20) << ", writer " << (b.writer >> 20) << ", replay " << (b.replay >> 20)
+         << ", burst " << (b.burst >> 20) << ", renditions " << (b.renditions >> 20) << ")";
+    if (limit > 0 && b.total > limit) {
+        return fail(SR_ERROR_MEMORY, AVERROR(ENOMEM), string("the recorder needs ") + to_string(b.total >> 20) +
+                                                      " MiB even with the smallest queues, over the budget of " +
+                                                      to_string(limit >> 20) +
+                                                      " MiB: lower the resolution, the convert threads or the renditions");
+    }
+    if (captureBuffer < CAPTURE_BUFFER || settings._muxmaxbytes < MUX_MAX_BYTES)
+        cout << "\nmemory: convert queues of " << captureBuffer << " frames, muxer holding at most "
+             << (settings._muxmaxbytes >> 20) << " MiB to fit the budget of " << (limit >> 20) << " MiB";
+    return 0;
+}
+
+/**
+ * initThreads() generate threads and initialize them by passing the right execution flow.\n
+ * Following threads are created:\n
+ * - AudioThread handles the real-time audio capturing and decoding \n
+ * - VideoThread handles the real-time video capturing and decoding \n
+ * - a reader thread per capture demuxer, with settings._threadqueuesize, drains the device for the Audio/VideoThread \n
+ * - ConvertThreads (convertWorkerCount()) scale and convert the decoded video frames,
+ *   or as many serial tasks of the SRTaskPool given to attachTaskPool() \n
+ * - ProducerThread handles encoding of the video stream. \n
+ * - MuxerThread is the only owner of the output context: it interleaves and writes the encoded packets. \n
+ * - a writer thread per live output (settings.streamurl), fed by the MuxerThread without blocking it \n
+ * - StatsThread, with settings._statsinterval, writes getStats() as JSON lines \n
+ * - MetricsThread, with settings.metricsurl, sends getStats() to StatsD \n
+ * - WatchdogThread, with settings._watchdogtimeout, flags the capture devices that stopped delivering \n
+ *
+ * Video frames are dispatched round-robin to the convert workers, each one owning an input
+ * and an output SRRingBuffer of captureBuffer frames, so the ProducerThread gets them back in capture order.\n
+ * initThreads() is the prepare phase: it returns once every thread has allocated its packets and contexts
+ * and warmed its buffers, so startCapture() only flips the run state.
+ */
+int ScreenRecorder::initThreads() {
+    setLogLevel(settings._loglevel);
+
+    muxLastDts.reset(new std::atomic<int64_t>[outAVFormatContext->nb_streams]);
+    for (unsigned int i = 0; i < outAVFormatContext->nb_streams; i++) {
+        muxQueues.emplace_back(new SRRingBuffer<AVPacket *>(muxQueuePackets(), pipelineWait()));
+        muxLastDts[i] = AV_NOPTS_VALUE;
+    }
+    //after avformat_write_header(): the muxer has chosen the time base of each stream
+    timelines.reset(new SRStreamTimeline[outAVFormatContext->nb_streams]);
+    if(outVideoStreamIndex >= 0)
+        timelines[outVideoStreamIndex].configure(outVCodecContext->time_base,
+                                                 outAVFormatContext->streams[outVideoStreamIndex]->time_base);
+    for (auto &track : audioTracks)
+        if(track->outAudioStreamIndex >= 0)
+            timelines[track->outAudioStreamIndex].configure(track->outACodecContext->time_base,
+                                                            outAVFormatContext->streams[track->outAudioStreamIndex]->time_base);
+    int ret;
+    if((ret = initPools()) < 0)
+        return ret;
+    if(settings._recaudio && (ret = init_fifo()) < 0)
+        return fail(SR_ERROR_MEMORY, ret, "Cannot allocate the audio FIFO");
+    captureClock.configure(settings._fps, 0, 0);
+    for (auto &track : audioTracks)
+        captureClock.configure(0, track->inACodecContext->sample_rate, track->inACodecContext->frame_size, track->index);
+
+    if(settings.tracefile && settings.tracefile[0])
+        tracer.reset(new SRTracer((int64_t) settings._traceduration * 1000000));
+    initTaskPool();
+    if(settings._recvideo) {
+        convertWorkers = convertWorkerCount();
+        scaleFlags = swsScaleFlags(settings._scalequality);
+        scaleBands = scaleBandCount();
+        bool pooled = taskPool && !filterGraph;
+        //a copied stream goes from the VideoThread to the muxer: no convert worker, no ProducerThread
+        if(videoCopy)
+            convertWorkers = 0;
+        threadsPending += videoCopy ? 1 : (pooled ? 0 : convertWorkers) + 2;
+        for (int i = 0; i < convertWorkers; i++) {
+            rawVideoQueues.emplace_back(new SRRingBuffer<AVFrame *>(captureBuffer, pipelineWait()));
+            scaledVideoQueues.emplace_back(new SRRingBuffer<AVFrame *>(captureBuffer, pipelineWait()));
+        }
+        for (int i = 0; i < convertWorkers; i++) {
+            if(!pooled) {
+                convertThreads.emplace_back([this, i](){srProfileStage(SR_STAGE_SCALE); convertVideo(i);});
+                continue;
+            }
+            //the worker is a serial task of the shared pool, its scaler is warmed up here
+            convertScalers.emplace_back(new SRScaler());
+            convertScalers[i]->setTaskPool(taskPool);
+            initConverter(i, *convertScalers[i]);
+            convertTasks.emplace_back(new SRSerialTask(*taskPool, [this, i](){srProfileStage(SR_STAGE_SCALE); return convertStep(i);}));
+        }
+        if(!videoCopy)
+            producerThread = thread([&](){srProfileStage(SR_STAGE_ENCODE); produce();});
+        if(!videoGrabber && settings._threadqueuesize > 0)
+            videoReader.reset(new SRDemuxReader(settings._threadqueuesize));
+        videoThread = thread([&](){srProfileStage(SR_STAGE_GRAB); captureVideo();});
+    }
+    if(settings._recaudio) {
+        //each track has its own thread and encoder: a slow device or encoder only stalls its own track
+        for (auto &track : audioTracks) {
+            AudioTrack *a = track.get();
+            if(!a->audioGrabber && settings._threadqueuesize > 0)
+                a->reader.reset(new SRDemuxReader(settings._threadqueuesize));
+            threadsPending++;
+            a->audioThread = thread([this, a](){captureAudio(*a);});
+        }
+    }
+    muxerThread = thread([&](){srProfileStage(SR_STAGE_MUX); mux();});
+    if(settings._statsinterval > 0)
+        statsThread = thread([&](){dumpStats();});
+    if(settings.metricsurl && settings.metricsurl[0])
+        metricsThread = thread([&](){exportMetrics();});
+    if(settings._watchdogtimeout > 0 && (settings._recvideo || settings._recaudio))
+        watchdogThread = thread([&](){watchdog();});
+    for (auto &live : liveOutputs)
+        live->start();
+    if(webrtcOutput)
+        webrtcOutput->start();
+    //on a pool the renditions are background tasks: a late rendition drops frames, a late conversion drops captures
+    for (auto &rendition : renditionOutputs)
+        rendition->start(taskPool);
+    if(videoWall)
+        videoWall->start(taskPool);
+    if(snapshots)
+        snapshots->start();
+
+    /* the capture threads must not be preempted by the encoder threads,
+     * the convert workers follow them; the encoder keeps to the other cores, the muxer is left to the scheduler */
+    std::vector<int> cores = captureCores(), node = nodeCores(), encoder = encoderCores();
+    if(!cores.empty()) {
+        size_t core = 0;
+        if(settings._recvideo) pinThread(videoThread, cores[core++ % cores.size()]);
+        for (auto &track : audioTracks)
+            pinThread(track->audioThread, cores[core++ % cores.size()]);
+        for (auto &t : convertThreads)
+            pinThread(t, cores[core++ % cores.size()]);
+    } else if(!node.empty()) {
+        if(settings._recvideo) pinThread(videoThread, node);
+        for (auto &track : audioTracks)
+            pinThread(track->audioThread, node);
+        for (auto &t : convertThreads)
+            pinThread(t, node);
+    }
+    if(settings._recvideo && !videoCopy && !encoder.empty())
+        pinThread(producerThread, encoder);
+    if(!node.empty())
+        pinThread(muxerThread, node);
+
+    //readiness barrier: startCapture() finds every stage set up and blocked on its first wait
+    int64_t prepareStart = av_gettime_relative();
+    {
+        std::unique_lock<SRMutex> r_lock(r_mutex);
+        r_cv.wait(r_lock, [&](){return threadsPending == 0;});
+    }
+    srLog(SR_LOG_INFO, "[MainThread] pipeline ready in %lld ms", (long long) (av_gettime_relative() - prepareStart) / 1000);
+    if(settings.controlurl && settings.controlurl[0])
+        openSyncControl();
+    return 0;
+}
+
+/**
+ * openSyncControl() hands the recorder, prepared by initThreads(), to the controller of settings.controlurl:
+ * its START is the origin of the capture clock, written with the clock state to settings.filename + SYNC_SUFFIX
+ */
+void ScreenRecorder::openSyncControl() {
+    SRSyncHandlers handlers;
+    handlers.arm = [this]() {
+        return killSwitch.load(std::memory_order_acquire) ? AVERROR(EINVAL) : 0;
+    };
+    handlers.start = [this](int64_t at) {
+        syncStart = at;
+        startCaptureAt(at);
+        //now, so that a recording that never ends cleanly can still be aligned
+        writeSyncFile();
+    };
+    handlers.stop = [this](int64_t at) {
+        syncStop = at;
+        endCapture();
+    };
+    handlers.status = [this]() {
+        SRClockState clock = srClockState();
+        return std::string(killSwitch.load(std::memory_order_acquire) ? "STOPPED" :
+                           captureSwitch.load(std::memory_order_acquire) ? "RECORDING" : "ARMED") +
+               " origin=" + std::to_string(syncStart.load()) + " frames=" + std::to_string(encodedFrames.load()) +
+               " synced=" + (clock.known ? clock.synced ? "yes" : "no" : "unknown") +
+               " maxerror=" + std::to_string(clock.maxError);
+    };
+    syncControl.reset(new SRSyncControl());
+    int ret = syncControl->open(settings.controlurl, std::move(handlers));
+    if(ret < 0) {
+        syncControl.reset();
+        cout << "\nsync control: cannot listen on " << settings.controlurl << ": " << ret;
+        return;
+    }
+    cout << "\nsync control: waiting for a controller on " << settings.controlurl;
+}
+
+/**
+ * writeSyncFile() writes where the timeline of the recording is on the wall clock: origin is the time, in us since
+ * the epoch, of 0 on the capture clock, start the capture clock time of the first frame of each output stream,
+ * so the recordings of many machines line up from their timestamps alone, with no decoding.
+ * The start times are those the encoder threads published so far, see SRStreamTimeline::startTime()
+ */
+void ScreenRecorder::writeSyncFile() {
+    std::lock_guard<std::mutex> guard(syncLock);
+    int64_t start = syncStart.load(std::memory_order_acquire), stop = syncStop.load(std::memory_order_acquire);
+    if(!settings.filename || !start)
+        return;
+    std::string name;
+    for (const char *c = settings.filename; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            name += '\\';
+        name += *c;
+    }
+    SRClockState clock = srClockState();
+    std::ofstream out(std::string(settings.filename) + SYNC_SUFFIX, std::ios::trunc);
+    out << "{\"file\":\"" << name << "\",\"origin\":" << start << ",\"stop\":" << stop
+        << ",\"clock\":{\"known\":" << (clock.known ? "true" : "false") << ",\"synced\":"
+        << (clock.synced ? "true" : "false") << ",\"maxError\":" << clock.maxError << ",\"estError\":"
+        << clock.estError << "},\"streams\":[";
+    unsigned int streams = timelines && outAVFormatContext ? outAVFormatContext->nb_streams : 0;
+    for (unsigned int i = 0; i < streams; i++) {
+        int64_t first = timelines[i].startTime();
+        out << (i ? "," : "") << "{\"index\":" << i << ",\"start\":";
+        if (first == AV_NOPTS_VALUE)
+            out << "null}";
+        else
+            out << first << "}";
+    }
+    out << "]}\n";
+    if(!out)
+        srLog(SR_LOG_WARNING, "[MainThread] cannot write %s%s", settings.filename, SYNC_SUFFIX);
+}
+
+/**
+ * threadReady() is called by each capture, convert and encode thread once its buffers and contexts are set up
+ */
+void ScreenRecorder::threadReady() {
+    {
+        std::lock_guard<SRMutex> r_lock(r_mutex);
+        threadsPending--;
+    }
+    r_cv.notify_all();
+}
+
+/**
+ * wrapRawVideo() makes frame a reference to the picture of a rawvideo packet: the decoder would only copy it
+ * @return 0 on success, a negative AVERROR code when the packet needs the decoder (not refcounted, padded lines, palette)
+ */
+static int wrapRawVideo(AVFrame *frame, const AVPacket *pkt, const AVCodecContext *ctx) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(ctx->pix_fmt);
+    if (ctx->codec_id != AV_CODEC_ID_RAWVIDEO || !pkt->buf || !desc ||
+        desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL) ||
+        pkt->size != av_image_get_buffer_size(ctx->pix_fmt, ctx->width, ctx->height, 1))
+        return AVERROR(EINVAL);
+
+    int ret = av_image_fill_arrays(frame->data, frame->linesize, pkt->data, ctx->pix_fmt, ctx->width, ctx->height, 1);
+    if (ret < 0)
+        return ret;
+    frame->buf[0] = av_buffer_ref(pkt->buf);
+    if (!frame->buf[0])
+        return AVERROR(ENOMEM);
+    frame->format = ctx->pix_fmt;
+    frame->width = ctx->width;
+    frame->height = ctx->height;
+    frame->pts = frame->best_effort_timestamp = pkt->pts;
+    frame->pkt_dts = pkt->dts;
+    frame->key_frame = 1;
+    frame->pict_type = AV_PICTURE_TYPE_I;
+    return 0;
+}
+
+/**
+ * rawSampleFormat() is the sample format the packets of an interleaved PCM codec already are in,
+ * AV_SAMPLE_FMT_NONE when the decoder has to convert them
+ */
+static enum AVSampleFormat rawSampleFormat(enum AVCodecID codec) {
+#if AV_HAVE_BIGENDIAN
+    (void) codec;
+    return AV_SAMPLE_FMT_NONE;
+#else
+    switch (codec) {
+        case AV_CODEC_ID_PCM_U8: return AV_SAMPLE_FMT_U8;
+        case AV_CODEC_ID_PCM_S16LE: return AV_SAMPLE_FMT_S16;
+        case AV_CODEC_ID_PCM_S32LE: return AV_SAMPLE_FMT_S32;
+        case AV_CODEC_ID_PCM_F32LE: return AV_SAMPLE_FMT_FLT;
+        case AV_CODEC_ID_PCM_F64LE: return AV_SAMPLE_FMT_DBL;
+        default: return AV_SAMPLE_FMT_NONE;
+    }
+#endif
+}
+
+/**
+ * wrapRawAudio() makes frame a reference to the samples of an interleaved PCM packet: the decoder would only copy them
+ * @return 0 on success, a negative AVERROR code when the packet needs the decoder
+ */
+static int wrapRawAudio(AVFrame *frame, const AVPacket *pkt, const AVCodecContext *ctx) {
+    enum AVSampleFormat format = rawSampleFormat(ctx->codec_id);
+    int blockAlign = format == AV_SAMPLE_FMT_NONE ? 0 : av_get_bytes_per_sample(format) * ctx->channels;
+    if (format != ctx->sample_fmt || !pkt->buf || blockAlign <= 0 || pkt->size <= 0 || pkt->size % blockAlign)
+        return AVERROR(EINVAL);
+
+    av_frame_unref(frame);
+    frame->buf[0] = av_buffer_ref(pkt->buf);
+    if (!frame->buf[0])
+        return AVERROR(ENOMEM);
+    frame->data[0] = pkt->data;
+    frame->extended_data = frame->data;
+    frame->linesize[0] = pkt->size;
+    frame->nb_samples = pkt->size / blockAlign;
+    frame->format = format;
+    frame->channels = ctx->channels;
+    frame->channel_layout = ctx->channel_layout ? ctx->channel_layout : av_get_default_channel_layout(ctx->channels);
+    frame->sample_rate = ctx->sample_rate;
+    frame->pts = frame->best_effort_timestamp = pkt->pts;
+    frame->pkt_dts = pkt->dts;
+    return 0;
+}
+
+/**
+ * captureVideo() is the "VideoThread" execution flow.
+ * This execution flow get packets from video input device
+ * and decode them by sending them to the decoder, rawvideo packets are wrapped as they are.
+ * Decoded frames are handed to the convert workers without waiting for encoding.
+ *
+ * @Note captureVideo() is a thread-safe execution flow, has to be passed to a specific thread to ensure the correct execution
+ */
+
+/**
+ * closeVideoQueues() is the end of the VideoThread, on every path out of it: the convert workers drain what has
+ * already been captured and stop; with no ProducerThread behind a copied stream the video of the muxer ends here
+ */
+void ScreenRecorder::closeVideoQueues() {
+    if(videoCopy)
+        muxQueues[outVideoStreamIndex]->close();
+    for (auto &queue : rawVideoQueues)
+        queue->close();
+    for (auto &task : convertTasks)
+        task->schedule();
+}
+
+void ScreenRecorder::captureVideo(){
+    int ret;
+    AVFrame *rawFrame;
+    //native grabs are stamped with their deadline: wall clock base, like av_gettime()
+    const int64_t wallOffset = av_gettime() - SRFrameClock::now();
+
+    //one packet for the whole capture, unreferenced after each read
+    SRPacketPtr packet(av_packet_alloc());
+    AVPacket *inPacket = packet.get();
+    if(!inPacket) {
+        failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVPacket for encoded video");
+        closeVideoQueues();
+        threadReady();
+        return;
+    }
+
+    if(!realtimeThread(settings._realtime, settings._rtpriority))
+        srLog(SR_LOG_WARNING, "[VideoThread] cannot switch to real-time scheduling, running at normal priority");
+    if(settings._realtime == SR_REALTIME_OFF)
+        efficientPipelineThread("VideoThread");
+
+    //warm-up grab: the first real one must not pay for the shared memory and page faults
+    if(videoGrabber) {
+        rawFrame = videoGrabber->allocatesFrames() ? grabPool.getEmpty() : grabPool.get();
+        if(!rawFrame || videoGrabber->grab(rawFrame) < 0) {
+            grabPool.release(rawFrame);
+            failCapture(SR_ERROR_VIDEO_DEVICE, 0, "Cannot grab from %s", videoGrabber->name());
+            closeVideoQueues();
+            threadReady();
+            return;
+        }
+        grabPool.release(rawFrame);
+    }
+    //a grab right after the vblank copies the frame the compositor just finished, never half of one
+    std::unique_ptr<SRVblank> vblank;
+    if(videoGrabber && settings._vblank) {
+        vblank.reset(new SRVblank());
+        if((ret = vblank->open(settings.vblankdevice)) < 0) {
+            srLog(SR_LOG_WARNING, "[VideoThread] no vblank from the display %d, pacing on the frame clock", ret);
+            vblank.reset();
+        }
+    }
+
+    //the screen of a remote tile client is not the one of this desktop
+    std::unique_ptr<SRIdleMonitor> idleMonitor;
+    if(settings._idlerate && !(settings.tilesource && *settings.tilesource)) {
+        idleMonitor.reset(new SRIdleMonitor());
+        if((ret = idleMonitor->open(*settings.videourl ? settings.videourl : VIDEO_URL)) < 0) {
+            srLog(SR_LOG_WARNING, "[VideoThread] no idle time from the desktop %d, capturing at the full rate", ret);
+            idleMonitor.reset();
+        }
+    }
+
+    srLog(SR_LOG_INFO, "[VideoThread] thread started!");
+    if(tracer)
+        tracer->nameThread("VideoThread");
+    threadReady();
+    const int64_t nominal = 1000000 / settings._fps;
+    if(videoReader)
+        startVideoReader();
+    int64_t unset = 0;
+    captureInterval.compare_exchange_strong(unset, nominal);
+    int64_t interval = captureInterval;
+    if(vblank) {
+        interval = vblank->setRate(1000000.0 / interval);
+        captureInterval = interval;
+        srLog(SR_LOG_INFO, "[VideoThread] %.2f Hz display, capturing every %d vblanks at %.2f fps",
+              1000000.0 / vblank->refreshPeriod(), vblank->refreshDivisor(), 1000000.0 / interval);
+    }
+    //settings._power: the caps of the battery and the heat apply on top of setFrameRate()
+    int64_t requested = interval, powerInterval = 0, nextPowerPoll = 0;
+    int64_t seenResume = -1, lastWall = AV_NOPTS_VALUE, lastKept = AV_NOPTS_VALUE;
+    bool catchUp = false;
+    while(true) {
+
+        /*checks if capture is enabled or stopped*/
+        if(!waitRunning()) {
+            srLog(SR_LOG_INFO, "[VideoThread] thread stopped!");
+            if(videoReader)
+                videoReader->stop();
+            //the last change held back by the minimum interval is the final content
+            if(vfrPending) {
+                queueVideoFrame(vfrPending);
+                vfrPending = nullptr;
+            }
+            grabPool.release(vfrLast);
+            vfrLast = nullptr;
+            closeVideoQueues();
+            return;
+        }
+        //the first deadline is one interval after startCapture(), not after initThreads() or pauseCapture()
+        if(seenResume != captureClock.resumes()) {
+            seenResume = captureClock.resumes();
+            videoClock.start(interval);
+            catchUp = true;
+            //a copied stream starts over at a keyframe of after the pause, see copyVideoPacket()
+            videoCopyStarted = false;
+        }
+        if(settings._power != SR_POWER_OFF && SRFrameClock::now() >= nextPowerPoll) {
+            nextPowerPoll = SRFrameClock::now() + (int64_t) POWER_POLL * 1000000;
+            SRPowerStatus power = SRPowerMonitor::query();
+            int cap = SRPowerMonitor::fpsCap(power);
+            int64_t capped = cap ? FFMAX(1000000 / cap, nominal) : 0;
+            if(capped != powerInterval) {
+                powerInterval = capped;
+                if(cap)
+                    srLog(SR_LOG_INFO, "[VideoThread] %s: %d fps at most", power.hot ? "hot" : "on battery", cap);
+                else
+                    srLog(SR_LOG_INFO, "[VideoThread] on mains and cool: no power cap on the frame rate");
+            }
+        }
+        //setFrameRate() or a power cap: the next deadline is one new interval away
+        int64_t wanted = FFMAX(captureInterval.load(std::memory_order_relaxed), powerInterval);
+        if(wanted != requested) {
+            requested = wanted;
+            interval = vblank ? vblank->setRate(1000000.0 / wanted) : wanted;
+            videoClock.start(interval);
+            srLog(SR_LOG_INFO, "[VideoThread] capturing at %.2f fps", 1000000.0 / interval);
+        }
+        if(settings._vfr)
+            vfrTick();
+
+        if(videoGrabber) {
+            //native back-ends are paced here, unchanged frames are never dispatched
+            int64_t deadline = vblank ? vblank->wait() : 0;
+            if(vblank && deadline >= 0) {
+                videoClock.observe(deadline);
+            } else {
+                if(vblank) {
+                    srLog(SR_LOG_WARNING, "[VideoThread] the vblank stopped %lld, pacing on the frame clock", (long long) deadline);
+                    vblank.reset();
+                    videoClock.start(interval);
+                }
+                deadline = videoClock.wait();
+            }
+            if(idleMonitor && !idleMonitor->due(deadline, interval)) {
+                idleFrames++;
+                continue;
+            }
+            if(shedFrame())
+                continue;
 
-        if (!video_st) {
-            cout << "\nCannot create video stream";
-            exit(1);
-        }
-        outVCodec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
-        if (!outVCodec) {
-            cout << "\nCannot find requested encoder";
-            exit(1);
-        }
-        outVCodecContext = avcodec_alloc_context3(outVCodec);
-        if (!outVCodecContext) {
-            cout << "\nCannot create related VideoCodecContext";
-            exit(1);
-        }
-
-        /* set properties for the video stream encoding */
-        outVCodecContext->codec_id = AV_CODEC_ID_MPEG4;// AV_CODEC_ID_MPEG4; // AV_CODEC_ID_H264 // AV_CODEC_ID_MPEG1VIDEO
-        outVCodecContext->codec_type = AVMEDIA_TYPE_VIDEO;
-        outVCodecContext->pix_fmt = AV_PIX_FMT_YUV420P;
-        outVCodecContext->bit_rate = 400000; // 2500000
-        outVCodecContext->width = settings._outscreenres.width;
-        outVCodecContext->height = settings._outscreenres.height;
-        outVCodecContext->gop_size = 3;
-        outVCodecContext->max_b_frames = 2;
-        outVCodecContext->time_base.num = 1;
-        outVCodecContext->time_base.den = settings._fps; // 15fps
-        outVCodecContext->compression_level = 1;
-        /* reduce preset to slow if H264 to avoid resources leak */
-        if(outVCodecContext->codec_id == AV_CODEC_ID_H264)
-            av_opt_set(outVCodecContext->priv_data, "preset", "slow", 0);
-
-        /*setting global headers because some formats require them*/
-        if (outAVFormatContext->oformat->flags & AVFMT_GLOBALHEADER) {
-            outVCodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-        }
-
-        if (avcodec_open2(outVCodecContext, outVCodec, nullptr)< 0) {
-            cout << "\nerror in opening the avcodec";
-            exit(1);
+            rawFrame = videoGrabber->allocatesFrames() ? grabPool.getEmpty() : grabPool.get();
+            if(!rawFrame) {
+                failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVFrame for decoded video");
+                continue;
+            }
+            grabSpan[0] = SRFrameClock::now();
+            ret = videoGrabber->grab(rawFrame);
+            grabSpan[1] = SRFrameClock::now();
+            decodeSpan[0] = 0;
+            stageTimes[SR_STAGE_GRAB].record(grabSpan[1] - grabSpan[0]);
+            if(ret < 0 && (settings._watchdogtimeout || !settings._exitonerror)) {
+                grabPool.release(rawFrame);
+                recoverVideoDevice();
+                continue;
+            }
+            if(ret < 0) {
+                grabPool.release(rawFrame);
+                failCapture(SR_ERROR_VIDEO_DEVICE, ret, "Cannot grab from %s", videoGrabber->name());
+                continue;
+            }
+            //a grab cannot be interrupted: a back-end flagged while it was slow just answered
+            videoHeartbeat.store(av_gettime(), std::memory_order_relaxed);
+            videoLost.store(false, std::memory_order_relaxed);
+            if(ret == SR_GRAB_UNCHANGED) {
+                grabPool.release(rawFrame);
+            } else {
+                rawFrame->pts = deadline + wallOffset;
+                dispatchVideoFrame(rawFrame);
+            }
+            continue;
         }
 
-        //find a free stream index
-        outVideoStreamIndex = -1;
-        for(i=0; i < outAVFormatContext->nb_streams; i++)
-            if(outAVFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_UNKNOWN)
-                outVideoStreamIndex = i;
+        int64_t readStart = SRFrameClock::now(), arrival;
+        if(videoReader) {
+            ret = videoReader->read(inPacket, nominal, &readStart, &arrival);
+        } else {
+            ret = av_read_frame(inVFormatContext, inPacket);
+            arrival = SRFrameClock::now();
+        }
+        //a device that failed, or that the watchdog found silent, is opened again while the audio goes on
+        if((settings._watchdogtimeout || !settings._exitonerror) &&
+           ((ret < 0 && ret != AVERROR(EAGAIN)) || videoLost.load(std::memory_order_relaxed))) {
+            av_packet_unref(inPacket);
+            recoverVideoDevice();
+            continue;
+        }
+        if(ret >= 0 && !videoReader)
+            videoHeartbeat.store(av_gettime(), std::memory_order_relaxed);
+        if(ret >= 0 && inPacket->stream_index == inVideoStreamIndex) {
+            //decode video routine
+            //the demuxer paces itself: only its jitter is measured, at the read
+            videoClock.observe(arrival);
+            stageTimes[SR_STAGE_GRAB].record(arrival - readStart);
+            grabSpan[0] = readStart;
+            grabSpan[1] = arrival;
+
+            //a copied stream with references loses none of its packets: the pacing below only drops intra-only ones
+            if(videoCopy && !videoCopyIntra) {
+                copyVideoPacket(inPacket);
+                av_packet_unref(inPacket);
+                continue;
+            }
 
-            if(outVideoStreamIndex < 0) {
-                cout << "\nCannot find a free stream for video on the output";
-                exit(1);
+            /* after a pause the device delivers what it buffered and the frames its own clock thinks it missed:
+             * they are dropped before decoding, until the frames are an interval apart again */
+            if(catchUp && inPacket->pts != AV_NOPTS_VALUE) {
+                int64_t wall = av_rescale_q(inPacket->pts, inVFormatContext->streams[inVideoStreamIndex]->time_base, AV_TIME_BASE_Q);
+                if(wall < resumeWall.load(std::memory_order_relaxed) ||
+                   (lastWall != AV_NOPTS_VALUE && wall - lastWall < interval / 2)) {
+                    staleDeviceFrames++;
+                    av_packet_unref(inPacket);
+                    continue;
+                }
+                catchUp = lastWall == AV_NOPTS_VALUE || wall - lastWall > interval * 2;
+                lastWall = wall;
+            } else if(inPacket->pts != AV_NOPTS_VALUE) {
+                lastWall = av_rescale_q(inPacket->pts, inVFormatContext->streams[inVideoStreamIndex]->time_base, AV_TIME_BASE_Q);
+            }
+            //the device keeps the rate it was opened with: below it, the frames within an interval are left out
+            if(interval > nominal && lastWall != AV_NOPTS_VALUE) {
+                if(lastKept != AV_NOPTS_VALUE && lastWall - lastKept < interval - nominal / 2) {
+                    decimatedFrames++;
+                    av_packet_unref(inPacket);
+                    continue;
+                }
+                lastKept = lastWall;
+            }
+            //the device keeps its rate while idle too: the frames between two idle ones are left out alike
+            if(idleMonitor && !idleMonitor->due(arrival, interval)) {
+                idleFrames++;
+                av_packet_unref(inPacket);
+                continue;
+            }
+            
+            //the devices deliver intra-only packets: a shed one is never decoded
+            if(shedFrame()) {
+                av_packet_unref(inPacket);
+                continue;
             }
 
-        avcodec_parameters_from_context(outAVFormatContext->streams[outVideoStreamIndex]->codecpar, outVCodecContext);
-		cout<<"[generateVideoOutputStream] exiting\n";
+            if(videoCopy) {
+                copyVideoPacket(inPacket);
+                av_packet_unref(inPacket);
+                continue;
+            }
+
+            //frames keep the device timestamps of the stream, dispatchVideoFrame() maps them on the capture clock
+            int64_t decodeStart = SRFrameClock::now();
+            rawFrame = grabPool.getEmpty();
+            if(!rawFrame) {
+                failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVFrame for decoded video");
+                av_packet_unref(inPacket);
+                continue;
+            }
+            if(wrapRawVideo(rawFrame, inPacket, inVCodecContext) >= 0) {
+                decodeSpan[0] = decodeStart;
+                decodeSpan[1] = SRFrameClock::now();
+                stageTimes[SR_STAGE_DECODE].record(decodeSpan[1] - decodeStart);
+                dispatchVideoFrame(rawFrame);
+                av_packet_unref(inPacket);
+                continue;
+            }
+            grabPool.release(rawFrame);
+            if((ret = avcodec_send_packet(inVCodecContext, inPacket)) < 0){
+                srLog(SR_LOG_WARNING, "Cannot decode current video packet %d", ret);
+                av_packet_unref(inPacket);
+                continue;
+            }
+            while (ret >= 0) {
+                rawFrame = grabPool.getEmpty();
+                if(!rawFrame) {
+                    failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVFrame for decoded video");
+                    break;
+                }
+                ret = avcodec_receive_frame(inVCodecContext, rawFrame);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                    grabPool.release(rawFrame);
+                    break;
+                }
+                else if (ret < 0) {
+                    //a corrupt packet of a failing device: the decoder starts over on the next one
+                    srLog(SR_LOG_WARNING, "[VideoThread] error during decoding %d, frame dropped", ret);
+                    grabPool.release(rawFrame);
+                    avcodec_flush_buffers(inVCodecContext);
+                    break;
+                }
+                //raw frame ready, the time blocked on a full queue is not decoding time
+                decodeSpan[0] = decodeStart;
+                decodeSpan[1] = SRFrameClock::now();
+                stageTimes[SR_STAGE_DECODE].record(decodeSpan[1] - decodeStart);
+                dispatchVideoFrame(rawFrame);
+                decodeStart = SRFrameClock::now();
+            }
+        }
+        av_packet_unref(inPacket);
+
+    }
 
 }
-void ScreenRecorder::generateAudioOutputStream(){
-    outACodecContext = nullptr;
-    outACodec = nullptr;
-    int i;
 
-	cout<<"[generateAudioOutputStream] entering\n";
+/**
+ * copyVideoPacket() hands a packet of the video device to the MuxerThread as it is, with settings._streamcopy:
+ * its dts goes on the capture clock like the pts of a captured frame, its pts keeps its distance to the dts.
+ * A stream with references starts at its first keyframe, after the open, after each recovery and after each
+ * pause: the packets the device still held from before startCapture() are dropped up to a keyframe captured since.
+ * @Note VideoThread only
+ */
+void ScreenRecorder::copyVideoPacket(AVPacket *pkt) {
+    //the timeline runs in the time base of the device, outVCodecContext has it
+    AVRational sourceTb = inVFormatContext->streams[inVideoStreamIndex]->time_base;
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    int64_t wall = ts != AV_NOPTS_VALUE ? av_rescale_q(ts, sourceTb, AV_TIME_BASE_Q) : av_gettime();
+    if(!videoCopyStarted && (!(pkt->flags & AV_PKT_FLAG_KEY) || wall < resumeWall.load(std::memory_order_relaxed))) {
+        staleDeviceFrames++;
+        return;
+    }
+    videoCopyStarted = true;
+    int64_t delay = pkt->pts != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE ? pkt->pts - pkt->dts : 0;
+    int64_t captured = captureClock.videoTime(wall);
+    int64_t unset = AV_NOPTS_VALUE;
+    videoOrigin.compare_exchange_strong(unset, captured, std::memory_order_release);
+    pkt->dts = timelines[outVideoStreamIndex].stamp(captured);
+    pkt->pts = pkt->dts + delay;
+    pkt->pos = -1;
+    timelines[outVideoStreamIndex].toStream(pkt);
+    pkt->stream_index = outVideoStreamIndex;
+    encodedBytes.fetch_add(pkt->size, std::memory_order_relaxed);
+    encodedFrames.fetch_add(1, std::memory_order_relaxed);
+    queuePacket(pkt);
+}
 
-    AVStream *audio_st = avformat_new_stream(outAVFormatContext, nullptr);
-    if (!audio_st) {
-        cout << "\nCannot create audio stream";
-        exit(1);
+/*
+ * The opaque of a captured frame carries what the VideoThread found to the ProducerThread, through the conversion:
+ * the rows it scrolled by in the low 16 bits, above them the per mille of its tiles that changed plus one, 0 unknown.
+ */
+static inline void *frameHints(int scrolled, int changed) {
+    return (void *) (intptr_t) ((scrolled & 0xFFFF) | ((intptr_t) (changed + 1) << 16));
+}
+
+static inline int hintScrolled(const void *opaque) {
+    return (int16_t) ((intptr_t) opaque & 0xFFFF);
+}
+
+static inline int hintChange(const void *opaque) {
+    return (int) (((intptr_t) opaque >> 16) & 0x7FF) - 1;
+}
+
+/**
+ * dispatchVideoFrame() hands a captured frame to the convert workers.
+ * The round-robin dispatch keeps the frame order recoverable by the producer.
+ * With settings._skipstatic or settings._vfr the frame is tile hashed first and dropped when nothing changed,
+ * with settings._activitygate the hash tells the activity the output is written on.
+ */
+void ScreenRecorder::dispatchVideoFrame(AVFrame *rawFrame) {
+    AVRational sourceTb = videoGrabber ? inVCodecContext->time_base : inVFormatContext->streams[inVideoStreamIndex]->time_base;
+    int64_t wall = rawFrame->pts != AV_NOPTS_VALUE ? av_rescale_q(rawFrame->pts, sourceTb, AV_TIME_BASE_Q) : av_gettime();
+    rawFrame->pts = captureClock.videoTime(wall);
+    int64_t unset = AV_NOPTS_VALUE;
+    videoOrigin.compare_exchange_strong(unset, rawFrame->pts, std::memory_order_release);
+    //the capture time is the id of the frame in the trace, the grab happened before it was known
+    if(tracer) {
+        tracer->record(SR_STAGE_GRAB, rawFrame->pts, grabSpan[0], grabSpan[1]);
+        if(decodeSpan[0])
+            tracer->record(SR_STAGE_DECODE, rawFrame->pts, decodeSpan[0], decodeSpan[1]);
     }
-    outACodec = avcodec_find_encoder(AV_CODEC_ID_AAC);
-    if (!outACodec) {
-        cout << "\nCannot find requested encoder";
-        exit(1);
+
+#ifdef __unix__
+    if(!maskedWindows.empty() && wall - maskWindowsPolled >= MASK_WINDOW_POLL * 1000) {
+        maskWindowsPolled = wall;
+        trackMaskedWindows();
     }
-    outACodecContext = avcodec_alloc_context3(outACodec);
-    if (!outACodecContext) {
-        cout << "\nCannot create related VideoCodecContext";
-        exit(1);
+#endif
+    //a change of the overlays or masks is a change of the output, whatever the screen does
+    uint32_t overlayChanges = overlay.changeCount() + privacyMask.changeCount();
+    int scrolled = 0;
+    if(settings._scrollhints && !rawFrame->hw_frames_ctx && rawFrame->format != AV_PIX_FMT_DRM_PRIME) {
+        //the rows of the frame moved by, for the motion search of the encoder
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat) rawFrame->format);
+        int bpp = desc && desc->nb_components ? desc->comp[0].step : 4;
+        scrolled = scrollDetector.update(rawFrame->data[0], rawFrame->linesize[0], rawFrame->width, rawFrame->height, bpp);
+        if(scrolled)
+            scrolledFrames++;
+    }
+    bool overlayChanged = overlayChanges != overlaySeen;
+    overlaySeen = overlayChanges;
+    //the viewers get the screen as captured, before the static frames are dropped: they compare with what they have
+    if(tileView && !rawFrame->hw_frames_ctx && rawFrame->format != AV_PIX_FMT_DRM_PRIME)
+        tileView->push(rawFrame);
+    //-1: a frame out of reach of the hasher, changed as far as anyone can tell
+    int changedTiles = -1;
+    if((settings._skipstatic || settings._vfr || settings._activitygate || settings._scenekeys || settings._contentrate) &&
+       !rawFrame->hw_frames_ctx &&
+       rawFrame->format != AV_PIX_FMT_DRM_PRIME) {
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat) rawFrame->format);
+        int bpp = desc && desc->nb_components ? desc->comp[0].step : 4;
+        changedTiles = staticHasher.update(rawFrame->data[0], rawFrame->linesize[0], rawFrame->width, rawFrame->height, bpp);
     }
+    int tiles = ((rawFrame->width + SR_TILE_SIZE - 1) / SR_TILE_SIZE) * ((rawFrame->height + SR_TILE_SIZE - 1) / SR_TILE_SIZE);
+    rawFrame->opaque = frameHints(scrolled, changedTiles < 0 || tiles <= 0 ? -1 : (int) ((int64_t) changedTiles * 1000 / tiles));
+    if(settings._activitygate && (changedTiles < 0 || changedTiles >= settings._activitytiles || overlayChanged))
+        lastActivity.store(rawFrame->pts, std::memory_order_relaxed);
+    if((settings._skipstatic || settings._vfr) && changedTiles == 0 && !overlayChanged) {
+        //identical to the previous frame: no conversion and no encoding, the output gets a timestamp gap
+        skippedStaticFrames++;
+        grabPool.release(rawFrame);
+        return;
+    }
+    if(settings._vfr && !vfrAdmit(rawFrame))
+        return;
+    queueVideoFrame(rawFrame);
+}
 
+/**
+ * queueVideoFrame() pushes a frame on the queue of the next convert worker, as settings._droppolicy allows
+ * @Note VideoThread only
+ */
+void ScreenRecorder::queueVideoFrame(AVFrame *rawFrame) {
+    if(settings._vfr) {
+        //a reference of what the output shows, the keepalive repeats it
+        if(!vfrLast)
+            vfrLast = grabPool.getEmpty();
+        av_frame_unref(vfrLast);
+        if(vfrLast && av_frame_ref(vfrLast, rawFrame) < 0)
+            av_frame_unref(vfrLast);
+        vfrLastQueued = captureClock.elapsed(av_gettime());
+    }
+    //the tiles of the wall take the canvas as grabbed, the convert workers may scale it down for the recording
+    if(videoWall)
+        videoWall->send(rawFrame);
+
+    //a frame that is not queued takes no slot of the round robin
+    int worker = (int) (videoFrameCount % convertWorkers);
+    SRRingBuffer<AVFrame*> &queue = *rawVideoQueues[worker];
+    bool critical = keyframeCritical(rawFrame->pts);
+    bool wait = settings._droppolicy == SR_DROP_NONE || (settings._droppolicy == SR_DROP_KEYFRAME && critical);
+    if(wait ? !queue.push(rawFrame) : !queue.tryPush(rawFrame)) {
+        if(!wait)
+            policyDroppedFrames++;
+        grabPool.release(rawFrame);
+        return;
+    }
+    if(!convertTasks.empty())
+        convertTasks[worker]->schedule();
+    videoFrameCount++;
+}
 
-    /* set properties for the video stream encoding*/
+/**
+ * vfrAdmit() applies settings._vfrmininterval to a changed frame: too close to the last frame queued it is held back,
+ * replacing the change held before it, until vfrTick() queues it
+ * @return true if the frame is to be queued now
+ * @Note VideoThread only
+ */
+bool ScreenRecorder::vfrAdmit(AVFrame *rawFrame) {
+    if(vfrPending) {
+        vfrMergedFrames++;
+        grabPool.release(vfrPending);
+        vfrPending = nullptr;
+    }
+    if(vfrLastQueued != AV_NOPTS_VALUE &&
+       captureClock.elapsed(av_gettime()) - vfrLastQueued < (int64_t) settings._vfrmininterval * 1000) {
+        vfrPending = rawFrame;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * vfrTick() runs once per capture interval with settings._vfr: it queues the held change once the minimum interval
+ * is over, and repeats the last frame when nothing was queued for settings._vfrmaxinterval,
+ * produce() makes that repetition a keyframe
+ * @Note VideoThread only
+ */
+void ScreenRecorder::vfrTick() {
+    if(vfrLastQueued == AV_NOPTS_VALUE)
+        return;
+    int64_t now = captureClock.elapsed(av_gettime());
+    if(vfrPending) {
+        if(now - vfrLastQueued >= (int64_t) settings._vfrmininterval * 1000) {
+            AVFrame *frame = vfrPending;
+            vfrPending = nullptr;
+            queueVideoFrame(frame);
+        }
+        return;
+    }
+    if(!vfrLast || !vfrLast->buf[0] || settings._vfrmaxinterval == 0 ||
+       now - vfrLastQueued < (int64_t) settings._vfrmaxinterval * 1000)
+        return;
+    AVFrame *frame = grabPool.getEmpty();
+    if(!frame || av_frame_ref(frame, vfrLast) < 0) {
+        grabPool.release(frame);
+        return;
+    }
+    frame->pts = now;
+    vfrKeepaliveFrames++;
+    queueVideoFrame(frame);
+}
+
+/**
+ * keyframeCritical() tells the frames SR_DROP_KEYFRAME never drops: the first one, and the first one
+ * of every forced keyframe interval, as produce() schedules them
+ * @Note VideoThread only, pts on the capture clock
+ */
+bool ScreenRecorder::keyframeCritical(int64_t pts) {
+    const int64_t keyInterval = forcedKeyframeInterval();
+    if(firstCriticalFrame == AV_NOPTS_VALUE) {
+        firstCriticalFrame = pts;
+        nextCriticalFrame = pts + keyInterval;
+        return true;
+    }
+    if(keyInterval <= 0 || pts < nextCriticalFrame)
+        return false;
+    nextCriticalFrame = firstCriticalFrame + ((pts - firstCriticalFrame) / keyInterval + 1) * keyInterval;
+    return true;
+}
+
+/**
+ * frameExpired() is the latency bound of SR_DROP_OLDEST: the frame has waited more than settings._droplatency ms
+ * since its capture
+ */
+bool ScreenRecorder::frameExpired(const AVFrame *frame) const {
+    if(settings._droppolicy != SR_DROP_OLDEST || frame->pts == AV_NOPTS_VALUE)
+        return false;
+    return captureClock.elapsed(av_gettime()) - frame->pts > (int64_t) settings._droplatency * 1000;
+}
+
+/**
+ * Steps of the adaptive quality controller, from the full quality: keep is the share of the frame clock deadlines
+ * (or device frames) captured, fastScale replaces settings._scalequality with SWS_FAST_BILINEAR.
+ * @Note the output resolution and the encoder preset are fixed once the encoder is open, as the MP4 track is
+ */
+static const struct {
+    int keep;
+    bool fastScale;
+} qualitySteps[] = {
+        {1, false},
+        {1, true},
+        {2, true},
+        {3, true},
+        {4, true},
+};
+#define QUALITY_STEPS ((int) (sizeof(qualitySteps) / sizeof(qualitySteps[0])))
+
+/**
+ * shedFrame() applies the frame rate of the current quality step: one frame in keep goes on,
+ * the timestamps of the others are left as gaps
+ * @Note VideoThread only
+ */
+bool ScreenRecorder::shedFrame() {
+    int keep = qualitySteps[qualityStep.load(std::memory_order_relaxed)].keep;
+    if(keep <= 1 || shedCount++ % keep == 0)
+        return false;
+    shedFrames++;
+    return true;
+}
+
+/**
+ * adaptQuality() is the feedback controller of settings._adaptivequality, run by the ProducerThread every
+ * ADAPT_WINDOW ms of encoding. An encoder busy for more than ADAPT_HIGH_LOAD of the window, or convert queues
+ * (or the memory the async writer stages for a slow disk) filled beyond ADAPT_QUEUE_FILL, step the quality down
+ * at once; it is restored one step at a time after ADAPT_RESTORE_WINDOWS windows of headroom, once the load of
+ * the better step is predicted under ADAPT_LOW_LOAD.
+ *
+ * @param encodeLoad fraction of the window spent in the encoder
+ */
+void ScreenRecorder::adaptQuality(double encodeLoad) {
+    size_t queued = 0, capacity = 0;
+    for (auto &queue : rawVideoQueues) {
+        queued += queue->size();
+        capacity += queue->maxSize();
+    }
+    double fill = capacity ? (double) queued / capacity : 0;
+    //a slow disk the writer is staging for counts as a full queue: fewer frames, fewer bytes to write
+    if(fileWriter && settings._writerspill > 0)
+        fill = FFMAX(fill, (double) fileWriter->backlog() / settings._writerspill);
+    int step = qualityStep.load(std::memory_order_relaxed);
+
+    if(encodeLoad > ADAPT_HIGH_LOAD || fill > ADAPT_QUEUE_FILL) {
+        calmWindows = 0;
+        if(step + 1 < QUALITY_STEPS) {
+            qualityStep = ++step;
+            srLog(SR_LOG_WARNING, "[ProducerThread] encoder %d%% busy, convert queues %d%% full: quality step %d, 1 frame in %d%s",
+                  (int) (encodeLoad * 100), (int) (fill * 100), step, qualitySteps[step].keep,
+                  qualitySteps[step].fastScale ? ", fast scaling" : "");
+        }
+        return;
+    }
+    if(step == 0)
+        return;
+    //the better step encodes keep/keep' times the frames
+    double predicted = encodeLoad * qualitySteps[step].keep / qualitySteps[step - 1].keep;
+    if(predicted >= ADAPT_LOW_LOAD || fill > ADAPT_QUEUE_FILL / 2) {
+        calmWindows = 0;
+        return;
+    }
+    if(++calmWindows >= ADAPT_RESTORE_WINDOWS) {
+        calmWindows = 0;
+        qualityStep = --step;
+        srLog(SR_LOG_INFO, "[ProducerThread] headroom back: quality step %d, 1 frame in %d%s", step, qualitySteps[step].keep,
+              qualitySteps[step].fastScale ? ", fast scaling" : "");
+    }
+}
 
-    if ((outACodec)->supported_samplerates) {
-        outACodecContext->sample_rate = (outACodec)->supported_samplerates[0];
-        for (i = 0; (outACodec)->supported_samplerates[i]; i++) {
-            if ((outACodec)->supported_samplerates[i] == inACodecContext->sample_rate)
-                outACodecContext->sample_rate = inACodecContext->sample_rate;
+/**
+ * convertVideo() is the execution flow of a "ConvertThread".
+ * Each worker owns its SwsContext and converts the frames of its own input queue
+ * to the encoder pixel format and resolution.
+ *
+ * @param worker index of the worker, selects the pair of queues it is bound to
+ */
+void ScreenRecorder::convertVideo(int worker) {
+    AVFrame *rawFrame, *scaledFrame;
+    SRRingBuffer<AVFrame*> &inQueue = *rawVideoQueues[worker];
+    SRRingBuffer<AVFrame*> &outQueue = *scaledVideoQueues[worker];
+
+    //each frame is split in bands converted in parallel, on top of the frame-level workers
+    SRScaler scaler;
+    initConverter(worker, scaler);
+    efficientPipelineThread("ConvertThread");
+    if(tracer)
+        tracer->nameThread("ConvertThread " + std::to_string(worker));
+    threadReady();
+
+    if(filterGraph) {
+        //the whole conversion runs in the filter graph: on the device for the GPU stages, on the CPU for the video filters
+        bool flushed = false;
+        while(!flushed) {
+            bool more = inQueue.pop(rawFrame);
+            if(more && drainExpired()) {
+                grabPool.release(rawFrame);
+                framesAbandoned++;
+                continue;
+            }
+            //a null frame at the end flushes the graph
+            flushed = !more;
+            if(flushed && drainExpired())
+                break;
+            int ret = av_buffersrc_add_frame(filterSrc, more ? rawFrame : nullptr);
+            if(more)
+                grabPool.release(rawFrame);
+            while(ret >= 0) {
+                scaledFrame = scaledPool.getEmpty();
+                if(!scaledFrame) {
+                    failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVFrame for scaled video");
+                    break;
+                }
+                ret = av_buffersink_get_frame(filterSink, scaledFrame);
+                if(ret < 0) {
+                    scaledPool.release(scaledFrame);
+                    break;
+                }
+                //the frame rate filters have a time base of their own, the producer expects the one of the input
+                scaledFrame->pts = av_rescale_q(scaledFrame->pts, av_buffersink_get_time_base(filterSink),
+                                                filterSrc->outputs[0]->time_base);
+                //the graph may hand out a buffer twice (fps, framestep): the overlays and masks go into a copy of it then
+                bool drawn = (settings._overlay || privacyMasking()) && !scaledFrame->hw_frames_ctx;
+                if(drawn && av_frame_make_writable(scaledFrame) < 0) {
+                    scaledPool.release(scaledFrame);
+                    failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVFrame for scaled video");
+                    continue;
+                }
+                if(drawn && settings._overlay && !overlay.composite(scaledFrame) && !overlayWarned.exchange(true))
+                    srLog(SR_LOG_WARNING, "[ConvertThread] the overlays cannot be drawn on %s frames",
+                          av_get_pix_fmt_name((enum AVPixelFormat) scaledFrame->format));
+                if(regionsActive() && !applyRegions(scaledFrame)) {
+                    scaledPool.release(scaledFrame);
+                    continue;
+                }
+                scaledFrame = uploadFrame(scaledFrame);
+                if(!outQueue.push(scaledFrame))
+                    scaledPool.release(scaledFrame);
+            }
         }
+        outQueue.close();
+        return;
     }
-    outACodecContext->codec_id = AV_CODEC_ID_AAC;
-    outACodecContext->sample_fmt  = (outACodec)->sample_fmts ? (outACodec)->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
-    outACodecContext->channels  = inACodecContext->channels;
-    outACodecContext->channel_layout = av_get_default_channel_layout(outACodecContext->channels);
-    outACodecContext->bit_rate = 96000;
-    outACodecContext->time_base = { 1, inACodecContext->sample_rate };
 
-    outACodecContext->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+    while(inQueue.pop(rawFrame))
+        convertFrame(worker, rawFrame, scaler);
 
-    if ((outAVFormatContext)->oformat->flags & AVFMT_GLOBALHEADER) {
-        outACodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    //no more input: let the producer drain this worker
+    outQueue.close();
+}
+
+/**
+ * initConverter() configures the scaler of a convert worker, then converts a first frame:
+ * the scaler tables and the band threads are built before the first captured frame
+ */
+void ScreenRecorder::initConverter(int worker, SRScaler &scaler) {
+    if(videoPassthrough || filterGraph)
+        return;
+    scaler.setColorspace(outVCodecContext->colorspace, outVCodecContext->color_range);
+    if(settings._scaletiles)
+        scaler.setTiling(SCALE_TILE_WIDTH, SCALE_TILE_HEIGHT);
+    if(scaler.configure(inVCodecContext->width, inVCodecContext->height, inVCodecContext->pix_fmt,
+                        outVCodecContext->width, outVCodecContext->height, outVSwPixFmt,
+                        scaleFlags, scaleBands) < 0) {
+        failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate the scaling context");
+        return;
     }
+    if(worker == 0 && scaler.isFastPath())
+        srLog(SR_LOG_INFO, "[ConvertThread] %s conversion, swscale bypassed",
+              scaler.downscaleRatio() == SR_DOWNSCALE_HALF ? "2:1 downscale and" :
+              scaler.downscaleRatio() == SR_DOWNSCALE_THREE_QUARTERS ? "4:3 downscale and" :
+              scaler.isTiled() ? "tiled unscaled" : "unscaled");
+    if(videoGrabber) {
+        AVFrame *rawFrame = grabPool.get();
+        AVFrame *scaledFrame = scaledPool.get();
+        if(rawFrame && scaledFrame)
+            scaler.scale(rawFrame, scaledFrame);
+        grabPool.release(rawFrame);
+        scaledPool.release(scaledFrame);
+    }
+}
 
-    if (avcodec_open2(outACodecContext, outACodec, nullptr)< 0) {
-        cout << "\nerror in opening the avcodec with error: ";
-        exit(1);
+/**
+ * convertFrame() converts one captured frame of a worker and queues it for the ProducerThread.
+ * It blocks while the output queue of the worker is full.
+ */
+void ScreenRecorder::convertFrame(int worker, AVFrame *rawFrame, SRScaler &scaler) {
+    SRRingBuffer<AVFrame*> &outQueue = *scaledVideoQueues[worker];
+    AVFrame *scaledFrame;
+    if(drainExpired()) {
+        grabPool.release(rawFrame);
+        framesAbandoned++;
+        return;
+    }
+    if(frameExpired(rawFrame)) {
+        //an empty slot keeps the producer in step with the round robin
+        grabPool.release(rawFrame);
+        policyDroppedFrames++;
+        outQueue.push(nullptr);
+        return;
+    }
+    //the capture region can change size, or the quality step the filter: only then the contexts are rebuilt
+    int flags = qualitySteps[qualityStep.load(std::memory_order_relaxed)].fastScale ? SWS_FAST_BILINEAR : scaleFlags;
+    if(videoPassthrough) {
+        scaledFrame = rawFrame;
+    } else if(!(scaledFrame = convertIntoSurface(rawFrame, scaler, flags))) {
+        /* scaledFrame comes out of the pool with the encoder geometry */
+        scaledFrame = scaledPool.get();
+        if(!scaledFrame) {
+            grabPool.release(rawFrame);
+            failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "unable to allocate memory");
+            outQueue.push(nullptr);
+            return;
+        }
+        scaledFrame->pts = rawFrame->pts;
+        scaledFrame->opaque = rawFrame->opaque;
+        scaledFrame->pkt_dts=rawFrame->pkt_dts;
+        scaledFrame->best_effort_timestamp = rawFrame->best_effort_timestamp;
+
+        if(scaler.configure(rawFrame->width, rawFrame->height, (enum AVPixelFormat) rawFrame->format,
+                            scaledFrame->width, scaledFrame->height, outVSwPixFmt, flags, scaleBands) < 0) {
+            grabPool.release(rawFrame);
+            scaledPool.release(scaledFrame);
+            failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate the scaling context");
+            outQueue.push(nullptr);
+            return;
+        }
+        int64_t scaleStart = SRFrameClock::now();
+        scaler.scale(rawFrame, scaledFrame);
+        int64_t scaleEnd = SRFrameClock::now();
+        stageTimes[SR_STAGE_SCALE].record(scaleEnd - scaleStart);
+        if(tracer)
+            tracer->record(SR_STAGE_SCALE, rawFrame->pts, scaleStart, scaleEnd);
+        grabPool.release(rawFrame);
     }
 
+    //before the upload: the layers are blended on the CPU, into the rectangles they cover
+    if(settings._overlay && !overlay.composite(scaledFrame) && !overlayWarned.exchange(true))
+        srLog(SR_LOG_WARNING, "[ConvertThread] the overlays cannot be drawn on %s frames",
+              av_get_pix_fmt_name((enum AVPixelFormat) scaledFrame->format));
+    //after the overlays: nothing drawn on the frame shows what is masked, and the text of the overlays is found too
+    if(regionsActive() && !applyRegions(scaledFrame)) {
+        releaseScaledFrame(scaledFrame);
+        outQueue.push(nullptr);
+        return;
+    }
 
-    //find a free stream index
-    outAudioStreamIndex = -1;
-    for(i=0; i < outAVFormatContext->nb_streams; i++)
-        if(outAVFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_UNKNOWN)
-            outAudioStreamIndex = i;
+    scaledFrame = uploadFrame(scaledFrame);
+    if(!outQueue.push(scaledFrame))
+        releaseScaledFrame(scaledFrame);
+}
+
+/**
+ * convertIntoSurface() is the conversion of the unscaled RGB captures for a hardware encoder: the SRColorConvert
+ * kernel writes the NV12 (P010, 4:4:4) planes straight into a mapped surface of the encoder pool, instead of into
+ * a system memory frame uploadFrame() copies again. The overlays and the regions read the frame they draw on,
+ * slow on uncached device memory: they keep the two steps, as the scaled and the swscale conversions.
+ * @return the surface to encode, nullptr when this frame takes the usual path
+ */
+AVFrame *ScreenRecorder::convertIntoSurface(AVFrame *rawFrame, SRScaler &scaler, int flags) {
+    if(!outVCodecContext->hw_frames_ctx || rawFrame->hw_frames_ctx || settings._overlay || regionsActive() ||
+       surfaceMapFailed.load(std::memory_order_relaxed))
+        return nullptr;
+    //a failure is left to the usual path: it configures the same scaler and asks the same pool, and reports it once
+    if(scaler.configure(rawFrame->width, rawFrame->height, (enum AVPixelFormat) rawFrame->format,
+                        outVCodecContext->width, outVCodecContext->height, outVSwPixFmt, flags, scaleBands) < 0 ||
+       !scaler.isFastPath())
+        return nullptr;
+    AVFrame *hwFrame = scaledPool.getEmpty();
+    if(!hwFrame || av_hwframe_get_buffer(outVCodecContext->hw_frames_ctx, hwFrame, 0) < 0) {
+        scaledPool.release(hwFrame);
+        return nullptr;
+    }
+    AVFrame *mapped = av_frame_alloc();
+    if(mapped)
+        mapped->format = outVSwPixFmt;
+    //OVERWRITE: the driver does not read the surface back before the kernel writes all of it
+    if(!mapped || av_hwframe_map(mapped, hwFrame, AV_HWFRAME_MAP_WRITE | AV_HWFRAME_MAP_OVERWRITE) < 0) {
+        av_frame_free(&mapped);
+        scaledPool.release(hwFrame);
+        if(!surfaceMapFailed.exchange(true))
+            srLog(SR_LOG_INFO, "[ConvertThread] the encoder surfaces cannot be mapped, the converted frames are uploaded");
+        return nullptr;
+    }
+    int64_t scaleStart = SRFrameClock::now();
+    scaler.scale(rawFrame, mapped);
+    //unmapping writes the planes back where the mapping is a copy
+    av_frame_free(&mapped);
+    int64_t scaleEnd = SRFrameClock::now();
+    stageTimes[SR_STAGE_SCALE].record(scaleEnd - scaleStart);
+    if(tracer)
+        tracer->record(SR_STAGE_SCALE, rawFrame->pts, scaleStart, scaleEnd);
+
+    hwFrame->pts = rawFrame->pts;
+    hwFrame->opaque = rawFrame->opaque;
+    hwFrame->pkt_dts = rawFrame->pkt_dts;
+    hwFrame->best_effort_timestamp = rawFrame->best_effort_timestamp;
+    grabPool.release(rawFrame);
+    return hwFrame;
+}
+
+/**
+ * uploadFrame() copies a converted frame to a device surface of the encoder pool when the encoder takes them
+ * @return the frame to encode: frame itself, or the surface it was released for; nullptr, frame released, when the
+ * upload failed without settings._exitonerror
+ */
+AVFrame *ScreenRecorder::uploadFrame(AVFrame *frame) {
+    if(!outVCodecContext->hw_frames_ctx || frame->hw_frames_ctx)
+        return frame;
+    AVFrame *hwFrame = scaledPool.getEmpty();
+    if(!hwFrame || av_hwframe_get_buffer(outVCodecContext->hw_frames_ctx, hwFrame, 0) < 0) {
+        scaledPool.release(hwFrame);
+        releaseScaledFrame(frame);
+        failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate a hardware frame");
+        return nullptr;
+    }
+    if(av_hwframe_transfer_data(hwFrame, frame, 0) < 0) {
+        scaledPool.release(hwFrame);
+        releaseScaledFrame(frame);
+        failCapture(SR_ERROR_ENCODER, 0, "Cannot upload the frame to the hardware encoder");
+        return nullptr;
+    }
+    av_frame_copy_props(hwFrame, frame);
+    releaseScaledFrame(frame);
+    return hwFrame;
+}
 
-        if(outAudioStreamIndex < 0) {
-            cout << "\nCannot find a free stream for audio on the output";
-            exit(1);
+/**
+ * convertStep() is one step of the serial task a convert worker becomes on a shared SRTaskPool:
+ * it converts the next frame of the worker, if the ProducerThread has room for it, so a pool worker never blocks.
+ * The VideoThread schedules the task when it queues a frame or closes the queues, the ProducerThread when it takes one.
+ * @return false when there was nothing to convert or no room
+ */
+bool ScreenRecorder::convertStep(int worker) {
+    SRRingBuffer<AVFrame*> &inQueue = *rawVideoQueues[worker];
+    SRRingBuffer<AVFrame*> &outQueue = *scaledVideoQueues[worker];
+    AVFrame *rawFrame;
+    if(outQueue.isClosed() || outQueue.size() >= outQueue.maxSize())
+        return false;
+    if(!inQueue.tryPop(rawFrame)) {
+        //a closed queue can still receive one last frame before close() is seen
+        if(!inQueue.isClosed())
+            return false;
+        if(!inQueue.tryPop(rawFrame)) {
+            //no more input: let the producer drain this worker
+            outQueue.close();
+            return false;
         }
+    }
+    convertFrame(worker, rawFrame, *convertScalers[worker]);
+    return true;
+}
 
-    avcodec_parameters_from_context(outAVFormatContext->streams[outAudioStreamIndex]->codecpar, outACodecContext);
-    cout<<"[generateAudioOutputStream] exiting\n";
+/**
+ * placeSceneKeyframe() starts a GOP on the first frame of a large change of the screen, a window switch or a new page:
+ * coded as a P-frame it would cost as much as a keyframe without being one, and it is where a viewer seeks to.
+ * A change that goes on, a video played, only gets the first one. While the screen changes a keyframe also comes
+ * every sceneGop, while it is static the encoder waits SCENE_GOP_STRETCH times longer.
+ * @param previousChange per mille of the previous frame, updated
+ * @param lastKeyframe capture time of the last keyframe asked for, updated
+ * @Note ProducerThread only, frame pts on the capture clock
+ */
+void ScreenRecorder::placeSceneKeyframe(AVFrame *frame, int &previousChange, int64_t &lastKeyframe) {
+    int change = hintChange(frame->opaque);
+    bool spaced = lastKeyframe == AV_NOPTS_VALUE || frame->pts - lastKeyframe >= (int64_t) SCENE_MIN_INTERVAL * 1000;
+    if(frame->pict_type != AV_PICTURE_TYPE_I && spaced && change >= SCENE_CHANGE &&
+       previousChange >= 0 && previousChange < SCENE_CHANGE) {
+        frame->pict_type = AV_PICTURE_TYPE_I;
+        sceneKeyframes++;
+    }
+    //unknown counts as changed: only a frame known to be still leaves the GOP stretching
+    if(frame->pict_type != AV_PICTURE_TYPE_I && sceneGop > 0 && change != 0 &&
+       lastKeyframe != AV_NOPTS_VALUE && frame->pts - lastKeyframe >= sceneGop)
+        frame->pict_type = AV_PICTURE_TYPE_I;
+    if(frame->pict_type == AV_PICTURE_TYPE_I || lastKeyframe == AV_NOPTS_VALUE)
+        lastKeyframe = frame->pts;
+    previousChange = change;
 }
 
-void ScreenRecorder::initOptions() {
-    settings.filename = "";
-    settings._recaudio=false;
-    settings._inscreenres={0,0};
-    settings._outscreenres={0,0};
+/**
+ * releaseScaledFrame() gives a converted frame back to the pool it comes from:
+ * without conversion the captured frames go straight to the encoder.
+ */
+void ScreenRecorder::releaseScaledFrame(AVFrame *frame) {
+    if(burstEncoding)
+        burstArena->release(frame);
+    else if(videoPassthrough && (!frame->hw_frames_ctx || inVCodecContext->hw_frames_ctx))
+        grabPool.release(frame);
+    else
+        scaledPool.release(frame);
+}
 
-    settings._screenoffset={0,0};
+/**
+ * produce() is the "ProducerThread" execution flow.
+ * It collects the converted frames from the workers in capture order,
+ * encodes them and hands the resulting packets to the muxer.
+ * It ends when all the convert workers are drained.
+ */
+void ScreenRecorder::produce() {
+    int ret;
+    AVFrame *scaledFrame;
+    uint64_t frameCount = 0;
+    const int64_t keyInterval = forcedKeyframeInterval();
+    const bool numa = numaNodeCount() > 1;
+    //node of each pool buffer: its pages stay where they were first touched, one get_mempolicy() call per buffer
+    std::map<const uint8_t *, int> numaHomes;
+    int64_t firstKeyframe = AV_NOPTS_VALUE, nextKeyframe = 0;
+    int64_t windowStart = 0, windowBusy = 0;
+    //the mpegvideo encoders read me_range for every macroblock: the search window can follow the scroll frame by frame
+    const AVCodecID codecId = outVCodecContext->codec_id;
+    const bool scrollHints = settings._scrollhints && (codecId == AV_CODEC_ID_MPEG4 || codecId == AV_CODEC_ID_H263P ||
+                             codecId == AV_CODEC_ID_MPEG1VIDEO || codecId == AV_CODEC_ID_MPEG2VIDEO);
+    //variable frame rate: a frame after the keepalive interval starts a GOP, the screen stayed unchanged until it
+    const int64_t keepalive = settings._vfr ? (int64_t) settings._vfrmaxinterval * 1000 : 0;
+    int64_t lastCapture = AV_NOPTS_VALUE;
+    //scene keyframes: the previous change, -1 unknown, and the capture time of the last keyframe asked for
+    int previousChange = -1;
+    int64_t lastKeyframe = AV_NOPTS_VALUE;
+
+    //avcodec_receive_packet() unreferences it first, the packets move to packetPool ones for the muxer
+    SRPacketPtr packet(av_packet_alloc());
+    AVPacket *outPacket = packet.get();
+    if(!outPacket) {
+        failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVPacket for encoded video");
+        threadReady();
+        //the convert workers blocked on a full queue stop pushing, nothing pops it any more
+        for (auto &queue : scaledVideoQueues)
+            queue->close();
+        muxQueues[outVideoStreamIndex]->close();
+        return;
+    }
+    //B-frames are coded ahead of the frames they are shown after, a pyramid one more
+    videoReorder.init(FFMAX(outVCodecContext->max_b_frames, outVCodecContext->has_b_frames) + 1);
+    efficientPipelineThread("ProducerThread");
+    if(tracer)
+        tracer->nameThread("ProducerThread");
+    threadReady();
+
+    //settings._burst: once the convert workers are drained the frames of the arena take their place, in capture order
+    auto nextFrame = [&]() {
+        if(!burstEncoding && scaledVideoQueues[frameCount % convertWorkers]->pop(scaledFrame))
+            return true;
+        if(!burstArena)
+            return false;
+        if(!burstEncoding)
+            srLog(SR_LOG_INFO, "[ProducerThread] encoding the %llu frames of the burst",
+                  (unsigned long long) burstArena->stats().frames);
+        burstEncoding = true;
+        return (scaledFrame = burstArena->pop()) != nullptr;
+    };
+    while(nextFrame()) {
+        //a pooled worker stops when its output queue is full: there is room again
+        if(!convertTasks.empty() && !burstEncoding)
+            convertTasks[frameCount % convertWorkers]->schedule();
+        frameCount++;
+        //dropped by the worker, already counted
+        if(!scaledFrame)
+            continue;
+        //the burst is encoded at leisure, past the drain deadline
+        if(!burstEncoding && drainExpired()) {
+            releaseScaledFrame(scaledFrame);
+            framesAbandoned++;
+            continue;
+        }
+        if(!burstEncoding && frameExpired(scaledFrame)) {
+            releaseScaledFrame(scaledFrame);
+            policyDroppedFrames++;
+            continue;
+        }
+        if(killSwitch.load(std::memory_order_relaxed) && !burstEncoding)
+            framesFlushed++;
+        if(!burstEncoding) {
+            //the renditions scale the same converted frame down, nothing is grabbed nor converted twice
+            for (auto &rendition : renditionOutputs)
+                rendition->send(scaledFrame);
+            if(snapshots)
+                snapshots->send(scaledFrame);
+            if(frameCallback)
+                frameCallback(scaledFrame);
+            if(sharedFrames)
+                sharedFrames->write(scaledFrame);
+        }
+        //kept for saveReplay(), on the capture clock: the encoder of the recording is never fed
+        if(frameReplay) {
+            frameReplay->push(scaledFrame);
+            releaseScaledFrame(scaledFrame);
+            continue;
+        }
+        //the bandwidth fell faster than the encoder rate: the frame goes, not its packets on the network
+        if(webrtcOutput && !burstEncoding && webrtcOutput->congested()) {
+            releaseScaledFrame(scaledFrame);
+            congestionDroppedFrames++;
+            continue;
+        }
+        //packed on the capture deadline, the encoder runs once the capture is over: the arena keeps room
+        //for the frames in flight when it asks for the end
+        if(burstArena && !burstEncoding) {
+            if(burstArena->push(scaledFrame) < 0)
+                srLog(SR_LOG_ERROR, "[ProducerThread] the burst arena refused a frame");
+            releaseScaledFrame(scaledFrame);
+            if(burstArena->full() && !killSwitch.load(std::memory_order_relaxed)) {
+                srLog(SR_LOG_INFO, "[ProducerThread] the burst arena is full, ending the capture");
+                endCapture();
+            }
+            continue;
+        }
+
+        //segment cuts need a keyframe on every boundary, counted like the muxers do from the first frame
+        scaledFrame->pict_type = AV_PICTURE_TYPE_NONE;
+        if(keyInterval > 0) {
+            if(firstKeyframe == AV_NOPTS_VALUE)
+                firstKeyframe = nextKeyframe = scaledFrame->pts;
+            if(scaledFrame->pts >= nextKeyframe) {
+                scaledFrame->pict_type = AV_PICTURE_TYPE_I;
+                nextKeyframe = firstKeyframe + ((scaledFrame->pts - firstKeyframe) / keyInterval + 1) * keyInterval;
+            }
+        }
+        if(keepalive > 0 && lastCapture != AV_NOPTS_VALUE && scaledFrame->pts - lastCapture >= keepalive)
+            scaledFrame->pict_type = AV_PICTURE_TYPE_I;
+        //the next file of rotateOutput() starts on this one, a new bitrate of setBitrate() too
+        int kbps = pendingBitrate.exchange(0);
+        if(kbps > 0)
+            applyBitrate(kbps);
+        //the congestion control moves the rate on every report: reconfigured in place, the refresh carries on
+        int congestion = congestionBitrate.exchange(0);
+        if(congestion > 0 && kbps == 0)
+            applyBitrate(congestion);
+        if(keyframeRequested.exchange(false) || kbps > 0)
+            scaledFrame->pict_type = AV_PICTURE_TYPE_I;
+        if(settings._scenekeys)
+            placeSceneKeyframe(scaledFrame, previousChange, lastKeyframe);
+        if(contentRate) {
+            int64_t cap = contentRate->update(scaledFrame, hintChange(scaledFrame->opaque), scaledFrame->pts);
+            if(cap > 0)
+                applyContentRate(cap);
+        }
+        if(phashIndex)
+            phashIndex->send(scaledFrame, scaledFrame->pict_type == AV_PICTURE_TYPE_I);
+        lastCapture = scaledFrame->pts;
+        //capture clock microseconds to encoder ticks, two frames within a tick must not share it
+        scaledFrame->pts = timelines[outVideoStreamIndex].stamp(scaledFrame->pts);
+        if(tracer)
+            tracer->encoded(outVideoStreamIndex, scaledFrame->pts, lastCapture);
+        if(qualityProbe)
+            qualityProbe->sendFrame(scaledFrame, lastCapture);
+
+        //cross-socket reads: the encoder runs on one node and the frame lives on another
+        if(numa && scaledFrame->buf[0] && !scaledFrame->hw_frames_ctx) {
+            auto cached = numaHomes.find(scaledFrame->buf[0]->data);
+            int home = cached != numaHomes.end() ? cached->second : numaNodeOf(scaledFrame->buf[0]->data);
+            if(cached == numaHomes.end() && home >= 0) {
+                //frames allocated outside the pools come and go: the map must not grow with them
+                if(numaHomes.size() >= NUMA_HOME_CACHE)
+                    numaHomes.clear();
+                numaHomes[scaledFrame->buf[0]->data] = home;
+            }
+            int here = numaCurrentNode();
+            if(home >= 0 && here >= 0 && home != here) {
+                numaRemoteFrames++;
+                numaRemoteBytes += scaledFrame->buf[0]->size;
+            }
+        }
+        if(scrollHints) {
+            //narrow on still frames, just wide enough for the scrolled content otherwise; half pixel units
+            int scrolled = (int) av_rescale(hintScrolled(scaledFrame->opaque), outVCodecContext->height, inVCodecContext->height);
+            outVCodecContext->me_range = (FFABS(scrolled) + SCROLL_ME_MARGIN) * 2;
+        }
+        int64_t encodeStart = SRFrameClock::now();
+        ret = avcodec_send_frame(outVCodecContext, scaledFrame);
+        releaseScaledFrame(scaledFrame);
+        if(ret < 0){
+            failCapture(SR_ERROR_ENCODER, ret, "Cannot encode current video packet %d", ret);
+            continue;
+        }
+        receiveVideoPackets(outPacket);
+        int64_t encodeEnd = SRFrameClock::now();
+        stageTimes[SR_STAGE_ENCODE].record(encodeEnd - encodeStart);
+        if(tracer)
+            tracer->record(SR_STAGE_ENCODE, lastCapture, encodeStart, encodeEnd);
+
+        if(settings._adaptivequality) {
+            if(!windowStart)
+                windowStart = encodeStart;
+            windowBusy += encodeEnd - encodeStart;
+            if(encodeEnd - windowStart >= (int64_t) ADAPT_WINDOW * 1000) {
+                adaptQuality((double) windowBusy / (encodeEnd - windowStart));
+                windowStart = encodeEnd;
+                windowBusy = 0;
+            }
+        }
+    }
+
+    //the encoder still holds its lookahead: drain it unless the deadline is gone
+    if((burstEncoding || !drainExpired()) && avcodec_send_frame(outVCodecContext, nullptr) >= 0)
+        packetsFlushed += receiveVideoPackets(outPacket);
+    videoReady.clear();
+    videoReorder.flush(videoReady);
+    queuePackets(videoReady.data(), (int) videoReady.size());
+    if(videoReorder.fixedCount())
+        srLog(SR_LOG_INFO, "[ProducerThread] %llu video dts rewritten", (unsigned long long) videoReorder.fixedCount());
+
+    srLog(SR_LOG_INFO, "[ProducerThread] thread stopped!");
+    muxQueues[outVideoStreamIndex]->close();
+}
+
+/**
+ * receiveVideoPackets() moves the packets the video encoder has ready to the muxer, through videoReorder:
+ * the burst of a frame-threaded encoder reaches the mux queue in a single push, with increasing dts
+ * @return the number of packets
+ */
+int ScreenRecorder::receiveVideoPackets(AVPacket *outPacket) {
+    int count = 0;
+    bool rewriting = videoReorder.rewriting();
+    videoReady.clear();
+    while(true) {
+        int ret = avcodec_receive_packet(outVCodecContext, outPacket);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            break;
+        else if (ret < 0) {
+            failCapture(SR_ERROR_ENCODER, ret, "Error during encoding");
+            break;
+        }
+        //outPacket ready, the probe decodes it in the encoder time base
+        if(qualityProbe)
+            qualityProbe->sendPacket(outPacket);
+        if(contentRate && (outPacket->flags & AV_PKT_FLAG_KEY))
+            contentRate->keyframe();
+        int64_t encoderPts = outPacket->pts;
+        timelines[outVideoStreamIndex].toStream(outPacket);
+        if(tracer)
+            tracer->packetized(outVideoStreamIndex, encoderPts, outPacket->pts);
+
+        outPacket->stream_index = outVideoStreamIndex;
+        AVPacket *queued = packetPool.get();
+        if(!queued) {
+            av_packet_unref(outPacket);
+            failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVPacket for the muxer");
+            break;
+        }
+        encodedBytes.fetch_add(outPacket->size, std::memory_order_relaxed);
+        av_packet_move_ref(queued, outPacket);
+        videoReorder.push(queued, videoReady);
+        count++;
+    }
+    encodedFrames.fetch_add(count, std::memory_order_relaxed);
+    if(!rewriting && videoReorder.rewriting())
+        srLog(SR_LOG_WARNING, "[ProducerThread] the video encoder gives no valid dts, rewriting them from the pts");
+    queuePackets(videoReady.data(), (int) videoReady.size());
+    return count;
 }
 
-void ScreenRecorder::initBuffers() {
-    inVideoBuffer.np = 0;
-    inAudioBuffer.np = 0;
+
+/**
+ * queuePackets() hands count encoded packets of one stream to the MuxerThread in a single push:
+ * the muxer is woken once for all of them
+ *
+ * @param pkts packets of packetPool, owned by the muxer afterwards
+ */
+void ScreenRecorder::queuePackets(AVPacket **pkts, int count) {
+    if(count <= 0)
+        return;
+    int stream = pkts[0]->stream_index;
+    int64_t bytes = 0;
+    for (int i = 0; i < count; i++)
+        bytes += pkts[i]->size;
+    const AVPacket *last = pkts[count - 1];
+    if(last->dts != AV_NOPTS_VALUE)
+        muxLastDts[stream] = av_rescale_q(last->dts, outAVFormatContext->streams[stream]->time_base, AV_TIME_BASE_Q);
+    muxQueuedBytes += bytes;
+    for (int i = (int) muxQueues[stream]->pushBatch(pkts, count); i < count; i++) {
+        muxQueuedBytes -= pkts[i]->size;
+        packetPool.release(pkts[i]);
+    }
 }
 
 /**
- * initThreads() generate threads and initialize them by passing the right execution flow.\n
- * Following threads are created:\n
- * - AudioThread handles the real-time audio capturing and decoding \n
- * - VideoThread handles the real-time video capturing and decoding \n
- * - ProducerThread handles encoding and multiplexing of the video and audio streams. \n
+ * queuePacket() hands an encoded packet to the MuxerThread.
+ * The packet content is moved to a new reference, so the caller can reuse pkt right away.
  *
+ * @param pkt encoded packet, its stream_index selects the mux queue
+ */
+void ScreenRecorder::queuePacket(AVPacket *pkt) {
+    AVPacket *queued = packetPool.get();
+    if(!queued) {
+        av_packet_unref(pkt);
+        failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVPacket for the muxer");
+        return;
+    }
+    av_packet_move_ref(queued, pkt);
+    int stream = queued->stream_index;
+    if(queued->dts != AV_NOPTS_VALUE)
+        muxLastDts[stream] = av_rescale_q(queued->dts, outAVFormatContext->streams[stream]->time_base, AV_TIME_BASE_Q);
+    int size = queued->size;
+    muxQueuedBytes += size;
+    if(!muxQueues[stream]->push(queued)) {
+        muxQueuedBytes -= size;
+        packetPool.release(queued);
+    }
+}
+
+/**
+ * muxQueuePackets() is the capacity of each mux queue: enough packets to reach settings._muxmaxdelay
+ * at the video frame rate or at the audio packet rate, whichever is higher, so the limits trigger before the queue fills up.
  */
-void ScreenRecorder::initThreads() {
+int ScreenRecorder::muxQueuePackets() const {
+    int rate = FFMAX((int) settings._fps, 50);
+    return CAPTURE_BUFFER + (int) ((int64_t) rate * settings._muxmaxdelay / 1000);
+}
 
-    if(settings._recvideo) videoThread = thread([&](){captureVideo();});
-    if(settings._recaudio) audioThread = thread([&](){captureAudio();});
-   // producerThread = thread([&](){produce();});
+/**
+ * muxHeldDelay() is the longest span, in us, between the head packet kept by the muxer and the newest queued packet of the same stream
+ */
+int64_t ScreenRecorder::muxHeldDelay(const std::vector<AVPacket*> &pending) const {
+    int64_t held = 0;
+    for (unsigned int i = 0; i < pending.size(); i++) {
+        int64_t last = muxLastDts[i];
+        if(!pending[i] || pending[i]->dts == AV_NOPTS_VALUE || last == AV_NOPTS_VALUE) continue;
+        held = FFMAX(held, last - av_rescale_q(pending[i]->dts, outAVFormatContext->streams[i]->time_base, AV_TIME_BASE_Q));
+    }
+    return held;
+}
 
+/**
+ * checkStorage() reports the output disk falling behind the async writer, catching up again, or failing:
+ * a full disk is logged once instead of an error per packet
+ * @Note MuxerThread only
+ */
+void ScreenRecorder::checkStorage() {
+    int failure = fileWriter->failure();
+    if(failure < 0 && !storageFailed) {
+        storageFailed = true;
+        char reason[AV_ERROR_MAX_STRING_SIZE] = {0};
+        av_strerror(failure, reason, sizeof(reason));
+        srLog(SR_LOG_ERROR, "[MuxerThread] %s: %s, the recording stops growing",
+              failure == AVERROR(ENOSPC) ? "the output disk is full" : "cannot write the output", reason);
+        return;
+    }
+    //more than the regular buffers queued: the writer is spilling
+    int64_t backlog = fileWriter->backlog();
+    if(!storageDegraded && backlog > (int64_t) ASYNC_BUFFER_SIZE * ASYNC_BUFFER_COUNT) {
+        storageDegraded = true;
+        srLog(SR_LOG_WARNING, "[MuxerThread] the storage is slow: %d KiB staged in memory", (int) (backlog / 1024));
+    } else if(storageDegraded && backlog == 0) {
+        storageDegraded = false;
+        srLog(SR_LOG_INFO, "[MuxerThread] the storage caught up");
+    }
 }
 
 /**
- * captureVideo() is the "VideoThread" execution flow.
- * This execution flow get packets from video input device
- * and decode them by sending them to the decoder
- *
- * @Note captureVideo() is a thread-safe execution flow, has to be passed to a specific thread to ensure the correct execution
+ * mux() is the "MuxerThread" execution flow.
+ * It keeps the head packet of every stream queue and always writes the one with the lowest dts,
+ * so the output is interleaved here and av_write_frame never buffers.
+ * A stream stops taking part to the interleaving once its queue is closed and drained.
+ * While a stream has nothing queued the muxer holds the others back, until they exceed settings._muxmaxbytes
+ * or settings._muxmaxdelay: then settings._muxoverflow decides whether the held packets are written or dropped.
+ * It ends when all the streams are drained.
  */
+void ScreenRecorder::mux() {
+    unsigned int nb_streams = outAVFormatContext->nb_streams;
+    std::vector<AVPacket*> pending(nb_streams, nullptr);
+    std::vector<bool> drained(nb_streams, false);
+    std::vector<bool> skipToKey(nb_streams, false);
+    bool overflowing = false;
+
+    efficientPipelineThread("MuxerThread");
+    srLog(SR_LOG_INFO, "[MuxerThread] thread started!");
+    if(tracer)
+        tracer->nameThread("MuxerThread");
+    while(true) {
+        int waiting = -1;
+        int next = -1;
+
+        for (unsigned int i = 0; i < nb_streams; i++) {
+            if(drained[i] || pending[i]) continue;
+            if(muxQueues[i]->tryPop(pending[i])) continue;
+            //a closed queue can still receive one last packet before close() is seen
+            if(muxQueues[i]->isClosed() && !muxQueues[i]->tryPop(pending[i]))
+                drained[i] = true;
+            else if(!pending[i] && waiting < 0)
+                waiting = i;
+        }
 
-void ScreenRecorder::captureVideo(){
-    int ret;
-    AVPacket *inPacket, *outPacket;
-    AVFrame *rawFrame, *scaledFrame;
+        muxQueuedDelay = muxHeldDelay(pending);
+        if(waiting >= 0) {
+            //the stream with nothing queued could still have the lowest dts, unless the others hold too much
+            bool overLimit = muxQueuedBytes > (int64_t) settings._muxmaxbytes ||
+                             muxQueuedDelay > (int64_t) settings._muxmaxdelay * 1000;
+            if(!overLimit) {
+                overflowing = false;
+                //a lone stream has nothing to interleave with: no limit to check until its next packet
+                muxQueues[waiting]->waitReadable(nb_streams > 1 ? MUX_POLL : -1);
+                continue;
+            }
+            if(!overflowing) {
+                srLog(SR_LOG_WARNING, "[MuxerThread] stream %d is starving, releasing the held packets", waiting);
+                muxOverflows++;
+                overflowing = true;
+            }
+        }
 
-    //allocate space for a packet
-    inPacket = (AVPacket *) av_malloc(sizeof (AVPacket));
-    if(!inPacket) {
-        cout << "\nCannot allocate an AVPacket for encoded video";
-        exit(1);
-    }
+        for (unsigned int i = 0; i < nb_streams; i++) {
+            if(!pending[i]) continue;
+            if(next < 0 || av_compare_ts(pending[i]->dts, outAVFormatContext->streams[i]->time_base,
+                                         pending[next]->dts, outAVFormatContext->streams[next]->time_base) < 0)
+                next = i;
+        }
+        if(next < 0) {
+            if(waiting >= 0) continue;
+            break;
+        }
 
+        AVPacket *pkt = pending[next];
+        pending[next] = nullptr;
+        muxQueuedBytes -= pkt->size;
+        if(waiting >= 0 && settings._muxoverflow == SR_MUX_DROP)
+            skipToKey[next] = true;     //the stream restarts on its next keyframe
+        else if(skipToKey[next] && (pkt->flags & AV_PKT_FLAG_KEY))
+            skipToKey[next] = false;
+        if(skipToKey[next]) {
+            muxDroppedPackets++;
+            packetPool.release(pkt);
+            continue;
+        }
 
-    //allocate space for a packet
-    rawFrame =av_frame_alloc();
-    if(!rawFrame) {
-        cout << "\nCannot allocate an AVPacket for encoded video";
-        exit(1);
-    }
+        //capture to mux: both streams are stamped on the capture clock
+        if(pkt->pts != AV_NOPTS_VALUE) {
+            int64_t latency = captureClock.elapsed(av_gettime()) -
+                              av_rescale_q(pkt->pts, outAVFormatContext->streams[next]->time_base, AV_TIME_BASE_Q);
+            ((int) next == outVideoStreamIndex ? videoLatency : audioLatency).record(latency);
+        }
 
-    outPacket = (AVPacket *) av_malloc(sizeof (AVPacket));
-    if(!outPacket) {
-        cout << "\nCannot allocate an AVPacket for encoded video";
-        exit(1);
+        for (auto &live : liveOutputs)
+            live->send(pkt);
+        if(webrtcOutput)
+            webrtcOutput->send(pkt);
+        const SRPacketCallback &callback = (int) next == outVideoStreamIndex ? videoPacketCallback : audioPacketCallback;
+        if(callback)
+            callback(pkt, outAVFormatContext->streams[next]);
+        muxedPackets++;
+        //before the rotation rebases it: the pts finds the capture time of its frame, the id in the trace
+        int64_t traceId = tracer && pkt->pts != AV_NOPTS_VALUE ? tracer->muxedId((int) next, pkt->pts) : -1;
+        int64_t writeStart = SRFrameClock::now();
+        if(rotatePending && (outVideoStreamIndex < 0 || ((int) next == outVideoStreamIndex && (pkt->flags & AV_PKT_FLAG_KEY))))
+            rotateMuxer(pkt);
+        if(replayBuffer)
+            replayBuffer->push(pkt);
+        else if(prerollBuffer && !activityGate())
+            prerollBuffer->push(pkt);
+        else if(settings._outputmode != SR_OUTPUT_REPLAY && settings._outputmode != SR_OUTPUT_CALLBACK && muxContext)
+            writeMuxPacket(pkt, next);
+        int64_t writeEnd = SRFrameClock::now();
+        stageTimes[SR_STAGE_MUX].record(writeEnd - writeStart);
+        if(tracer)
+            tracer->record(SR_STAGE_MUX, traceId, writeStart, writeEnd);
+        if(fileWriter)
+            checkStorage();
+        packetPool.release(pkt);
     }
 
-    //allocate space for a packet
-    scaledFrame = av_frame_alloc();
-    if(!scaledFrame) {
-        cout << "\nCannot allocate an AVPacket for encoded video";
-        exit(1);
-    }
+    srLog(SR_LOG_INFO, "[MuxerThread] thread stopped!");
+}
 
-    int video_outbuf_size;
-    int nbytes = av_image_get_buffer_size(outVCodecContext->pix_fmt,outVCodecContext->width,outVCodecContext->height,32);
-    uint8_t *video_outbuf = (uint8_t*)av_malloc(nbytes*sizeof (uint8_t));
-    if( video_outbuf == nullptr )
-    {
-        cout<<"\nunable to allocate memory";
-        exit(1);
+/**
+ * writeMuxPacket() writes a packet of the recording, in the time base of its stream, to the current file
+ * and indexes the video keyframes
+ * @Note MuxerThread only
+ */
+void ScreenRecorder::writeMuxPacket(AVPacket *pkt, unsigned int stream) {
+    bool indexed = keyIndex && (int) stream == outVideoStreamIndex && (pkt->flags & AV_PKT_FLAG_KEY);
+    int64_t before = indexed && outAVFormatContext->pb ? avio_tell(outAVFormatContext->pb) : -1;
+    if(muxContext != outAVFormatContext) {
+        //a rotated file starts at its cut, in the time bases of its own muxer
+        if(pkt->pts != AV_NOPTS_VALUE)
+            pkt->pts -= muxOffsets[stream];
+        if(pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts -= muxOffsets[stream];
+        av_packet_rescale_ts(pkt, outAVFormatContext->streams[stream]->time_base, muxContext->streams[stream]->time_base);
     }
-
-    // Setup the data pointers and linesizes based on the specified image parameters and the provided array.
-    ret = av_image_fill_arrays( scaledFrame->data, scaledFrame->linesize, video_outbuf , AV_PIX_FMT_YUV420P, outVCodecContext->width,outVCodecContext->height,1 ); // returns : the size in bytes required for src
-    if(ret < 0)
-    {
-        cout<<"\nerror in filling image array";
+    if(av_write_frame(muxContext, pkt) < 0)
+        srLog(SR_LOG_ERROR, "error in writing frame on stream %d", stream);
+    if(uploadFollowing && !uploadPath.empty() && avio_tell(muxContext->pb) - uploadAdvanced >= UPLOAD_PART_SIZE) {
+        //a part goes as soon as the muxer has written it: out of the AVIOContext, on its way to the file
+        avio_flush(muxContext->pb);
+        uploadAdvanced = avio_tell(muxContext->pb);
+        uploader->advance(uploadAdvanced);
     }
+    if(indexed)
+        indexKeyframe(pkt, before);
+}
 
+/**
+ * activityGate() tells whether the packets are written, with settings._activitygate: while the screen changed
+ * less than settings._activitytail seconds ago. The other packets go to the pre-roll buffer, which keeps the last
+ * settings._activitypreroll seconds of whole GOPs: when the activity starts again it is written first, from its
+ * keyframe, and the packet at hand follows in the same GOP. Nothing is reopened, the file keeps the timeline of
+ * the capture and the idle spans play as the last frame written.\n
+ * The encoder runs all along to fill the pre-roll; with settings._skipstatic, or settings._vfr, an idle screen is not
+ * encoded either.
+ * @Note MuxerThread only
+ */
+bool ScreenRecorder::activityGate() {
+    int64_t last = lastActivity.load(std::memory_order_relaxed);
+    bool active = last != AV_NOPTS_VALUE &&
+                  captureClock.elapsed(av_gettime()) - last <= (int64_t) settings._activitytail * 1000000;
+    if(active == activityOpen)
+        return active;
+    activityOpen = active;
+    if(!active) {
+        srLog(SR_LOG_INFO, "[MuxerThread] no activity for %d s, the output waits for the next one", settings._activitytail);
+        //the pre-roll starts on a keyframe: the sooner there is one the sooner it holds something to write
+        keyframeRequested = true;
+        return false;
+    }
+    activityEvents++;
+    SRReplayStats preroll = prerollBuffer->stats();
+    srLog(SR_LOG_INFO, "[MuxerThread] activity, writing from %.1f s before it", preroll.duration / 1000000.0);
+    //in mux order already, with lower timestamps than the packet at hand
+    prerollBuffer->drain([this](AVPacket *pkt) {
+        if(muxContext)
+            writeMuxPacket(pkt, (unsigned int) pkt->stream_index);
+    });
+    return true;
+}
 
-    SwsContext* swsCtx_ ;
-
-    // Allocate and return swsContext.
-    // a pointer to an allocated context, or NULL in case of error
-    // Deprecated : Use sws_getCachedContext() instead.
-    swsCtx_ = sws_getContext(inVCodecContext->width,
-                             inVCodecContext->height,
-                             inVCodecContext->pix_fmt,
-                             outVCodecContext->width,
-                             outVCodecContext->height,
-                             outVCodecContext->pix_fmt,
-                             SWS_BICUBIC, NULL, NULL, NULL);
-
-
+/**
+ * setResamplerProfile() sets the options of a resampler not initialized yet for a settings._resampler profile
+ */
+static void setResamplerProfile(SwrContext *ctx, SRResampler profile) {
+    switch (profile) {
+        case SR_RESAMPLER_FAST:
+            //8 taps and 256 interpolated phases instead of 32 taps and 1024 phases: a quarter of the multiplies
+            av_opt_set_int(ctx, "filter_size", 8, 0);
+            av_opt_set_int(ctx, "phase_shift", 8, 0);
+            av_opt_set_int(ctx, "linear_interp", 1, 0);
+            break;
+        case SR_RESAMPLER_HIGH:
+            if (resamplerHasSoxr()) {
+                av_opt_set_int(ctx, "resampler", SWR_ENGINE_SOXR, 0);
+                av_opt_set_int(ctx, "precision", 28, 0);
+            } else {
+                av_opt_set_int(ctx, "filter_size", 64, 0);
+                av_opt_set_int(ctx, "phase_shift", 12, 0);
+                av_opt_set_int(ctx, "linear_interp", 1, 0);
+                av_opt_set_double(ctx, "cutoff", 0.97, 0);
+            }
+            break;
+        default:
+            break;
+    }
+}
 
-    std::unique_lock<std::mutex> r_lock(r_mutex, std::defer_lock);
+/**
+ * resample() is swr_convert(), its time and output counted in the resampler stats of the track
+ */
+int ScreenRecorder::resample(AudioTrack &a, SwrContext *resampleContext, uint8_t **out, int outCount,
+                             const uint8_t **in, int inCount) {
+    int64_t started = av_gettime_relative();
+    int got = swr_convert(resampleContext, out, outCount, in, inCount);
+    a.resampleTime.fetch_add(av_gettime_relative() - started, std::memory_order_relaxed);
+    if(got > 0)
+        a.resampledSamples.fetch_add((uint64_t) got, std::memory_order_relaxed);
+    return got;
+}
 
+void ScreenRecorder::captureAudio(AudioTrack &a) {
+    int ret;
+    if(!realtimeThread(settings._realtime, settings._rtpriority))
+        srLog(SR_LOG_WARNING, "[AudioThread] cannot switch to real-time scheduling, running at normal priority");
+    if(tracer)
+        tracer->nameThread("AudioThread " + std::to_string(a.outAudioStreamIndex));
+    //the packets and the frame of the whole capture, unreferenced after each use
+    SRPacketPtr inHolder(av_packet_alloc()), outHolder(av_packet_alloc());
+    SRFramePtr frameHolder(av_frame_alloc());
+    AVPacket *inPacket = inHolder.get(), *outPacket = outHolder.get();
+    AVFrame *rawFrame = frameHolder.get();
+    if(!inPacket || !outPacket || !rawFrame) {
+        failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate the packets of the audio capture");
+        threadReady();
+        muxQueues[a.outAudioStreamIndex]->close();
+        return;
+    }
 
-    cout<<"\n\n[VideoThread] thread started!";
+    //init the resampler
+    SRSwrPtr resampler(swr_alloc_set_opts(nullptr,
+                                          av_get_default_channel_layout(a.outACodecContext->channels),
+                                          a.outACodecContext->sample_fmt,
+                                          a.outACodecContext->sample_rate,
+                                          av_get_default_channel_layout(a.inACodecContext->channels),
+                                          a.inACodecContext->sample_fmt,
+                                          a.inACodecContext->sample_rate,
+                                          0, NULL));
+    SwrContext *resampleContext = resampler.get();
+    if(!resampleContext){
+        failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate the resample context");
+        threadReady();
+        muxQueues[a.outAudioStreamIndex]->close();
+        return;
+    }
+    setResamplerProfile(resampleContext, settings._resampler);
+    if ((swr_init(resampleContext)) < 0) {
+        failCapture(SR_ERROR_AUDIO_DEVICE, 0, "Could not open resample context");
+        threadReady();
+        muxQueues[a.outAudioStreamIndex]->close();
+        return;
+    }
+    a.gate.setup(a.inACodecContext->sample_rate);
+    if(settings._audiodsp && (ret = a.dsp.setup(a.outACodecContext->sample_rate, a.outACodecContext->channels)) < 0)
+        srLog(SR_LOG_WARNING, "[AudioThread] cannot set up the audio clean-up of track %d (%d), recorded as it is", a.index, ret);
+    a.convertible = a.inACodecContext->sample_rate == a.outACodecContext->sample_rate &&
+                    a.inACodecContext->channels <= AV_NUM_DATA_POINTERS &&
+                    SRAudioConvert::supported(a.inACodecContext->sample_fmt, a.outACodecContext->sample_fmt);
+    if(a.convertible)
+        srLog(SR_LOG_INFO, "[AudioThread] track %d: %s to %s at %d Hz, the resampler only compensates the drift", a.index,
+              av_get_sample_fmt_name(a.inACodecContext->sample_fmt), av_get_sample_fmt_name(a.outACodecContext->sample_fmt),
+              a.outACodecContext->sample_rate);
+    srLog(SR_LOG_INFO, "[AudioThread] thread started!");
+    threadReady();
+    if(a.reader)
+        startAudioReader(a);
     while(true) {
 
-        /*checks if capture is enabled or stopped*/
-        r_lock.lock();
-        r_cv.wait(r_lock, [&](){return (captureSwitch || killSwitch);});
-        if(killSwitch) {
-            cout << "\n[VideoThread] thread stopped!";
-            /*  ret = av_write_trailer(outAVFormatContext);
-              if( ret < 0)
-              {
-                  cout<<"\nerror in writing av trailer";
-                  exit(1);
-              }*/
+        if(!waitRunning()) {
+            if(a.reader)
+                a.reader->stop();
+            flushAudio(a, outPacket, resampleContext);
+            srLog(SR_LOG_INFO, "[AudioThread] thread stopped!");
+            muxQueues[a.outAudioStreamIndex]->close();
             return;
         }
-        r_lock.unlock();
-
 
 
-        if(av_read_frame(inVFormatContext, inPacket) >= 0 && inPacket->stream_index == inVideoStreamIndex) {
-            //decode video routine
-            
-            av_packet_rescale_ts(inPacket,  inVFormatContext->streams[inVideoStreamIndex]->time_base,inVCodecContext->time_base);
-            if((ret = avcodec_send_packet(inVCodecContext, inPacket)) < 0){
-                cout << "Cannot decode current video packet " <<  ret;
+        bool captured;
+        if(a.audioGrabber) {
+            //the native back-ends wait for the next chunk, EAGAIN is a silent source, any other error a lost device
+            ret = a.audioGrabber->read(inPacket);
+            if(ret < 0 && ret != AVERROR(EAGAIN) && (settings._watchdogtimeout || !settings._exitonerror)) {
+                recoverAudioDevice(a);
+                continue;
+            }
+            if(ret < 0 && ret != AVERROR(EAGAIN)) {
+                failCapture(SR_ERROR_AUDIO_DEVICE, ret, "Cannot record from %s", a.audioGrabber->name());
+                continue;
+            }
+            a.heartbeat.store(av_gettime(), std::memory_order_relaxed);
+            a.lost.store(false, std::memory_order_relaxed);
+            captured = ret >= 0;
+        } else {
+            //a reader waits for the next chunk itself
+            ret = a.reader ? a.reader->read(inPacket, (int64_t) settings._audiofragment * 1000)
+                           : av_read_frame(a.inAFormatContext, inPacket);
+            //a device that failed, or that the watchdog found silent, is opened again while the video goes on
+            if((settings._watchdogtimeout || !settings._exitonerror) &&
+               ((ret < 0 && ret != AVERROR(EAGAIN)) || a.lost.load(std::memory_order_relaxed))) {
+                av_packet_unref(inPacket);
+                recoverAudioDevice(a);
+                continue;
+            }
+            if(ret >= 0 && !a.reader)
+                a.heartbeat.store(av_gettime(), std::memory_order_relaxed);
+            captured = ret >= 0 && inPacket->stream_index == a.inAudioStreamIndex;
+            //the non-blocking demuxers answer EAGAIN until the next period: wait for it instead of spinning
+            if(ret < 0 && !a.reader)
+                av_usleep(settings._audiofragment * 500);
+        }
+        if(captured) {
+            //samples the device buffered while paused belong to the cut out interval
+            if(inPacket->pts != AV_NOPTS_VALUE &&
+               av_rescale_q(inPacket->pts, audioSourceTimeBase(a), AV_TIME_BASE_Q) <
+               resumeWall.load(std::memory_order_relaxed)) {
+                audioStalePackets++;
+                av_packet_unref(inPacket);
+                continue;
+            }
+            //decode video routing
+            av_packet_rescale_ts(outPacket, audioSourceTimeBase(a), a.inACodecContext->time_base);
+            //interleaved PCM packets are the frame already: wrapped by reference, the decoder is skipped
+            bool decoding = wrapRawAudio(rawFrame, inPacket, a.inACodecContext) < 0;
+            if(decoding && (ret = avcodec_send_packet(a.inACodecContext, inPacket)) < 0){
+                srLog(SR_LOG_WARNING, "Cannot decode current audio packet %d", ret);
+                av_packet_unref(inPacket);
                 continue;
             }
+            ret = 0;
             while (ret >= 0) {
-                ret = avcodec_receive_frame(inVCodecContext, rawFrame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-                    break;
-                else if (ret < 0) {
-                    fprintf(stderr, "Error during decoding\n");
-                    exit(1);
-                }
-                //raw frame ready
-                if(outAVFormatContext->streams[outVideoStreamIndex]->start_time <= 0) {
-                    outAVFormatContext->streams[outVideoStreamIndex]->start_time = rawFrame->pts;
-                }
-
-                
-                outPacket->data =  nullptr;    // packet data will be allocated by the encoder
-                outPacket->size = 0;
-
-                /*initializing scaleFrame */
-                scaledFrame->width = outVCodecContext->width;
-                scaledFrame->height = outVCodecContext->height;
-                scaledFrame->format = outVCodecContext->pix_fmt;
-                scaledFrame->pts = rawFrame->pts;
-                scaledFrame->pkt_dts=rawFrame->pkt_dts;
-                scaledFrame->best_effort_timestamp = rawFrame->best_effort_timestamp;
-                //av_frame_get_buffer(scaledFrame, 0);
-
-                sws_scale(swsCtx_, rawFrame->data, rawFrame->linesize,0, inVCodecContext->height, scaledFrame->data, scaledFrame->linesize);
-
-                if(avcodec_send_frame(outVCodecContext, scaledFrame)< 0){
-                    cout << "Cannot encode current video packet " << AVERROR(EAGAIN);
-                    exit(1);
-                }
-                while(ret>=0){
-                    ret = avcodec_receive_packet(outVCodecContext, outPacket);
+                if(decoding) {
+                    ret = avcodec_receive_frame(a.inACodecContext, rawFrame);
                     if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
                         break;
                     else if (ret < 0) {
-                        fprintf(stderr, "Error during encoding\n");
-                        exit(1);
+                        //the samples of the corrupt packet are a hole syncAudioClock() fills
+                        srLog(SR_LOG_WARNING, "[AudioThread] error during decoding %d, chunk dropped", ret);
+                        avcodec_flush_buffers(a.inACodecContext);
+                        break;
                     }
-                    //outPacket ready
-                    if(outPacket->pts != AV_NOPTS_VALUE)
-                        outPacket->pts = av_rescale_q(outPacket->pts, outVCodecContext->time_base,  outAVFormatContext->streams[outVideoStreamIndex]->time_base);
-                    if(outPacket->dts != AV_NOPTS_VALUE)
-                        outPacket->dts = av_rescale_q(outPacket->dts, outVCodecContext->time_base, outAVFormatContext->streams[outVideoStreamIndex]->time_base);
-
-                    outPacket->stream_index = outVideoStreamIndex;
-                    w_lock.lock();
-                    if(av_interleaved_write_frame(outAVFormatContext , outPacket) != 0)
-                    {
-                        cout<<"\nerror in writing video frame";
+                }
+                //the chunks before the first video frame are left out, the audio begins with it
+                if(!alignAudioStart(a, rawFrame)) {
+                    if(!decoding)
+                        break;
+                    continue;
+                }
+                int64_t gap = syncAudioClock(a, rawFrame, resampleContext);
+                if(gap > 0) {
+                    //the samples swr holds come before the hole
+                    drainResampler(a, resampleContext, outPacket);
+                    insertAudioSilence(a, gap, outPacket);
+                }
+                if(settings._silencegate && a.gate.silent(rawFrame)) {
+                    gateAudioChunk(a, rawFrame, resampleContext, outPacket);
+                } else if(a.convertible && !a.compensating && rawFrame->format == a.inACodecContext->sample_fmt) {
+                    a.gated = false;
+                    convertAudioChunk(a, rawFrame, resampleContext, outPacket);
+                } else {
+                    a.gated = false;
+                    a.direct = false;
+                    //no output space: swr keeps the chunk, encodeResampled() converts it into the encoder frames
+                    if(resample(a, resampleContext, nullptr, 0,
+                                (const uint8_t **)rawFrame->extended_data, rawFrame->nb_samples) < 0) {
+                        failCapture(SR_ERROR_AUDIO_DEVICE, 0, "Cannot resample the audio");
+                        break;
                     }
-                    w_lock.unlock();
-                    av_packet_unref(outPacket);
-                } // got_picture
-                av_packet_unref(outPacket);
+                    encodeResampled(a, resampleContext, outPacket, true);
+                }
+                ret = 0;
+                //a wrapped packet is a single frame
+                if(!decoding)
+                    break;
             }
+        } else if(av_audio_fifo_size(a.fifo) + swr_get_out_samples(resampleContext, 0) < a.outACodecContext->frame_size) {
+            //nothing captured and not enough samples for the encoder
+            audioUnderruns++;
         }
+        av_packet_unref(inPacket);
+        sendAudioPackets(a);
 
     }
 
 }
 
-static int64_t pts = 0;
-
-void ScreenRecorder::captureAudio() {
+/**
+ * encodeAudioFifo() encodes every full encoder frame of the audio ring and queues the packets for the muxer
+ */
+void ScreenRecorder::encodeAudioFifo(AudioTrack &a, AVPacket *outPacket) {
     int ret;
-    AVPacket *inPacket, *outPacket;
-    AVFrame *rawFrame, *scaledFrame;
-    uint8_t  **resampledData;
-    //allocate space for a packet
-    inPacket = (AVPacket *) av_malloc(sizeof (AVPacket));
-    if(!inPacket) {
-        cout << "\nCannot allocate an AVPacket for encoded video";
-        exit(1);
+    while (av_audio_fifo_size(a.fifo) >= a.outACodecContext->frame_size){
+        //a frame per send: the encoder may still reference the previous one
+        AVFrame *scaledFrame = a.audioPool.get();
+        if(!scaledFrame) {
+            failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVFrame for encoded audio");
+            break;
+        }
+        av_audio_fifo_read(a.fifo, (void **)(scaledFrame->data), a.outACodecContext->frame_size);
+        encodeAudioFrame(a, scaledFrame, outPacket);
     }
-    av_init_packet(inPacket);
+    av_packet_unref(outPacket);
+}
 
-    //allocate space for a packet
-    rawFrame = av_frame_alloc();
-    if(!rawFrame) {
-        cout << "\nCannot allocate an AVPacket for encoded video";
-        exit(1);
+/**
+ * encodeAudioFrame() stamps a full frame of the audio pool with the sample count, encodes it and gives it back
+ */
+void ScreenRecorder::encodeAudioFrame(AudioTrack &a, AVFrame *frame, AVPacket *outPacket) {
+    frame->pts = timelines[a.outAudioStreamIndex].stampSamples(a.audioSamples, a.outACodecContext->sample_rate);
+    a.audioSamples += frame->nb_samples;
+    //before the gate: the digital silence stays zero through the stages, the tail of the sound before it does not
+    a.dsp.process(frame->data, frame->nb_samples, a.outACodecContext->sample_fmt);
+    if(settings._silencegate && repeatSilence(a, frame)) {
+        a.audioPool.release(frame);
+        return;
     }
-
-    outPacket = (AVPacket *) av_malloc(sizeof (AVPacket));
-    if(!outPacket) {
-        cout << "\nCannot allocate an AVPacket for encoded video";
-        exit(1);
+    //the id of an audio frame in the trace is the capture time of its first sample
+    int64_t traceId = tracer ? av_rescale_q(frame->pts, a.outACodecContext->time_base, AV_TIME_BASE_Q) : -1;
+    if(tracer)
+        tracer->encoded(a.outAudioStreamIndex, frame->pts, traceId);
+    int64_t encodeStart = SRFrameClock::now();
+    int ret = avcodec_send_frame(a.outACodecContext, frame);
+    a.framesSent++;
+    a.audioPool.release(frame);
+    if(ret < 0){
+        failCapture(SR_ERROR_ENCODER, ret, "Cannot encode current audio packet");
+        return;
     }
+    receiveAudioPackets(a, outPacket);
+    if(tracer)
+        tracer->record(SR_STAGE_ENCODE, traceId, encodeStart, SRFrameClock::now());
+}
 
-
-
-    //init the resampler
-    SwrContext* resampleContext = nullptr;
-    resampleContext = swr_alloc_set_opts(resampleContext,
-                                         av_get_default_channel_layout(outACodecContext->channels),
-                                         outACodecContext->sample_fmt,
-                                         outACodecContext->sample_rate,
-                                         av_get_default_channel_layout(inACodecContext->channels),
-                                         inACodecContext->sample_fmt,
-                                         inACodecContext->sample_rate,
-                                         0, NULL);
-    if(!resampleContext){
-        cout << "\nCannot allocate the resample context";
-        exit(1);
-    }
-    if ((swr_init(resampleContext)) < 0) {
-        fprintf(stderr, "Could not open resample context\n");
-                    swr_free(&resampleContext);
-                    exit(1);
+/**
+ * encodeResampled() converts the samples swr holds straight into frames of the audio pool and encodes them:
+ * swr keeps what is short of a frame in its own buffer, so each sample is copied once, by swr_convert().\n
+ * The ring only holds what starts the next frame: the silence of insertAudioSilence(), and the samples of a frame
+ * swr could not fill (swr_get_out_samples() is an upper bound when it resamples).
+ * @param batched waits for settings._audiobatch frames of samples, then encodes them in one go
+ */
+void ScreenRecorder::encodeResampled(AudioTrack &a, SwrContext *resampleContext, AVPacket *outPacket, bool batched) {
+    const int frameSize = a.outACodecContext->frame_size;
+    const int planar = av_sample_fmt_is_planar(a.outACodecContext->sample_fmt);
+    const int step = av_get_bytes_per_sample(a.outACodecContext->sample_fmt) * (planar ? 1 : a.outACodecContext->channels);
+
+    //the samples of a batch wait in swr, which holds them anyway: the encoder and the muxer wake up once for all
+    int batch = settings._profile == SR_PROFILE_LIVE ? 1 : FFMAX((int) settings._audiobatch, 1);
+    if(batched && av_audio_fifo_size(a.fifo) + swr_get_out_samples(resampleContext, 0) < (int64_t) frameSize * batch)
+        return;
+    encodeAudioFifo(a, outPacket);
+    while (av_audio_fifo_size(a.fifo) + swr_get_out_samples(resampleContext, 0) >= frameSize) {
+        AVFrame *frame = a.audioPool.get();
+        if(!frame) {
+            failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVFrame for encoded audio");
+            break;
+        }
+        int head = av_audio_fifo_read(a.fifo, (void **) frame->data, av_audio_fifo_size(a.fifo));
+        uint8_t *tail[AV_NUM_DATA_POINTERS];
+        for (int i = 0; i < AV_NUM_DATA_POINTERS; i++)
+            tail[i] = frame->data[i] ? frame->data[i] + (int64_t) head * step : nullptr;
+        //no input but not a null one: a null input would flush the filter of the resampler
+        int got = resample(a, resampleContext, tail, frameSize - head, (const uint8_t **) frame->data, 0);
+        if(got < 0) {
+            a.audioPool.release(frame);
+            failCapture(SR_ERROR_AUDIO_DEVICE, got, "Cannot resample the audio");
+            break;
+        }
+        if(head + got < frameSize) {
+            add_samples_to_fifo(a, frame->data, head + got);
+            a.audioPool.release(frame);
+            break;
+        }
+        encodeAudioFrame(a, frame, outPacket);
     }
-    std::unique_lock<std::mutex> r_lock(r_mutex, std::defer_lock);
-
-    cout<<"\n\n[AudioThread] thread started!";
-    while(true) {
+    av_packet_unref(outPacket);
+}
 
-        r_lock.lock();
-        r_cv.wait(r_lock, [&](){return (captureSwitch || killSwitch);});
+/**
+ * drainResampler() encodes the full frames swr holds and moves the rest to the ring,
+ * so that samples written to the ring afterwards follow them
+ */
+void ScreenRecorder::drainResampler(AudioTrack &a, SwrContext *resampleContext, AVPacket *outPacket) {
+    encodeResampled(a, resampleContext, outPacket);
+    AVFrame *frame = a.audioPool.get();
+    if(!frame)
+        return;
+    int got = resample(a, resampleContext, frame->data, a.outACodecContext->frame_size, (const uint8_t **) frame->data, 0);
+    if(got > 0)
+        add_samples_to_fifo(a, frame->data, got);
+    a.audioPool.release(frame);
+}
 
-        if(killSwitch) {
-            cout << "\n[AudioThread] thread stopped!";
-            return;
+/**
+ * receiveAudioPackets() moves the packets the audio encoder has ready to the pending ones of the track,
+ * sendAudioPackets() hands them to the muxer
+ * @return the number of packets
+ */
+int ScreenRecorder::receiveAudioPackets(AudioTrack &a, AVPacket *outPacket) {
+    int count = 0;
+    while(true) {
+        int ret = avcodec_receive_packet(a.outACodecContext, outPacket);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            break;
+        else if (ret < 0) {
+            failCapture(SR_ERROR_ENCODER, ret, "Error during encoding");
+            break;
         }
-
-        r_lock.unlock();
-
-
-        if(av_read_frame(inAFormatContext, inPacket) >= 0 && inPacket->stream_index == inAudioStreamIndex) {
-            //decode video routing
-            av_packet_rescale_ts(outPacket,  inAFormatContext->streams[inAudioStreamIndex]->time_base, inACodecContext->time_base);
-            if((ret = avcodec_send_packet(inACodecContext, inPacket)) < 0){
-                cout << "Cannot decode current video packet " <<  ret;
-                continue;
+        //outPacket ready
+        if(settings._silencegate) {
+            if(a.stalePackets > 0) {
+                //silence the repeated packets already stand for: it goes after them
+                outPacket->pts = outPacket->dts = a.nextSilentPts;
+                a.stalePackets--;
+            } else if(a.zeroRun && a.packetsReceived >= a.zeroStart + 2 && !a.silentPacket->size) {
+                //two frames into the silence: no overlap with the sound before it left in the packet
+                av_packet_ref(a.silentPacket.get(), outPacket);
             }
-            while (ret >= 0) {
-                ret = avcodec_receive_frame(inACodecContext, rawFrame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-                    break;
-                else if (ret < 0) {
-                    fprintf(stderr, "Error during decoding\n");
-                    exit(1);
-                }
-                if(outAVFormatContext->streams[outAudioStreamIndex]->start_time <= 0) {
-                    outAVFormatContext->streams[outAudioStreamIndex]->start_time = rawFrame->pts;
-                }
-                initConvertedSamples(&resampledData, outACodecContext, rawFrame->nb_samples);
+            a.packetsReceived++;
+            a.nextSilentPts = outPacket->pts + (outPacket->duration > 0 ? outPacket->duration : a.outACodecContext->frame_size);
+        }
+        int64_t encoderPts = outPacket->pts;
+        timelines[a.outAudioStreamIndex].toStream(outPacket);
+        if(tracer)
+            tracer->packetized(a.outAudioStreamIndex, encoderPts, outPacket->pts);
+
+        outPacket->stream_index = a.outAudioStreamIndex;
+        AVPacket *queued = packetPool.get();
+        if(!queued) {
+            av_packet_unref(outPacket);
+            failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVPacket for the muxer");
+            break;
+        }
+        av_packet_move_ref(queued, outPacket);
+        a.pending.push_back(queued);
+        count++;
+    }
+    return count;
+}
 
-                swr_convert(resampleContext,
-                            resampledData, rawFrame->nb_samples,
-                            (const uint8_t **)rawFrame->extended_data, rawFrame->nb_samples);
+/**
+ * sendAudioPackets() queues the pending packets of the track for the muxer in one push
+ */
+void ScreenRecorder::sendAudioPackets(AudioTrack &a) {
+    queuePackets(a.pending.data(), (int) a.pending.size());
+    a.pending.clear();
+}
 
-                add_samples_to_fifo(resampledData,rawFrame->nb_samples);
+/**
+ * flushAudio() encodes what is left in the resampler and the audio ring, padding the last frame with silence,
+ * and drains the encoder: the recording keeps the audio captured up to endCapture()
+ */
+void ScreenRecorder::flushAudio(AudioTrack &a, AVPacket *outPacket, SwrContext *resampleContext) {
+    if(drainExpired()) {
+        sendAudioPackets(a);
+        return;
+    }
+    drainResampler(a, resampleContext, outPacket);
+    const int frameSize = a.outACodecContext->frame_size;
+    //the clean-up stage still holds its last latency() samples: as much silence pushes them out
+    int left = av_audio_fifo_size(a.fifo) + a.dsp.latency();
+    int pad = a.dsp.latency() + (frameSize > 0 && left % frameSize ? frameSize - left % frameSize : 0);
+    AVFrame *silence = pad > 0 ? a.audioPool.get() : nullptr;
+    if(silence) {
+        int chunk = frameSize > 0 ? frameSize : pad;
+        av_samples_set_silence(silence->data, 0, chunk, a.outACodecContext->channels, a.outACodecContext->sample_fmt);
+        for(; pad > 0; pad -= chunk) {
+            av_audio_fifo_write(a.fifo, (void **) silence->data, FFMIN(pad, chunk));
+            encodeAudioFifo(a, outPacket);
+        }
+        a.audioPool.release(silence);
+    }
+    encodeAudioFifo(a, outPacket);
+    if(avcodec_send_frame(a.outACodecContext, nullptr) >= 0)
+        packetsFlushed += receiveAudioPackets(a, outPacket);
+    sendAudioPackets(a);
+}
 
-                //raw frame ready
-                av_init_packet(outPacket);
-                outPacket->data = nullptr;    // packet data will be allocated by the encoder
-                outPacket->size = 0;
+/**
+ * insertAudioSilence() fills a hole of the audio timeline with silent samples, encoding as it goes
+ * so that a long gap never overflows the audio ring.
+ */
+void ScreenRecorder::insertAudioSilence(AudioTrack &a, int64_t samples, AVPacket *outPacket) {
+    const int frameSize = a.outACodecContext->frame_size;
+    AVFrame *silence = a.audioPool.get();
+    if(!silence) {
+        failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVFrame for audio silence");
+        return;
+    }
+    av_samples_set_silence(silence->data, 0, frameSize, a.outACodecContext->channels, a.outACodecContext->sample_fmt);
+    srLog(SR_LOG_WARNING, "[AudioThread] filling %lld ms of missing audio with silence", (long long) av_rescale(samples, 1000, a.outACodecContext->sample_rate));
+    while(samples > 0) {
+        int n = (int) FFMIN(samples, (int64_t) frameSize);
+        av_audio_fifo_write(a.fifo, (void **) silence->data, n);
+        samples -= n;
+        encodeAudioFifo(a, outPacket);
+        sendAudioPackets(a);
+    }
+    a.audioPool.release(silence);
+}
 
-                const int frame_size = FFMAX(av_audio_fifo_size(fifo), outACodecContext->frame_size);
+/**
+ * convertAudioChunk() converts a chunk straight into the encoder frames with SRAudioConvert, when the device and the
+ * encoder only differ in the sample format: swr would copy it through its own buffers for nothing. The samples swr
+ * still holds come first; swr takes over again while syncAudioClock() compensates the drift.
+ */
+void ScreenRecorder::convertAudioChunk(AudioTrack &a, const AVFrame *rawFrame, SwrContext *resampleContext, AVPacket *outPacket) {
+    if(!a.direct) {
+        drainResampler(a, resampleContext, outPacket);
+        a.direct = true;
+    }
+    const int frameSize = a.outACodecContext->frame_size;
+    const int channels = a.outACodecContext->channels;
+    const AVSampleFormat in = (AVSampleFormat) rawFrame->format, out = a.outACodecContext->sample_fmt;
+
+    //the samples of a batch wait in the ring: the encoder and the muxer wake up once for all
+    int batch = settings._profile == SR_PROFILE_LIVE ? 1 : FFMAX((int) settings._audiobatch, 1);
+    bool waiting = av_audio_fifo_size(a.fifo) + rawFrame->nb_samples < (int64_t) frameSize * batch;
+    if(!waiting)
+        encodeAudioFifo(a, outPacket);
+    int done = 0;
+    while(done < rawFrame->nb_samples) {
+        AVFrame *frame = a.audioPool.get();
+        if(!frame) {
+            failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVFrame for encoded audio");
+            break;
+        }
+        //the start of the frame left in the ring, then the chunk converted behind it
+        int head = waiting ? 0 : av_audio_fifo_read(a.fifo, (void **) frame->data, av_audio_fifo_size(a.fifo));
+        int n = FFMIN(frameSize - head, rawFrame->nb_samples - done);
+        SRAudioConvert::convert(frame->data, head, rawFrame->extended_data, done, n, channels, in, out);
+        done += n;
+        if(waiting || head + n < frameSize) {
+            add_samples_to_fifo(a, frame->data, head + n);
+            a.audioPool.release(frame);
+            continue;
+        }
+        encodeAudioFrame(a, frame, outPacket);
+    }
+    av_packet_unref(outPacket);
+}
 
-                scaledFrame = av_frame_alloc();
-                if(!scaledFrame) {
-                    cout << "\nCannot allocate an AVPacket for encoded video";
-                    exit(1);
-                }
+/**
+ * gateAudioChunk() writes a chunk of the closed gate of settings._silencegate to the ring as digital silence of the
+ * same length, without going through the resampler; the samples swr still holds come first. The drift
+ * compensation of syncAudioClock() is left out while the gate is closed, it resumes with the sound.
+ */
+void ScreenRecorder::gateAudioChunk(AudioTrack &a, const AVFrame *rawFrame, SwrContext *resampleContext, AVPacket *outPacket) {
+    if(!a.gated) {
+        drainResampler(a, resampleContext, outPacket);
+        a.gated = true;
+        a.silentIn = a.silentOut = 0;
+    }
+    //rounded on the whole run, not per chunk: 44.1 kHz chunks into 48 kHz frames do not drift
+    a.silentIn += rawFrame->nb_samples;
+    int64_t samples = av_rescale(a.silentIn, a.outACodecContext->sample_rate, a.inACodecContext->sample_rate) - a.silentOut;
+    a.silentOut += samples;
+    a.gatedSamples += samples;
+
+    const int frameSize = a.outACodecContext->frame_size;
+    int batch = settings._profile == SR_PROFILE_LIVE ? 1 : FFMAX((int) settings._audiobatch, 1);
+    AVFrame *silence = a.audioPool.get();
+    if(!silence) {
+        failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVFrame for audio silence");
+        return;
+    }
+    av_samples_set_silence(silence->data, 0, frameSize, a.outACodecContext->channels, a.outACodecContext->sample_fmt);
+    while(samples > 0) {
+        int n = (int) FFMIN(samples, (int64_t) frameSize);
+        add_samples_to_fifo(a, silence->data, n);
+        samples -= n;
+        if(av_audio_fifo_size(a.fifo) >= frameSize * batch)
+            encodeAudioFifo(a, outPacket);
+    }
+    a.audioPool.release(silence);
+}
 
-                scaledFrame->nb_samples     = outACodecContext->frame_size;
-                scaledFrame->channel_layout = outACodecContext->channel_layout;
-                scaledFrame->format         = outACodecContext->sample_fmt;
-                scaledFrame->sample_rate    = outACodecContext->sample_rate;
-               // scaledFrame->best_effort_timestamp = rawFrame->best_effort_timestamp;
-               // scaledFrame->pts = rawFrame->pts;
-                av_frame_get_buffer(scaledFrame,0);
-
-                while (av_audio_fifo_size(fifo) >= outACodecContext->frame_size){
-                    ret = av_audio_fifo_read(fifo, (void **)(scaledFrame->data), outACodecContext->frame_size);
-                    scaledFrame->pts = pts;
-                    pts += scaledFrame->nb_samples;
-                    if(avcodec_send_frame(outACodecContext, scaledFrame) < 0){
-                        cout << "Cannot encode current audio packet ";
-                        exit(1);
-                    }
-                    while(ret>=0){
-                        ret = avcodec_receive_packet(outACodecContext, outPacket);
-                        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-                            break;
-                        else if (ret < 0) {
-                            fprintf(stderr, "Error during encoding\n");
-                            exit(1);
-                        }
-                        //outPacket ready
-                        av_packet_rescale_ts(outPacket, outACodecContext->time_base,  outAVFormatContext->streams[outAudioStreamIndex]->time_base);
-
-
-                        outPacket->stream_index = outAudioStreamIndex;
-
-                        w_lock.lock();
-                        if(av_interleaved_write_frame(outAVFormatContext , outPacket) != 0)
-                        {
-                            cout<<"\nerror in writing audio frame";
-                        }else  cout<<"\n writing audio frame";
-                        w_lock.unlock();
-                        av_packet_unref(outPacket);
-                    }
-                    ret=0;
-               }// got_picture
-                av_frame_free(&scaledFrame);
-                av_packet_unref(outPacket);
-                //av_freep(&resampledData[0]);
-               // free(resampledData);
-            }
-        }
+/**
+ * repeatSilence() stands in for the encoder on the frames of digital silence, once a packet of it is known: the
+ * packet is queued again with the pts of the frame. The packets of silence still inside the encoder, for the frames
+ * before, come out after the repeated ones and take the pts that follow them; the timeline stays continuous.
+ * @return true when frame needs no encoding
+ */
+bool ScreenRecorder::repeatSilence(AudioTrack &a, const AVFrame *frame) {
+    if(!SRAudioGate::zero(frame->data, frame->nb_samples, a.outACodecContext->channels,
+                          a.outACodecContext->sample_fmt)) {
+        a.zeroRun = 0;
+        a.repeating = false;
+        av_packet_unref(a.silentPacket.get());
+        return false;
+    }
+    if(a.zeroRun++ == 0)
+        a.zeroStart = a.framesSent;
+    if(!a.silentPacket->size)
+        return false;
+    if(!a.repeating) {
+        a.stalePackets = a.framesSent - a.packetsReceived;
+        a.repeating = true;
+    }
+    AVPacket *queued = packetPool.get();
+    if(!queued || av_packet_ref(queued, a.silentPacket.get()) < 0) {
+        packetPool.release(queued);
+        failCapture(SR_ERROR_MEMORY, AVERROR(ENOMEM), "Cannot allocate an AVPacket for the muxer");
+        return false;
+    }
+    //the packet of the frame stalePackets before this one, as the encoder would stamp it: a jump of the timeline
+    //during the silence is kept
+    queued->pts = queued->dts = FFMAX(a.nextSilentPts, frame->pts - a.stalePackets * a.outACodecContext->frame_size -
+                                                       a.outACodecContext->initial_padding);
+    a.nextSilentPts = queued->pts + (queued->duration > 0 ? queued->duration : a.outACodecContext->frame_size);
+    timelines[a.outAudioStreamIndex].toStream(queued);
+    queued->stream_index = a.outAudioStreamIndex;
+    a.pending.push_back(queued);
+    a.repeatedFrames++;
+    return true;
+}
 
+/**
+ * trimAudioFront() drops the first samples of an audio frame by moving its planes past them, the buffers stay
+ */
+static void trimAudioFront(AVFrame *frame, int samples) {
+    enum AVSampleFormat format = (enum AVSampleFormat) frame->format;
+    bool planar = av_sample_fmt_is_planar(format);
+    int planes = planar ? frame->channels : 1;
+    int offset = samples * av_get_bytes_per_sample(format) * (planar ? 1 : frame->channels);
+    for (int p = 0; p < planes; p++) {
+        frame->extended_data[p] += offset;
+        if(frame->extended_data != frame->data && p < AV_NUM_DATA_POINTERS)
+            frame->data[p] += offset;
     }
+    frame->nb_samples -= samples;
+}
 
+/**
+ * alignAudioStart() starts a track on the first video frame, the t0 of the recording: the chunks captured before
+ * it are dropped and the one it falls in is trimmed to begin with it. Both streams then start at the same time
+ * and the muxer holds no audio while the video gets its first frame through the encoder; without a video frame
+ * after AUDIO_ALIGN_TIMEOUT ms the audio starts alone.
+ * @return false when the whole chunk comes before t0
+ */
+bool ScreenRecorder::alignAudioStart(AudioTrack &a, AVFrame *rawFrame) {
+    if(a.aligned)
+        return true;
+    if(!settings._recvideo) {
+        a.aligned = true;
+        return true;
+    }
+    const int rate = rawFrame->sample_rate > 0 ? rawFrame->sample_rate : a.inACodecContext->sample_rate;
+    AVRational tb = audioSourceTimeBase(a);
+    int64_t wall = rawFrame->pts != AV_NOPTS_VALUE ? av_rescale_q(rawFrame->pts, tb, AV_TIME_BASE_Q) : av_gettime();
+    int64_t start = captureClock.elapsed(wall), end = start + av_rescale(rawFrame->nb_samples, 1000000, rate);
+    int64_t t0 = videoOrigin.load(std::memory_order_acquire);
+    if(t0 == AV_NOPTS_VALUE) {
+        if(start < AUDIO_ALIGN_TIMEOUT * 1000LL) {
+            a.trimmedSamples += rawFrame->nb_samples;
+            return false;
+        }
+        srLog(SR_LOG_WARNING, "[AudioThread] no video frame after %d ms, track %d starts alone", AUDIO_ALIGN_TIMEOUT,
+              a.index);
+        a.aligned = true;
+        return true;
+    }
+    if(end <= t0) {
+        a.trimmedSamples += rawFrame->nb_samples;
+        return false;
+    }
+    if(start < t0) {
+        int cut = (int) FFMIN(av_rescale(t0 - start, rate, 1000000), rawFrame->nb_samples - 1);
+        trimAudioFront(rawFrame, cut);
+        if(rawFrame->pts != AV_NOPTS_VALUE)
+            rawFrame->pts += av_rescale_q(cut, (AVRational){1, rate}, tb);
+        a.trimmedSamples += cut;
+    }
+    a.aligned = true;
+    return true;
 }
 
-int ScreenRecorder::add_samples_to_fifo(uint8_t **converted_input_samples, const int frame_size){
-    int error;
-    /* Make the FIFO as large as it needs to be to hold both,
-     * the old and the new samples. */
-    if ((error = av_audio_fifo_realloc(fifo, av_audio_fifo_size(fifo) + frame_size)) < 0) {
-        fprintf(stderr, "Could not reallocate FIFO\n");
-        return error;
+/**
+ * syncAudioClock() keeps the audio sample count aligned with the capture clock.\n
+ * The first chunk places the audio timeline where the capture started; afterwards the drift of the sound card
+ * clock is measured on every chunk and averaged over AUDIO_DRIFT_SMOOTHING of them. Above AUDIO_MAX_DRIFT ms the
+ * resampler stretches or squeezes the audio by at most AUDIO_MAX_CORRECTION per thousand until it is back in
+ * half of it: no frame is dropped or repeated and no sudden resync is needed, however long the recording.
+ * A hole longer than the resampler can absorb (the device stalled) is skipped, or returned to be filled with
+ * silence under SR_MUX_SILENCE.
+ * @return the number of silent samples to insert before this chunk
+ */
+int64_t ScreenRecorder::syncAudioClock(AudioTrack &a, AVFrame *rawFrame, SwrContext *resampleContext) {
+    const int rate = a.outACodecContext->sample_rate;
+    AVRational tb = audioSourceTimeBase(a);
+    int64_t wall = rawFrame->pts != AV_NOPTS_VALUE ? av_rescale_q(rawFrame->pts, tb, AV_TIME_BASE_Q) : av_gettime();
+    int64_t expected = av_rescale(captureClock.audioTime(wall, rawFrame->nb_samples, a.index), rate, 1000000);
+    //the samples of the clean-up come out later: the timeline starts earlier by as much
+    int64_t pending = av_audio_fifo_size(a.fifo) + swr_get_delay(resampleContext, rate) + a.dsp.latency();
+
+    if(!a.audioClockSynced) {
+        a.audioSamples = FFMAX(expected - pending, 0);
+        a.audioClockSynced = true;
+        return 0;
     }
-    /* Store the new samples in the FIFO buffer. */
-    if (av_audio_fifo_write(fifo, (void **)converted_input_samples, frame_size) < frame_size) {
-        fprintf(stderr, "Could not write data to FIFO\n");
-        return AVERROR_EXIT;
+    int64_t drift = expected - (a.audioSamples + pending);
+    if(drift > rate / 10) {
+        //the hole is filled or skipped at once, the estimate starts over behind it
+        a.driftEstimate = 0;
+        bool recovered = a.recovered;
+        a.recovered = false;
+        if(settings._muxoverflow == SR_MUX_SILENCE || recovered)
+            return drift;
+        a.audioSamples += drift;
+        return 0;
+    }
+    //a chunk is measured when the AudioThread gets to it: the compensation follows the average, not the jitter
+    a.driftEstimate += (drift - a.driftEstimate) / AUDIO_DRIFT_SMOOTHING;
+    int64_t estimate = llrint(a.driftEstimate);
+    int64_t us = av_rescale(estimate, 1000000, rate);
+    a.drift.store(us, std::memory_order_relaxed);
+    if(FFABS(us) > a.maxDrift.load(std::memory_order_relaxed))
+        a.maxDrift.store(FFABS(us), std::memory_order_relaxed);
+
+    //on above AUDIO_MAX_DRIFT, off once back within half of it: the resampler does not toggle around the bound
+    const int64_t bound = (int64_t) rate * AUDIO_MAX_DRIFT / 1000;
+    const int64_t chunk = av_rescale(rawFrame->nb_samples, rate, rawFrame->sample_rate > 0 ? rawFrame->sample_rate : rate);
+    a.compensationLeft -= chunk;
+    if(FFABS(estimate) > bound || (a.compensating && FFABS(estimate) > bound / 2)) {
+        //spread over the next second of output, a few samples per thousand at most
+        const int64_t limit = (int64_t) rate * AUDIO_MAX_CORRECTION / 1000;
+        int64_t correction = av_clip64(estimate, -limit, limit);
+        //a new call starts the second over: only a new correction, or the end of the last one, is handed to swr
+        if(!a.compensating || correction != a.compensation || a.compensationLeft <= 0) {
+            int ret = a.compensationRefused ? AVERROR(ENOSYS) : swr_set_compensation(resampleContext, (int) correction, rate);
+            if(ret < 0 && !a.compensationRefused) {
+                srLog(SR_LOG_WARNING, "[AudioThread %d] the resampler cannot compensate the drift (%d), the timestamps "
+                      "follow the capture clock by steps", a.index, ret);
+                a.compensationRefused = true;
+            }
+            if(a.compensationRefused) {
+                //the correction of the second at once: a step of the timeline, no sample is resampled for it
+                a.audioSamples += correction;
+                a.driftEstimate -= correction;
+                a.compensatedSamples += correction;
+            }
+            a.compensation = correction;
+            a.compensationLeft = rate;
+        }
+        if(!a.compensationRefused)
+            a.compensatedSamples += av_rescale(correction, chunk, rate);
+        a.compensating = true;
+    } else if(a.compensating) {
+        if(!a.compensationRefused)
+            swr_set_compensation(resampleContext, 0, rate);
+        a.compensating = false;
     }
     return 0;
- }
-
+}
 
- int ScreenRecorder::initConvertedSamples(uint8_t ***converted_input_samples,
-                                          AVCodecContext *output_codec_context,
-                                          int frame_size){
-    int error;
-    /* Allocate as many pointers as there are audio channels.
-     * Each pointer will later point to the audio samples of the corresponding
-     * channels (although it may be NULL for interleaved formats).
-     */
-    if (!(*converted_input_samples = (uint8_t **)calloc(output_codec_context->channels,
-                                            sizeof(**converted_input_samples)))) {
-        fprintf(stderr, "Could not allocate converted input sample pointers\n");
-        return AVERROR(ENOMEM);
+/**
+ * add_samples_to_fifo() stores the converted samples in the audio ring.
+ * The ring never grows: when the encoder falls behind by more than the latency budget
+ * the oldest samples are dropped and counted as an overflow.
+ */
+int ScreenRecorder::add_samples_to_fifo(AudioTrack &a, uint8_t **converted_input_samples, const int frame_size){
+    int space = av_audio_fifo_space(a.fifo);
+    if (space < frame_size) {
+        int drop = frame_size - space;
+        if (drop > av_audio_fifo_size(a.fifo))
+            drop = av_audio_fifo_size(a.fifo);
+        av_audio_fifo_drain(a.fifo, drop);
+        audioOverflows++;
+        audioDroppedSamples += drop;
     }
-    /* Allocate memory for the samples of all channels in one consecutive
-     * block for convenience. */
-    if (av_samples_alloc(*converted_input_samples, nullptr,
-                                  output_codec_context->channels,
-                                  frame_size,
-                                  output_codec_context->sample_fmt, 0) < 0) {
-
-        exit(1);
+    /* Store the new samples in the FIFO buffer. */
+    if (av_audio_fifo_write(a.fifo, (void **)converted_input_samples, frame_size) < frame_size) {
+        srLog(SR_LOG_ERROR, "Could not write data to FIFO");
+        return AVERROR_EXIT;
     }
     return 0;
  }
 
 
 /**
- * startCapture() enables Audio and Video capturing threads
+ * startCapture() enables Audio and Video capturing threads: everything is allocated by initThreads(),
+ * only the capture clock origin and the run state are set here
  * @Note is callable only after thread initialization by mean of initThreads();
  */
 void ScreenRecorder::startCapture() {
-    cout<<"\n[MainThread] Capture started";
-    cout<<"\n[MainThread] Capturing audio: " << (settings._recaudio ? "yes" : "no") ;
-    std::lock_guard<std::mutex> r_lock(r_mutex);
-    if (settings._recaudio)
-    init_fifo();
-    captureSwitch = true;
+    startCaptureAt(av_gettime());
+}
+
+void ScreenRecorder::startCaptureAt(int64_t wallTime) {
+    srLog(SR_LOG_INFO, "[MainThread] Capture started, capturing audio: %s", settings._recaudio ? "yes" : "no");
+    resumeWall.store(wallTime, std::memory_order_relaxed);
+    captureClock.start(wallTime);
+    if(tracer)
+        tracer->start();
+    {
+        std::lock_guard<SRMutex> r_lock(r_mutex);
+        captureSwitch.store(true, std::memory_order_release);
+    }
     r_cv.notify_all();
 }
 /**
- * pauseCapture() pauses Audio and Video capturing threads
+ * pauseCapture() pauses Audio and Video capturing threads: they stop reading the devices and block on r_cv.
+ * The paused interval is cut out of the capture clock, so the timestamps go on from where they stopped on resume
  * @Note is callable only after thread initialization by mean of initThreads();
  */
 void ScreenRecorder::pauseCapture() {
-    cout<<"\n[MainThread] Capture paused";
-    std::lock_guard<std::mutex> r_lock(r_mutex);
-    captureSwitch = false;
+    srLog(SR_LOG_INFO, "[MainThread] Capture paused");
+    std::lock_guard<SRMutex> r_lock(r_mutex);
+    if(captureSwitch.load(std::memory_order_relaxed))
+        captureClock.pause(av_gettime());
+    captureSwitch.store(false, std::memory_order_release);
 }
 /**
  * endCapture() ends Audio and Video capturing threads
  * @Note is callable only after thread initialization by mean of initThreads();
  */
 void ScreenRecorder::endCapture() {
-    int ret;
-    cout<<"\n[MainThread] Capture ended";
-    std::lock_guard<std::mutex> r_lock(r_mutex);
-    killSwitch = true;
+    srLog(SR_LOG_INFO, "[MainThread] Capture ended");
+    {
+        std::lock_guard<SRMutex> r_lock(r_mutex);
+        if(!stopRequested) {
+            stopRequested = av_gettime_relative();
+            drainDeadline = stopRequested + (int64_t) settings._shutdowntimeout * 1000;
+        }
+        killSwitch.store(true, std::memory_order_release);
+    }
+    //paused threads are blocked on r_cv
+    r_cv.notify_all();
+}
+
+/**
+ * drainExpired() tells the draining stages to drop what is left instead of converting and encoding it
+ */
+bool ScreenRecorder::drainExpired() const {
+    int64_t deadline = drainDeadline.load(std::memory_order_relaxed);
+    return deadline && av_gettime_relative() > deadline;
+}
+
+/**
+ * finishCapture() waits for the drain started by endCapture(): the grab stops first, the convert and encode
+ * stages flush what is queued in parallel, then the muxer writes the last packets.
+ * Stages still running after settings._shutdowntimeout ms drop their frames, so the wait is bounded.
+ * @Note the destructor calls it, call it earlier to read getShutdownStats() before the trailer is written
+ */
+void ScreenRecorder::finishCapture() {
+    if(settings._recvideo && videoThread.joinable()) {
+        videoThread.join();
+        for (auto &t : convertThreads)
+            t.join();
+        if(producerThread.joinable())
+            producerThread.join();
+        convertTasks.clear();
+        for (auto &rendition : renditionOutputs)
+            rendition->finish();
+        if(videoWall)
+            videoWall->finish();
+        if(snapshots) {
+            snapshots->finish();
+            cout << "\nthumbnails: " << snapshots->writtenSnapshots() << " written, " << snapshots->skippedSnapshots()
+                 << " skipped";
+        }
+    }
+    for (auto &track : audioTracks)
+        if(track->audioThread.joinable()) track->audioThread.join();
+    if(muxerThread.joinable()) {
+        muxerThread.join();
+        //the summaries below are written synchronously, after what the threads logged
+        flushLog();
+        shutdownTime = stopRequested ? av_gettime_relative() - stopRequested : 0;
+        SRShutdownStats stats = getShutdownStats();
+        cout << "\nshutdown: " << stats.framesFlushed << " frames and " << stats.packetsFlushed
+             << " encoder packets flushed, " << stats.framesDropped << " frames dropped at the deadline, "
+             << stats.duration / 1000 << " ms";
+        if(policyDroppedFrames)
+            cout << "\n" << policyDroppedFrames << " frames dropped by the frame-drop policy";
+        if(settings._profile == SR_PROFILE_LIVE && settings._recvideo) {
+            //the budget of the live profile is one frame from capture to the outputs
+            SRLatencyStats latency = videoLatency.snapshot();
+            cout << "\nlive latency: capture to output p50 " << latency.p50 / 1000.0 << " ms, p99 " << latency.p99 / 1000.0
+                 << " ms, " << (double) latency.p99 * settings._fps / 1000000 << " frames";
+        }
+    }
+    if(syncControl) {
+        //the streams have started by now: the file gets their first frames
+        syncControl->close();
+        syncControl.reset();
+        writeSyncFile();
+    }
+    if(statsThread.joinable() || metricsThread.joinable() || watchdogThread.joinable()) {
+        {
+            std::lock_guard<SRMutex> r_lock(r_mutex);
+            statsEnded = true;
+        }
+        r_cv.notify_all();
+        if(statsThread.joinable())
+            statsThread.join();
+        if(metricsThread.joinable())
+            metricsThread.join();
+        if(watchdogThread.joinable())
+            watchdogThread.join();
+    }
+}
+
+SRShutdownStats ScreenRecorder::getShutdownStats() const {
+    return {framesFlushed, framesAbandoned, packetsFlushed, shutdownTime};
+}
 
+/**
+ * waitRunning() is the run-state check of the capture loops.\n
+ * While capturing it costs two relaxed atomic loads, video and audio only take r_mutex
+ * and block on r_cv while the capture is paused.
+ *
+ * @return false once endCapture() has been called
+ */
+bool ScreenRecorder::waitRunning() {
+    if(captureSwitch.load(std::memory_order_relaxed) && !killSwitch.load(std::memory_order_relaxed))
+        return true;
+    std::unique_lock<SRMutex> r_lock(r_mutex);
+    r_cv.wait(r_lock, [&](){return captureSwitch.load(std::memory_order_acquire) || killSwitch.load(std::memory_order_acquire);});
+    return !killSwitch.load(std::memory_order_acquire);
 }
 
+/**
+ * init_fifo() allocates the audio ring of each track once, sized from settings._audiolatency:
+ * it holds the latency budget plus one encoder frame and is kept across pause and resume.
+ */
 int ScreenRecorder::init_fifo()
 {
-    /* Create the FIFO buffer based on the specified output sample format. */
-    if (!(fifo = av_audio_fifo_alloc(outACodecContext->sample_fmt,
-                                      outACodecContext->channels, 1))) {
-        fprintf(stderr, "Could not allocate FIFO\n");
-        return AVERROR(ENOMEM);
+    for (auto &track : audioTracks) {
+        if (track->fifo)
+            continue;
+        const AVCodecContext *enc = track->outACodecContext;
+        int frameSize = enc->frame_size > 0 ? enc->frame_size : 1024;
+        int capacity = (int) av_rescale(settings._audiolatency, enc->sample_rate, 1000) + frameSize;
+        /* Create the FIFO buffer based on the specified output sample format. */
+        if (!(track->fifo = av_audio_fifo_alloc(enc->sample_fmt, enc->channels, capacity))) {
+            fprintf(stderr, "Could not allocate FIFO\n");
+            return AVERROR(ENOMEM);
+        }
     }
     return 0;
 }
\ No newline at end of file
@@ -5,17 +5,77 @@
 #ifndef CPPSCREENRECORDER_SCREENRECORDER_H
 #define CPPSCREENRECORDER_SCREENRECORDER_H
 
+#include <algorithm>
 #include <iostream>
 #include <cstdio>
+#include <cstdarg>
 #include <cstdlib>
 #include <fstream>
 #include <cstring>
 #include <math.h>
 #include <string.h>
-#include <queue>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
 #include <thread>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <map>
+#include "SRRingBuffer.h"
+#include "SRVideoGrabber.h"
+#include "SRAudioGrabber.h"
+#include "SRFrameHash.h"
+#include "SRFramePool.h"
+#include "SRThreads.h"
+#include "SRNuma.h"
+#include "SRScaler.h"
+#include "SRFrameClock.h"
+#include "SRCaptureClock.h"
+#include "SRDemuxReader.h"
+#include "SRVblank.h"
+#include "SRIdleMonitor.h"
+#include "SRPowerMonitor.h"
+#include "SRTimeline.h"
+#include "SRStreamOutput.h"
+#include "SRWebRtcOutput.h"
+#include "SRCapabilityCache.h"
+#include "SRRendition.h"
+#include "SRVideoWall.h"
+#include "SROverlay.h"
+#include "SRWebcam.h"
+#include "SRPacketReorder.h"
+#include "SRPrivacyMask.h"
+#include "SRRegionMap.h"
+#include "SRSharedFrames.h"
+#include "SRSnapshot.h"
+#include "SRAsyncWriter.h"
+#include "SRAudioConvert.h"
+#include "SRAudioDsp.h"
+#include "SRAudioGate.h"
+#include "SRAvPtr.h"
+#include "SRMappedWriter.h"
+#include "SRInputLog.h"
+#include "SRCursorTrack.h"
+#include "SRKeyIndex.h"
+#include "SRPHashIndex.h"
+#include "SRQualityProbe.h"
+#include "SRContentRate.h"
+#include "SRPacketArena.h"
+#include "SRFrameReplay.h"
+#include "SRBurstArena.h"
+#include "SRReplayBuffer.h"
+#include "SRTaskPool.h"
+#include "SRStats.h"
+#include "SRProfiler.h"
+#include "SRTrace.h"
+#include "SRUploader.h"
+#include "SRTileLink.h"
+#include "SRTileView.h"
+#include "SRMetrics.h"
+#include "SRSyncControl.h"
+#include "SRLog.h"
 //#include <semaphore.h>
 //FFMPEG LIBRARIES
 
@@ -40,7 +100,9 @@ extern "C"
 #include "libavutil/opt.h"
 #include "libavutil/pixdesc.h"
 #include "libavutil/file.h"
+#include "libavutil/hwcontext.h"
 #include "libavutil/audio_fifo.h"
+#include "libavutil/cpu.h"
 #include "libswscale/swscale.h"
 #include "libswresample/swresample.h"
 
@@ -50,13 +112,19 @@ extern "C"
 #define VIDEO_URL ("1:none")
 #define AUDIO_SOURCE ("avfoundation")
 #define AUDIO_URL ("none:0")
+#define WEBCAM_SOURCE ("avfoundation")
 #endif
 
 #ifdef __unix__
 #define VIDEO_SOURCE ("x11grab")
 #define VIDEO_URL (":1.0+0,0")
 #define AUDIO_SOURCE ("pulse")
-#define AUDIO_URL ("alsa_input.platform-2300000.pci-pci-0000_00_01.0.analog-stereo")
+#define AUDIO_URL ("default")   //the server default source, settings.audiourl picks another one
+#define KMS_SOURCE ("kmsgrab")
+#define KMS_DEVICE ("/dev/dri/card0")
+#define FBDEV_SOURCE ("fbdev")  //settings.videosource recorded by SRFbdevGrabber, no display server needed
+#define FBDEV_DEVICE ("/dev/fb0")
+#define WEBCAM_SOURCE ("v4l2")
 #endif
 
 #ifdef _WIN32
@@ -64,9 +132,85 @@ extern "C"
 #define VIDEO_URL ("desktop")
 #define AUDIO_SOURCE ("dshow")
 #define AUDIO_URL ("audio=Microfono (USB Microphone)")
+#define WEBCAM_SOURCE ("dshow")
 #endif
 
 #define CAPTURE_BUFFER 10
+#define AAC_BITRATE 96000
+#define AUDIO_ENCODER_RATE 48000   //Hz the audio devices are asked for, AAC and Opus both take it: no resampling on the way
+#define OPUS_BITRATE 64000  //bit/s, transparent stereo for Opus
+#define OPUS_FRAME 10   //ms, default settings._opusframe: a tenth of the AAC frame at 48 kHz
+#define CAPTURE_BUFFER_MIN 3    //frames of each convert queue the memory budget may shrink to
+#define NUMA_HOME_CACHE 64   //buffers whose NUMA node produce() remembers, more than the pools hold
+#define ENCODER_LOOKAHEAD 40    //frames a software encoder looks ahead when it does not tell, the x264 default
+#define REPLAY_MIN_BYTES (16 << 20)     //settings._replaymaxbytes the memory budget may shrink to
+#define ENCODER_ARENA_BYTES (16 << 20)  //free slabs the video encoder keeps, outside the replay mode
+#define BURST_MAX_BYTES (1LL << 30)    //arena of settings._burst without settings._memorybudget
+#define ACTIVITY_PREROLL 5  //s written before the activity that opens settings._activitygate
+#define ACTIVITY_TAIL 10    //s settings._activitygate keeps writing after the last activity
+#define ACTIVITY_MIN_TILES 1    //changed tiles a frame needs to count as activity
+#define PIPELINE_WAIT SR_WAIT_PARK  //wait strategy of the queues between the pipeline stages, SR_WAIT_SLEEP with the power profile
+#define CONVERT_WORKERS 4     //upper bound of the automatic convert worker count
+#define SCALE_BANDS 4   //upper bound of the automatic band count of each convert worker
+#define SCALE_TILE_WIDTH 256    //px of the tiles of settings._scaletiles: 1 KiB of BGRA source per row
+#define SCALE_TILE_HEIGHT 64    //rows of the tiles of settings._scaletiles, the source of a tile fits in L2
+#define SCREEN_GOP_SECONDS 10    //keyframe interval of the screen profile, intra-refresh covers the gaps
+#define X264_PRESET "veryfast"  //SR_CODEC_X264 preset: 1080p60 in real time on 4 cores, sliced
+#define X264_TUNE "zerolatency" //SR_CODEC_X264 tune: no look-ahead, no B-frames, a packet per frame given
+#define SOFTWARE_GOP_SECONDS 2  //keyframe interval of SR_CODEC_X264, VP8 and VP9 with the legacy profile, instead of its GOP of 3
+#define VPX_CPU_USED 8  //SR_CODEC_VP8/VP9 speed at the realtime deadline: 1080p at the H.264 bitrate in real time
+#define VPX_MIN_TILE_WIDTH 256  //px, narrowest tile column of VP9
+#define SCENE_CHANGE 400    //per mille of the tiles a frame changes in for settings._scenekeys to start a GOP on it
+#define SCENE_MIN_INTERVAL 500  //ms between two keyframes of scene changes
+#define SCENE_GOP_STRETCH 4     //settings._scenekeys: the encoder GOP of a static screen, in GOPs of the active one
+#define SCREEN_BITS_PER_PIXEL 0.03  //H.264 budget of the screen profile, HEVC takes 60% of it
+#define SCREEN_PALETTE_COLORS 16    //colors of a 16x16 block that still counts as palette content (anti-aliased text)
+#define SCREEN_LOSSLESS_SHARE 0.8   //palette blocks of the first frame above which SR_CODEC_SCREEN_CONTENT goes lossless
+#define LIVE_REFRESH_SECONDS 1  //intra-refresh period of the live profile, its GOP stays long: a lost packet heals within it
+#define LIVE_SLICES 4   //slices per frame of the live profile, each one leaves the encoder on its own
+#define INTERMEDIATE_SLICES 16  //slices per frame of the intermediate codecs, coded in parallel
+#define AUDIO_MAX_DRIFT 10     //ms of audio/capture clock drift tolerated before resampler compensation
+#define AUDIO_DRIFT_SMOOTHING 32   //chunks the drift estimate averages, the scheduling jitter of the AudioThread cancels out
+#define AUDIO_MAX_CORRECTION 5     //samples per thousand the resampler may add or remove, 0.5%: no audible pitch change
+#define AUDIO_LATENCY 500     //ms of audio the ring can hold before dropping samples
+#define AUDIO_ALIGN_TIMEOUT 2000   //ms of capture the audio waits for the first video frame before starting alone
+#define AUDIO_FRAGMENT 10   //ms of each chunk the native audio grabber asks the server for
+#define AUDIO_BATCH 4   //encoder frames an AudioThread wakeup encodes and queues at once (85 ms of AAC at 48 kHz)
+#define AUDIO_LOWPOWER_FRAGMENT 100    //ms of each chunk of an audio-only _lowpower recording, ten wakeups a second
+#define METRICS_INTERVAL 10000   //ms between two samples of settings.metricsurl, the StatsD flush interval
+#define METRICS_PREFIX ("screenrecorder")
+#define TRACE_DURATION 60   //s of settings.tracefile recorded from the start
+#define FRAGMENT_DURATION 1000   //ms of the longest MP4 fragment of SR_OUTPUT_FRAGMENTED
+#define FRAGMENT_CLUSTER_SIZE (1 << 20)     //bytes of the largest Matroska cluster of SR_OUTPUT_FRAGMENTED
+#define SEGMENT_DURATION 600    //s of each file of SR_OUTPUT_SEGMENTED
+#define LIVE_SEGMENT_DURATION 2000  //ms of each HLS/DASH segment, the latency follows it
+#define LIVE_WINDOW 6   //segments listed by the HLS playlist or the DASH manifest
+#define MOOV_BASE_SIZE 8192     //bytes of the MP4 index before the sample tables
+#define MOOV_TRACK_SIZE 2048    //bytes of the headers of each track: tkhd, edts, mdhd, hdlr, stsd, the roll groups of audio
+#define MOOV_BYTES_PER_SAMPLE 48    //worst case bytes of the sample tables for each packet
+#define SHUTDOWN_TIMEOUT 5000   //ms endCapture() gives the stages to flush before they start dropping
+#define WATCHDOG_TIMEOUT 3000   //ms a capture device may deliver nothing before the watchdog reopens it
+#define WATCHDOG_RETRY 500     //ms before the first reopen of a lost device, doubled on each failure
+#define WATCHDOG_RETRY_MAX 10000    //ms between two reopen attempts of a device that stays away
+#define MUX_MAX_BYTES (64 << 20)   //bytes the muxer may hold back while a stream is starving
+#define MUX_MIN_BYTES (4 << 20)    //settings._muxmaxbytes the memory budget may shrink to
+#define MUX_MAX_DELAY 2000    //ms the muxer may hold back while a stream is starving
+#define MUX_POLL 10000    //us between two checks of the interleaving limits
+#define DROP_LATENCY 250    //ms a queued frame may wait for conversion and encoding with SR_DROP_OLDEST
+#define ADAPT_WINDOW 1000   //ms of encoding the quality controller measures before each decision
+#define ADAPT_HIGH_LOAD 0.9     //fraction of the window the encoder may be busy before a step down
+#define ADAPT_LOW_LOAD 0.6  //encoder load, predicted at the better step, under which the quality is restored
+#define ADAPT_QUEUE_FILL 0.5    //fill of the convert queues that counts as pressure
+#define WRITER_SPILL_BYTES (64 << 20)   //default settings._writerspill: 16 s of a 30 Mbit/s recording
+#define ADAPT_RESTORE_WINDOWS 3     //windows of headroom in a row before a step up
+#define VFR_TIME_BASE 1000  //encoder ticks per second with settings._vfr, the frames keep their capture time
+#define VFR_MAX_INTERVAL 2000   //ms an unchanged screen waits for a keepalive keyframe with settings._vfr
+#define SCROLL_ME_MARGIN 16     //pixels the motion search of the mpegvideo encoders keeps around the detected scroll
+#define MASK_WINDOW_POLL 200    //ms between two lookups of the windows of settings.maskwindows
+#define CAPTURE_FORMAT_TRIES 3  //pixel formats settings.capturepixfmt "auto" asks of the device before its default one
+#define HDR_TONEMAP_FILTERS "zscale=tin=smpte2084:pin=bt2020:rin=pc:t=linear:npl=100,format=gbrpf32le,zscale=p=bt709," \
+        "tonemap=hable:desat=0,zscale=t=bt709:m=bt709:r=tv,format=yuv420p"   //SR_HDR_PQ to SDR BT.709 for the 8 bit encoders
+#define MASK_WINDOW_ID (-1000)  //privacyMasks() id of the first window of settings.maskwindows, the next ones count down
 
 typedef struct S{
     int width;
@@ -78,20 +222,523 @@ typedef struct T{
     int y;
 }SROffset;
 
+/**
+ * Video encoder back-end. SR_ENCODER_AUTO tries the hardware encoders of the platform first,
+ * any back-end falls back to the software encoder when it is not available.
+ */
+typedef enum E{
+    SR_ENCODER_SOFTWARE,
+    SR_ENCODER_AUTO,
+    SR_ENCODER_VAAPI,
+    SR_ENCODER_NVENC,
+    SR_ENCODER_QSV,
+    SR_ENCODER_VIDEOTOOLBOX,
+    SR_ENCODER_AMF
+}SREncoder;
+
+/**
+ * Scaling policy of the convert workers, from the fastest to the sharpest on downscales.
+ */
+typedef enum Q{
+    SR_SCALE_FAST_BILINEAR,
+    SR_SCALE_BILINEAR,
+    SR_SCALE_BICUBIC,
+    SR_SCALE_AREA
+}SRScaleQuality;
+
+/**
+ * Video codec of the screen and live profiles. SR_CODEC_SCREEN_CONTENT measures a first captured frame:
+ * mostly palette-like blocks (terminals, IDEs) get a lossless screen codec (ZMBV, QuickTime RLE) when the recording
+ * is a plain file whose container takes it, the rest AV1 with its screen content tools (intra block copy, palette);
+ * H.264 when neither is available.\n
+ * SR_CODEC_X264 is H.264 by libx264 in software, whatever the profile and the hardware: settings.x264preset,
+ * settings.x264tune, settings._crf and settings._slicedthreads tune it.\n
+ * SR_CODEC_VP8 and SR_CODEC_VP9 are libvpx at the realtime deadline, for WebM and the browsers:
+ * settings._vpxcpuused trades quality for speed, VP9 codes tile columns and, with settings._vpxrowmt, rows in parallel.
+ */
+typedef enum C{
+    SR_CODEC_H264,
+    SR_CODEC_HEVC,
+    SR_CODEC_SCREEN_CONTENT,
+    SR_CODEC_X264,
+    SR_CODEC_VP8,
+    SR_CODEC_VP9
+}SRVideoCodec;
+
+/**
+ * Audio codec of the recording. SR_AUDIO_OPUS (libopus) encodes frames of settings._opusframe ms instead of
+ * the 1024 samples of AAC, with a shorter encoder delay: less latency for the live outputs, less CPU per stream.
+ * It falls back to AAC when libavcodec has no libopus, and needs a container that carries it (not FLV).
+ */
+typedef enum AC{
+    SR_AUDIO_AAC,
+    SR_AUDIO_OPUS
+}SRAudioCodec;
+
+/**
+ * Quality of the resampler, for the tracks whose device rate or layout differs from the encoder's, and for the drift
+ * compensation of every track. SR_RESAMPLER_FAST is a short interpolated filter of swresample, for the low-power
+ * devices; SR_RESAMPLER_DEFAULT the defaults of swresample; SR_RESAMPLER_HIGH is libsoxr at very high quality when
+ * swresample was built with it, a long swresample filter otherwise. libsoxr cannot compensate: its tracks follow the
+ * capture clock by steps of their timestamps instead, a warning tells when the first one is taken.
+ * The time the AudioThreads spend resampling is in the stats.
+ */
+typedef enum RS{
+    SR_RESAMPLER_FAST,
+    SR_RESAMPLER_DEFAULT,
+    SR_RESAMPLER_HIGH
+}SRResampler;
+
+/**
+ * Encoding profile. SR_PROFILE_SCREEN trades a long GOP without B-frames, low-latency tuning,
+ * intra-refresh and a resolution-scaled VBV (or CRF with settings._crf) for smaller files
+ * on mostly static content; SR_PROFILE_LEGACY keeps the original short-GOP settings.
+ * SR_PROFILE_LIVE is the screen profile for remote support: no look-ahead, sliced output, intra-refresh
+ * instead of IDR frames and every packet flushed to the outputs as soon as it is muxed.
+ * SR_PROFILE_INTERMEDIATE records fast: a lossless intra-only codec (UT Video, FFV1 or FFVHuff) in Matroska,
+ * SRCompact turns the recording into H.264 later.
+ */
+typedef enum P{
+    SR_PROFILE_LEGACY,
+    SR_PROFILE_SCREEN,
+    SR_PROFILE_LIVE,
+    SR_PROFILE_INTERMEDIATE
+}SRProfile;
+
+/**
+ * Dynamic range of the recording. SR_HDR_OFF is the 8 bit BT.601 of the original recorder.
+ * SR_HDR_10BIT keeps the 10 bits of a deep color desktop (X2RGB10 captures) in a 10 bit 4:2:0 encode, BT.709:
+ * less banding on gradients. SR_HDR_PQ takes the captured frames as HDR10 (BT.2020 primaries, PQ transfer),
+ * recorded as such by the encoders with 10 bit input and tone-mapped to SDR for the others.
+ * Both prefer the P010/YUV420P10 formats of the encoder, HEVC Main 10 on the hardware ones; an encoder
+ * without them records 8 bit.
+ */
+typedef enum HD{
+    SR_HDR_OFF,
+    SR_HDR_10BIT,
+    SR_HDR_PQ
+}SRHdrMode;
+
+/**
+ * Chroma of the recording. SR_CHROMA_420 halves the color resolution both ways, as usual.
+ * SR_CHROMA_444 keeps the color of every pixel (YUV444P): colored text and thin lines stay sharp.
+ * SR_CHROMA_RGB records RGB with the encoders that take it: libx264rgb for H.264, which gets the BGR0 captures
+ * without any conversion, the GBR planes of libx265 and of the intermediate codecs.
+ * The hardware encoders get 4:4:4 surfaces for both, an encoder without such formats records 4:2:0.
+ */
+typedef enum CM{
+    SR_CHROMA_420,
+    SR_CHROMA_444,
+    SR_CHROMA_RGB
+}SRChromaMode;
+
+/**
+ * Hardware encoder description.
+ * hwFormat is the surface format the encoder takes, AV_PIX_FMT_NONE when it reads system memory frames;
+ * swFormat is the format the convert workers produce before the upload.
+ */
+typedef struct H{
+    SREncoder backend;
+    const char *name;
+    const char *hevcName;
+    enum AVHWDeviceType deviceType;
+    enum AVPixelFormat hwFormat;
+    enum AVPixelFormat swFormat;
+}SRHardwareEncoder;
+
+/**
+ * GPU conversion stage of a hardware encoder back-end: filters is the filter chain uploading the system memory
+ * frames and converting them on the device, with the output size as its %d arguments.
+ */
+typedef struct G{
+    SREncoder backend;
+    enum AVHWDeviceType deviceType;
+    const char *filters;
+}SRGpuConverter;
+
+/**
+ * Private option of an encoder, applied by the screen content profile when the encoder has it.
+ */
+typedef struct O{
+    const char *encoder;
+    const char *key;
+    const char *value;
+}SREncoderOption;
+
+/**
+ * How the output file is written:\n
+ * - SR_OUTPUT_FILE is a plain file, the MP4 index is kept in memory and written by the trailer \n
+ * - SR_OUTPUT_FRAGMENTED writes MP4 fragments on keyframes or every settings._fragduration ms:
+ *   the index memory stays constant and a killed recording is readable up to its last fragment;
+ *   a Matroska or WebM file gets clusters of at most settings._fragduration ms and FRAGMENT_CLUSTER_SIZE bytes
+ *   instead, its cues are the entries of the keyframe index (settings._keyindex) \n
+ * - SR_OUTPUT_SEGMENTED rolls to a new file, numbered after settings.filename, on the first keyframe after
+ *   settings._segmentduration seconds; with settings._segmentkeep the numbers wrap and the oldest files are overwritten \n
+ * - SR_OUTPUT_HLS and SR_OUTPUT_DASH package for the browsers: settings.filename is the playlist or the manifest,
+ *   listing the last settings._livewindow segments of settings._livesegment ms \n
+ * - SR_OUTPUT_REPLAY writes nothing: the last settings._replayduration seconds stay in memory until saveReplay(),
+ *   settings.filename only picks the container of the replays; with settings._replayraw it keeps the converted frames
+ *   instead of the packets and the encoder only runs in saveReplay(), video only \n
+ * - SR_OUTPUT_CALLBACK writes nothing either: the packets only reach ScreenRecorder::onVideoPacket() and onAudioPacket(),
+ *   in the encoder time bases; settings.filename, when set, picks the container the codecs must fit \n
+ * The segmenting modes force a keyframe on every cut, so no segment needs transcoding.
+ */
+typedef enum F{
+    SR_OUTPUT_FILE,
+    SR_OUTPUT_FRAGMENTED,
+    SR_OUTPUT_SEGMENTED,
+    SR_OUTPUT_HLS,
+    SR_OUTPUT_DASH,
+    SR_OUTPUT_REPLAY,
+    SR_OUTPUT_CALLBACK
+}SROutputMode;
+
+/**
+ * What the muxer does when a starving stream (a silent microphone, a stalled grabber) makes it hold back
+ * more than settings._muxmaxbytes or settings._muxmaxdelay of the other streams:\n
+ * - SR_MUX_FLUSH writes the held packets anyway, the late stream is written out of interleaving order \n
+ * - SR_MUX_DROP drops the held packets, up to the next keyframe of each stream \n
+ * - SR_MUX_SILENCE flushes like SR_MUX_FLUSH, and the audio gap is filled with silence once the device resumes \n
+ */
+typedef enum M{
+    SR_MUX_FLUSH,
+    SR_MUX_DROP,
+    SR_MUX_SILENCE
+}SRMuxOverflow;
+
+/**
+ * What happens to the frames the encoder cannot keep up with, between the grab and the encoder:\n
+ * - SR_DROP_NONE waits for room in the convert queue: the latency grows and the device drops frames on its own \n
+ * - SR_DROP_NEWEST drops the new frame when the convert queue is full \n
+ * - SR_DROP_OLDEST drops the queued frames captured more than settings._droplatency ms ago, before conversion
+ *   and before encoding, and the new frame when the convert queue is still full \n
+ * - SR_DROP_KEYFRAME drops like SR_DROP_NEWEST, but the keyframe-critical frames (the first one and the forced
+ *   keyframes of the segment cuts) wait for room \n
+ * Dropped frames leave a gap in the timestamps, SRPipelineStats::policyDroppedFrames counts them.
+ */
+typedef enum DR{
+    SR_DROP_NONE,
+    SR_DROP_NEWEST,
+    SR_DROP_OLDEST,
+    SR_DROP_KEYFRAME
+}SRDropPolicy;
+
+/**
+ * Power profile of the recording, for laptops:\n
+ * - SR_POWER_OFF records as configured \n
+ * - SR_POWER_AUTO applies the power profile when the recording starts on battery or hot, and caps the capture rate
+ *   at POWER_FPS on battery, POWER_FPS_HOT while hot, for as long as it lasts \n
+ * - SR_POWER_SAVE applies the profile whatever the power source, the rate caps still follow it \n
+ * The profile prefers the hardware encoders and their GPU conversion, leaves fewer encoder and convert threads
+ * running, parks the pipeline queues without spinning and lets the kernel batch the wake-ups of the pipeline threads
+ * (POWER_TIMER_SLACK), on the efficiency cores where the platform has them. See SRPowerMonitor.
+ */
+typedef enum PP{
+    SR_POWER_OFF,
+    SR_POWER_AUTO,
+    SR_POWER_SAVE
+}SRPowerPolicy;
+
+/**
+ * What the last drain did: frames encoded after endCapture(), frames dropped because the deadline expired,
+ * packets drained from the encoders, and the time from endCapture() to the last muxed packet in us.
+ */
+typedef struct D{
+    uint64_t framesFlushed;
+    uint64_t framesDropped;
+    uint64_t packetsFlushed;
+    int64_t duration;
+}SRShutdownStats;
+
+/**
+ * Interval a capture device was lost for, on the capture clock in us: the video holds its last frame over it,
+ * the audio is padded with silence. stream is the output stream of the device.
+ */
+typedef struct CG{
+    int stream;
+    int64_t start;
+    int64_t duration;
+}SRCaptureGap;
+
+/**
+ * Where a stage of the video pipeline runs: SR_PATH_GPU stages hand device surfaces to the next one
+ */
+typedef enum PS{
+    SR_PATH_CPU,
+    SR_PATH_GPU
+}SRPathStage;
+
+/**
+ * Video pipeline the recorder ended up with, see ScreenRecorder::getPipelinePath(): resident when the frames never
+ * leave the GPU from the capture to the encoder, otherwise they are uploaded once, ahead of the first GPU stage
+ */
+typedef struct VP{
+    SRPathStage capture;
+    SRPathStage convert;
+    SRPathStage encode;
+    bool resident;
+    const char *encoder;
+}SRPipelinePath;
+
+/**
+ * Memory the recorder reserves, in bytes, as computed by ScreenRecorder::memoryBudget(): the pools and queues
+ * are bounded, the encoder is an estimate from its reference, B and lookahead frames. GPU surfaces are not counted.
+ */
+typedef struct Z{
+    int64_t grabber;    //buffers of the capture back-end
+    int64_t captureFrames;
+    int64_t convertedFrames;
+    int64_t encoder;
+    int64_t audio;      //ring and frames
+    int64_t muxer;      //held packets and the queues of the live outputs
+    int64_t writer;     //buffers of the async writer and the parts being uploaded
+    int64_t replay;
+    int64_t burst;      //arena of settings._burst
+    int64_t renditions;     //and the tiles of settings.videowall
+    int64_t total;
+}SRMemoryBudget;
+
+/**
+ * Encoded packet handed to the application: stream gives its time base and codecpar, the extradata included.
+ * pkt is refcounted and only valid during the call, av_packet_ref() keeps its data without a copy.
+ */
+typedef std::function<void(const AVPacket *pkt, const AVStream *stream)> SRPacketCallback;
+
+/**
+ * Converted video frame handed to the application, the one the encoder gets next: overlays and masks applied,
+ * pts in microseconds of the capture clock (AV_TIME_BASE_Q). frame is refcounted and only valid during the call,
+ * av_frame_ref() keeps its planes without a copy; a device frame (GPU paths) keeps its hw_frames_ctx.
+ */
+typedef std::function<void(const AVFrame *frame)> SRFrameCallback;
+
+/**
+ * Stage a failure of the recorder comes from, see SRError
+ */
+typedef enum EC{
+    SR_ERROR_NONE,
+    SR_ERROR_SETTINGS,      //a setting the recorder cannot apply: a malformed list, an unknown source
+    SR_ERROR_VIDEO_DEVICE,  //the video source cannot be opened, or stopped delivering
+    SR_ERROR_AUDIO_DEVICE,
+    SR_ERROR_ENCODER,       //no encoder opens, or one fails while recording
+    SR_ERROR_OUTPUT,        //the output file, its muxer or its trailer
+    SR_ERROR_MEMORY
+}SRErrorCode;
+
+/**
+ * Failure handed to ScreenRecorder::onError() and kept by ScreenRecorder::lastError().
+ * A recoverable one is handled by the stage itself, a lost device being opened again, the recording goes on;
+ * otherwise the open or init call returns averror, or the capture ends as with endCapture().
+ */
+typedef struct ER{
+    SRErrorCode code;
+    int averror;        //negative AVERROR, the one of libav when there is one
+    bool recoverable;
+    std::string message;
+}SRError;
+
+typedef std::function<void(const SRError &error)> SRErrorCallback;
+
+/**
+ * Snapshot of the pipeline returned by ScreenRecorder::getStats():
+ * time spent in each stage per frame (per packet for the mux), capture to mux latency of each stream,
+ * elements queued between the stages and the frames or packets lost on the way, by cause.
+ * @Note the grab stage of the libavdevice sources includes the pacing sleep of the demuxer
+ */
+typedef struct R{
+    SRLatencyStats stages[SR_STAGE_COUNT];
+    SRLatencyStats videoLatency;
+    SRLatencyStats audioLatency;
+    size_t rawQueued;   //captured frames waiting for the convert workers
+    size_t scaledQueued;    //converted frames waiting for the encoder
+    size_t muxQueued;   //packets waiting for the muxer
+    int64_t muxQueuedBytes;
+    uint64_t staticFrames;  //unchanged frames skipped by settings._skipstatic
+    uint64_t scrolledFrames;    //frames settings._scrollhints found scrolled
+    uint64_t sceneKeyframes;    //keyframes settings._scenekeys placed on a change of the screen
+    uint64_t missedFrames;  //deadlines of the frame clock the grab was late for
+    uint64_t staleFrames;   //device frames buffered across a pause
+    uint64_t abandonedFrames;   //frames dropped at the shutdown deadline
+    uint64_t droppedPackets;    //packets dropped by the muxer, SR_MUX_DROP
+    uint64_t droppedSamples;    //audio samples dropped by a full audio ring
+    uint64_t policyDroppedFrames;   //frames dropped between grab and encoder by settings._droppolicy
+    uint64_t shedFrames;    //frames left out by the frame rate steps of settings._adaptivequality
+    int qualityStep;    //current step of settings._adaptivequality, 0 is the full quality
+    uint64_t mergedFrames;  //changes replaced by a later one within settings._vfrmininterval
+    uint64_t keepaliveFrames;   //unchanged frames repeated after settings._vfrmaxinterval
+    uint64_t remoteFrames;  //frames the encoder read from the memory of another NUMA node
+    int64_t remoteBytes;
+    uint64_t capturedFrames;    //frames queued to the convert workers
+    uint64_t encodedFrames;     //video packets out of the encoder
+    int64_t videoBytes;         //of the encoded video packets
+    int64_t audioDrift;     //us the audio track furthest from the capture clock lags behind it (> 0) or leads, before compensation
+    SRResampler resampler;  //settings._resampler
+    bool soxr;      //SR_RESAMPLER_HIGH got libsoxr
+    int64_t resampleTime;   //us the AudioThreads spent in the resampler
+    uint64_t resampledSamples;  //output samples it produced
+    SRQualityStats quality;     //settings._qualityprobe, zero otherwise
+    SRWriterStats writer;   //settings._asyncwrite, zero otherwise
+    SRProfileStats profile;     //allocations and lock waits by stage of the SR_PROFILING builds, of the whole process
+}SRPipelineStats;
+
 typedef struct A{
     bool _recaudio;
+    SRAudioCodec _audiocodec;
+    SRResampler _resampler;
+    float _opusframe;   //ms of audio in an Opus frame: 2.5, 5, 10, 20, 40 or 60
+    bool _aacfast;  //native AAC in real-time mode: the fast coder without TNS, PNS and intensity stereo, instead of the two-loop search
+    bool _silencegate;  //the silent chunks skip the resampler and the silent frames the encoder, see SRAudioGate; Opus with DTX where the wrapper has it
+    bool _audiodsp;     //noise suppression, loudness normalization and compression of the recorded audio, see SRAudioDsp
     bool _recvideo;
     SRResolution  _inscreenres;
     SRResolution  _outscreenres;
     SROffset _screenoffset;
     uint16_t  _fps;
+    SREncoder _encoder;
+    SRVideoCodec _codec;    //only used by the screen profile, the legacy profile falls back to MPEG-4 unless SR_CODEC_X264, VP8 or VP9
+    SRProfile _profile;
+    SRHdrMode _hdr;
+    SRChromaMode _chroma;
+    int _crf;   //screen profile and SR_CODEC_X264: constant quality capped by the VBV, 0 for VBV only
+    bool _contentrate;  //constant quality (settings._crf, else CONTENT_CRF) with a VBV cap following the motion and detail of the screen, see SRContentRate; libx264 only
+    bool _slicedthreads;    //SR_CODEC_X264: the threads share each frame, no frame of delay per thread
+    int _vpxcpuused;    //SR_CODEC_VP8/VP9: 0 to 8 (VP9) or 16 (VP8), higher is faster, VPX_CPU_USED
+    bool _vpxrowmt;     //SR_CODEC_VP9: the rows of each tile column coded in parallel too
+    bool _webmlive;     //WebM recordings written as a live stream: no cues, nothing rewritten at the end
+    int _bitrate;   //kbit/s, 0 scales it with the output resolution
+    bool _gpucapture;   //linux: DRM/KMS capture feeding VAAPI, windows: desktop duplication feeding NVENC/AMF, macOS: ScreenCaptureKit feeding VideoToolbox, frames stay on the GPU
+    bool _gpuconvert;   //scale and convert on the GPU (VAAPI VPP, NPP) instead of the convert workers
+    bool _sourcescale;  //windows, macOS: without _gpucapture a smaller output is scaled by the desktop duplication or the window server, only the scaled frames are read back
+    bool _gpupath;  //negotiate _gpucapture and _gpuconvert from what the machine has, each stage falling back to system memory on its own, see getPipelinePath()
+    bool _damagecapture;    //linux only: XDamage driven grabber, unchanged frames are skipped; with FBDEV_SOURCE the framebuffer is compared page by page instead
+    bool _drawcursor;       //the XDamage grabber composites the mouse pointer (the demuxers have draw_mouse)
+    bool _cursortrack;      //linux only: the pointer in settings.filename + CURSOR_SUFFIX instead of the frames, see SRCursorTrack
+    bool _vblank;   //native grabbers wait for the vertical blank of the display, fps rounded to a divisor of its refresh rate
+    char* vblankdevice;     //linux: DRM device of the display, VBLANK_DEVICE
+    char* x264preset;   //SR_CODEC_X264: ultrafast to placebo, X264_PRESET
+    char* x264tune;     //SR_CODEC_X264: zerolatency, film, animation, stillimage...; comma separated, empty for none
+    int _encthreads;    //encoder threads, 0 uses the cores left by the capture threads
+    int _decthreads;    //input decoder threads, 0 lets libavcodec decide
+    int _convertthreads;    //swscale convert workers, 0 uses a core out of four
+    int _filterthreads;     //slice threads of the videofilters graph, 0 lets libavfilter use every core
+    SRScaleQuality _scalequality;
+    int _scalebands;    //bands of a frame converted in parallel by each worker, 0 splits frames above 1080p
+    bool _scaletiles;   //unscaled conversions run in SCALE_TILE_WIDTH x SCALE_TILE_HEIGHT tiles, the tasks of the pool with _taskpool: for 8K wide canvases
+    bool _pinthreads;   //pin the capture threads to their own cores when there are enough of them
+    SRRealtimePolicy _realtime; //real-time scheduling of the grab and audio threads
+    int _rtpriority;    //linux only: 1 to 99, priority of SR_REALTIME_FIFO/SR_REALTIME_RR
+    int _numanode;      //NUMA node the threads and frame buffers of the recording are bound to, -1 leaves them to the OS
+    bool _hugepages;    //frame buffers and XShm images in 2 MiB pages: reserved huge pages, else transparent ones, else normal pages
+    bool _taskpool;     //convert workers, their bands and the renditions run as tasks of one pool sized to the free cores
+    bool _skipstatic;   //frames identical to the previous one are neither converted nor encoded
+    bool _scenekeys;    //keyframes on the large changes of the screen (window switches), the GOP stretches while it is static
+    bool _scrollhints;  //the vertical scroll of the captured frames bounds the motion search of the mpegvideo encoders (MPEG-4, H.263, MPEG-1/2)
+    bool _overlay;      //the converted frames go through the layers of overlays(), the captured frames are never encoded as they are
+    bool _streamcopy;   //compressed video of a device (an H.264 capture card, an MJPEG webcam) remuxed as it is when the container takes its codec: no decoder, no conversion, no encoder, see streamCopyable()
+    int _webcamwidth;   //px of the picture-in-picture of settings.webcam, bottom right of the recording
+    bool _privacymask;  //the converted frames go through the rectangles of privacyMasks(), set by masks and maskwindows too
+    bool _textregions;  //the text found on the converted frames gets a lower quantizer, for the encoders with per-block QP
+    bool _vfr;  //variable frame rate: only the frames the content changed in are encoded, at their capture time
+    uint16_t _vfrmaxinterval;   //ms, an unchanged screen is repeated as a keyframe this often
+    uint16_t _vfrmininterval;   //ms, changes closer than this are merged into the last one, 0 keeps the capture rate
+    bool _idlerate;     //the capture rate steps down to IDLE_FPS_LOW, then IDLE_FPS_LOWEST, while the desktop gets no input, see SRIdleMonitor
+    SRDropPolicy _droppolicy;
+    uint16_t _droplatency;  //ms, SR_DROP_OLDEST
+    bool _adaptivequality;  //under CPU pressure the scaling gets cheaper and frames are shed, restored with headroom
+    SRPowerPolicy _power;
+    uint16_t _audiolatency;  //ms, bounds the audio ring between capture and encoder
+    bool _nativeaudio;  //settings._audiofragment ms chunks from asynchronous PulseAudio (linux) or WASAPI (windows, "loopback" url records the output) instead of the demuxer
+    uint16_t _audiofragment;    //ms
+    uint16_t _audiobatch;   //encoder frames buffered before an AudioThread encodes them and queues the packets in one push, SR_PROFILE_LIVE encodes each one
+    bool _lowpower;     //audio-only recordings: chunks of at least AUDIO_LOWPOWER_FRAGMENT ms, every thread sleeps between them
+    SROutputMode _outputmode;
+    uint16_t _fragduration;  //ms
+    uint16_t _segmentduration;   //s
+    int _segmentkeep;   //files kept by SR_OUTPUT_SEGMENTED, 0 keeps all of them
+    uint16_t _livesegment;  //ms
+    int _replayduration;    //s kept by SR_OUTPUT_REPLAY
+    bool _replayraw;    //SR_OUTPUT_REPLAY keeps the converted frames, encoded by saveReplay() only
+    bool _replaypack;   //the frames of _replayraw packed with FRAME_REPLAY_CODEC
+    bool _burst;    //the converted frames are packed into a RAM arena instead of being encoded, the capture ends once it is full and the encoder runs afterwards, video only, see SRBurstArena
+    int64_t _burstmaxbytes; //arena of _burst, 0 takes what _memorybudget leaves (BURST_MAX_BYTES without a budget): the length of the burst
+    int _bursttiles;    //bands of each frame of _burst packed in parallel, 0 for one per core
+    int _sharedslots;   //frames of the ring of sharedframes
+    int _thumbinterval; //s between two snapshots of thumbnails
+    int _thumbwidth;    //px of the snapshots of thumbnails
+    int64_t _replaymaxbytes;    //memory SR_OUTPUT_REPLAY, or the pre-roll of _activitygate, may use for the packets
+    bool _activitygate; //the output is only written while the screen changes, see ScreenRecorder::activityGate()
+    int _activitypreroll;   //s written before the activity
+    int _activitytail;  //s written after it
+    int _activitytiles; //changed tiles of SR_TILE_SIZE pixels that count as activity
+    int64_t _memorybudget;  //bytes the recorder may reserve, the queues shrink to fit; 0 is no limit
+    int _livewindow;
+    size_t _muxmaxbytes;
+    uint16_t _muxmaxdelay;  //ms
+    SRMuxOverflow _muxoverflow;
+    SRLogLevel _loglevel;
+    uint32_t _shutdowntimeout;  //ms
+    uint32_t _watchdogtimeout;  //ms without data before a capture device is reopened, 0 lets a lost device end the process
+    bool _exitonerror;  //a failure ends the process with exit(1); false reports it to onError(), the open and init calls return a negative AVERROR and a failing device is opened again like with _watchdogtimeout
+    uint32_t _threadqueuesize;  //packets a capture demuxer reads ahead in a thread of its own, 0 reads in the capture thread
+    bool _faststart;    //MP4 index at the head of SR_OUTPUT_FILE recordings
+    uint32_t _expectedduration;     //s, reserves the faststart index up front; 0 rewrites the file at the end
+    bool _fastopen;     //capture devices skip stream probing and open at settings._fps
+    bool _asyncwrite;   //plain and fragmented files are written by their own thread through large buffers
+    bool _directio;     //linux only: the async writer bypasses the page cache
+    int _iobuffer;      //bytes of the AVIOContext buffer in front of the async writer, libavformat hands it over when full
+    bool _mmapwrite;    //POSIX only: plain and fragmented files are written through a mapping of preallocated chunks, for local NVMe; not with _faststart
+    int64_t _writerspill;   //bytes the async writer may stage in memory while the storage is behind, 0 makes the muxer wait
+    char* encryptkey;   //32 hex digits of the AES-128 key the plain and fragmented files are encrypted with by the async writer, see SRCipher; empty writes them in the clear
+    bool _manifest;     //the async writer hashes the plain and fragmented files as it writes them, path.manifest.json lists the SHA-256 of each chunk, see SRManifest
+    char* manifestkey;  //hex HMAC-SHA256 key signing the manifests, empty leaves them unsigned
+    bool _keyindex;     //keyframe index of the recording in settings.filename + ".idx", see SRKeyIndex
+    bool _inputlog;     //linux only: keys, clicks, scrolls and pointer moves in settings.filename + ".input", see SRInputLog
+    bool _inputkeys;    //the input log writes which keys were pressed, not only when
+    bool _phashindex;   //perceptual hash of each change of the screen in settings.filename + ".phash", searched by SRPHashIndex::search()
+    uint32_t _qualityprobe;     //ms between two frames compared with a decode of their packets (SSIM and PSNR of the luma, see SRQualityProbe), 0 disables
+    uint32_t _statsinterval;    //ms between two getStats() JSON lines, 0 disables the dump
+    uint32_t _metricsinterval;  //ms between two samples sent to metricsurl
+    int _traceduration;     //s of tracefile from startCapture(), the stages after it are not traced
     char* filename;
+    char* streamurl;    //live copy of the recording (rtmp://, srt://, rtp://, udp:// multicast), empty to only record
+    int _udprate;   //kbit/s a udp:// live output is paced at; 0 from the encoder rates, -1 unpaced
+    int _udpttl;    //hops of the udp:// multicast datagrams
+    char* webrtcurl;    //RTP of a WebRTC gateway (rtp://host:port, srtp://host:port?key=...), its feedback driving the encoder, see SRWebRtcOutput; live profile only, empty for none
+    char* capscache;    //capability cache of the machine (see SRCapabilityCache): the device probes and encoder trials it remembers are skipped, empty for none
+    char* uploadurl;    //S3-compatible bucket the files go to as they are written, http(s)://host/bucket[/prefix], empty for none
+    int _uploadthreads; //parts of settings.uploadurl sent at once
+    char* renditions;   //extra encodes of the recorded frames, each with its own encoder and muxer: "WxH@kbps:file;WxH@kbps:file"
+    char* videowall;    //"CxR@kbps:file" the captured canvas split in C x R tiles, each encoded at full size into its own track of file, see SRVideoWall; empty for none
+    char* thumbnails;   //"thumb_%05d.jpg" files of a snapshot of the recording every _thumbinterval s, .png for PNG, no number overwrites one file; empty for none
+    char* sharedframes; //shared memory ("/sr-frames", "Local\\sr-frames" on windows) the recorded frames are published to for local readers, see SRSharedFrames; empty for none
+    char* tileview;     //tcp://0.0.0.0:port browsers view the screen on, the changed tiles of each captured frame over a WebSocket, see SRTileView; empty for none
+    char* statsfile;    //file the JSON lines are appended to, empty writes them to the standard output
+    char* metricsurl;   //StatsD server of the fleet dashboards ("udp://10.0.0.5:8125"), empty for none
+    char* metricsprefix;    //of the metric names, one per recorder of the fleet ("screenrecorder.host42")
+    char* controlurl;   //tcp://0.0.0.0:port a controller arms and starts the recorder on at an absolute time, see SRSyncControl and startCaptureAt(); empty for none
+    char* tracefile;    //Chrome trace_event JSON of the stages of each frame, for chrome://tracing or Perfetto; empty for none
+    char* videosource;  //capture demuxer, empty uses VIDEO_SOURCE
+    char* videourl;     //device of videosource (display name of the native grabbers), empty uses VIDEO_URL
+    char* capturepixfmt;    //pixel format asked of the capture demuxers that take one (avfoundation, dshow): "nv12", "auto" tries the ones of the encoder, empty keeps the device default
+    char* videooptions; //"key=value:key=value" demuxer options on top of the recorder ones ("use_shm=1:draw_mouse=0")
+    char* videofilters; //libavfilter chain on the captured frames before the encoder scaling ("hqdn3d,crop=1280:720:0:0"), replaces swscale and _gpuconvert; empty for none
+    char* audiosource;  //capture demuxer, empty uses AUDIO_SOURCE
+    char* audiourl;     //device of audiosource, empty uses AUDIO_URL
+    char* audiooptions; //"key=value:key=value" demuxer options ("fragment_size=3840")
+    char* webcam;       //camera of the picture-in-picture ("/dev/video0", "video=Integrated Camera", "0" on macOS), see SRWebcam; empty for none
+    char* webcamsource; //camera demuxer, empty uses WEBCAM_SOURCE
+    char* webcamoptions;    //"key=value:key=value" demuxer options of the camera, over the MJPEG at WEBCAM_SIZE asked for
+    char* audiotracks;  //more audio sources, each recorded as a track of its own: "source=url;source=url", "native=url" for the native back-end ("native=loopback" next to the microphone)
+    char* window;       //window to record, following it: X11 window id, title on windows (gdigrab), CGWindowID on macOS; empty records the region
+    char* monitors;     //linux only: "WxH+X,Y;WxH+X,Y" regions grabbed by their own threads into one canvas, empty records _screenoffset/_inscreenres
+    char* tilesource;   //tcp://address:port a tileclient sends its screen to, the recorder encodes it in place of a local capture; empty for none
+    char* sharedsource; //shared memory ring of a capturehost the recorder encodes in place of a local capture, read in place; empty for none
+    char* masks;        //"WxH+X,Y;WxH+X,Y" screen areas blanked in the recording, ids -1, -2... of privacyMasks()
+    char* maskwindows;  //linux only: "0x3a00007,0x3c00001" X11 windows blanked wherever they move, looked up every MASK_WINDOW_POLL ms
+    char* capturecores; //"0,1" or "0-3": cores of the grab, audio and convert threads, in this order, the encoder keeps off them; empty picks the first ones with _pinthreads
+    char* cpuflags;     //av_parse_cpu_caps() syntax on top of the detected flags ("-avx2"), a leading '=' forces the set ("=sse2+ssse3")
 }SRSettings;
 
-typedef struct B{
-    int np;
-    std::queue<AVPacket*> buf;
-}SRPacketBuffer;
+class SRDisplayLoop;
 
 class ScreenRecorder {
 
@@ -99,22 +746,147 @@ private:
 
 
     //synchro stuff
-    std::mutex r_mutex;
-    std::condition_variable r_cv;
-    std::mutex w_lock;
+    SRMutex r_mutex;
+    SRCondition r_cv;
+    int threadsPending;     //threads still setting up, under r_mutex
+    bool statsEnded;    //under r_mutex, the StatsThread writes its last line
 
     //threads
     std::thread videoThread;
-    std::thread audioThread;
     std::thread producerThread;
+    std::vector<std::thread> convertThreads;
+    //convert workers on a shared pool instead of convertThreads, see attachTaskPool()
+    SRTaskPool *taskPool;
+    //reads the events of the X11 grabbers, see attachDisplayLoop()
+    SRDisplayLoop *displayLoop;
+    std::unique_ptr<SRTaskPool> ownTaskPool;    //settings._taskpool without an attached pool
+    std::vector<std::unique_ptr<SRScaler>> convertScalers;
+    std::vector<std::unique_ptr<SRSerialTask>> convertTasks;
+    std::thread muxerThread;
+    std::thread statsThread;
+    std::thread metricsThread;
+    std::thread watchdogThread;
+    //settings._watchdogtimeout: wall clock of the last video data, the flag that interrupts the read of a lost device
+    std::atomic<int64_t> videoHeartbeat;
+    std::atomic<bool> videoLost;
+    mutable std::mutex gapLock;
+    std::vector<SRCaptureGap> captureGaps;
 
-    SRPacketBuffer inVideoBuffer;
-    SRPacketBuffer inAudioBuffer;
+    //video pipeline queues, one pair per convert worker
+    std::vector<std::unique_ptr<SRRingBuffer<AVFrame*>>> rawVideoQueues;
+    std::vector<std::unique_ptr<SRRingBuffer<AVFrame*>>> scaledVideoQueues;
+
+    //payloads of the video packets, written there by the encoder: declared first, the packets of the members below hold it
+    std::unique_ptr<SRPacketArena> encoderArena;
+    //encoded packets waiting for the muxer, indexed by output stream
+    std::vector<std::unique_ptr<SRRingBuffer<AVPacket*>>> muxQueues;
+    std::unique_ptr<std::atomic<int64_t>[]> muxLastDts;  //newest queued dts of each stream, us
+    std::atomic<int64_t> muxQueuedBytes;
+    std::atomic<int64_t> muxQueuedDelay;
+    std::atomic<uint64_t> muxOverflows;
+    std::atomic<uint64_t> muxDroppedPackets;
+    //file I/O of the recording, off the MuxerThread, when settings._asyncwrite is set
+    std::unique_ptr<SRAsyncWriter> fileWriter;
+    //settings._mmapwrite, instead of fileWriter
+    std::unique_ptr<SRMappedWriter> mappedWriter;
+    bool storageDegraded;   //MuxerThread only, the writer stages what the storage has not taken yet
+    bool storageFailed;
+    int (*defaultIoOpen)(AVFormatContext *s, AVIOContext **pb, const char *url, int flags, AVDictionary **options);
+    void (*defaultIoClose)(AVFormatContext *s, AVIOContext *pb);
+    //rotateOutput(): the next file, opened by the MuxerThread on the keyframe the ProducerThread forces
+    std::mutex rotateLock;
+    std::string rotatePath;
+    std::atomic<bool> rotatePending;
+    std::atomic<bool> keyframeRequested;
+    AVFormatContext *muxContext;    //MuxerThread only, outAVFormatContext until the first rotation, nullptr once lost
+    std::vector<int64_t> muxOffsets;    //MuxerThread only, start of the rotated file in each stream time base
+    uint64_t rotations;
+    //run-time changes of setBitrate() and setFrameRate()
+    std::atomic<int> pendingBitrate;    //kbit/s, taken by the ProducerThread, 0 for none
+    std::atomic<int> congestionBitrate; //kbit/s of the WebRTC congestion control, applied without a keyframe, 0 for none
+    std::atomic<uint64_t> congestionDroppedFrames; //frames the WebRTC frame dropper kept from the encoder
+    std::atomic<int64_t> captureInterval;   //us between two captured frames, 0 until the VideoThread starts
+    std::atomic<uint64_t> decimatedFrames;  //device frames left out below the rate they were opened with
+    std::atomic<uint64_t> idleFrames;   //capture ticks left out by settings._idlerate
+    bool powerSaving;   //the power profile of settings._power applies, see applyPowerProfile()
+
+    //faststart: bytes reserved for the index after the header, packets it must describe
+    int64_t moovReserve;
+    uint64_t muxedPackets;  //MuxerThread only
+
+    //keyframe index of settings._keyindex: first sample byte after the header, first keyframe us, MuxerThread only
+    std::unique_ptr<SRKeyIndex> keyIndex;
+    int64_t keyIndexDataStart;
+    int64_t keyIndexFirstPts;
+    bool keyIndexAfterWrite;    //the muxer buffers the keyframe until its fragment is complete
+    //input events of settings._inputlog, written by a thread of their own
+    std::unique_ptr<SRInputLog> inputLog;
+    //pointer of settings._cursortrack, left out of the frames
+    std::unique_ptr<SRCursorTrack> cursorTrack;
+    std::unique_ptr<SRSyncControl> syncControl;
+    //wall us the controller started the capture at, the origin of the capture clock; 0 before. Set on the timer thread
+    std::atomic<int64_t> syncStart;
+    std::atomic<int64_t> syncStop;
+    std::mutex syncLock;    //of the sync file, written from the timer thread and the MainThread
+    //perceptual hashes of settings._phashindex, ProducerThread only
+    std::unique_ptr<SRPHashIndex> phashIndex;
+    //SSIM and PSNR of settings._qualityprobe, fed by the ProducerThread
+    std::unique_ptr<SRQualityProbe> qualityProbe;
+    //VBV cap of settings._contentrate, ProducerThread only
+    std::unique_ptr<SRContentRate> contentRate;
+    //packets of SR_OUTPUT_REPLAY, instead of the output file
+    std::unique_ptr<SRReplayBuffer> replayBuffer;
+    //converted frames of SR_OUTPUT_REPLAY with settings._replayraw, the encoder is not fed
+    std::unique_ptr<SRFrameReplay> frameReplay;
+    //converted frames of settings._burst, encoded by the ProducerThread once the capture ended
+    std::unique_ptr<SRBurstArena> burstArena;
+    bool burstEncoding;  //ProducerThread only: the frames come from burstArena
+    //settings._activitygate: the packets of the idle screen, written as the pre-roll of the next activity
+    std::unique_ptr<SRReplayBuffer> prerollBuffer;
+    std::atomic<int64_t> lastActivity;  //us on the capture clock, set by the VideoThread
+    bool activityOpen;  //MuxerThread only
+    uint64_t activityEvents;
+    //set by the application before startCapture()
+    SRPacketCallback videoPacketCallback;
+    SRPacketCallback audioPacketCallback;
+    SRFrameCallback frameCallback;
+    SRErrorCallback errorCallback;
+    mutable std::mutex errorLock;
+    SRError lastFailure;
+
+    //drain protocol of endCapture()
+    int64_t stopRequested;
+    std::atomic<int64_t> drainDeadline;
+    int64_t shutdownTime;
+    std::atomic<uint64_t> framesFlushed;
+    std::atomic<uint64_t> framesAbandoned;
+    std::atomic<uint64_t> packetsFlushed;
+
+    //tee of the muxed packets, each live output has its own writer thread
+    std::vector<std::unique_ptr<SRStreamOutput>> liveOutputs;
+    std::unique_ptr<SRWebRtcOutput> webrtcOutput;  //settings.webrtcurl, fed by the MuxerThread like the live outputs
+    std::unique_ptr<SRCapabilityCache> capsCache;  //settings.capscache, loaded by the first probe through capabilities()
+    std::vector<std::unique_ptr<SRRendition>> renditionOutputs;    //settings.renditions, fed by the ProducerThread
+    std::unique_ptr<SRSharedFrames> sharedFrames;  //settings.sharedframes, written by the ProducerThread
+    std::unique_ptr<SRTileView> tileView;  //settings.tileview, fed by the VideoThread
+    std::unique_ptr<SRVideoWall> videoWall;    //settings.videowall, fed by the VideoThread
+    std::unique_ptr<SRSnapshot> snapshots;     //settings.thumbnails, fed by the ProducerThread
+    //settings.uploadurl: the files of the recording go to the bucket while it goes on
+    std::unique_ptr<SRUploader> uploader;
+    bool uploadFollowing;   //the output only grows, its parts go as the MuxerThread writes them
+    std::string uploadPath;     //MuxerThread only, the output file, empty for the packagers
+    int64_t uploadAdvanced;     //MuxerThread only, bytes of uploadPath handed to the uploader
+    std::map<AVIOContext*, std::string> ioPaths;    //files the packager has open for writing
+    std::vector<std::string> ioRenamed;     //closed under a temporary name, uploaded once renamed
 
     //video
     AVInputFormat *inVInputFormat;
     AVFormatContext *inVFormatContext;
     AVDictionary *inVOptions;
+    //what opened the capture demuxer, for the watchdog to open it again
+    std::string inVUrl;
+    AVDictionary *inVDeviceOptions;
+    std::unique_ptr<SRDemuxReader> videoReader;     //settings._threadqueuesize, reads inVFormatContext
     AVCodecContext *inVCodecContext;
     AVCodec *inVCodec;
 
@@ -122,16 +894,177 @@ private:
     AVDictionary *outVOptions;
     AVCodecContext *outVCodecContext;
     AVCodec *outVCodec;
+    int outVOpenError;      //AVERROR of the last openVideoEncoder() that failed
+    AVBufferRef *hwDeviceContext;
+    enum AVPixelFormat outVSwPixFmt;  //converters output, uploaded when the encoder takes hardware frames
 
-    //audio
-    AVDictionary *inAOptions;
-    AVFormatContext *inAFormatContext;
-    AVInputFormat *inAInputFormat;
-    AVCodecContext *inACodecContext;
+    //conversion graph: hwmap + scale_vaapi for GPU capture, an upload and the device scaler, or settings.videofilters
+    AVFilterGraph *filterGraph;
+    AVFilterContext *filterSrc;
+    AVFilterContext *filterSink;
+    int convertWorkers;
+    bool toneMapping;   //HDR_TONEMAP_FILTERS run ahead of settings.videofilters, see initToneMapping()
+    bool gpuCaptureFailed;  //settings._gpupath: the GPU capture did not open, negotiateGpuPath() keeps the capture in system memory
+    int captureBuffer;  //frames of each convert queue, CAPTURE_BUFFER unless the memory budget shrinks it
+    int scaleFlags;     //swscale flags and bands of the convert workers, set by initThreads()
+    int scaleBands;
+    std::atomic<bool> surfaceMapFailed;     //the encoder surfaces cannot be mapped, convertIntoSurface() gave up
+    std::atomic<uint64_t> videoFrameCount;
+    std::atomic<uint64_t> encodedFrames;
+    std::atomic<int64_t> encodedBytes;
+    SRFrameClock videoClock;
+
+    //static frame detection on the captured frames
+    SRTileHasher staticHasher;
+    std::atomic<uint64_t> skippedStaticFrames;
+
+    //scroll of the captured frames, carried to the encoder in the opaque of the frames, see settings._scrollhints
+    SRScrollDetector scrollDetector;
+    std::atomic<uint64_t> scrolledFrames;
+    //settings._scenekeys: us between the keyframes of an active screen, 0 when the encoder keeps its own GOP
+    int64_t sceneGop;
+    std::atomic<uint64_t> sceneKeyframes;
 
-    AVCodecContext *outACodecContext;
-    AVCodec *outACodec;
-    AVCodec *inACodec;
+    //layers burnt into the converted frames, see settings._overlay
+    SROverlay overlay;
+    std::unique_ptr<SRWebcam> webcam;   //settings.webcam, a layer of overlay
+    uint32_t overlaySeen;   //VideoThread only, overlay and privacyMask changeCount() of the last frame dispatched
+    std::atomic<bool> overlayWarned;
+
+    //rectangles blanked on the converted frames, see settings._privacymask
+    struct MaskedWindow {
+        unsigned long id;
+        int x, y, width, height;    //screen area of the last lookup
+    };
+    SRPrivacyMask privacyMask;
+    std::vector<MaskedWindow> maskedWindows;    //VideoThread only once recording
+    int64_t maskWindowsPolled;      //VideoThread only, wall time of the last lookup
+    std::atomic<bool> maskWarned;
+
+    //per-block quantizer offsets of the encoded frames, see settings._textregions
+    SRRegionMap regionMap;
+
+    //frame-drop policy between grab and encoder, see settings._droppolicy
+    std::atomic<uint64_t> policyDroppedFrames;
+    int64_t firstCriticalFrame;     //VideoThread only, capture time of the first frame
+    int64_t nextCriticalFrame;      //VideoThread only, capture time of the next forced keyframe
+
+    //variable frame rate, see vfrAdmit() and vfrTick()
+    AVFrame *vfrLast;       //VideoThread only, reference of the last frame queued, repeated as keepalive
+    AVFrame *vfrPending;    //VideoThread only, change held back by settings._vfrmininterval
+    int64_t vfrLastQueued;  //VideoThread only, capture timeline position of the last frame queued
+    std::atomic<uint64_t> vfrMergedFrames;
+    std::atomic<uint64_t> vfrKeepaliveFrames;
+    std::atomic<uint64_t> numaRemoteFrames;
+    std::atomic<int64_t> numaRemoteBytes;
+
+    //adaptive quality controller, see adaptQuality()
+    std::atomic<int> qualityStep;
+    std::atomic<uint64_t> shedFrames;
+    uint64_t shedCount;     //VideoThread only
+    int calmWindows;    //ProducerThread only
+
+    //instrumentation, see getStats()
+    SRHistogram stageTimes[SR_STAGE_COUNT];
+    SRHistogram videoLatency;
+    SRHistogram audioLatency;
+    std::unique_ptr<SRTracer> tracer;   //settings.tracefile, the stages of stageTimes frame by frame
+    int64_t grabSpan[2];    //VideoThread only, grab start and end of the frame being captured, traced once it is timed
+    int64_t decodeSpan[2];  //VideoThread only, 0 when the frame was not decoded
+
+    //recycled frames and packets, sized by initPools()
+    SRFramePool grabPool;
+    SRFramePool scaledPool;
+    SRPacketPool packetPool;
+    bool videoPassthrough;
+    //settings._streamcopy granted: the VideoThread hands the device packets to the MuxerThread, outVCodecContext is never opened
+    bool videoCopy;
+    bool videoCopyIntra;    //every packet is a keyframe: the pacing may leave some out
+    bool videoCopyStarted;  //VideoThread only, from the first keyframe after the open or a recovery
+
+    //native capture back-end, replaces inVFormatContext when set
+    std::unique_ptr<SRVideoGrabber> videoGrabber;
+
+    /**
+     * AudioTrack is one recorded audio source with its own AudioThread, resampler, ring and encoder,
+     * muxed as a stream of its own: track 0 is settings.audiosource, the others settings.audiotracks
+     */
+    struct AudioTrack {
+        int index;  //of the track, and of its filter on captureClock
+        AVDictionary *inAOptions;
+        AVFormatContext *inAFormatContext;
+        AVInputFormat *inAInputFormat;
+        AVCodecContext *inACodecContext;
+        AVCodec *inACodec;
+        //native capture back-end, replaces inAFormatContext when set
+        std::unique_ptr<SRAudioGrabber> audioGrabber;
+        std::unique_ptr<SRDemuxReader> reader;  //settings._threadqueuesize, reads inAFormatContext
+        AVCodecContext *outACodecContext;
+        AVCodec *outACodec;
+        int inAudioStreamIndex;
+        int outAudioStreamIndex;
+        AVAudioFifo *fifo;
+        SRFramePool audioPool;
+        std::thread audioThread;
+        std::vector<AVPacket*> pending;     //AudioThread only, encoded packets not handed to the muxer yet
+        int64_t audioSamples;   //AudioThread only, output samples since the capture clock origin
+        bool audioClockSynced;
+        std::atomic<int64_t> drift;     //us the capture clock is ahead of the samples, averaged by syncAudioClock()
+        std::atomic<int64_t> maxDrift;  //us, largest magnitude of drift
+        double driftEstimate;   //AudioThread only, samples
+        bool compensating;      //AudioThread only, the resampler is pulling the samples back to the capture clock
+        int64_t compensatedSamples;     //AudioThread only, added (> 0) or removed by the resampler
+        int64_t compensation;   //AudioThread only, the correction handed to swr, compensationLeft the output samples it has left
+        int64_t compensationLeft;
+        bool compensationRefused;   //AudioThread only, the engine has no compensation (soxr): the timeline takes the steps
+        bool convertible;   //AudioThread only, the device and the encoder only differ in the sample format
+        bool direct;    //AudioThread only, the last chunk was converted by SRAudioConvert, swr holds nothing
+        std::atomic<int64_t> resampleTime;  //us in swr_convert(), written by the AudioThread
+        std::atomic<uint64_t> resampledSamples;
+        //the watchdog: wall clock of the last chunk, and the flag that interrupts the read of a lost device
+        std::atomic<int64_t> heartbeat;
+        std::atomic<bool> lost;
+        bool recovered;     //AudioThread only, the hole before the next chunk is a device loss, padded with silence
+        std::string deviceUrl;  //of the demuxer, for the watchdog to open it again
+        AVDictionary *deviceOptions;
+        SRAudioDsp dsp;     //settings._audiodsp, AudioThread only
+        //settings._silencegate, AudioThread only
+        SRAudioGate gate;
+        bool gated;     //the last chunk was replaced by silence
+        int64_t silentIn;   //samples of the chunks gated in a row, silentOut the output samples written for them
+        int64_t silentOut;
+        int64_t zeroRun;    //silent encoder frames in a row, the first one is frame zeroStart
+        int64_t zeroStart;
+        int64_t framesSent;     //to the encoder, packetsReceived from it: the difference is still inside
+        int64_t packetsReceived;
+        SRPacketPtr silentPacket;   //the encoded silence of this run, repeated instead of encoding its frames
+        int64_t nextSilentPts;  //encoder time base, the pts after the last packet
+        bool repeating;     //the frames of this run are repeated packets
+        int64_t stalePackets;   //packets of the encoder taken over by the repeated ones, renumbered when they come out
+        uint64_t gatedSamples;
+        uint64_t repeatedFrames;
+        bool aligned;   //AudioThread only, the track reached the first video frame, see alignAudioStart()
+        int64_t trimmedSamples;     //device samples before it left out
+
+        explicit AudioTrack(int index): index(index), inAOptions(nullptr), inAFormatContext(nullptr),
+                inAInputFormat(nullptr), inACodecContext(nullptr), inACodec(nullptr), outACodecContext(nullptr),
+                outACodec(nullptr), inAudioStreamIndex(-1), outAudioStreamIndex(-1), fifo(nullptr),
+                audioSamples(0), audioClockSynced(false), drift(0), maxDrift(0),
+                driftEstimate(0), compensating(false), compensatedSamples(0), compensation(0), compensationLeft(0),
+                compensationRefused(false), convertible(false),
+                direct(false), resampleTime(0), resampledSamples(0), heartbeat(0), lost(false),
+                recovered(false), deviceOptions(nullptr), gated(false), silentIn(0), silentOut(0), zeroRun(0), zeroStart(0),
+                framesSent(0), packetsReceived(0), silentPacket(av_packet_alloc()), nextSilentPts(AV_NOPTS_VALUE),
+                repeating(false), stalePackets(0), gatedSamples(0), repeatedFrames(0), aligned(false),
+                trimmedSamples(0) {}
+        ~AudioTrack();
+
+        AudioTrack(const AudioTrack&) = delete;
+        AudioTrack &operator=(const AudioTrack&) = delete;
+    };
+
+    //audio
+    std::vector<std::unique_ptr<AudioTrack>> audioTracks;
 
 
     AVFrame *rawVideoFrame;
@@ -141,25 +1074,205 @@ private:
     AVOutputFormat *outAVOutputFormat;
 
     int inVideoStreamIndex;
-    int inAudioStreamIndex;
     int outVideoStreamIndex;
-    int outAudioStreamIndex;
 
-    bool captureSwitch;
-    bool killSwitch;
+    //run state, written under r_mutex, read lock-free by the capture loops
+    std::atomic<bool> captureSwitch;
+    std::atomic<bool> killSwitch;
 
-    AVAudioFifo *fifo;
+    //totals of the audio tracks
+    std::atomic<uint64_t> audioOverflows;
+    std::atomic<uint64_t> audioUnderruns;
+    std::atomic<uint64_t> audioDroppedSamples;
 
-    void generateVideoOutputStream();
-    void generateAudioOutputStream();
+    //one timeline for both streams: device timestamps are smoothed onto captureClock
+    SRCaptureClock captureClock;
+    //encoder and muxer timestamps of each output stream, set up by initThreads()
+    std::unique_ptr<SRStreamTimeline[]> timelines;
+    SRPacketReorder videoReorder;   //ProducerThread only, dts of the encoded video
+    std::vector<AVPacket*> videoReady;  //ProducerThread only, packets of the pool leaving videoReorder
+    std::atomic<int64_t> resumeWall;    //wall clock of the last startCapture(), older device data is dropped
+    std::atomic<int64_t> videoOrigin;   //capture clock us of the first video frame, the t0 of the audio tracks; AV_NOPTS_VALUE before
+    std::atomic<uint64_t> staleDeviceFrames;
+    std::atomic<uint64_t> audioStalePackets;
+
+    int generateVideoOutputStream();
+    bool openVideoEncoder(AVCodec *codec, const SRHardwareEncoder *hw);
+    bool openHardwareEncoder(const SRHardwareEncoder &hw, const char *path);
+    bool openScreenContentEncoder();
+    AVFrame *probeVideoFrame();
+    void applyScreenProfile(AVCodecContext *ctx, const AVCodec *codec);
+    void applyIntermediateProfile(AVCodecContext *ctx, const AVCodec *codec);
+    void applyColorDescription(AVCodecContext *ctx);
+    void initToneMapping();
+    int initGpuCapture();
+    bool buildFilterGraph(int format, int width, int height, AVRational timeBase,
+                          AVBufferRef *framesCtx, AVBufferRef *device, const char *filters, int threads = 0);
+    bool initGpuConvert(const SRGpuConverter &conv);
+    void negotiateGpuPath();
+    bool deviceAvailable(enum AVHWDeviceType type, const char *device = nullptr);
+    SRCapabilityCache *capabilities();
+    int fallBackFromGpuCapture();
+    int initVideoFilters();
+    int initPrivacyMasks();
+    bool privacyMasking() const {
+        return settings._privacymask || (settings.masks && *settings.masks) || (settings.maskwindows && *settings.maskwindows);
+    }
+    void maskScreenArea(int id, int x, int y, int width, int height);
+    void trackMaskedWindows();
+    void initTextRegions();
+    bool regionsActive() const { return privacyMasking() || regionMap.detection() || !regionMap.empty(); }
+    bool applyRegions(AVFrame *frame);
+    bool hasVideoFilters() const { return toneMapping || (settings.videofilters && *settings.videofilters); }
+    bool sourceScaling() const {
+        return settings._sourcescale && settings._outscreenres.width > 0 && settings._outscreenres.height > 0 &&
+               (settings._outscreenres.width < settings._inscreenres.width ||
+                settings._outscreenres.height < settings._inscreenres.height);
+    }
+    int generateAudioOutputStream(AudioTrack &a);
     void captureVideo();
-    void captureAudio();
+    void closeVideoQueues();
+    void dispatchVideoFrame(AVFrame *rawFrame);
+    void queueVideoFrame(AVFrame *rawFrame);
+    bool vfrAdmit(AVFrame *rawFrame);
+    void vfrTick();
+    bool shedFrame();
+    bool keyframeCritical(int64_t pts);
+    bool frameExpired(const AVFrame *frame) const;
+    void adaptQuality(double encodeLoad);
+    void convertVideo(int worker);
+    void initConverter(int worker, SRScaler &scaler);
+    void convertFrame(int worker, AVFrame *rawFrame, SRScaler &scaler);
+    bool convertStep(int worker);
+    int openNativeVideoSource(SRVideoGrabber *grabber);
+    int openMonitorSources();
+    int openWindowSource();
+    int openFramebufferSource();
+    int openTileSource();
+
+    int openSharedSource();
+    int openDemuxerAudioSource(AudioTrack &a, const char *source, const char *url, const char *options);
+    int openNativeAudioSource(AudioTrack &a, SRAudioGrabber *grabber, const char *url);
+    static SRAudioGrabber *nativeAudioGrabber();
+    int openAudioTracks();
+    AVRational audioSourceTimeBase(const AudioTrack &a) const;
+    static int applyDeviceOptions(AVDictionary **options, const char *spec);
+    void report(const SRError &error);
+    int fail(SRErrorCode code, int averror, const std::string &message);
+    int failVideoSource(SRErrorCode code, int averror, const std::string &message);
+    void failCapture(SRErrorCode code, int averror, const char *format, ...)
+#if defined(__GNUC__)
+    __attribute__((format(printf, 4, 5)))
+#endif
+    ;
+    std::vector<std::string> capturePixelFormats(const AVInputFormat *format) const;
+    int probeStreams(AVFormatContext *ctx, enum AVMediaType type);
+    void captureAudio(AudioTrack &a);
+    bool waitRunning();
+    void threadReady();
+    bool drainExpired() const;
+    int receiveVideoPackets(AVPacket *outPacket);
+    int receiveAudioPackets(AudioTrack &a, AVPacket *outPacket);
+    void flushAudio(AudioTrack &a, AVPacket *outPacket, SwrContext *resampleContext);
+    int64_t syncAudioClock(AudioTrack &a, AVFrame *rawFrame, SwrContext *resampleContext);
+    bool alignAudioStart(AudioTrack &a, AVFrame *rawFrame);
+    void encodeAudioFrame(AudioTrack &a, AVFrame *frame, AVPacket *outPacket);
+    void encodeAudioFifo(AudioTrack &a, AVPacket *outPacket);
+    void encodeResampled(AudioTrack &a, SwrContext *resampleContext, AVPacket *outPacket, bool batched = false);
+    void sendAudioPackets(AudioTrack &a);
+    void drainResampler(AudioTrack &a, SwrContext *resampleContext, AVPacket *outPacket);
+    int resample(AudioTrack &a, SwrContext *resampleContext, uint8_t **out, int outCount, const uint8_t **in, int inCount);
+    void insertAudioSilence(AudioTrack &a, int64_t samples, AVPacket *outPacket);
+    void convertAudioChunk(AudioTrack &a, const AVFrame *rawFrame, SwrContext *resampleContext, AVPacket *outPacket);
+    void gateAudioChunk(AudioTrack &a, const AVFrame *rawFrame, SwrContext *resampleContext, AVPacket *outPacket);
+    bool repeatSilence(AudioTrack &a, const AVFrame *frame);
+    int add_samples_to_fifo(AudioTrack &a, uint8_t **converted_input_samples, const int frame_size);
     void produce();
+    void mux();
+    void dumpStats();
+    void exportMetrics();
+    void watchdog();
+    bool waitRetry(int64_t ms);
+    bool recoverVideoDevice();
+    int reopenVideoDevice();
+    bool recoverAudioDevice(AudioTrack &a);
+    int reopenAudioDevice(AudioTrack &a);
+    void startVideoReader();
+    void startAudioReader(AudioTrack &a);
+    void recordGap(int stream, int64_t lostWall, int64_t backWall);
+    void queuePacket(AVPacket *pkt);
+    void queuePackets(AVPacket **pkts, int count);
+    int muxQueuePackets() const;
+    int64_t muxHeldDelay(const std::vector<AVPacket*> &pending) const;
+    void checkStorage();
+    void writeMuxPacket(AVPacket *pkt, unsigned int stream);
+    bool activityGate();
+    int openOutputFile(AVFormatContext *ctx, const char *path);
+    int closeOutputFile(AVFormatContext *ctx);
+    void rotateMuxer(const AVPacket *cut);
+    void applyBitrate(int kbps);
     void initOptions();
-    void initBuffers();
-    static int initConvertedSamples(uint8_t ***converted_input_samples,
-                         AVCodecContext *output_codec_context,
-                         int frame_size);
+    void applyCpuFlags();
+    void applyPowerProfile();
+    void efficientPipelineThread(const char *name);
+    SRWaitStrategy pipelineWait() const { return powerSaving ? SR_WAIT_SLEEP : PIPELINE_WAIT; }
+    void reportCpuFeatures() const;
+    AVDictionary *outputOptions() const;
+    static std::string segmentPattern(const char *filename);
+    bool needsGlobalHeader() const;
+    bool needsInbandHeaders() const;
+    bool liveMatroska() const;
+    void applyX264Options(AVCodecContext *ctx);
+    void applyVpxOptions(AVCodecContext *ctx, const AVCodec *codec);
+    int64_t forcedKeyframeInterval() const;
+    int64_t moovBytes(int64_t packets) const;
+    void reserveMoov();
+    int openRenditions();
+    int openVideoWall();
+    int openWebRtc();
+    int openSharedFrames();
+    bool finishFaststart();
+    static void rewriteFaststart(const char *path);
+    void openKeyIndex();
+    void indexKeyframe(const AVPacket *pkt, int64_t before);
+    void closeKeyIndex();
+    void openInputLog();
+    void openSyncControl();
+    void writeSyncFile();
+    void closeInputLog();
+    void openCursorTrack();
+    void closeCursorTrack();
+    void openWebcam();
+    void closeWebcam();
+    void openPHashIndex();
+    void closePHashIndex();
+    void openQualityProbe();
+    void closeQualityProbe();
+    void openContentRate();
+    void applyContentRate(int64_t cap);
+    void hookOutputIo();
+    static int openOutputIo(AVFormatContext *s, AVIOContext **pb, const char *url, int flags, AVDictionary **options);
+    static void closeOutputIo(AVFormatContext *s, AVIOContext *pb);
+    bool appendOnlyOutput() const;
+    int openUploader();
+    void uploadOutputFile();
+    void uploadRenamedFiles();
+    int initPools();
+    bool passthrough() const;
+    bool streamCopyable() const;
+    int openStreamCopy();
+    void copyVideoPacket(AVPacket *pkt);
+    int enforceMemoryBudget();
+    int convertWorkerCount() const;
+    int scaleBandCount() const;
+    std::vector<int> nodeCores() const;
+    std::vector<int> captureCores() const;
+    std::vector<int> encoderCores() const;
+    void initTaskPool();
+    void releaseScaledFrame(AVFrame *frame);
+    void placeSceneKeyframe(AVFrame *frame, int &previousChange, int64_t &lastKeyframe);
+    AVFrame *uploadFrame(AVFrame *frame);
+    AVFrame *convertIntoSurface(AVFrame *rawFrame, SRScaler &scaler, int flags);
 public:
     SRSettings settings;
 
@@ -167,18 +1280,147 @@ public:
     ~ScreenRecorder();
 
     int openVideoSource();
+    int openVideoSource(SRVideoGrabber *grabber);
     int openAudioSource();
+    int openAudioSource(SRAudioGrabber *grabber);
+    void listDevices() const;
     int initOutputFile();
 
     void startCapture();
+
+    /**
+     * startCaptureAt() is startCapture() with wallTime, on av_gettime(), as the origin of the capture clock: the
+     * recorders started with the same wallTime stamp their frames from the same instant, whenever they woke up
+     */
+    void startCaptureAt(int64_t wallTime);
     void pauseCapture();
     void endCapture();
+    void finishCapture();
 
-    void initThreads();
+    /**
+     * captureEnded() tells whether endCapture() was called, by the application or by a controller of
+     * settings.controlurl: finishCapture() is left to the application
+     */
+    bool captureEnded() const { return killSwitch.load(std::memory_order_acquire); }
+    SRShutdownStats getShutdownStats() const;
+    /**
+     * getCaptureGaps() lists the intervals the watchdog recovered a lost capture device in, so far
+     */
+    std::vector<SRCaptureGap> getCaptureGaps() const;
+    /**
+     * getPipelinePath() tells where the capture, the conversion and the encoder run, once the video stream is open
+     */
+    SRPipelinePath getPipelinePath() const;
 
-    int init_fifo();
+    /**
+     * saveReplay() writes what SR_OUTPUT_REPLAY holds to path, from its own thread, while the capture goes on
+     * @return 0 when the replay is being written, a negative AVERROR otherwise
+     */
+    int saveReplay(const char *path);
+
+    /**
+     * rotateOutput() ends the recording file on the next video keyframe, which it forces, and goes on in filename:
+     * the devices and the encoders keep running, the new file starts at 0 with the packets after the cut
+     * @return 0 when the cut is scheduled, AVERROR(EBUSY) while the previous one is, AVERROR(ENOSYS) outside
+     * SR_OUTPUT_FILE and SR_OUTPUT_FRAGMENTED or with _faststart or _keyindex, which index the first file only
+     */
+    int rotateOutput(const char *filename);
+
+    /**
+     * setBitrate() changes the video bitrate, in kbit/s, from the next frame encoded, which starts a GOP:
+     * encoders with a dynamic rate control reconfigure, the others keep the bitrate they were opened with
+     * @return 0, AVERROR(EINVAL) below 1 kbit/s
+     */
+    int setBitrate(int kbps);
+
+    /**
+     * setFrameRate() changes the capture rate from the next frame, up to settings._fps the recording was opened with:
+     * the native back-ends are paced at the new interval, the frames of the capture demuxers are decimated to it.
+     * The encoder time base stays, the lower rate only spaces the timestamps.
+     * @return 0, AVERROR(EINVAL) outside 1.._fps
+     */
+    int setFrameRate(int fps);
+
+    /**
+     * onVideoPacket() hands every encoded video packet to callback, in the order and with the timestamps of the
+     * output file, before it is written; called before startCapture().
+     * @Note the callback runs on the MuxerThread and holds back the output while it runs: it should take a reference
+     * and return, the transport runs on a thread of the application
+     */
+    void onVideoPacket(SRPacketCallback callback) { videoPacketCallback = std::move(callback); }
+
+    /**
+     * onAudioPacket() is onVideoPacket() for the packets of the audio tracks, stream->index tells the tracks apart;
+     * on the MuxerThread as well
+     */
+    void onAudioPacket(SRPacketCallback callback) { audioPacketCallback = std::move(callback); }
+
+    /**
+     * onFrame() hands every converted video frame to callback before it is encoded; called before startCapture().
+     * @Note the callback runs on the ProducerThread, between two encodes: a slow one lowers the frame rate the encoder
+     * keeps up with. A kept reference holds a buffer of the frame pool, which then allocates a new one
+     */
+    void onFrame(SRFrameCallback callback) { frameCallback = std::move(callback); }
+
+    /**
+     * onError() hands every failure to callback, the recoverable ones included, before the stage handles it;
+     * called before openVideoSource().
+     * @Note the callback runs on the thread of the failing stage (the caller of the open or init call, a capture
+     * thread, the ProducerThread) and must not call back into the recorder but for endCapture()
+     */
+    void onError(SRErrorCallback callback) { errorCallback = std::move(callback); }
+    /**
+     * lastError() is the last failure reported, code SR_ERROR_NONE if none
+     */
+    SRError lastError() const;
+
+    /**
+     * attachTaskPool() runs the convert workers as tasks of pool, shared with other recorders, instead of
+     * threads of their own; called before initThreads(), pool must outlive the recording
+     */
+    void attachTaskPool(SRTaskPool *pool);
 
-    int add_samples_to_fifo(uint8_t **converted_input_samples, const int frame_size);
+    /**
+     * attachDisplayLoop() has the events of the X11 grabbers of settings._damagecapture, settings.window and
+     * settings.monitors read by loop, shared with other recorders; called before openVideoSource(), loop must
+     * outlive the recording
+     */
+    void attachDisplayLoop(SRDisplayLoop *loop);
+
+    /**
+     * overlays() are the layers drawn on the recording with settings._overlay, from any thread while it runs
+     */
+    SROverlay &overlays() { return overlay; }
+
+    /**
+     * privacyMasks() are the rectangles blanked on the recording with settings._privacymask, from any thread while it runs;
+     * the negative ids belong to settings.masks and settings.maskwindows
+     */
+    SRPrivacyMask &privacyMasks() { return privacyMask; }
+
+    /**
+     * regionMaps() are the quantizer offsets given to the encoder on top of settings._textregions, from any thread
+     * while it runs; encoders without per-block QP ignore them
+     */
+    SRRegionMap &regionMaps() { return regionMap; }
+
+    /**
+     * memoryBudget() adds up what the recorder reserves with the current settings, once initOutputFile() opened the codecs
+     */
+    SRMemoryBudget memoryBudget() const;
+
+    int initThreads();
+
+    SRClockStats getVideoClockStats() const;
+    uint64_t getAudioOverflows() const;
+    uint64_t getAudioUnderruns() const;
+    int64_t getMuxQueueBytes() const;
+    int64_t getMuxQueueDelay() const;
+    uint64_t getMuxOverflows() const;
+    SRPipelineStats getStats() const;
+    void writeStatsJson(std::ostream &out) const;
+
+    int init_fifo();
 };
 
 
@@ -0,0 +1,658 @@
+//
+// Capture pipeline benchmark: ScreenRecorder fed by SRTestGrabber, no display or microphone needed.
+//
+// usage: benchmark [seconds] [resolution ...] [hugepages] [power] [aac]   e.g. benchmark 5 1080p 4k
+// with hugepages each configuration runs twice, in normal and in huge pages, to compare them
+// with power each configuration runs at BENCH_POWER_FPS instead, without and with the power profile: the energy
+// per recorded minute needs the RAPL counter, readable by root only on recent kernels
+// with aac the native AAC encoder is timed alone, default against settings._aacfast, instead of the pipeline
+// with regress baseline.json [threshold=N] [update] 720p, 1080p and 4k run in legacy, screen-h264 and screen-hevc
+// with 1, 2 and 4 convert threads and are compared with the baseline: the exit code is 1 when one lost more than
+// N% (BENCH_REGRESSION) of its fps or took that much more CPU per frame; without the file, or with update, the
+// results are written to it as the new baseline, take it on the machine of the later runs
+// with startup a single recording measures the time from the start of the process to its first muxed frame and
+// the resident memory then: run it in a default build and in one with SR_MINIMAL_FFMPEG to compare them
+// with coroutines, in a build with SR_COROUTINES, BENCH_CO_SESSIONS sessions encode synthetic 720p frames at once
+// through the awaitables of SRCoroutine.h on one task pool
+//
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ScreenRecorder.h"
+#include "SRTestGrabber.h"
+#include "SRPowerMonitor.h"
+#include "SRCoroutine.h"
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BENCH_SECONDS 5     //default capture time of each run
+#define BENCH_FPS 1000  //target rate of the frame clock, above what any configuration sustains
+#define BENCH_POWER_FPS 30  //rate of the power runs: a recording as a laptop makes it, not the throughput
+#define BENCH_OUTPUT "benchmark.mp4"
+#define BENCH_AAC_RATE 48000
+#define BENCH_AAC_BITRATE 96000     //the bit rate of generateAudioOutputStream()
+#define BENCH_STARTUP_TIMEOUT 10000 //ms a startup run waits for its first muxed frame
+#define BENCH_REGRESSION 10     //% of throughput lost or CPU time per frame gained that fails a regression run
+#define BENCH_CO_SESSIONS 4 //sessions a coroutine run encodes at once
+#define BENCH_CO_FPS 30     //frames per second of capture time each session of a coroutine run encodes
+
+#if defined(__GLIBC__) && !defined(SR_PROFILING)
+/* glibc only: every heap allocation of the process, libav included, goes through these */
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+}
+
+static std::atomic<uint64_t> allocations(0);
+
+extern "C" {
+void *malloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+}
+#define BENCH_ALLOCATIONS() allocations.load(std::memory_order_relaxed)
+#elif defined(SR_PROFILING)
+//the profiling build counts them already, by stage
+#define BENCH_ALLOCATIONS() srProfileAllocations()
+#else
+#define BENCH_ALLOCATIONS() ((uint64_t) 0)
+#endif
+
+namespace {
+
+typedef struct X{
+    const char *name;
+    SRResolution resolution;
+}SRBenchResolution;
+
+typedef struct Y{
+    const char *name;
+    SRProfile profile;
+    SRVideoCodec codec;
+    SRHdrMode hdr;  //anything but SR_HDR_OFF grabs X2RGB10 frames
+    SRChromaMode chroma;
+}SRBenchCodec;
+
+/**
+ * What a run measured, compared by the regression runs: the throughput and the CPU time per frame,
+ * the latency for the report only (its percentiles are power of two buckets)
+ */
+typedef struct BR{
+    double fps;
+    double cpuPerFrame;     //us of all the threads of the process
+    int64_t p99;
+}SRBenchResult;
+
+}
+
+static const SRBenchResolution resolutions[] = {
+        {"720p", {1280, 720}},
+        {"1080p", {1920, 1080}},
+        {"1440p", {2560, 1440}},
+        {"4k", {3840, 2160}},
+        {"8k", {7680, 4320}},
+};
+
+static const SRBenchCodec codecs[] = {
+        {"legacy", SR_PROFILE_LEGACY, SR_CODEC_H264, SR_HDR_OFF, SR_CHROMA_420},
+        {"screen-h264", SR_PROFILE_SCREEN, SR_CODEC_H264, SR_HDR_OFF, SR_CHROMA_420},
+        {"screen-hevc", SR_PROFILE_SCREEN, SR_CODEC_HEVC, SR_HDR_OFF, SR_CHROMA_420},
+        {"screen-content", SR_PROFILE_SCREEN, SR_CODEC_SCREEN_CONTENT, SR_HDR_OFF, SR_CHROMA_420},
+        {"live-h264", SR_PROFILE_LIVE, SR_CODEC_H264, SR_HDR_OFF, SR_CHROMA_420},
+        //libx264 with the original settings of the legacy profile, re-tuned by SR_CODEC_X264
+        {"legacy-x264", SR_PROFILE_LEGACY, SR_CODEC_X264, SR_HDR_OFF, SR_CHROMA_420},
+        //text sharpness against screen-h264 and screen-hevc: the bitrate column tells the cost
+        {"h264-444", SR_PROFILE_SCREEN, SR_CODEC_H264, SR_HDR_OFF, SR_CHROMA_444},
+        {"h264-rgb", SR_PROFILE_SCREEN, SR_CODEC_H264, SR_HDR_OFF, SR_CHROMA_RGB},
+        {"hevc-444", SR_PROFILE_SCREEN, SR_CODEC_HEVC, SR_HDR_OFF, SR_CHROMA_444},
+#ifdef AV_PIX_FMT_X2RGB10
+        //the 10 bit path against screen-hevc: conversion to P010/YUV420P10 and a Main 10 encode
+        {"hevc-10bit", SR_PROFILE_SCREEN, SR_CODEC_HEVC, SR_HDR_10BIT, SR_CHROMA_420},
+        {"hevc-hdr10", SR_PROFILE_SCREEN, SR_CODEC_HEVC, SR_HDR_PQ, SR_CHROMA_420},
+        {"legacy-tonemap", SR_PROFILE_LEGACY, SR_CODEC_H264, SR_HDR_PQ, SR_CHROMA_420},
+#endif
+};
+
+/* uJ since start on the package counter, -1 without one */
+static int64_t energySince(int64_t start) {
+    int64_t now = SRPowerMonitor::energy();
+    if (start < 0 || now < 0)
+        return -1;
+    if (now < start)
+        now += SRPowerMonitor::energyRange();
+    return now - start;
+}
+
+static int64_t cpuTime() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (int64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/**
+ * run() records seconds of synthetic frames and prints one line of results
+ * @param power settings._power of the run
+ * @param fps BENCH_FPS measures the throughput, BENCH_POWER_FPS the energy of a real recording
+ * @param convertThreads settings._convertthreads, 0 for the default
+ */
+static SRBenchResult run(const SRBenchResolution &res, const SRBenchCodec &codec, int seconds, bool hugePages,
+                         SRPowerPolicy power = SR_POWER_OFF, int fps = BENCH_FPS, int convertThreads = 0) {
+    SRPipelineStats stats;
+    int64_t wall, cpu, energy;
+    uint64_t allocs;
+    {
+        ScreenRecorder sc;
+        sc.settings.filename = (char *) BENCH_OUTPUT;
+        sc.settings._recvideo = true;
+        sc.settings._recaudio = false;
+        sc.settings._inscreenres = res.resolution;
+        sc.settings._outscreenres = res.resolution;
+        sc.settings._fps = fps;
+        sc.settings._encoder = SR_ENCODER_SOFTWARE;
+        sc.settings._profile = codec.profile;
+        sc.settings._codec = codec.codec;
+        sc.settings._hdr = codec.hdr;
+        sc.settings._chroma = codec.chroma;
+        sc.settings._loglevel = SR_LOG_WARNING;
+        sc.settings._hugepages = hugePages;
+        sc.settings._power = power;
+        sc.settings._convertthreads = convertThreads;
+
+#ifdef AV_PIX_FMT_X2RGB10
+        sc.openVideoSource(new SRTestGrabber(codec.hdr != SR_HDR_OFF ? AV_PIX_FMT_X2RGB10LE : AV_PIX_FMT_BGR0));
+#else
+        sc.openVideoSource(new SRTestGrabber());
+#endif
+        sc.initOutputFile();
+        sc.initThreads();
+
+        wall = av_gettime_relative();
+        cpu = cpuTime();
+        energy = SRPowerMonitor::energy();
+        allocs = BENCH_ALLOCATIONS();
+        sc.startCapture();
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+        sc.endCapture();
+        sc.finishCapture();
+        wall = av_gettime_relative() - wall;
+        cpu = cpuTime() - cpu;
+        energy = energySince(energy);
+        allocs = BENCH_ALLOCATIONS() - allocs;
+        stats = sc.getStats();
+    }
+    struct stat file;
+    int64_t bytes = stat(BENCH_OUTPUT, &file) ? 0 : (int64_t) file.st_size;
+    remove(BENCH_OUTPUT);
+
+    uint64_t frames = stats.stages[SR_STAGE_ENCODE].count;
+    printf("\n%-6s %-14s %-4s %8.1f fps %6.1f%% cpu %8.1f alloc/frame %8.1f kbit/frame | ns/frame grab %lld scale %lld encode %lld"
+           " mux %lld | latency p50 %lld us p99 %lld us",
+           res.name, codec.name, hugePages ? "2M" : "4K", frames * 1e6 / wall, cpu * 100.0 / wall, frames ? (double) allocs / frames : 0.0,
+           frames ? bytes * 8.0 / 1000 / frames : 0.0,
+           (long long) stats.stages[SR_STAGE_GRAB].mean * 1000, (long long) stats.stages[SR_STAGE_SCALE].mean * 1000,
+           (long long) stats.stages[SR_STAGE_ENCODE].mean * 1000, (long long) stats.stages[SR_STAGE_MUX].mean * 1000,
+           (long long) stats.videoLatency.p50, (long long) stats.videoLatency.p99);
+    if (fps != BENCH_FPS)
+        printf(" | %d fps %s", fps, power == SR_POWER_OFF ? "full power" : "power profile");
+    //the whole package: an idle desktop draws its share too, compare the runs with each other
+    if (energy >= 0)
+        printf(" | %.1f J per recorded minute", energy * 60.0 / wall);
+    if (convertThreads)
+        printf(" | %d convert threads", convertThreads);
+    fflush(stdout);
+    return SRBenchResult{frames * 1e6 / wall, frames ? (double) cpu / frames : 0.0, stats.videoLatency.p99};
+}
+
+/* the matrix of the regression runs: resolutions x encoders x convert threads */
+static const char *regressionResolutions[] = {"720p", "1080p", "4k"};
+static const char *regressionCodecs[] = {"legacy", "screen-h264", "screen-hevc"};
+static const int regressionThreads[] = {1, 2, 4};
+
+/**
+ * baselineValue() is the number after "key": in the object of the baseline that starts at entry, -1 if it has none
+ */
+static double baselineValue(const std::string &json, size_t entry, const char *key) {
+    size_t end = json.find('}', entry);
+    size_t at = json.find(std::string("\"") + key + "\":", entry);
+    if (at == std::string::npos || at > end)
+        return -1;
+    return strtod(json.c_str() + at + strlen(key) + 3, nullptr);
+}
+
+/**
+ * runRegression() runs the matrix and compares it with the baseline of path, or writes it there
+ * @param threshold % of throughput lost or CPU time per frame gained that counts as a regression
+ * @return the exit code: 0, 1 when a configuration regressed, 2 when the baseline cannot be written
+ */
+static int runRegression(int seconds, const char *path, double threshold, bool update) {
+    std::string baseline;
+    FILE *in = update ? nullptr : fopen(path, "r");
+    if (in) {
+        char chunk[4096];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+            baseline.append(chunk, n);
+        fclose(in);
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    double baselineCores = baseline.empty() ? -1 : baselineValue(baseline, 0, "cores");
+    if (baselineCores > 0 && (long) baselineCores != cores)
+        printf("\nthe baseline was taken on %ld cores, this host has %ld: the comparison is only indicative",
+               (long) baselineCores, cores);
+
+    std::string results = "{\"cores\":" + std::to_string(cores) + ",\"seconds\":" + std::to_string(seconds) +
+                          ",\"results\":[";
+    int regressions = 0, compared = 0;
+    char line[512];
+    for (const char *resName : regressionResolutions)
+        for (const char *codecName : regressionCodecs)
+            for (int threads : regressionThreads) {
+                const SRBenchResolution *res = nullptr;
+                const SRBenchCodec *codec = nullptr;
+                for (const SRBenchResolution &r : resolutions)
+                    if (!strcmp(r.name, resName))
+                        res = &r;
+                for (const SRBenchCodec &c : codecs)
+                    if (!strcmp(c.name, codecName))
+                        codec = &c;
+                std::string name = std::string(resName) + "/" + codecName + "/" + std::to_string(threads);
+                SRBenchResult result = run(*res, *codec, seconds, false, SR_POWER_OFF, BENCH_FPS, threads);
+                snprintf(line, sizeof(line), "%s\n{\"name\":\"%s\",\"fps\":%.2f,\"cpuPerFrame\":%.1f,\"p99\":%lld}",
+                         results.back() == '}' ? "," : "", name.c_str(), result.fps,
+                         result.cpuPerFrame, (long long) result.p99);
+                results += line;
+
+                size_t entry = baseline.empty() ? std::string::npos : baseline.find("\"name\":\"" + name + "\"");
+                if (entry == std::string::npos) {
+                    if (!baseline.empty())
+                        printf("\n  %s: not in the baseline", name.c_str());
+                    continue;
+                }
+                double fps = baselineValue(baseline, entry, "fps");
+                double cpuPerFrame = baselineValue(baseline, entry, "cpuPerFrame");
+                double fpsChange = fps > 0 ? (result.fps - fps) * 100 / fps : 0;
+                double cpuChange = cpuPerFrame > 0 ? (result.cpuPerFrame - cpuPerFrame) * 100 / cpuPerFrame : 0;
+                bool regressed = fpsChange < -threshold || cpuChange > threshold;
+                printf("\n  %s: %+.1f%% fps, %+.1f%% cpu per frame, p99 %lld us (baseline %lld)%s", name.c_str(),
+                       fpsChange, cpuChange, (long long) result.p99, (long long) baselineValue(baseline, entry, "p99"),
+                       regressed ? "  REGRESSION" : "");
+                compared++;
+                if (regressed)
+                    regressions++;
+            }
+    results += "\n]}\n";
+
+    if (baseline.empty()) {
+        FILE *out = fopen(path, "w");
+        if (!out || fputs(results.c_str(), out) < 0) {
+            fprintf(stderr, "\ncannot write the baseline %s\n", path);
+            if (out)
+                fclose(out);
+            return 2;
+        }
+        fclose(out);
+        printf("\nbaseline of %d configurations written to %s\n", (int) (sizeof(regressionResolutions) /
+               sizeof(*regressionResolutions) * sizeof(regressionCodecs) / sizeof(*regressionCodecs) *
+               sizeof(regressionThreads) / sizeof(*regressionThreads)), path);
+        return 0;
+    }
+    printf("\n%d of %d configurations regressed by more than %.0f%%\n", regressions, compared, threshold);
+    return regressions ? 1 : 0;
+}
+
+/**
+ * processAge() is the time since the process started in us, the loading of its libraries included:
+ * /proc/self/stat has the start in clock ticks after boot, -1 if it cannot be read
+ */
+static int64_t processAge() {
+    FILE *stat = fopen("/proc/self/stat", "r");
+    if (!stat)
+        return -1;
+    char line[1024];
+    size_t length = fread(line, 1, sizeof(line) - 1, stat);
+    fclose(stat);
+    line[length] = 0;
+    //the fields after the command, which may hold spaces: starttime is the 20th of them
+    const char *field = strrchr(line, ')');
+    for (int i = 0; field && i < 20; i++)
+        field = strchr(field + 1, ' ');
+    struct timespec now;
+    if (!field || clock_gettime(CLOCK_BOOTTIME, &now) < 0)
+        return -1;
+    int64_t start = (int64_t) (strtoull(field + 1, nullptr, 10) * 1000000 / sysconf(_SC_CLK_TCK));
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000 - start;
+}
+
+/* KiB resident, VmRSS of /proc/self/status, -1 if it cannot be read */
+static int64_t residentKiB() {
+    FILE *status = fopen("/proc/self/status", "r");
+    if (!status)
+        return -1;
+    char line[256];
+    long long kib = -1;
+    while (fgets(line, sizeof(line), status))
+        if (sscanf(line, "VmRSS: %lld kB", &kib) == 1)
+            break;
+    fclose(status);
+    return kib;
+}
+
+/**
+ * runStartup() records until the first frame is muxed and prints how long it took since the start of the process
+ * and since the recorder was created, with the resident memory at that point
+ */
+static void runStartup() {
+    int64_t age = processAge(), created = av_gettime_relative(), first = -1, rss = -1;
+    {
+        ScreenRecorder sc;
+        sc.settings.filename = (char *) BENCH_OUTPUT;
+        sc.settings._recvideo = true;
+        sc.settings._recaudio = false;
+        sc.settings._inscreenres = resolutions[1].resolution;
+        sc.settings._outscreenres = resolutions[1].resolution;
+        sc.settings._fps = BENCH_POWER_FPS;
+        sc.settings._encoder = SR_ENCODER_SOFTWARE;
+        sc.settings._loglevel = SR_LOG_WARNING;
+        sc.openVideoSource(new SRTestGrabber());
+        sc.initOutputFile();
+        sc.initThreads();
+        sc.startCapture();
+        for (int ms = 0; ms < BENCH_STARTUP_TIMEOUT; ms++) {
+            if (sc.getStats().stages[SR_STAGE_MUX].count) {
+                first = av_gettime_relative() - created;
+                rss = residentKiB();
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        sc.endCapture();
+        sc.finishCapture();
+    }
+    remove(BENCH_OUTPUT);
+    if (first < 0) {
+        printf("\nstartup no frame muxed within %d ms", BENCH_STARTUP_TIMEOUT);
+        return;
+    }
+    printf("\nstartup %s: first frame muxed %.1f ms after the start of the process, %.1f ms after the recorder was"
+           " created | %lld KiB resident",
+#ifdef SR_MINIMAL_FFMPEG
+           "minimal FFmpeg",
+#else
+           "full FFmpeg",
+#endif
+           age >= 0 ? (age + first) / 1000.0 : -1.0, first / 1000.0, (long long) rss);
+    fflush(stdout);
+}
+
+/**
+ * runAac() encodes seconds of synthetic stereo (a chord, its harmonics and some noise, like speech over music)
+ * with the native AAC encoder and prints the CPU time per second of audio
+ * @param fast the options of settings._aacfast
+ */
+static void runAac(int seconds, bool fast) {
+    const AVCodec *codec = avcodec_find_encoder_by_name("aac");
+    AVCodecContext *ctx = codec ? avcodec_alloc_context3(codec) : nullptr;
+    if (!ctx) {
+        printf("\naac    no native AAC encoder");
+        return;
+    }
+    ctx->sample_rate = BENCH_AAC_RATE;
+    ctx->sample_fmt = AV_SAMPLE_FMT_FLTP;
+    ctx->channels = 2;
+    ctx->channel_layout = av_get_default_channel_layout(2);
+    ctx->bit_rate = BENCH_AAC_BITRATE;
+    ctx->time_base = {1, BENCH_AAC_RATE};
+    ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+    if (fast) {
+        av_opt_set(ctx->priv_data, "aac_coder", "fast", 0);
+        av_opt_set_int(ctx->priv_data, "aac_tns", 0, 0);
+        av_opt_set_int(ctx->priv_data, "aac_pns", 0, 0);
+        av_opt_set_int(ctx->priv_data, "aac_is", 0, 0);
+    }
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *pkt = av_packet_alloc();
+    if (avcodec_open2(ctx, codec, nullptr) < 0 || !frame || !pkt) {
+        printf("\naac    cannot open the encoder");
+        av_frame_free(&frame);
+        av_packet_free(&pkt);
+        avcodec_free_context(&ctx);
+        return;
+    }
+    frame->nb_samples = ctx->frame_size;
+    frame->format = ctx->sample_fmt;
+    frame->channel_layout = ctx->channel_layout;
+    frame->channels = ctx->channels;
+    av_frame_get_buffer(frame, 0);
+
+    int64_t samples = (int64_t) seconds * BENCH_AAC_RATE, bytes = 0;
+    uint32_t noise = 1;
+    int64_t cpu = cpuTime();
+    for (int64_t t = 0; t < samples; t += frame->nb_samples) {
+        av_frame_make_writable(frame);
+        for (int ch = 0; ch < 2; ch++) {
+            float *out = (float *) frame->data[ch];
+            for (int i = 0; i < frame->nb_samples; i++) {
+                double s = (double) (t + i) / BENCH_AAC_RATE;
+                noise = noise * 1664525 + 1013904223;
+                out[i] = (float) (0.3 * sin(2 * M_PI * (220 + ch * 110) * s) + 0.15 * sin(2 * M_PI * 1320 * s) +
+                                  0.05 * sin(2 * M_PI * 5280 * s) + 0.02 * ((int32_t) noise / 2147483648.0));
+            }
+        }
+        frame->pts = t;
+        avcodec_send_frame(ctx, frame);
+        while (avcodec_receive_packet(ctx, pkt) >= 0) {
+            bytes += pkt->size;
+            av_packet_unref(pkt);
+        }
+    }
+    avcodec_send_frame(ctx, nullptr);
+    while (avcodec_receive_packet(ctx, pkt) >= 0) {
+        bytes += pkt->size;
+        av_packet_unref(pkt);
+    }
+    cpu = cpuTime() - cpu;
+    printf("\naac    %-12s %8.2f ms cpu per s of audio %6.1fx real time %6.1f kbit/s",
+           fast ? "fast" : "twoloop", cpu / 1000.0 / seconds, seconds * 1e6 / FFMAX(cpu, 1),
+           bytes * 8.0 / seconds / 1000);
+    fflush(stdout);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&ctx);
+}
+
+#ifdef SR_HAVE_COROUTINES
+/* one session of a coroutine run: frames moving bars through encodeFrame(), then the drain */
+static SRCoTask coSession(SRTaskPool &pool, AVCodecContext *ctx, AVFrame *frame, int64_t frames,
+                          std::atomic<int64_t> &bytes) {
+    std::vector<AVPacket *> packets;
+    for (int64_t i = 0; ; i++) {
+        const AVFrame *in = nullptr;
+        if (i < frames) {
+            av_frame_make_writable(frame);
+            memset(frame->data[0], 16, (size_t) frame->linesize[0] * frame->height);
+            int row = (int) (i * 8 % frame->height);
+            memset(frame->data[0] + (size_t) row * frame->linesize[0], 235,
+                   (size_t) frame->linesize[0] * FFMIN(8, frame->height - row));
+            frame->pts = i;
+            in = frame;
+        }
+        int ret = co_await encodeFrame(pool, ctx, in, packets);
+        for (AVPacket *pkt : packets) {
+            bytes += pkt->size;
+            av_packet_free(&pkt);
+        }
+        packets.clear();
+        if (ret == AVERROR_EOF)
+            co_return 0;
+        if (ret < 0)
+            co_return ret;
+    }
+}
+
+/**
+ * runCoroutines() encodes seconds of BENCH_CO_FPS frames in each of BENCH_CO_SESSIONS sessions, all spawned on one
+ * SRTaskPool, and prints the throughput of the pool
+ */
+static void runCoroutines(int seconds) {
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!codec) {
+        printf("\ncoroutines no H.264 encoder");
+        return;
+    }
+    std::vector<AVCodecContext *> contexts;
+    std::vector<AVFrame *> frames;
+    for (int i = 0; i < BENCH_CO_SESSIONS; i++) {
+        AVCodecContext *ctx = avcodec_alloc_context3(codec);
+        AVFrame *frame = av_frame_alloc();
+        if (ctx) {
+            ctx->width = 1280;
+            ctx->height = 720;
+            ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+            ctx->time_base = {1, BENCH_CO_FPS};
+            //the pool is the parallelism: one thread per encoder
+            ctx->thread_count = 1;
+        }
+        if (!ctx || !frame || avcodec_open2(ctx, codec, nullptr) < 0) {
+            printf("\ncoroutines cannot open the encoder");
+            avcodec_free_context(&ctx);
+            av_frame_free(&frame);
+            break;
+        }
+        frame->format = ctx->pix_fmt;
+        frame->width = ctx->width;
+        frame->height = ctx->height;
+        av_frame_get_buffer(frame, 0);
+        memset(frame->data[1], 128, (size_t) frame->linesize[1] * (ctx->height / 2));
+        memset(frame->data[2], 128, (size_t) frame->linesize[2] * (ctx->height / 2));
+        contexts.push_back(ctx);
+        frames.push_back(frame);
+    }
+
+    std::atomic<int64_t> bytes(0);
+    std::mutex lock;
+    std::condition_variable finished;
+    size_t running = contexts.size();
+    int failed = 0;
+    int64_t count = (int64_t) seconds * BENCH_CO_FPS, wall = av_gettime_relative(), cpu = cpuTime();
+    {
+        SRTaskPool pool;
+        for (size_t i = 0; i < contexts.size(); i++)
+            coSession(pool, contexts[i], frames[i], count, bytes).spawn(pool, [&](int ret) {
+                std::lock_guard<std::mutex> guard(lock);
+                if (ret < 0)
+                    failed++;
+                running--;
+                finished.notify_one();
+            });
+        std::unique_lock<std::mutex> guard(lock);
+        finished.wait(guard, [&]() { return running == 0; });
+    }
+    wall = av_gettime_relative() - wall;
+    cpu = cpuTime() - cpu;
+    int64_t encoded = count * (int64_t) contexts.size();
+    printf("\ncoroutines %d sessions 720p %8.1f fps %6.1f%% cpu %8.1f kbit/frame%s", (int) contexts.size(),
+           encoded * 1e6 / FFMAX(wall, 1), cpu * 100.0 / FFMAX(wall, 1), encoded ? bytes * 8.0 / 1000 / encoded : 0.0,
+           failed ? " | a session failed" : "");
+    fflush(stdout);
+    for (size_t i = 0; i < contexts.size(); i++) {
+        avcodec_free_context(&contexts[i]);
+        av_frame_free(&frames[i]);
+    }
+}
+#endif
+
+int main(int argc, char **argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : BENCH_SECONDS;
+    if (seconds <= 0) seconds = BENCH_SECONDS;
+
+    std::vector<const SRBenchResolution *> selected;
+    bool compareHugePages = false, comparePower = false;
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "hugepages"))
+            compareHugePages = true;
+        if (!strcmp(argv[i], "power"))
+            comparePower = true;
+        if (!strcmp(argv[i], "regress") && i + 1 < argc) {
+            double threshold = BENCH_REGRESSION;
+            bool update = false;
+            for (int j = i + 2; j < argc; j++) {
+                if (!strncmp(argv[j], "threshold=", 10))
+                    threshold = atof(argv[j] + 10);
+                if (!strcmp(argv[j], "update"))
+                    update = true;
+            }
+            return runRegression(seconds, argv[i + 1], threshold, update);
+        }
+        if (!strcmp(argv[i], "startup")) {
+            runStartup();
+            printf("\n");
+            return 0;
+        }
+#ifdef SR_HAVE_COROUTINES
+        if (!strcmp(argv[i], "coroutines")) {
+            runCoroutines(seconds);
+            printf("\n");
+            return 0;
+        }
+#endif
+        if (!strcmp(argv[i], "aac")) {
+            runAac(seconds, false);
+            runAac(seconds, true);
+            printf("\n");
+            return 0;
+        }
+        for (const SRBenchResolution &res : resolutions)
+            if (!strcmp(argv[i], res.name))
+                selected.push_back(&res);
+    }
+    if (selected.empty()) {
+        for (const SRBenchResolution &res : resolutions)
+            selected.push_back(&res);
+    }
+
+    for (const SRBenchResolution *res : selected)
+        for (const SRBenchCodec &codec : codecs) {
+            if (comparePower) {
+                run(*res, codec, seconds, false, SR_POWER_OFF, BENCH_POWER_FPS);
+                run(*res, codec, seconds, false, SR_POWER_SAVE, BENCH_POWER_FPS);
+                continue;
+            }
+            run(*res, codec, seconds, false);
+            if (compareHugePages)
+                run(*res, codec, seconds, true);
+        }
+    printf("\n");
+    return 0;
+}
@@ -0,0 +1,412 @@
+//
+// Capture back-end benchmark: each capture path of this machine grabs the same region on its own, back to back,
+// and the cheapest one that keeps up with the frame rate is recommended, with the settings that select it.
+//
+// usage: capturebench [-seconds N] [-fps N] [-display :0.0] [-offset x,y] -size WxH
+// Linux: the native X11 grabber over shared memory and over pipelined XCB requests, x11grab, kmsgrab, fbdev;
+// Windows: gdigrab and the desktop duplication; macOS: avfoundation and ScreenCaptureKit.
+// On X11 a window of the benchmark is repainted over the region before each grab: the damage driven back-ends
+// have a changed region to copy every time, as while a video plays.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ScreenRecorder.h"
+
+#ifdef __unix__
+#include "SRFbdevGrabber.h"
+#include "SRX11Grabber.h"
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#include "SRDxgiGrabber.h"
+#endif
+#ifdef __APPLE__
+#include "SRSckGrabber.h"
+#endif
+
+extern "C"
+{
+#include "libavdevice/avdevice.h"
+#include "libavutil/time.h"
+}
+
+#define CAPTURE_BENCH_SECONDS 3     //of grabs of each back-end, after CAPTURE_BENCH_WARMUP
+#define CAPTURE_BENCH_WARMUP 10     //grabs left out of the results: the first ones map the images and connect
+#define CAPTURE_BENCH_FPS 60        //rate a back-end must reach to be recommended
+#define CAPTURE_BENCH_DEMUX_FPS 1000    //framerate asked of the demuxers, which pace their reads to it
+
+namespace {
+
+/**
+ * DemuxGrabber reads and decodes a capture demuxer the way openVideoSource() opens it, so the demuxers are timed
+ * through the same interface as the native back-ends, decoder included
+ */
+class DemuxGrabber : public SRVideoGrabber {
+
+private:
+    const char *source;
+    AVFormatContext *input;
+    AVCodecContext *decoder;
+    int streamIndex;
+    AVPacket *pkt;
+
+public:
+    explicit DemuxGrabber(const char *source): source(source), input(nullptr), decoder(nullptr), streamIndex(-1),
+                                               pkt(av_packet_alloc()) {}
+
+    ~DemuxGrabber() override {
+        av_packet_free(&pkt);
+        avcodec_free_context(&decoder);
+        avformat_close_input(&input);
+    }
+
+    int open(const char *device, int x, int y, int width, int height) override {
+        AVDictionary *options = nullptr;
+        std::string url(device);
+        char value[32];
+        snprintf(value, sizeof(value), "%dx%d", width, height);
+        av_dict_set(&options, "video_size", value, 0);
+        av_dict_set_int(&options, "framerate", CAPTURE_BENCH_DEMUX_FPS, 0);
+        if (!strcmp(source, "x11grab"))
+            url = url.substr(0, url.find('+')) + "+" + std::to_string(x) + "," + std::to_string(y);
+        if (!strcmp(source, "gdigrab")) {
+            av_dict_set_int(&options, "offset_x", x, 0);
+            av_dict_set_int(&options, "offset_y", y, 0);
+        }
+#ifdef __unix__
+        if (!strcmp(source, KMS_SOURCE)) {
+            av_dict_set(&options, "device", KMS_DEVICE, 0);
+            av_dict_set(&options, "video_size", nullptr, 0);
+            url = "-";
+        }
+#endif
+#ifdef __APPLE__
+        av_dict_set(&options, "pixel_format", "0rgb", 0);
+#endif
+        avdevice_register_all();
+        AVInputFormat *format = av_find_input_format(source);
+        if (!format) {
+            av_dict_free(&options);
+            return AVERROR_DEMUXER_NOT_FOUND;
+        }
+        int ret = avformat_open_input(&input, url.c_str(), format, &options);
+        av_dict_free(&options);
+        if (ret < 0)
+            return ret;
+        if ((ret = avformat_find_stream_info(input, nullptr)) < 0)
+            return ret;
+        if ((streamIndex = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0)) < 0)
+            return streamIndex;
+        AVCodecParameters *params = input->streams[streamIndex]->codecpar;
+        const AVCodec *codec = avcodec_find_decoder(params->codec_id);
+        if (!codec || !(decoder = avcodec_alloc_context3(codec)))
+            return AVERROR_DECODER_NOT_FOUND;
+        if ((ret = avcodec_parameters_to_context(decoder, params)) < 0)
+            return ret;
+        return avcodec_open2(decoder, codec, nullptr);
+    }
+
+    int grab(AVFrame *frame) override {
+        while (true) {
+            int ret = avcodec_receive_frame(decoder, frame);
+            if (ret != AVERROR(EAGAIN))
+                return ret;
+            if ((ret = av_read_frame(input, pkt)) < 0)
+                return ret;
+            if (pkt->stream_index == streamIndex)
+                ret = avcodec_send_packet(decoder, pkt);
+            av_packet_unref(pkt);
+            if (ret < 0)
+                return ret;
+        }
+    }
+
+    enum AVPixelFormat pixelFormat() const override { return decoder ? decoder->pix_fmt : AV_PIX_FMT_NONE; }
+    const char *name() const override { return source; }
+    bool allocatesFrames() const override { return true; }
+};
+
+/**
+ * A capture path of this platform and the settings of the recorder that record through it
+ */
+typedef struct CB{
+    const char *name;
+    const char *settings;
+    std::function<SRVideoGrabber *()> create;
+    const char *device;     //nullptr for the display of -display
+}SRBenchBackend;
+
+/**
+ * What the grabs of one back-end measured
+ */
+typedef struct CR{
+    const char *name;
+    const char *settings;
+    int error;          //of open() or of a grab, 0 when the back-end ran
+    uint64_t grabs;
+    uint64_t unchanged;
+    double grabMs;      //wall time of a grab
+    double cpuMs;       //CPU time of the grabbing thread per grab
+    double jitterMs;    //standard deviation of the grab times
+    double p99Ms;
+    double maxFps;
+}SRBenchCapture;
+
+/**
+ * threadCpu() is the CPU time of the calling thread in microseconds: the X server, the window server and the GPU
+ * are not counted, compare the paths by it and by their wall time together
+ */
+int64_t threadCpu() {
+#ifdef _WIN32
+    FILETIME creation, exited, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &creation, &exited, &kernel, &user);
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (int64_t) ((k.QuadPart + u.QuadPart) / 10);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+#ifdef __unix__
+/**
+ * Repaint is an override-redirect window over the captured region, filled with another colour before each grab
+ */
+class Repaint {
+
+private:
+    Display *display;
+    Window window;
+    GC gc;
+    unsigned long colour;
+
+public:
+    Repaint(const char *device, int x, int y, int width, int height): window(0), gc(nullptr), colour(0) {
+        std::string name(device);
+        display = XOpenDisplay(name.substr(0, name.find('+')).c_str());
+        if (!display)
+            return;
+        XSetWindowAttributes attributes;
+        attributes.override_redirect = True;
+        window = XCreateWindow(display, DefaultRootWindow(display), x, y, width, height, 0, CopyFromParent,
+                               InputOutput, CopyFromParent, CWOverrideRedirect, &attributes);
+        XMapRaised(display, window);
+        gc = XCreateGC(display, window, 0, nullptr);
+        XSync(display, False);
+    }
+
+    ~Repaint() {
+        if (!display)
+            return;
+        if (gc)
+            XFreeGC(display, gc);
+        if (window)
+            XDestroyWindow(display, window);
+        XCloseDisplay(display);
+    }
+
+    Repaint(const Repaint&) = delete;
+    Repaint &operator=(const Repaint&) = delete;
+
+    /**
+     * next() paints the window and waits for the server to have drawn it, outside of the timed grab
+     */
+    void next() {
+        if (!display)
+            return;
+        colour = (colour + 0x10305) & 0xffffff;
+        XSetForeground(display, gc, colour);
+        XFillRectangle(display, window, gc, 0, 0, 0xffff, 0xffff);
+        XSync(display, False);
+    }
+};
+#endif
+
+std::vector<SRBenchBackend> backends(int width, int height, int fps) {
+    std::vector<SRBenchBackend> list;
+#ifdef __unix__
+    list.push_back({"x11damage-shm", "settings._damagecapture = true",
+                    []() -> SRVideoGrabber * { return new SRX11Grabber(); }, nullptr});
+    list.push_back({"x11damage-xcb", "settings._damagecapture = true, used on the servers without shared memory",
+                    []() -> SRVideoGrabber * {
+                        SRX11Grabber *grabber = new SRX11Grabber();
+                        grabber->fetchOverConnection();
+                        return grabber;
+                    }, nullptr});
+    list.push_back({"x11grab", "settings.videosource = \"x11grab\"",
+                    []() -> SRVideoGrabber * { return new DemuxGrabber("x11grab"); }, nullptr});
+    list.push_back({"kmsgrab", "settings._gpucapture = true",
+                    []() -> SRVideoGrabber * { return new DemuxGrabber(KMS_SOURCE); }, KMS_DEVICE});
+    list.push_back({"fbdev", "settings.videosource = FBDEV_SOURCE",
+                    []() -> SRVideoGrabber * { return new SRFbdevGrabber(false); }, FBDEV_DEVICE});
+#endif
+#ifdef _WIN32
+    list.push_back({"gdigrab", "settings.videosource = \"gdigrab\"",
+                    []() -> SRVideoGrabber * { return new DemuxGrabber("gdigrab"); }, nullptr});
+    list.push_back({"dxgi", "settings._gpucapture = true",
+                    [width, height]() -> SRVideoGrabber * { return new SRDxgiGrabber(width, height); }, nullptr});
+    list.push_back({"dxgi-readback", "settings._sourcescale = true, to half the size",
+                    [width, height]() -> SRVideoGrabber * {
+                        return new SRDxgiGrabber(width / 2 & ~1, height / 2 & ~1, true);
+                    }, nullptr});
+#endif
+#ifdef __APPLE__
+    list.push_back({"avfoundation", "settings.videosource = \"avfoundation\"",
+                    []() -> SRVideoGrabber * { return new DemuxGrabber("avfoundation"); }, nullptr});
+    list.push_back({"screencapturekit", "settings._gpucapture = true",
+                    [width, height, fps]() -> SRVideoGrabber * { return new SRSckGrabber(width, height, fps); },
+                    nullptr});
+    list.push_back({"screencapturekit-mapped", "settings._sourcescale = true, to half the size",
+                    [width, height, fps]() -> SRVideoGrabber * {
+                        return new SRSckGrabber(width / 2 & ~1, height / 2 & ~1, fps, true);
+                    }, nullptr});
+#endif
+    (void) width;
+    (void) height;
+    (void) fps;
+    return list;
+}
+
+/**
+ * measure() opens a back-end and grabs back to back for seconds
+ */
+SRBenchCapture measure(const SRBenchBackend &backend, const char *display, int x, int y, int width, int height,
+                       int seconds) {
+    SRBenchCapture result = SRBenchCapture();
+    result.name = backend.name;
+    result.settings = backend.settings;
+    std::unique_ptr<SRVideoGrabber> grabber(backend.create());
+    const char *device = backend.device ? backend.device : display;
+    if ((result.error = grabber->open(device, x, y, width, height)) < 0)
+        return result;
+#ifdef __unix__
+    Repaint repaint(display, x, y, width, height);
+#endif
+
+    AVFrame *frame = av_frame_alloc();
+    std::vector<int64_t> times;
+    int64_t wall = 0, cpu = 0, end = 0;
+    for (int i = 0; !end || av_gettime_relative() < end; i++) {
+        if (i == CAPTURE_BENCH_WARMUP)
+            end = av_gettime_relative() + seconds * 1000000LL;
+#ifdef __unix__
+        repaint.next();
+#endif
+        int64_t started = av_gettime_relative(), startedCpu = threadCpu();
+        int ret = grabber->grab(frame);
+        int64_t took = av_gettime_relative() - started;
+        int64_t tookCpu = threadCpu() - startedCpu;
+        av_frame_unref(frame);
+        if (ret < 0 && ret != AVERROR(EAGAIN)) {
+            result.error = ret;
+            break;
+        }
+        if (!end || ret == AVERROR(EAGAIN))
+            continue;
+        if (ret == SR_GRAB_UNCHANGED)
+            result.unchanged++;
+        times.push_back(took);
+        wall += took;
+        cpu += tookCpu;
+    }
+    av_frame_free(&frame);
+
+    result.grabs = times.size();
+    if (!result.grabs)
+        return result;
+    double mean = (double) wall / result.grabs, variance = 0;
+    for (int64_t t : times)
+        variance += (t - mean) * (t - mean);
+    std::sort(times.begin(), times.end());
+    result.grabMs = mean / 1000;
+    result.cpuMs = (double) cpu / result.grabs / 1000;
+    result.jitterMs = std::sqrt(variance / result.grabs) / 1000;
+    result.p99Ms = times[times.size() * 99 / 100] / 1000.0;
+    result.maxFps = 1e6 / mean;
+    return result;
+}
+
+}
+
+int main(int argc, char **argv) {
+    int seconds = CAPTURE_BENCH_SECONDS, fps = CAPTURE_BENCH_FPS, x = 0, y = 0, width = 0, height = 0, i = 1;
+#ifdef __unix__
+    const char *display = ":0.0";
+#else
+    const char *display = VIDEO_URL;
+#endif
+    bool valid = true;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (!strcmp(argv[i], "-seconds"))
+            seconds = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-fps"))
+            fps = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-display"))
+            display = argv[i + 1];
+        else if (!strcmp(argv[i], "-offset"))
+            valid = sscanf(argv[i + 1], "%d,%d", &x, &y) == 2;
+        else if (!strcmp(argv[i], "-size"))
+            valid = sscanf(argv[i + 1], "%dx%d", &width, &height) == 2;
+        else
+            valid = false;
+        if (!valid)
+            break;
+    }
+    //the encoders want even sizes, the recorder asks the back-ends for them
+    width &= ~1;
+    height &= ~1;
+    if (!valid || i != argc || seconds <= 0 || fps <= 0 || width <= 0 || height <= 0) {
+        fprintf(stderr, "usage: %s [-seconds N] [-fps N] [-display :0.0] [-offset x,y] -size WxH\n", argv[0]);
+        return 2;
+    }
+    av_log_set_level(AV_LOG_ERROR);
+
+    printf("%-18s %9s %9s %9s %9s %9s %10s", "back-end", "ms/grab", "cpu ms", "jitter", "p99 ms", "max fps",
+           "unchanged");
+    const SRBenchCapture *best = nullptr;
+    std::vector<SRBenchCapture> results;
+    std::vector<SRBenchBackend> list = backends(width, height, fps);
+    results.reserve(list.size());
+    for (const SRBenchBackend &backend : list) {
+        results.push_back(measure(backend, display, x, y, width, height, seconds));
+        const SRBenchCapture &r = results.back();
+        if (r.error < 0 && !r.grabs) {
+            char reason[AV_ERROR_MAX_STRING_SIZE];
+            av_strerror(r.error, reason, sizeof(reason));
+            printf("\n%-18s unavailable: %s", r.name, reason);
+            fflush(stdout);
+            continue;
+        }
+        printf("\n%-18s %9.3f %9.3f %9.3f %9.3f %9.1f %10llu%s", r.name, r.grabMs, r.cpuMs, r.jitterMs, r.p99Ms,
+               r.maxFps, (unsigned long long) r.unchanged, r.error < 0 ? "  (stopped by an error)" : "");
+        fflush(stdout);
+        //the cheapest for the recorder among the ones that keep up, the fastest when none does
+        if (r.error < 0)
+            continue;
+        bool keepsUp = r.maxFps >= fps;
+        if (!best || (keepsUp && (best->maxFps < fps || r.cpuMs < best->cpuMs)) ||
+            (!keepsUp && best->maxFps < fps && r.maxFps > best->maxFps))
+            best = &r;
+    }
+    if (!best) {
+        printf("\nno capture back-end could grab %dx%d+%d,%d\n", width, height, x, y);
+        return 1;
+    }
+    printf("\n\nrecommended at %d fps: %s%s\n  %s\n", fps, best->name, best->maxFps < fps ? " (none keeps up)" : "",
+           best->settings);
+    return 0;
+}
@@ -0,0 +1,203 @@
+//
+// Capture host: captures the screen into a shared memory ring and runs the encoder in a child process of its own,
+// a recorder started with settings.sharedsource on the ring that reads the frames in place. A crash of the encoder
+// leaves the capture running: the child is started again on the next file, out.1.mp4, out.2.mp4... Linux (X11) only.
+//
+// usage: capturehost [-fps N] [-display :0.0] [-offset x,y] [-ring /sr-capture] [-slots N] [-audio] -size WxH out.mp4
+//
+
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "ScreenRecorder.h"
+#include "SRFrameClock.h"
+#include "SRSharedFrames.h"
+#include "SRX11Grabber.h"
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include "libavutil/time.h"
+}
+
+#define CAPTURE_HOST_FPS 30
+#define CAPTURE_HOST_RING "/sr-capture"
+#define CAPTURE_HOST_SLOTS 8    //frames of the ring: the encoder holds those of its grab pool and convert queues
+#define CAPTURE_HOST_RESTART 1000   //ms between the crash of the encoder and its next start
+#define CAPTURE_HOST_STABLE 10000   //ms an encoder runs before its crash counts as a new one
+#define CAPTURE_HOST_MAX_FAILS 5    //encoders in a row crashing within CAPTURE_HOST_STABLE before the host gives up
+
+static std::atomic<bool> stopping(false);
+
+static void stop(int) {
+    stopping = true;
+}
+
+/**
+ * segmentName() is the file of the encoder started after restarts crashes: out.mp4, then out.1.mp4, out.2.mp4...
+ */
+static std::string segmentName(const char *filename, int restarts) {
+    std::string name(filename);
+    if (!restarts)
+        return name;
+    size_t dot = name.find_last_of('.');
+    size_t slash = name.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = name.size();
+    return name.substr(0, dot) + "." + std::to_string(restarts) + name.substr(dot);
+}
+
+/**
+ * encode() is the child process: a recorder of the ring until the host sends SIGTERM or exits
+ */
+static int encode(const char *ring, const std::string &filename, int fps, bool audio) {
+    //the Ctrl-C of the terminal reaches the whole group: the host stops the encoder once its capture is done
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, stop);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    ScreenRecorder sc;
+    sc.settings.filename = (char *) filename.c_str();
+    sc.settings.sharedsource = (char *) ring;
+    sc.settings._recvideo = true;
+    sc.settings._recaudio = audio;
+    sc.settings._fps = fps;
+    sc.settings._outscreenres = {0, 0};
+    sc.openVideoSource();
+    if (audio)
+        sc.openAudioSource();
+    sc.initOutputFile();
+    sc.initThreads();
+    sc.startCapture();
+    while (!stopping)
+        av_usleep(100000);
+    sc.endCapture();
+    sc.finishCapture();
+    return 0;
+}
+
+/**
+ * spawn() starts the encoder; the child never returns: it leaves the ring and the display of the host as they are
+ */
+static pid_t spawn(const char *ring, const std::string &filename, int fps, bool audio) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(encode(ring, filename, fps, audio));
+    if (pid > 0)
+        printf("\nencoder %d recording to %s", (int) pid, filename.c_str());
+    return pid;
+}
+
+int main(int argc, char **argv) {
+    int fps = CAPTURE_HOST_FPS, slots = CAPTURE_HOST_SLOTS, x = 0, y = 0, width = 0, height = 0, i = 1;
+    const char *display = ":0.0", *ring = CAPTURE_HOST_RING;
+    bool valid = true, audio = false;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (!strcmp(argv[i], "-audio")) {
+            audio = true;
+            i--;
+        } else if (!strcmp(argv[i], "-fps"))
+            fps = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-display"))
+            display = argv[i + 1];
+        else if (!strcmp(argv[i], "-offset"))
+            valid = sscanf(argv[i + 1], "%d,%d", &x, &y) == 2;
+        else if (!strcmp(argv[i], "-size"))
+            valid = sscanf(argv[i + 1], "%dx%d", &width, &height) == 2;
+        else if (!strcmp(argv[i], "-ring"))
+            ring = argv[i + 1];
+        else if (!strcmp(argv[i], "-slots"))
+            slots = atoi(argv[i + 1]);
+        else
+            valid = false;
+        if (!valid)
+            break;
+    }
+    //the encoders want even sizes
+    width &= ~1;
+    height &= ~1;
+    if (!valid || i + 1 != argc || fps <= 0 || width <= 0 || height <= 0) {
+        fprintf(stderr, "usage: %s [-fps N] [-display :0.0] [-offset x,y] [-ring /sr-capture] [-slots N] [-audio] "
+                        "-size WxH out.mp4\n", argv[0]);
+        return 2;
+    }
+    const char *filename = argv[i];
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    SRX11Grabber grabber(true);
+    if (grabber.open(display, x, y, width, height) < 0) {
+        fprintf(stderr, "cannot capture %dx%d+%d,%d of %s\n", width, height, x, y, display);
+        return 1;
+    }
+    SRSharedFrames frames(ring, slots);
+    if (frames.init(grabber.pixelFormat(), width, height) < 0) {
+        fprintf(stderr, "cannot create the shared memory %s\n", ring);
+        return 1;
+    }
+
+    //the grabber hands out its own images, the ring is the one copy of each
+    AVFrame *frame = av_frame_alloc();
+    SRFrameClock clock;
+    clock.start(1000000 / fps);
+    int restarts = 0, fails = 0;
+    int64_t startedAt = av_gettime_relative(), restartAt = 0;
+    pid_t encoder = spawn(ring, segmentName(filename, 0), fps, audio);
+    if (encoder < 0)
+        restartAt = startedAt + CAPTURE_HOST_RESTART * 1000LL;
+    while (!stopping) {
+        clock.wait();
+        int ret = grabber.grab(frame);
+        if (ret < 0) {
+            fprintf(stderr, "cannot grab from %s: %d\n", display, ret);
+            break;
+        }
+        if (ret == 0) {
+            frames.write(frame);
+            av_frame_unref(frame);
+        }
+
+        int status;
+        if (encoder > 0 && waitpid(encoder, &status, WNOHANG) == encoder) {
+            if (WIFSIGNALED(status))
+                fprintf(stderr, "\nthe encoder %d was killed by signal %d", (int) encoder, WTERMSIG(status));
+            else
+                fprintf(stderr, "\nthe encoder %d exited with %d", (int) encoder, WEXITSTATUS(status));
+            encoder = -1;
+            //the frames it held, its pipeline is gone
+            frames.releaseHolds();
+            fails = av_gettime_relative() - startedAt < CAPTURE_HOST_STABLE * 1000LL ? fails + 1 : 1;
+            if (fails >= CAPTURE_HOST_MAX_FAILS) {
+                fprintf(stderr, "\n%d encoders in a row crashed, giving up", fails);
+                break;
+            }
+            restartAt = av_gettime_relative() + CAPTURE_HOST_RESTART * 1000LL;
+        }
+        if (encoder < 0 && av_gettime_relative() >= restartAt) {
+            restarts++;
+            startedAt = av_gettime_relative();
+            encoder = spawn(ring, segmentName(filename, restarts), fps, audio);
+            if (encoder < 0)
+                restartAt = av_gettime_relative() + CAPTURE_HOST_RESTART * 1000LL;
+        }
+    }
+    if (encoder > 0) {
+        kill(encoder, SIGTERM);
+        waitpid(encoder, nullptr, 0);
+    }
+    av_frame_free(&frame);
+
+    SRClockStats ticks = clock.stats();
+    printf("\n%llu frames to the ring, %llu left out, %d encoder restarts, %llu missed deadlines\n",
+           (unsigned long long) frames.writtenFrames(), (unsigned long long) frames.skippedFrames(), restarts,
+           (unsigned long long) ticks.missed);
+    return 0;
+}
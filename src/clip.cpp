@@ -0,0 +1,61 @@
+//
+// Clip job: exports a range of a recording, copying its GOPs and encoding only the partial ones at the ends.
+// An output ending in .gif is an animated GIF of the range instead, see SRGifExport.
+//
+// usage: clip [-crf N] [-index input.idx] [-fps N] [-width N] input start end output
+//        start and end in seconds or [HH:]MM:SS[.m...], end "-" for the end of the recording
+//        -fps and -width for a GIF only, GIF_FPS and GIF_WIDTH by default
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "SRClip.h"
+#include "SRGifExport.h"
+
+extern "C"
+{
+#include "libavutil/avstring.h"
+#include "libavutil/parseutils.h"
+}
+
+int main(int argc, char **argv) {
+    int crf = CLIP_CRF, fps = GIF_FPS, width = GIF_WIDTH, i = 1;
+    const char *index = nullptr;
+    bool valid = true;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (i + 1 == argc)
+            valid = false;
+        else if (!strcmp(argv[i], "-crf"))
+            crf = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-index"))
+            index = argv[++i];
+        else if (!strcmp(argv[i], "-fps"))
+            fps = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-width"))
+            width = atoi(argv[++i]);
+        else
+            valid = false;
+    }
+    int64_t start = 0, end = INT64_MAX;
+    if (!valid || argc - i != 4 || av_parse_time(&start, argv[i + 1], 1) < 0 ||
+        (strcmp(argv[i + 2], "-") && av_parse_time(&end, argv[i + 2], 1) < 0)) {
+        fprintf(stderr, "usage: %s [-crf N] [-index input.idx] [-fps N] [-width N] input start end|- output\n", argv[0]);
+        return 2;
+    }
+    if (crf <= 0) crf = CLIP_CRF;
+
+    const char *output = argv[i + 3];
+    size_t length = strlen(output);
+    if (length > 4 && !av_strcasecmp(output + length - 4, ".gif")) {
+        SRGifExport gif(fps, width);
+        int ret = gif.run(argv[i], start, end, output);
+        printf("\n");
+        return ret < 0 ? 1 : 0;
+    }
+
+    SRClip job(crf);
+    int ret = job.run(argv[i], start, end, argv[i + 3], index);
+    printf("\n");
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,52 @@
+//
+// Compact job: transcodes intermediate recordings to H.264 or MPEG-4 at idle priority, in parallel chunks;
+// -fast exports at full speed in short chunks instead, -b kbps in two parallel passes to an average bitrate.
+//
+// usage: compact [-crf N] [-b kbps] [-j jobs] [-codec h264|mpeg4] [-fast] input.mkv output.mp4 [input.mkv output.mp4 ...]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include "SRCompact.h"
+
+int main(int argc, char **argv) {
+    int crf = COMPACT_CRF, jobs = 0, kbps = 0, i = 1;
+    enum AVCodecID codec = AV_CODEC_ID_H264;
+    bool fast = false, valid = true;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-fast"))
+            fast = true;
+        else if (i + 1 == argc)
+            valid = false;
+        else if (!strcmp(argv[i], "-crf"))
+            crf = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-b"))
+            kbps = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-j"))
+            jobs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-codec") && !strcmp(argv[i + 1], "mpeg4"))
+            codec = AV_CODEC_ID_MPEG4, i++;
+        else if (!strcmp(argv[i], "-codec") && !strcmp(argv[i + 1], "h264"))
+            i++;
+        else
+            valid = false;
+    }
+    std::vector<std::pair<std::string, std::string>> recordings;
+    for (; i + 1 < argc; i += 2)
+        recordings.emplace_back(argv[i], argv[i + 1]);
+    if (!valid || recordings.empty() || i != argc) {
+        fprintf(stderr, "usage: %s [-crf N] [-b kbps] [-j jobs] [-codec h264|mpeg4] [-fast] input.mkv output.mp4 [input.mkv output.mp4 ...]\n",
+                argv[0]);
+        return 2;
+    }
+    if (crf <= 0) crf = COMPACT_CRF;
+
+    SRCompact job(crf, jobs > 0 ? jobs : 0, codec, fast, kbps > 0 ? (int64_t) kbps * 1000 : 0);
+    int failed = job.runBatch(recordings);
+    printf("\n");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,257 @@
+//
+// Color conversion microbenchmark: swscale flags, unscaled paths and the SRColorConvert kernels.
+//
+// usage: convertbench [resolution ...]   e.g. convertbench 1080p 4k
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "SRColorConvert.h"
+
+extern "C"
+{
+#include "libavutil/common.h"
+#include "libavutil/cpu.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/mem.h"
+#include "libavutil/pixdesc.h"
+#include "libswscale/swscale.h"
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define SR_CYCLES() ((int64_t) __rdtsc())
+#define CYCLE_UNIT "cycles"
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define SR_CYCLES() ((int64_t) __rdtsc())
+#define CYCLE_UNIT "cycles"
+#else
+#define SR_CYCLES() ((int64_t) std::chrono::duration_cast<std::chrono::nanoseconds>( \
+        std::chrono::steady_clock::now().time_since_epoch()).count())
+#define CYCLE_UNIT "ns"
+#endif
+
+#define BENCH_RUNS 50   //timed conversions of each case, after one warm-up
+#define BENCH_ALIGN 64  //stride and buffer alignment of the aligned cases
+
+namespace {
+
+typedef struct X{
+    const char *name;
+    int width;
+    int height;
+}SRBenchResolution;
+
+typedef struct Y{
+    const char *name;
+    int flags;
+}SRBenchFlag;
+
+typedef struct Z{
+    const char *name;
+    int mask;   //cpu flags left enabled, av_force_cpu_flags() style
+}SRBenchCpu;
+
+typedef struct W{
+    enum AVPixelFormat src;
+    enum AVPixelFormat dst;
+    enum AVColorSpace matrix;   //AVCOL_SPC_UNSPECIFIED for the BT.601 default
+}SRBenchConversion;
+
+static const SRBenchResolution resolutions[] = {
+        {"768p", 1366, 768},
+        {"1080p", 1920, 1080},
+        {"1440p", 2560, 1440},
+        {"4k", 3840, 2160},
+};
+
+static const SRBenchFlag swsFlags[] = {
+        {"point", SWS_POINT},
+        {"fast_bilinear", SWS_FAST_BILINEAR},
+        {"bilinear", SWS_BILINEAR},
+        {"bicubic", SWS_BICUBIC},
+        {"area", SWS_AREA},
+};
+
+static const SRBenchConversion conversions[] = {
+        {AV_PIX_FMT_BGR0, AV_PIX_FMT_YUV420P, AVCOL_SPC_UNSPECIFIED},
+        {AV_PIX_FMT_BGR0, AV_PIX_FMT_NV12, AVCOL_SPC_UNSPECIFIED},
+        {AV_PIX_FMT_BGR0, AV_PIX_FMT_YUV444P, AVCOL_SPC_UNSPECIFIED},
+        //8 bit output of settings._hdr
+        {AV_PIX_FMT_BGR0, AV_PIX_FMT_NV12, AVCOL_SPC_BT709},
+#ifdef AV_PIX_FMT_X2RGB10
+        //deep color desktops, settings._hdr
+        {AV_PIX_FMT_X2RGB10LE, AV_PIX_FMT_YUV420P10LE, AVCOL_SPC_BT709},
+        {AV_PIX_FMT_X2RGB10LE, AV_PIX_FMT_P010LE, AVCOL_SPC_BT709},
+        {AV_PIX_FMT_X2RGB10LE, AV_PIX_FMT_P010LE, AVCOL_SPC_BT2020_NCL},
+#endif
+};
+
+static const SRBenchCpu cpus[] = {
+        {"native", -1},
+        {"no-avx512", ~AV_CPU_FLAG_AVX512},
+        {"no-avx2", ~(AV_CPU_FLAG_AVX2 | AV_CPU_FLAG_AVX512)},
+        {"no-simd", 0},
+};
+
+/* one frame of packed source pixels and its destination planes, aligned or deliberately off by 4 bytes */
+typedef struct I{
+    std::vector<uint8_t> memory;
+    const uint8_t *src;
+    int srcStride;
+    uint8_t *dst[4];
+    int dstStride[4];
+    std::vector<uint8_t> dstMemory;
+}SRBenchBuffers;
+
+}
+
+static void allocate(SRBenchBuffers &b, int width, int height, int dstWidth, int dstHeight,
+                     enum AVPixelFormat dstFormat, bool aligned) {
+    int skew = aligned ? 0 : 4;
+    b.srcStride = FFALIGN(width * 4, BENCH_ALIGN) + skew;
+    b.memory.assign((size_t) b.srcStride * height + BENCH_ALIGN + skew, 0);
+    uintptr_t base = FFALIGN((uintptr_t) b.memory.data(), BENCH_ALIGN) + skew;
+    b.src = (const uint8_t *) base;
+    for (int row = 0; row < height; row++)
+        for (int col = 0; col < width * 4; col++)
+            ((uint8_t *) b.src)[(size_t) row * b.srcStride + col] = (uint8_t) (row * 3 + col * 7);
+
+    memset(b.dst, 0, sizeof(b.dst));
+    memset(b.dstStride, 0, sizeof(b.dstStride));
+    int lumaStride = FFALIGN(dstWidth, BENCH_ALIGN) + skew;
+    av_image_fill_linesizes(b.dstStride, dstFormat, lumaStride);
+    int size = av_image_fill_pointers(b.dst, dstFormat, dstHeight, nullptr, b.dstStride);
+    b.dstMemory.assign((size_t) size + BENCH_ALIGN + skew, 0);
+    av_image_fill_pointers(b.dst, dstFormat, dstHeight, (uint8_t *) FFALIGN((uintptr_t) b.dstMemory.data(), BENCH_ALIGN) + skew,
+                           b.dstStride);
+}
+
+/**
+ * measure() times BENCH_RUNS calls of convert and prints the best and the median cost per source pixel,
+ * like START_TIMER/STOP_TIMER the first call is left out
+ */
+template <typename F>
+static void measure(const char *label, int pixels, F convert) {
+    std::vector<int64_t> runs;
+    convert();
+    for (int i = 0; i < BENCH_RUNS; i++) {
+        int64_t start = SR_CYCLES();
+        convert();
+        runs.push_back(SR_CYCLES() - start);
+    }
+    std::sort(runs.begin(), runs.end());
+    printf("\n  %-40s %7.3f %s/pixel best, %7.3f median", label, (double) runs[0] / pixels, CYCLE_UNIT,
+           (double) runs[runs.size() / 2] / pixels);
+    fflush(stdout);
+}
+
+static void benchSws(const SRBenchResolution &res, const SRBenchConversion &conv, bool aligned, bool scaled,
+                     const SRBenchFlag &flag, const SRBenchCpu &cpu) {
+    int dstWidth = scaled ? res.width / 2 : res.width, dstHeight = scaled ? res.height / 2 : res.height;
+    SRBenchBuffers b;
+    allocate(b, res.width, res.height, dstWidth, dstHeight, conv.dst, aligned);
+    //swscale picks its kernels when the context is created
+    struct SwsContext *sws = sws_getContext(res.width, res.height, conv.src, dstWidth, dstHeight, conv.dst,
+                                            flag.flags, nullptr, nullptr, nullptr);
+    if (!sws) {
+        printf("\n  sws %s: no context", flag.name);
+        return;
+    }
+    if (conv.matrix != AVCOL_SPC_UNSPECIFIED) {
+        //the matrix of SRScaler::setColorspace()
+        const int *coefficients = sws_getCoefficients(conv.matrix);
+        sws_setColorspaceDetails(sws, coefficients, 1, coefficients, 0, 0, 1 << 16, 1 << 16);
+    }
+    char label[128];
+    snprintf(label, sizeof(label), "sws %s %s %s", scaled ? "1/2" : "1:1", flag.name, cpu.name);
+    const uint8_t *const srcPlanes[4] = {b.src, nullptr, nullptr, nullptr};
+    const int srcStrides[4] = {b.srcStride, 0, 0, 0};
+    measure(label, res.width * res.height, [&](){
+        sws_scale(sws, srcPlanes, srcStrides, 0, res.height, b.dst, b.dstStride);
+    });
+    sws_freeContext(sws);
+}
+
+static void benchKernel(const SRBenchResolution &res, const SRBenchConversion &conv, bool aligned, const SRBenchCpu &cpu) {
+    SRColorConvertFn convert = getColorConverter(conv.src, conv.dst, conv.matrix);
+    if (!convert)
+        return;
+    //x86 has no run time C path, SSE2 is the compile time baseline: no-simd would measure it again
+    const char *name = getColorConverterName(conv.src, conv.dst, conv.matrix);
+    if (!cpu.mask && strcmp(name, "C"))
+        return;
+    SRBenchBuffers b;
+    allocate(b, res.width, res.height, res.width, res.height, conv.dst, aligned);
+    char label[128];
+    snprintf(label, sizeof(label), "SRColorConvert %s %s", name, cpu.name);
+    measure(label, res.width * res.height, [&](){
+        convert(b.src, b.srcStride, b.dst, b.dstStride, res.width, res.height);
+    });
+}
+
+/**
+ * benchDownscale() times the fused 2:1 or 4:3 downscale and conversion, the counterpart of the scaled swscale cases
+ */
+static void benchDownscale(const SRBenchResolution &res, const SRBenchConversion &conv, bool aligned, enum SRDownscale ratio,
+                           const SRBenchCpu &cpu) {
+    SRColorConvertFn convert = getColorConverter(conv.src, conv.dst, conv.matrix);
+    int dstWidth = ratio == SR_DOWNSCALE_HALF ? res.width / 2 : res.width / 4 * 3;
+    int dstHeight = ratio == SR_DOWNSCALE_HALF ? res.height / 2 : res.height / 4 * 3;
+    //the 8 bit conversions, the X2RGB10 ones have no fused kernel
+    if (!convert || conv.src != AV_PIX_FMT_BGR0 ||
+        getDownscale(res.width, res.height, dstWidth, dstHeight) != ratio)
+        return;
+    const char *name = getColorConverterName(conv.src, conv.dst, conv.matrix);
+    if (!cpu.mask && strcmp(name, "C"))
+        return;
+    SRBenchBuffers b;
+    allocate(b, res.width, res.height, dstWidth, dstHeight, conv.dst, aligned);
+    std::vector<uint8_t> scratch((size_t) 8 * dstWidth);
+    int chromaShift = av_pix_fmt_desc_get(conv.dst)->log2_chroma_h;
+    char label[128];
+    snprintf(label, sizeof(label), "SRColorConvert %s %s %s", ratio == SR_DOWNSCALE_HALF ? "1/2" : "3/4", name, cpu.name);
+    measure(label, res.width * res.height, [&](){
+        convertDownscaled(ratio, convert, chromaShift, b.src, b.srcStride, b.dst, b.dstStride, dstWidth, dstHeight,
+                          scratch.data());
+    });
+}
+
+int main(int argc, char **argv) {
+    const int nativeFlags = av_get_cpu_flags();
+
+    printf("RGB to YUV, %d runs per case, cpu flags 0x%x", BENCH_RUNS, nativeFlags);
+    for (const SRBenchResolution &res : resolutions) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; i++)
+            selected = selected || !strcmp(argv[i], res.name);
+        if (!selected)
+            continue;
+
+        for (const SRBenchConversion &conv : conversions) {
+            for (int aligned = 1; aligned >= 0; aligned--) {
+                printf("\n\n%s %dx%d %s -> %s%s, %s", res.name, res.width, res.height, av_get_pix_fmt_name(conv.src),
+                       av_get_pix_fmt_name(conv.dst), conv.matrix == AVCOL_SPC_BT2020_NCL ? " bt2020" : "",
+                       aligned ? "aligned" : "misaligned");
+                for (const SRBenchCpu &cpu : cpus) {
+                    av_force_cpu_flags(cpu.mask == -1 ? -1 : nativeFlags & cpu.mask);
+                    benchKernel(res, conv, aligned, cpu);
+                    benchDownscale(res, conv, aligned, SR_DOWNSCALE_HALF, cpu);
+                    benchDownscale(res, conv, aligned, SR_DOWNSCALE_THREE_QUARTERS, cpu);
+                    for (const SRBenchFlag &flag : swsFlags) {
+                        benchSws(res, conv, aligned, false, flag, cpu);
+                        benchSws(res, conv, aligned, true, flag, cpu);
+                    }
+                }
+            }
+        }
+    }
+    av_force_cpu_flags(-1);
+    printf("\n");
+    return 0;
+}
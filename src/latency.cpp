@@ -0,0 +1,461 @@
+//
+// End-to-end latency: a helper window shows the wall clock as a block code, a recorder records the window and the
+// code is read back from the encoded frames as they are muxed (glass to file) and from the live stream as it is
+// received (glass to network). Linux (X11) only.
+//
+// usage: latency [-seconds N] [-fps N] [-display :0.0] [-offset x,y] [-live] [-stream url [-receive url]]
+//                [-csv file] out.mp4
+// e.g. latency -stream udp://127.0.0.1:5000 out.mp4: the stream is read back on the url it is sent to,
+// -receive takes another one (srt://:port?mode=listener for an srt:// caller)
+//
+// The glass time is the one of the X requests drawing the code: the scan-out of the compositor and of the display
+// comes on top, only a camera or a photodiode in front of the screen sees it.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ScreenRecorder.h"
+#include "SRScaler.h"
+
+#include <X11/Xlib.h>
+
+extern "C"
+{
+#include "libavutil/crc.h"
+#include "libavutil/time.h"
+}
+
+#define LATENCY_SECONDS 10
+#define LATENCY_FPS 30
+#define LATENCY_BLOCK 16    //px of a bit of the code: a block keeps its level through 4:2:0 and a coarse quantizer
+#define LATENCY_COLUMNS 20  //blocks of a row of the pattern
+#define LATENCY_TIME_BITS 32    //time in LATENCY_TICK us units, it wraps in 4.9 days
+#define LATENCY_CRC_BITS 8  //CRC-8 of the time: a frame caught in the middle of a redraw is left out
+#define LATENCY_BITS (LATENCY_TIME_BITS + LATENCY_CRC_BITS)
+#define LATENCY_ROWS ((LATENCY_BITS + LATENCY_COLUMNS - 1) / LATENCY_COLUMNS)
+#define LATENCY_TICK 100    //us of a unit of the drawn time
+#define LATENCY_REDRAW 1000     //us between two codes: below a frame interval, a frame shows a code at most that old
+#define LATENCY_QUEUE 256   //packets waiting for a decoder, older ones are left out
+
+namespace {
+
+std::atomic<bool> stopping(false);
+
+/* the code of a time: LATENCY_TIME_BITS of it, then the CRC of those 4 bytes */
+uint64_t encodeTime(int64_t us) {
+    uint32_t ticks = (uint32_t) (us / LATENCY_TICK);
+    uint8_t bytes[4] = {(uint8_t) (ticks >> 24), (uint8_t) (ticks >> 16), (uint8_t) (ticks >> 8), (uint8_t) ticks};
+    uint32_t crc = av_crc(av_crc_get_table(AV_CRC_8_ATM), 0, bytes, sizeof(bytes));
+    return (uint64_t) ticks << LATENCY_CRC_BITS | (crc & 0xff);
+}
+
+/* the wall time of a code read back at now, -1 if its CRC does not match */
+int64_t decodeTime(uint64_t code, int64_t now) {
+    uint32_t ticks = (uint32_t) (code >> LATENCY_CRC_BITS);
+    if (encodeTime((int64_t) ticks * LATENCY_TICK) != code)
+        return -1;
+    //the ticks of now minus the wrapped difference: a code is at most a few seconds old
+    uint32_t age = (uint32_t) (now / LATENCY_TICK) - ticks;
+    return (now / LATENCY_TICK - age) * LATENCY_TICK;
+}
+
+/**
+ * TimecodeWindow keeps a borderless window on top at x,y, redrawn with the code of the time every LATENCY_REDRAW us
+ * by a thread of its own, on a connection of its own
+ */
+class TimecodeWindow {
+
+private:
+    Display *display;
+    Window window;
+    GC gc;
+    std::thread drawer;
+
+    void run() {
+        std::vector<XRectangle> ones, zeros;
+        unsigned long white = WhitePixel(display, DefaultScreen(display));
+        unsigned long black = BlackPixel(display, DefaultScreen(display));
+        while (!stopping) {
+            //the time of the requests, as close to the glass as the tool gets
+            int64_t now = av_gettime();
+            uint64_t code = encodeTime(now);
+            ones.clear();
+            zeros.clear();
+            for (int bit = 0; bit < LATENCY_BITS; bit++) {
+                XRectangle r = {(short) (bit % LATENCY_COLUMNS * LATENCY_BLOCK), (short) (bit / LATENCY_COLUMNS * LATENCY_BLOCK),
+                                LATENCY_BLOCK, LATENCY_BLOCK};
+                (code >> (LATENCY_BITS - 1 - bit) & 1 ? ones : zeros).push_back(r);
+            }
+            XSetForeground(display, gc, white);
+            XFillRectangles(display, window, gc, ones.data(), (int) ones.size());
+            XSetForeground(display, gc, black);
+            XFillRectangles(display, window, gc, zeros.data(), (int) zeros.size());
+            XSync(display, False);
+            int64_t next = now + LATENCY_REDRAW - av_gettime();
+            if (next > 0)
+                av_usleep((unsigned) next);
+        }
+    }
+
+public:
+    TimecodeWindow(): display(nullptr), window(0), gc(nullptr) {}
+
+    ~TimecodeWindow() {
+        if (drawer.joinable())
+            drawer.join();
+        if (gc)
+            XFreeGC(display, gc);
+        if (window)
+            XDestroyWindow(display, window);
+        if (display)
+            XCloseDisplay(display);
+    }
+
+    bool open(const char *name, int x, int y) {
+        if (!(display = XOpenDisplay(name)))
+            return false;
+        int screen = DefaultScreen(display);
+        window = XCreateSimpleWindow(display, RootWindow(display, screen), x, y, width(), height(), 0,
+                                     BlackPixel(display, screen), BlackPixel(display, screen));
+        //no window manager places it elsewhere, nor draws it a frame
+        XSetWindowAttributes attributes;
+        attributes.override_redirect = True;
+        XChangeWindowAttributes(display, window, CWOverrideRedirect, &attributes);
+        XMapRaised(display, window);
+        gc = XCreateGC(display, window, 0, nullptr);
+        XSync(display, False);
+        drawer = std::thread(&TimecodeWindow::run, this);
+        return true;
+    }
+
+    static int width() { return LATENCY_COLUMNS * LATENCY_BLOCK; }
+    static int height() { return LATENCY_ROWS * LATENCY_BLOCK; }
+};
+
+/**
+ * TimecodeReader decodes the packets of one path, file or network, on a thread of its own and reads the code back
+ * from each frame: the latency of a frame is the time its packet arrived minus the time drawn in it
+ */
+class TimecodeReader {
+
+private:
+    const char *path;
+    AVCodecContext *decoder;
+    SRScaler scaler;
+    AVFrame *frame, *gray;
+    std::map<int64_t, int64_t> arrivals;    //pts of the packets, the time they arrived
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<std::pair<AVPacket *, int64_t>> queue;
+    bool closing;
+    std::thread thread;
+
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            ready.wait(guard, [this]() { return closing || !queue.empty(); });
+            if (queue.empty())
+                break;
+            std::pair<AVPacket *, int64_t> next = queue.front();
+            queue.pop_front();
+            guard.unlock();
+            decode(next.first, next.second);
+            av_packet_free(&next.first);
+            guard.lock();
+        }
+        guard.unlock();
+        decode(nullptr, 0);
+    }
+
+    void decode(AVPacket *pkt, int64_t arrival) {
+        if (pkt) {
+            arrivals[pkt->pts] = arrival;
+            //the decoder answers the packets of a missed keyframe with errors: they are counted as unread frames
+            if (avcodec_send_packet(decoder, pkt) < 0) {
+                unreadable++;
+                return;
+            }
+        } else {
+            avcodec_send_packet(decoder, nullptr);
+        }
+        while (avcodec_receive_frame(decoder, frame) >= 0) {
+            std::map<int64_t, int64_t>::iterator it = arrivals.find(frame->pts);
+            if (it != arrivals.end()) {
+                read(it->second);
+                arrivals.erase(arrivals.begin(), ++it);
+            }
+            av_frame_unref(frame);
+        }
+    }
+
+    void read(int64_t arrival) {
+        if (frame->width < TimecodeWindow::width() || frame->height < TimecodeWindow::height() ||
+            scaler.configure(frame->width, frame->height, (enum AVPixelFormat) frame->format, frame->width,
+                             frame->height, AV_PIX_FMT_GRAY8, SWS_POINT, 1) < 0) {
+            unreadable++;
+            return;
+        }
+        if (!gray->buf[0]) {
+            gray->format = AV_PIX_FMT_GRAY8;
+            gray->width = frame->width;
+            gray->height = frame->height;
+            if (av_frame_get_buffer(gray, 0) < 0) {
+                unreadable++;
+                return;
+            }
+        }
+        scaler.scale(frame, gray);
+        //the middle of each block, away from the ringing of its edges
+        uint64_t code = 0;
+        for (int bit = 0; bit < LATENCY_BITS; bit++) {
+            int x = bit % LATENCY_COLUMNS * LATENCY_BLOCK + LATENCY_BLOCK / 4;
+            int y = bit / LATENCY_COLUMNS * LATENCY_BLOCK + LATENCY_BLOCK / 4;
+            int sum = 0;
+            for (int row = 0; row < LATENCY_BLOCK / 2; row++)
+                for (int col = 0; col < LATENCY_BLOCK / 2; col++)
+                    sum += gray->data[0][(y + row) * gray->linesize[0] + x + col];
+            code = code << 1 | (sum > 128 * (LATENCY_BLOCK / 2) * (LATENCY_BLOCK / 2));
+        }
+        int64_t drawn = decodeTime(code, arrival);
+        if (drawn < 0) {
+            unreadable++;
+            return;
+        }
+        latencies.push_back(arrival - drawn);
+        drawnTimes.push_back(drawn);
+    }
+
+public:
+    std::vector<int64_t> latencies, drawnTimes;     //of the frames read in order, us
+    uint64_t unreadable, dropped;
+
+    explicit TimecodeReader(const char *name): path(name), decoder(nullptr), frame(av_frame_alloc()),
+                                               gray(av_frame_alloc()), closing(false), unreadable(0), dropped(0) {}
+
+    ~TimecodeReader() {
+        close();
+        for (std::pair<AVPacket *, int64_t> &next : queue)
+            av_packet_free(&next.first);
+        avcodec_free_context(&decoder);
+        av_frame_free(&frame);
+        av_frame_free(&gray);
+    }
+
+    /**
+     * open() starts the decoder of the stream the packets come from, one thread: the frames come out in the order
+     * of their packets and the toll of the decode is not in the latency
+     */
+    int open(const AVCodecParameters *par, AVRational timeBase) {
+        const AVCodec *codec = avcodec_find_decoder(par->codec_id);
+        if (!codec || !(decoder = avcodec_alloc_context3(codec)))
+            return AVERROR_DECODER_NOT_FOUND;
+        int ret = avcodec_parameters_to_context(decoder, par);
+        decoder->pkt_timebase = timeBase;
+        decoder->thread_count = 1;
+        if (ret < 0 || (ret = avcodec_open2(decoder, codec, nullptr)) < 0)
+            return ret;
+        thread = std::thread(&TimecodeReader::run, this);
+        return 0;
+    }
+
+    bool opened() const { return decoder != nullptr; }
+
+    /**
+     * push() queues a reference of pkt, arrived at arrival; from the thread of the muxer or of the receiver
+     */
+    void push(const AVPacket *pkt, int64_t arrival) {
+        AVPacket *ref = av_packet_clone(pkt);
+        if (!ref)
+            return;
+        std::lock_guard<std::mutex> guard(lock);
+        if (queue.size() >= LATENCY_QUEUE) {
+            av_packet_free(&queue.front().first);
+            queue.pop_front();
+            dropped++;
+        }
+        queue.emplace_back(ref, arrival);
+        ready.notify_one();
+    }
+
+    /**
+     * close() decodes what is queued and stops the thread
+     */
+    void close() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            closing = true;
+        }
+        ready.notify_one();
+        if (thread.joinable())
+            thread.join();
+    }
+
+    void print() const {
+        if (latencies.empty()) {
+            printf("\n%-8s no frame read back (%llu unreadable)", path, (unsigned long long) unreadable);
+            return;
+        }
+        std::vector<int64_t> sorted(latencies);
+        std::sort(sorted.begin(), sorted.end());
+        int64_t sum = 0;
+        for (int64_t latency : sorted)
+            sum += latency;
+        size_t n = sorted.size();
+        printf("\n%-8s %6zu frames | mean %7.1f ms min %7.1f p50 %7.1f p90 %7.1f p99 %7.1f max %7.1f | %llu unreadable,"
+               " %llu left out", path, n, sum / 1000.0 / n, sorted[0] / 1000.0, sorted[n / 2] / 1000.0,
+               sorted[n * 9 / 10] / 1000.0, sorted[FFMIN(n * 99 / 100, n - 1)] / 1000.0, sorted[n - 1] / 1000.0,
+               (unsigned long long) unreadable, (unsigned long long) dropped);
+    }
+};
+
+int interrupted(void *) {
+    return stopping.load();
+}
+
+/**
+ * receive() reads the live stream back until stopping, stamping each packet as av_read_frame() returns it
+ */
+void receive(const char *url, TimecodeReader *reader) {
+    AVFormatContext *input = avformat_alloc_context();
+    input->interrupt_callback.callback = interrupted;
+    //no probing: the packets held by avformat_find_stream_info() would arrive late
+    input->flags |= AVFMT_FLAG_NOBUFFER;
+    int ret = avformat_open_input(&input, url, nullptr, nullptr);
+    if (ret < 0) {
+        fprintf(stderr, "cannot read the stream back from %s: %d\n", url, ret);
+        return;
+    }
+    AVPacket *pkt = av_packet_alloc();
+    while (pkt && !stopping && (ret = av_read_frame(input, pkt)) >= 0) {
+        int64_t arrival = av_gettime();
+        AVStream *stream = input->streams[pkt->stream_index];
+        if (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (!reader->opened() && reader->open(stream->codecpar, stream->time_base) < 0) {
+                fprintf(stderr, "no decoder for the stream of %s\n", url);
+                break;
+            }
+            reader->push(pkt, arrival);
+        }
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    avformat_close_input(&input);
+}
+
+}
+
+int main(int argc, char **argv) {
+    int seconds = LATENCY_SECONDS, fps = LATENCY_FPS, x = 0, y = 0, i = 1;
+    const char *display = ":0.0", *stream = nullptr, *receiveUrl = nullptr, *csv = nullptr;
+    bool valid = true, live = false;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (!strcmp(argv[i], "-live")) {
+            live = true;
+            i--;
+        } else if (!strcmp(argv[i], "-seconds"))
+            seconds = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-fps"))
+            fps = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-display"))
+            display = argv[i + 1];
+        else if (!strcmp(argv[i], "-offset"))
+            valid = sscanf(argv[i + 1], "%d,%d", &x, &y) == 2;
+        else if (!strcmp(argv[i], "-stream"))
+            stream = argv[i + 1];
+        else if (!strcmp(argv[i], "-receive"))
+            receiveUrl = argv[i + 1];
+        else if (!strcmp(argv[i], "-csv"))
+            csv = argv[i + 1];
+        else
+            valid = false;
+        if (!valid)
+            break;
+    }
+    if (!valid || i + 1 != argc || seconds <= 0 || fps <= 0) {
+        fprintf(stderr, "usage: %s [-seconds N] [-fps N] [-display :0.0] [-offset x,y] [-live] [-stream url "
+                        "[-receive url]] [-csv file] out.mp4\n", argv[0]);
+        return 2;
+    }
+    avformat_network_init();
+
+    TimecodeWindow window;
+    if (!window.open(display, x, y)) {
+        fprintf(stderr, "cannot open the display %s\n", display);
+        return 1;
+    }
+    TimecodeReader file("file"), network("network");
+    std::thread receiver;
+    if (stream)
+        receiver = std::thread(receive, receiveUrl ? receiveUrl : stream, &network);
+    {
+        ScreenRecorder sc;
+        sc.settings.filename = argv[i];
+        sc.settings._recvideo = true;
+        sc.settings._recaudio = false;
+        sc.settings._fps = fps;
+        sc.settings._screenoffset = {x, y};
+        sc.settings._inscreenres = {TimecodeWindow::width(), TimecodeWindow::height()};
+        sc.settings._outscreenres = sc.settings._inscreenres;
+        sc.settings.videourl = (char *) display;
+        //the pointer over the pattern would flip its bits
+        sc.settings._drawcursor = false;
+        sc.settings.videooptions = (char *) "draw_mouse=0";
+        if (live)
+            sc.settings._profile = SR_PROFILE_LIVE;
+        if (stream)
+            sc.settings.streamurl = (char *) stream;
+        sc.onVideoPacket([&file](const AVPacket *pkt, const AVStream *st) {
+            //the arrival in the file is when the muxer gets the packet: the write follows at once
+            int64_t arrival = av_gettime();
+            if (!file.opened() && file.open(st->codecpar, st->time_base) < 0)
+                return;
+            file.push(pkt, arrival);
+        });
+        sc.openVideoSource();
+        sc.initOutputFile();
+        sc.initThreads();
+        sc.startCapture();
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+        sc.endCapture();
+        sc.finishCapture();
+        //the last packets of the stream are on their way
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+    stopping = true;
+    if (receiver.joinable())
+        receiver.join();
+    file.close();
+    network.close();
+
+    file.print();
+    if (stream)
+        network.print();
+    printf("\n");
+
+    if (csv) {
+        FILE *out = fopen(csv, "w");
+        if (!out) {
+            fprintf(stderr, "cannot write %s\n", csv);
+            return 1;
+        }
+        //one line per frame read back on each path: the drawn time ties the two paths together
+        fprintf(out, "path,drawn_us,latency_us\n");
+        for (const TimecodeReader *reader : {&file, &network})
+            for (size_t n = 0; n < reader->latencies.size(); n++)
+                fprintf(out, "%s,%lld,%lld\n", reader == &file ? "file" : "network",
+                        (long long) reader->drawnTimes[n], (long long) reader->latencies[n]);
+        fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,109 @@
+//
+// Tile client: captures the screen and sends its changed tiles to an encode node, a recorder started with
+// settings.tilesource on the same url; nothing is scaled nor encoded here. Linux (X11) only.
+//
+// usage: tileclient [-fps N] [-display :0.0] [-offset x,y] -size WxH tcp://node:port
+//
+
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "SRFrameClock.h"
+#include "SRTileLink.h"
+#include "SRX11Grabber.h"
+
+extern "C"
+{
+#include "libavutil/time.h"
+}
+
+#define TILE_CLIENT_FPS 30
+
+static std::atomic<bool> stopping(false);
+
+static void stop(int) {
+    stopping = true;
+}
+
+int main(int argc, char **argv) {
+    int fps = TILE_CLIENT_FPS, x = 0, y = 0, width = 0, height = 0, i = 1;
+    const char *display = ":0.0";
+    bool valid = true;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (!strcmp(argv[i], "-fps"))
+            fps = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-display"))
+            display = argv[i + 1];
+        else if (!strcmp(argv[i], "-offset"))
+            valid = sscanf(argv[i + 1], "%d,%d", &x, &y) == 2;
+        else if (!strcmp(argv[i], "-size"))
+            valid = sscanf(argv[i + 1], "%dx%d", &width, &height) == 2;
+        else
+            valid = false;
+        if (!valid)
+            break;
+    }
+    //the encoders of the node want even sizes
+    width &= ~1;
+    height &= ~1;
+    if (!valid || i + 1 != argc || fps <= 0 || width <= 0 || height <= 0) {
+        fprintf(stderr, "usage: %s [-fps N] [-display :0.0] [-offset x,y] -size WxH tcp://node:port\n", argv[0]);
+        return 2;
+    }
+    avformat_network_init();
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    SRX11Grabber grabber(true);
+    if (grabber.open(display, x, y, width, height) < 0) {
+        fprintf(stderr, "cannot capture %dx%d+%d,%d of %s\n", width, height, x, y, display);
+        return 1;
+    }
+    SRTileSender sender(argv[i]);
+    //last is the latest picture, sent whole to a node that just connected even if the screen stays still
+    AVFrame *frame = av_frame_alloc(), *last = av_frame_alloc();
+    SRFrameClock clock;
+    clock.start(1000000 / fps);
+    bool connected = false;
+    int64_t retryAt = 0;
+    while (!stopping) {
+        clock.wait();
+        //the grabber hands out its own images, SR_GRAB_UNCHANGED leaves frame untouched
+        int ret = grabber.grab(frame);
+        if (ret < 0) {
+            fprintf(stderr, "cannot grab from %s: %d\n", display, ret);
+            break;
+        }
+        bool changed = ret == 0;
+        if (changed) {
+            av_frame_unref(last);
+            av_frame_move_ref(last, frame);
+        }
+        if (!connected) {
+            if (!last->buf[0] || av_gettime_relative() < retryAt)
+                continue;
+            if (!(connected = sender.open(grabber.pixelFormat(), width, height) >= 0)) {
+                retryAt = av_gettime_relative() + TILE_LINK_RECONNECT * 1000LL;
+                continue;
+            }
+            changed = true;
+        }
+        if (changed && sender.send(last) < 0) {
+            connected = false;
+            retryAt = av_gettime_relative() + TILE_LINK_RECONNECT * 1000LL;
+        }
+    }
+    sender.close();
+    av_frame_free(&frame);
+    av_frame_free(&last);
+
+    SRTileLinkStats stats = sender.stats();
+    SRClockStats ticks = clock.stats();
+    printf("\n%llu updates, %llu tiles, %lld KiB sent, %llu frames unchanged, %llu connections, %llu missed deadlines\n",
+           (unsigned long long) stats.updates, (unsigned long long) stats.tiles, (long long) (stats.bytes / 1024),
+           (unsigned long long) stats.unchanged, (unsigned long long) stats.connections,
+           (unsigned long long) ticks.missed);
+    return 0;
+}